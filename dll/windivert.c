@@ -138,6 +138,9 @@ typedef enum
     FILTER_TOKEN_TCP_DST_PORT,
     FILTER_TOKEN_TCP_FIN,
     FILTER_TOKEN_TCP_HDR_LENGTH,
+    FILTER_TOKEN_TCP_PAYLOAD,
+    FILTER_TOKEN_TCP_PAYLOAD16,
+    FILTER_TOKEN_TCP_PAYLOAD32,
     FILTER_TOKEN_TCP_PAYLOAD_LENGTH,
     FILTER_TOKEN_TCP_PSH,
     FILTER_TOKEN_TCP_RST,
@@ -151,6 +154,9 @@ typedef enum
     FILTER_TOKEN_UDP_CHECKSUM,
     FILTER_TOKEN_UDP_DST_PORT,
     FILTER_TOKEN_UDP_LENGTH,
+    FILTER_TOKEN_UDP_PAYLOAD,
+    FILTER_TOKEN_UDP_PAYLOAD16,
+    FILTER_TOKEN_UDP_PAYLOAD32,
     FILTER_TOKEN_UDP_PAYLOAD_LENGTH,
     FILTER_TOKEN_UDP_SRC_PORT,
     FILTER_TOKEN_TRUE,
@@ -167,10 +173,13 @@ typedef enum
     FILTER_TOKEN_LEQ,
     FILTER_TOKEN_GT,
     FILTER_TOKEN_GEQ,
+    FILTER_TOKEN_CONTAINS,
     FILTER_TOKEN_NOT,
     FILTER_TOKEN_AND,
     FILTER_TOKEN_OR,
     FILTER_TOKEN_NUMBER,
+    FILTER_TOKEN_STRING,
+    FILTER_TOKEN_STRINGS,
     FILTER_TOKEN_END,
 } FILTER_TOKEN_KIND;
 
@@ -178,6 +187,8 @@ typedef struct
 {
     FILTER_TOKEN_KIND kind;
     UINT32 val[4];
+    const char *str;                            // String (unescaped)
+    UINT len;                                   // String length
 } FILTER_TOKEN;
 
 #define FILTER_TOKEN_MAXLEN             32      // Fits longest IPv6
@@ -188,6 +199,24 @@ typedef struct
     FILTER_TOKEN_KIND kind;
 } FILTER_TOKEN_NAME, *PFILTER_TOKEN_NAME;
 
+/*
+ * Compiled filter object (see WinDivertFilterCompile).  The header is
+ * followed by the IOCTL_WINDIVERT_START_FILTER buffer, i.e. the filter
+ * program and its automata.
+ */
+#define WINDIVERT_FILTER_OBJECT_MAGIC   0x4F464457
+
+#pragma pack(push, 1)
+typedef struct
+{
+    UINT32 magic;                               // Object magic
+    UINT8  version;                             // WINDIVERT_IOCTL_VERSION
+    UINT8  layer;                               // Filter layer
+    UINT16 filter_len;                          // Filter program length
+    UINT32 automata_len;                        // Automata length (bytes)
+} WINDIVERT_FILTER_OBJECT, *PWINDIVERT_FILTER_OBJECT;
+#pragma pack(pop)
+
 /*
  * IPv4/IPv6 pseudo headers.
  */
@@ -205,8 +234,8 @@ typedef struct
     UINT32 SrcAddr[4];
     UINT32 DstAddr[4];
     UINT32 Length;
-    UINT32 NextHdr:8;
     UINT32 Zero:24;
+    UINT32 NextHdr:8;
 } WINDIVERT_PSEUDOV6HDR, *PWINDIVERT_PSEUDOV6HDR;
 
 /*
@@ -223,6 +252,83 @@ typedef struct
 #define IPPROTO_UDP     17
 #define IPPROTO_ICMPV6  58
 
+/*
+ * Filter interpreter (shared with the driver).
+ */
+typedef struct
+{
+    UINT8 *data;                                // Packet data
+    size_t len;                                 // Packet length
+} WINDIVERT_PACKET, *PWINDIVERT_PACKET;
+typedef PWINDIVERT_PACKET windivert_packet_t;
+#define DEBUG(format, ...)
+#include "windivert_shared.c"
+
+/*
+ * Loaded filter (see WinDivertHelperFilterOpen).
+ */
+#define WINDIVERT_FILTER_MAGIC          0x544C4946
+
+typedef struct
+{
+    UINT32 magic;                               // WINDIVERT_FILTER_MAGIC
+    filter_t filter;                            // Filter program
+} WINDIVERT_FILTER, *PWINDIVERT_FILTER;
+
+/*
+ * Multi-filter classifier.  Each rule is indexed by a "key" field that the
+ * rule requires to equal one of a small set of values (e.g. tcp.DstPort ==
+ * 80).  Only rules whose key matches the packet (plus the rules without a
+ * key) are evaluated, in rule order.
+ */
+#define WINDIVERT_CLASSIFIER_MAGIC      0x53534C43
+
+static const UINT8 windivert_classifier_keys[] =
+{
+    // In order of preference:
+    WINDIVERT_FILTER_FIELD_TCP_DSTPORT,
+    WINDIVERT_FILTER_FIELD_UDP_DSTPORT,
+    WINDIVERT_FILTER_FIELD_TCP_SRCPORT,
+    WINDIVERT_FILTER_FIELD_UDP_SRCPORT,
+    WINDIVERT_FILTER_FIELD_IP_DSTADDR,
+    WINDIVERT_FILTER_FIELD_IP_SRCADDR,
+    WINDIVERT_FILTER_FIELD_ICMP_TYPE,
+    WINDIVERT_FILTER_FIELD_ICMPV6_TYPE,
+    WINDIVERT_FILTER_FIELD_IP_PROTOCOL,
+    WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR,
+};
+#define WINDIVERT_CLASSIFIER_KEYS       \
+    (sizeof(windivert_classifier_keys) / sizeof(windivert_classifier_keys[0]))
+
+typedef struct
+{
+    UINT32 value;                           // Key value
+    UINT32 num_rules;                       // Number of rules (0 = empty)
+    UINT32 *rules;                          // Rules (in order)
+} WINDIVERT_CLASSIFIER_BUCKET, *PWINDIVERT_CLASSIFIER_BUCKET;
+
+typedef struct
+{
+    UINT32 magic;                           // WINDIVERT_CLASSIFIER_MAGIC
+    UINT num_rules;                         // Number of rules
+    filter_t *rules;                        // Rule filters
+    UINT8 depth;                            // Header depth of all rules
+    UINT32 *rule_ids;                       // Bucket rule lists
+    UINT num_wild;                          // Number of rules without a key
+    UINT32 *wild;                           // Rules without a key
+    UINT32 masks[WINDIVERT_CLASSIFIER_KEYS];
+                                            // Hash table sizes - 1
+    PWINDIVERT_CLASSIFIER_BUCKET tables[WINDIVERT_CLASSIFIER_KEYS];
+                                            // Hash tables (or NULL)
+} WINDIVERT_CLASSIFIER, *PWINDIVERT_CLASSIFIER;
+
+typedef struct
+{
+    UINT32 key;                             // Key index
+    UINT32 value;                           // Key value
+    UINT32 rule;                            // Rule
+} WINDIVERT_CLASSIFIER_ENTRY, *PWINDIVERT_CLASSIFIER_ENTRY;
+
 /*
  * Driver installed?
  */
@@ -240,22 +346,55 @@ static BOOL WinDivertIoControl(HANDLE handle, DWORD code, UINT8 arg8,
     UINT64 arg, PVOID buf, UINT len, UINT *iolen);
 static BOOL WinDivertIoControlEx(HANDLE handle, DWORD code, UINT8 arg8,
     UINT64 arg, PVOID buf, UINT len, UINT *iolen, LPOVERLAPPED overlapped);
+static HANDLE WinDivertDeviceOpen(VOID);
+static DWORD WINAPI WinDivertPumpThread(LPVOID arg);
+static BOOL WinDivertStart(HANDLE handle,
+    const WINDIVERT_FILTER_OBJECT *object, UINT object_len, INT16 priority,
+    UINT64 flags);
 static BOOL WinDivertCompileFilter(const char *filter_str,
-    WINDIVERT_LAYER layer, windivert_ioctl_filter_t filter, UINT16 *fp);
+    WINDIVERT_LAYER layer, windivert_ioctl_filter_t filter, UINT16 *fp,
+    UINT8 **automata_ptr, UINT *automata_len_ptr);
+static PWINDIVERT_FILTER_OBJECT WinDivertCompileFilterObject(
+    const char *filter_str, WINDIVERT_LAYER layer, UINT *object_len_ptr);
+static BOOL WinDivertCheckFilterObject(const WINDIVERT_FILTER_OBJECT *object,
+    UINT object_len);
+static filter_t WinDivertLoadFilter(const WINDIVERT_FILTER_OBJECT *object);
 static int __cdecl WinDivertFilterTokenNameCompare(const void *a,
     const void *b);
 static BOOL WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
     FILTER_TOKEN *tokens, UINT tokensmax);
+static BOOL WinDivertTokenizeIndex(const char *filter, UINT *i,
+    FILTER_TOKEN_KIND kind, UINT32 *val);
+static BOOL WinDivertTokenizeString(const char *filter, UINT *i,
+    FILTER_TOKEN *token);
+static BOOL WinDivertTokenizeStrings(const char *filter, UINT *i,
+    FILTER_TOKEN *token);
+static UINT WinDivertDecodeString(const char *str, UINT len, UINT8 *buf,
+    UINT buflen);
 static BOOL WinDivertParseFilter(FILTER_TOKEN *tokens, UINT16 *tp,
     windivert_ioctl_filter_t filter, UINT16 *fp, FILTER_TOKEN_KIND op);
 static void WinDivertFilterUpdate(windivert_ioctl_filter_t filter, UINT16 s,
     UINT16 e, UINT16 success, UINT16 failure);
+static BOOL WinDivertCompileAutomaton(const FILTER_TOKEN *token,
+    UINT8 **automata_ptr, UINT *automata_len_ptr);
+static BOOL WinDivertNextPattern(const FILTER_TOKEN *token, UINT *i,
+    FILTER_TOKEN *pattern);
 static void WinDivertInitPseudoHeader(PWINDIVERT_IPHDR ip_header,
     PWINDIVERT_PSEUDOHDR pseudo_header, UINT8 protocol, UINT len);
 static void WinDivertInitPseudoHeaderV6(PWINDIVERT_IPV6HDR ipv6_header,
     PWINDIVERT_PSEUDOV6HDR pseudov6_header, UINT8 protocol, UINT len);
 static UINT16 WinDivertHelperCalcChecksum(PVOID pseudo_header,
     UINT16 pseudo_header_len, PVOID data, UINT len);
+static void WinDivertClassifierFree(PWINDIVERT_CLASSIFIER classifier);
+static BOOL WinDivertClassifierKey(filter_t filter, UINT *key_ptr,
+    UINT32 *values, UINT *num_values_ptr);
+static BOOL WinDivertClassifierReach(filter_t filter, UINT16 ip, UINT8 field,
+    UINT8 *reach);
+static BOOL WinDivertClassifierValue(windivert_headers_t headers, UINT8 field,
+    UINT32 *value);
+static UINT32 WinDivertClassifierHash(UINT32 value);
+static int __cdecl WinDivertClassifierEntryCompare(const void *a,
+    const void *b);
 
 #ifdef WINDIVERT_DEBUG
 static void WinDivertFilterDump(windivert_ioctl_filter_t filter, UINT16 len);
@@ -714,9 +853,12 @@ static BOOL WinDivertIoControl(HANDLE handle, DWORD code, UINT8 arg8,
         TlsSetValue(windivert_tls_idx, (LPVOID)event);
     }
 
+    // Setting the low bit of the event stops the completion being queued to
+    // an I/O completion port that the handle may be bound to (see
+    // WinDivertPumpCreate()).
     overlapped.Offset     = 0;
     overlapped.OffsetHigh = 0;
-    overlapped.hEvent     = event;
+    overlapped.hEvent     = (HANDLE)((UINT_PTR)event | 1);
     if (!WinDivertIoControlEx(handle, code, arg8, arg, buf, len, iolen,
             &overlapped))
     {
@@ -762,11 +904,9 @@ static BOOL WinDivertIoControlEx(HANDLE handle, DWORD code, UINT8 arg8,
 extern HANDLE WinDivertOpen(const char *filter, WINDIVERT_LAYER layer,
     INT16 priority, UINT64 flags)
 {
-    struct windivert_ioctl_filter_s ioctl_filter[WINDIVERT_FILTER_MAXLEN];
-    UINT16 filter_len;
-    DWORD err;
+    PWINDIVERT_FILTER_OBJECT object;
+    UINT object_len;
     HANDLE handle;
-    UINT32 priority32;
 
     // Parameter checking.
     if (!WINDIVERT_FLAGS_VALID(flags) || layer > WINDIVERT_LAYER_MAX)
@@ -776,15 +916,60 @@ extern HANDLE WinDivertOpen(const char *filter, WINDIVERT_LAYER layer,
     }
 
     // Parse the filter:
-    if (!WinDivertCompileFilter(filter, layer, ioctl_filter, &filter_len))
+    object = WinDivertCompileFilterObject(filter, layer, &object_len);
+    if (object == NULL)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    handle = WinDivertOpenCompiled(object, object_len, priority, flags);
+    free(object);
+    return handle;
+}
+
+/*
+ * Open a WinDivert handle from a compiled filter object.
+ */
+extern HANDLE WinDivertOpenCompiled(const VOID *pObject, UINT objectLen,
+    INT16 priority, UINT64 flags)
+{
+    const WINDIVERT_FILTER_OBJECT *object =
+        (const WINDIVERT_FILTER_OBJECT *)pObject;
+    DWORD err;
+    HANDLE handle;
+
+    // Parameter checking.
+    if (!WINDIVERT_FLAGS_VALID(flags) ||
+        !WinDivertCheckFilterObject(object, objectLen))
     {
         SetLastError(ERROR_INVALID_PARAMETER);
         return INVALID_HANDLE_VALUE;
     }
 
-#ifdef WINDIVERT_DEBUG
-    WinDivertFilterDump(ioctl_filter, filter_len);
-#endif
+    handle = WinDivertDeviceOpen();
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+    if (!WinDivertStart(handle, object, objectLen, priority, flags))
+    {
+        err = GetLastError();
+        CloseHandle(handle);
+        SetLastError(err);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // Success!
+    return handle;
+}
+
+/*
+ * Open the WinDivert device (installing the driver if necessary).
+ */
+static HANDLE WinDivertDeviceOpen(VOID)
+{
+    DWORD err;
+    HANDLE handle;
 
     // Attempt to open the WinDivert device:
     handle = CreateFile(L"\\\\.\\" WINDIVERT_DEVICE_NAME,
@@ -821,52 +1006,73 @@ extern HANDLE WinDivertOpen(const char *filter, WINDIVERT_LAYER layer,
     {
         installed = TRUE;
     }
+    return handle;
+}
 
-    // Set the layer:
-    if (layer != WINDIVERT_LAYER_DEFAULT)
-    {
-        if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_LAYER, 0,
-                (UINT64)layer, NULL, 0, NULL))
-        {
-            CloseHandle(handle);
-            return INVALID_HANDLE_VALUE;
-        }
-    }
+/*
+ * Start a (checked) filter object on an idle WinDivert handle.
+ */
+static BOOL WinDivertStart(HANDLE handle,
+    const WINDIVERT_FILTER_OBJECT *object, UINT object_len, INT16 priority,
+    UINT64 flags)
+{
+    struct windivert_ioctl_open_s *ioctl_open;
+    UINT filter_len, open_len;
+    BOOL result;
 
-    // Set the flags:
-    if (flags != 0)
+    // Set the layer, flags and priority, and start the filter, all with a
+    // single request:
+    filter_len = object_len - sizeof(WINDIVERT_FILTER_OBJECT);
+    open_len = sizeof(struct windivert_ioctl_open_s) + filter_len;
+    ioctl_open = (struct windivert_ioctl_open_s *)malloc(open_len);
+    if (ioctl_open == NULL)
     {
-        if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_FLAGS, 0,
-                (UINT64)flags, NULL, 0, NULL))
-        {
-            CloseHandle(handle);
-            return INVALID_HANDLE_VALUE;
-        }
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
     }
+    ioctl_open->version    = WINDIVERT_IOCTL_OPEN_VERSION;
+    ioctl_open->layer      = object->layer;
+    ioctl_open->filter_len = object->filter_len;
+    ioctl_open->priority   = WINDIVERT_PRIORITY(priority);
+    ioctl_open->flags      = flags;
+    ioctl_open->queue_len  = 0;
+    ioctl_open->queue_time = 0;
+    memcpy(ioctl_open + 1, object + 1, filter_len);
+    result = WinDivertIoControl(handle, IOCTL_WINDIVERT_OPEN, 0, 0,
+        ioctl_open, open_len, NULL);
+    free(ioctl_open);
+    return result;
+}
 
-    // Set the priority:
-    priority32 = WINDIVERT_PRIORITY(priority);
-    if (priority32 != WINDIVERT_PRIORITY_DEFAULT)
+/*
+ * Replace the filter of an open WinDivert handle.
+ */
+extern BOOL WinDivertSetFilter(HANDLE handle, const char *filter,
+    WINDIVERT_LAYER layer)
+{
+    PWINDIVERT_FILTER_OBJECT object;
+    UINT object_len;
+    BOOL result;
+
+    // Parameter checking.
+    if (layer > WINDIVERT_LAYER_MAX)
     {
-        if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_PRIORITY, 0,
-                (UINT64)priority32, NULL, 0, NULL))
-        {
-            CloseHandle(handle);
-            return INVALID_HANDLE_VALUE;
-        }
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
     }
 
-    // Start the filter:
-    if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_START_FILTER, 0, 0,
-            ioctl_filter, filter_len*sizeof(struct windivert_ioctl_filter_s),
-            NULL))
+    // Parse the filter:
+    object = WinDivertCompileFilterObject(filter, layer, &object_len);
+    if (object == NULL)
     {
-        CloseHandle(handle);
-        return INVALID_HANDLE_VALUE;
+        return FALSE;
     }
 
-    // Success!
-    return handle;
+    result = WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_FILTER,
+        (UINT8)layer, (UINT64)object->filter_len, object + 1,
+        object_len - sizeof(WINDIVERT_FILTER_OBJECT), NULL);
+    free(object);
+    return result;
 }
 
 /*
@@ -903,6 +1109,31 @@ extern BOOL WinDivertRecvEx(HANDLE handle, PVOID pPacket, UINT packetLen,
     }
 }
 
+/*
+ * Receive a WinDivert packet from one of the handle's queues.
+ */
+extern BOOL WinDivertRecvQueue(HANDLE handle, UINT queue, PVOID pPacket,
+    UINT packetLen, PWINDIVERT_ADDRESS addr, UINT *readlen,
+    LPOVERLAPPED overlapped)
+{
+    if (queue >= WINDIVERT_PARAM_QUEUE_COUNT_MAX)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (overlapped == NULL)
+    {
+        return WinDivertIoControl(handle, IOCTL_WINDIVERT_RECV, (UINT8)queue,
+            (UINT64)addr, pPacket, packetLen, readlen);
+    }
+    else
+    {
+        return WinDivertIoControlEx(handle, IOCTL_WINDIVERT_RECV,
+            (UINT8)queue, (UINT64)addr, pPacket, packetLen, readlen,
+            overlapped);
+    }
+}
+
 /*
  * Send a WinDivert packet.
  */
@@ -946,457 +1177,1481 @@ extern BOOL WinDivertClose(HANDLE handle)
 }
 
 /*
- * Set a WinDivert parameter.
+ * Handle pool definitions.
  */
-extern BOOL WinDivertSetParam(HANDLE handle, WINDIVERT_PARAM param,
-    UINT64 value)
+#define WINDIVERT_POOL_MAGIC                0x4C4F4F50  // "POOL"
+
+typedef struct
 {
-    switch ((int)param)
+    UINT32 magic;                           // WINDIVERT_POOL_MAGIC
+    UINT size;                              // Number of slots
+    HANDLE volatile *slots;                 // Idle handles (or NULL)
+} WINDIVERT_POOL, *PWINDIVERT_POOL;
+
+/*
+ * Create a pool of idle WinDivert handles.
+ */
+extern HANDLE WinDivertPoolCreate(UINT poolSize)
+{
+    PWINDIVERT_POOL pool;
+    HANDLE handle;
+    UINT i;
+
+    if (poolSize == 0 || poolSize > WINDIVERT_POOL_MAX_SIZE)
     {
-        case WINDIVERT_PARAM_QUEUE_LEN:
-            if (value < WINDIVERT_PARAM_QUEUE_LEN_MIN ||
-                value > WINDIVERT_PARAM_QUEUE_LEN_MAX)
-            {
-                SetLastError(ERROR_INVALID_PARAMETER);
-                return FALSE;
-            }
-            break;
-        case WINDIVERT_PARAM_QUEUE_TIME:
-            if (value < WINDIVERT_PARAM_QUEUE_TIME_MIN ||
-                value > WINDIVERT_PARAM_QUEUE_TIME_MAX)
-            {
-                SetLastError(ERROR_INVALID_PARAMETER);
-                return FALSE;
-            }
-            break;
-        default:
-            SetLastError(ERROR_INVALID_PARAMETER);
-            return FALSE;
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
     }
-    return WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_PARAM, (UINT8)param,
-        value, NULL, 0, NULL);
+    pool = (PWINDIVERT_POOL)malloc(sizeof(WINDIVERT_POOL));
+    if (pool == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    pool->slots = (HANDLE volatile *)calloc(poolSize, sizeof(HANDLE));
+    if (pool->slots == NULL)
+    {
+        free(pool);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    pool->magic = WINDIVERT_POOL_MAGIC;
+    pool->size = poolSize;
+
+    // Pay for the device open (and driver install) up-front:
+    for (i = 0; i < poolSize; i++)
+    {
+        handle = WinDivertDeviceOpen();
+        if (handle == INVALID_HANDLE_VALUE)
+        {
+            WinDivertPoolDestroy((HANDLE)pool);
+            return INVALID_HANDLE_VALUE;
+        }
+        pool->slots[i] = handle;
+    }
+
+    return (HANDLE)pool;
 }
 
 /*
- * Get a WinDivert parameter.
+ * Open a WinDivert handle, re-using an idle handle from the pool if one is
+ * available.
  */
-extern BOOL WinDivertGetParam(HANDLE handle, WINDIVERT_PARAM param,
-    UINT64 *pValue)
+extern HANDLE WinDivertPoolOpen(HANDLE poolHandle, const char *filter,
+    WINDIVERT_LAYER layer, INT16 priority, UINT64 flags)
 {
-    switch ((int)param)
+    PWINDIVERT_POOL pool = (PWINDIVERT_POOL)poolHandle;
+    PWINDIVERT_FILTER_OBJECT object;
+    UINT object_len, i;
+    DWORD err;
+    HANDLE handle = NULL;
+
+    // Parameter checking.
+    if (pool == NULL || pool == INVALID_HANDLE_VALUE ||
+        pool->magic != WINDIVERT_POOL_MAGIC ||
+        !WINDIVERT_FLAGS_VALID(flags) || layer > WINDIVERT_LAYER_MAX)
     {
-        case WINDIVERT_PARAM_QUEUE_LEN: case WINDIVERT_PARAM_QUEUE_TIME:
-            break;
-        default:
-            SetLastError(ERROR_INVALID_PARAMETER);
-            return FALSE;
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
     }
-    return WinDivertIoControl(handle, IOCTL_WINDIVERT_GET_PARAM, (UINT8)param,
-        0, pValue, sizeof(UINT64), NULL);
+
+    // Parse the filter:
+    object = WinDivertCompileFilterObject(filter, layer, &object_len);
+    if (object == NULL)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // Claim an idle handle, else fall back to opening a new one:
+    for (i = 0; i < pool->size && handle == NULL; i++)
+    {
+        handle = InterlockedExchangePointer(
+            (PVOID volatile *)&pool->slots[i], NULL);
+    }
+    if (handle == NULL)
+    {
+        handle = WinDivertDeviceOpen();
+        if (handle == INVALID_HANDLE_VALUE)
+        {
+            free(object);
+            return INVALID_HANDLE_VALUE;
+        }
+    }
+
+    if (!WinDivertStart(handle, object, object_len, priority, flags))
+    {
+        err = GetLastError();
+        free(object);
+        CloseHandle(handle);
+        SetLastError(err);
+        return INVALID_HANDLE_VALUE;
+    }
+    free(object);
+    return handle;
 }
 
 /*
- * Compile a filter.
+ * Close a WinDivert handle opened by WinDivertPoolOpen(), returning it to
+ * the pool if there is room.
  */
-static BOOL WinDivertCompileFilter(const char *filter_str,
-    WINDIVERT_LAYER layer, windivert_ioctl_filter_t filter, UINT16 *fp)
+extern BOOL WinDivertPoolClose(HANDLE poolHandle, HANDLE handle)
 {
-    FILTER_TOKEN tokens[WINDIVERT_FILTER_MAXLEN*3];
-    UINT16 tp;
+    PWINDIVERT_POOL pool = (PWINDIVERT_POOL)poolHandle;
+    UINT i;
 
-    if (!WinDivertTokenizeFilter(filter_str, layer, tokens,
-            WINDIVERT_FILTER_MAXLEN*3-1))
+    if (pool == NULL || pool == INVALID_HANDLE_VALUE ||
+        pool->magic != WINDIVERT_POOL_MAGIC)
     {
+        SetLastError(ERROR_INVALID_PARAMETER);
         return FALSE;
     }
 
-    tp = 0;
-    *fp = 0;
-    if (!WinDivertParseFilter(tokens, &tp, filter, fp, FILTER_TOKEN_AND))
+    // Stop the filter, drop queued packets and cancel pending reads.  If
+    // this fails the handle is in an unknown state, so just close it.
+    if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_RESET, 0, 0, NULL, 0,
+            NULL))
     {
-        return FALSE;
+        return CloseHandle(handle);
     }
-    if (tokens[tp].kind != FILTER_TOKEN_END)
+    for (i = 0; i < pool->size; i++)
     {
-        return FALSE;
+        if (InterlockedCompareExchangePointer(
+                (PVOID volatile *)&pool->slots[i], handle, NULL) == NULL)
+        {
+            return TRUE;
+        }
     }
-    return TRUE;
+    return CloseHandle(handle);
 }
 
 /*
- * Compare two FILTER_TOKEN_NAMEs.
+ * Destroy a handle pool, closing all idle handles.
  */
-static int __cdecl WinDivertFilterTokenNameCompare(const void *a,
-    const void *b)
+extern BOOL WinDivertPoolDestroy(HANDLE poolHandle)
 {
-    PFILTER_TOKEN_NAME na = (PFILTER_TOKEN_NAME)a;
-    PFILTER_TOKEN_NAME nb = (PFILTER_TOKEN_NAME)b;
-    return strcmp(na->name, nb->name);
+    PWINDIVERT_POOL pool = (PWINDIVERT_POOL)poolHandle;
+    HANDLE handle;
+    UINT i;
+
+    if (pool == NULL || pool == INVALID_HANDLE_VALUE ||
+        pool->magic != WINDIVERT_POOL_MAGIC)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    pool->magic = 0;
+    for (i = 0; i < pool->size; i++)
+    {
+        handle = pool->slots[i];
+        if (handle != NULL)
+        {
+            CloseHandle(handle);
+        }
+    }
+    free((PVOID)pool->slots);
+    free(pool);
+    return TRUE;
 }
 
 /*
- * Tokenize the given filter string.
+ * Packet pump definitions.
  */
-static BOOL WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
-    FILTER_TOKEN *tokens, UINT tokensmax)
+#define WINDIVERT_PUMP_MAGIC                0x504D5550  // "PUMP"
+#define WINDIVERT_PUMP_MAX_FAILURES         8           // Before retiring
+
+typedef struct
 {
-    static const FILTER_TOKEN_NAME token_names[] =
+    OVERLAPPED overlapped;                  // Must be first
+    BOOL send;                              // Send (else recv) in flight
+    UINT failures;                          // Consecutive recv failures
+    WINDIVERT_ADDRESS addr;                 // Packet address
+    UINT8 packet[WINDIVERT_PUMP_PACKET_MAX]; // Packet data
+} WINDIVERT_PUMP_BUFFER, *PWINDIVERT_PUMP_BUFFER;
+
+/*
+ * Packet pump I/O.  The pump issues its requests, and waits for their
+ * completions, through this interface, so that the pump can be driven by a
+ * simulated device.  recv() and send() return like WinDivertRecvEx() and
+ * WinDivertSendEx(), i.e. FALSE with ERROR_IO_PENDING for a request that
+ * completes later.  open() returns the completion source for the handle's
+ * requests, and wait() returns like GetQueuedCompletionStatus(), with
+ * overlapped set to NULL for each call to wake().
+ */
+typedef struct
+{
+    HANDLE (*open)(HANDLE handle, ULONG_PTR key, UINT num_threads);
+    BOOL (*recv)(HANDLE handle, PVOID packet, UINT packet_len,
+        PWINDIVERT_ADDRESS addr, LPOVERLAPPED overlapped);
+    BOOL (*send)(HANDLE handle, PVOID packet, UINT packet_len,
+        PWINDIVERT_ADDRESS addr, LPOVERLAPPED overlapped);
+    VOID (*cancel)(HANDLE handle, LPOVERLAPPED overlapped);
+    BOOL (*wait)(HANDLE port, DWORD *iolen, LPOVERLAPPED *overlapped);
+    VOID (*wake)(HANDLE port);
+    VOID (*close)(HANDLE port);
+} WINDIVERT_PUMP_IO, *PWINDIVERT_PUMP_IO;
+
+typedef struct
+{
+    UINT32 magic;                           // WINDIVERT_PUMP_MAGIC
+    const WINDIVERT_PUMP_IO *io;            // Requests and completions
+    HANDLE handle;                          // WinDivert handle
+    HANDLE port;                            // Completion source
+    WINDIVERT_PUMP_CALLBACK callback;       // Packet callback
+    WINDIVERT_PUMP_IO_CALLBACK io_callback; // Other completions (optional)
+    PVOID context;                          // Callback context
+    volatile LONG stop;                     // Stop issuing requests?
+    volatile LONG pending;                  // Buffers with I/O in flight
+    DWORD error;                            // Last request error
+    UINT num_threads;                       // Number of threads
+    HANDLE threads[WINDIVERT_PUMP_MAX_THREADS];
+    UINT num_buffers;                       // Number of buffers
+    PWINDIVERT_PUMP_BUFFER buffers;         // Buffers
+} WINDIVERT_PUMP, *PWINDIVERT_PUMP;
+
+static HANDLE WinDivertPumpStart(const WINDIVERT_PUMP_IO *io, HANDLE handle,
+    UINT num_threads, UINT depth, WINDIVERT_PUMP_CALLBACK callback,
+    WINDIVERT_PUMP_IO_CALLBACK io_callback, PVOID context);
+static VOID WinDivertPumpRecv(PWINDIVERT_PUMP pump,
+    PWINDIVERT_PUMP_BUFFER buffer);
+static VOID WinDivertPumpSend(PWINDIVERT_PUMP pump,
+    PWINDIVERT_PUMP_BUFFER buffer, UINT packet_len);
+static VOID WinDivertPumpRelease(PWINDIVERT_PUMP pump);
+static VOID WinDivertPumpFree(PWINDIVERT_PUMP pump);
+static HANDLE WinDivertPumpPortOpen(HANDLE handle, ULONG_PTR key,
+    UINT num_threads);
+static BOOL WinDivertPumpPortRecv(HANDLE handle, PVOID packet,
+    UINT packet_len, PWINDIVERT_ADDRESS addr, LPOVERLAPPED overlapped);
+static BOOL WinDivertPumpPortSend(HANDLE handle, PVOID packet,
+    UINT packet_len, PWINDIVERT_ADDRESS addr, LPOVERLAPPED overlapped);
+static VOID WinDivertPumpPortCancel(HANDLE handle, LPOVERLAPPED overlapped);
+static BOOL WinDivertPumpPortWait(HANDLE port, DWORD *iolen,
+    LPOVERLAPPED *overlapped);
+static VOID WinDivertPumpPortWake(HANDLE port);
+static VOID WinDivertPumpPortClose(HANDLE port);
+
+/*
+ * Packet pump I/O using overlapped requests and an I/O completion port.
+ */
+static const WINDIVERT_PUMP_IO windivert_pump_port_io =
+{
+    WinDivertPumpPortOpen,
+    WinDivertPumpPortRecv,
+    WinDivertPumpPortSend,
+    WinDivertPumpPortCancel,
+    WinDivertPumpPortWait,
+    WinDivertPumpPortWake,
+    WinDivertPumpPortClose
+};
+
+/*
+ * Start pumping packets from a WinDivert handle through a callback.
+ */
+extern HANDLE WinDivertPumpCreate(HANDLE handle, UINT numThreads, UINT depth,
+    WINDIVERT_PUMP_CALLBACK callback, PVOID context)
+{
+    return WinDivertPumpStart(&windivert_pump_port_io, handle, numThreads,
+        depth, callback, NULL, context);
+}
+
+/*
+ * Start pumping packets from a WinDivert handle through a callback, passing
+ * the completions of the application's own overlapped requests (on the
+ * same handle) to ioCallback.
+ */
+extern HANDLE WinDivertPumpCreateEx(HANDLE handle, UINT numThreads,
+    UINT depth, WINDIVERT_PUMP_CALLBACK callback,
+    WINDIVERT_PUMP_IO_CALLBACK ioCallback, PVOID context)
+{
+    return WinDivertPumpStart(&windivert_pump_port_io, handle, numThreads,
+        depth, callback, ioCallback, context);
+}
+
+/*
+ * Start a packet pump using the given I/O.
+ */
+static HANDLE WinDivertPumpStart(const WINDIVERT_PUMP_IO *io, HANDLE handle,
+    UINT num_threads, UINT depth, WINDIVERT_PUMP_CALLBACK callback,
+    WINDIVERT_PUMP_IO_CALLBACK io_callback, PVOID context)
+{
+    PWINDIVERT_PUMP pump;
+    DWORD err;
+    UINT i;
+
+    if (handle == NULL || handle == INVALID_HANDLE_VALUE ||
+        num_threads == 0 || num_threads > WINDIVERT_PUMP_MAX_THREADS ||
+        depth == 0 || depth > WINDIVERT_PUMP_MAX_DEPTH || callback == NULL)
     {
-        {"and",                 FILTER_TOKEN_AND},
-        {"false",               FILTER_TOKEN_FALSE},
-        {"icmp",                FILTER_TOKEN_ICMP},
-        {"icmp.Body",           FILTER_TOKEN_ICMP_BODY},
-        {"icmp.Checksum",       FILTER_TOKEN_ICMP_CHECKSUM},
-        {"icmp.Code",           FILTER_TOKEN_ICMP_CODE},
-        {"icmp.Type",           FILTER_TOKEN_ICMP_TYPE},
-        {"icmpv6",              FILTER_TOKEN_ICMPV6},
-        {"icmpv6.Body",         FILTER_TOKEN_ICMPV6_BODY},
-        {"icmpv6.Checksum",     FILTER_TOKEN_ICMPV6_CHECKSUM},
-        {"icmpv6.Code",         FILTER_TOKEN_ICMPV6_CODE},
-        {"icmpv6.Type",         FILTER_TOKEN_ICMPV6_TYPE},
-        {"ifIdx",               FILTER_TOKEN_IF_IDX},
-        {"inbound",             FILTER_TOKEN_INBOUND},
-        {"ip",                  FILTER_TOKEN_IP},
-        {"ip.Checksum",         FILTER_TOKEN_IP_CHECKSUM},
-        {"ip.DF",               FILTER_TOKEN_IP_DF},
-        {"ip.DstAddr",          FILTER_TOKEN_IP_DST_ADDR},
-        {"ip.FragOff",          FILTER_TOKEN_IP_FRAG_OFF},
-        {"ip.HdrLength",        FILTER_TOKEN_IP_HDR_LENGTH},
-        {"ip.Id",               FILTER_TOKEN_IP_ID},
-        {"ip.Length",           FILTER_TOKEN_IP_LENGTH},
-        {"ip.MF",               FILTER_TOKEN_IP_MF},
-        {"ip.Protocol",         FILTER_TOKEN_IP_PROTOCOL},
-        {"ip.SrcAddr",          FILTER_TOKEN_IP_SRC_ADDR},
-        {"ip.TOS",              FILTER_TOKEN_IP_TOS},
-        {"ip.TTL",              FILTER_TOKEN_IP_TTL},
-        {"ipv6",                FILTER_TOKEN_IPV6},
-        {"ipv6.DstAddr",        FILTER_TOKEN_IPV6_DST_ADDR},
-        {"ipv6.FlowLabel",      FILTER_TOKEN_IPV6_FLOW_LABEL},
-        {"ipv6.HopLimit",       FILTER_TOKEN_IPV6_HOP_LIMIT},
-        {"ipv6.Length",         FILTER_TOKEN_IPV6_LENGTH},
-        {"ipv6.NextHdr",        FILTER_TOKEN_IPV6_NEXT_HDR},
-        {"ipv6.SrcAddr",        FILTER_TOKEN_IPV6_SRC_ADDR},
-        {"ipv6.TrafficClass",   FILTER_TOKEN_IPV6_TRAFFIC_CLASS},
-        {"not",                 FILTER_TOKEN_NOT},
-        {"or",                  FILTER_TOKEN_OR},
-        {"outbound",            FILTER_TOKEN_OUTBOUND},
-        {"subIfIdx",            FILTER_TOKEN_SUB_IF_IDX},
-        {"tcp",                 FILTER_TOKEN_TCP},
-        {"tcp.Ack",             FILTER_TOKEN_TCP_ACK},
-        {"tcp.AckNum",          FILTER_TOKEN_TCP_ACK_NUM},
-        {"tcp.Checksum",        FILTER_TOKEN_TCP_CHECKSUM},
-        {"tcp.DstPort",         FILTER_TOKEN_TCP_DST_PORT},
-        {"tcp.Fin",             FILTER_TOKEN_TCP_FIN},
-        {"tcp.HdrLength",       FILTER_TOKEN_TCP_HDR_LENGTH},
-        {"tcp.PayloadLength",   FILTER_TOKEN_TCP_PAYLOAD_LENGTH},
-        {"tcp.Psh",             FILTER_TOKEN_TCP_PSH},
-        {"tcp.Rst",             FILTER_TOKEN_TCP_RST},
-        {"tcp.SeqNum",          FILTER_TOKEN_TCP_SEQ_NUM},
-        {"tcp.SrcPort",         FILTER_TOKEN_TCP_SRC_PORT},
-        {"tcp.Syn",             FILTER_TOKEN_TCP_SYN},
-        {"tcp.Urg",             FILTER_TOKEN_TCP_URG},
-        {"tcp.UrgPtr",          FILTER_TOKEN_TCP_URG_PTR},
-        {"tcp.Window",          FILTER_TOKEN_TCP_WINDOW},
-        {"true",                FILTER_TOKEN_TRUE},
-        {"udp",                 FILTER_TOKEN_UDP},
-        {"udp.Checksum",        FILTER_TOKEN_UDP_CHECKSUM},
-        {"udp.DstPort",         FILTER_TOKEN_UDP_DST_PORT},
-        {"udp.Length",          FILTER_TOKEN_UDP_LENGTH},
-        {"udp.PayloadLength",   FILTER_TOKEN_UDP_PAYLOAD_LENGTH},
-        {"udp.SrcPort",         FILTER_TOKEN_UDP_SRC_PORT},
-    };
-    FILTER_TOKEN_NAME key, *result;
-    char c;
-    char token[FILTER_TOKEN_MAXLEN];
-    UINT i = 0, j;
-    UINT tp = 0;
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+    pump = (PWINDIVERT_PUMP)calloc(1, sizeof(WINDIVERT_PUMP));
+    if (pump == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    pump->buffers = (PWINDIVERT_PUMP_BUFFER)calloc(depth,
+        sizeof(WINDIVERT_PUMP_BUFFER));
+    if (pump->buffers == NULL)
+    {
+        free(pump);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    pump->magic       = WINDIVERT_PUMP_MAGIC;
+    pump->io          = io;
+    pump->handle      = handle;
+    pump->callback    = callback;
+    pump->io_callback = io_callback;
+    pump->context     = context;
+    pump->num_buffers = depth;
+
+    pump->port = io->open(handle, (ULONG_PTR)pump, num_threads);
+    if (pump->port == NULL)
+    {
+        goto WinDivertPumpStartError;
+    }
+
+    for (i = 0; i < num_threads; i++)
+    {
+        pump->threads[i] = CreateThread(NULL, 0, WinDivertPumpThread,
+            (LPVOID)pump, 0, NULL);
+        if (pump->threads[i] == NULL)
+        {
+            goto WinDivertPumpStartError;
+        }
+        pump->num_threads++;
+    }
+
+    // Keep 'depth' receives outstanding from now on:
+    pump->pending = (LONG)depth;
+    for (i = 0; i < depth; i++)
+    {
+        WinDivertPumpRecv(pump, pump->buffers + i);
+    }
+    if (pump->error != 0 && pump->pending == 0)
+    {
+        // Every receive failed; the threads have already been told to exit.
+        err = pump->error;
+        WinDivertPumpFree(pump);
+        SetLastError(err);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    return (HANDLE)pump;
+
+WinDivertPumpStartError:
+    err = GetLastError();
+    for (i = 0; i < pump->num_threads; i++)
+    {
+        io->wake(pump->port);
+    }
+    WinDivertPumpFree(pump);
+    SetLastError(err);
+    return INVALID_HANDLE_VALUE;
+}
+
+/*
+ * Stop and destroy a packet pump.
+ */
+extern BOOL WinDivertPumpDestroy(HANDLE pumpHandle)
+{
+    PWINDIVERT_PUMP pump = (PWINDIVERT_PUMP)pumpHandle;
+    UINT i;
+
+    if (pump == NULL || pump == INVALID_HANDLE_VALUE ||
+        pump->magic != WINDIVERT_PUMP_MAGIC)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    // Stop re-issuing requests and cancel the outstanding ones.  The
+    // threads exit once the last request has completed.
+    InterlockedExchange(&pump->stop, TRUE);
+    for (i = 0; i < pump->num_buffers; i++)
+    {
+        pump->io->cancel(pump->handle, &pump->buffers[i].overlapped);
+    }
+    WinDivertPumpFree(pump);
+    return TRUE;
+}
+
+/*
+ * Packet pump worker thread.
+ */
+static DWORD WINAPI WinDivertPumpThread(LPVOID arg)
+{
+    PWINDIVERT_PUMP pump = (PWINDIVERT_PUMP)arg;
+    PWINDIVERT_PUMP_BUFFER buffer;
+    LPOVERLAPPED overlapped;
+    DWORD iolen, err;
+    UINT packet_len;
+    BOOL result;
 
     while (TRUE)
     {
-        if (tp >= tokensmax-1)
+        result = pump->io->wait(pump->port, &iolen, &overlapped);
+        if (overlapped == NULL)
         {
-            return FALSE;
+            // Told to exit (or the port is gone).
+            return 0;
         }
-        memset(tokens[tp].val, 0, sizeof(tokens[tp].val));
-        while (isspace(filter[i]))
+        buffer = (PWINDIVERT_PUMP_BUFFER)overlapped;
+        if (buffer < pump->buffers ||
+            buffer >= pump->buffers + pump->num_buffers)
         {
-            i++;
+            // Overlapped I/O issued on the handle by the application:
+            err = (result? 0: GetLastError());
+            if (pump->io_callback != NULL)
+            {
+                pump->io_callback(pump->context, overlapped, (UINT)iolen,
+                    err);
+            }
+            continue;
         }
-        c = filter[i++];
-        switch (c)
+
+        if (buffer->send)
         {
-            case '\0':
-                tokens[tp].kind = FILTER_TOKEN_END;
-                return TRUE;
-            case '(':
-                tokens[tp++].kind = FILTER_TOKEN_OPEN;
-                continue;
-            case ')':
-                tokens[tp++].kind = FILTER_TOKEN_CLOSE;
-                continue;
-            case '!':
-                if (filter[i] == '=')
-                {
-                    i++;
-                    tokens[tp++].kind = FILTER_TOKEN_NEQ;
-                }
-                else
-                {
-                    tokens[tp++].kind = FILTER_TOKEN_NOT;
-                }
-                continue;
-            case '=':
-                if (filter[i] == '=')
-                {
-                    i++;
-                }
-                tokens[tp++].kind = FILTER_TOKEN_EQ;
-                continue;
-            case '<':
-                if (filter[i] == '=')
-                {
-                    i++;
-                    tokens[tp++].kind = FILTER_TOKEN_LEQ;
-                }
-                else
-                {
-                    tokens[tp++].kind = FILTER_TOKEN_LT;
-                }
-                continue;
-            case '>':
-                if (filter[i] == '=')
-                {
-                    i++;
-                    tokens[tp++].kind = FILTER_TOKEN_GEQ;
-                }
-                else
-                {
-                    tokens[tp++].kind = FILTER_TOKEN_GT;
-                }
-                continue;
-            case '&':
-                if (filter[i++] != '&')
-                {
-                    return FALSE;
-                }
-                tokens[tp++].kind = FILTER_TOKEN_AND;
-                continue;
-            case '|':
-                if (filter[i++] != '|')
-                {
-                    return FALSE;
-                }
-                tokens[tp++].kind = FILTER_TOKEN_OR;
-                continue;
-            default:
-                break;
+            // Send done (a failed send just drops the packet):
+            WinDivertPumpRecv(pump, buffer);
+            continue;
         }
-        token[0] = c;
-        if (isalnum(c) || c == '.' || c == ':')
+        if (!result)
         {
-            UINT32 num;
-            char *end;
-            for (j = 1; j < FILTER_TOKEN_MAXLEN && (isalnum(filter[i]) ||
-                    filter[i] == '.' || filter[i] == ':'); j++, i++)
+            err = GetLastError();
+            pump->error = err;
+            buffer->failures++;
+            if (err == ERROR_OPERATION_ABORTED ||
+                err == ERROR_INVALID_HANDLE ||
+                buffer->failures >= WINDIVERT_PUMP_MAX_FAILURES)
             {
-                token[j] = filter[i];
+                // Cancelled, the handle was closed, or the error persists;
+                // retire the buffer.
+                WinDivertPumpRelease(pump);
             }
-            if (j >= FILTER_TOKEN_MAXLEN)
+            else
             {
-                return FALSE;
+                WinDivertPumpRecv(pump, buffer);
             }
-            token[j] = '\0';
+            continue;
+        }
+        buffer->failures = 0;
 
-            // Check for symbol:
-            key.name = token;
-            result = (PFILTER_TOKEN_NAME)bsearch((const void *)&key,
-                token_names, sizeof(token_names) / sizeof(FILTER_TOKEN_NAME),
-                sizeof(FILTER_TOKEN_NAME), WinDivertFilterTokenNameCompare);
-            if (result != NULL)
-            {
-                switch (layer)
-                {
-                    case WINDIVERT_LAYER_NETWORK_FORWARD:
-                        if (result->kind == FILTER_TOKEN_INBOUND ||
-                            result->kind == FILTER_TOKEN_OUTBOUND)
-                        {
-                            return FALSE;
-                        }
-                        break;
-                    default:
-                        break;
-                }
-                tokens[tp++].kind = result->kind;
-                continue;
-            }
+        packet_len = (UINT)iolen;
+        if (!pump->callback(pump->context, buffer->packet, &packet_len,
+                &buffer->addr) ||
+            packet_len > WINDIVERT_PUMP_PACKET_MAX)
+        {
+            WinDivertPumpRecv(pump, buffer);
+            continue;
+        }
+        WinDivertPumpSend(pump, buffer, packet_len);
+    }
+}
 
-            // Check for base 10 number:
-            errno = 0;
-            num = strtoul(token, &end, 10);
-            if (errno == 0 && *end == '\0')
-            {
-                tokens[tp].kind   = FILTER_TOKEN_NUMBER;
-                tokens[tp].val[0] = num;
-                tp++;
-                continue;
-            }
+/*
+ * Issue an overlapped receive into a pump buffer.
+ */
+static VOID WinDivertPumpRecv(PWINDIVERT_PUMP pump,
+    PWINDIVERT_PUMP_BUFFER buffer)
+{
+    if (pump->stop)
+    {
+        WinDivertPumpRelease(pump);
+        return;
+    }
+    memset(&buffer->overlapped, 0, sizeof(buffer->overlapped));
+    buffer->send = FALSE;
+    if (!pump->io->recv(pump->handle, buffer->packet, sizeof(buffer->packet),
+            &buffer->addr, &buffer->overlapped) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        pump->error = GetLastError();
+        WinDivertPumpRelease(pump);
+        return;
+    }
 
-            // Check for base 16 number:
-            errno = 0;
-            num = strtoul(token, &end, 16);
-            if (errno == 0 && *end == '\0')
-            {
-                tokens[tp].kind   = FILTER_TOKEN_NUMBER;
-                tokens[tp].val[0] = num;
-                tp++;
-                continue;
-            }
+    // WinDivertPumpDestroy() may have missed this request:
+    if (pump->stop)
+    {
+        pump->io->cancel(pump->handle, &buffer->overlapped);
+    }
+}
 
-            // Check for IPv4 address:
-            if (WinDivertHelperParseIPv4Address(token, tokens[tp].val))
-            {
-                tokens[tp].kind = FILTER_TOKEN_NUMBER;
-                tp++;
-                continue;
-            }
+/*
+ * Issue an overlapped send from a pump buffer.
+ */
+static VOID WinDivertPumpSend(PWINDIVERT_PUMP pump,
+    PWINDIVERT_PUMP_BUFFER buffer, UINT packet_len)
+{
+    memset(&buffer->overlapped, 0, sizeof(buffer->overlapped));
+    buffer->send = TRUE;
+    if (!pump->io->send(pump->handle, buffer->packet, packet_len,
+            &buffer->addr, &buffer->overlapped) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        // The packet is dropped; re-use the buffer.
+        WinDivertPumpRecv(pump, buffer);
+    }
+}
 
-            // Check for IPv6 address:
-            SetLastError(0);
-            if (WinDivertHelperParseIPv6Address(token, tokens[tp].val))
-            {
-                tokens[tp].kind = FILTER_TOKEN_NUMBER;
-                tp++;
-                continue;
-            }
+/*
+ * Retire a pump buffer; the last one tells the threads to exit.
+ */
+static VOID WinDivertPumpRelease(PWINDIVERT_PUMP pump)
+{
+    UINT i;
 
-            return FALSE;
-        }
-        else
-        {
-            return FALSE;
-        }
+    if (InterlockedDecrement(&pump->pending) != 0)
+    {
+        return;
+    }
+    for (i = 0; i < pump->num_threads; i++)
+    {
+        pump->io->wake(pump->port);
     }
 }
 
 /*
- * Parse the given filter.
+ * Wait for the pump threads to exit, then free the pump.
  */
-static BOOL WinDivertParseFilter(FILTER_TOKEN *tokens, UINT16 *tp,
-    windivert_ioctl_filter_t filter, UINT16 *fp, FILTER_TOKEN_KIND op)
+static VOID WinDivertPumpFree(PWINDIVERT_PUMP pump)
 {
-    BOOL testop, fused, result, negate;
-    FILTER_TOKEN token;
-    UINT16 f, s;
-    s = *fp;
+    UINT i;
 
-WinDivertParseFilterNext:
+    if (pump->num_threads != 0)
+    {
+        WaitForMultipleObjects(pump->num_threads, pump->threads, TRUE,
+            INFINITE);
+    }
+    for (i = 0; i < pump->num_threads; i++)
+    {
+        CloseHandle(pump->threads[i]);
+    }
+    if (pump->port != NULL)
+    {
+        pump->io->close(pump->port);
+    }
+    pump->magic = 0;
+    free(pump->buffers);
+    free(pump);
+}
 
-    testop = TRUE;
-    fused = TRUE;
-    negate = FALSE;
-    token = tokens[*tp];
+/*
+ * Bind a handle to a new completion port.  This fails if the handle is
+ * already bound, e.g. to another pump.
+ */
+static HANDLE WinDivertPumpPortOpen(HANDLE handle, ULONG_PTR key,
+    UINT num_threads)
+{
+    HANDLE port;
+    DWORD err;
 
-    *tp = *tp + 1;
-    f = *fp;
-    if (f >= WINDIVERT_FILTER_MAXLEN)
+    port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0,
+        num_threads);
+    if (port == NULL)
     {
-        return FALSE;
+        return NULL;
     }
-    filter[f].success = WINDIVERT_FILTER_RESULT_ACCEPT;
-    filter[f].failure = WINDIVERT_FILTER_RESULT_REJECT;
-    filter[f].arg[1] = 0;
-    filter[f].arg[2] = 0;
-    filter[f].arg[3] = 0;
-    if (token.kind == FILTER_TOKEN_NOT)
+    if (CreateIoCompletionPort(handle, port, key, 0) == NULL)
     {
-        negate = TRUE;
-        token = tokens[*tp];
-        *tp = *tp + 1;
+        err = GetLastError();
+        CloseHandle(port);
+        SetLastError(err);
+        return NULL;
     }
-    switch (token.kind)
+    return port;
+}
+
+/*
+ * Issue an overlapped receive.
+ */
+static BOOL WinDivertPumpPortRecv(HANDLE handle, PVOID packet,
+    UINT packet_len, PWINDIVERT_ADDRESS addr, LPOVERLAPPED overlapped)
+{
+    return WinDivertRecvEx(handle, packet, packet_len, 0, addr, NULL,
+        overlapped);
+}
+
+/*
+ * Issue an overlapped send.
+ */
+static BOOL WinDivertPumpPortSend(HANDLE handle, PVOID packet,
+    UINT packet_len, PWINDIVERT_ADDRESS addr, LPOVERLAPPED overlapped)
+{
+    return WinDivertSendEx(handle, packet, packet_len, 0, addr, NULL,
+        overlapped);
+}
+
+/*
+ * Cancel an overlapped request.
+ */
+static VOID WinDivertPumpPortCancel(HANDLE handle, LPOVERLAPPED overlapped)
+{
+    CancelIoEx(handle, overlapped);
+}
+
+/*
+ * Wait for the next completion.
+ */
+static BOOL WinDivertPumpPortWait(HANDLE port, DWORD *iolen,
+    LPOVERLAPPED *overlapped)
+{
+    ULONG_PTR key;
+
+    return GetQueuedCompletionStatus(port, iolen, &key, overlapped,
+        INFINITE);
+}
+
+/*
+ * Wake one thread waiting in WinDivertPumpPortWait().
+ */
+static VOID WinDivertPumpPortWake(HANDLE port)
+{
+    PostQueuedCompletionStatus(port, 0, 0, NULL);
+}
+
+/*
+ * Close a completion port.
+ */
+static VOID WinDivertPumpPortClose(HANDLE port)
+{
+    CloseHandle(port);
+}
+
+/*
+ * Set a WinDivert parameter.
+ */
+extern BOOL WinDivertSetParam(HANDLE handle, WINDIVERT_PARAM param,
+    UINT64 value)
+{
+    switch ((int)param)
     {
-        case FILTER_TOKEN_OPEN:
-            result = WinDivertParseFilter(tokens, tp, filter, fp,
-                FILTER_TOKEN_AND);
-            result = (result? (tokens[*tp].kind == FILTER_TOKEN_CLOSE): FALSE);
-            if (!result)
+        case WINDIVERT_PARAM_QUEUE_LEN:
+            if (value < WINDIVERT_PARAM_QUEUE_LEN_MIN ||
+                value > WINDIVERT_PARAM_QUEUE_LEN_MAX)
             {
+                SetLastError(ERROR_INVALID_PARAMETER);
                 return FALSE;
             }
-            *tp = *tp + 1;
-            testop = FALSE;
-            fused = FALSE;
-            break;
-        case FILTER_TOKEN_TRUE: case FILTER_TOKEN_FALSE:
-            filter[f].field  = WINDIVERT_FILTER_FIELD_ZERO;
-            filter[f].test   = WINDIVERT_FILTER_TEST_EQ;
-            filter[f].arg[0] = (token.kind == FILTER_TOKEN_FALSE);
-            testop = FALSE;
-            break;
-        case FILTER_TOKEN_OUTBOUND:
-            filter[f].field = WINDIVERT_FILTER_FIELD_OUTBOUND;
-            break;
-        case FILTER_TOKEN_INBOUND:
-            filter[f].field = WINDIVERT_FILTER_FIELD_INBOUND;
-            break;
-        case FILTER_TOKEN_IF_IDX:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IFIDX;
-            break;
-        case FILTER_TOKEN_SUB_IF_IDX:
-            filter[f].field = WINDIVERT_FILTER_FIELD_SUBIFIDX;
-            break;
-        case FILTER_TOKEN_IP:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IP;
-            break;
-        case FILTER_TOKEN_IPV6:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IPV6;
-            break;
-        case FILTER_TOKEN_ICMP:
-            filter[f].field = WINDIVERT_FILTER_FIELD_ICMP;
-            break;
-        case FILTER_TOKEN_ICMPV6:
-            filter[f].field = WINDIVERT_FILTER_FIELD_ICMPV6;
-            break;
-        case FILTER_TOKEN_TCP:
-            filter[f].field = WINDIVERT_FILTER_FIELD_TCP;
-            break;
-        case FILTER_TOKEN_UDP:
-            filter[f].field = WINDIVERT_FILTER_FIELD_UDP;
-            break;
-        case FILTER_TOKEN_IP_HDR_LENGTH:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IP_HDRLENGTH;
-            break;
-        case FILTER_TOKEN_IP_TOS:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IP_TOS;
-            break;
-        case FILTER_TOKEN_IP_LENGTH:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IP_LENGTH;
-            break;
-        case FILTER_TOKEN_IP_ID:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IP_ID;
-            break;
-        case FILTER_TOKEN_IP_DF:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IP_DF;
-            break;
-        case FILTER_TOKEN_IP_MF:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IP_MF;
-            break;
-        case FILTER_TOKEN_IP_FRAG_OFF:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IP_FRAGOFF;
-            break;
-        case FILTER_TOKEN_IP_TTL:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IP_TTL;
             break;
-        case FILTER_TOKEN_IP_PROTOCOL:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IP_PROTOCOL;
+        case WINDIVERT_PARAM_QUEUE_TIME:
+            if (value < WINDIVERT_PARAM_QUEUE_TIME_MIN ||
+                value > WINDIVERT_PARAM_QUEUE_TIME_MAX)
+            {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return FALSE;
+            }
             break;
-        case FILTER_TOKEN_IP_CHECKSUM:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IP_CHECKSUM;
+        case WINDIVERT_PARAM_QUEUE_COUNT:
+            if (value < WINDIVERT_PARAM_QUEUE_COUNT_MIN ||
+                value > WINDIVERT_PARAM_QUEUE_COUNT_MAX)
+            {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return FALSE;
+            }
             break;
-        case FILTER_TOKEN_IP_SRC_ADDR:
-            filter[f].field = WINDIVERT_FILTER_FIELD_IP_SRCADDR;
+        default:
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+    }
+    return WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_PARAM, (UINT8)param,
+        value, NULL, 0, NULL);
+}
+
+/*
+ * Get a WinDivert parameter.
+ */
+extern BOOL WinDivertGetParam(HANDLE handle, WINDIVERT_PARAM param,
+    UINT64 *pValue)
+{
+    switch ((int)param)
+    {
+        case WINDIVERT_PARAM_QUEUE_LEN: case WINDIVERT_PARAM_QUEUE_TIME:
+        case WINDIVERT_PARAM_QUEUE_COUNT:
             break;
-        case FILTER_TOKEN_IP_DST_ADDR:
+        default:
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+    }
+    return WinDivertIoControl(handle, IOCTL_WINDIVERT_GET_PARAM, (UINT8)param,
+        0, pValue, sizeof(UINT64), NULL);
+}
+
+/*
+ * Compile a filter into a filter object.
+ */
+extern BOOL WinDivertFilterCompile(const char *filter, WINDIVERT_LAYER layer,
+    PVOID pObject, UINT objectLen, UINT *pObjectLen)
+{
+    PWINDIVERT_FILTER_OBJECT object;
+    UINT object_len;
+
+    if (filter == NULL || layer > WINDIVERT_LAYER_MAX)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    object = WinDivertCompileFilterObject(filter, layer, &object_len);
+    if (object == NULL)
+    {
+        return FALSE;
+    }
+    if (pObjectLen != NULL)
+    {
+        *pObjectLen = object_len;
+    }
+    if (pObject == NULL || objectLen < object_len)
+    {
+        free(object);
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+    memcpy(pObject, object, object_len);
+    free(object);
+    return TRUE;
+}
+
+/*
+ * Compile a filter into a (malloc'ed) filter object.
+ */
+static PWINDIVERT_FILTER_OBJECT WinDivertCompileFilterObject(
+    const char *filter_str, WINDIVERT_LAYER layer, UINT *object_len_ptr)
+{
+    struct windivert_ioctl_filter_s ioctl_filter[WINDIVERT_FILTER_MAXLEN];
+    PWINDIVERT_FILTER_OBJECT object;
+    UINT16 filter_len;
+    UINT8 *automata, *program;
+    UINT automata_len, program_len;
+
+    if (!WinDivertCompileFilter(filter_str, layer, ioctl_filter, &filter_len,
+            &automata, &automata_len))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+#ifdef WINDIVERT_DEBUG
+    WinDivertFilterDump(ioctl_filter, filter_len);
+#endif
+
+    program_len = filter_len*sizeof(struct windivert_ioctl_filter_s);
+    object = (PWINDIVERT_FILTER_OBJECT)malloc(sizeof(WINDIVERT_FILTER_OBJECT) +
+        program_len + automata_len);
+    if (object == NULL)
+    {
+        free(automata);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    object->magic        = WINDIVERT_FILTER_OBJECT_MAGIC;
+    object->version      = WINDIVERT_IOCTL_VERSION;
+    object->layer        = (UINT8)layer;
+    object->filter_len   = filter_len;
+    object->automata_len = automata_len;
+    program = (UINT8 *)(object + 1);
+    memcpy(program, ioctl_filter, program_len);
+    if (automata_len != 0)
+    {
+        memcpy(program + program_len, automata, automata_len);
+    }
+    free(automata);
+    *object_len_ptr = sizeof(WINDIVERT_FILTER_OBJECT) + program_len +
+        automata_len;
+    return object;
+}
+
+/*
+ * Check a filter object's header.
+ */
+static BOOL WinDivertCheckFilterObject(const WINDIVERT_FILTER_OBJECT *object,
+    UINT object_len)
+{
+    return (object != NULL &&
+        object_len >= sizeof(WINDIVERT_FILTER_OBJECT) &&
+        object->magic == WINDIVERT_FILTER_OBJECT_MAGIC &&
+        object->version == WINDIVERT_IOCTL_VERSION &&
+        object->layer <= WINDIVERT_LAYER_MAX &&
+        object->filter_len < WINDIVERT_FILTER_MAXLEN &&
+        object->automata_len <= WINDIVERT_FILTER_AUTOMATA_MAXLEN &&
+        object_len == sizeof(WINDIVERT_FILTER_OBJECT) +
+            object->filter_len*sizeof(struct windivert_ioctl_filter_s) +
+            object->automata_len);
+}
+
+/*
+ * Compile a filter.
+ */
+static BOOL WinDivertCompileFilter(const char *filter_str,
+    WINDIVERT_LAYER layer, windivert_ioctl_filter_t filter, UINT16 *fp,
+    UINT8 **automata_ptr, UINT *automata_len_ptr)
+{
+    FILTER_TOKEN tokens[WINDIVERT_FILTER_MAXLEN*3];
+    UINT16 tp, i;
+    UINT32 automaton;
+
+    *automata_ptr = NULL;
+    *automata_len_ptr = 0;
+    if (!WinDivertTokenizeFilter(filter_str, layer, tokens,
+            WINDIVERT_FILTER_MAXLEN*3-1))
+    {
+        return FALSE;
+    }
+
+    tp = 0;
+    *fp = 0;
+    if (!WinDivertParseFilter(tokens, &tp, filter, fp, FILTER_TOKEN_AND))
+    {
+        return FALSE;
+    }
+    if (tokens[tp].kind != FILTER_TOKEN_END)
+    {
+        return FALSE;
+    }
+
+    // Compile the pattern sets of the (n)contains tests:
+    automaton = 0;
+    for (i = 0; i < *fp; i++)
+    {
+        if (filter[i].test != WINDIVERT_FILTER_TEST_CONTAINS &&
+            filter[i].test != WINDIVERT_FILTER_TEST_NCONTAINS)
+        {
+            continue;
+        }
+        if (!WinDivertCompileAutomaton(&tokens[filter[i].arg[0]],
+                automata_ptr, automata_len_ptr))
+        {
+            free(*automata_ptr);
+            *automata_ptr = NULL;
+            *automata_len_ptr = 0;
+            return FALSE;
+        }
+        filter[i].arg[0] = automaton++;
+    }
+    return TRUE;
+}
+
+/*
+ * Compare two FILTER_TOKEN_NAMEs.
+ */
+static int __cdecl WinDivertFilterTokenNameCompare(const void *a,
+    const void *b)
+{
+    PFILTER_TOKEN_NAME na = (PFILTER_TOKEN_NAME)a;
+    PFILTER_TOKEN_NAME nb = (PFILTER_TOKEN_NAME)b;
+    return strcmp(na->name, nb->name);
+}
+
+/*
+ * Tokenize the given filter string.
+ */
+static BOOL WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
+    FILTER_TOKEN *tokens, UINT tokensmax)
+{
+    static const FILTER_TOKEN_NAME token_names[] =
+    {
+        {"and",                 FILTER_TOKEN_AND},
+        {"contains",            FILTER_TOKEN_CONTAINS},
+        {"false",               FILTER_TOKEN_FALSE},
+        {"icmp",                FILTER_TOKEN_ICMP},
+        {"icmp.Body",           FILTER_TOKEN_ICMP_BODY},
+        {"icmp.Checksum",       FILTER_TOKEN_ICMP_CHECKSUM},
+        {"icmp.Code",           FILTER_TOKEN_ICMP_CODE},
+        {"icmp.Type",           FILTER_TOKEN_ICMP_TYPE},
+        {"icmpv6",              FILTER_TOKEN_ICMPV6},
+        {"icmpv6.Body",         FILTER_TOKEN_ICMPV6_BODY},
+        {"icmpv6.Checksum",     FILTER_TOKEN_ICMPV6_CHECKSUM},
+        {"icmpv6.Code",         FILTER_TOKEN_ICMPV6_CODE},
+        {"icmpv6.Type",         FILTER_TOKEN_ICMPV6_TYPE},
+        {"ifIdx",               FILTER_TOKEN_IF_IDX},
+        {"inbound",             FILTER_TOKEN_INBOUND},
+        {"ip",                  FILTER_TOKEN_IP},
+        {"ip.Checksum",         FILTER_TOKEN_IP_CHECKSUM},
+        {"ip.DF",               FILTER_TOKEN_IP_DF},
+        {"ip.DstAddr",          FILTER_TOKEN_IP_DST_ADDR},
+        {"ip.FragOff",          FILTER_TOKEN_IP_FRAG_OFF},
+        {"ip.HdrLength",        FILTER_TOKEN_IP_HDR_LENGTH},
+        {"ip.Id",               FILTER_TOKEN_IP_ID},
+        {"ip.Length",           FILTER_TOKEN_IP_LENGTH},
+        {"ip.MF",               FILTER_TOKEN_IP_MF},
+        {"ip.Protocol",         FILTER_TOKEN_IP_PROTOCOL},
+        {"ip.SrcAddr",          FILTER_TOKEN_IP_SRC_ADDR},
+        {"ip.TOS",              FILTER_TOKEN_IP_TOS},
+        {"ip.TTL",              FILTER_TOKEN_IP_TTL},
+        {"ipv6",                FILTER_TOKEN_IPV6},
+        {"ipv6.DstAddr",        FILTER_TOKEN_IPV6_DST_ADDR},
+        {"ipv6.FlowLabel",      FILTER_TOKEN_IPV6_FLOW_LABEL},
+        {"ipv6.HopLimit",       FILTER_TOKEN_IPV6_HOP_LIMIT},
+        {"ipv6.Length",         FILTER_TOKEN_IPV6_LENGTH},
+        {"ipv6.NextHdr",        FILTER_TOKEN_IPV6_NEXT_HDR},
+        {"ipv6.SrcAddr",        FILTER_TOKEN_IPV6_SRC_ADDR},
+        {"ipv6.TrafficClass",   FILTER_TOKEN_IPV6_TRAFFIC_CLASS},
+        {"not",                 FILTER_TOKEN_NOT},
+        {"or",                  FILTER_TOKEN_OR},
+        {"outbound",            FILTER_TOKEN_OUTBOUND},
+        {"subIfIdx",            FILTER_TOKEN_SUB_IF_IDX},
+        {"tcp",                 FILTER_TOKEN_TCP},
+        {"tcp.Ack",             FILTER_TOKEN_TCP_ACK},
+        {"tcp.AckNum",          FILTER_TOKEN_TCP_ACK_NUM},
+        {"tcp.Checksum",        FILTER_TOKEN_TCP_CHECKSUM},
+        {"tcp.DstPort",         FILTER_TOKEN_TCP_DST_PORT},
+        {"tcp.Fin",             FILTER_TOKEN_TCP_FIN},
+        {"tcp.HdrLength",       FILTER_TOKEN_TCP_HDR_LENGTH},
+        {"tcp.Payload",         FILTER_TOKEN_TCP_PAYLOAD},
+        {"tcp.Payload16",       FILTER_TOKEN_TCP_PAYLOAD16},
+        {"tcp.Payload32",       FILTER_TOKEN_TCP_PAYLOAD32},
+        {"tcp.PayloadLength",   FILTER_TOKEN_TCP_PAYLOAD_LENGTH},
+        {"tcp.Psh",             FILTER_TOKEN_TCP_PSH},
+        {"tcp.Rst",             FILTER_TOKEN_TCP_RST},
+        {"tcp.SeqNum",          FILTER_TOKEN_TCP_SEQ_NUM},
+        {"tcp.SrcPort",         FILTER_TOKEN_TCP_SRC_PORT},
+        {"tcp.Syn",             FILTER_TOKEN_TCP_SYN},
+        {"tcp.Urg",             FILTER_TOKEN_TCP_URG},
+        {"tcp.UrgPtr",          FILTER_TOKEN_TCP_URG_PTR},
+        {"tcp.Window",          FILTER_TOKEN_TCP_WINDOW},
+        {"true",                FILTER_TOKEN_TRUE},
+        {"udp",                 FILTER_TOKEN_UDP},
+        {"udp.Checksum",        FILTER_TOKEN_UDP_CHECKSUM},
+        {"udp.DstPort",         FILTER_TOKEN_UDP_DST_PORT},
+        {"udp.Length",          FILTER_TOKEN_UDP_LENGTH},
+        {"udp.Payload",         FILTER_TOKEN_UDP_PAYLOAD},
+        {"udp.Payload16",       FILTER_TOKEN_UDP_PAYLOAD16},
+        {"udp.Payload32",       FILTER_TOKEN_UDP_PAYLOAD32},
+        {"udp.PayloadLength",   FILTER_TOKEN_UDP_PAYLOAD_LENGTH},
+        {"udp.SrcPort",         FILTER_TOKEN_UDP_SRC_PORT},
+    };
+    FILTER_TOKEN_NAME key, *result;
+    char c;
+    char token[FILTER_TOKEN_MAXLEN];
+    UINT32 addr[4];
+    UINT i = 0, j;
+    UINT tp = 0;
+
+    while (TRUE)
+    {
+        if (tp >= tokensmax-1)
+        {
+            return FALSE;
+        }
+        memset(tokens[tp].val, 0, sizeof(tokens[tp].val));
+        tokens[tp].str = NULL;
+        tokens[tp].len = 0;
+        while (isspace(filter[i]))
+        {
+            i++;
+        }
+        c = filter[i++];
+        switch (c)
+        {
+            case '\0':
+                tokens[tp].kind = FILTER_TOKEN_END;
+                return TRUE;
+            case '(':
+                tokens[tp++].kind = FILTER_TOKEN_OPEN;
+                continue;
+            case ')':
+                tokens[tp++].kind = FILTER_TOKEN_CLOSE;
+                continue;
+            case '!':
+                if (filter[i] == '=')
+                {
+                    i++;
+                    tokens[tp++].kind = FILTER_TOKEN_NEQ;
+                }
+                else
+                {
+                    tokens[tp++].kind = FILTER_TOKEN_NOT;
+                }
+                continue;
+            case '=':
+                if (filter[i] == '=')
+                {
+                    i++;
+                }
+                tokens[tp++].kind = FILTER_TOKEN_EQ;
+                continue;
+            case '<':
+                if (filter[i] == '=')
+                {
+                    i++;
+                    tokens[tp++].kind = FILTER_TOKEN_LEQ;
+                }
+                else
+                {
+                    tokens[tp++].kind = FILTER_TOKEN_LT;
+                }
+                continue;
+            case '>':
+                if (filter[i] == '=')
+                {
+                    i++;
+                    tokens[tp++].kind = FILTER_TOKEN_GEQ;
+                }
+                else
+                {
+                    tokens[tp++].kind = FILTER_TOKEN_GT;
+                }
+                continue;
+            case '&':
+                if (filter[i++] != '&')
+                {
+                    return FALSE;
+                }
+                tokens[tp++].kind = FILTER_TOKEN_AND;
+                continue;
+            case '|':
+                if (filter[i++] != '|')
+                {
+                    return FALSE;
+                }
+                tokens[tp++].kind = FILTER_TOKEN_OR;
+                continue;
+            case '"':
+                if (!WinDivertTokenizeString(filter, &i, &tokens[tp]))
+                {
+                    return FALSE;
+                }
+                tokens[tp++].kind = FILTER_TOKEN_STRING;
+                continue;
+            case '{':
+                if (!WinDivertTokenizeStrings(filter, &i, &tokens[tp]))
+                {
+                    return FALSE;
+                }
+                tokens[tp++].kind = FILTER_TOKEN_STRINGS;
+                continue;
+            default:
+                break;
+        }
+        token[0] = c;
+        if (isalnum(c) || c == '.' || c == ':')
+        {
+            UINT32 num;
+            char *end;
+            for (j = 1; j < FILTER_TOKEN_MAXLEN && (isalnum(filter[i]) ||
+                    filter[i] == '.' || filter[i] == ':'); j++, i++)
+            {
+                token[j] = filter[i];
+            }
+            if (j >= FILTER_TOKEN_MAXLEN)
+            {
+                return FALSE;
+            }
+            token[j] = '\0';
+
+            // Check for symbol:
+            key.name = token;
+            result = (PFILTER_TOKEN_NAME)bsearch((const void *)&key,
+                token_names, sizeof(token_names) / sizeof(FILTER_TOKEN_NAME),
+                sizeof(FILTER_TOKEN_NAME), WinDivertFilterTokenNameCompare);
+            if (result != NULL)
+            {
+                switch (layer)
+                {
+                    case WINDIVERT_LAYER_NETWORK_FORWARD:
+                        if (result->kind == FILTER_TOKEN_INBOUND ||
+                            result->kind == FILTER_TOKEN_OUTBOUND)
+                        {
+                            return FALSE;
+                        }
+                        break;
+                    default:
+                        break;
+                }
+                switch (result->kind)
+                {
+                    case FILTER_TOKEN_TCP_PAYLOAD:
+                    case FILTER_TOKEN_UDP_PAYLOAD:
+                        if (filter[i] != '[')
+                        {
+                            break;      // Whole payload (contains only).
+                        }
+                        // Fallthrough:
+                    case FILTER_TOKEN_TCP_PAYLOAD16:
+                    case FILTER_TOKEN_TCP_PAYLOAD32:
+                    case FILTER_TOKEN_UDP_PAYLOAD16:
+                    case FILTER_TOKEN_UDP_PAYLOAD32:
+                        if (!WinDivertTokenizeIndex(filter, &i, result->kind,
+                                tokens[tp].val))
+                        {
+                            return FALSE;
+                        }
+                        break;
+                    default:
+                        break;
+                }
+                tokens[tp++].kind = result->kind;
+                continue;
+            }
+
+            // Check for base 10 number:
+            errno = 0;
+            num = strtoul(token, &end, 10);
+            if (errno == 0 && *end == '\0')
+            {
+                tokens[tp].kind   = FILTER_TOKEN_NUMBER;
+                tokens[tp].val[0] = num;
+                tp++;
+                continue;
+            }
+
+            // Check for base 16 number:
+            errno = 0;
+            num = strtoul(token, &end, 16);
+            if (errno == 0 && *end == '\0')
+            {
+                tokens[tp].kind   = FILTER_TOKEN_NUMBER;
+                tokens[tp].val[0] = num;
+                tp++;
+                continue;
+            }
+
+            // Check for IPv4 address:
+            if (WinDivertHelperParseIPv4Address(token, tokens[tp].val))
+            {
+                tokens[tp].kind = FILTER_TOKEN_NUMBER;
+                tp++;
+                continue;
+            }
+
+            // Check for IPv6 address:
+            SetLastError(0);
+            if (WinDivertHelperParseIPv6Address(token, addr))
+            {
+                // Numbers are stored least significant word first:
+                for (j = 0; j < 4; j++)
+                {
+                    tokens[tp].val[j] = ntohl(addr[3-j]);
+                }
+                tokens[tp].kind = FILTER_TOKEN_NUMBER;
+                tp++;
+                continue;
+            }
+
+            return FALSE;
+        }
+        else
+        {
+            return FALSE;
+        }
+    }
+}
+
+/*
+ * Tokenize a payload index, i.e. "[offset]" or "[offset:length]".
+ */
+static BOOL WinDivertTokenizeIndex(const char *filter, UINT *i,
+    FILTER_TOKEN_KIND kind, UINT32 *val)
+{
+    UINT32 offset, length;
+    char *end;
+
+    switch (kind)
+    {
+        case FILTER_TOKEN_TCP_PAYLOAD16: case FILTER_TOKEN_UDP_PAYLOAD16:
+            length = sizeof(UINT16);
+            break;
+        case FILTER_TOKEN_TCP_PAYLOAD32: case FILTER_TOKEN_UDP_PAYLOAD32:
+            length = sizeof(UINT32);
+            break;
+        default:
+            length = sizeof(UINT8);
+            break;
+    }
+
+    if (filter[*i] != '[' || !isdigit(filter[*i+1]))
+    {
+        return FALSE;
+    }
+    errno = 0;
+    offset = strtoul(filter + *i + 1, &end, 10);
+    if (errno != 0)
+    {
+        return FALSE;
+    }
+    if (*end == ':' && length == sizeof(UINT8))
+    {
+        if (!isdigit(end[1]))
+        {
+            return FALSE;
+        }
+        length = strtoul(end + 1, &end, 10);
+        if (errno != 0)
+        {
+            return FALSE;
+        }
+    }
+    if (*end != ']' || length == 0 ||
+        length > WINDIVERT_FILTER_PAYLOAD_MAXWIDTH ||
+        offset + length > WINDIVERT_FILTER_PAYLOAD_MAXLEN)
+    {
+        return FALSE;
+    }
+    *i = (UINT)(end + 1 - filter);
+    val[0] = offset;
+    val[1] = length;
+    return TRUE;
+}
+
+/*
+ * Tokenize a string literal; *i is the index following the opening quote.
+ * Supported escapes are \\, \", \r, \n, \t and \xHH.
+ */
+static BOOL WinDivertTokenizeString(const char *filter, UINT *i,
+    FILTER_TOKEN *token)
+{
+    UINT j = *i;
+
+    while (filter[j] != '"')
+    {
+        switch (filter[j])
+        {
+            case '\0':
+                return FALSE;
+            case '\\':
+                j++;
+                switch (filter[j])
+                {
+                    case '\\': case '"': case 'r': case 'n': case 't':
+                        break;
+                    case 'x':
+                        if (!isxdigit(filter[j+1]) || !isxdigit(filter[j+2]))
+                        {
+                            return FALSE;
+                        }
+                        j += 2;
+                        break;
+                    default:
+                        return FALSE;
+                }
+                break;
+            default:
+                break;
+        }
+        j++;
+    }
+    token->str = filter + *i;
+    token->len = j - *i;
+    *i = j + 1;
+    return TRUE;
+}
+
+/*
+ * Tokenize a pattern set, i.e. {"string", ...}; *i is the index following
+ * the opening brace.
+ */
+static BOOL WinDivertTokenizeStrings(const char *filter, UINT *i,
+    FILTER_TOKEN *token)
+{
+    FILTER_TOKEN string;
+    UINT j = *i;
+
+    while (TRUE)
+    {
+        while (isspace(filter[j]))
+        {
+            j++;
+        }
+        if (filter[j++] != '"' ||
+            !WinDivertTokenizeString(filter, &j, &string))
+        {
+            return FALSE;
+        }
+        while (isspace(filter[j]))
+        {
+            j++;
+        }
+        if (filter[j] == '}')
+        {
+            break;
+        }
+        if (filter[j++] != ',')
+        {
+            return FALSE;
+        }
+    }
+    token->str = filter + *i;
+    token->len = j - *i;
+    *i = j + 1;
+    return TRUE;
+}
+
+/*
+ * Decode a (validated) string literal into buf.  Returns the decoded length,
+ * or (UINT)-1 if buf is too small.
+ */
+static UINT WinDivertDecodeString(const char *str, UINT len, UINT8 *buf,
+    UINT buflen)
+{
+    UINT i, j;
+    char hex[3];
+
+    for (i = 0, j = 0; i < len; i++, j++)
+    {
+        if (j >= buflen)
+        {
+            return (UINT)-1;
+        }
+        if (str[i] != '\\')
+        {
+            buf[j] = (UINT8)str[i];
+            continue;
+        }
+        i++;
+        switch (str[i])
+        {
+            case 'r':
+                buf[j] = '\r';
+                break;
+            case 'n':
+                buf[j] = '\n';
+                break;
+            case 't':
+                buf[j] = '\t';
+                break;
+            case 'x':
+                hex[0] = str[i+1];
+                hex[1] = str[i+2];
+                hex[2] = '\0';
+                buf[j] = (UINT8)strtoul(hex, NULL, 16);
+                i += 2;
+                break;
+            default:
+                buf[j] = (UINT8)str[i];
+                break;
+        }
+    }
+    return j;
+}
+
+/*
+ * Parse the given filter.
+ */
+static BOOL WinDivertParseFilter(FILTER_TOKEN *tokens, UINT16 *tp,
+    windivert_ioctl_filter_t filter, UINT16 *fp, FILTER_TOKEN_KIND op)
+{
+    BOOL testop, fused, result, negate, contains, payload;
+    FILTER_TOKEN token;
+    UINT16 f, s;
+    s = *fp;
+
+WinDivertParseFilterNext:
+
+    testop = TRUE;
+    fused = TRUE;
+    negate = FALSE;
+    token = tokens[*tp];
+
+    *tp = *tp + 1;
+    f = *fp;
+    if (f >= WINDIVERT_FILTER_MAXLEN)
+    {
+        return FALSE;
+    }
+    filter[f].success = WINDIVERT_FILTER_RESULT_ACCEPT;
+    filter[f].failure = WINDIVERT_FILTER_RESULT_REJECT;
+    filter[f].offset = 0;
+    filter[f].length = 0;
+    filter[f].arg[1] = 0;
+    filter[f].arg[2] = 0;
+    filter[f].arg[3] = 0;
+    if (token.kind == FILTER_TOKEN_NOT)
+    {
+        negate = TRUE;
+        token = tokens[*tp];
+        *tp = *tp + 1;
+    }
+    switch (token.kind)
+    {
+        case FILTER_TOKEN_OPEN:
+            result = WinDivertParseFilter(tokens, tp, filter, fp,
+                FILTER_TOKEN_AND);
+            result = (result? (tokens[*tp].kind == FILTER_TOKEN_CLOSE): FALSE);
+            if (!result)
+            {
+                return FALSE;
+            }
+            *tp = *tp + 1;
+            if (negate)
+            {
+                WinDivertFilterUpdate(filter, f, *fp,
+                    WINDIVERT_FILTER_RESULT_REJECT,
+                    WINDIVERT_FILTER_RESULT_ACCEPT);
+            }
+            testop = FALSE;
+            fused = FALSE;
+            break;
+        case FILTER_TOKEN_TRUE: case FILTER_TOKEN_FALSE:
+            filter[f].field  = WINDIVERT_FILTER_FIELD_ZERO;
+            filter[f].test   = WINDIVERT_FILTER_TEST_EQ;
+            filter[f].arg[0] = (token.kind == FILTER_TOKEN_FALSE);
+            testop = FALSE;
+            break;
+        case FILTER_TOKEN_OUTBOUND:
+            filter[f].field = WINDIVERT_FILTER_FIELD_OUTBOUND;
+            break;
+        case FILTER_TOKEN_INBOUND:
+            filter[f].field = WINDIVERT_FILTER_FIELD_INBOUND;
+            break;
+        case FILTER_TOKEN_IF_IDX:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IFIDX;
+            break;
+        case FILTER_TOKEN_SUB_IF_IDX:
+            filter[f].field = WINDIVERT_FILTER_FIELD_SUBIFIDX;
+            break;
+        case FILTER_TOKEN_IP:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IP;
+            break;
+        case FILTER_TOKEN_IPV6:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IPV6;
+            break;
+        case FILTER_TOKEN_ICMP:
+            filter[f].field = WINDIVERT_FILTER_FIELD_ICMP;
+            break;
+        case FILTER_TOKEN_ICMPV6:
+            filter[f].field = WINDIVERT_FILTER_FIELD_ICMPV6;
+            break;
+        case FILTER_TOKEN_TCP:
+            filter[f].field = WINDIVERT_FILTER_FIELD_TCP;
+            break;
+        case FILTER_TOKEN_UDP:
+            filter[f].field = WINDIVERT_FILTER_FIELD_UDP;
+            break;
+        case FILTER_TOKEN_IP_HDR_LENGTH:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IP_HDRLENGTH;
+            break;
+        case FILTER_TOKEN_IP_TOS:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IP_TOS;
+            break;
+        case FILTER_TOKEN_IP_LENGTH:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IP_LENGTH;
+            break;
+        case FILTER_TOKEN_IP_ID:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IP_ID;
+            break;
+        case FILTER_TOKEN_IP_DF:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IP_DF;
+            break;
+        case FILTER_TOKEN_IP_MF:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IP_MF;
+            break;
+        case FILTER_TOKEN_IP_FRAG_OFF:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IP_FRAGOFF;
+            break;
+        case FILTER_TOKEN_IP_TTL:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IP_TTL;
+            break;
+        case FILTER_TOKEN_IP_PROTOCOL:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IP_PROTOCOL;
+            break;
+        case FILTER_TOKEN_IP_CHECKSUM:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IP_CHECKSUM;
+            break;
+        case FILTER_TOKEN_IP_SRC_ADDR:
+            filter[f].field = WINDIVERT_FILTER_FIELD_IP_SRCADDR;
+            break;
+        case FILTER_TOKEN_IP_DST_ADDR:
             filter[f].field = WINDIVERT_FILTER_FIELD_IP_DSTADDR;
             break;
         case FILTER_TOKEN_IPV6_TRAFFIC_CLASS:
@@ -1456,688 +2711,3451 @@ WinDivertParseFilterNext:
         case FILTER_TOKEN_TCP_ACK_NUM:
             filter[f].field = WINDIVERT_FILTER_FIELD_TCP_ACKNUM;
             break;
-        case FILTER_TOKEN_TCP_HDR_LENGTH:
-            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_HDRLENGTH;
+        case FILTER_TOKEN_TCP_HDR_LENGTH:
+            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_HDRLENGTH;
+            break;
+        case FILTER_TOKEN_TCP_URG:
+            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_URG;
+            break;
+        case FILTER_TOKEN_TCP_ACK:
+            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_ACK;
+            break;
+        case FILTER_TOKEN_TCP_PSH:
+            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_PSH;
+            break;
+        case FILTER_TOKEN_TCP_RST:
+            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_RST;
+            break;
+        case FILTER_TOKEN_TCP_SYN:
+            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_SYN;
+            break;
+        case FILTER_TOKEN_TCP_FIN:
+            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_FIN;
+            break;
+        case FILTER_TOKEN_TCP_WINDOW:
+            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_WINDOW;
+            break;
+        case FILTER_TOKEN_TCP_CHECKSUM:
+            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_CHECKSUM;
+            break;
+        case FILTER_TOKEN_TCP_URG_PTR:
+            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_URGPTR;
+            break;
+        case FILTER_TOKEN_TCP_PAYLOAD_LENGTH:
+            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_PAYLOADLENGTH;
+            break;
+        case FILTER_TOKEN_TCP_PAYLOAD: case FILTER_TOKEN_TCP_PAYLOAD16:
+        case FILTER_TOKEN_TCP_PAYLOAD32:
+            filter[f].field  = WINDIVERT_FILTER_FIELD_TCP_PAYLOAD;
+            filter[f].offset = (UINT16)token.val[0];
+            filter[f].length = (UINT8)token.val[1];
+            break;
+        case FILTER_TOKEN_UDP_SRC_PORT:
+            filter[f].field = WINDIVERT_FILTER_FIELD_UDP_SRCPORT;
+            break;
+        case FILTER_TOKEN_UDP_DST_PORT:
+            filter[f].field = WINDIVERT_FILTER_FIELD_UDP_DSTPORT;
+            break;
+        case FILTER_TOKEN_UDP_LENGTH:
+            filter[f].field = WINDIVERT_FILTER_FIELD_UDP_LENGTH;
+            break;
+        case FILTER_TOKEN_UDP_CHECKSUM:
+            filter[f].field = WINDIVERT_FILTER_FIELD_UDP_CHECKSUM;
+            break;
+        case FILTER_TOKEN_UDP_PAYLOAD_LENGTH:
+            filter[f].field = WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH;
+            break;
+        case FILTER_TOKEN_UDP_PAYLOAD: case FILTER_TOKEN_UDP_PAYLOAD16:
+        case FILTER_TOKEN_UDP_PAYLOAD32:
+            filter[f].field  = WINDIVERT_FILTER_FIELD_UDP_PAYLOAD;
+            filter[f].offset = (UINT16)token.val[0];
+            filter[f].length = (UINT8)token.val[1];
+            break;
+        default:
+            return FALSE;
+    }
+
+    if (fused)
+    {
+        *fp = f+1;
+    }
+
+    if (testop)
+    {
+        token = tokens[*tp];
+        if (!negate)
+        {
+            switch (token.kind)
+            {
+                case FILTER_TOKEN_EQ:
+                    filter[f].test = WINDIVERT_FILTER_TEST_EQ;
+                    break;
+                case FILTER_TOKEN_NEQ:
+                    filter[f].test = WINDIVERT_FILTER_TEST_NEQ;
+                    break;
+                case FILTER_TOKEN_LT:
+                    filter[f].test = WINDIVERT_FILTER_TEST_LT;
+                    break;
+                case FILTER_TOKEN_LEQ:
+                    filter[f].test = WINDIVERT_FILTER_TEST_LEQ;
+                    break;
+                case FILTER_TOKEN_GT:
+                    filter[f].test = WINDIVERT_FILTER_TEST_GT;
+                    break;
+                case FILTER_TOKEN_GEQ:
+                    filter[f].test = WINDIVERT_FILTER_TEST_GEQ;
+                    break;
+                case FILTER_TOKEN_CONTAINS:
+                    filter[f].test = WINDIVERT_FILTER_TEST_CONTAINS;
+                    break;
+                default:
+                    filter[f].test = WINDIVERT_FILTER_TEST_NEQ;
+                    filter[f].arg[0] = 0;
+                    testop = FALSE;
+                    break;
+            }
+        }
+        else
+        {
+            switch (token.kind)
+            {
+                case FILTER_TOKEN_EQ:
+                    filter[f].test = WINDIVERT_FILTER_TEST_NEQ;
+                    break;
+                case FILTER_TOKEN_NEQ:
+                    filter[f].test = WINDIVERT_FILTER_TEST_EQ;
+                    break;
+                case FILTER_TOKEN_LT:
+                    filter[f].test = WINDIVERT_FILTER_TEST_GEQ;
+                    break;
+                case FILTER_TOKEN_LEQ:
+                    filter[f].test = WINDIVERT_FILTER_TEST_GT;
+                    break;
+                case FILTER_TOKEN_GT:
+                    filter[f].test = WINDIVERT_FILTER_TEST_LEQ;
+                    break;
+                case FILTER_TOKEN_GEQ:
+                    filter[f].test = WINDIVERT_FILTER_TEST_LT;
+                    break;
+                case FILTER_TOKEN_CONTAINS:
+                    filter[f].test = WINDIVERT_FILTER_TEST_NCONTAINS;
+                    break;
+                default:
+                    filter[f].test = WINDIVERT_FILTER_TEST_EQ;
+                    filter[f].arg[0] = 0;
+                    testop = FALSE;
+                    break;
+            }
+        }
+
+        contains = (filter[f].test == WINDIVERT_FILTER_TEST_CONTAINS ||
+                    filter[f].test == WINDIVERT_FILTER_TEST_NCONTAINS);
+        if (testop)
+        {
+            *tp = *tp + 1;
+            token = tokens[*tp];
+            *tp = *tp + 1;
+            if (contains)
+            {
+                // The pattern set is compiled into an automaton once parsing
+                // is complete; until then arg[0] is the index of its token.
+                if (token.kind != FILTER_TOKEN_STRING &&
+                    token.kind != FILTER_TOKEN_STRINGS)
+                {
+                    return FALSE;
+                }
+                token.val[0] = *tp - 1;
+            }
+            else if (token.kind == FILTER_TOKEN_STRING)
+            {
+                // A string literal must exactly match the payload length:
+                UINT8 bytes[WINDIVERT_FILTER_PAYLOAD_MAXWIDTH];
+                UINT i, len;
+                if (filter[f].length == 0)
+                {
+                    return FALSE;
+                }
+                len = WinDivertDecodeString(token.str, token.len, bytes,
+                    sizeof(bytes));
+                if (len != filter[f].length)
+                {
+                    return FALSE;
+                }
+                for (i = 0; i < len; i++)
+                {
+                    token.val[3] = (token.val[3] << 8) | (token.val[2] >> 24);
+                    token.val[2] = (token.val[2] << 8) | (token.val[1] >> 24);
+                    token.val[1] = (token.val[1] << 8) | (token.val[0] >> 24);
+                    token.val[0] = (token.val[0] << 8) | (UINT32)bytes[i];
+                }
+            }
+            else if (token.kind != FILTER_TOKEN_NUMBER)
+            {
+                return FALSE;
+            }
+            else if (filter[f].length != 0 &&
+                     filter[f].length < WINDIVERT_FILTER_PAYLOAD_MAXWIDTH)
+            {
+                // A number literal must fit in the payload width:
+                UINT bits = 8 * filter[f].length;
+                UINT word = bits / 32;
+                if ((bits % 32 != 0 &&
+                     (token.val[word] >> (bits % 32)) != 0) ||
+                    (word < 3 && token.val[3] != 0) ||
+                    (word < 2 && token.val[2] != 0) ||
+                    (word < 1 && token.val[1] != 0))
+                {
+                    return FALSE;
+                }
+            }
+            filter[f].arg[0] = token.val[0];
+            filter[f].arg[1] = token.val[1];
+            filter[f].arg[2] = token.val[2];
+            filter[f].arg[3] = token.val[3];
+        }
+
+        // Only the (n)contains tests apply to the whole payload:
+        payload = ((filter[f].field == WINDIVERT_FILTER_FIELD_TCP_PAYLOAD ||
+                    filter[f].field == WINDIVERT_FILTER_FIELD_UDP_PAYLOAD) &&
+                   filter[f].length == 0);
+        if (contains != payload)
+        {
+            return FALSE;
+        }
+    }
+
+    token = tokens[*tp];
+    if (token.kind != FILTER_TOKEN_AND && token.kind != FILTER_TOKEN_OR)
+    {
+        return TRUE;
+    }
+    if (op < token.kind)
+    {
+        op = token.kind;
+        f = s;
+    }
+    *tp = *tp + 1;
+    switch (token.kind)
+    {
+        case FILTER_TOKEN_AND:
+            WinDivertFilterUpdate(filter, f, *fp, *fp,
+                WINDIVERT_FILTER_RESULT_REJECT);
+            goto WinDivertParseFilterNext;
+        case FILTER_TOKEN_OR:
+            WinDivertFilterUpdate(filter, f, *fp,
+                WINDIVERT_FILTER_RESULT_ACCEPT, *fp);
+            goto WinDivertParseFilterNext;
+        default:
+            break;
+    }
+    return TRUE;
+}
+
+/*
+ * Update success.
+ */
+static void WinDivertFilterUpdate(windivert_ioctl_filter_t filter, UINT16 s,
+    UINT16 e, UINT16 success, UINT16 failure)
+{
+    UINT16 i;
+
+    for (i = s; i < e; i++)
+    {
+        switch (filter[i].success)
+        {
+            case WINDIVERT_FILTER_RESULT_ACCEPT:
+                filter[i].success = success;
+                break;
+            case WINDIVERT_FILTER_RESULT_REJECT:
+                filter[i].success = failure;
+                break;
+        }
+        switch (filter[i].failure)
+        {
+            case WINDIVERT_FILTER_RESULT_ACCEPT:
+                filter[i].failure = success;
+                break;
+            case WINDIVERT_FILTER_RESULT_REJECT:
+                filter[i].failure = failure;
+                break;
+        }
+    }
+}
+
+/*
+ * Compile a pattern set (a STRING or STRINGS token) into an Aho-Corasick
+ * automaton, and append it to the automata buffer.  The automaton is a DFA
+ * over byte classes (bytes that appear in no pattern share class 0).  The
+ * search stops at the first match, so all accepting states are merged into
+ * the single match state.
+ */
+static BOOL WinDivertCompileAutomaton(const FILTER_TOKEN *token,
+    UINT8 **automata_ptr, UINT *automata_len_ptr)
+{
+    FILTER_TOKEN pattern;
+    windivert_ioctl_automaton_t automaton;
+    UINT8 map[256], *bytes = NULL, *accept = NULL, *automata;
+    UINT32 *trie = NULL, *fail = NULL, *queue = NULL, *next;
+    UINT i, j, len, used, classes, nodes, max_nodes, head, tail;
+    size_t size;
+    UINT32 s, t, c;
+    BOOL result = FALSE;
+
+    // Find the byte classes, and bound the number of trie nodes (node 0 is
+    // unused and node 1 is the root):
+    bytes = (UINT8 *)malloc(token->len + 1);
+    if (bytes == NULL)
+    {
+        goto WinDivertCompileAutomatonExit;
+    }
+    memset(map, 0, sizeof(map));
+    max_nodes = 2;
+    i = 0;
+    while (WinDivertNextPattern(token, &i, &pattern))
+    {
+        len = WinDivertDecodeString(pattern.str, pattern.len, bytes,
+            token->len);
+        if (len == 0 || len == (UINT)-1)
+        {
+            goto WinDivertCompileAutomatonExit;
+        }
+        for (j = 0; j < len; j++)
+        {
+            map[bytes[j]] = 1;
+        }
+        max_nodes += len;
+    }
+    for (i = 0, used = 0; i < sizeof(map); i++)
+    {
+        used += map[i];
+    }
+    classes = (used == sizeof(map)? 0: 1);
+    for (i = 0; i < sizeof(map); i++)
+    {
+        map[i] = (map[i] != 0? (UINT8)classes++: 0);
+    }
+    if (max_nodes > UINT32_MAX / sizeof(UINT32) / classes)
+    {
+        goto WinDivertCompileAutomatonExit;
+    }
+
+    // Build the trie.  Patterns that extend another pattern are redundant.
+    trie = (UINT32 *)calloc(max_nodes * classes, sizeof(UINT32));
+    accept = (UINT8 *)calloc(max_nodes, sizeof(UINT8));
+    if (trie == NULL || accept == NULL)
+    {
+        goto WinDivertCompileAutomatonExit;
+    }
+    nodes = 2;
+    i = 0;
+    while (WinDivertNextPattern(token, &i, &pattern))
+    {
+        len = WinDivertDecodeString(pattern.str, pattern.len, bytes,
+            token->len);
+        for (j = 0, s = 1; j < len && !accept[s]; j++)
+        {
+            c = map[bytes[j]];
+            t = trie[s * classes + c];
+            if (t == 0)
+            {
+                t = nodes++;
+                trie[s * classes + c] = t;
+            }
+            s = t;
+        }
+        accept[s] = 1;
+    }
+
+    // Breadth-first, compute the failure links and complete the transitions
+    // of each non-accepting state.  The failure link of a state is always
+    // shallower, so its transitions are already complete.
+    fail = (UINT32 *)calloc(nodes, sizeof(UINT32));
+    queue = (UINT32 *)malloc(nodes * sizeof(UINT32));
+    if (fail == NULL || queue == NULL)
+    {
+        goto WinDivertCompileAutomatonExit;
+    }
+    head = tail = 0;
+    queue[tail++] = 1;
+    fail[1] = 1;
+    while (head < tail)
+    {
+        s = queue[head++];
+        for (c = 0; c < classes; c++)
+        {
+            t = trie[s * classes + c];
+            if (t == 0)
+            {
+                trie[s * classes + c] =
+                    (s == 1? 1: trie[fail[s] * classes + c]);
+                continue;
+            }
+            fail[t] = (s == 1? 1: trie[fail[s] * classes + c]);
+            accept[t] |= accept[fail[t]];
+            if (!accept[t])
+            {
+                queue[tail++] = t;
+            }
+        }
+    }
+
+    // Number the non-accepting states in BFS order (the root is state 1),
+    // and map all accepting states to the match state:
+    for (i = 0; i < tail; i++)
+    {
+        fail[queue[i]] = i + 1;
+    }
+    for (i = 0; i < nodes; i++)
+    {
+        if (accept[i])
+        {
+            fail[i] = WINDIVERT_FILTER_AUTOMATON_MATCH;
+        }
+    }
+
+    size = sizeof(struct windivert_ioctl_automaton_s) +
+        (size_t)(tail + 1) * classes * sizeof(UINT32);
+    if (size > WINDIVERT_FILTER_AUTOMATA_MAXLEN - *automata_len_ptr)
+    {
+        goto WinDivertCompileAutomatonExit;
+    }
+    automata = (UINT8 *)realloc(*automata_ptr, *automata_len_ptr + size);
+    if (automata == NULL)
+    {
+        goto WinDivertCompileAutomatonExit;
+    }
+    *automata_ptr = automata;
+    automaton = (windivert_ioctl_automaton_t)(automata + *automata_len_ptr);
+    *automata_len_ptr += (UINT)size;
+    automaton->size     = (UINT32)size;
+    automaton->states   = tail + 1;
+    automaton->classes  = (UINT16)classes;
+    automaton->reserved = 0;
+    memcpy(automaton->map, map, sizeof(map));
+    next = (UINT32 *)(automaton + 1);
+    memset(next, 0, classes * sizeof(UINT32));
+    for (i = 0; i < tail; i++)
+    {
+        s = queue[i];
+        for (c = 0; c < classes; c++)
+        {
+            next[(i + 1) * classes + c] =
+                fail[trie[s * classes + c]] * classes;
+        }
+    }
+    result = TRUE;
+
+WinDivertCompileAutomatonExit:
+    free(bytes);
+    free(accept);
+    free(trie);
+    free(fail);
+    free(queue);
+    return result;
+}
+
+/*
+ * Get the next pattern of a pattern set; *i is the iterator (initially 0).
+ */
+static BOOL WinDivertNextPattern(const FILTER_TOKEN *token, UINT *i,
+    FILTER_TOKEN *pattern)
+{
+    if (token->kind == FILTER_TOKEN_STRING)
+    {
+        if (*i != 0)
+        {
+            return FALSE;
+        }
+        *i = token->len + 1;
+        pattern->str = token->str;
+        pattern->len = token->len;
+        return TRUE;
+    }
+
+    // FILTER_TOKEN_STRINGS (already validated by the tokenizer):
+    while (*i < token->len && token->str[*i] != '"')
+    {
+        (*i)++;
+    }
+    if (*i >= token->len)
+    {
+        return FALSE;
+    }
+    (*i)++;
+    return WinDivertTokenizeString(token->str, i, pattern);
+}
+
+/****************************************************************************/
+/* WINDIVERT HELPER IMPLEMENTATION                                          */
+/****************************************************************************/
+
+/*
+ * Parse IPv4/IPv6/ICMP/ICMPv6/TCP/UDP headers from a raw packet.
+ */
+extern BOOL WinDivertHelperParsePacket(PVOID pPacket, UINT packetLen,
+    PWINDIVERT_IPHDR *ppIpHdr, PWINDIVERT_IPV6HDR *ppIpv6Hdr,
+    PWINDIVERT_ICMPHDR *ppIcmpHdr, PWINDIVERT_ICMPV6HDR *ppIcmpv6Hdr,
+    PWINDIVERT_TCPHDR *ppTcpHdr, PWINDIVERT_UDPHDR *ppUdpHdr, PVOID *ppData,
+    UINT *pDataLen)
+{
+    PWINDIVERT_IPHDR ip_header = NULL;
+    PWINDIVERT_IPV6HDR ipv6_header = NULL;
+    PWINDIVERT_ICMPHDR icmp_header = NULL;
+    PWINDIVERT_ICMPV6HDR icmpv6_header = NULL;
+    PWINDIVERT_TCPHDR tcp_header = NULL;
+    PWINDIVERT_UDPHDR udp_header = NULL;
+    UINT16 header_len;
+    UINT8 trans_proto;
+    PVOID data = NULL;
+    UINT data_len = 0;
+    BOOL success;
+
+    if (pPacket == NULL || packetLen < sizeof(UINT8))
+    {
+        goto WinDivertHelperParsePacketExit;
+    }
+    data = pPacket;
+    data_len = packetLen;
+
+    ip_header = (PWINDIVERT_IPHDR)data;
+    switch (ip_header->Version)
+    {
+        case 4:
+            if (data_len < sizeof(WINDIVERT_IPHDR) ||
+                ip_header->HdrLength < 5 ||
+                data_len < ip_header->HdrLength*sizeof(UINT32) ||
+                ntohs(ip_header->Length) != data_len)
+            {
+                ip_header = NULL;
+                goto WinDivertHelperParsePacketExit;
+            }
+            trans_proto = ip_header->Protocol;
+            header_len = ip_header->HdrLength*sizeof(UINT32); 
+            data = (PVOID)((UINT8 *)data + header_len);
+            data_len -= header_len;
             break;
-        case FILTER_TOKEN_TCP_URG:
-            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_URG;
+        case 6:
+            ip_header = NULL;
+            ipv6_header = (PWINDIVERT_IPV6HDR)data;
+            if (data_len < sizeof(WINDIVERT_IPV6HDR) ||
+                ntohs(ipv6_header->Length) !=
+                    data_len - sizeof(WINDIVERT_IPV6HDR))
+            {
+                ipv6_header = NULL;
+                goto WinDivertHelperParsePacketExit;
+            }
+            trans_proto = ipv6_header->NextHdr;
+            data = (PVOID)((UINT8 *)data + sizeof(WINDIVERT_IPV6HDR));
+            data_len -= sizeof(WINDIVERT_IPV6HDR);
             break;
-        case FILTER_TOKEN_TCP_ACK:
-            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_ACK;
+        default:
+            ip_header = NULL;
+            goto WinDivertHelperParsePacketExit;
+    }
+
+    // Non-first IPv4 fragments do not contain a transport header:
+    if (ip_header != NULL && WINDIVERT_IPHDR_GET_FRAGOFF(ip_header) != 0)
+    {
+        goto WinDivertHelperParsePacketData;
+    }
+
+    switch (trans_proto)
+    {
+        case IPPROTO_TCP:
+            tcp_header = (PWINDIVERT_TCPHDR)data;
+            if (data_len < sizeof(WINDIVERT_TCPHDR) ||
+                tcp_header->HdrLength < 5 ||
+                data_len < tcp_header->HdrLength*sizeof(UINT32))
+            {
+                tcp_header = NULL;
+                goto WinDivertHelperParsePacketExit;
+            }
+            header_len = tcp_header->HdrLength*sizeof(UINT32);
+            data = ((UINT8 *)data + header_len);
+            data_len -= header_len;
             break;
-        case FILTER_TOKEN_TCP_PSH:
-            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_PSH;
+        case IPPROTO_UDP:
+            udp_header = (PWINDIVERT_UDPHDR)data;
+            if (data_len < sizeof(WINDIVERT_UDPHDR) ||
+                ntohs(udp_header->Length) != data_len)
+            {
+                udp_header = NULL;
+                goto WinDivertHelperParsePacketExit;
+            }
+            data = ((UINT8 *)data + sizeof(WINDIVERT_UDPHDR));
+            data_len -= sizeof(WINDIVERT_UDPHDR);
             break;
-        case FILTER_TOKEN_TCP_RST:
-            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_RST;
+        case IPPROTO_ICMP:
+            icmp_header = (PWINDIVERT_ICMPHDR)data;
+            if (ip_header == NULL ||
+                data_len < sizeof(WINDIVERT_ICMPHDR))
+            {
+                icmp_header = NULL;
+                goto WinDivertHelperParsePacketExit;
+            }
+            data = ((UINT8 *)data + sizeof(WINDIVERT_ICMPHDR));
+            data_len -= sizeof(WINDIVERT_ICMPHDR);
             break;
-        case FILTER_TOKEN_TCP_SYN:
-            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_SYN;
+        case IPPROTO_ICMPV6:
+            icmpv6_header = (PWINDIVERT_ICMPV6HDR)data;
+            if (ipv6_header == NULL ||
+                data_len < sizeof(WINDIVERT_ICMPV6HDR))
+            {
+                icmpv6_header = NULL;
+                goto WinDivertHelperParsePacketExit;
+            }
+            data = ((UINT8 *)data + sizeof(WINDIVERT_ICMPV6HDR));
+            data_len -= sizeof(WINDIVERT_ICMPV6HDR);
             break;
-        case FILTER_TOKEN_TCP_FIN:
-            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_FIN;
+        default:
             break;
-        case FILTER_TOKEN_TCP_WINDOW:
-            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_WINDOW;
+    }
+
+WinDivertHelperParsePacketData:
+    if (data_len == 0)
+    {
+        data = NULL;
+    }
+
+WinDivertHelperParsePacketExit:
+    success = TRUE;
+    if (ppIpHdr != NULL)
+    {
+        *ppIpHdr = ip_header;
+        success = success && (ip_header != NULL);
+    }
+    if (ppIpv6Hdr != NULL)
+    {
+        *ppIpv6Hdr = ipv6_header;
+        success = success && (ipv6_header != NULL);
+    }
+    if (ppIcmpHdr != NULL)
+    {
+        *ppIcmpHdr = icmp_header;
+        success = success && (icmp_header != NULL);
+    }
+    if (ppIcmpv6Hdr != NULL)
+    {
+        *ppIcmpv6Hdr = icmpv6_header;
+        success = success && (icmpv6_header != NULL);
+    }
+    if (ppTcpHdr != NULL)
+    {
+        *ppTcpHdr = tcp_header;
+        success = success && (tcp_header != NULL);
+    }
+    if (ppUdpHdr != NULL)
+    {
+        *ppUdpHdr = udp_header;
+        success = success && (udp_header != NULL);
+    }
+    if (ppData != NULL)
+    {
+        *ppData = data;
+        success = success && (data != NULL);
+    }
+    if (pDataLen != NULL)
+    {
+        *pDataLen = data_len;
+    }
+    return success;
+}
+
+/*
+ * Packets are parsed in chunks of this size so that per-packet intermediate
+ * results fit on the stack.
+ */
+#define WINDIVERT_BATCH_CHUNK           64
+
+/*
+ * Intermediate results for a chunk of packets, already in column form.
+ */
+typedef struct
+{
+    UINT8  version[WINDIVERT_BATCH_CHUNK];
+    UINT8  protocol[WINDIVERT_BATCH_CHUNK];
+    UINT32 src_addr[4*WINDIVERT_BATCH_CHUNK];
+    UINT32 dst_addr[4*WINDIVERT_BATCH_CHUNK];
+    UINT16 src_port[WINDIVERT_BATCH_CHUNK];
+    UINT16 dst_port[WINDIVERT_BATCH_CHUNK];
+    UINT   payload_offset[WINDIVERT_BATCH_CHUNK];
+    UINT   payload_len[WINDIVERT_BATCH_CHUNK];
+} WINDIVERT_BATCH_CHUNK_COLUMNS, *PWINDIVERT_BATCH_CHUNK_COLUMNS;
+
+/*
+ * Parse the network and transport headers of a single packet for
+ * WinDivertHelperParsePacketBatch() into entry j of the chunk.  Follows the
+ * same validation rules as WinDivertHelperParsePacket().
+ *
+ * All of a packet's fields are extracted here, while its headers are being
+ * examined anyway.  Filling each column by a separate pass over the packets
+ * would repeat the (data dependent, and so often mispredicted) branches on
+ * the version and protocol once per column.
+ */
+static BOOL WinDivertParseBatchHeaders(const UINT8 *packet, UINT packet_len,
+    PWINDIVERT_BATCH_CHUNK_COLUMNS chunk, UINT j)
+{
+    const WINDIVERT_IPHDR *ip_header;
+    const WINDIVERT_IPV6HDR *ipv6_header;
+    const WINDIVERT_TCPHDR *tcp_header;
+    const WINDIVERT_UDPHDR *udp_header;
+    UINT32 *src_addr = chunk->src_addr + 4*j;
+    UINT32 *dst_addr = chunk->dst_addr + 4*j;
+    UINT8 protocol;
+    UINT offset, header_len;
+
+    chunk->version[j] = 0;
+    chunk->protocol[j] = 0;
+    memset(src_addr, 0, 4*sizeof(UINT32));
+    memset(dst_addr, 0, 4*sizeof(UINT32));
+    chunk->src_port[j] = 0;
+    chunk->dst_port[j] = 0;
+    chunk->payload_offset[j] = 0;
+    chunk->payload_len[j] = 0;
+
+    if (packet == NULL || packet_len < sizeof(WINDIVERT_IPHDR))
+    {
+        return FALSE;
+    }
+    ip_header = (const WINDIVERT_IPHDR *)packet;
+    switch (ip_header->Version)
+    {
+        case 4:
+            offset = ip_header->HdrLength*sizeof(UINT32);
+            if (ip_header->HdrLength < 5 || packet_len < offset ||
+                ntohs(ip_header->Length) != packet_len)
+            {
+                return FALSE;
+            }
+            protocol = ip_header->Protocol;
+            src_addr[2] = dst_addr[2] = htonl((UINT32)0x0000FFFF);
+            src_addr[3] = ip_header->SrcAddr;
+            dst_addr[3] = ip_header->DstAddr;
             break;
-        case FILTER_TOKEN_TCP_CHECKSUM:
-            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_CHECKSUM;
+        case 6:
+            ipv6_header = (const WINDIVERT_IPV6HDR *)packet;
+            offset = sizeof(WINDIVERT_IPV6HDR);
+            if (packet_len < offset ||
+                ntohs(ipv6_header->Length) != packet_len - offset)
+            {
+                return FALSE;
+            }
+            protocol = ipv6_header->NextHdr;
+            memcpy(src_addr, ipv6_header->SrcAddr, 4*sizeof(UINT32));
+            memcpy(dst_addr, ipv6_header->DstAddr, 4*sizeof(UINT32));
             break;
-        case FILTER_TOKEN_TCP_URG_PTR:
-            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_URGPTR;
+        default:
+            return FALSE;
+    }
+
+    chunk->version[j] = (UINT8)ip_header->Version;
+    chunk->protocol[j] = protocol;
+
+    // Non-first IPv4 fragments do not contain a transport header:
+    if (ip_header->Version == 4 &&
+        WINDIVERT_IPHDR_GET_FRAGOFF(ip_header) != 0)
+    {
+        goto WinDivertParseBatchHeadersExit;
+    }
+
+    switch (protocol)
+    {
+        case IPPROTO_TCP:
+            tcp_header = (const WINDIVERT_TCPHDR *)(packet + offset);
+            if (packet_len - offset < sizeof(WINDIVERT_TCPHDR) ||
+                tcp_header->HdrLength < 5 ||
+                packet_len - offset < tcp_header->HdrLength*sizeof(UINT32))
+            {
+                break;
+            }
+            header_len = tcp_header->HdrLength*sizeof(UINT32);
+            chunk->src_port[j] = tcp_header->SrcPort;
+            chunk->dst_port[j] = tcp_header->DstPort;
+            offset += header_len;
             break;
-        case FILTER_TOKEN_TCP_PAYLOAD_LENGTH:
-            filter[f].field = WINDIVERT_FILTER_FIELD_TCP_PAYLOADLENGTH;
+        case IPPROTO_UDP:
+            udp_header = (const WINDIVERT_UDPHDR *)(packet + offset);
+            if (packet_len - offset < sizeof(WINDIVERT_UDPHDR) ||
+                ntohs(udp_header->Length) != packet_len - offset)
+            {
+                break;
+            }
+            chunk->src_port[j] = udp_header->SrcPort;
+            chunk->dst_port[j] = udp_header->DstPort;
+            offset += sizeof(WINDIVERT_UDPHDR);
             break;
-        case FILTER_TOKEN_UDP_SRC_PORT:
-            filter[f].field = WINDIVERT_FILTER_FIELD_UDP_SRCPORT;
+        case IPPROTO_ICMP:
+            if (ip_header->Version == 4 &&
+                packet_len - offset >= sizeof(WINDIVERT_ICMPHDR))
+            {
+                offset += sizeof(WINDIVERT_ICMPHDR);
+            }
             break;
-        case FILTER_TOKEN_UDP_DST_PORT:
-            filter[f].field = WINDIVERT_FILTER_FIELD_UDP_DSTPORT;
+        case IPPROTO_ICMPV6:
+            if (ip_header->Version == 6 &&
+                packet_len - offset >= sizeof(WINDIVERT_ICMPV6HDR))
+            {
+                offset += sizeof(WINDIVERT_ICMPV6HDR);
+            }
             break;
-        case FILTER_TOKEN_UDP_LENGTH:
-            filter[f].field = WINDIVERT_FILTER_FIELD_UDP_LENGTH;
+        default:
             break;
-        case FILTER_TOKEN_UDP_CHECKSUM:
-            filter[f].field = WINDIVERT_FILTER_FIELD_UDP_CHECKSUM;
+    }
+
+WinDivertParseBatchHeadersExit:
+    chunk->payload_offset[j] = offset;
+    chunk->payload_len[j] = packet_len - offset;
+    return TRUE;
+}
+
+/*
+ * Parse a batch of raw packets into columns.
+ */
+extern UINT WinDivertHelperParsePacketBatch(const PVOID *pPackets,
+    const UINT *packetLens, UINT count, PWINDIVERT_PACKET_COLUMNS pColumns)
+{
+    WINDIVERT_BATCH_CHUNK_COLUMNS chunk;
+    UINT i, j, n, result = 0;
+
+    if (pPackets == NULL || packetLens == NULL || pColumns == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+
+    for (i = 0; i < count; i += n)
+    {
+        n = count - i;
+        n = (n > WINDIVERT_BATCH_CHUNK? WINDIVERT_BATCH_CHUNK: n);
+
+        // (1) Parse every packet in the chunk:
+        for (j = 0; j < n; j++)
+        {
+            if (WinDivertParseBatchHeaders((const UINT8 *)pPackets[i+j],
+                    packetLens[i+j], &chunk, j))
+            {
+                result++;
+            }
+        }
+
+        // (2) Copy out each requested column:
+        if (pColumns->Version != NULL)
+        {
+            memcpy(pColumns->Version + i, chunk.version, n*sizeof(UINT8));
+        }
+        if (pColumns->Protocol != NULL)
+        {
+            memcpy(pColumns->Protocol + i, chunk.protocol, n*sizeof(UINT8));
+        }
+        if (pColumns->SrcAddr != NULL)
+        {
+            memcpy(pColumns->SrcAddr + 4*i, chunk.src_addr,
+                4*n*sizeof(UINT32));
+        }
+        if (pColumns->DstAddr != NULL)
+        {
+            memcpy(pColumns->DstAddr + 4*i, chunk.dst_addr,
+                4*n*sizeof(UINT32));
+        }
+        if (pColumns->SrcPort != NULL)
+        {
+            memcpy(pColumns->SrcPort + i, chunk.src_port, n*sizeof(UINT16));
+        }
+        if (pColumns->DstPort != NULL)
+        {
+            memcpy(pColumns->DstPort + i, chunk.dst_port, n*sizeof(UINT16));
+        }
+        if (pColumns->PayloadOffset != NULL)
+        {
+            memcpy(pColumns->PayloadOffset + i, chunk.payload_offset,
+                n*sizeof(UINT));
+        }
+        if (pColumns->PayloadLength != NULL)
+        {
+            memcpy(pColumns->PayloadLength + i, chunk.payload_len,
+                n*sizeof(UINT));
+        }
+    }
+
+    return result;
+}
+
+/*
+ * Calculate IPv4/IPv6/ICMP/ICMPv6/TCP/UDP checksums.
+ */
+extern UINT WinDivertHelperCalcChecksums(PVOID pPacket, UINT packetLen,
+    UINT64 flags)
+{
+    WINDIVERT_PSEUDOHDR pseudo_header;
+    WINDIVERT_PSEUDOV6HDR pseudov6_header;
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_ICMPHDR icmp_header;
+    PWINDIVERT_ICMPV6HDR icmpv6_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_UDPHDR udp_header;
+    UINT payload_len, checksum_len;
+    UINT count = 0;
+
+    WinDivertHelperParsePacket(pPacket, packetLen, &ip_header, &ipv6_header,
+        &icmp_header, &icmpv6_header, &tcp_header, &udp_header, NULL,
+        &payload_len);
+
+    if (ip_header != NULL && !(flags & WINDIVERT_HELPER_NO_IP_CHECKSUM))
+    {
+        ip_header->Checksum = 0;
+        ip_header->Checksum = WinDivertHelperCalcChecksum(NULL, 0,
+            ip_header, ip_header->HdrLength*sizeof(UINT32));
+        count++;
+    }
+
+    if (icmp_header != NULL)
+    {
+        if (flags & WINDIVERT_HELPER_NO_ICMP_CHECKSUM)
+        {
+            return count;
+        }
+        icmp_header->Checksum = 0;
+        icmp_header->Checksum = WinDivertHelperCalcChecksum(NULL, 0,
+            icmp_header, payload_len + sizeof(WINDIVERT_ICMPHDR));
+        count++;
+        return count;
+    }
+
+    if (icmpv6_header != NULL)
+    {
+        if (flags & WINDIVERT_HELPER_NO_ICMPV6_CHECKSUM)
+        {
+            return count;
+        }
+        checksum_len = payload_len + sizeof(WINDIVERT_ICMPV6HDR);
+        WinDivertInitPseudoHeaderV6(ipv6_header, &pseudov6_header,
+            IPPROTO_ICMPV6, checksum_len);
+        icmpv6_header->Checksum = 0;
+        icmpv6_header->Checksum = WinDivertHelperCalcChecksum(&pseudov6_header,
+            sizeof(pseudov6_header), icmpv6_header, checksum_len);
+        count++;
+        return count;
+    }
+
+    if (tcp_header != NULL)
+    {
+        if (flags & WINDIVERT_HELPER_NO_TCP_CHECKSUM)
+        {
+            return count;
+        }
+        checksum_len = payload_len + tcp_header->HdrLength*sizeof(UINT32);
+        if (ip_header != NULL)
+        {
+            WinDivertInitPseudoHeader(ip_header, &pseudo_header, IPPROTO_TCP,
+                checksum_len);
+            tcp_header->Checksum = 0;
+            tcp_header->Checksum = WinDivertHelperCalcChecksum(&pseudo_header,
+                sizeof(pseudo_header), tcp_header, checksum_len);
+        }
+        else
+        {
+            WinDivertInitPseudoHeaderV6(ipv6_header, &pseudov6_header,
+                IPPROTO_TCP, checksum_len);
+            tcp_header->Checksum = 0;
+            tcp_header->Checksum = WinDivertHelperCalcChecksum(&pseudov6_header,
+                sizeof(pseudov6_header), tcp_header, checksum_len);
+        }
+        count++;
+        return count;
+    }
+
+    if (udp_header != NULL)
+    {
+        if (flags & WINDIVERT_HELPER_NO_UDP_CHECKSUM)
+        {
+            return count;
+        }
+        checksum_len = payload_len + sizeof(WINDIVERT_UDPHDR);
+        if (ip_header != NULL)
+        {
+            WinDivertInitPseudoHeader(ip_header, &pseudo_header, IPPROTO_UDP, 
+                checksum_len);
+            udp_header->Checksum = 0;
+            udp_header->Checksum = WinDivertHelperCalcChecksum(&pseudo_header,
+                sizeof(pseudo_header), udp_header, checksum_len);
+            if (udp_header->Checksum == 0)
+            {
+                udp_header->Checksum = 0xFFFF;
+            }
+        }
+        else
+        {
+            WinDivertInitPseudoHeaderV6(ipv6_header, &pseudov6_header,
+                IPPROTO_UDP, checksum_len);
+            udp_header->Checksum = 0;
+            udp_header->Checksum = WinDivertHelperCalcChecksum(&pseudov6_header,
+                sizeof(pseudov6_header), udp_header, checksum_len);
+        }
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Initialize the IP pseudo header.
+ */
+static void WinDivertInitPseudoHeader(PWINDIVERT_IPHDR ip_header,
+    PWINDIVERT_PSEUDOHDR pseudo_header, UINT8 protocol, UINT len)
+{
+    pseudo_header->SrcAddr  = ip_header->SrcAddr;
+    pseudo_header->DstAddr  = ip_header->DstAddr;
+    pseudo_header->Zero     = 0;
+    pseudo_header->Protocol = protocol;
+    pseudo_header->Length   = htons((UINT16)len);
+}
+
+/*
+ * Initialize the IPv6 pseudo header.
+ */
+static void WinDivertInitPseudoHeaderV6(PWINDIVERT_IPV6HDR ipv6_header,
+    PWINDIVERT_PSEUDOV6HDR pseudov6_header, UINT8 protocol, UINT len)
+{
+    memcpy(pseudov6_header->SrcAddr, ipv6_header->SrcAddr,
+        sizeof(pseudov6_header->SrcAddr));
+    memcpy(pseudov6_header->DstAddr, ipv6_header->DstAddr,
+        sizeof(pseudov6_header->DstAddr));
+    pseudov6_header->Length  = htonl((UINT32)len);
+    pseudov6_header->NextHdr = protocol;
+    pseudov6_header->Zero    = 0;
+}
+
+/*
+ * Generic checksum computation.
+ */
+static UINT16 WinDivertHelperCalcChecksum(PVOID pseudo_header,
+    UINT16 pseudo_header_len, PVOID data, UINT len)
+{
+    register const UINT16 *data16 = (const UINT16 *)pseudo_header;
+    register size_t len16 = pseudo_header_len >> 1;
+    register UINT32 sum = 0;
+    size_t i;
+
+    // Pseudo header:
+    for (i = 0; i < len16; i++)
+    {
+        sum += (UINT32)data16[i];
+    }
+
+    // Main data:
+    data16 = (const UINT16 *)data;
+    len16 = len >> 1;
+    for (i = 0; i < len16; i++)
+    {
+        sum += (UINT32)data16[i];
+    }
+
+    if (len & 0x1)
+    {
+        const UINT8 *data8 = (const UINT8 *)data;
+        sum += (UINT16)data8[len-1];
+    }
+
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum += (sum >> 16);
+    sum = ~sum;
+    return (UINT16)sum;
+}
+
+/*
+ * IPv4/IPv6 fragment reassembly.
+ */
+#define WINDIVERT_REASSEMBLY_MAXLEN     0xFFFF
+#define WINDIVERT_REASSEMBLY_UNITS      \
+    ((WINDIVERT_REASSEMBLY_MAXLEN + 7) / 8)
+#define WINDIVERT_REASSEMBLY_HDRLEN     128
+#define WINDIVERT_REASSEMBLY_MAGIC      0x4D534552
+
+typedef struct
+{
+    BOOL used;                              // Entry in use?
+    DWORD start;                            // Tick count of first fragment
+    UINT8 version;                          // Key (4 or 6)
+    UINT8 protocol;                         // Key (IPv4 only)
+    UINT32 id;                              // Key (network order)
+    UINT32 src_addr[4];                     // Key (network order)
+    UINT32 dst_addr[4];
+    UINT8 next_hdr;                         // IPv6 upper-layer protocol
+    UINT next_hdr_offset;                   // IPv6 NextHdr field offset
+    UINT header_len;                        // First fragment's header length
+    UINT data_len;                          // Payload length (if known)
+    UINT units;                             // Number of 8-byte units seen
+    UINT end_unit;                          // One past highest unit seen
+    UINT8 header[WINDIVERT_REASSEMBLY_HDRLEN];
+                                            // First fragment's IP header
+                                            // (IPv6: unfragmentable part)
+    UINT8 map[WINDIVERT_REASSEMBLY_UNITS / 8];
+                                            // Received units bitmap
+    UINT8 *data;                            // Payload (from the pool)
+} WINDIVERT_REASSEMBLY_ENTRY, *PWINDIVERT_REASSEMBLY_ENTRY;
+
+typedef struct
+{
+    UINT32 magic;                           // WINDIVERT_REASSEMBLY_MAGIC
+    UINT timeout;                           // Datagram timeout (ms)
+    UINT num_entries;                       // Number of entries
+    PWINDIVERT_REASSEMBLY_ENTRY entries;    // Entries
+    UINT8 *pool;                            // Payload memory pool
+} WINDIVERT_REASSEMBLY, *PWINDIVERT_REASSEMBLY;
+
+/*
+ * A fragment, as parsed by WinDivertReassemblyParse().
+ */
+typedef struct
+{
+    UINT8 version;
+    UINT8 protocol;                         // Key (0 for IPv6)
+    UINT32 id;
+    UINT32 src_addr[4];
+    UINT32 dst_addr[4];
+    UINT8 next_hdr;                         // IPv6 upper-layer protocol
+    UINT next_hdr_offset;                   // IPv6 NextHdr field offset
+    UINT header_len;                        // Header (unfragmentable) length
+    UINT offset;                            // Fragment offset (bytes)
+    UINT frag_len;                          // Fragment data length
+    const UINT8 *frag_data;                 // Fragment data
+    BOOL last;                              // Last fragment?
+} WINDIVERT_REASSEMBLY_FRAGMENT, *PWINDIVERT_REASSEMBLY_FRAGMENT;
+
+/*
+ * Create an IPv4/IPv6 fragment reassembly context.
+ */
+extern HANDLE WinDivertHelperReassemblyOpen(UINT maxDatagrams, UINT timeout)
+{
+    PWINDIVERT_REASSEMBLY reasm;
+    UINT i;
+
+    if (maxDatagrams == 0 ||
+        maxDatagrams > WINDIVERT_REASSEMBLY_MAX_DATAGRAMS || timeout == 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // All memory is allocated up-front; the context never grows.
+    reasm = (PWINDIVERT_REASSEMBLY)malloc(sizeof(WINDIVERT_REASSEMBLY));
+    if (reasm == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    reasm->entries = (PWINDIVERT_REASSEMBLY_ENTRY)calloc(maxDatagrams,
+        sizeof(WINDIVERT_REASSEMBLY_ENTRY));
+    reasm->pool = (UINT8 *)malloc(maxDatagrams*WINDIVERT_REASSEMBLY_MAXLEN);
+    if (reasm->entries == NULL || reasm->pool == NULL)
+    {
+        free(reasm->entries);
+        free(reasm->pool);
+        free(reasm);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    for (i = 0; i < maxDatagrams; i++)
+    {
+        reasm->entries[i].data = reasm->pool + i*WINDIVERT_REASSEMBLY_MAXLEN;
+    }
+    reasm->magic = WINDIVERT_REASSEMBLY_MAGIC;
+    reasm->timeout = timeout;
+    reasm->num_entries = maxDatagrams;
+
+    return (HANDLE)reasm;
+}
+
+/*
+ * Parse an IPv4 fragment, or an IPv6 packet with a fragment header (after
+ * any hop-by-hop, routing or destination options headers).  Returns FALSE
+ * if the packet is not a valid fragment.
+ */
+static BOOL WinDivertReassemblyParse(const UINT8 *packet, UINT packet_len,
+    PWINDIVERT_REASSEMBLY_FRAGMENT frag)
+{
+    const WINDIVERT_IPHDR *ip_header = (const WINDIVERT_IPHDR *)packet;
+    const WINDIVERT_IPV6HDR *ipv6_header =
+        (const WINDIVERT_IPV6HDR *)packet;
+    const UINT8 *ext_header;
+    UINT16 frag_off;
+    UINT8 next_hdr;
+    UINT offset;
+
+    memset(frag, 0, sizeof(WINDIVERT_REASSEMBLY_FRAGMENT));
+    if (packet_len < sizeof(WINDIVERT_IPHDR))
+    {
+        return FALSE;
+    }
+    switch (ip_header->Version)
+    {
+        case 4:
+            if (ip_header->HdrLength < 5 ||
+                packet_len < ip_header->HdrLength*sizeof(UINT32) ||
+                ntohs(ip_header->Length) != packet_len ||
+                (WINDIVERT_IPHDR_GET_FRAGOFF(ip_header) == 0 &&
+                 !WINDIVERT_IPHDR_GET_MF(ip_header)))
+            {
+                return FALSE;
+            }
+            frag->protocol    = ip_header->Protocol;
+            frag->id          = ip_header->Id;
+            frag->src_addr[0] = ip_header->SrcAddr;
+            frag->dst_addr[0] = ip_header->DstAddr;
+            frag->header_len  = ip_header->HdrLength*sizeof(UINT32);
+            frag->offset      = (ntohs(ip_header->FragOff0) & 0x1FFF) * 8;
+            frag->last        = !WINDIVERT_IPHDR_GET_MF(ip_header);
             break;
-        case FILTER_TOKEN_UDP_PAYLOAD_LENGTH:
-            filter[f].field = WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH;
+
+        case 6:
+            if (packet_len < sizeof(WINDIVERT_IPV6HDR) ||
+                ntohs(ipv6_header->Length) !=
+                    packet_len - sizeof(WINDIVERT_IPV6HDR))
+            {
+                return FALSE;
+            }
+            offset = sizeof(WINDIVERT_IPV6HDR);
+            frag->next_hdr_offset = (UINT)((const UINT8 *)
+                &ipv6_header->NextHdr - packet);
+            next_hdr = ipv6_header->NextHdr;
+            while (next_hdr == 0 || next_hdr == 43 || next_hdr == 60)
+            {
+                ext_header = packet + offset;
+                if (packet_len - offset < 8 ||
+                    packet_len - offset < (UINT)(ext_header[1] + 1) * 8)
+                {
+                    return FALSE;
+                }
+                frag->next_hdr_offset = offset;
+                next_hdr = ext_header[0];
+                offset += (ext_header[1] + 1) * 8;
+            }
+            if (next_hdr != 44 || packet_len - offset < 8)
+            {
+                return FALSE;
+            }
+            ext_header = packet + offset;
+            memcpy(&frag_off, ext_header + 2, sizeof(frag_off));
+            frag_off = ntohs(frag_off);
+            memcpy(&frag->id, ext_header + 4, sizeof(frag->id));
+            memcpy(frag->src_addr, ipv6_header->SrcAddr,
+                sizeof(frag->src_addr));
+            memcpy(frag->dst_addr, ipv6_header->DstAddr,
+                sizeof(frag->dst_addr));
+            frag->next_hdr    = ext_header[0];
+            frag->header_len  = offset;
+            frag->offset      = frag_off & 0xFFF8;
+            frag->last        = ((frag_off & 0x0001) == 0);
+            offset += 8;
+            frag->frag_data   = packet + offset;
+            frag->frag_len    = packet_len - offset;
+            frag->version     = 6;
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+
+    frag->frag_data = packet + frag->header_len;
+    frag->frag_len  = packet_len - frag->header_len;
+    frag->version   = 4;
+    return TRUE;
+}
+
+/*
+ * Fix up the header of a reassembled datagram of total_len bytes.
+ */
+static void WinDivertReassemblyFinish(UINT8 *datagram, UINT total_len,
+    UINT8 version, UINT8 next_hdr, UINT next_hdr_offset)
+{
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)datagram;
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)datagram;
+
+    if (version == 4)
+    {
+        ip_header->Length = htons((UINT16)total_len);
+        ip_header->FragOff0 &= 0x0040;              // Keep DF only
+        WinDivertHelperCalcChecksums(datagram, total_len,
+            WINDIVERT_HELPER_NO_ICMP_CHECKSUM |
+            WINDIVERT_HELPER_NO_ICMPV6_CHECKSUM |
+            WINDIVERT_HELPER_NO_TCP_CHECKSUM |
+            WINDIVERT_HELPER_NO_UDP_CHECKSUM);
+    }
+    else
+    {
+        // The fragment header is removed:
+        datagram[next_hdr_offset] = next_hdr;
+        ipv6_header->Length =
+            htons((UINT16)(total_len - sizeof(WINDIVERT_IPV6HDR)));
+    }
+}
+
+/*
+ * Add a packet to a reassembly context; returns whole datagrams.
+ */
+extern BOOL WinDivertHelperReassemble(HANDLE handle, PVOID pPacket,
+    UINT packetLen, PVOID pDatagram, UINT datagramLen, UINT *pReadLen)
+{
+    PWINDIVERT_REASSEMBLY reasm = (PWINDIVERT_REASSEMBLY)handle;
+    PWINDIVERT_REASSEMBLY_ENTRY entry = NULL, free_entry = NULL,
+        oldest_entry = NULL;
+    WINDIVERT_REASSEMBLY_FRAGMENT frag;
+    UINT max_len, unit, end_unit, total_len, i;
+    DWORD now;
+
+    if (pReadLen != NULL)
+    {
+        *pReadLen = 0;
+    }
+    if (reasm == NULL || reasm == INVALID_HANDLE_VALUE ||
+        reasm->magic != WINDIVERT_REASSEMBLY_MAGIC || pPacket == NULL ||
+        pDatagram == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    // Packets that are not valid fragments are returned unmodified:
+    if (!WinDivertReassemblyParse((const UINT8 *)pPacket, packetLen, &frag))
+    {
+        if (datagramLen < packetLen)
+        {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return FALSE;
+        }
+        memmove(pDatagram, pPacket, packetLen);
+        if (pReadLen != NULL)
+        {
+            *pReadLen = packetLen;
+        }
+        return TRUE;
+    }
+
+    // The IPv6 payload length excludes the IPv6 header:
+    max_len = WINDIVERT_REASSEMBLY_MAXLEN +
+        (frag.version == 6? sizeof(WINDIVERT_IPV6HDR): 0);
+    if ((!frag.last && (frag.frag_len == 0 || frag.frag_len % 8 != 0)) ||
+        frag.header_len > WINDIVERT_REASSEMBLY_HDRLEN ||
+        frag.offset + frag.frag_len > max_len - frag.header_len)
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+
+    // An IPv6 "atomic" fragment (offset 0, last) is a whole datagram by
+    // itself, and must not be mixed with other fragments (RFC 6946):
+    if (frag.offset == 0 && frag.last)
+    {
+        total_len = frag.header_len + frag.frag_len;
+        if (datagramLen < total_len)
+        {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return FALSE;
+        }
+        memmove(pDatagram, pPacket, frag.header_len);
+        memmove((UINT8 *)pDatagram + frag.header_len, frag.frag_data,
+            frag.frag_len);
+        WinDivertReassemblyFinish((UINT8 *)pDatagram, total_len,
+            frag.version, frag.next_hdr, frag.next_hdr_offset);
+        if (pReadLen != NULL)
+        {
+            *pReadLen = total_len;
+        }
+        return TRUE;
+    }
+
+    // Find the datagram's entry, expiring stale entries along the way:
+    now = GetTickCount();
+    for (i = 0; i < reasm->num_entries; i++)
+    {
+        PWINDIVERT_REASSEMBLY_ENTRY e = reasm->entries + i;
+        if (e->used && now - e->start > reasm->timeout)
+        {
+            e->used = FALSE;
+        }
+        if (!e->used)
+        {
+            free_entry = (free_entry == NULL? e: free_entry);
+            continue;
+        }
+        if (e->version == frag.version && e->id == frag.id &&
+            e->protocol == frag.protocol &&
+            memcmp(e->src_addr, frag.src_addr, sizeof(e->src_addr)) == 0 &&
+            memcmp(e->dst_addr, frag.dst_addr, sizeof(e->dst_addr)) == 0)
+        {
+            entry = e;
+        }
+        if (oldest_entry == NULL ||
+            now - e->start > now - oldest_entry->start)
+        {
+            oldest_entry = e;
+        }
+    }
+    if (entry == NULL)
+    {
+        // New datagram; if the pool is exhausted then drop the oldest.
+        entry = (free_entry != NULL? free_entry: oldest_entry);
+        entry->used       = TRUE;
+        entry->start      = now;
+        entry->version    = frag.version;
+        entry->protocol   = frag.protocol;
+        entry->id         = frag.id;
+        memcpy(entry->src_addr, frag.src_addr, sizeof(entry->src_addr));
+        memcpy(entry->dst_addr, frag.dst_addr, sizeof(entry->dst_addr));
+        entry->header_len = 0;
+        entry->data_len   = 0;
+        entry->units      = 0;
+        entry->end_unit   = 0;
+        memset(entry->map, 0, sizeof(entry->map));
+    }
+
+    // Check consistency with fragments already received:
+    if (frag.last)
+    {
+        if (entry->data_len != 0 &&
+            entry->data_len != frag.offset + frag.frag_len)
+        {
+            goto WinDivertHelperReassembleError;
+        }
+        entry->data_len = frag.offset + frag.frag_len;
+
+        // Earlier fragments must not extend beyond the end of the datagram,
+        // else the units can never add up.
+        if (entry->end_unit > (entry->data_len + 7) / 8)
+        {
+            goto WinDivertHelperReassembleError;
+        }
+    }
+    else if (entry->data_len != 0 &&
+             frag.offset + frag.frag_len > entry->data_len)
+    {
+        goto WinDivertHelperReassembleError;
+    }
+    if (frag.offset == 0)
+    {
+        entry->header_len      = frag.header_len;
+        entry->next_hdr        = frag.next_hdr;
+        entry->next_hdr_offset = frag.next_hdr_offset;
+        memcpy(entry->header, pPacket, frag.header_len);
+    }
+
+    // Copy the fragment and mark the units it covers:
+    memcpy(entry->data + frag.offset, frag.frag_data, frag.frag_len);
+    end_unit = (frag.offset + frag.frag_len + 7) / 8;
+    for (unit = frag.offset / 8; unit < end_unit; unit++)
+    {
+        if ((entry->map[unit / 8] & (1 << (unit % 8))) == 0)
+        {
+            entry->map[unit / 8] |= (UINT8)(1 << (unit % 8));
+            entry->units++;
+        }
+    }
+    if (end_unit > entry->end_unit)
+    {
+        entry->end_unit = end_unit;
+    }
+
+    if (entry->header_len == 0 || entry->data_len == 0 ||
+        entry->units != (entry->data_len + 7) / 8)
+    {
+        SetLastError(ERROR_IO_PENDING);
+        return FALSE;
+    }
+
+    // Datagram is complete:
+    total_len = entry->header_len + entry->data_len;
+    if (total_len > max_len)
+    {
+        goto WinDivertHelperReassembleError;
+    }
+    if (datagramLen < total_len)
+    {
+        // Keep the entry so that the caller can retry with a larger buffer.
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+    memcpy(pDatagram, entry->header, entry->header_len);
+    memcpy((UINT8 *)pDatagram + entry->header_len, entry->data,
+        entry->data_len);
+    entry->used = FALSE;
+    WinDivertReassemblyFinish((UINT8 *)pDatagram, total_len, entry->version,
+        entry->next_hdr, entry->next_hdr_offset);
+    if (pReadLen != NULL)
+    {
+        *pReadLen = total_len;
+    }
+    return TRUE;
+
+WinDivertHelperReassembleError:
+    entry->used = FALSE;
+    SetLastError(ERROR_INVALID_DATA);
+    return FALSE;
+}
+
+/*
+ * Close a reassembly context.
+ */
+extern BOOL WinDivertHelperReassemblyClose(HANDLE handle)
+{
+    PWINDIVERT_REASSEMBLY reasm = (PWINDIVERT_REASSEMBLY)handle;
+
+    if (reasm == NULL || reasm == INVALID_HANDLE_VALUE ||
+        reasm->magic != WINDIVERT_REASSEMBLY_MAGIC)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    reasm->magic = 0;
+    free(reasm->entries);
+    free(reasm->pool);
+    free(reasm);
+    return TRUE;
+}
+
+/*
+ * TCP stream reassembly.
+ */
+#define WINDIVERT_STREAM_MAGIC          0x4D525453
+#define WINDIVERT_STREAM_MAX_RANGES     16
+
+typedef struct
+{
+    UINT32 start;                           // Range [start, end) offsets
+    UINT32 end;
+} WINDIVERT_STREAM_RANGE, *PWINDIVERT_STREAM_RANGE;
+
+typedef struct
+{
+    UINT32 magic;                           // WINDIVERT_STREAM_MAGIC
+    BOOL started;                           // First segment seen?
+    UINT32 base;                            // SeqNum of data[0]
+    UINT32 ready;                           // In-order bytes at data[0]
+    UINT32 size;                            // Size of data
+    UINT num_ranges;                        // Out-of-order ranges
+    WINDIVERT_STREAM_RANGE ranges[WINDIVERT_STREAM_MAX_RANGES];
+    UINT8 *data;                            // Stream window
+} WINDIVERT_STREAM, *PWINDIVERT_STREAM;
+
+/*
+ * Create a TCP stream reassembly context.
+ */
+extern HANDLE WinDivertHelperStreamOpen(UINT windowLen)
+{
+    PWINDIVERT_STREAM stream;
+
+    if (windowLen == 0 || windowLen > WINDIVERT_STREAM_MAX_WINDOW)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+    stream = (PWINDIVERT_STREAM)malloc(sizeof(WINDIVERT_STREAM));
+    if (stream == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    stream->data = (UINT8 *)malloc(windowLen);
+    if (stream->data == NULL)
+    {
+        free(stream);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    stream->magic      = WINDIVERT_STREAM_MAGIC;
+    stream->started    = FALSE;
+    stream->base       = 0;
+    stream->ready      = 0;
+    stream->size       = windowLen;
+    stream->num_ranges = 0;
+
+    return (HANDLE)stream;
+}
+
+/*
+ * Add a TCP segment's payload to a stream.
+ */
+extern BOOL WinDivertHelperStreamPush(HANDLE handle, PVOID pPacket,
+    UINT packetLen)
+{
+    PWINDIVERT_STREAM stream = (PWINDIVERT_STREAM)handle;
+    PWINDIVERT_STREAM_RANGE ranges;
+    PWINDIVERT_TCPHDR tcp_header;
+    UINT8 *payload;
+    UINT payload_len, i, j, k;
+    UINT32 seq, pos;
+    INT64 start, end;
+    BOOL truncated = FALSE;
+
+    if (stream == NULL || stream == INVALID_HANDLE_VALUE ||
+        stream->magic != WINDIVERT_STREAM_MAGIC || pPacket == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    // (Fails for segments without payload, so only check the TCP header.)
+    WinDivertHelperParsePacket(pPacket, packetLen, NULL, NULL, NULL, NULL,
+        &tcp_header, NULL, (PVOID *)&payload, &payload_len);
+    if (tcp_header == NULL)
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+
+    // The SYN occupies one sequence number before the data.
+    seq = ntohl(tcp_header->SeqNum) + (tcp_header->Syn? 1: 0);
+    if (!stream->started)
+    {
+        stream->base    = seq;
+        stream->started = TRUE;
+    }
+    if (payload_len == 0)
+    {
+        return TRUE;
+    }
+    start = (INT64)(INT32)(seq - stream->base);
+    end   = start + payload_len;
+
+    // Trim data that has already been received in-order (retransmits), and
+    // data that does not fit in the window:
+    if (end <= (INT64)stream->ready)
+    {
+        return TRUE;
+    }
+    if (start < (INT64)stream->ready)
+    {
+        payload += (UINT)((INT64)stream->ready - start);
+        start = stream->ready;
+    }
+    if (end > (INT64)stream->size)
+    {
+        end = stream->size;
+        truncated = TRUE;
+        if (start >= end)
+        {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return FALSE;
+        }
+    }
+
+    // Find the out-of-order ranges [i, j) that overlap or touch the data:
+    ranges = stream->ranges;
+    for (i = 0; i < stream->num_ranges && ranges[i].end < start; i++)
+        ;
+    for (j = i; j < stream->num_ranges && ranges[j].start <= end; j++)
+        ;
+    if (start > (INT64)stream->ready && i == j &&
+        stream->num_ranges >= WINDIVERT_STREAM_MAX_RANGES)
+    {
+        // Too many holes to track this segment; wait for a retransmit.
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+
+    // Copy only the bytes not already received, i.e. the first copy of
+    // overlapping data wins:
+    pos = (UINT32)start;
+    for (k = i; k < j; k++)
+    {
+        if (ranges[k].start > pos)
+        {
+            memcpy(stream->data + pos, payload + (pos - (UINT32)start),
+                ranges[k].start - pos);
+        }
+        pos = (ranges[k].end > pos? ranges[k].end: pos);
+    }
+    if (pos < (UINT32)end)
+    {
+        memcpy(stream->data + pos, payload + (pos - (UINT32)start),
+            (UINT32)end - pos);
+    }
+
+    // Merge the ranges, and extend the in-order data if possible:
+    if (i < j)
+    {
+        start = (ranges[i].start < start? ranges[i].start: start);
+        end = (ranges[j-1].end > end? ranges[j-1].end: end);
+    }
+    if (start <= (INT64)stream->ready)
+    {
+        stream->ready = (UINT32)end;
+        memmove(ranges + i, ranges + j,
+            (stream->num_ranges - j) * sizeof(WINDIVERT_STREAM_RANGE));
+        stream->num_ranges -= j - i;
+    }
+    else
+    {
+        memmove(ranges + i + 1, ranges + j,
+            (stream->num_ranges - j) * sizeof(WINDIVERT_STREAM_RANGE));
+        stream->num_ranges -= j - i;
+        stream->num_ranges++;
+        ranges[i].start = (UINT32)start;
+        ranges[i].end   = (UINT32)end;
+    }
+
+    if (truncated)
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Get the in-order data of a stream.
+ */
+extern BOOL WinDivertHelperStreamData(HANDLE handle, PVOID *ppData,
+    UINT *pDataLen, UINT32 *pSeqNum)
+{
+    PWINDIVERT_STREAM stream = (PWINDIVERT_STREAM)handle;
+
+    if (stream == NULL || stream == INVALID_HANDLE_VALUE ||
+        stream->magic != WINDIVERT_STREAM_MAGIC || ppData == NULL ||
+        pDataLen == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    *ppData   = (PVOID)stream->data;
+    *pDataLen = (UINT)stream->ready;
+    if (pSeqNum != NULL)
+    {
+        *pSeqNum = stream->base;
+    }
+    return TRUE;
+}
+
+/*
+ * Discard in-order data from the start of a stream.
+ */
+extern BOOL WinDivertHelperStreamConsume(HANDLE handle, UINT len)
+{
+    PWINDIVERT_STREAM stream = (PWINDIVERT_STREAM)handle;
+    UINT32 stored;
+    UINT i;
+
+    if (stream == NULL || stream == INVALID_HANDLE_VALUE ||
+        stream->magic != WINDIVERT_STREAM_MAGIC || len > stream->ready)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (len == 0)
+    {
+        return TRUE;
+    }
+    stored = (stream->num_ranges == 0? stream->ready:
+        stream->ranges[stream->num_ranges-1].end);
+    memmove(stream->data, stream->data + len, stored - len);
+    stream->base  += len;
+    stream->ready -= len;
+    for (i = 0; i < stream->num_ranges; i++)
+    {
+        stream->ranges[i].start -= len;
+        stream->ranges[i].end   -= len;
+    }
+    return TRUE;
+}
+
+/*
+ * Close a TCP stream reassembly context.
+ */
+extern BOOL WinDivertHelperStreamClose(HANDLE handle)
+{
+    PWINDIVERT_STREAM stream = (PWINDIVERT_STREAM)handle;
+
+    if (stream == NULL || stream == INVALID_HANDLE_VALUE ||
+        stream->magic != WINDIVERT_STREAM_MAGIC)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    stream->magic = 0;
+    free(stream->data);
+    free(stream);
+    return TRUE;
+}
+
+/*
+ * Load a (checked) filter object into a (malloc'ed) filter.
+ */
+static filter_t WinDivertLoadFilter(const WINDIVERT_FILTER_OBJECT *object)
+{
+    windivert_ioctl_filter_t ioctl_filter =
+        (windivert_ioctl_filter_t)(object + 1);
+    filter_t filter;
+    UINT8 *automata;
+
+    // As with the driver, the automata are stored after the filter program.
+    filter = (filter_t)malloc(object->filter_len*sizeof(struct filter_s) +
+        object->automata_len);
+    if (filter == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    automata = (UINT8 *)(filter + object->filter_len);
+    memcpy(automata, ioctl_filter + object->filter_len,
+        object->automata_len);
+    if (!windivert_filter_load(ioctl_filter, object->filter_len, automata,
+            object->automata_len, filter))
+    {
+        free(filter);
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    return filter;
+}
+
+/*
+ * Load a compiled filter object for WinDivertHelperEvalFilter().
+ */
+extern HANDLE WinDivertHelperFilterOpen(const VOID *pObject, UINT objectLen)
+{
+    const WINDIVERT_FILTER_OBJECT *object =
+        (const WINDIVERT_FILTER_OBJECT *)pObject;
+    PWINDIVERT_FILTER eval;
+
+    if (!WinDivertCheckFilterObject(object, objectLen))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+    eval = (PWINDIVERT_FILTER)malloc(sizeof(WINDIVERT_FILTER));
+    if (eval == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    eval->filter = WinDivertLoadFilter(object);
+    if (eval->filter == NULL)
+    {
+        free(eval);
+        return INVALID_HANDLE_VALUE;
+    }
+    eval->magic = WINDIVERT_FILTER_MAGIC;
+
+    return (HANDLE)eval;
+}
+
+/*
+ * Evaluate a filter against a packet.
+ */
+extern BOOL WinDivertHelperEvalFilter(HANDLE handle, PVOID pPacket,
+    UINT packetLen, PWINDIVERT_ADDRESS pAddr)
+{
+    PWINDIVERT_FILTER eval = (PWINDIVERT_FILTER)handle;
+    WINDIVERT_PACKET packet;
+
+    if (eval == NULL || eval == INVALID_HANDLE_VALUE ||
+        eval->magic != WINDIVERT_FILTER_MAGIC || pPacket == NULL ||
+        pAddr == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    packet.data = (UINT8 *)pPacket;
+    packet.len  = (size_t)packetLen;
+    if (!windivert_filter(&packet, pAddr->IfIdx, pAddr->SubIfIdx,
+            pAddr->Direction == WINDIVERT_DIRECTION_OUTBOUND, eval->filter,
+            NULL))
+    {
+        SetLastError(0);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Compute a packet's (symmetric) flow hash.
+ */
+extern UINT32 WinDivertHelperHashPacket(PVOID pPacket, UINT packetLen)
+{
+    WINDIVERT_PACKET packet;
+
+    if (pPacket == NULL)
+    {
+        return 0;
+    }
+    packet.data = (UINT8 *)pPacket;
+    packet.len  = (size_t)packetLen;
+    return windivert_hash_packet(&packet);
+}
+
+/*
+ * Close a filter loaded by WinDivertHelperFilterOpen().
+ */
+extern BOOL WinDivertHelperFilterClose(HANDLE handle)
+{
+    PWINDIVERT_FILTER eval = (PWINDIVERT_FILTER)handle;
+
+    if (eval == NULL || eval == INVALID_HANDLE_VALUE ||
+        eval->magic != WINDIVERT_FILTER_MAGIC)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    eval->magic = 0;
+    free(eval->filter);
+    free(eval);
+    return TRUE;
+}
+
+/*
+ * Get the length of a packet.
+ */
+static size_t windivert_packet_length(PWINDIVERT_PACKET packet)
+{
+    return packet->len;
+}
+
+/*
+ * Get the first len bytes of a packet.  Packets are always contiguous in
+ * user mode, so storage is not needed.
+ */
+static UINT8 *windivert_packet_data(PWINDIVERT_PACKET packet, size_t len,
+    UINT8 *storage)
+{
+    return packet->data;
+}
+
+/*
+ * Search the packet from offset onwards for any pattern of the automaton.
+ */
+static BOOL windivert_packet_contains(PWINDIVERT_PACKET packet,
+    size_t offset, windivert_ioctl_automaton_t automaton)
+{
+    UINT32 state = automaton->classes;      // Start state
+
+    if (offset >= packet->len)
+    {
+        return FALSE;
+    }
+    return windivert_automaton_match(automaton, packet->data + offset,
+        packet->len - offset, &state);
+}
+
+/*
+ * Prefetch the start of a packet (nothing to do in user mode).
+ */
+static void windivert_packet_prefetch(PWINDIVERT_PACKET packet)
+{
+    return;
+}
+
+/*
+ * Create a classifier from an ordered list of filters.
+ */
+extern HANDLE WinDivertHelperClassifierOpen(const char **filters,
+    UINT numFilters, WINDIVERT_LAYER layer)
+{
+    PWINDIVERT_CLASSIFIER classifier;
+    PWINDIVERT_CLASSIFIER_ENTRY entries = NULL, entry;
+    PWINDIVERT_CLASSIFIER_BUCKET bucket;
+    PWINDIVERT_FILTER_OBJECT object;
+    UINT object_len, num_entries = 0, max_entries = 0, i, j, k, size;
+    UINT counts[WINDIVERT_CLASSIFIER_KEYS];
+    UINT32 values[WINDIVERT_FILTER_MAXLEN], hash;
+    UINT num_values;
+    DWORD err;
+
+    if (filters == NULL || numFilters == 0 ||
+        numFilters > WINDIVERT_CLASSIFIER_MAX_RULES ||
+        layer > WINDIVERT_LAYER_MAX)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+    classifier = (PWINDIVERT_CLASSIFIER)calloc(1,
+        sizeof(WINDIVERT_CLASSIFIER));
+    if (classifier == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    classifier->rules = (filter_t *)calloc(numFilters, sizeof(filter_t));
+    classifier->wild = (UINT32 *)malloc(numFilters*sizeof(UINT32));
+    if (classifier->rules == NULL || classifier->wild == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        goto WinDivertHelperClassifierOpenError;
+    }
+    classifier->num_rules = numFilters;
+
+    // Compile each rule and find its key:
+    for (i = 0; i < numFilters; i++)
+    {
+        object = WinDivertCompileFilterObject(filters[i], layer, &object_len);
+        if (object == NULL)
+        {
+            goto WinDivertHelperClassifierOpenError;
+        }
+        classifier->rules[i] = WinDivertLoadFilter(object);
+        free(object);
+        if (classifier->rules[i] == NULL)
+        {
+            goto WinDivertHelperClassifierOpenError;
+        }
+        if (classifier->rules[i][0].depth > classifier->depth)
+        {
+            classifier->depth = classifier->rules[i][0].depth;
+        }
+        if (!WinDivertClassifierKey(classifier->rules[i], &k, values,
+                &num_values))
+        {
+            classifier->wild[classifier->num_wild++] = i;
+            continue;
+        }
+        if (num_entries + num_values > max_entries)
+        {
+            max_entries = 2*max_entries + num_values;
+            entry = (PWINDIVERT_CLASSIFIER_ENTRY)realloc(entries,
+                max_entries*sizeof(WINDIVERT_CLASSIFIER_ENTRY));
+            if (entry == NULL)
+            {
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                goto WinDivertHelperClassifierOpenError;
+            }
+            entries = entry;
+        }
+        for (j = 0; j < num_values; j++)
+        {
+            entries[num_entries].key   = k;
+            entries[num_entries].value = values[j];
+            entries[num_entries].rule  = i;
+            num_entries++;
+        }
+    }
+
+    // Build one hash table per key.  Sorting keeps each bucket's rules in
+    // rule order.
+    if (num_entries != 0)
+    {
+        qsort(entries, num_entries, sizeof(WINDIVERT_CLASSIFIER_ENTRY),
+            WinDivertClassifierEntryCompare);
+        classifier->rule_ids = (UINT32 *)malloc(num_entries*sizeof(UINT32));
+        if (classifier->rule_ids == NULL)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            goto WinDivertHelperClassifierOpenError;
+        }
+    }
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < num_entries; i++)
+    {
+        if (i == 0 || entries[i].key != entries[i-1].key ||
+            entries[i].value != entries[i-1].value)
+        {
+            counts[entries[i].key]++;
+        }
+    }
+    for (k = 0; k < WINDIVERT_CLASSIFIER_KEYS; k++)
+    {
+        if (counts[k] == 0)
+        {
+            continue;
+        }
+        size = 2;
+        while (size < 2*counts[k])
+        {
+            size *= 2;
+        }
+        classifier->masks[k] = size - 1;
+        classifier->tables[k] = (PWINDIVERT_CLASSIFIER_BUCKET)calloc(size,
+            sizeof(WINDIVERT_CLASSIFIER_BUCKET));
+        if (classifier->tables[k] == NULL)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            goto WinDivertHelperClassifierOpenError;
+        }
+    }
+    for (i = 0, bucket = NULL; i < num_entries; i++)
+    {
+        k = entries[i].key;
+        if (i == 0 || k != entries[i-1].key ||
+            entries[i].value != entries[i-1].value)
+        {
+            hash = WinDivertClassifierHash(entries[i].value);
+            for (j = 0; ; j++)
+            {
+                bucket = classifier->tables[k] +
+                    ((hash + j) & classifier->masks[k]);
+                if (bucket->num_rules == 0)
+                {
+                    break;
+                }
+            }
+            bucket->value = entries[i].value;
+            bucket->rules = classifier->rule_ids + i;
+        }
+        bucket->rules[bucket->num_rules++] = entries[i].rule;
+    }
+    free(entries);
+
+    classifier->magic = WINDIVERT_CLASSIFIER_MAGIC;
+    return (HANDLE)classifier;
+
+WinDivertHelperClassifierOpenError:
+    err = GetLastError();
+    free(entries);
+    WinDivertClassifierFree(classifier);
+    SetLastError(err);
+    return INVALID_HANDLE_VALUE;
+}
+
+/*
+ * Classify a packet.
+ */
+extern BOOL WinDivertHelperClassify(HANDLE handle, PVOID pPacket,
+    UINT packetLen, PWINDIVERT_ADDRESS pAddr, UINT *pRuleIds,
+    UINT ruleIdsLen, UINT *pNumRules)
+{
+    PWINDIVERT_CLASSIFIER classifier = (PWINDIVERT_CLASSIFIER)handle;
+    PWINDIVERT_CLASSIFIER_BUCKET bucket;
+    WINDIVERT_PACKET packet;
+    struct windivert_headers_s headers;
+    UINT32 *lists[WINDIVERT_CLASSIFIER_KEYS+1], value, hash, rule;
+    UINT lens[WINDIVERT_CLASSIFIER_KEYS+1];
+    UINT num_lists = 0, num_rules = 0, i, j, k;
+    UINT8 depth;
+    BOOL outbound;
+
+    if (classifier == NULL || classifier == INVALID_HANDLE_VALUE ||
+        classifier->magic != WINDIVERT_CLASSIFIER_MAGIC || pPacket == NULL ||
+        pAddr == NULL || pRuleIds == NULL || ruleIdsLen == 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (pNumRules != NULL)
+    {
+        *pNumRules = 0;
+    }
+
+    // The headers are parsed once for all rules.  A malformed packet may
+    // still match rules that do not look as deep (metadata only rules never
+    // fail to parse):
+    packet.data = (UINT8 *)pPacket;
+    packet.len  = (size_t)packetLen;
+    depth = classifier->depth;
+    while (!windivert_parse_headers(&packet, depth, &headers))
+    {
+        depth--;
+    }
+
+    // Collect the candidate rule lists:
+    if (classifier->num_wild != 0)
+    {
+        lists[num_lists] = classifier->wild;
+        lens[num_lists]  = classifier->num_wild;
+        num_lists++;
+    }
+    for (k = 0; k < WINDIVERT_CLASSIFIER_KEYS; k++)
+    {
+        if (classifier->tables[k] == NULL ||
+            !WinDivertClassifierValue(&headers, windivert_classifier_keys[k],
+                &value))
+        {
+            continue;
+        }
+        hash = WinDivertClassifierHash(value);
+        for (j = 0; ; j++)
+        {
+            bucket = classifier->tables[k] +
+                ((hash + j) & classifier->masks[k]);
+            if (bucket->num_rules == 0 || bucket->value == value)
+            {
+                break;
+            }
+        }
+        if (bucket->num_rules != 0)
+        {
+            lists[num_lists] = bucket->rules;
+            lens[num_lists]  = bucket->num_rules;
+            num_lists++;
+        }
+    }
+
+    // Evaluate the candidates in rule order (each rule is in at most one
+    // list):
+    outbound = (pAddr->Direction == WINDIVERT_DIRECTION_OUTBOUND);
+    while (num_rules < ruleIdsLen)
+    {
+        for (i = 0, j = num_lists; i < num_lists; i++)
+        {
+            if (lens[i] != 0 && (j == num_lists || lists[i][0] < lists[j][0]))
+            {
+                j = i;
+            }
+        }
+        if (j == num_lists)
+        {
             break;
+        }
+        rule = lists[j][0];
+        lists[j]++;
+        lens[j]--;
+        if (classifier->rules[rule][0].depth <= depth &&
+            windivert_filter_exec(&packet, &headers, pAddr->IfIdx,
+                pAddr->SubIfIdx, outbound, classifier->rules[rule]))
+        {
+            pRuleIds[num_rules++] = (UINT)rule;
+        }
+    }
+
+    if (pNumRules != NULL)
+    {
+        *pNumRules = num_rules;
+    }
+    if (num_rules == 0)
+    {
+        SetLastError(0);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Close a classifier.
+ */
+extern BOOL WinDivertHelperClassifierClose(HANDLE handle)
+{
+    PWINDIVERT_CLASSIFIER classifier = (PWINDIVERT_CLASSIFIER)handle;
+
+    if (classifier == NULL || classifier == INVALID_HANDLE_VALUE ||
+        classifier->magic != WINDIVERT_CLASSIFIER_MAGIC)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    classifier->magic = 0;
+    WinDivertClassifierFree(classifier);
+    return TRUE;
+}
+
+/*
+ * Free a (possibly partially constructed) classifier.
+ */
+static void WinDivertClassifierFree(PWINDIVERT_CLASSIFIER classifier)
+{
+    UINT i;
+
+    if (classifier->rules != NULL)
+    {
+        for (i = 0; i < classifier->num_rules; i++)
+        {
+            free(classifier->rules[i]);
+        }
+    }
+    for (i = 0; i < WINDIVERT_CLASSIFIER_KEYS; i++)
+    {
+        free(classifier->tables[i]);
+    }
+    free(classifier->rules);
+    free(classifier->rule_ids);
+    free(classifier->wild);
+    free(classifier);
+}
+
+/*
+ * Find a rule's key, i.e. the first key field such that every path to
+ * ACCEPT passes an "field == value" test.  The rule can only match packets
+ * where the key field equals one of values[].
+ */
+static BOOL WinDivertClassifierKey(filter_t filter, UINT *key_ptr,
+    UINT32 *values, UINT *num_values_ptr)
+{
+    UINT8 reach[WINDIVERT_FILTER_MAXLEN];
+    UINT8 field;
+    UINT k, i, j, num_values;
+
+    for (k = 0; k < WINDIVERT_CLASSIFIER_KEYS; k++)
+    {
+        field = windivert_classifier_keys[k];
+        memset(reach, 0, sizeof(reach));
+        if (WinDivertClassifierReach(filter, 0, field, reach))
+        {
+            continue;
+        }
+
+        // The first "field == value" test on any path to ACCEPT is reached
+        // without passing another, i.e. it is one of the tests visited
+        // above:
+        num_values = 0;
+        for (i = 0; i < WINDIVERT_FILTER_MAXLEN; i++)
+        {
+            if (reach[i] == 0 || filter[i].field != field ||
+                filter[i].test != WINDIVERT_FILTER_TEST_EQ)
+            {
+                continue;
+            }
+            j = 0;
+            while (j < num_values && values[j] != filter[i].arg[0])
+            {
+                j++;
+            }
+            if (j == num_values)
+            {
+                values[num_values++] = filter[i].arg[0];
+            }
+        }
+        *key_ptr = k;
+        *num_values_ptr = num_values;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Can the filter reach ACCEPT from ip without passing a "field == value"
+ * test?  Other tests may go either way.  Note that the failure branch of a
+ * "field != value" test is also taken if the packet does not have the field.
+ */
+static BOOL WinDivertClassifierReach(filter_t filter, UINT16 ip, UINT8 field,
+    UINT8 *reach)
+{
+    BOOL result = FALSE;
+
+    if (ip == WINDIVERT_FILTER_RESULT_ACCEPT)
+    {
+        return TRUE;
+    }
+    if (ip == WINDIVERT_FILTER_RESULT_REJECT)
+    {
+        return FALSE;
+    }
+    if (reach[ip] != 0)
+    {
+        return (reach[ip] == 2);
+    }
+    if (filter[ip].field != field ||
+        filter[ip].test != WINDIVERT_FILTER_TEST_EQ)
+    {
+        result = WinDivertClassifierReach(filter, filter[ip].success, field,
+            reach);
+    }
+    if (!result)
+    {
+        result = WinDivertClassifierReach(filter, filter[ip].failure, field,
+            reach);
+    }
+    reach[ip] = (result? 2: 1);
+    return result;
+}
+
+/*
+ * Get a key field's value (same as windivert_filter_exec()).
+ */
+static BOOL WinDivertClassifierValue(windivert_headers_t headers, UINT8 field,
+    UINT32 *value)
+{
+    switch (field)
+    {
+        case WINDIVERT_FILTER_FIELD_TCP_DSTPORT:
+        case WINDIVERT_FILTER_FIELD_TCP_SRCPORT:
+            if (headers->tcp_header == NULL)
+            {
+                return FALSE;
+            }
+            *value = (UINT32)ntohs(field == WINDIVERT_FILTER_FIELD_TCP_DSTPORT?
+                headers->tcp_header->DstPort: headers->tcp_header->SrcPort);
+            return TRUE;
+        case WINDIVERT_FILTER_FIELD_UDP_DSTPORT:
+        case WINDIVERT_FILTER_FIELD_UDP_SRCPORT:
+            if (headers->udp_header == NULL)
+            {
+                return FALSE;
+            }
+            *value = (UINT32)ntohs(field == WINDIVERT_FILTER_FIELD_UDP_DSTPORT?
+                headers->udp_header->DstPort: headers->udp_header->SrcPort);
+            return TRUE;
+        case WINDIVERT_FILTER_FIELD_IP_DSTADDR:
+        case WINDIVERT_FILTER_FIELD_IP_SRCADDR:
+            if (headers->ip_header == NULL)
+            {
+                return FALSE;
+            }
+            *value = (UINT32)ntohl(field == WINDIVERT_FILTER_FIELD_IP_DSTADDR?
+                headers->ip_header->DstAddr: headers->ip_header->SrcAddr);
+            return TRUE;
+        case WINDIVERT_FILTER_FIELD_ICMP_TYPE:
+            if (headers->icmp_header == NULL)
+            {
+                return FALSE;
+            }
+            *value = (UINT32)headers->icmp_header->Type;
+            return TRUE;
+        case WINDIVERT_FILTER_FIELD_ICMPV6_TYPE:
+            if (headers->icmpv6_header == NULL)
+            {
+                return FALSE;
+            }
+            *value = (UINT32)headers->icmpv6_header->Type;
+            return TRUE;
+        case WINDIVERT_FILTER_FIELD_IP_PROTOCOL:
+            if (headers->ip_header == NULL)
+            {
+                return FALSE;
+            }
+            *value = (UINT32)headers->ip_header->Protocol;
+            return TRUE;
+        case WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR:
+            if (headers->ipv6_header == NULL)
+            {
+                return FALSE;
+            }
+            *value = (UINT32)headers->ipv6_header->NextHdr;
+            return TRUE;
         default:
             return FALSE;
     }
+}
+
+/*
+ * Classifier hash function.
+ */
+static UINT32 WinDivertClassifierHash(UINT32 value)
+{
+    value *= 0x9E3779B1;
+    return value ^ (value >> 16);
+}
+
+/*
+ * Classifier entry order.
+ */
+static int __cdecl WinDivertClassifierEntryCompare(const void *a,
+    const void *b)
+{
+    PWINDIVERT_CLASSIFIER_ENTRY entry_a = (PWINDIVERT_CLASSIFIER_ENTRY)a;
+    PWINDIVERT_CLASSIFIER_ENTRY entry_b = (PWINDIVERT_CLASSIFIER_ENTRY)b;
+
+    if (entry_a->key != entry_b->key)
+    {
+        return (entry_a->key < entry_b->key? -1: 1);
+    }
+    if (entry_a->value != entry_b->value)
+    {
+        return (entry_a->value < entry_b->value? -1: 1);
+    }
+    if (entry_a->rule != entry_b->rule)
+    {
+        return (entry_a->rule < entry_b->rule? -1: 1);
+    }
+    return 0;
+}
+
+/*
+ * Parse an IPv4 address.
+ */
+extern BOOL WinDivertHelperParseIPv4Address(const char *str, UINT32 *addr_ptr)
+{
+    UINT32 addr = 0;
+    UINT part, i;
+
+    errno = 0;
+    for (i = 0; i < 4; i++)
+    {
+        part = strtoul(str, (char **)&str, 10);
+        if (errno != 0 || part > UINT8_MAX)
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        if (i != 3 && *str++ != '.')
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        addr |= part << (8*(3-i));
+    }
+    if (*str != '\0')
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (addr_ptr != NULL)
+    {
+        *addr_ptr = addr;
+    }
+    return TRUE;
+}
+
+/*
+ * Parse an IPv6 address.
+ */
+extern BOOL WinDivertHelperParseIPv6Address(const char *str, UINT32 *addr_ptr)
+{
+    UINT16 addr[8] = {0};
+    UINT part;
+    UINT i, j, k;
+    BOOL end = FALSE;
+    char part_str[5];
 
-    if (fused)
+    if (*str == ':')
     {
-        *fp = f+1;
+        str++;
+        if (*str != ':')
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        end = TRUE;
+        str++;
     }
 
-    if (testop)
+    for (i = 0, j = 7; i < 8; i++)
     {
-        token = tokens[*tp];
-        if (!negate)
+        if (*str == ':')
         {
-            switch (token.kind)
+            if (end)
             {
-                case FILTER_TOKEN_EQ:
-                    filter[f].test = WINDIVERT_FILTER_TEST_EQ;
-                    break;
-                case FILTER_TOKEN_NEQ:
-                    filter[f].test = WINDIVERT_FILTER_TEST_NEQ;
-                    break;
-                case FILTER_TOKEN_LT:
-                    filter[f].test = WINDIVERT_FILTER_TEST_LT;
-                    break;
-                case FILTER_TOKEN_LEQ:
-                    filter[f].test = WINDIVERT_FILTER_TEST_LEQ;
-                    break;
-                case FILTER_TOKEN_GT:
-                    filter[f].test = WINDIVERT_FILTER_TEST_GT;
-                    break;
-                case FILTER_TOKEN_GEQ:
-                    filter[f].test = WINDIVERT_FILTER_TEST_GEQ;
-                    break;
-                default:
-                    filter[f].test = WINDIVERT_FILTER_TEST_NEQ;
-                    filter[f].arg[0] = 0;
-                    testop = FALSE;
-                    break;
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return FALSE;
+            }
+            end = TRUE;
+            str++;
+            if (*str == '\0')
+            {
+                break;
             }
         }
+        for (k = 0; k < 4 && isxdigit(*str); k++)
+        {
+            part_str[k] = *str;
+            str++;
+        }
+        if (k == 0)
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        part_str[k] = '\0';
+        if (*str != ':' && *str != '\0')
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        part = strtoul(part_str, NULL, 16);
+        if (!end)
+        {
+            addr[i] = (UINT16)ntohs(part);
+        }
         else
         {
-            switch (token.kind)
-            {
-                case FILTER_TOKEN_EQ:
-                    filter[f].test = WINDIVERT_FILTER_TEST_NEQ;
-                    break;
-                case FILTER_TOKEN_NEQ:
-                    filter[f].test = WINDIVERT_FILTER_TEST_EQ;
-                    break;
-                case FILTER_TOKEN_LT:
-                    filter[f].test = WINDIVERT_FILTER_TEST_GEQ;
-                    break;
-                case FILTER_TOKEN_LEQ:
-                    filter[f].test = WINDIVERT_FILTER_TEST_GT;
-                    break;
-                case FILTER_TOKEN_GT:
-                    filter[f].test = WINDIVERT_FILTER_TEST_LEQ;
-                    break;
-                case FILTER_TOKEN_GEQ:
-                    filter[f].test = WINDIVERT_FILTER_TEST_LT;
-                    break;
-                default:
-                    filter[f].test = WINDIVERT_FILTER_TEST_EQ;
-                    filter[f].arg[0] = 0;
-                    testop = FALSE;
-                    break;
-            }
+            addr[j--] = (UINT16)ntohs(part);
         }
-
-        if (testop)
+        if (*str == '\0')
         {
-            *tp = *tp + 1;
-            token = tokens[*tp];
-            *tp = *tp + 1;
-            if (token.kind != FILTER_TOKEN_NUMBER)
+            if (end)
             {
-                return FALSE;
+                break;
             }
-            filter[f].arg[0] = token.val[0];
-            filter[f].arg[1] = token.val[1];
-            filter[f].arg[2] = token.val[2];
-            filter[f].arg[3] = token.val[3];
+            if (i == 7)
+            {
+                break;
+            }
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
         }
+        str++;
     }
 
-    token = tokens[*tp];
-    if (token.kind != FILTER_TOKEN_AND && token.kind != FILTER_TOKEN_OR)
+    if (*str != '\0')
     {
-        return TRUE;
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
     }
-    if (op < token.kind)
+
+    if (end)
     {
-        op = token.kind;
-        f = s;
+        j++;
+        for (i = 7; j < i; j++, i--)
+        {
+            UINT16 tmp = addr[i];
+            addr[i] = addr[j];
+            addr[j] = tmp;
+        }
     }
-    *tp = *tp + 1;
-    switch (token.kind)
+    if (addr_ptr != NULL)
     {
-        case FILTER_TOKEN_AND:
-            WinDivertFilterUpdate(filter, f, *fp, *fp,
-                WINDIVERT_FILTER_RESULT_REJECT);
-            goto WinDivertParseFilterNext;
-        case FILTER_TOKEN_OR:
-            WinDivertFilterUpdate(filter, f, *fp,
-                WINDIVERT_FILTER_RESULT_ACCEPT, *fp);
-            goto WinDivertParseFilterNext;
-        default:
-            break;
+        memcpy(addr_ptr, addr, sizeof(addr));
     }
+
     return TRUE;
 }
 
 /*
- * Update success.
+ * Flow table definitions.
  */
-static void WinDivertFilterUpdate(windivert_ioctl_filter_t filter, UINT16 s,
-    UINT16 e, UINT16 success, UINT16 failure)
+#define WINDIVERT_FLOW_TABLE_MAGIC          0x574F4C46  // "FLOW"
+#define WINDIVERT_FLOW_WHEEL_SIZE           256
+#define WINDIVERT_FLOW_NIL                  0xFFFFFFFF
+
+typedef struct
 {
-    UINT16 i;
+    UINT32 addr[2][4];                      // Endpoint addresses
+    UINT16 port[2];                         // Endpoint ports
+    UINT8 protocol;                         // Protocol
+    UINT8 version;                          // IP version (0 = free entry)
+    UINT8 reserved[2];
+} WINDIVERT_FLOW_KEY, *PWINDIVERT_FLOW_KEY;
 
-    for (i = s; i < e; i++)
+typedef struct
+{
+    WINDIVERT_FLOW_KEY key;                 // Normalized 5-tuple
+    UINT32 hash;                            // Flow hash
+    UINT32 last;                            // Last seen (ms)
+    UINT32 due;                             // Wheel tick
+    UINT32 prev;                            // Wheel list (or free list)
+    UINT32 next;
+    UINT32 reverse;                         // First packet was swapped?
+} WINDIVERT_FLOW_ENTRY, *PWINDIVERT_FLOW_ENTRY;
+
+typedef struct
+{
+    UINT32 hash;                            // Flow hash
+    UINT32 entry;                           // Entry index + 1 (0 = empty)
+} WINDIVERT_FLOW_SLOT, *PWINDIVERT_FLOW_SLOT;
+
+typedef struct
+{
+    UINT32 magic;                           // WINDIVERT_FLOW_TABLE_MAGIC
+    UINT32 timeout;                         // Idle timeout (ms)
+    UINT32 tick_len;                        // Wheel tick length (ms)
+    UINT64 tick;                            // Last expired tick
+    UINT32 mask;                            // Number of slots - 1
+    UINT32 max_flows;                       // Number of entries
+    UINT32 entry_size;                      // Entry + user data size
+    UINT32 free;                            // Free entry list
+    PWINDIVERT_FLOW_SLOT slots;             // Open addressing index
+    UINT8 *entries;                         // Entries
+    UINT32 wheel[WINDIVERT_FLOW_WHEEL_SIZE]; // Timer wheel lists
+} WINDIVERT_FLOW_TABLE, *PWINDIVERT_FLOW_TABLE;
+
+#define WINDIVERT_FLOW_ENTRY(table, idx)                                    \
+    ((PWINDIVERT_FLOW_ENTRY)((table)->entries +                             \
+        (SIZE_T)(idx) * (table)->entry_size))
+
+static BOOL WinDivertFlowKey(windivert_headers_t headers,
+    PWINDIVERT_FLOW_KEY key, BOOL *swapped);
+static VOID WinDivertFlowWheelInsert(PWINDIVERT_FLOW_TABLE table,
+    UINT32 idx);
+static VOID WinDivertFlowWheelRemove(PWINDIVERT_FLOW_TABLE table,
+    UINT32 idx);
+static VOID WinDivertFlowFree(PWINDIVERT_FLOW_TABLE table, UINT32 idx);
+
+/*
+ * Create a flow table.
+ */
+extern HANDLE WinDivertHelperFlowTableCreate(UINT maxFlows, UINT dataSize,
+    UINT timeout)
+{
+    PWINDIVERT_FLOW_TABLE table;
+    PWINDIVERT_FLOW_ENTRY entry;
+    UINT32 num_slots, i;
+
+    if (maxFlows == 0 || maxFlows > WINDIVERT_FLOW_TABLE_MAX_FLOWS ||
+        dataSize > WINDIVERT_FLOW_TABLE_MAX_DATA || timeout == 0 ||
+        timeout > WINDIVERT_FLOW_TABLE_MAX_TIMEOUT)
     {
-        switch (filter[i].success)
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+    table = (PWINDIVERT_FLOW_TABLE)malloc(sizeof(WINDIVERT_FLOW_TABLE));
+    if (table == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // Keep the index at most half full, so that probe sequences are short:
+    for (num_slots = 1; num_slots < 2 * maxFlows; num_slots <<= 1)
+        ;
+    table->magic      = WINDIVERT_FLOW_TABLE_MAGIC;
+    table->timeout    = timeout;
+    table->tick_len   = timeout / (WINDIVERT_FLOW_WHEEL_SIZE / 2);
+    table->tick_len   = (table->tick_len == 0? 1: table->tick_len);
+    table->tick       = GetTickCount64() / table->tick_len;
+    table->mask       = num_slots - 1;
+    table->max_flows  = maxFlows;
+    table->entry_size = sizeof(WINDIVERT_FLOW_ENTRY) + ((dataSize + 7) & ~7);
+    table->slots      = (PWINDIVERT_FLOW_SLOT)calloc(num_slots,
+        sizeof(WINDIVERT_FLOW_SLOT));
+    table->entries    = (UINT8 *)malloc((SIZE_T)maxFlows * table->entry_size);
+    if (table->slots == NULL || table->entries == NULL)
+    {
+        free(table->slots);
+        free(table->entries);
+        free(table);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    for (i = 0; i < WINDIVERT_FLOW_WHEEL_SIZE; i++)
+    {
+        table->wheel[i] = WINDIVERT_FLOW_NIL;
+    }
+    for (i = 0; i < maxFlows; i++)
+    {
+        entry = WINDIVERT_FLOW_ENTRY(table, i);
+        entry->key.version = 0;
+        entry->next = (i + 1 < maxFlows? i + 1: WINDIVERT_FLOW_NIL);
+    }
+    table->free = 0;
+
+    return (HANDLE)table;
+}
+
+/*
+ * Find (or create) the flow of a packet.
+ */
+extern PVOID WinDivertHelperFlowLookup(HANDLE handle, PVOID pPacket,
+    UINT packetLen, UINT64 flags, BOOL *pReverse)
+{
+    PWINDIVERT_FLOW_TABLE table = (PWINDIVERT_FLOW_TABLE)handle;
+    PWINDIVERT_FLOW_ENTRY entry;
+    PWINDIVERT_FLOW_SLOT slot;
+    struct windivert_headers_s headers;
+    WINDIVERT_PACKET packet;
+    WINDIVERT_FLOW_KEY key;
+    UINT64 now;
+    UINT32 hash, idx, i;
+    BOOL swapped;
+
+    if (table == NULL || table == INVALID_HANDLE_VALUE ||
+        table->magic != WINDIVERT_FLOW_TABLE_MAGIC || pPacket == NULL ||
+        (flags & ~WINDIVERT_FLOW_CREATE) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    packet.data = (UINT8 *)pPacket;
+    packet.len  = (size_t)packetLen;
+    if (!windivert_parse_headers(&packet, WINDIVERT_FILTER_DEPTH_TRANSPORT,
+            &headers) ||
+        !WinDivertFlowKey(&headers, &key, &swapped))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    hash = windivert_hash_headers(&headers);
+    now = GetTickCount64();
+
+    // Linear probing:
+    for (i = hash & table->mask; ; i = (i + 1) & table->mask)
+    {
+        slot = table->slots + i;
+        if (slot->entry == 0)
         {
-            case WINDIVERT_FILTER_RESULT_ACCEPT:
-                filter[i].success = success;
-                break;
-            case WINDIVERT_FILTER_RESULT_REJECT:
-                filter[i].success = failure;
-                break;
+            break;
         }
-        switch (filter[i].failure)
+        if (slot->hash != hash)
         {
-            case WINDIVERT_FILTER_RESULT_ACCEPT:
-                filter[i].failure = success;
-                break;
-            case WINDIVERT_FILTER_RESULT_REJECT:
-                filter[i].failure = failure;
-                break;
+            continue;
+        }
+        entry = WINDIVERT_FLOW_ENTRY(table, slot->entry - 1);
+        if (memcmp(&entry->key, &key, sizeof(key)) == 0)
+        {
+            entry->last = (UINT32)now;
+            if (pReverse != NULL)
+            {
+                *pReverse = (swapped != (BOOL)entry->reverse);
+            }
+            return (PVOID)(entry + 1);
         }
     }
-}
 
-/****************************************************************************/
-/* WINDIVERT HELPER IMPLEMENTATION                                          */
-/****************************************************************************/
+    // Not found; 'slot' is the free slot at the end of the probe sequence.
+    if ((flags & WINDIVERT_FLOW_CREATE) == 0)
+    {
+        SetLastError(ERROR_NOT_FOUND);
+        return NULL;
+    }
+    idx = table->free;
+    if (idx == WINDIVERT_FLOW_NIL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    entry = WINDIVERT_FLOW_ENTRY(table, idx);
+    table->free = entry->next;
+    memcpy(&entry->key, &key, sizeof(key));
+    entry->hash    = hash;
+    entry->last    = (UINT32)now;
+    entry->due     = (UINT32)((now + table->timeout) / table->tick_len);
+    entry->reverse = (UINT32)swapped;
+    memset(entry + 1, 0, table->entry_size - sizeof(WINDIVERT_FLOW_ENTRY));
+    WinDivertFlowWheelInsert(table, idx);
+    slot->hash  = hash;
+    slot->entry = idx + 1;
+    if (pReverse != NULL)
+    {
+        *pReverse = FALSE;
+    }
+    return (PVOID)(entry + 1);
+}
 
 /*
- * Parse IPv4/IPv6/ICMP/ICMPv6/TCP/UDP headers from a raw packet.
+ * Remove a flow from a flow table.
  */
-extern BOOL WinDivertHelperParsePacket(PVOID pPacket, UINT packetLen,
-    PWINDIVERT_IPHDR *ppIpHdr, PWINDIVERT_IPV6HDR *ppIpv6Hdr,
-    PWINDIVERT_ICMPHDR *ppIcmpHdr, PWINDIVERT_ICMPV6HDR *ppIcmpv6Hdr,
-    PWINDIVERT_TCPHDR *ppTcpHdr, PWINDIVERT_UDPHDR *ppUdpHdr, PVOID *ppData,
-    UINT *pDataLen)
+extern BOOL WinDivertHelperFlowRemove(HANDLE handle, PVOID pData)
+{
+    PWINDIVERT_FLOW_TABLE table = (PWINDIVERT_FLOW_TABLE)handle;
+    PWINDIVERT_FLOW_ENTRY entry;
+    SIZE_T offset;
+    UINT32 idx;
+
+    if (table == NULL || table == INVALID_HANDLE_VALUE ||
+        table->magic != WINDIVERT_FLOW_TABLE_MAGIC || pData == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    entry = (PWINDIVERT_FLOW_ENTRY)pData - 1;
+    offset = (SIZE_T)((UINT8 *)entry - table->entries);
+    if ((UINT8 *)entry < table->entries ||
+        offset >= (SIZE_T)table->max_flows * table->entry_size ||
+        offset % table->entry_size != 0 || entry->key.version == 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    idx = (UINT32)(offset / table->entry_size);
+    WinDivertFlowWheelRemove(table, idx);
+    WinDivertFlowFree(table, idx);
+    return TRUE;
+}
+
+/*
+ * Remove the flows that have been idle for longer than the timeout.
+ */
+extern BOOL WinDivertHelperFlowTableExpire(HANDLE handle)
 {
-    PWINDIVERT_IPHDR ip_header = NULL;
-    PWINDIVERT_IPV6HDR ipv6_header = NULL;
-    PWINDIVERT_ICMPHDR icmp_header = NULL;
-    PWINDIVERT_ICMPV6HDR icmpv6_header = NULL;
-    PWINDIVERT_TCPHDR tcp_header = NULL;
-    PWINDIVERT_UDPHDR udp_header = NULL;
-    UINT16 header_len;
-    UINT8 trans_proto;
-    PVOID data = NULL;
-    UINT data_len = 0;
-    BOOL success;
+    PWINDIVERT_FLOW_TABLE table = (PWINDIVERT_FLOW_TABLE)handle;
+    PWINDIVERT_FLOW_ENTRY entry;
+    UINT64 now, now_tick, tick, due;
+    UINT32 idx, next, idle, s;
 
-    if (pPacket == NULL || packetLen < sizeof(UINT8))
+    if (table == NULL || table == INVALID_HANDLE_VALUE ||
+        table->magic != WINDIVERT_FLOW_TABLE_MAGIC)
     {
-        goto WinDivertHelperParsePacketExit;
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
     }
-    data = pPacket;
-    data_len = packetLen;
-
-    ip_header = (PWINDIVERT_IPHDR)data;
-    switch (ip_header->Version)
+    now = GetTickCount64();
+    now_tick = now / table->tick_len;
+    tick = table->tick + 1;
+    if (now_tick - table->tick > WINDIVERT_FLOW_WHEEL_SIZE)
     {
-        case 4:
-            if (data_len < sizeof(WINDIVERT_IPHDR) ||
-                ip_header->HdrLength < 5 ||
-                data_len < ip_header->HdrLength*sizeof(UINT32) ||
-                ntohs(ip_header->Length) != data_len)
-            {
-                ip_header = NULL;
-                goto WinDivertHelperParsePacketExit;
-            }
-            trans_proto = ip_header->Protocol;
-            header_len = ip_header->HdrLength*sizeof(UINT32); 
-            data = (PVOID)((UINT8 *)data + header_len);
-            data_len -= header_len;
-            break;
-        case 6:
-            ip_header = NULL;
-            ipv6_header = (PWINDIVERT_IPV6HDR)data;
-            if (data_len < sizeof(WINDIVERT_IPV6HDR) ||
-                ntohs(ipv6_header->Length) !=
-                    data_len - sizeof(WINDIVERT_IPV6HDR))
-            {
-                ipv6_header = NULL;
-                goto WinDivertHelperParsePacketExit;
-            }
-            trans_proto = ipv6_header->NextHdr;
-            data = (PVOID)((UINT8 *)data + sizeof(WINDIVERT_IPV6HDR));
-            data_len -= sizeof(WINDIVERT_IPV6HDR);
-            break;
-        default:
-            ip_header = NULL;
-            goto WinDivertHelperParsePacketExit;
+        tick = now_tick - WINDIVERT_FLOW_WHEEL_SIZE + 1;
     }
 
-    switch (trans_proto)
+    // A flow is re-scheduled when its wheel slot comes due, rather than on
+    // every packet; so a lookup costs no list updates.
+    for (; tick <= now_tick; tick++)
     {
-        case IPPROTO_TCP:
-            tcp_header = (PWINDIVERT_TCPHDR)data;
-            if (data_len < sizeof(WINDIVERT_TCPHDR) ||
-                tcp_header->HdrLength < 5 ||
-                data_len < tcp_header->HdrLength*sizeof(UINT32))
-            {
-                tcp_header = NULL;
-                goto WinDivertHelperParsePacketExit;
-            }
-            header_len = tcp_header->HdrLength*sizeof(UINT32);
-            data = ((UINT8 *)data + header_len);
-            data_len -= header_len;
-            break;
-        case IPPROTO_UDP:
-            udp_header = (PWINDIVERT_UDPHDR)data;
-            if (data_len < sizeof(WINDIVERT_UDPHDR) ||
-                ntohs(udp_header->Length) != data_len)
-            {
-                udp_header = NULL;
-                goto WinDivertHelperParsePacketExit;
-            }
-            data = ((UINT8 *)data + sizeof(WINDIVERT_UDPHDR));
-            data_len -= sizeof(WINDIVERT_UDPHDR);
-            break;
-        case IPPROTO_ICMP:
-            icmp_header = (PWINDIVERT_ICMPHDR)data;
-            if (ip_header == NULL ||
-                data_len < sizeof(WINDIVERT_ICMPHDR))
+        s = (UINT32)(tick % WINDIVERT_FLOW_WHEEL_SIZE);
+        idx = table->wheel[s];
+        table->wheel[s] = WINDIVERT_FLOW_NIL;
+        for (; idx != WINDIVERT_FLOW_NIL; idx = next)
+        {
+            entry = WINDIVERT_FLOW_ENTRY(table, idx);
+            next = entry->next;
+            if ((INT32)(entry->due - (UINT32)now_tick) > 0)
             {
-                icmp_header = NULL;
-                goto WinDivertHelperParsePacketExit;
+                // Due on a later turn of the wheel.
+                WinDivertFlowWheelInsert(table, idx);
+                continue;
             }
-            data = ((UINT8 *)data + sizeof(WINDIVERT_ICMPHDR));
-            data_len -= sizeof(WINDIVERT_ICMPHDR);
-            break;
-        case IPPROTO_ICMPV6:
-            icmpv6_header = (PWINDIVERT_ICMPV6HDR)data;
-            if (ipv6_header == NULL ||
-                data_len < sizeof(WINDIVERT_ICMPV6HDR))
+            idle = (UINT32)now - entry->last;
+            if (idle >= table->timeout)
             {
-                icmpv6_header = NULL;
-                goto WinDivertHelperParsePacketExit;
+                // (Already unlinked from the wheel.)
+                WinDivertFlowFree(table, idx);
+                continue;
             }
-            data = ((UINT8 *)data + sizeof(WINDIVERT_ICMPV6HDR));
-            data_len -= sizeof(WINDIVERT_ICMPV6HDR);
-            break;
-        default:
-            break;
+            // Round up, and never into a tick that has already been done:
+            due = (now - idle + table->timeout + table->tick_len - 1) /
+                table->tick_len;
+            entry->due = (UINT32)(due > now_tick? due: now_tick + 1);
+            WinDivertFlowWheelInsert(table, idx);
+        }
     }
+    table->tick = now_tick;
+    return TRUE;
+}
 
-    if (data_len == 0)
-    {
-        data = NULL;
-    }
+/*
+ * Destroy a flow table.
+ */
+extern BOOL WinDivertHelperFlowTableDestroy(HANDLE handle)
+{
+    PWINDIVERT_FLOW_TABLE table = (PWINDIVERT_FLOW_TABLE)handle;
 
-WinDivertHelperParsePacketExit:
-    success = TRUE;
-    if (ppIpHdr != NULL)
+    if (table == NULL || table == INVALID_HANDLE_VALUE ||
+        table->magic != WINDIVERT_FLOW_TABLE_MAGIC)
     {
-        *ppIpHdr = ip_header;
-        success = success && (ip_header != NULL);
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
     }
-    if (ppIpv6Hdr != NULL)
+    table->magic = 0;
+    free(table->slots);
+    free(table->entries);
+    free(table);
+    return TRUE;
+}
+
+/*
+ * Build the normalized flow key of a packet.  The endpoints are ordered so
+ * that both directions of a flow have the same key.
+ */
+static BOOL WinDivertFlowKey(windivert_headers_t headers,
+    PWINDIVERT_FLOW_KEY key, BOOL *swapped)
+{
+    UINT32 addr[2][4];
+    UINT16 port[2] = {0, 0};
+    int cmp;
+
+    memset(key, 0, sizeof(*key));
+    memset(addr, 0, sizeof(addr));
+    if (headers->ip_header != NULL)
     {
-        *ppIpv6Hdr = ipv6_header;
-        success = success && (ipv6_header != NULL);
+        addr[0][0] = headers->ip_header->SrcAddr;
+        addr[1][0] = headers->ip_header->DstAddr;
+        key->protocol = headers->ip_header->Protocol;
+        key->version  = 4;
     }
-    if (ppIcmpHdr != NULL)
+    else if (headers->ipv6_header != NULL)
     {
-        *ppIcmpHdr = icmp_header;
-        success = success && (icmp_header != NULL);
+        memcpy(addr[0], headers->ipv6_header->SrcAddr, sizeof(addr[0]));
+        memcpy(addr[1], headers->ipv6_header->DstAddr, sizeof(addr[1]));
+        key->protocol = headers->ipv6_header->NextHdr;
+        key->version  = 6;
     }
-    if (ppIcmpv6Hdr != NULL)
+    else
     {
-        *ppIcmpv6Hdr = icmpv6_header;
-        success = success && (icmpv6_header != NULL);
+        return FALSE;
     }
-    if (ppTcpHdr != NULL)
+
+    // Same rules as windivert_hash_headers(): fragments have no ports.
+    if (headers->ip_header != NULL &&
+        (IPHDR_GET_FRAGOFF(headers->ip_header) != 0 ||
+         IPHDR_GET_MF(headers->ip_header) != 0))
     {
-        *ppTcpHdr = tcp_header;
-        success = success && (tcp_header != NULL);
+        ;
     }
-    if (ppUdpHdr != NULL)
+    else if (headers->tcp_header != NULL)
     {
-        *ppUdpHdr = udp_header;
-        success = success && (udp_header != NULL);
+        port[0] = headers->tcp_header->SrcPort;
+        port[1] = headers->tcp_header->DstPort;
     }
-    if (ppData != NULL)
+    else if (headers->udp_header != NULL)
     {
-        *ppData = data;
-        success = success && (data != NULL);
+        port[0] = headers->udp_header->SrcPort;
+        port[1] = headers->udp_header->DstPort;
     }
-    if (pDataLen != NULL)
+
+    cmp = memcmp(addr[0], addr[1], sizeof(addr[0]));
+    *swapped = (cmp > 0 || (cmp == 0 && port[0] > port[1]));
+    memcpy(key->addr[0], addr[*swapped? 1: 0], sizeof(key->addr[0]));
+    memcpy(key->addr[1], addr[*swapped? 0: 1], sizeof(key->addr[1]));
+    key->port[0] = port[*swapped? 1: 0];
+    key->port[1] = port[*swapped? 0: 1];
+    return TRUE;
+}
+
+/*
+ * Add a flow to the timer wheel list for its due tick.
+ */
+static VOID WinDivertFlowWheelInsert(PWINDIVERT_FLOW_TABLE table, UINT32 idx)
+{
+    PWINDIVERT_FLOW_ENTRY entry = WINDIVERT_FLOW_ENTRY(table, idx);
+    UINT32 *head;
+
+    head = table->wheel + entry->due % WINDIVERT_FLOW_WHEEL_SIZE;
+    entry->prev = WINDIVERT_FLOW_NIL;
+    entry->next = *head;
+    if (*head != WINDIVERT_FLOW_NIL)
     {
-        *pDataLen = data_len;
+        WINDIVERT_FLOW_ENTRY(table, *head)->prev = idx;
     }
-    return success;
+    *head = idx;
 }
 
 /*
- * Calculate IPv4/IPv6/ICMP/ICMPv6/TCP/UDP checksums.
+ * Unlink a flow from its timer wheel list.
  */
-extern UINT WinDivertHelperCalcChecksums(PVOID pPacket, UINT packetLen,
-    UINT64 flags)
+static VOID WinDivertFlowWheelRemove(PWINDIVERT_FLOW_TABLE table, UINT32 idx)
 {
-    WINDIVERT_PSEUDOHDR pseudo_header;
-    WINDIVERT_PSEUDOV6HDR pseudov6_header;
-    PWINDIVERT_IPHDR ip_header;
-    PWINDIVERT_IPV6HDR ipv6_header;
-    PWINDIVERT_ICMPHDR icmp_header;
-    PWINDIVERT_ICMPV6HDR icmpv6_header;
-    PWINDIVERT_TCPHDR tcp_header;
-    PWINDIVERT_UDPHDR udp_header;
-    UINT payload_len, checksum_len;
-    UINT count = 0;
-
-    WinDivertHelperParsePacket(pPacket, packetLen, &ip_header, &ipv6_header,
-        &icmp_header, &icmpv6_header, &tcp_header, &udp_header, NULL,
-        &payload_len);
+    PWINDIVERT_FLOW_ENTRY entry = WINDIVERT_FLOW_ENTRY(table, idx);
 
-    if (ip_header != NULL && !(flags & WINDIVERT_HELPER_NO_IP_CHECKSUM))
+    if (entry->prev == WINDIVERT_FLOW_NIL)
     {
-        ip_header->Checksum = 0;
-        ip_header->Checksum = WinDivertHelperCalcChecksum(NULL, 0,
-            ip_header, ip_header->HdrLength*sizeof(UINT32));
-        count++;
+        table->wheel[entry->due % WINDIVERT_FLOW_WHEEL_SIZE] = entry->next;
     }
-
-    if (icmp_header != NULL)
+    else
     {
-        if (flags & WINDIVERT_HELPER_NO_ICMP_CHECKSUM)
-        {
-            return count;
-        }
-        icmp_header->Checksum = 0;
-        icmp_header->Checksum = WinDivertHelperCalcChecksum(NULL, 0,
-            icmp_header, payload_len + sizeof(WINDIVERT_ICMPHDR));
-        count++;
-        return count;
+        WINDIVERT_FLOW_ENTRY(table, entry->prev)->next = entry->next;
     }
-
-    if (icmpv6_header != NULL)
+    if (entry->next != WINDIVERT_FLOW_NIL)
     {
-        if (flags & WINDIVERT_HELPER_NO_ICMPV6_CHECKSUM)
-        {
-            return count;
-        }
-        checksum_len = payload_len + sizeof(WINDIVERT_ICMPV6HDR);
-        WinDivertInitPseudoHeaderV6(ipv6_header, &pseudov6_header,
-            IPPROTO_ICMPV6, checksum_len);
-        icmpv6_header->Checksum = 0;
-        icmpv6_header->Checksum = WinDivertHelperCalcChecksum(&pseudov6_header,
-            sizeof(pseudov6_header), icmpv6_header, checksum_len);
-        count++;
-        return count;
+        WINDIVERT_FLOW_ENTRY(table, entry->next)->prev = entry->prev;
     }
+}
 
-    if (tcp_header != NULL)
+/*
+ * Remove a flow (already unlinked from the wheel) from the index, and
+ * return its entry to the free list.
+ */
+static VOID WinDivertFlowFree(PWINDIVERT_FLOW_TABLE table, UINT32 idx)
+{
+    PWINDIVERT_FLOW_ENTRY entry = WINDIVERT_FLOW_ENTRY(table, idx);
+    UINT32 i, j, k;
+
+    for (i = entry->hash & table->mask; table->slots[i].entry != idx + 1;
+            i = (i + 1) & table->mask)
+        ;
+
+    // Backward shift deletion: move later entries of the probe sequence
+    // into the hole, unless that would put them before their home slot.
+    for (j = i; ; )
     {
-        if (flags & WINDIVERT_HELPER_NO_TCP_CHECKSUM)
-        {
-            return count;
-        }
-        checksum_len = payload_len + tcp_header->HdrLength*sizeof(UINT32);
-        if (ip_header != NULL)
+        j = (j + 1) & table->mask;
+        if (table->slots[j].entry == 0)
         {
-            WinDivertInitPseudoHeader(ip_header, &pseudo_header, IPPROTO_TCP,
-                checksum_len);
-            tcp_header->Checksum = 0;
-            tcp_header->Checksum = WinDivertHelperCalcChecksum(&pseudo_header,
-                sizeof(pseudo_header), tcp_header, checksum_len);
+            break;
         }
-        else
+        k = table->slots[j].hash & table->mask;
+        if (i <= j? (i < k && k <= j): (i < k || k <= j))
         {
-            WinDivertInitPseudoHeaderV6(ipv6_header, &pseudov6_header,
-                IPPROTO_TCP, checksum_len);
-            tcp_header->Checksum = 0;
-            tcp_header->Checksum = WinDivertHelperCalcChecksum(&pseudov6_header,
-                sizeof(pseudov6_header), tcp_header, checksum_len);
+            continue;
         }
-        count++;
-        return count;
+        table->slots[i] = table->slots[j];
+        i = j;
+    }
+    table->slots[i].entry = 0;
+
+    entry->key.version = 0;
+    entry->next = table->free;
+    table->free = idx;
+}
+
+/*
+ * pcapng capture file definitions.
+ */
+#define WINDIVERT_PCAP_MAGIC                0x50414350  // "PCAP"
+#define WINDIVERT_PCAP_BUFFER_SIZE          (1024*1024)
+#define WINDIVERT_PCAP_LINKTYPE_RAW         101
+#define WINDIVERT_PCAP_BLOCK_SHB            0x0A0D0D0A
+#define WINDIVERT_PCAP_BLOCK_IDB            0x00000001
+#define WINDIVERT_PCAP_BLOCK_EPB            0x00000006
+#define WINDIVERT_PCAP_BYTE_ORDER           0x1A2B3C4D
+#define WINDIVERT_PCAP_OPT_END              0
+#define WINDIVERT_PCAP_OPT_IF_NAME          2
+#define WINDIVERT_PCAP_OPT_EPB_FLAGS        2
+#define WINDIVERT_PCAP_FLAG_INBOUND         0x00000001
+#define WINDIVERT_PCAP_FLAG_OUTBOUND        0x00000002
+#define WINDIVERT_PCAP_EPOCH                116444736000000000ull
+
+typedef struct
+{
+    UINT32 IfIdx;
+    UINT32 SubIfIdx;
+} WINDIVERT_PCAP_INTERFACE, *PWINDIVERT_PCAP_INTERFACE;
+
+typedef struct
+{
+    UINT32 magic;                           // WINDIVERT_PCAP_MAGIC
+    HANDLE file;                            // Current file
+    char *filename;                         // Base file name
+    char *name;                             // Current file name
+    UINT64 rotate_size;                     // Max file size (or 0)
+    UINT32 rotate_time;                     // Max file time (ms, or 0)
+    UINT32 seq;                             // Current file number
+    UINT64 file_size;                       // Current file size
+    ULONGLONG file_start;                   // Current file open time
+    UINT num_interfaces;                    // Interfaces in current file
+    UINT max_interfaces;
+    PWINDIVERT_PCAP_INTERFACE interfaces;   // IDB id -> interface
+    UINT8 *buf;                             // Write buffer
+    UINT buf_len;
+} WINDIVERT_PCAP, *PWINDIVERT_PCAP;
+
+static BOOL WinDivertPcapFileOpen(PWINDIVERT_PCAP pcap);
+static BOOL WinDivertPcapFileClose(PWINDIVERT_PCAP pcap);
+static BOOL WinDivertPcapFlush(PWINDIVERT_PCAP pcap);
+static UINT8 *WinDivertPcapReserve(PWINDIVERT_PCAP pcap, UINT len);
+static BOOL WinDivertPcapInterface(PWINDIVERT_PCAP pcap,
+    PWINDIVERT_ADDRESS addr, UINT32 *id);
+static VOID WinDivertPcapFree(PWINDIVERT_PCAP pcap);
+
+/*
+ * Open a pcapng capture file.
+ */
+extern HANDLE WinDivertHelperPcapOpen(const char *filename,
+    UINT64 rotateSize, UINT rotateTime)
+{
+    PWINDIVERT_PCAP pcap;
+    SIZE_T len;
+
+    if (filename == NULL || rotateTime > WINDIVERT_PCAP_MAX_ROTATE_TIME ||
+        (rotateSize != 0 && rotateSize < WINDIVERT_PCAP_MIN_ROTATE_SIZE))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+    pcap = (PWINDIVERT_PCAP)malloc(sizeof(WINDIVERT_PCAP));
+    if (pcap == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    memset(pcap, 0, sizeof(WINDIVERT_PCAP));
+    pcap->file        = INVALID_HANDLE_VALUE;
+    pcap->rotate_size = rotateSize;
+    pcap->rotate_time = rotateTime * 1000;
+    len = strlen(filename);
+    pcap->filename = (char *)malloc(len + 1);
+    pcap->name = (char *)malloc(len + 16);
+    pcap->max_interfaces = 16;
+    pcap->interfaces = (PWINDIVERT_PCAP_INTERFACE)malloc(
+        pcap->max_interfaces * sizeof(WINDIVERT_PCAP_INTERFACE));
+
+    // Page aligned, so that WriteFile() can use the buffer directly.
+    pcap->buf = (UINT8 *)VirtualAlloc(NULL, WINDIVERT_PCAP_BUFFER_SIZE,
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (pcap->filename == NULL || pcap->name == NULL ||
+        pcap->interfaces == NULL || pcap->buf == NULL)
+    {
+        WinDivertPcapFree(pcap);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
     }
+    memcpy(pcap->filename, filename, len + 1);
+    pcap->magic = WINDIVERT_PCAP_MAGIC;
 
-    if (udp_header != NULL)
+    if (!WinDivertPcapFileOpen(pcap))
     {
-        if (flags & WINDIVERT_HELPER_NO_UDP_CHECKSUM)
-        {
-            return count;
-        }
-        checksum_len = payload_len + sizeof(WINDIVERT_UDPHDR);
-        if (ip_header != NULL)
+        DWORD err = GetLastError();
+        WinDivertPcapFree(pcap);
+        SetLastError(err);
+        return INVALID_HANDLE_VALUE;
+    }
+    return (HANDLE)pcap;
+}
+
+/*
+ * Write a packet to a pcapng capture file.
+ */
+extern BOOL WinDivertHelperPcapWrite(HANDLE handle, PVOID pPacket,
+    UINT packetLen, PWINDIVERT_ADDRESS pAddr)
+{
+    PWINDIVERT_PCAP pcap = (PWINDIVERT_PCAP)handle;
+    FILETIME now;
+    UINT64 timestamp;
+    UINT32 id, len, pad_len;
+    UINT8 *block;
+
+    if (pcap == NULL || pcap == INVALID_HANDLE_VALUE ||
+        pcap->magic != WINDIVERT_PCAP_MAGIC || pPacket == NULL ||
+        packetLen > WINDIVERT_PCAP_MAX_PACKET || pAddr == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    // Start a new file if the current file is too big or too old:
+    pad_len = (packetLen + 3) & ~3;
+    len = 28 + pad_len + 12 + 4;
+    if ((pcap->rotate_size != 0 && pcap->num_interfaces != 0 &&
+            pcap->file_size + len > pcap->rotate_size) ||
+        (pcap->rotate_time != 0 &&
+            GetTickCount64() - pcap->file_start >= pcap->rotate_time))
+    {
+        if (!WinDivertPcapFileClose(pcap))
         {
-            WinDivertInitPseudoHeader(ip_header, &pseudo_header, IPPROTO_UDP, 
-                checksum_len);
-            udp_header->Checksum = 0;
-            udp_header->Checksum = WinDivertHelperCalcChecksum(&pseudo_header,
-                sizeof(pseudo_header), udp_header, checksum_len);
-            if (udp_header->Checksum == 0)
-            {
-                udp_header->Checksum = 0xFFFF;
-            }
+            return FALSE;
         }
-        else
+        pcap->seq++;
+        if (!WinDivertPcapFileOpen(pcap))
         {
-            WinDivertInitPseudoHeaderV6(ipv6_header, &pseudov6_header,
-                IPPROTO_UDP, checksum_len);
-            udp_header->Checksum = 0;
-            udp_header->Checksum = WinDivertHelperCalcChecksum(&pseudov6_header,
-                sizeof(pseudov6_header), udp_header, checksum_len);
+            return FALSE;
         }
-        count++;
     }
-    return count;
+
+    if (!WinDivertPcapInterface(pcap, pAddr, &id))
+    {
+        return FALSE;
+    }
+    block = WinDivertPcapReserve(pcap, len);
+    if (block == NULL)
+    {
+        return FALSE;
+    }
+
+    // Enhanced Packet Block:
+    GetSystemTimeAsFileTime(&now);
+    timestamp = ((((UINT64)now.dwHighDateTime) << 32) | now.dwLowDateTime);
+    timestamp = (timestamp - WINDIVERT_PCAP_EPOCH) / 10;
+    ((UINT32 *)block)[0] = WINDIVERT_PCAP_BLOCK_EPB;
+    ((UINT32 *)block)[1] = len;
+    ((UINT32 *)block)[2] = id;
+    ((UINT32 *)block)[3] = (UINT32)(timestamp >> 32);
+    ((UINT32 *)block)[4] = (UINT32)timestamp;
+    ((UINT32 *)block)[5] = packetLen;
+    ((UINT32 *)block)[6] = packetLen;
+    memcpy(block + 28, pPacket, packetLen);
+    memset(block + 28 + packetLen, 0, pad_len - packetLen);
+    block += 28 + pad_len;
+    ((UINT16 *)block)[0] = WINDIVERT_PCAP_OPT_EPB_FLAGS;
+    ((UINT16 *)block)[1] = sizeof(UINT32);
+    ((UINT32 *)block)[1] = (pAddr->Direction == WINDIVERT_DIRECTION_INBOUND?
+        WINDIVERT_PCAP_FLAG_INBOUND: WINDIVERT_PCAP_FLAG_OUTBOUND);
+    ((UINT16 *)block)[4] = WINDIVERT_PCAP_OPT_END;
+    ((UINT16 *)block)[5] = 0;
+    ((UINT32 *)block)[3] = len;
+    return TRUE;
 }
 
 /*
- * Initialize the IP pseudo header.
+ * Write any buffered packets to the capture file.
  */
-static void WinDivertInitPseudoHeader(PWINDIVERT_IPHDR ip_header,
-    PWINDIVERT_PSEUDOHDR pseudo_header, UINT8 protocol, UINT len)
+extern BOOL WinDivertHelperPcapFlush(HANDLE handle)
 {
-    pseudo_header->SrcAddr  = ip_header->SrcAddr;
-    pseudo_header->DstAddr  = ip_header->DstAddr;
-    pseudo_header->Zero     = 0;
-    pseudo_header->Protocol = protocol;
-    pseudo_header->Length   = htons((UINT16)len);
+    PWINDIVERT_PCAP pcap = (PWINDIVERT_PCAP)handle;
+
+    if (pcap == NULL || pcap == INVALID_HANDLE_VALUE ||
+        pcap->magic != WINDIVERT_PCAP_MAGIC)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    return WinDivertPcapFlush(pcap);
 }
 
 /*
- * Initialize the IPv6 pseudo header.
+ * Close a pcapng capture file.
  */
-static void WinDivertInitPseudoHeaderV6(PWINDIVERT_IPV6HDR ipv6_header,
-    PWINDIVERT_PSEUDOV6HDR pseudov6_header, UINT8 protocol, UINT len)
+extern BOOL WinDivertHelperPcapClose(HANDLE handle)
 {
-    memcpy(pseudov6_header->SrcAddr, ipv6_header->SrcAddr,
-        sizeof(pseudov6_header->SrcAddr));
-    memcpy(pseudov6_header->DstAddr, ipv6_header->DstAddr,
-        sizeof(pseudov6_header->DstAddr));
-    pseudov6_header->Length  = htonl((UINT32)len);
-    pseudov6_header->NextHdr = protocol;
-    pseudov6_header->Zero    = 0;
+    PWINDIVERT_PCAP pcap = (PWINDIVERT_PCAP)handle;
+    BOOL result;
+    DWORD err;
+
+    if (pcap == NULL || pcap == INVALID_HANDLE_VALUE ||
+        pcap->magic != WINDIVERT_PCAP_MAGIC)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    pcap->magic = 0;
+    result = WinDivertPcapFileClose(pcap);
+    err = GetLastError();
+    WinDivertPcapFree(pcap);
+    SetLastError(err);
+    return result;
 }
 
 /*
- * Generic checksum computation.
+ * Open the current capture file, and write the Section Header Block.  With
+ * rotation, files are named "name-NNNNN.ext".
  */
-static UINT16 WinDivertHelperCalcChecksum(PVOID pseudo_header,
-    UINT16 pseudo_header_len, PVOID data, UINT len)
+static BOOL WinDivertPcapFileOpen(PWINDIVERT_PCAP pcap)
 {
-    register const UINT16 *data16 = (const UINT16 *)pseudo_header;
-    register size_t len16 = pseudo_header_len >> 1;
-    register UINT32 sum = 0;
-    size_t i;
+    const char *ext, *sep;
+    UINT8 *block;
 
-    // Pseudo header:
-    for (i = 0; i < len16; i++)
+    if (pcap->rotate_size == 0 && pcap->rotate_time == 0)
     {
-        sum += (UINT32)data16[i];
+        strcpy(pcap->name, pcap->filename);
     }
-
-    // Main data:
-    data16 = (const UINT16 *)data;
-    len16 = len >> 1;
-    for (i = 0; i < len16; i++)
+    else
     {
-        sum += (UINT32)data16[i];
+        ext = strrchr(pcap->filename, '.');
+        sep = strrchr(pcap->filename, '\\');
+        if (ext == NULL || (sep != NULL && sep > ext))
+        {
+            ext = pcap->filename + strlen(pcap->filename);
+        }
+        sprintf(pcap->name, "%.*s-%.5u%s", (int)(ext - pcap->filename),
+            pcap->filename, pcap->seq, ext);
+    }
+    pcap->file = CreateFileA(pcap->name, GENERIC_WRITE, FILE_SHARE_READ,
+        NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL);
+    if (pcap->file == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
     }
+    pcap->file_size      = 0;
+    pcap->file_start     = GetTickCount64();
+    pcap->num_interfaces = 0;
 
-    if (len & 0x1)
+    // Section Header Block (section length unknown):
+    block = WinDivertPcapReserve(pcap, 28);
+    if (block == NULL)
     {
-        const UINT8 *data8 = (const UINT8 *)data;
-        sum += (UINT16)data8[len-1];
+        return FALSE;
     }
+    ((UINT32 *)block)[0] = WINDIVERT_PCAP_BLOCK_SHB;
+    ((UINT32 *)block)[1] = 28;
+    ((UINT32 *)block)[2] = WINDIVERT_PCAP_BYTE_ORDER;
+    ((UINT16 *)block)[6] = 1;               // Major version
+    ((UINT16 *)block)[7] = 0;               // Minor version
+    ((UINT32 *)block)[4] = 0xFFFFFFFF;
+    ((UINT32 *)block)[5] = 0xFFFFFFFF;
+    ((UINT32 *)block)[6] = 28;
+    return TRUE;
+}
 
-    sum = (sum & 0xFFFF) + (sum >> 16);
-    sum += (sum >> 16);
-    sum = ~sum;
-    return (UINT16)sum;
+/*
+ * Flush and close the current capture file.
+ */
+static BOOL WinDivertPcapFileClose(PWINDIVERT_PCAP pcap)
+{
+    BOOL result;
+
+    if (pcap->file == INVALID_HANDLE_VALUE)
+    {
+        return TRUE;
+    }
+    result = WinDivertPcapFlush(pcap);
+    if (!CloseHandle(pcap->file))
+    {
+        result = FALSE;
+    }
+    pcap->file = INVALID_HANDLE_VALUE;
+    return result;
 }
 
 /*
- * Parse an IPv4 address.
+ * Write the buffer to the current capture file.
  */
-extern BOOL WinDivertHelperParseIPv4Address(const char *str, UINT32 *addr_ptr)
+static BOOL WinDivertPcapFlush(PWINDIVERT_PCAP pcap)
 {
-    UINT32 addr = 0;
-    UINT part, i;
+    DWORD written;
+    UINT len = pcap->buf_len;
 
-    errno = 0;
-    for (i = 0; i < 4; i++)
+    pcap->buf_len = 0;
+    if (len == 0)
     {
-        part = strtoul(str, (char **)&str, 10);
-        if (errno != 0 || part > UINT8_MAX)
-        {
-            SetLastError(ERROR_INVALID_PARAMETER);
-            return FALSE;
-        }
-        if (i != 3 && *str++ != '.')
-        {
-            SetLastError(ERROR_INVALID_PARAMETER);
-            return FALSE;
-        }
-        addr |= part << (8*(3-i));
+        return TRUE;
     }
-    if (*str != '\0')
+    if (pcap->file == INVALID_HANDLE_VALUE)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
+        SetLastError(ERROR_INVALID_HANDLE);
         return FALSE;
     }
-    if (addr_ptr != NULL)
+    if (!WriteFile(pcap->file, pcap->buf, len, &written, NULL))
     {
-        *addr_ptr = addr;
+        return FALSE;
+    }
+    if (written != len)
+    {
+        SetLastError(ERROR_WRITE_FAULT);
+        return FALSE;
     }
     return TRUE;
 }
 
 /*
- * Parse an IPv6 address.
+ * Reserve space for a block in the write buffer (flushing it if full).
  */
-extern BOOL WinDivertHelperParseIPv6Address(const char *str, UINT32 *addr_ptr)
+static UINT8 *WinDivertPcapReserve(PWINDIVERT_PCAP pcap, UINT len)
 {
-    UINT16 addr[8] = {0};
-    UINT part;
-    UINT i, j, k;
-    BOOL end = FALSE;
-    char part_str[5];
+    UINT8 *block;
 
-    if (*str == ':')
+    if (pcap->buf_len + len > WINDIVERT_PCAP_BUFFER_SIZE &&
+        !WinDivertPcapFlush(pcap))
     {
-        str++;
-        if (*str != ':')
-        {
-            SetLastError(ERROR_INVALID_PARAMETER);
-            return FALSE;
-        }
-        end = TRUE;
-        str++;
+        return NULL;
     }
+    block = pcap->buf + pcap->buf_len;
+    pcap->buf_len += len;
+    pcap->file_size += len;
+    return block;
+}
 
-    for (i = 0, j = 7; i < 8; i++)
+/*
+ * Get the Interface Description Block id of a packet's interface, writing
+ * a new IDB the first time an interface is seen in the current file.
+ */
+static BOOL WinDivertPcapInterface(PWINDIVERT_PCAP pcap,
+    PWINDIVERT_ADDRESS addr, UINT32 *id)
+{
+    PWINDIVERT_PCAP_INTERFACE interfaces;
+    char name[32];
+    UINT name_len, opt_len, len, i;
+    UINT8 *block;
+
+    for (i = 0; i < pcap->num_interfaces; i++)
     {
-        if (*str == ':')
-        {
-            if (end)
-            {
-                SetLastError(ERROR_INVALID_PARAMETER);
-                return FALSE;
-            }
-            end = TRUE;
-            str++;
-            if (*str == '\0')
-            {
-                break;
-            }
-        }
-        for (k = 0; k < 4 && isxdigit(*str); k++)
-        {
-            part_str[k] = *str;
-            str++;
-        }
-        if (k == 0)
-        {
-            SetLastError(ERROR_INVALID_PARAMETER);
-            return FALSE;
-        }
-        part_str[k] = '\0';
-        if (*str != ':' && *str != '\0')
-        {
-            SetLastError(ERROR_INVALID_PARAMETER);
-            return FALSE;
-        }
-        part = strtoul(part_str, NULL, 16);
-        if (!end)
+        if (pcap->interfaces[i].IfIdx == addr->IfIdx &&
+            pcap->interfaces[i].SubIfIdx == addr->SubIfIdx)
         {
-            addr[i] = (UINT16)ntohs(part);
-        }
-        else
-        {
-            addr[j--] = (UINT16)ntohs(part);
+            *id = i;
+            return TRUE;
         }
-        if (*str == '\0')
+    }
+
+    if (pcap->num_interfaces >= pcap->max_interfaces)
+    {
+        interfaces = (PWINDIVERT_PCAP_INTERFACE)realloc(pcap->interfaces,
+            2 * pcap->max_interfaces * sizeof(WINDIVERT_PCAP_INTERFACE));
+        if (interfaces == NULL)
         {
-            if (end)
-            {
-                break;
-            }
-            if (i == 7)
-            {
-                break;
-            }
-            SetLastError(ERROR_INVALID_PARAMETER);
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
             return FALSE;
         }
-        str++;
+        pcap->interfaces = interfaces;
+        pcap->max_interfaces *= 2;
     }
 
-    if (*str != '\0')
+    // Interface Description Block, named after the interface indices:
+    name_len = (UINT)sprintf(name, "%u.%u", addr->IfIdx, addr->SubIfIdx);
+    opt_len = (name_len + 3) & ~3;
+    len = 16 + 4 + opt_len + 4 + 4;
+    block = WinDivertPcapReserve(pcap, len);
+    if (block == NULL)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
         return FALSE;
     }
+    ((UINT32 *)block)[0] = WINDIVERT_PCAP_BLOCK_IDB;
+    ((UINT32 *)block)[1] = len;
+    ((UINT16 *)block)[4] = WINDIVERT_PCAP_LINKTYPE_RAW;
+    ((UINT16 *)block)[5] = 0;
+    ((UINT32 *)block)[3] = 0;               // SnapLen (no limit)
+    ((UINT16 *)block)[8] = WINDIVERT_PCAP_OPT_IF_NAME;
+    ((UINT16 *)block)[9] = (UINT16)name_len;
+    memset(block + 20, 0, opt_len);
+    memcpy(block + 20, name, name_len);
+    block += 20 + opt_len;
+    ((UINT16 *)block)[0] = WINDIVERT_PCAP_OPT_END;
+    ((UINT16 *)block)[1] = 0;
+    ((UINT32 *)block)[1] = len;
+
+    i = pcap->num_interfaces++;
+    pcap->interfaces[i].IfIdx    = addr->IfIdx;
+    pcap->interfaces[i].SubIfIdx = addr->SubIfIdx;
+    *id = i;
+    return TRUE;
+}
 
-    if (end)
+/*
+ * Free a pcapng capture context.
+ */
+static VOID WinDivertPcapFree(PWINDIVERT_PCAP pcap)
+{
+    if (pcap->file != INVALID_HANDLE_VALUE)
     {
-        j++;
-        for (i = 7; j < i; j++, i--)
-        {
-            UINT16 tmp = addr[i];
-            addr[i] = addr[j];
-            addr[j] = tmp;
-        }
+        CloseHandle(pcap->file);
     }
-    if (addr_ptr != NULL)
+    if (pcap->buf != NULL)
     {
-        memcpy(addr_ptr, addr, sizeof(addr));
+        VirtualFree(pcap->buf, 0, MEM_RELEASE);
     }
-
-    return TRUE;
+    free(pcap->interfaces);
+    free(pcap->name);
+    free(pcap->filename);
+    free(pcap);
 }
 
 /***************************************************************************/
@@ -2331,6 +6349,24 @@ static void WinDivertFilterDump(windivert_ioctl_filter_t filter, UINT16 len)
             case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
                 printf("udp.PayloadLength ");
                 break;
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD:
+                if (filter[i].length == 0)
+                {
+                    printf("tcp.Payload ");
+                    break;
+                }
+                printf("tcp.Payload[%u:%u] ", filter[i].offset,
+                    filter[i].length);
+                break;
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD:
+                if (filter[i].length == 0)
+                {
+                    printf("udp.Payload ");
+                    break;
+                }
+                printf("udp.Payload[%u:%u] ", filter[i].offset,
+                    filter[i].length);
+                break;
             default:
                 printf("unknown.Field ");       
                 break;
@@ -2355,6 +6391,12 @@ static void WinDivertFilterDump(windivert_ioctl_filter_t filter, UINT16 len)
             case WINDIVERT_FILTER_TEST_GEQ:
                 printf(">= ");
                 break;
+            case WINDIVERT_FILTER_TEST_CONTAINS:
+                printf("contains automaton_");
+                break;
+            case WINDIVERT_FILTER_TEST_NCONTAINS:
+                printf("!contains automaton_");
+                break;
             default:
                 printf("?? ");
                 break;
@@ -0,0 +1,1597 @@
+/*
+ * windivert_shared.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * NOTE: This file is #include'd by both the WinDivert driver (sys/) and the
+ *       WinDivert DLL (dll/) so that both use the same filter verifier and
+ *       interpreter.  It must only use portable C.  The includer provides:
+ *       - windivert_device.h, DEBUG(), ntohs() and ntohl();
+ *       - the windivert_packet_t type; and
+ *       - the windivert_packet_*() functions declared below.
+ */
+
+/*
+ * WinDivert packet filter.
+ */
+struct filter_s
+{
+    UINT8  protocol:4;                          // field's protocol
+    UINT8  test:4;                              // Filter test
+    UINT8  field;                               // Field of interest
+    UINT16 success;                             // Success continuation
+    UINT16 failure;                             // Fail continuation
+    UINT16 offset;                              // Payload offset
+    UINT8  length;                              // Payload length
+    UINT8  depth;                               // Header depth needed
+    UINT32 arg[4];                              // Comparison argument
+    windivert_ioctl_automaton_t automaton;      // (n)contains automaton
+};
+typedef struct filter_s *filter_t;
+
+/*
+ * A filter that can be replaced while it is in use (see
+ * windivert_filter_swap()).
+ */
+struct windivert_filter_ref_s
+{
+    filter_t filter;                            // Current filter.
+    volatile LONG epoch;                        // Filter change epoch.
+    volatile LONG readers[2];                   // Filter readers (by epoch).
+};
+typedef struct windivert_filter_ref_s *windivert_filter_ref_t;
+
+/*
+ * Re-inject grouping (see windivert_group_next()).
+ */
+struct windivert_group_s
+{
+    BOOL open;                                  // A group is open.
+    UINT8 direction;                            // Direction of the group.
+    UINT32 hash;                                // Flow hash of the group.
+};
+typedef struct windivert_group_s *windivert_group_t;
+
+/*
+ * Count of objects in use (see windivert_nbl_count_alloc()).
+ */
+struct windivert_nbl_count_s
+{
+    volatile LONG used;                         // Number in use.
+    volatile LONG peak;                         // Peak since last sample.
+};
+typedef struct windivert_nbl_count_s *windivert_nbl_count_t;
+#define WINDIVERT_FILTER_PROTOCOL_NONE          0
+#define WINDIVERT_FILTER_PROTOCOL_IP            1
+#define WINDIVERT_FILTER_PROTOCOL_IPV6          2
+#define WINDIVERT_FILTER_PROTOCOL_ICMP          3
+#define WINDIVERT_FILTER_PROTOCOL_ICMPV6        4
+#define WINDIVERT_FILTER_PROTOCOL_TCP           5
+#define WINDIVERT_FILTER_PROTOCOL_UDP           6
+#define WINDIVERT_FILTER_DEPTH_NONE             0   // Metadata only
+#define WINDIVERT_FILTER_DEPTH_NETWORK          1   // IP/IPv6 header
+#define WINDIVERT_FILTER_DEPTH_TRANSPORT        2   // + transport header
+
+/*
+ * Header definitions.
+ */
+struct iphdr
+{
+    UINT8  HdrLength:4;
+    UINT8  Version:4;
+    UINT8  TOS;
+    UINT16 Length;
+    UINT16 Id;
+    UINT16 FragOff0;
+    UINT8  TTL;
+    UINT8  Protocol;
+    UINT16 Checksum;
+    UINT32 SrcAddr;
+    UINT32 DstAddr;
+};
+struct ipv6hdr
+{
+    UINT8  TrafficClass0:4;
+    UINT8  Version:4;
+    UINT8  FlowLabel0:4;
+    UINT8  TrafficClass1:4;
+    UINT16 FlowLabel1;
+    UINT16 Length;
+    UINT8  NextHdr;
+    UINT8  HopLimit;
+    UINT32 SrcAddr[4];
+    UINT32 DstAddr[4];
+};
+struct icmphdr
+{
+    UINT8  Type;
+    UINT8  Code;
+    UINT16 Checksum;
+    UINT32 Body;
+};
+struct icmpv6hdr
+{
+    UINT8  Type;
+    UINT8  Code;
+    UINT16 Checksum;
+    UINT32 Body;
+};
+struct tcphdr
+{
+    UINT16 SrcPort;
+    UINT16 DstPort;
+    UINT32 SeqNum;
+    UINT32 AckNum;
+    UINT16 Reserved1:4;
+    UINT16 HdrLength:4;
+    UINT16 Fin:1;
+    UINT16 Syn:1;
+    UINT16 Rst:1;
+    UINT16 Psh:1;
+    UINT16 Ack:1;
+    UINT16 Urg:1;
+    UINT16 Reserved2:2;
+    UINT16 Window;
+    UINT16 Checksum;
+    UINT16 UrgPtr;
+};
+struct udphdr
+{
+    UINT16 SrcPort;
+    UINT16 DstPort;
+    UINT16 Length;
+    UINT16 Checksum;
+};
+
+#define IPHDR_GET_FRAGOFF(hdr)          (((hdr)->FragOff0) & 0xFF1F)
+#define IPHDR_GET_MF(hdr)               (((hdr)->FragOff0) & 0x0020)
+#define IPHDR_GET_DF(hdr)               (((hdr)->FragOff0) & 0x0040)
+#define IPV6HDR_GET_TRAFFICCLASS(hdr)   \
+    ((((hdr)->TrafficClass0) << 4) | ((hdr)->TrafficClass1))
+#define IPV6HDR_GET_FLOWLABEL(hdr)      \
+    ((((UINT32)(hdr)->FlowLabel0) << 16) | ((UINT32)(hdr)->FlowLabel1))
+
+/*
+ * Parsed packet headers.
+ */
+struct windivert_headers_s
+{
+    UINT8 *data;                                // Header bytes
+    size_t tot_len;                             // Packet length
+    size_t cpy_len;                             // Length of data
+    size_t ip_header_len;                       // IP header length
+    struct iphdr *ip_header;                    // Headers (or NULL)
+    struct ipv6hdr *ipv6_header;
+    struct icmphdr *icmp_header;
+    struct icmpv6hdr *icmpv6_header;
+    struct tcphdr *tcp_header;
+    struct udphdr *udp_header;
+
+    // Enough space for a full size iphdr and tcphdr (with options) and the
+    // part of the payload that payload fields can access.
+    UINT8 storage[2*0xF*sizeof(UINT32) + WINDIVERT_FILTER_PAYLOAD_MAXLEN];
+};
+typedef struct windivert_headers_s *windivert_headers_t;
+
+/*
+ * Misc.
+ */
+#ifndef UINT8_MAX
+#define UINT8_MAX       0xFF
+#endif
+#ifndef UINT16_MAX
+#define UINT16_MAX      0xFFFF
+#endif
+
+/*
+ * Packet access (provided by the includer).  windivert_packet_data() returns
+ * the first len bytes of the packet (copied into storage if the packet is
+ * not contiguous), or NULL if they cannot be obtained.
+ */
+static size_t windivert_packet_length(windivert_packet_t packet);
+static UINT8 *windivert_packet_data(windivert_packet_t packet, size_t len,
+    UINT8 *storage);
+static BOOL windivert_packet_contains(windivert_packet_t packet,
+    size_t offset, windivert_ioctl_automaton_t automaton);
+static void windivert_packet_prefetch(windivert_packet_t packet);
+
+/*
+ * Prototypes.
+ */
+static BOOL windivert_filter(windivert_packet_t packet, UINT32 if_idx,
+    UINT32 sub_if_idx, BOOL outbound, filter_t filter, UINT32 *hash_ptr);
+static UINT64 windivert_filter_batch(windivert_packet_t *packets, UINT count,
+    UINT32 if_idx, UINT32 sub_if_idx, BOOL outbound, filter_t filter,
+    UINT32 *hashes);
+static BOOL windivert_parse_headers(windivert_packet_t packet, UINT8 depth,
+    windivert_headers_t headers);
+static UINT32 windivert_hash_headers(windivert_headers_t headers);
+static UINT32 windivert_hash_mix(UINT32 hash, UINT32 value);
+static UINT windivert_hash_queue(UINT32 hash, UINT queue_count);
+static UINT32 windivert_hash_packet(windivert_packet_t packet);
+static void windivert_group_init(windivert_group_t group);
+static BOOL windivert_group_next(windivert_group_t group, UINT32 hash,
+    UINT8 direction);
+static void windivert_group_close(windivert_group_t group);
+static void windivert_nbl_count_init(windivert_nbl_count_t count);
+static void windivert_nbl_count_alloc(windivert_nbl_count_t count);
+static void windivert_nbl_count_raise(windivert_nbl_count_t count,
+    LONG used);
+static void windivert_nbl_count_free(windivert_nbl_count_t count);
+static LONG windivert_nbl_count_sample(windivert_nbl_count_t count);
+static BOOL windivert_filter_exec(windivert_packet_t packet,
+    windivert_headers_t headers, UINT32 if_idx, UINT32 sub_if_idx,
+    BOOL outbound, filter_t filter);
+static BOOL windivert_filter_payload(windivert_packet_t packet,
+    size_t tot_len, UINT8 *storage, size_t storage_len, UINT8 **headers_ptr,
+    size_t *cpy_len_ptr, size_t offset, UINT8 length, UINT32 *field);
+static size_t windivert_automaton_verify(windivert_ioctl_automaton_t automaton,
+    size_t len);
+static BOOL windivert_automaton_match(windivert_ioctl_automaton_t automaton,
+    const UINT8 *data, size_t len, UINT32 *state_ptr);
+static BOOL windivert_filter_load(windivert_ioctl_filter_t ioctl_filter,
+    size_t length, UINT8 *automata_data, size_t automata_len,
+    filter_t filter);
+static BOOL windivert_open_verify(windivert_ioctl_open_t ioctl_open,
+    size_t len);
+static void windivert_filter_ref_init(windivert_filter_ref_t ref,
+    filter_t filter);
+static filter_t windivert_filter_swap(windivert_filter_ref_t ref,
+    filter_t filter);
+static filter_t windivert_filter_enter(windivert_filter_ref_t ref,
+    LONG *epoch_ptr);
+static void windivert_filter_exit(windivert_filter_ref_t ref, LONG epoch);
+
+/*
+ * Checks if the given packet is of interest.  If hash_ptr is non-NULL, the
+ * packet's flow hash is also returned (0 if the packet cannot be parsed).
+ */
+static BOOL windivert_filter(windivert_packet_t packet, UINT32 if_idx,
+    UINT32 sub_if_idx, BOOL outbound, filter_t filter, UINT32 *hash_ptr)
+{
+    struct windivert_headers_s headers;
+
+    // The flow hash needs the ports, i.e. the transport header.  A packet
+    // that cannot be parsed that deep is filtered as usual.
+    if (hash_ptr != NULL)
+    {
+        *hash_ptr = 0;
+        if (windivert_parse_headers(packet,
+                WINDIVERT_FILTER_DEPTH_TRANSPORT, &headers))
+        {
+            *hash_ptr = windivert_hash_headers(&headers);
+            return windivert_filter_exec(packet, &headers, if_idx,
+                sub_if_idx, outbound, filter);
+        }
+    }
+
+    if (!windivert_parse_headers(packet, filter[0].depth, &headers))
+    {
+        return FALSE;
+    }
+    return windivert_filter_exec(packet, &headers, if_idx, sub_if_idx,
+        outbound, filter);
+}
+
+/*
+ * Filter a batch of (at most 64) packets.  Returns a bitmap of the verdicts,
+ * where bit i is set if packets[i] is of interest.  If hashes is non-NULL,
+ * the flow hash of each packet is also returned.
+ */
+static UINT64 windivert_filter_batch(windivert_packet_t *packets, UINT count,
+    UINT32 if_idx, UINT32 sub_if_idx, BOOL outbound, filter_t filter,
+    UINT32 *hashes)
+{
+    UINT64 verdicts = 0;
+    UINT i;
+    BOOL prefetch;
+
+    // Headers are only read if the filter or the hash needs them:
+    prefetch = (filter[0].depth != WINDIVERT_FILTER_DEPTH_NONE ||
+        hashes != NULL);
+    for (i = 0; i < count && i < 8*sizeof(verdicts); i++)
+    {
+        if (prefetch && i + 1 < count)
+        {
+            windivert_packet_prefetch(packets[i+1]);
+        }
+        if (windivert_filter(packets[i], if_idx, sub_if_idx, outbound, filter,
+                (hashes != NULL? hashes + i: NULL)))
+        {
+            verdicts |= ((UINT64)1 << i);
+        }
+    }
+    return verdicts;
+}
+
+/*
+ * Parse (and validate) the packet's headers down to the given depth.  Only
+ * the header bytes needed for the depth are copied (if the packet is not
+ * contiguous); the payload is copied on demand by windivert_filter_payload().
+ */
+static BOOL windivert_parse_headers(windivert_packet_t packet, UINT8 depth,
+    windivert_headers_t headers)
+{
+    UINT8 *data;
+    size_t tot_len, ip_header_len, cpy_len;
+    struct iphdr *ip_header = NULL;
+    struct ipv6hdr *ipv6_header = NULL;
+    UINT8 protocol;
+
+    headers->ip_header     = NULL;
+    headers->ipv6_header   = NULL;
+    headers->icmp_header   = NULL;
+    headers->icmpv6_header = NULL;
+    headers->tcp_header    = NULL;
+    headers->udp_header    = NULL;
+
+    // Metadata only filters do not look at the packet at all:
+    if (depth == WINDIVERT_FILTER_DEPTH_NONE)
+    {
+        headers->data          = NULL;
+        headers->tot_len       = 0;
+        headers->cpy_len       = 0;
+        headers->ip_header_len = 0;
+        return TRUE;
+    }
+
+    tot_len = windivert_packet_length(packet);
+    if (tot_len < sizeof(struct iphdr))
+    {
+        DEBUG("FILTER: REJECT (packet length too small)");
+        return FALSE;
+    }
+    headers->tot_len = tot_len;
+
+    // Copy enough for an iphdr/ipv6hdr (without options), followed by a
+    // tcphdr (without options) if needed:
+    cpy_len = sizeof(struct ipv6hdr);
+    if (depth >= WINDIVERT_FILTER_DEPTH_TRANSPORT)
+    {
+        cpy_len += sizeof(struct tcphdr);
+    }
+    cpy_len = (tot_len < cpy_len? tot_len: cpy_len);
+    data = windivert_packet_data(packet, cpy_len, headers->storage);
+    if (data == NULL)
+    {
+        DEBUG("FILTER: REJECT (failed to get packet data)");
+        return FALSE;
+    }
+    headers->data    = data;
+    headers->cpy_len = cpy_len;
+
+    ip_header = (struct iphdr *)data;
+    switch (ip_header->Version)
+    {
+        case 4:
+            ip_header_len = ip_header->HdrLength*sizeof(UINT32);
+            if (ntohs(ip_header->Length) != tot_len ||
+                ip_header->HdrLength < 5 ||
+                ip_header_len > tot_len)
+            {
+                DEBUG("FILTER: REJECT (bad IPv4 packet)");
+                return FALSE;
+            }
+            protocol = ip_header->Protocol;
+            headers->ip_header = ip_header;
+            break;
+        case 6:
+            ip_header = NULL;
+            ipv6_header = (struct ipv6hdr *)data;
+            ip_header_len = sizeof(struct ipv6hdr);
+            if (ip_header_len > tot_len ||
+                ntohs(ipv6_header->Length) +
+                    sizeof(struct ipv6hdr) != tot_len)
+            {
+                DEBUG("FILTER: REJECT (bad IPv6 packet)");
+                return FALSE;
+            }
+            protocol = ipv6_header->NextHdr;
+            headers->ipv6_header = ipv6_header;
+            break;
+        default:
+            DEBUG("FILTER: REJECT (packet is neither IPv4 nor IPv6)");
+            return FALSE;
+    }
+    headers->ip_header_len = ip_header_len;
+
+    // Non-first IPv4 fragments do not contain a transport header:
+    if (depth < WINDIVERT_FILTER_DEPTH_TRANSPORT ||
+        (ip_header != NULL && IPHDR_GET_FRAGOFF(ip_header) != 0))
+    {
+        return TRUE;
+    }
+
+    // IPv4 options may push the transport header beyond the copied bytes:
+    cpy_len = ip_header_len + sizeof(struct tcphdr);
+    cpy_len = (tot_len < cpy_len? tot_len: cpy_len);
+    if (cpy_len > headers->cpy_len)
+    {
+        data = windivert_packet_data(packet, cpy_len, headers->storage);
+        if (data == NULL)
+        {
+            DEBUG("FILTER: REJECT (failed to get packet data)");
+            return FALSE;
+        }
+        headers->data    = data;
+        headers->cpy_len = cpy_len;
+        if (ip_header != NULL)
+        {
+            ip_header = (struct iphdr *)data;
+            headers->ip_header = ip_header;
+        }
+    }
+
+    switch (protocol)
+    {
+        case IPPROTO_ICMP:
+            if (ip_header == NULL ||
+                sizeof(struct icmphdr) + ip_header_len > tot_len)
+            {
+                DEBUG("FILTER: REJECT (bad ICMP packet)");
+                return FALSE;
+            }
+            headers->icmp_header = (struct icmphdr *)(data + ip_header_len);
+            break;
+        case IPPROTO_ICMPV6:
+            if (ipv6_header == NULL ||
+                sizeof(struct icmpv6hdr) + ip_header_len > tot_len)
+            {
+                DEBUG("FILTER: REJECT (bad ICMPV6 packet)");
+                return FALSE;
+            }
+            headers->icmpv6_header =
+                (struct icmpv6hdr *)(data + ip_header_len);
+            break;
+        case IPPROTO_TCP:
+            headers->tcp_header = (struct tcphdr *)(data + ip_header_len);
+            if (sizeof(struct tcphdr) + ip_header_len > tot_len ||
+                headers->tcp_header->HdrLength < 5 ||
+                headers->tcp_header->HdrLength*sizeof(UINT32) +
+                    ip_header_len > tot_len)
+            {
+                DEBUG("FILTER: REJECT (bad TCP packet)");
+                return FALSE;
+            }
+            break;
+        case IPPROTO_UDP:
+            if (sizeof(struct udphdr) + ip_header_len > tot_len)
+            {
+                DEBUG("FILTER: REJECT (bad UDP packet)");
+                return FALSE;
+            }
+            headers->udp_header = (struct udphdr *)(data + ip_header_len);
+            break;
+        default:
+            break;
+    }
+    return TRUE;
+}
+
+/*
+ * Symmetric flow hash of the packet's (addresses, ports, protocol), i.e.
+ * both directions of a flow have the same hash.  IP fragments are hashed
+ * without ports.
+ */
+static UINT32 windivert_hash_headers(windivert_headers_t headers)
+{
+    UINT32 addr0, addr1, tmp, hash;
+    UINT16 port0 = 0, port1 = 0, tmp16;
+    UINT8 protocol;
+    UINT i;
+
+    if (headers->ip_header != NULL)
+    {
+        addr0 = headers->ip_header->SrcAddr;
+        addr1 = headers->ip_header->DstAddr;
+        protocol = headers->ip_header->Protocol;
+    }
+    else if (headers->ipv6_header != NULL)
+    {
+        addr0 = addr1 = 0;
+        for (i = 0; i < 4; i++)
+        {
+            addr0 = windivert_hash_mix(addr0,
+                headers->ipv6_header->SrcAddr[i]);
+            addr1 = windivert_hash_mix(addr1,
+                headers->ipv6_header->DstAddr[i]);
+        }
+        protocol = headers->ipv6_header->NextHdr;
+    }
+    else
+    {
+        return 0;
+    }
+    if (headers->ip_header != NULL &&
+        (IPHDR_GET_FRAGOFF(headers->ip_header) != 0 ||
+         IPHDR_GET_MF(headers->ip_header) != 0))
+    {
+        // Only the first fragment has ports.
+    }
+    else if (headers->tcp_header != NULL)
+    {
+        port0 = headers->tcp_header->SrcPort;
+        port1 = headers->tcp_header->DstPort;
+    }
+    else if (headers->udp_header != NULL)
+    {
+        port0 = headers->udp_header->SrcPort;
+        port1 = headers->udp_header->DstPort;
+    }
+
+    // Order each pair so that (src, dst) and (dst, src) hash the same:
+    if (addr0 > addr1)
+    {
+        tmp = addr0; addr0 = addr1; addr1 = tmp;
+    }
+    if (port0 > port1)
+    {
+        tmp16 = port0; port0 = port1; port1 = tmp16;
+    }
+    hash = windivert_hash_mix(0x9E3779B9, (UINT32)protocol);
+    hash = windivert_hash_mix(hash, addr0);
+    hash = windivert_hash_mix(hash, addr1);
+    hash = windivert_hash_mix(hash, ((UINT32)port0 << 16) | (UINT32)port1);
+    return hash;
+}
+
+/*
+ * Mix a 32-bit value into a hash.
+ */
+static UINT32 windivert_hash_mix(UINT32 hash, UINT32 value)
+{
+    hash ^= value;
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/*
+ * Select one of queue_count queues by flow hash.  The hash is scaled to
+ * queue_count (rather than reduced modulo queue_count), which needs no
+ * division.
+ */
+static UINT windivert_hash_queue(UINT32 hash, UINT queue_count)
+{
+    return (UINT)(((UINT64)hash * queue_count) >> 32);
+}
+
+/*
+ * The flow hash of a packet (0 if the packet cannot be parsed).
+ */
+static UINT32 windivert_hash_packet(windivert_packet_t packet)
+{
+    struct windivert_headers_s headers;
+
+    if (!windivert_parse_headers(packet, WINDIVERT_FILTER_DEPTH_TRANSPORT,
+            &headers))
+    {
+        return 0;
+    }
+    return windivert_hash_headers(&headers);
+}
+
+/*
+ * Start grouping a sequence of re-injected packets.
+ */
+static void windivert_group_init(windivert_group_t group)
+{
+    group->open      = FALSE;
+    group->direction = 0;
+    group->hash      = 0;
+}
+
+/*
+ * The next re-injected packet, in order.  Returns TRUE if the packet joins
+ * the open group, i.e. the previous packet was also re-injected, and both
+ * packets have the same flow hash and direction.  Otherwise the packet
+ * starts a new group (and FALSE is returned).  A packet that cannot be
+ * parsed (hash 0) is never grouped with another packet.
+ */
+static BOOL windivert_group_next(windivert_group_t group, UINT32 hash,
+    UINT8 direction)
+{
+    if (group->open && group->hash == hash && group->direction == direction)
+    {
+        return TRUE;
+    }
+    group->open      = (hash != 0);
+    group->direction = direction;
+    group->hash      = hash;
+    return FALSE;
+}
+
+/*
+ * A packet that is not re-injected (i.e. is diverted) ends the open group.
+ */
+static void windivert_group_close(windivert_group_t group)
+{
+    group->open = FALSE;
+}
+
+/*
+ * Initialize a count of objects in use.
+ */
+static void windivert_nbl_count_init(windivert_nbl_count_t count)
+{
+    count->used = 0;
+    count->peak = 0;
+}
+
+/*
+ * Count an allocation.  Allocations and frees may run concurrently on any
+ * processor, so the count (and its peak) are only updated with interlocked
+ * operations.
+ */
+static void windivert_nbl_count_alloc(windivert_nbl_count_t count)
+{
+    windivert_nbl_count_raise(count, InterlockedIncrement(&count->used));
+}
+
+/*
+ * Raise the peak to (at least) used.
+ */
+static void windivert_nbl_count_raise(windivert_nbl_count_t count,
+    LONG used)
+{
+    LONG peak, old;
+
+    peak = count->peak;
+    while (used > peak)
+    {
+        old = InterlockedCompareExchange(&count->peak, used, peak);
+        if (old == peak)
+        {
+            break;
+        }
+        peak = old;
+    }
+}
+
+/*
+ * Count a free.
+ */
+static void windivert_nbl_count_free(windivert_nbl_count_t count)
+{
+    InterlockedDecrement(&count->used);
+}
+
+/*
+ * The peak number in use since the last sample (which starts a new
+ * sample).
+ */
+static LONG windivert_nbl_count_sample(windivert_nbl_count_t count)
+{
+    LONG peak;
+
+    peak = InterlockedExchange(&count->peak, 0);
+    windivert_nbl_count_raise(count, count->used);
+    return peak;
+}
+
+/*
+ * Execute a filter over a packet with parsed headers.
+ */
+static BOOL windivert_filter_exec(windivert_packet_t packet,
+    windivert_headers_t headers, UINT32 if_idx, UINT32 sub_if_idx,
+    BOOL outbound, filter_t filter)
+{
+    size_t tot_len = headers->tot_len;
+    size_t ip_header_len = headers->ip_header_len;
+    struct iphdr *ip_header = headers->ip_header;
+    struct ipv6hdr *ipv6_header = headers->ipv6_header;
+    struct icmphdr *icmp_header = headers->icmp_header;
+    struct icmpv6hdr *icmpv6_header = headers->icmpv6_header;
+    struct tcphdr *tcp_header = headers->tcp_header;
+    struct udphdr *udp_header = headers->udp_header;
+    UINT16 ip, ttl;
+
+    // Execute the filter:
+    ip = 0;
+    ttl = WINDIVERT_FILTER_MAXLEN+1;       // Additional safety
+    while (ttl-- != 0)
+    {
+        BOOL result;
+        UINT32 field[4];
+        size_t offset = 0;
+        field[1] = 0;
+        field[2] = 0;
+        field[3] = 0;
+        switch (filter[ip].protocol)
+        {
+            case WINDIVERT_FILTER_PROTOCOL_NONE:
+                result = TRUE;
+                break;
+            case WINDIVERT_FILTER_PROTOCOL_IP:
+                result = (ip_header != NULL);
+                break;
+            case WINDIVERT_FILTER_PROTOCOL_IPV6:
+                result = (ipv6_header != NULL);
+                break;
+            case WINDIVERT_FILTER_PROTOCOL_ICMP:
+                result = (icmp_header != NULL);
+                break;
+            case WINDIVERT_FILTER_PROTOCOL_ICMPV6:
+                result = (icmpv6_header != NULL);
+                break;
+            case WINDIVERT_FILTER_PROTOCOL_TCP:
+                result = (tcp_header != NULL);
+                break;
+            case WINDIVERT_FILTER_PROTOCOL_UDP:
+                result = (udp_header != NULL);
+                break;
+            default:
+                result = FALSE;
+                break;
+        }
+        if (result)
+        {
+            switch (filter[ip].field)
+            {
+                case WINDIVERT_FILTER_FIELD_ZERO:
+                    field[0] = 0;
+                    break;
+                case WINDIVERT_FILTER_FIELD_INBOUND:
+                    field[0] = (UINT32)(!outbound);
+                    break;
+                case WINDIVERT_FILTER_FIELD_OUTBOUND:
+                    field[0] = (UINT32)outbound;
+                    break;
+                case WINDIVERT_FILTER_FIELD_IFIDX:
+                    field[0] = (UINT32)if_idx;
+                    break;
+                case WINDIVERT_FILTER_FIELD_SUBIFIDX:
+                    field[0] = (UINT32)sub_if_idx;
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP:
+                    field[0] = (UINT32)(ip_header != NULL);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6:
+                    field[0] = (UINT32)(ipv6_header != NULL);
+                    break;
+                case WINDIVERT_FILTER_FIELD_ICMP:
+                    field[0] = (UINT32)(icmp_header != NULL);
+                    break;
+                case WINDIVERT_FILTER_FIELD_ICMPV6:
+                    field[0] = (UINT32)(icmpv6_header != NULL);
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP:
+                    field[0] = (UINT32)(tcp_header != NULL);
+                    break;
+                case WINDIVERT_FILTER_FIELD_UDP:
+                    field[0] = (UINT32)(udp_header != NULL);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP_HDRLENGTH:
+                    field[0] = (UINT32)ip_header->HdrLength;
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP_TOS:
+                    field[0] = (UINT32)ntohs(ip_header->TOS);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP_LENGTH:
+                    field[0] = (UINT32)ntohs(ip_header->Length);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP_ID:
+                    field[0] = (UINT32)ntohs(ip_header->Id);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP_DF:
+                    field[0] = (UINT32)IPHDR_GET_DF(ip_header);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP_MF:
+                    field[0] = (UINT32)IPHDR_GET_MF(ip_header);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP_FRAGOFF:
+                    field[0] = (UINT32)ntohs(
+                        IPHDR_GET_FRAGOFF(ip_header));
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP_TTL:
+                    field[0] = (UINT32)ip_header->TTL;
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP_PROTOCOL:
+                    field[0] = (UINT32)ip_header->Protocol;
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP_CHECKSUM:
+                    field[0] = (UINT32)ntohs(ip_header->Checksum);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP_SRCADDR:
+                    field[0] = (UINT32)ntohl(ip_header->SrcAddr);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IP_DSTADDR:
+                    field[0] = (UINT32)ntohl(ip_header->DstAddr);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_TRAFFICCLASS:
+                    field[0] = (UINT32)IPV6HDR_GET_TRAFFICCLASS(ipv6_header);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_FLOWLABEL:
+                    field[0] = (UINT32)ntohl(
+                        IPV6HDR_GET_FLOWLABEL(ipv6_header));
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_LENGTH:
+                    field[0] = (UINT32)ntohs(ipv6_header->Length);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR:
+                    field[0] = (UINT32)ipv6_header->NextHdr;
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
+                    field[0] = (UINT32)ipv6_header->HopLimit;
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_SRCADDR:
+                    field[0] =
+                        (UINT32)ntohl(ipv6_header->SrcAddr[3]);
+                    field[1] =
+                        (UINT32)ntohl(ipv6_header->SrcAddr[2]);
+                    field[2] =
+                        (UINT32)ntohl(ipv6_header->SrcAddr[1]);
+                    field[3] =
+                        (UINT32)ntohl(ipv6_header->SrcAddr[0]);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
+                    field[0] =
+                        (UINT32)ntohl(ipv6_header->DstAddr[3]);
+                    field[1] =
+                        (UINT32)ntohl(ipv6_header->DstAddr[2]);
+                    field[2] =
+                        (UINT32)ntohl(ipv6_header->DstAddr[1]);
+                    field[3] =
+                        (UINT32)ntohl(ipv6_header->DstAddr[0]);
+                    break;
+                case WINDIVERT_FILTER_FIELD_ICMP_TYPE:
+                    field[0] = (UINT32)icmp_header->Type;
+                    break;
+                case WINDIVERT_FILTER_FIELD_ICMP_CODE:
+                    field[0] = (UINT32)icmp_header->Code;
+                    break;
+                case WINDIVERT_FILTER_FIELD_ICMP_CHECKSUM:
+                    field[0] =
+                        (UINT32)ntohs(icmp_header->Checksum);
+                    break;
+                case WINDIVERT_FILTER_FIELD_ICMP_BODY:
+                    field[0] = (UINT32)ntohl(icmp_header->Body);
+                    break;
+                case WINDIVERT_FILTER_FIELD_ICMPV6_TYPE:
+                    field[0] = (UINT32)icmpv6_header->Type;
+                    break;
+                case WINDIVERT_FILTER_FIELD_ICMPV6_CODE:
+                    field[0] = (UINT32)icmpv6_header->Code;
+                    break;
+                case WINDIVERT_FILTER_FIELD_ICMPV6_CHECKSUM:
+                    field[0] = (UINT32)icmpv6_header->Checksum;
+                    break;
+                case WINDIVERT_FILTER_FIELD_ICMPV6_BODY:
+                    field[0] = (UINT32)icmpv6_header->Body;
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_SRCPORT:
+                    field[0] = (UINT32)ntohs(tcp_header->SrcPort);
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_DSTPORT:
+                    field[0] = (UINT32)ntohs(tcp_header->DstPort);
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_SEQNUM:
+                    field[0] = (UINT32)ntohl(tcp_header->SeqNum);
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_ACKNUM:
+                    field[0] = (UINT32)ntohl(tcp_header->AckNum);
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_HDRLENGTH:
+                    field[0] = (UINT32)tcp_header->HdrLength;
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_URG:
+                    field[0] = (UINT32)tcp_header->Urg;
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_ACK:
+                    field[0] = (UINT32)tcp_header->Ack;
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_PSH:
+                    field[0] = (UINT32)tcp_header->Psh;
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_RST:
+                    field[0] = (UINT32)tcp_header->Rst;
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_SYN:
+                    field[0] = (UINT32)tcp_header->Syn;
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_FIN:
+                    field[0] = (UINT32)tcp_header->Fin;
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_WINDOW:
+                    field[0] = (UINT32)ntohs(tcp_header->Window);
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_CHECKSUM:
+                    field[0] = (UINT32)ntohs(tcp_header->Checksum);
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_URGPTR:
+                    field[0] = (UINT32)ntohs(tcp_header->UrgPtr);
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_PAYLOADLENGTH:
+                    field[0] = (UINT32)(tot_len - ip_header_len -
+                        tcp_header->HdrLength*sizeof(UINT32));
+                    break;
+                case WINDIVERT_FILTER_FIELD_UDP_SRCPORT:
+                    field[0] = (UINT32)ntohs(udp_header->SrcPort);
+                    break;
+                case WINDIVERT_FILTER_FIELD_UDP_DSTPORT:
+                    field[0] = (UINT32)ntohs(udp_header->DstPort);
+                    break;
+                case WINDIVERT_FILTER_FIELD_UDP_LENGTH:
+                    field[0] = (UINT32)ntohs(udp_header->Length);
+                    break;
+                case WINDIVERT_FILTER_FIELD_UDP_CHECKSUM:
+                    field[0] = (UINT32)ntohs(udp_header->Checksum);
+                    break;
+                case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
+                    field[0] = (UINT32)(tot_len - ip_header_len -
+                        sizeof(struct udphdr));
+                    break;
+                case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD:
+                    offset = ip_header_len +
+                        tcp_header->HdrLength*sizeof(UINT32);
+                    result = (filter[ip].automaton != NULL ||
+                        windivert_filter_payload(packet, tot_len,
+                            headers->storage, sizeof(headers->storage),
+                            &headers->data, &headers->cpy_len,
+                            offset + filter[ip].offset, filter[ip].length,
+                            field));
+                    break;
+                case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD:
+                    offset = ip_header_len + sizeof(struct udphdr);
+                    result = (filter[ip].automaton != NULL ||
+                        windivert_filter_payload(packet, tot_len,
+                            headers->storage, sizeof(headers->storage),
+                            &headers->data, &headers->cpy_len,
+                            offset + filter[ip].offset, filter[ip].length,
+                            field));
+                    break;
+                default:
+                    field[0] = 0;
+                    break;
+            }
+            if (result)
+            {
+                switch (filter[ip].test)
+                {
+                    case WINDIVERT_FILTER_TEST_EQ:
+                        result = (field[0] == filter[ip].arg[0] &&
+                                  field[1] == filter[ip].arg[1] &&
+                                  field[2] == filter[ip].arg[2] &&
+                                  field[3] == filter[ip].arg[3]);
+                        break;
+                    case WINDIVERT_FILTER_TEST_NEQ:
+                        result = (field[0] != filter[ip].arg[0] ||
+                                  field[1] != filter[ip].arg[1] ||
+                                  field[2] != filter[ip].arg[2] ||
+                                  field[3] != filter[ip].arg[3]);
+                        break;
+                    case WINDIVERT_FILTER_TEST_LT:
+                        result = (field[3] < filter[ip].arg[3] ||
+                                 (field[3] == filter[ip].arg[3] &&
+                                 (field[2] < filter[ip].arg[2] ||
+                                 (field[2] == filter[ip].arg[2] &&
+                                 (field[1] < filter[ip].arg[1] ||
+                                 (field[1] == filter[ip].arg[1] &&
+                                  field[0] < filter[ip].arg[0]))))));
+                        break;
+                    case WINDIVERT_FILTER_TEST_LEQ:
+                        result = (field[3] < filter[ip].arg[3] ||
+                                 (field[3] == filter[ip].arg[3] &&
+                                 (field[2] < filter[ip].arg[2] ||
+                                 (field[2] == filter[ip].arg[2] &&
+                                 (field[1] < filter[ip].arg[1] ||
+                                 (field[1] == filter[ip].arg[1] &&
+                                  field[0] <= filter[ip].arg[0]))))));
+                        break;
+                    case WINDIVERT_FILTER_TEST_GT:
+                        result = (field[3] > filter[ip].arg[3] ||
+                                 (field[3] == filter[ip].arg[3] &&
+                                 (field[2] > filter[ip].arg[2] ||
+                                 (field[2] == filter[ip].arg[2] &&
+                                 (field[1] > filter[ip].arg[1] ||
+                                 (field[1] == filter[ip].arg[1] &&
+                                  field[0] > filter[ip].arg[0]))))));
+                        break;
+                    case WINDIVERT_FILTER_TEST_GEQ:
+                        result = (field[3] > filter[ip].arg[3] ||
+                                 (field[3] == filter[ip].arg[3] &&
+                                 (field[2] > filter[ip].arg[2] ||
+                                 (field[2] == filter[ip].arg[2] &&
+                                 (field[1] > filter[ip].arg[1] ||
+                                 (field[1] == filter[ip].arg[1] &&
+                                  field[0] >= filter[ip].arg[0]))))));
+                        break;
+                    case WINDIVERT_FILTER_TEST_CONTAINS:
+                        result = windivert_packet_contains(packet, offset,
+                            filter[ip].automaton);
+                        break;
+                    case WINDIVERT_FILTER_TEST_NCONTAINS:
+                        result = !windivert_packet_contains(packet, offset,
+                            filter[ip].automaton);
+                        break;
+                    default:
+                        result = FALSE;
+                        break;
+                }
+            }
+        }
+        ip = (result? filter[ip].success: filter[ip].failure);
+        if (ip == WINDIVERT_FILTER_RESULT_ACCEPT)
+        {
+            return TRUE;
+        }
+        if (ip == WINDIVERT_FILTER_RESULT_REJECT)
+        {
+            return FALSE;
+        }
+    }
+    DEBUG("FILTER: REJECT (filter TTL exceeded)");
+    return FALSE;
+}
+
+/*
+ * Load a payload field (length bytes at offset, big endian).  The packet
+ * snapshot is extended if it does not already contain the requested bytes.
+ * Returns FALSE (no match) if the bytes are not in the packet, or cannot be
+ * obtained.
+ */
+static BOOL windivert_filter_payload(windivert_packet_t packet,
+    size_t tot_len, UINT8 *storage, size_t storage_len, UINT8 **headers_ptr,
+    size_t *cpy_len_ptr, size_t offset, UINT8 length, UINT32 *field)
+{
+    UINT8 *headers;
+    size_t i, cpy_len, end = offset + length;
+
+    if (end > tot_len || end > storage_len)
+    {
+        return FALSE;
+    }
+    if (end > *cpy_len_ptr)
+    {
+        // Any existing header pointers remain valid: they either point into
+        // the packet itself, or into storage which is overwritten with the
+        // same data.
+        cpy_len = (tot_len < storage_len? tot_len: storage_len);
+        headers = windivert_packet_data(packet, cpy_len, storage);
+        if (headers == NULL)
+        {
+            return FALSE;
+        }
+        *headers_ptr = headers;
+        *cpy_len_ptr = cpy_len;
+    }
+
+    headers = *headers_ptr;
+    field[0] = 0;
+    for (i = offset; i < end; i++)
+    {
+        field[3] = (field[3] << 8) | (field[2] >> 24);
+        field[2] = (field[2] << 8) | (field[1] >> 24);
+        field[1] = (field[1] << 8) | (field[0] >> 24);
+        field[0] = (field[0] << 8) | (UINT32)headers[i];
+    }
+    return TRUE;
+}
+
+/*
+ * Verify an automaton (see windivert_device.h).  Returns the automaton's
+ * size, or 0 if it is invalid.
+ */
+static size_t windivert_automaton_verify(windivert_ioctl_automaton_t automaton,
+    size_t len)
+{
+    const UINT32 *next;
+    size_t i, size;
+
+    if (len < sizeof(struct windivert_ioctl_automaton_s) ||
+        automaton->classes == 0 ||
+        automaton->classes > sizeof(automaton->map) ||
+        automaton->states < 2 ||
+        automaton->states > WINDIVERT_FILTER_AUTOMATA_MAXLEN /
+            sizeof(UINT32) / automaton->classes ||
+        automaton->reserved != 0)
+    {
+        return 0;
+    }
+    size = (size_t)automaton->states * automaton->classes;
+    if (automaton->size != sizeof(struct windivert_ioctl_automaton_s) +
+            size * sizeof(UINT32) ||
+        automaton->size > len)
+    {
+        return 0;
+    }
+    for (i = 0; i < sizeof(automaton->map); i++)
+    {
+        if (automaton->map[i] >= automaton->classes)
+        {
+            return 0;
+        }
+    }
+    next = (const UINT32 *)(automaton + 1);
+    for (i = 0; i < size; i++)
+    {
+        if (next[i] >= size || next[i] % automaton->classes != 0)
+        {
+            return 0;
+        }
+    }
+    return automaton->size;
+}
+
+/*
+ * Run an automaton over data from state *state_ptr.  Returns TRUE on a
+ * match; otherwise *state_ptr is updated so that the search can continue
+ * over the next chunk of data.
+ */
+static BOOL windivert_automaton_match(windivert_ioctl_automaton_t automaton,
+    const UINT8 *data, size_t len, UINT32 *state_ptr)
+{
+    const UINT32 *next = (const UINT32 *)(automaton + 1);
+    UINT32 state = *state_ptr;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        state = next[state + automaton->map[data[i]]];
+        if (state == WINDIVERT_FILTER_AUTOMATON_MATCH)
+        {
+            return TRUE;
+        }
+    }
+    *state_ptr = state;
+    return FALSE;
+}
+
+/*
+ * Load a filter program and its automata (already copied to trusted memory)
+ * into filter[0..length-1].  Returns FALSE if the program is invalid.
+ */
+static BOOL windivert_filter_load(windivert_ioctl_filter_t ioctl_filter,
+    size_t length, UINT8 *automata_data, size_t automata_len,
+    filter_t filter)
+{
+    windivert_ioctl_automaton_t automata[WINDIVERT_FILTER_MAXLEN];
+    UINT16 i;
+    size_t automata_num, offset, size;
+    BOOL contains;
+
+    if (length == 0 || length >= WINDIVERT_FILTER_MAXLEN ||
+        automata_len > WINDIVERT_FILTER_AUTOMATA_MAXLEN)
+    {
+        return FALSE;
+    }
+    for (automata_num = 0, offset = 0; offset < automata_len;
+            automata_num++)
+    {
+        if (automata_num >= WINDIVERT_FILTER_MAXLEN)
+        {
+            return FALSE;
+        }
+        automata[automata_num] =
+            (windivert_ioctl_automaton_t)(automata_data + offset);
+        size = windivert_automaton_verify(automata[automata_num],
+            automata_len - offset);
+        if (size == 0)
+        {
+            return FALSE;
+        }
+        offset += size;
+    }
+
+    for (i = 0; i < length; i++)
+    {
+        if (ioctl_filter[i].field > WINDIVERT_FILTER_FIELD_MAX ||
+            ioctl_filter[i].test > WINDIVERT_FILTER_TEST_MAX)
+        {
+            return FALSE;
+        }
+        switch (ioctl_filter[i].success)
+        {
+            case WINDIVERT_FILTER_RESULT_ACCEPT:
+            case WINDIVERT_FILTER_RESULT_REJECT:
+                break;
+            default:
+                if (ioctl_filter[i].success <= i ||
+                    ioctl_filter[i].success >= length)
+                {
+                    return FALSE;
+                }
+                break;
+        }
+        switch (ioctl_filter[i].failure)
+        {
+            case WINDIVERT_FILTER_RESULT_ACCEPT:
+            case WINDIVERT_FILTER_RESULT_REJECT:
+                break;
+            default:
+                if (ioctl_filter[i].failure <= i ||
+                    ioctl_filter[i].failure >= length)
+                {
+                    return FALSE;
+                }
+                break;
+        }
+
+        // Enforce size limits:
+        contains = (ioctl_filter[i].test == WINDIVERT_FILTER_TEST_CONTAINS ||
+                    ioctl_filter[i].test == WINDIVERT_FILTER_TEST_NCONTAINS);
+        if (contains)
+        {
+            if ((ioctl_filter[i].field !=
+                    WINDIVERT_FILTER_FIELD_TCP_PAYLOAD &&
+                 ioctl_filter[i].field !=
+                    WINDIVERT_FILTER_FIELD_UDP_PAYLOAD) ||
+                ioctl_filter[i].offset != 0 ||
+                ioctl_filter[i].length != 0 ||
+                ioctl_filter[i].arg[0] >= automata_num ||
+                ioctl_filter[i].arg[1] != 0 ||
+                ioctl_filter[i].arg[2] != 0 ||
+                ioctl_filter[i].arg[3] != 0)
+            {
+                return FALSE;
+            }
+        }
+        else if (ioctl_filter[i].field == WINDIVERT_FILTER_FIELD_TCP_PAYLOAD ||
+                 ioctl_filter[i].field == WINDIVERT_FILTER_FIELD_UDP_PAYLOAD)
+        {
+            if (ioctl_filter[i].length == 0 ||
+                ioctl_filter[i].length > WINDIVERT_FILTER_PAYLOAD_MAXWIDTH ||
+                (size_t)ioctl_filter[i].offset + ioctl_filter[i].length >
+                    WINDIVERT_FILTER_PAYLOAD_MAXLEN)
+            {
+                return FALSE;
+            }
+            if (ioctl_filter[i].length < WINDIVERT_FILTER_PAYLOAD_MAXWIDTH)
+            {
+                UINT bits = 8 * ioctl_filter[i].length;
+                UINT word = bits / 32;
+                if ((bits % 32 != 0 &&
+                     (ioctl_filter[i].arg[word] >> (bits % 32)) != 0) ||
+                    (word < 3 && ioctl_filter[i].arg[3] != 0) ||
+                    (word < 2 && ioctl_filter[i].arg[2] != 0) ||
+                    (word < 1 && ioctl_filter[i].arg[1] != 0))
+                {
+                    return FALSE;
+                }
+            }
+        }
+        else if (ioctl_filter[i].offset != 0 || ioctl_filter[i].length != 0)
+        {
+            return FALSE;
+        }
+        else if (ioctl_filter[i].field != WINDIVERT_FILTER_FIELD_IPV6_SRCADDR &&
+            ioctl_filter[i].field != WINDIVERT_FILTER_FIELD_IPV6_DSTADDR)
+        {
+            if (ioctl_filter[i].arg[1] != 0 ||
+                ioctl_filter[i].arg[2] != 0 ||
+                ioctl_filter[i].arg[3] != 0)
+            {
+                return FALSE;
+            }
+        }
+        switch (ioctl_filter[i].field)
+        {
+            case WINDIVERT_FILTER_FIELD_ZERO:
+            case WINDIVERT_FILTER_FIELD_INBOUND:
+            case WINDIVERT_FILTER_FIELD_OUTBOUND:
+            case WINDIVERT_FILTER_FIELD_IP:
+            case WINDIVERT_FILTER_FIELD_IPV6:
+            case WINDIVERT_FILTER_FIELD_ICMP:
+            case WINDIVERT_FILTER_FIELD_ICMPV6:
+            case WINDIVERT_FILTER_FIELD_TCP:
+            case WINDIVERT_FILTER_FIELD_UDP:
+            case WINDIVERT_FILTER_FIELD_IP_DF:
+            case WINDIVERT_FILTER_FIELD_IP_MF:
+            case WINDIVERT_FILTER_FIELD_TCP_URG:
+            case WINDIVERT_FILTER_FIELD_TCP_ACK:
+            case WINDIVERT_FILTER_FIELD_TCP_PSH:
+            case WINDIVERT_FILTER_FIELD_TCP_RST:
+            case WINDIVERT_FILTER_FIELD_TCP_SYN:
+            case WINDIVERT_FILTER_FIELD_TCP_FIN:
+                if (ioctl_filter[i].arg[0] > 1)
+                {
+                    return FALSE;
+                }
+                break;
+            case WINDIVERT_FILTER_FIELD_IP_HDRLENGTH:
+            case WINDIVERT_FILTER_FIELD_TCP_HDRLENGTH:
+                if (ioctl_filter[i].arg[0] > 0x0F)
+                {
+                    return FALSE;
+                }
+                break;
+            case WINDIVERT_FILTER_FIELD_IP_TTL:
+            case WINDIVERT_FILTER_FIELD_IP_PROTOCOL:
+            case WINDIVERT_FILTER_FIELD_IPV6_TRAFFICCLASS:
+            case WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR:
+            case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
+            case WINDIVERT_FILTER_FIELD_ICMP_TYPE:
+            case WINDIVERT_FILTER_FIELD_ICMP_CODE:
+            case WINDIVERT_FILTER_FIELD_ICMPV6_TYPE:
+            case WINDIVERT_FILTER_FIELD_ICMPV6_CODE:
+                if (ioctl_filter[i].arg[0] > UINT8_MAX)
+                {
+                    return FALSE;
+                }
+                break;
+            case WINDIVERT_FILTER_FIELD_IP_FRAGOFF:
+                if (ioctl_filter[i].arg[0] > 0x1FFF)
+                {
+                    return FALSE;
+                }
+                break;
+            case WINDIVERT_FILTER_FIELD_IP_TOS:
+            case WINDIVERT_FILTER_FIELD_IP_LENGTH:
+            case WINDIVERT_FILTER_FIELD_IP_ID:
+            case WINDIVERT_FILTER_FIELD_IP_CHECKSUM:
+            case WINDIVERT_FILTER_FIELD_IPV6_LENGTH:
+            case WINDIVERT_FILTER_FIELD_ICMP_CHECKSUM:
+            case WINDIVERT_FILTER_FIELD_ICMPV6_CHECKSUM:
+            case WINDIVERT_FILTER_FIELD_TCP_SRCPORT:
+            case WINDIVERT_FILTER_FIELD_TCP_DSTPORT:
+            case WINDIVERT_FILTER_FIELD_TCP_WINDOW:
+            case WINDIVERT_FILTER_FIELD_TCP_CHECKSUM:
+            case WINDIVERT_FILTER_FIELD_TCP_URGPTR:
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOADLENGTH:
+            case WINDIVERT_FILTER_FIELD_UDP_SRCPORT:
+            case WINDIVERT_FILTER_FIELD_UDP_DSTPORT:
+            case WINDIVERT_FILTER_FIELD_UDP_LENGTH:
+            case WINDIVERT_FILTER_FIELD_UDP_CHECKSUM:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
+                if (ioctl_filter[i].arg[0] > UINT16_MAX)
+                {
+                    return FALSE;
+                }
+                break;
+            case WINDIVERT_FILTER_FIELD_IPV6_FLOWLABEL:
+                if (ioctl_filter[i].arg[0] > 0x000FFFFF)
+                {
+                    return FALSE;
+                }
+                break;
+            default:
+                break;
+        }
+        filter[i].field   = ioctl_filter[i].field;
+        filter[i].test    = ioctl_filter[i].test;
+        filter[i].success = ioctl_filter[i].success;
+        filter[i].failure = ioctl_filter[i].failure;
+        filter[i].offset  = ioctl_filter[i].offset;
+        filter[i].length  = ioctl_filter[i].length;
+        filter[i].arg[0]  = ioctl_filter[i].arg[0];
+        filter[i].arg[1]  = ioctl_filter[i].arg[1];
+        filter[i].arg[2]  = ioctl_filter[i].arg[2];
+        filter[i].arg[3]  = ioctl_filter[i].arg[3];
+        filter[i].automaton =
+            (contains? automata[ioctl_filter[i].arg[0]]: NULL);
+
+        // Protocol and header depth selection:
+        filter[i].depth = WINDIVERT_FILTER_DEPTH_TRANSPORT;
+        switch (ioctl_filter[i].field)
+        {
+            case WINDIVERT_FILTER_FIELD_ZERO:
+            case WINDIVERT_FILTER_FIELD_INBOUND:
+            case WINDIVERT_FILTER_FIELD_OUTBOUND:
+            case WINDIVERT_FILTER_FIELD_IFIDX:
+            case WINDIVERT_FILTER_FIELD_SUBIFIDX:
+                filter[i].protocol = WINDIVERT_FILTER_PROTOCOL_NONE;
+                filter[i].depth    = WINDIVERT_FILTER_DEPTH_NONE;
+                break;
+            case WINDIVERT_FILTER_FIELD_IP:
+            case WINDIVERT_FILTER_FIELD_IPV6:
+                filter[i].protocol = WINDIVERT_FILTER_PROTOCOL_NONE;
+                filter[i].depth    = WINDIVERT_FILTER_DEPTH_NETWORK;
+                break;
+            case WINDIVERT_FILTER_FIELD_ICMP:
+            case WINDIVERT_FILTER_FIELD_ICMPV6:
+            case WINDIVERT_FILTER_FIELD_TCP:
+            case WINDIVERT_FILTER_FIELD_UDP:
+                filter[i].protocol = WINDIVERT_FILTER_PROTOCOL_NONE;
+                break;
+            case WINDIVERT_FILTER_FIELD_IP_HDRLENGTH:
+            case WINDIVERT_FILTER_FIELD_IP_TOS:
+            case WINDIVERT_FILTER_FIELD_IP_LENGTH:
+            case WINDIVERT_FILTER_FIELD_IP_ID:
+            case WINDIVERT_FILTER_FIELD_IP_DF:
+            case WINDIVERT_FILTER_FIELD_IP_MF:
+            case WINDIVERT_FILTER_FIELD_IP_FRAGOFF:
+            case WINDIVERT_FILTER_FIELD_IP_TTL:
+            case WINDIVERT_FILTER_FIELD_IP_PROTOCOL:
+            case WINDIVERT_FILTER_FIELD_IP_CHECKSUM:
+            case WINDIVERT_FILTER_FIELD_IP_SRCADDR:
+            case WINDIVERT_FILTER_FIELD_IP_DSTADDR:
+                filter[i].protocol = WINDIVERT_FILTER_PROTOCOL_IP;
+                filter[i].depth    = WINDIVERT_FILTER_DEPTH_NETWORK;
+                break;
+            case WINDIVERT_FILTER_FIELD_IPV6_TRAFFICCLASS:
+            case WINDIVERT_FILTER_FIELD_IPV6_FLOWLABEL:
+            case WINDIVERT_FILTER_FIELD_IPV6_LENGTH:
+            case WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR:
+            case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
+            case WINDIVERT_FILTER_FIELD_IPV6_SRCADDR:
+            case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
+                filter[i].protocol = WINDIVERT_FILTER_PROTOCOL_IPV6;
+                filter[i].depth    = WINDIVERT_FILTER_DEPTH_NETWORK;
+                break;
+            case WINDIVERT_FILTER_FIELD_ICMP_TYPE:
+            case WINDIVERT_FILTER_FIELD_ICMP_CODE:
+            case WINDIVERT_FILTER_FIELD_ICMP_CHECKSUM:
+            case WINDIVERT_FILTER_FIELD_ICMP_BODY:
+                filter[i].protocol = WINDIVERT_FILTER_PROTOCOL_ICMP;
+                break;
+            case WINDIVERT_FILTER_FIELD_ICMPV6_TYPE:
+            case WINDIVERT_FILTER_FIELD_ICMPV6_CODE:
+            case WINDIVERT_FILTER_FIELD_ICMPV6_CHECKSUM:
+            case WINDIVERT_FILTER_FIELD_ICMPV6_BODY:
+                filter[i].protocol = WINDIVERT_FILTER_PROTOCOL_ICMPV6;
+                break;
+            case WINDIVERT_FILTER_FIELD_TCP_SRCPORT:
+            case WINDIVERT_FILTER_FIELD_TCP_DSTPORT:
+            case WINDIVERT_FILTER_FIELD_TCP_SEQNUM:
+            case WINDIVERT_FILTER_FIELD_TCP_ACKNUM:
+            case WINDIVERT_FILTER_FIELD_TCP_HDRLENGTH:
+            case WINDIVERT_FILTER_FIELD_TCP_URG:
+            case WINDIVERT_FILTER_FIELD_TCP_ACK:
+            case WINDIVERT_FILTER_FIELD_TCP_PSH:
+            case WINDIVERT_FILTER_FIELD_TCP_RST:
+            case WINDIVERT_FILTER_FIELD_TCP_SYN:
+            case WINDIVERT_FILTER_FIELD_TCP_FIN:
+            case WINDIVERT_FILTER_FIELD_TCP_WINDOW:
+            case WINDIVERT_FILTER_FIELD_TCP_CHECKSUM:
+            case WINDIVERT_FILTER_FIELD_TCP_URGPTR:
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOADLENGTH:
+            case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD:
+                filter[i].protocol = WINDIVERT_FILTER_PROTOCOL_TCP;
+                break;
+            case WINDIVERT_FILTER_FIELD_UDP_SRCPORT:
+            case WINDIVERT_FILTER_FIELD_UDP_DSTPORT:
+            case WINDIVERT_FILTER_FIELD_UDP_LENGTH:
+            case WINDIVERT_FILTER_FIELD_UDP_CHECKSUM:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
+            case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD:
+                filter[i].protocol = WINDIVERT_FILTER_PROTOCOL_UDP;
+                break;
+            default:
+                return FALSE;
+        }
+    }
+
+    // Each instruction's depth becomes the maximum depth of any path from
+    // it, so filter[0].depth is the depth needed by the whole filter:
+    for (i = (UINT16)length; i-- > 0; )
+    {
+        if (filter[i].success != WINDIVERT_FILTER_RESULT_ACCEPT &&
+            filter[i].success != WINDIVERT_FILTER_RESULT_REJECT &&
+            filter[filter[i].success].depth > filter[i].depth)
+        {
+            filter[i].depth = filter[filter[i].success].depth;
+        }
+        if (filter[i].failure != WINDIVERT_FILTER_RESULT_ACCEPT &&
+            filter[i].failure != WINDIVERT_FILTER_RESULT_REJECT &&
+            filter[filter[i].failure].depth > filter[i].depth)
+        {
+            filter[i].depth = filter[filter[i].failure].depth;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * Checks an IOCTL_WINDIVERT_OPEN message of len bytes: the header fields,
+ * and that the rest of the message holds the filter program (of
+ * ioctl_open->filter_len instructions) and at most
+ * WINDIVERT_FILTER_AUTOMATA_MAXLEN bytes of automata.  The program and
+ * automata themselves are checked by windivert_filter_load().
+ */
+static BOOL windivert_open_verify(windivert_ioctl_open_t ioctl_open,
+    size_t len)
+{
+    size_t program_len;
+
+    if (len < sizeof(struct windivert_ioctl_open_s) ||
+        ioctl_open->version != WINDIVERT_IOCTL_OPEN_VERSION ||
+        ioctl_open->layer > WINDIVERT_LAYER_MAX ||
+        !WINDIVERT_FLAGS_VALID(ioctl_open->flags) ||
+        ioctl_open->priority > WINDIVERT_PRIORITY_MAX ||
+        (ioctl_open->queue_len != 0 &&
+         (ioctl_open->queue_len < WINDIVERT_PARAM_QUEUE_LEN_MIN ||
+          ioctl_open->queue_len > WINDIVERT_PARAM_QUEUE_LEN_MAX)) ||
+        (ioctl_open->queue_time != 0 &&
+         (ioctl_open->queue_time < WINDIVERT_PARAM_QUEUE_TIME_MIN ||
+          ioctl_open->queue_time > WINDIVERT_PARAM_QUEUE_TIME_MAX)))
+    {
+        return FALSE;
+    }
+    len -= sizeof(struct windivert_ioctl_open_s);
+    if (ioctl_open->filter_len == 0 ||
+        ioctl_open->filter_len >= WINDIVERT_FILTER_MAXLEN)
+    {
+        return FALSE;
+    }
+    program_len = (size_t)ioctl_open->filter_len *
+        sizeof(struct windivert_ioctl_filter_s);
+    return (len >= program_len &&
+        len - program_len <= WINDIVERT_FILTER_AUTOMATA_MAXLEN);
+}
+
+/*
+ * Initialize a filter reference.
+ */
+static void windivert_filter_ref_init(windivert_filter_ref_t ref,
+    filter_t filter)
+{
+    ref->filter     = filter;
+    ref->epoch      = 0;
+    ref->readers[0] = 0;
+    ref->readers[1] = 0;
+}
+
+/*
+ * Publish a new filter, and wait until no reader is still using the old
+ * filter (which is returned).  Filter changes must be serialized by the
+ * caller.
+ *
+ * Readers never block a filter change: each reader enters under the
+ * current epoch, and the change only waits for readers that entered under
+ * the previous epoch to exit.
+ */
+static filter_t windivert_filter_swap(windivert_filter_ref_t ref,
+    filter_t filter)
+{
+    filter_t old_filter;
+    LONG epoch;
+
+    old_filter = (filter_t)InterlockedExchangePointer(
+        (PVOID *)&ref->filter, (PVOID)filter);
+    epoch = InterlockedIncrement(&ref->epoch) - 1;
+    while (ref->readers[epoch & 1] != 0)
+    {
+        YieldProcessor();
+    }
+    return old_filter;
+}
+
+/*
+ * Start using the current filter; returns the filter (or NULL).
+ */
+static filter_t windivert_filter_enter(windivert_filter_ref_t ref,
+    LONG *epoch_ptr)
+{
+    LONG epoch;
+
+    while (TRUE)
+    {
+        epoch = ref->epoch;
+        InterlockedIncrement(&ref->readers[epoch & 1]);
+        if (epoch == ref->epoch)
+        {
+            // Any filter change from now on will wait for us.
+            *epoch_ptr = epoch;
+            return ref->filter;
+        }
+
+        // Raced with a filter change; it may not wait for us, so retry.
+        InterlockedDecrement(&ref->readers[epoch & 1]);
+    }
+}
+
+/*
+ * Stop using the filter returned by windivert_filter_enter().
+ */
+static void windivert_filter_exit(windivert_filter_ref_t ref, LONG epoch)
+{
+    InterlockedDecrement(&ref->readers[epoch & 1]);
+}
@@ -0,0 +1,322 @@
+/*
+ * log.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The netdump packet log.  The capture loop formats each packet into one
+ * record and appends it to a lock-free ring; the log thread writes the
+ * records to the console.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "windivert.h"
+#include "netdump.h"
+
+static char hex_table[256][2];
+static char ascii_table[256];
+
+/*
+ * Initialize the log (and the formatting tables).
+ */
+extern void LogInit(PLOG log, LONG rate)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    DWORD mode;
+    UINT i;
+
+    for (i = 0; i < 256; i++)
+    {
+        hex_table[i][0] = hex[i >> 4];
+        hex_table[i][1] = hex[i & 0x0F];
+        ascii_table[i] = (i >= 0x20 && i < 0x7F? (char)i: '.');
+    }
+
+    memset(log, 0, sizeof(LOG));
+    log->rate = rate;
+    log->console = GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &mode);
+    log->buf = (char *)malloc(LOG_SIZE);
+    if (log->buf == NULL)
+    {
+        fprintf(stderr, "error: memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Append a record to the log.  Never blocks; returns FALSE if the record
+ * was dropped.
+ */
+extern BOOL LogWrite(PLOG log, const char *text, UINT text_len)
+{
+    PLOGHDR hdr;
+    UINT32 head, off, pad, len;
+    LONG second;
+
+    // Rate limiting:
+    if (log->rate != 0)
+    {
+        second = (LONG)(GetTickCount() / 1000);
+        if (second != log->second)
+        {
+            InterlockedExchange(&log->second, second);
+            InterlockedExchange(&log->count, 0);
+        }
+        if (InterlockedIncrement(&log->count) > log->rate)
+        {
+            InterlockedIncrement(&log->dropped);
+            return FALSE;
+        }
+    }
+
+    // Reserve space:
+    len = (UINT32)((sizeof(LOGHDR) + text_len + sizeof(LOGHDR) - 1) &
+        ~(sizeof(LOGHDR) - 1));
+    do
+    {
+        head = (UINT32)log->head;
+        off = head & (LOG_SIZE-1);
+        pad = (off + len > LOG_SIZE? LOG_SIZE - off: 0);
+        if (head + pad + len - (UINT32)log->tail > LOG_SIZE)
+        {
+            // Log is full:
+            InterlockedIncrement(&log->dropped);
+            return FALSE;
+        }
+    }
+    while ((UINT32)InterlockedCompareExchange(&log->head,
+        (LONG)(head + pad + len), (LONG)head) != head);
+
+    if (pad != 0)
+    {
+        hdr = (PLOGHDR)(log->buf + off);
+        hdr->len = pad;
+        hdr->text_len = 0;
+        InterlockedExchange(&hdr->ready, TRUE);
+        off = 0;
+    }
+    hdr = (PLOGHDR)(log->buf + off);
+    hdr->len = len;
+    hdr->text_len = text_len;
+    memcpy(hdr + 1, text, text_len);
+    InterlockedExchange(&hdr->ready, TRUE);
+    return TRUE;
+}
+
+/*
+ * Log thread.  Output is buffered, and only flushed when the log is empty
+ * (or to change the console colour).
+ */
+extern DWORD WINAPI LogThread(LPVOID arg)
+{
+    PLOG log = (PLOG)arg;
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    PLOGHDR hdr;
+    UINT32 tail;
+    LONG dropped;
+    char *text;
+    UINT i, j;
+
+    setvbuf(stdout, NULL, _IOFBF, 1024*1024);
+    while (TRUE)
+    {
+        tail = (UINT32)log->tail;
+        hdr = (PLOGHDR)(log->buf + (tail & (LOG_SIZE-1)));
+        if (tail == (UINT32)log->head || !hdr->ready)
+        {
+            dropped = InterlockedExchange(&log->dropped, 0);
+            if (dropped != 0)
+            {
+                printf("\n(%ld packets not shown)\n", (long)dropped);
+            }
+            fflush(stdout);
+            Sleep(LOG_INTERVAL);
+            continue;
+        }
+
+        // Write the record text, switching colours at each marker:
+        text = (char *)(hdr + 1);
+        for (i = 0; i < hdr->text_len; i = j)
+        {
+            if (text[i] == LOG_COLOUR)
+            {
+                if (log->console)
+                {
+                    fflush(stdout);
+                    SetConsoleTextAttribute(console, (WORD)text[i+1]);
+                }
+                j = i + 2;
+                continue;
+            }
+            for (j = i + 1; j < hdr->text_len && text[j] != LOG_COLOUR; j++)
+                ;
+            fwrite(text + i, 1, j - i, stdout);
+        }
+
+        hdr->ready = FALSE;
+        InterlockedExchange(&log->tail, (LONG)(tail + hdr->len));
+    }
+}
+
+/*
+ * Format a packet for the log.  The buffer must be LOG_RECORD_MAX bytes.
+ */
+extern UINT PacketFormat(char *buf, const UINT8 *packet, UINT packet_len,
+    PWINDIVERT_ADDRESS addr)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_ICMPHDR icmp_header;
+    PWINDIVERT_ICMPV6HDR icmpv6_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_UDPHDR udp_header;
+    char *p = buf;
+    UINT i;
+
+    WinDivertHelperParsePacket((PVOID)packet, packet_len, &ip_header,
+        &ipv6_header, &icmp_header, &icmpv6_header, &tcp_header,
+        &udp_header, NULL, NULL);
+    if (ip_header == NULL && ipv6_header == NULL)
+    {
+        fprintf(stderr, "warning: junk packet\n");
+    }
+
+#define COLOUR(colour)                                                      \
+    do {                                                                    \
+        *p++ = LOG_COLOUR;                                                  \
+        *p++ = (char)(colour);                                              \
+    } while (FALSE)
+
+    // Dump packet info:
+    *p++ = '\n';
+    COLOUR(FOREGROUND_RED);
+    p += sprintf(p, "Packet [Direction=%u IfIdx=%u SubIfIdx=%u]\n",
+        addr->Direction, addr->IfIdx, addr->SubIfIdx);
+    if (ip_header != NULL)
+    {
+        UINT8 *src_addr = (UINT8 *)&ip_header->SrcAddr;
+        UINT8 *dst_addr = (UINT8 *)&ip_header->DstAddr;
+        COLOUR(FOREGROUND_GREEN | FOREGROUND_RED);
+        p += sprintf(p, "IPv4 [Version=%u HdrLength=%u TOS=%u Length=%u "
+            "Id=0x%.4X Reserved=%u DF=%u MF=%u FragOff=%u TTL=%u "
+            "Protocol=%u Checksum=0x%.4X SrcAddr=%u.%u.%u.%u "
+            "DstAddr=%u.%u.%u.%u]\n",
+            ip_header->Version, ip_header->HdrLength,
+            ntohs(ip_header->TOS), ntohs(ip_header->Length),
+            ntohs(ip_header->Id), WINDIVERT_IPHDR_GET_RESERVED(ip_header),
+            WINDIVERT_IPHDR_GET_DF(ip_header),
+            WINDIVERT_IPHDR_GET_MF(ip_header),
+            ntohs(WINDIVERT_IPHDR_GET_FRAGOFF(ip_header)), ip_header->TTL,
+            ip_header->Protocol, ntohs(ip_header->Checksum),
+            src_addr[0], src_addr[1], src_addr[2], src_addr[3],
+            dst_addr[0], dst_addr[1], dst_addr[2], dst_addr[3]);
+    }
+    if (ipv6_header != NULL)
+    {
+        UINT16 *src_addr = (UINT16 *)&ipv6_header->SrcAddr;
+        UINT16 *dst_addr = (UINT16 *)&ipv6_header->DstAddr;
+        COLOUR(FOREGROUND_GREEN | FOREGROUND_RED);
+        p += sprintf(p, "IPv6 [Version=%u TrafficClass=%u FlowLabel=%u "
+            "Length=%u NextHdr=%u HopLimit=%u SrcAddr=",
+            ipv6_header->Version,
+            WINDIVERT_IPV6HDR_GET_TRAFFICCLASS(ipv6_header),
+            ntohl(WINDIVERT_IPV6HDR_GET_FLOWLABEL(ipv6_header)),
+            ntohs(ipv6_header->Length), ipv6_header->NextHdr,
+            ipv6_header->HopLimit);
+        for (i = 0; i < 8; i++)
+        {
+            p += sprintf(p, "%x%c", ntohs(src_addr[i]), (i == 7? ' ': ':'));
+        }
+        p += sprintf(p, "DstAddr=");
+        for (i = 0; i < 8; i++)
+        {
+            p += sprintf(p, "%x%s", ntohs(dst_addr[i]), (i == 7? "]\n": ":"));
+        }
+    }
+    if (icmp_header != NULL)
+    {
+        COLOUR(FOREGROUND_RED);
+        p += sprintf(p, "ICMP [Type=%u Code=%u Checksum=0x%.4X "
+            "Body=0x%.8X]\n",
+            icmp_header->Type, icmp_header->Code,
+            ntohs(icmp_header->Checksum), ntohl(icmp_header->Body));
+    }
+    if (icmpv6_header != NULL)
+    {
+        COLOUR(FOREGROUND_RED);
+        p += sprintf(p, "ICMPV6 [Type=%u Code=%u Checksum=0x%.4X "
+            "Body=0x%.8X]\n",
+            icmpv6_header->Type, icmpv6_header->Code,
+            ntohs(icmpv6_header->Checksum), ntohl(icmpv6_header->Body));
+    }
+    if (tcp_header != NULL)
+    {
+        COLOUR(FOREGROUND_GREEN);
+        p += sprintf(p, "TCP [SrcPort=%u DstPort=%u SeqNum=%u AckNum=%u "
+            "HdrLength=%u Reserved1=%u Reserved2=%u Urg=%u Ack=%u "
+            "Psh=%u Rst=%u Syn=%u Fin=%u Window=%u Checksum=0x%.4X "
+            "UrgPtr=%u]\n",
+            ntohs(tcp_header->SrcPort), ntohs(tcp_header->DstPort),
+            ntohl(tcp_header->SeqNum), ntohl(tcp_header->AckNum),
+            tcp_header->HdrLength, tcp_header->Reserved1,
+            tcp_header->Reserved2, tcp_header->Urg, tcp_header->Ack,
+            tcp_header->Psh, tcp_header->Rst, tcp_header->Syn,
+            tcp_header->Fin, ntohs(tcp_header->Window),
+            ntohs(tcp_header->Checksum), ntohs(tcp_header->UrgPtr));
+    }
+    if (udp_header != NULL)
+    {
+        COLOUR(FOREGROUND_GREEN);
+        p += sprintf(p, "UDP [SrcPort=%u DstPort=%u Length=%u "
+            "Checksum=0x%.4X]\n",
+            ntohs(udp_header->SrcPort), ntohs(udp_header->DstPort),
+            ntohs(udp_header->Length), ntohs(udp_header->Checksum));
+    }
+
+    // Hex and ASCII dumps, using the lookup tables:
+    COLOUR(FOREGROUND_GREEN | FOREGROUND_BLUE);
+    for (i = 0; i < packet_len; i++)
+    {
+        if (i % 20 == 0)
+        {
+            *p++ = '\n';
+            *p++ = '\t';
+        }
+        *p++ = hex_table[packet[i]][0];
+        *p++ = hex_table[packet[i]][1];
+    }
+    COLOUR(FOREGROUND_RED | FOREGROUND_BLUE);
+    for (i = 0; i < packet_len; i++)
+    {
+        if (i % 40 == 0)
+        {
+            *p++ = '\n';
+            *p++ = '\t';
+        }
+        *p++ = ascii_table[packet[i]];
+    }
+    *p++ = '\n';
+    COLOUR(FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+
+#undef COLOUR
+
+    return (UINT)(p - buf);
+}
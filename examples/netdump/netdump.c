@@ -21,8 +21,17 @@
  * This is a simple traffic monitor.  It uses a WinDivert handle in SNIFF mode.
  * The SNIFF mode copies packets and does not block the original.
  *
- * usage: netdump.exe windivert-filter [priority]
+ * usage: netdump.exe [--write file.pcapng [--rotate-size MB]
+ *                     [--rotate-time seconds]]
+ *                     windivert-filter [priority [max-packets-per-second]]
  *
+ * With --write, packets are saved to a pcapng capture file (or a sequence of
+ * files if rotated) instead of being printed.
+ *
+ * Packets are formatted by the capture loop and written to the console by a
+ * separate log thread, so that console output does not slow down capture.
+ * Packets are dropped from the output (but still counted) if the log falls
+ * behind, or if the optional packets-per-second limit is exceeded.
  */
 
 #include <winsock2.h>
@@ -32,48 +41,107 @@
 #include <string.h>
 
 #include "windivert.h"
+#include "netdump.h"
 
 #define MAXBUF  0xFFFF
+#define PCAP_FLUSH_INTERVAL 1000        // Capture file flush interval (ms).
+
+static LOG packet_log;
+static HANDLE divert_handle;
+static volatile BOOL stop = FALSE;
+
+static BOOL WINAPI CtrlHandler(DWORD type);
 
 /*
  * Entry.
  */
 int __cdecl main(int argc, char **argv)
 {
-    HANDLE handle, console;
-    UINT i;
+    HANDLE handle, thread, pcap = NULL;
     INT16 priority = 0;
-    char packet[MAXBUF];
-    UINT packet_len;
+    LONG rate = 0;
+    static char packet[MAXBUF];
+    static char record[LOG_RECORD_MAX];
+    UINT packet_len, record_len;
     WINDIVERT_ADDRESS addr;
-    PWINDIVERT_IPHDR ip_header;
-    PWINDIVERT_IPV6HDR ipv6_header;
-    PWINDIVERT_ICMPHDR icmp_header;
-    PWINDIVERT_ICMPV6HDR icmpv6_header;
-    PWINDIVERT_TCPHDR tcp_header;
-    PWINDIVERT_UDPHDR udp_header;
+    const char *filename = NULL;
+    UINT64 rotate_size = 0;
+    UINT rotate_time = 0;
+    ULONGLONG flush_time = 0, now;
+    int i;
 
     // Check arguments.
+    for (i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "--write") == 0)
+        {
+            filename = argv[i+1];
+        }
+        else if (strcmp(argv[i], "--rotate-size") == 0)
+        {
+            rotate_size = (UINT64)atoi(argv[i+1]) * 1024 * 1024;
+        }
+        else if (strcmp(argv[i], "--rotate-time") == 0)
+        {
+            rotate_time = (UINT)atoi(argv[i+1]);
+        }
+        else
+        {
+            break;
+        }
+    }
+    argv[i-1] = argv[0];
+    argc -= i - 1;
+    argv += i - 1;
     switch (argc)
     {
         case 2:
             break;
+        case 4:
+            rate = (LONG)atoi(argv[3]);
+            // Fallthrough
         case 3:
             priority = (INT16)atoi(argv[2]);
             break;
         default:
-            fprintf(stderr, "usage: %s windivert-filter [priority]\n",
-                argv[0]);
+            fprintf(stderr, "usage: %s [--write file.pcapng [--rotate-size "
+                "MB] [--rotate-time seconds]]\n"
+                "       windivert-filter [priority "
+                "[max-packets-per-second]]\n", argv[0]);
             fprintf(stderr, "examples:\n");
             fprintf(stderr, "\t%s true\n", argv[0]);
             fprintf(stderr, "\t%s \"outbound and tcp.DstPort == 80\" 1000\n",
                 argv[0]);
             fprintf(stderr, "\t%s \"inbound and tcp.Syn\" -4000\n", argv[0]);
+            fprintf(stderr, "\t%s \"udp\" 0 100\n", argv[0]);
+            fprintf(stderr, "\t%s --write dump.pcapng --rotate-size 100 "
+                "true\n", argv[0]);
             exit(EXIT_FAILURE);
     }
 
-    // Get console for pretty colors.
-    console = GetStdHandle(STD_OUTPUT_HANDLE);
+    // Open the capture file, or start the log thread:
+    if (filename != NULL)
+    {
+        pcap = WinDivertHelperPcapOpen(filename, rotate_size, rotate_time);
+        if (pcap == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "error: failed to open capture file %s (%d)\n",
+                filename, GetLastError());
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        LogInit(&packet_log, rate);
+        thread = CreateThread(NULL, 0, LogThread, (LPVOID)&packet_log, 0,
+            NULL);
+        if (thread == NULL)
+        {
+            fprintf(stderr, "error: failed to start log thread (%d)\n",
+                GetLastError());
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Divert traffic matching the filter:
     handle = WinDivertOpen(argv[1], WINDIVERT_LAYER_NETWORK, priority,
@@ -104,143 +172,63 @@ int __cdecl main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    // Ctrl-C closes the handle, so that the capture file can be completed:
+    divert_handle = handle;
+    SetConsoleCtrlHandler(CtrlHandler, TRUE);
+
     // Main loop:
     while (TRUE)
     {
         // Read a matching packet.
         if (!WinDivertRecv(handle, packet, sizeof(packet), &addr, &packet_len))
         {
+            if (stop)
+            {
+                break;
+            }
             fprintf(stderr, "warning: failed to read packet (%d)\n",
                 GetLastError());
             continue;
         }
-       
-        // Print info about the matching packet.
-        WinDivertHelperParsePacket(packet, packet_len, &ip_header,
-            &ipv6_header, &icmp_header, &icmpv6_header, &tcp_header,
-            &udp_header, NULL, NULL);
-        if (ip_header == NULL && ipv6_header == NULL)
-        {
-            fprintf(stderr, "warning: junk packet\n");
-        }
 
-        // Dump packet info: 
-        putchar('\n');
-        SetConsoleTextAttribute(console, FOREGROUND_RED);
-        printf("Packet [Direction=%u IfIdx=%u SubIfIdx=%u]\n",
-            addr.Direction, addr.IfIdx, addr.SubIfIdx);
-        if (ip_header != NULL)
+        if (pcap != NULL)
         {
-            UINT8 *src_addr = (UINT8 *)&ip_header->SrcAddr;
-            UINT8 *dst_addr = (UINT8 *)&ip_header->DstAddr;
-            SetConsoleTextAttribute(console,
-                FOREGROUND_GREEN | FOREGROUND_RED);
-            printf("IPv4 [Version=%u HdrLength=%u TOS=%u Length=%u Id=0x%.4X "
-                "Reserved=%u DF=%u MF=%u FragOff=%u TTL=%u Protocol=%u "
-                "Checksum=0x%.4X SrcAddr=%u.%u.%u.%u DstAddr=%u.%u.%u.%u]\n",
-                ip_header->Version, ip_header->HdrLength,
-                ntohs(ip_header->TOS), ntohs(ip_header->Length),
-                ntohs(ip_header->Id), WINDIVERT_IPHDR_GET_RESERVED(ip_header),
-                WINDIVERT_IPHDR_GET_DF(ip_header),
-                WINDIVERT_IPHDR_GET_MF(ip_header),
-                ntohs(WINDIVERT_IPHDR_GET_FRAGOFF(ip_header)), ip_header->TTL,
-                ip_header->Protocol, ntohs(ip_header->Checksum),
-                src_addr[0], src_addr[1], src_addr[2], src_addr[3],
-                dst_addr[0], dst_addr[1], dst_addr[2], dst_addr[3]);
-        }
-        if (ipv6_header != NULL)
-        {
-            UINT16 *src_addr = (UINT16 *)&ipv6_header->SrcAddr;
-            UINT16 *dst_addr = (UINT16 *)&ipv6_header->DstAddr;
-            SetConsoleTextAttribute(console,
-                FOREGROUND_GREEN | FOREGROUND_RED);
-            printf("IPv6 [Version=%u TrafficClass=%u FlowLabel=%u Length=%u "
-                "NextHdr=%u HopLimit=%u SrcAddr=",
-                ipv6_header->Version,
-                WINDIVERT_IPV6HDR_GET_TRAFFICCLASS(ipv6_header),
-                ntohl(WINDIVERT_IPV6HDR_GET_FLOWLABEL(ipv6_header)),
-                ntohs(ipv6_header->Length), ipv6_header->NextHdr,
-                ipv6_header->HopLimit);
-            for (i = 0; i < 8; i++)
-            {
-                printf("%x%c", ntohs(src_addr[i]), (i == 7? ' ': ':'));
-            } 
-            fputs("DstAddr=", stdout);
-            for (i = 0; i < 8; i++)
-            {
-                printf("%x", ntohs(dst_addr[i]));
-                if (i != 7)
-                {
-                    putchar(':');
-                }
-            }
-            fputs("]\n", stdout);
-        }
-        if (icmp_header != NULL)
-        {
-            SetConsoleTextAttribute(console, FOREGROUND_RED);
-            printf("ICMP [Type=%u Code=%u Checksum=0x%.4X Body=0x%.8X]\n",
-                icmp_header->Type, icmp_header->Code,
-                ntohs(icmp_header->Checksum), ntohl(icmp_header->Body));
-        }
-        if (icmpv6_header != NULL)
-        {
-            SetConsoleTextAttribute(console, FOREGROUND_RED);
-            printf("ICMPV6 [Type=%u Code=%u Checksum=0x%.4X Body=0x%.8X]\n",
-                icmpv6_header->Type, icmpv6_header->Code,
-                ntohs(icmpv6_header->Checksum), ntohl(icmpv6_header->Body));
-        }
-        if (tcp_header != NULL)
-        {
-            SetConsoleTextAttribute(console, FOREGROUND_GREEN);
-            printf("TCP [SrcPort=%u DstPort=%u SeqNum=%u AckNum=%u "
-                "HdrLength=%u Reserved1=%u Reserved2=%u Urg=%u Ack=%u "
-                "Psh=%u Rst=%u Syn=%u Fin=%u Window=%u Checksum=0x%.4X "
-                "UrgPtr=%u]\n",
-                ntohs(tcp_header->SrcPort), ntohs(tcp_header->DstPort),
-                ntohl(tcp_header->SeqNum), ntohl(tcp_header->AckNum),
-                tcp_header->HdrLength, tcp_header->Reserved1,
-                tcp_header->Reserved2, tcp_header->Urg, tcp_header->Ack,
-                tcp_header->Psh, tcp_header->Rst, tcp_header->Syn,
-                tcp_header->Fin, ntohs(tcp_header->Window),
-                ntohs(tcp_header->Checksum), ntohs(tcp_header->UrgPtr));
-        }
-        if (udp_header != NULL)
-        {
-            SetConsoleTextAttribute(console, FOREGROUND_GREEN);
-            printf("UDP [SrcPort=%u DstPort=%u Length=%u "
-                "Checksum=0x%.4X]\n",
-                ntohs(udp_header->SrcPort), ntohs(udp_header->DstPort),
-                ntohs(udp_header->Length), ntohs(udp_header->Checksum));
-        }
-        SetConsoleTextAttribute(console, FOREGROUND_GREEN | FOREGROUND_BLUE);
-        for (i = 0; i < packet_len; i++)
-        {
-            if (i % 20 == 0)
+            // Save the matching packet.
+            if (!WinDivertHelperPcapWrite(pcap, packet, packet_len, &addr))
             {
-                printf("\n\t");
+                fprintf(stderr, "error: failed to write capture file (%d)\n",
+                    GetLastError());
+                exit(EXIT_FAILURE);
             }
-            printf("%.2X", (UINT8)packet[i]);
-        }
-        SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_BLUE);
-        for (i = 0; i < packet_len; i++)
-        {
-            if (i % 40 == 0)
+            now = GetTickCount64();
+            if (now - flush_time >= PCAP_FLUSH_INTERVAL)
             {
-                printf("\n\t");
-            }
-            if (isprint(packet[i]))
-            {
-                putchar(packet[i]);
-            }
-            else
-            {
-                putchar('.');
+                WinDivertHelperPcapFlush(pcap);
+                flush_time = now;
             }
+            continue;
         }
-        putchar('\n');
-        SetConsoleTextAttribute(console,
-            FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+
+        // Log info about the matching packet.
+        record_len = PacketFormat(record, (UINT8 *)packet, packet_len, &addr);
+        LogWrite(&packet_log, record, record_len);
     }
+
+    if (pcap != NULL && !WinDivertHelperPcapClose(pcap))
+    {
+        fprintf(stderr, "error: failed to write capture file (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    return 0;
 }
 
+/*
+ * Console control handler.
+ */
+static BOOL WINAPI CtrlHandler(DWORD type)
+{
+    stop = TRUE;
+    WinDivertClose(divert_handle);
+    return TRUE;
+}
@@ -0,0 +1,80 @@
+/*
+ * netdump.h
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Definitions shared by the parts of the netdump example:
+ *  - log.c: the packet log (a lock-free ring written by the log thread)
+ *    and the packet formatter.
+ *  - netdump.c: the program itself (options, capture, and saving to pcapng
+ *    files).
+ * log.c can also be built on a POSIX host, against the DLL and a Win32 shim,
+ * for testing (see test/).
+ */
+
+#ifndef __NETDUMP_H
+#define __NETDUMP_H
+
+#include <windows.h>
+
+#include "windivert.h"
+
+/*
+ * Log ring definitions.  Records are variable-length and aligned to the
+ * header size (so a padding header always fits); a record that would not
+ * fit before the end of the ring is preceded by a padding record.
+ */
+#define LOG_SIZE        (8*1024*1024)   // Ring size (power of 2).
+#define LOG_RECORD_MAX  (256*1024)      // Max formatted packet size.
+#define LOG_INTERVAL    50              // Log thread poll interval (ms).
+#define LOG_COLOUR      '\x1B'          // Colour change marker.
+
+typedef struct
+{
+    volatile LONG ready;                // Record is complete.
+    UINT32 len;                         // Record length (incl. header).
+    UINT32 text_len;                    // Text length (0 for padding).
+    UINT32 reserved;
+} LOGHDR, *PLOGHDR;
+
+/*
+ * Lock-free multi-producer log ring.  Producers reserve space by advancing
+ * the head, copy in their record, then mark it ready.  The log thread writes
+ * ready records in order, and advances the tail.
+ */
+typedef struct
+{
+    volatile LONG head;                 // Next free byte.
+    volatile LONG tail;                 // Next unwritten byte.
+    volatile LONG dropped;              // Records dropped.
+    volatile LONG second;               // Current rate limit period.
+    volatile LONG count;                // Records in the current period.
+    LONG rate;                          // Max records per second (or 0).
+    BOOL console;                       // Output is a console.
+    char *buf;
+} LOG, *PLOG;
+
+/*
+ * The packet log (log.c).
+ */
+extern void LogInit(PLOG log, LONG rate);
+extern BOOL LogWrite(PLOG log, const char *text, UINT text_len);
+extern DWORD WINAPI LogThread(LPVOID arg);
+extern UINT PacketFormat(char *buf, const UINT8 *packet, UINT packet_len,
+    PWINDIVERT_ADDRESS addr);
+
+#endif      /* __NETDUMP_H */
@@ -33,6 +33,17 @@
 
 #define MAXBUF  0xFFFF
 
+/*
+ * Thread arguments: each thread reads its own queue.
+ */
+struct passthru_s
+{
+    HANDLE handle;
+    UINT queue;
+};
+
+static struct passthru_s threads[64];
+
 static DWORD passthru(LPVOID arg);
 
 /*
@@ -69,11 +80,25 @@ int __cdecl main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    // One queue per thread, so that the threads do not contend for packets:
+    if (!WinDivertSetParam(handle, WINDIVERT_PARAM_QUEUE_COUNT,
+            (UINT64)num_threads))
+    {
+        fprintf(stderr, "error: failed to set the queue count (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
     // Start the threads
+    for (i = 0; i < num_threads; i++)
+    {
+        threads[i].handle = handle;
+        threads[i].queue  = (UINT)i;
+    }
     for (i = 1; i < num_threads; i++)
     {
         thread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)passthru,
-            (LPVOID)handle, 0, NULL);
+            (LPVOID)&threads[i], 0, NULL);
         if (thread == NULL)
         {
             fprintf(stderr, "error: failed to start passthru thread (%u)\n",
@@ -83,7 +108,7 @@ int __cdecl main(int argc, char **argv)
     }
 
     // Main thread:
-    passthru((LPVOID)handle);
+    passthru((LPVOID)&threads[0]);
 
     return 0;
 }
@@ -94,13 +119,15 @@ static DWORD passthru(LPVOID arg)
     char packet[MAXBUF];
     UINT packet_len;
     WINDIVERT_ADDRESS addr;
-    HANDLE handle = (HANDLE)arg;
+    struct passthru_s *thread = (struct passthru_s *)arg;
+    HANDLE handle = thread->handle;
 
     // Main loop:
     while (TRUE)
     {
         // Read a matching packet.
-        if (!WinDivertRecv(handle, packet, sizeof(packet), &addr, &packet_len))
+        if (!WinDivertRecvQueue(handle, thread->queue, packet, sizeof(packet),
+                &addr, &packet_len, NULL))
         {
             fprintf(stderr, "warning: failed to read packet (%d)\n",
                 GetLastError());
@@ -0,0 +1,795 @@
+/*
+ * replay.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DESCRIPTION:
+ * This is an offline benchmark for WinDivert's packet processing code.  It
+ * replays packets from pcap or pcapng capture files through the same filter,
+ * packet parser and checksum code that WinDivert uses.  No WinDivert handle
+ * is opened, so neither the driver nor live traffic is required.
+ *
+ * usage: replay.exe [--iterations N] windivert-filter capture-file
+ *                   [capture-file ...]
+ *
+ * Each stage is run over every packet N times (default 10), and the average
+ * time per packet is reported, along with the number of packets that failed
+ * to parse, matched the filter, or had at least one incorrect checksum.
+ *
+ * Packets are treated as outbound on interface 0.0 unless the capture file
+ * says otherwise.  Files written by WinDivertHelperPcapWrite() record both
+ * the interface and the direction of each packet.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "windivert.h"
+
+#define MAXBUF              0xFFFF
+#define DEFAULT_ITERATIONS  10
+
+/*
+ * Capture file definitions.
+ */
+#define PCAP_MAGIC              0xA1B2C3D4  // Microsecond timestamps.
+#define PCAP_MAGIC_NS           0xA1B23C4D  // Nanosecond timestamps.
+#define PCAP_HEADER_LEN         24
+#define PCAP_RECORD_LEN         16
+#define PCAPNG_BLOCK_SHB        0x0A0D0D0A
+#define PCAPNG_BLOCK_IDB        0x00000001
+#define PCAPNG_BLOCK_SPB        0x00000003
+#define PCAPNG_BLOCK_EPB        0x00000006
+#define PCAPNG_BYTE_ORDER       0x1A2B3C4D
+#define PCAPNG_OPT_END          0
+#define PCAPNG_OPT_IF_NAME      2
+#define PCAPNG_OPT_EPB_FLAGS    2
+#define PCAPNG_FLAG_INBOUND     0x00000001
+#define PCAPNG_FLAG_OUTBOUND    0x00000002
+
+/*
+ * Link-layer types.
+ */
+#define LINKTYPE_NULL           0
+#define LINKTYPE_ETHERNET       1
+#define LINKTYPE_RAW            101
+#define LINKTYPE_LINUX_SLL      113
+#define LINKTYPE_IPV4           228
+#define LINKTYPE_IPV6           229
+
+#define ETHERTYPE_IPV4          0x0800
+#define ETHERTYPE_IPV6          0x86DD
+#define ETHERTYPE_VLAN          0x8100
+#define ETHERTYPE_QINQ          0x88A8
+#define SLL_OUTGOING            4
+
+/*
+ * A capture file interface.
+ */
+typedef struct
+{
+    UINT linktype;
+    WINDIVERT_ADDRESS addr;             // Default packet address.
+} LINKINFO, *PLINKINFO;
+
+/*
+ * A replayed packet.
+ */
+typedef struct
+{
+    WINDIVERT_ADDRESS addr;
+    UINT len;
+    size_t offset;                      // Offset into the packet data.
+    UINT8 *data;                        // Set once all files are loaded.
+} RAWPACKET, *PRAWPACKET;
+
+/*
+ * All replayed packets.  Packet data is copied (stripped of any link-layer
+ * header) into a single buffer, with each packet 8-byte aligned as it would
+ * be in a WinDivertRecv() buffer.
+ */
+typedef struct
+{
+    PRAWPACKET packets;
+    UINT num_packets;
+    UINT max_packets;
+    UINT skipped;                       // Unsupported packets.
+    UINT8 *data;                        // Packet data.
+    size_t data_len;
+    size_t max_data;
+    PLINKINFO links;                    // Current pcapng section interfaces.
+    UINT num_links;
+    UINT max_links;
+} CAPTURE, *PCAPTURE;
+
+static BOOL CaptureLoad(PCAPTURE capture, const char *filename);
+static BOOL CaptureLoadPcap(PCAPTURE capture, const UINT8 *buf,
+    size_t len);
+static BOOL CaptureLoadPcapng(PCAPTURE capture, const UINT8 *buf,
+    size_t len);
+static BOOL CaptureAddLink(PCAPTURE capture, UINT linktype,
+    const UINT8 *options, size_t options_len, BOOL swap);
+static BOOL CaptureAddPacket(PCAPTURE capture, UINT linktype,
+    const WINDIVERT_ADDRESS *addr, const UINT8 *data, UINT len);
+static BOOL CaptureOption(const UINT8 *options, size_t options_len,
+    BOOL swap, UINT16 code, const UINT8 **value, UINT16 *value_len);
+static UINT16 CaptureRead16(const UINT8 *ptr, BOOL swap);
+static UINT32 CaptureRead32(const UINT8 *ptr, BOOL swap);
+static double NsPerPacket(LONGLONG ticks, LONGLONG freq, UINT num_packets,
+    UINT iterations);
+
+/*
+ * Entry.
+ */
+int __cdecl main(int argc, char **argv)
+{
+    CAPTURE capture;
+    PRAWPACKET packet;
+    UINT8 *object, *work;
+    UINT object_len, iterations = DEFAULT_ITERATIONS, i, j;
+    UINT failed = 0, matched = 0, fixed = 0;
+    HANDLE filter;
+    LARGE_INTEGER freq, start, end;
+    LONGLONG parse_ticks = 0, filter_ticks = 0, checksum_ticks = 0;
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_ICMPHDR icmp_header;
+    PWINDIVERT_ICMPV6HDR icmpv6_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_UDPHDR udp_header;
+    PVOID payload;
+    UINT payload_len;
+    int k;
+
+    // Check arguments.
+    for (k = 1; k + 1 < argc; k += 2)
+    {
+        if (strcmp(argv[k], "--iterations") == 0)
+        {
+            iterations = (UINT)atoi(argv[k+1]);
+        }
+        else
+        {
+            break;
+        }
+    }
+    argv[k-1] = argv[0];
+    argc -= k - 1;
+    argv += k - 1;
+    if (argc < 3 || iterations == 0)
+    {
+        fprintf(stderr, "usage: %s [--iterations N] windivert-filter "
+            "capture-file [capture-file ...]\n", argv[0]);
+        fprintf(stderr, "examples:\n");
+        fprintf(stderr, "\t%s true dump.pcapng\n", argv[0]);
+        fprintf(stderr, "\t%s --iterations 100 \"outbound and "
+            "tcp.DstPort == 80\" web.pcap\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Compile the filter:
+    if (WinDivertFilterCompile(argv[1], WINDIVERT_LAYER_NETWORK, NULL, 0,
+            &object_len) || GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+    {
+        fprintf(stderr, "error: filter syntax error\n");
+        exit(EXIT_FAILURE);
+    }
+    object = (UINT8 *)malloc(object_len);
+    if (object == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate filter object\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!WinDivertFilterCompile(argv[1], WINDIVERT_LAYER_NETWORK, object,
+            object_len, NULL))
+    {
+        fprintf(stderr, "error: failed to compile filter (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    filter = WinDivertHelperFilterOpen(object, object_len);
+    if (filter == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "error: failed to load filter (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    free(object);
+
+    // Load the capture files:
+    memset(&capture, 0, sizeof(capture));
+    for (k = 2; k < argc; k++)
+    {
+        if (!CaptureLoad(&capture, argv[k]))
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (capture.num_packets == 0)
+    {
+        fprintf(stderr, "error: no IPv4 or IPv6 packets found\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < capture.num_packets; i++)
+    {
+        packet = capture.packets + i;
+        packet->data = capture.data + packet->offset;
+    }
+
+    // The checksum stage modifies packets, so it runs over a copy:
+    work = (UINT8 *)malloc(capture.data_len);
+    if (work == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate packet copies\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Replay the packets through each stage in turn:
+    QueryPerformanceFrequency(&freq);
+    for (j = 0; j < iterations; j++)
+    {
+        failed = 0;
+        QueryPerformanceCounter(&start);
+        for (i = 0; i < capture.num_packets; i++)
+        {
+            packet = capture.packets + i;
+            WinDivertHelperParsePacket(packet->data, packet->len, &ip_header,
+                &ipv6_header, &icmp_header, &icmpv6_header, &tcp_header,
+                &udp_header, &payload, &payload_len);
+            if (ip_header == NULL && ipv6_header == NULL)
+            {
+                failed++;
+            }
+        }
+        QueryPerformanceCounter(&end);
+        parse_ticks += end.QuadPart - start.QuadPart;
+
+        matched = 0;
+        QueryPerformanceCounter(&start);
+        for (i = 0; i < capture.num_packets; i++)
+        {
+            packet = capture.packets + i;
+            if (WinDivertHelperEvalFilter(filter, packet->data, packet->len,
+                    &packet->addr))
+            {
+                matched++;
+            }
+        }
+        QueryPerformanceCounter(&end);
+        filter_ticks += end.QuadPart - start.QuadPart;
+
+        memcpy(work, capture.data, capture.data_len);
+        QueryPerformanceCounter(&start);
+        for (i = 0; i < capture.num_packets; i++)
+        {
+            packet = capture.packets + i;
+            WinDivertHelperCalcChecksums(work + packet->offset, packet->len,
+                0);
+        }
+        QueryPerformanceCounter(&end);
+        checksum_ticks += end.QuadPart - start.QuadPart;
+        fixed = 0;
+        for (i = 0; i < capture.num_packets; i++)
+        {
+            packet = capture.packets + i;
+            if (memcmp(work + packet->offset, packet->data, packet->len) != 0)
+            {
+                fixed++;
+            }
+        }
+    }
+
+    // Report:
+    printf("packets:  %u (%u skipped), %u iterations\n",
+        capture.num_packets, capture.skipped, iterations);
+    printf("parse:    %10.1f ns/packet (%u failed)\n",
+        NsPerPacket(parse_ticks, freq.QuadPart, capture.num_packets,
+            iterations), failed);
+    printf("filter:   %10.1f ns/packet (%u matched)\n",
+        NsPerPacket(filter_ticks, freq.QuadPart, capture.num_packets,
+            iterations), matched);
+    printf("checksum: %10.1f ns/packet (%u fixed)\n",
+        NsPerPacket(checksum_ticks, freq.QuadPart, capture.num_packets,
+            iterations), fixed);
+
+    WinDivertHelperFilterClose(filter);
+    free(work);
+    free(capture.packets);
+    free(capture.data);
+    free(capture.links);
+    return 0;
+}
+
+/*
+ * Load all packets from a pcap or pcapng capture file.
+ */
+static BOOL CaptureLoad(PCAPTURE capture, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    UINT8 *buf;
+    UINT32 magic;
+    long len;
+    BOOL result;
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: could not open capture file %s\n",
+            filename);
+        return FALSE;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) < 0 ||
+        fseek(file, 0, SEEK_SET) != 0)
+    {
+        fprintf(stderr, "error: could not read capture file %s\n",
+            filename);
+        fclose(file);
+        return FALSE;
+    }
+    buf = (UINT8 *)malloc(len + 1);
+    if (buf == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate memory for capture "
+            "file %s\n", filename);
+        fclose(file);
+        return FALSE;
+    }
+    if (fread(buf, 1, len, file) != (size_t)len)
+    {
+        fprintf(stderr, "error: could not read capture file %s\n",
+            filename);
+        fclose(file);
+        free(buf);
+        return FALSE;
+    }
+    fclose(file);
+
+    if ((size_t)len < sizeof(UINT32))
+    {
+        magic = 0;
+    }
+    else
+    {
+        magic = CaptureRead32(buf, FALSE);
+    }
+    if (magic == PCAPNG_BLOCK_SHB)
+    {
+        result = CaptureLoadPcapng(capture, buf, (size_t)len);
+    }
+    else
+    {
+        result = CaptureLoadPcap(capture, buf, (size_t)len);
+    }
+    free(buf);
+    if (!result)
+    {
+        fprintf(stderr, "error: invalid or unsupported capture file %s\n",
+            filename);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Load all packets from a (classic) pcap capture file.
+ */
+static BOOL CaptureLoadPcap(PCAPTURE capture, const UINT8 *buf,
+    size_t len)
+{
+    WINDIVERT_ADDRESS addr;
+    UINT32 magic, linktype, caplen;
+    size_t offset;
+    BOOL swap;
+
+    if (len < PCAP_HEADER_LEN)
+    {
+        return FALSE;
+    }
+    magic = CaptureRead32(buf, FALSE);
+    if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS)
+    {
+        swap = FALSE;
+    }
+    else if (CaptureRead32(buf, TRUE) == PCAP_MAGIC ||
+             CaptureRead32(buf, TRUE) == PCAP_MAGIC_NS)
+    {
+        swap = TRUE;
+    }
+    else
+    {
+        return FALSE;
+    }
+    linktype = CaptureRead32(buf + 20, swap) & 0xFFFF;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+    offset = PCAP_HEADER_LEN;
+    while (offset < len)
+    {
+        if (len - offset < PCAP_RECORD_LEN)
+        {
+            return FALSE;
+        }
+        caplen = CaptureRead32(buf + offset + 8, swap);
+        offset += PCAP_RECORD_LEN;
+        if (len - offset < caplen)
+        {
+            return FALSE;
+        }
+        if (!CaptureAddPacket(capture, linktype, &addr, buf + offset,
+                caplen))
+        {
+            return FALSE;
+        }
+        offset += caplen;
+    }
+    return TRUE;
+}
+
+/*
+ * Load all packets from a pcapng capture file.
+ */
+static BOOL CaptureLoadPcapng(PCAPTURE capture, const UINT8 *buf,
+    size_t len)
+{
+    PLINKINFO link;
+    WINDIVERT_ADDRESS addr;
+    const UINT8 *value, *block;
+    UINT32 type, block_len, link_id, caplen, padded_len, flags;
+    UINT16 value_len;
+    size_t offset = 0, data_len;
+    BOOL swap = FALSE;
+
+    while (offset < len)
+    {
+        block = buf + offset;
+        if (len - offset < 3 * sizeof(UINT32))
+        {
+            return FALSE;
+        }
+        type = CaptureRead32(block, swap);
+        if (type == PCAPNG_BLOCK_SHB)
+        {
+            // Each section may have a different byte order, and has its own
+            // interfaces.
+            if (CaptureRead32(block + 8, FALSE) == PCAPNG_BYTE_ORDER)
+            {
+                swap = FALSE;
+            }
+            else if (CaptureRead32(block + 8, TRUE) == PCAPNG_BYTE_ORDER)
+            {
+                swap = TRUE;
+            }
+            else
+            {
+                return FALSE;
+            }
+            capture->num_links = 0;
+        }
+        block_len = CaptureRead32(block + 4, swap);
+        if (block_len < 3 * sizeof(UINT32) ||
+            block_len % sizeof(UINT32) != 0 || block_len > len - offset)
+        {
+            return FALSE;
+        }
+        data_len = block_len - 3 * sizeof(UINT32);
+
+        switch (type)
+        {
+            case PCAPNG_BLOCK_IDB:
+                if (data_len < 8)
+                {
+                    return FALSE;
+                }
+                if (!CaptureAddLink(capture, CaptureRead16(block + 8, swap),
+                        block + 16, data_len - 8, swap))
+                {
+                    return FALSE;
+                }
+                break;
+
+            case PCAPNG_BLOCK_EPB:
+                if (data_len < 20)
+                {
+                    return FALSE;
+                }
+                link_id = CaptureRead32(block + 8, swap);
+                caplen = CaptureRead32(block + 20, swap);
+                if (link_id >= capture->num_links || caplen > data_len - 20)
+                {
+                    return FALSE;
+                }
+                link = capture->links + link_id;
+                addr = link->addr;
+                padded_len = (caplen + 3) & ~3;
+                if (padded_len > data_len - 20)
+                {
+                    padded_len = (UINT32)(data_len - 20);
+                }
+                if (CaptureOption(block + 28 + padded_len,
+                        data_len - 20 - padded_len, swap,
+                        PCAPNG_OPT_EPB_FLAGS, &value, &value_len) &&
+                    value_len == sizeof(UINT32))
+                {
+                    flags = CaptureRead32(value, swap) & 0x3;
+                    if (flags == PCAPNG_FLAG_INBOUND)
+                    {
+                        addr.Direction = WINDIVERT_DIRECTION_INBOUND;
+                    }
+                    else if (flags == PCAPNG_FLAG_OUTBOUND)
+                    {
+                        addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+                    }
+                }
+                if (!CaptureAddPacket(capture, link->linktype, &addr,
+                        block + 28, caplen))
+                {
+                    return FALSE;
+                }
+                break;
+
+            case PCAPNG_BLOCK_SPB:
+                if (data_len < 4 || capture->num_links == 0)
+                {
+                    return FALSE;
+                }
+                link = capture->links;
+                caplen = CaptureRead32(block + 8, swap);
+                if (caplen > data_len - 4)
+                {
+                    caplen = (UINT32)(data_len - 4);
+                }
+                if (!CaptureAddPacket(capture, link->linktype, &link->addr,
+                        block + 12, caplen))
+                {
+                    return FALSE;
+                }
+                break;
+
+            default:
+                break;
+        }
+        offset += block_len;
+    }
+    return TRUE;
+}
+
+/*
+ * Add a pcapng interface.  An if_name of the form "IfIdx.SubIfIdx" (as
+ * written by WinDivertHelperPcapWrite()) sets the interface's packet address.
+ */
+static BOOL CaptureAddLink(PCAPTURE capture, UINT linktype,
+    const UINT8 *options, size_t options_len, BOOL swap)
+{
+    PLINKINFO link;
+    const UINT8 *value;
+    UINT16 value_len;
+    char name[32];
+    UINT if_idx, sub_if_idx;
+
+    if (capture->num_links == capture->max_links)
+    {
+        capture->max_links = (capture->max_links == 0? 16:
+            2 * capture->max_links);
+        link = (PLINKINFO)realloc(capture->links,
+            capture->max_links * sizeof(LINKINFO));
+        if (link == NULL)
+        {
+            return FALSE;
+        }
+        capture->links = link;
+    }
+    link = capture->links + capture->num_links;
+    capture->num_links++;
+
+    memset(link, 0, sizeof(LINKINFO));
+    link->linktype = linktype;
+    link->addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+    if (CaptureOption(options, options_len, swap, PCAPNG_OPT_IF_NAME, &value,
+            &value_len) && value_len < sizeof(name))
+    {
+        memcpy(name, value, value_len);
+        name[value_len] = '\0';
+        if (sscanf(name, "%u.%u", &if_idx, &sub_if_idx) == 2)
+        {
+            link->addr.IfIdx    = (UINT32)if_idx;
+            link->addr.SubIfIdx = (UINT32)sub_if_idx;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Strip the link-layer header from a packet, and add it to the capture.
+ * Packets that are not IPv4 or IPv6 are skipped.
+ */
+static BOOL CaptureAddPacket(PCAPTURE capture, UINT linktype,
+    const WINDIVERT_ADDRESS *addr, const UINT8 *data, UINT len)
+{
+    PRAWPACKET packet;
+    UINT8 *buf;
+    UINT header_len, ethertype, padded_len;
+    size_t max_data;
+    UINT8 direction = addr->Direction;
+
+    switch (linktype)
+    {
+        case LINKTYPE_RAW: case LINKTYPE_IPV4: case LINKTYPE_IPV6:
+            header_len = 0;
+            break;
+        case LINKTYPE_NULL:
+            header_len = 4;
+            break;
+        case LINKTYPE_ETHERNET:
+            header_len = 14;
+            while (header_len <= len)
+            {
+                ethertype = ntohs(CaptureRead16(data + header_len - 2, FALSE));
+                if (ethertype != ETHERTYPE_VLAN && ethertype != ETHERTYPE_QINQ)
+                {
+                    break;
+                }
+                header_len += 4;
+            }
+            break;
+        case LINKTYPE_LINUX_SLL:
+            header_len = 16;
+            if (header_len <= len)
+            {
+                direction = (ntohs(CaptureRead16(data, FALSE)) == SLL_OUTGOING?
+                    WINDIVERT_DIRECTION_OUTBOUND:
+                    WINDIVERT_DIRECTION_INBOUND);
+            }
+            break;
+        default:
+            capture->skipped++;
+            return TRUE;
+    }
+    if (header_len >= len || len - header_len > MAXBUF)
+    {
+        capture->skipped++;
+        return TRUE;
+    }
+    if (linktype == LINKTYPE_ETHERNET || linktype == LINKTYPE_LINUX_SLL)
+    {
+        ethertype = ntohs(CaptureRead16(data + header_len - 2, FALSE));
+        if (ethertype != ETHERTYPE_IPV4 && ethertype != ETHERTYPE_IPV6)
+        {
+            capture->skipped++;
+            return TRUE;
+        }
+    }
+    data += header_len;
+    len -= header_len;
+    if ((data[0] >> 4) != 4 && (data[0] >> 4) != 6)
+    {
+        capture->skipped++;
+        return TRUE;
+    }
+
+    if (capture->num_packets == capture->max_packets)
+    {
+        capture->max_packets = (capture->max_packets == 0? 1024:
+            2 * capture->max_packets);
+        packet = (PRAWPACKET)realloc(capture->packets,
+            capture->max_packets * sizeof(RAWPACKET));
+        if (packet == NULL)
+        {
+            return FALSE;
+        }
+        capture->packets = packet;
+    }
+    padded_len = (len + 7) & ~7;
+    max_data = capture->max_data;
+    while (max_data - capture->data_len < padded_len)
+    {
+        max_data = (max_data == 0? 1024*1024: 2 * max_data);
+    }
+    if (max_data != capture->max_data)
+    {
+        buf = (UINT8 *)realloc(capture->data, max_data);
+        if (buf == NULL)
+        {
+            return FALSE;
+        }
+        capture->data = buf;
+        capture->max_data = max_data;
+    }
+    packet = capture->packets + capture->num_packets;
+    capture->num_packets++;
+
+    packet->addr           = *addr;
+    packet->addr.Direction = direction;
+    packet->len            = len;
+    packet->offset         = capture->data_len;
+    packet->data           = NULL;
+    memcpy(capture->data + capture->data_len, data, len);
+    capture->data_len += padded_len;
+    return TRUE;
+}
+
+/*
+ * Find a pcapng option.
+ */
+static BOOL CaptureOption(const UINT8 *options, size_t options_len,
+    BOOL swap, UINT16 code, const UINT8 **value, UINT16 *value_len)
+{
+    UINT16 opt_code, opt_len;
+    size_t offset = 0;
+
+    while (options_len - offset >= 2 * sizeof(UINT16))
+    {
+        opt_code = CaptureRead16(options + offset, swap);
+        opt_len = CaptureRead16(options + offset + 2, swap);
+        offset += 2 * sizeof(UINT16);
+        if (opt_code == PCAPNG_OPT_END || opt_len > options_len - offset)
+        {
+            return FALSE;
+        }
+        if (opt_code == code)
+        {
+            *value = options + offset;
+            *value_len = opt_len;
+            return TRUE;
+        }
+        offset += (opt_len + 3) & ~3;
+        if (offset > options_len)
+        {
+            return FALSE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Read a (possibly byte-swapped) 16-bit value.
+ */
+static UINT16 CaptureRead16(const UINT8 *ptr, BOOL swap)
+{
+    UINT16 value;
+
+    memcpy(&value, ptr, sizeof(value));
+    return (swap? (UINT16)((value >> 8) | (value << 8)): value);
+}
+
+/*
+ * Read a (possibly byte-swapped) 32-bit value.
+ */
+static UINT32 CaptureRead32(const UINT8 *ptr, BOOL swap)
+{
+    UINT32 value;
+
+    memcpy(&value, ptr, sizeof(value));
+    if (swap)
+    {
+        value = (value >> 24) | ((value >> 8) & 0x0000FF00) |
+            ((value << 8) & 0x00FF0000) | (value << 24);
+    }
+    return value;
+}
+
+/*
+ * Convert a tick count into an average time per packet.
+ */
+static double NsPerPacket(LONGLONG ticks, LONGLONG freq, UINT num_packets,
+    UINT iterations)
+{
+    return ((double)ticks * 1.0e9 / (double)freq) /
+        ((double)num_packets * (double)iterations);
+}
@@ -0,0 +1,775 @@
+/*
+ * blacklist.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The webfilter blacklist: reading blacklist files, compiling them into a
+ * trie, writing and mapping image files, replacing the current blacklist
+ * while it is in use, and matching HTTP requests.
+ */
+
+#include <windows.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "webfilter.h"
+
+/*
+ * The current blacklist.  Readers never block a reload: each reader enters
+ * under the current epoch, and a reload only waits for readers that entered
+ * under the previous epoch to exit before freeing the old blacklist.
+ */
+static PBLACKLIST volatile blacklist_current = NULL;
+static volatile LONG blacklist_epoch = 0;
+static volatile LONG blacklist_readers[2] = {0, 0};
+
+/*
+ * Prototypes
+ */
+static UINT32 BlackListBuild(PBLACKLIST blacklist, char **keys, UINT lo,
+    UINT hi, UINT depth);
+static BOOL BlackListStep(PBLACKLIST blacklist, PTRIEPOS pos, char c);
+static UINT DomainReverse(const char *domain, UINT len, char *buf);
+static int __cdecl KeyCompare(const void *a, const void *b);
+
+/*
+ * Initialize an empty blacklist.
+ */
+extern PBLACKLIST BlackListInit(void)
+{
+    PBLACKLIST blacklist = (PBLACKLIST)malloc(sizeof(BLACKLIST));
+    if (blacklist == NULL)
+    {
+        goto memory_error;
+    }
+    memset(blacklist, 0, sizeof(BLACKLIST));
+    blacklist->size = 1024;
+    blacklist->keys = (UINT32 *)malloc(blacklist->size*sizeof(UINT32));
+    blacklist->pool_size = 64 * 1024;
+    blacklist->pool = (char *)malloc(blacklist->pool_size);
+    if (blacklist->keys == NULL || blacklist->pool == NULL)
+    {
+        goto memory_error;
+    }
+
+    return blacklist;
+
+memory_error:
+    fprintf(stderr, "error: failed to allocate memory\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Insert a key ("rev-domain/uri") into a blacklist.
+ */
+extern void BlackListInsert(PBLACKLIST blacklist, const char *key,
+    UINT len)
+{
+    if (blacklist->length >= blacklist->size)
+    {
+        blacklist->size = (blacklist->size*3) / 2;
+        blacklist->keys = (UINT32 *)realloc(blacklist->keys,
+            blacklist->size*sizeof(UINT32));
+        if (blacklist->keys == NULL)
+        {
+            goto memory_error;
+        }
+    }
+    while (blacklist->pool_length + len + 1 > blacklist->pool_size)
+    {
+        blacklist->pool_size = (blacklist->pool_size*3) / 2;
+        blacklist->pool = (char *)realloc(blacklist->pool,
+            blacklist->pool_size);
+        if (blacklist->pool == NULL)
+        {
+            goto memory_error;
+        }
+    }
+
+    blacklist->keys[blacklist->length++] = blacklist->pool_length;
+    memcpy(blacklist->pool + blacklist->pool_length, key, len);
+    blacklist->pool_length += len;
+    blacklist->pool[blacklist->pool_length++] = '\0';
+    return;
+
+memory_error:
+    fprintf(stderr, "error: failed to reallocate memory\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Compile the blacklist keys into a trie (for searching).
+ */
+extern void BlackListCompile(PBLACKLIST blacklist)
+{
+    char **keys;
+    UINT i;
+
+    keys = (char **)malloc((blacklist->length+1)*sizeof(char *));
+    if (keys == NULL)
+    {
+        goto memory_error;
+    }
+    for (i = 0; i < blacklist->length; i++)
+    {
+        keys[i] = blacklist->pool + blacklist->keys[i];
+    }
+    qsort(keys, blacklist->length, sizeof(char *), KeyCompare);
+
+    // A radix trie over n keys has at most 2n+1 nodes, and its labels are
+    // no longer than the keys themselves:
+    blacklist->nodes = (PNODE)malloc((2*blacklist->length+1)*sizeof(NODE));
+    blacklist->edges = (PEDGE)malloc((2*blacklist->length+1)*sizeof(EDGE));
+    blacklist->labels = (char *)malloc(blacklist->pool_length+1);
+    if (blacklist->nodes == NULL || blacklist->edges == NULL ||
+        blacklist->labels == NULL)
+    {
+        goto memory_error;
+    }
+    BlackListBuild(blacklist, keys, 0, blacklist->length, 0);
+
+    // The keys are no longer needed:
+    free(keys);
+    free(blacklist->keys);
+    free(blacklist->pool);
+    blacklist->keys = NULL;
+    blacklist->pool = NULL;
+    blacklist->size = blacklist->length = 0;
+    blacklist->pool_size = blacklist->pool_length = 0;
+    return;
+
+memory_error:
+    fprintf(stderr, "error: failed to allocate memory\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Build the trie node for the sorted keys [lo, hi), which share their first
+ * 'depth' chars.  Returns the node's index.
+ */
+static UINT32 BlackListBuild(PBLACKLIST blacklist, char **keys, UINT lo,
+    UINT hi, UINT depth)
+{
+    UINT32 node = blacklist->num_nodes++, edge;
+    UINT i, j, len, num_edges = 0;
+
+    blacklist->nodes[node].match = FALSE;
+    while (lo < hi && keys[lo][depth] == '\0')
+    {
+        blacklist->nodes[node].match = TRUE;
+        lo++;
+    }
+    for (i = lo; i < hi; i = j)
+    {
+        for (j = i+1; j < hi && keys[j][depth] == keys[i][depth]; j++)
+            ;
+        num_edges++;
+    }
+    edge = blacklist->num_edges;
+    blacklist->num_edges += num_edges;
+    blacklist->nodes[node].edges = edge;
+    blacklist->nodes[node].num_edges = (UINT16)num_edges;
+
+    for (i = lo; i < hi; i = j, edge++)
+    {
+        for (j = i+1; j < hi && keys[j][depth] == keys[i][depth]; j++)
+            ;
+
+        // The keys are sorted, so the common prefix of the group is the
+        // common prefix of its first and last keys:
+        for (len = depth+1; keys[i][len] != '\0' &&
+                keys[i][len] == keys[j-1][len]; len++)
+            ;
+        blacklist->edges[edge].label = blacklist->labels_len;
+        blacklist->edges[edge].label_len = (UINT16)(len - depth);
+        blacklist->edges[edge].c = keys[i][depth];
+        blacklist->edges[edge].reserved = 0;
+        memcpy(blacklist->labels + blacklist->labels_len, keys[i] + depth,
+            len - depth);
+        blacklist->labels_len += len - depth;
+        blacklist->edges[edge].child =
+            BlackListBuild(blacklist, keys, i, j, len);
+    }
+    return node;
+}
+
+/*
+ * Write a compiled blacklist to an image file.
+ */
+extern void BlackListWrite(PBLACKLIST blacklist, const char *filename)
+{
+    IMAGE_HEADER header;
+    FILE *file = fopen(filename, "wb");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: could not open image file %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic      = IMAGE_MAGIC;
+    header.version    = IMAGE_VERSION;
+    header.num_nodes  = blacklist->num_nodes;
+    header.num_edges  = blacklist->num_edges;
+    header.labels_len = blacklist->labels_len;
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(blacklist->nodes, sizeof(NODE), blacklist->num_nodes, file) !=
+            blacklist->num_nodes ||
+        fwrite(blacklist->edges, sizeof(EDGE), blacklist->num_edges, file) !=
+            blacklist->num_edges ||
+        fwrite(blacklist->labels, 1, blacklist->labels_len, file) !=
+            blacklist->labels_len ||
+        fclose(file) != 0)
+    {
+        fprintf(stderr, "error: failed to write image file %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Test if a blacklist file is an image file (rather than text).
+ */
+extern BOOL BlackListIsImage(const char *filename)
+{
+    UINT32 magic;
+    BOOL result;
+    FILE *file = fopen(filename, "rb");
+
+    if (file == NULL)
+    {
+        return FALSE;
+    }
+    result = (fread(&magic, sizeof(magic), 1, file) == 1 &&
+        magic == IMAGE_MAGIC);
+    fclose(file);
+    return result;
+}
+
+/*
+ * Map a blacklist image file, and use the trie in place.
+ */
+extern BOOL BlackListMap(PBLACKLIST blacklist, const char *filename)
+{
+    HANDLE file, mapping;
+    LARGE_INTEGER size;
+    PIMAGE_HEADER header;
+    PNODE nodes;
+    PEDGE edges;
+    UINT64 image_len;
+    UINT32 i;
+
+    // FILE_SHARE_DELETE allows a new image to be renamed over this one.
+    file = CreateFileA(filename, GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        goto open_error;
+    }
+    if (!GetFileSizeEx(file, &size) ||
+        size.QuadPart < (LONGLONG)sizeof(IMAGE_HEADER))
+    {
+        CloseHandle(file);
+        goto image_error;
+    }
+
+    // Read-only pages of the image are shared by all webfilter processes
+    // that map it.
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+    {
+        goto open_error;
+    }
+    header = (PIMAGE_HEADER)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (header == NULL)
+    {
+        CloseHandle(mapping);
+        goto open_error;
+    }
+
+    // Check the image, so that a corrupt image cannot crash the matcher:
+    image_len = sizeof(IMAGE_HEADER) +
+        (UINT64)header->num_nodes * sizeof(NODE) +
+        (UINT64)header->num_edges * sizeof(EDGE) + header->labels_len;
+    if (header->magic != IMAGE_MAGIC || header->version != IMAGE_VERSION ||
+        header->num_nodes == 0 || image_len != (UINT64)size.QuadPart)
+    {
+        goto image_unmap_error;
+    }
+    nodes = (PNODE)(header + 1);
+    edges = (PEDGE)(nodes + header->num_nodes);
+    for (i = 0; i < header->num_nodes; i++)
+    {
+        if ((UINT64)nodes[i].edges + nodes[i].num_edges > header->num_edges)
+        {
+            goto image_unmap_error;
+        }
+    }
+    for (i = 0; i < header->num_edges; i++)
+    {
+        if (edges[i].child >= header->num_nodes ||
+            edges[i].label_len == 0 ||
+            (UINT64)edges[i].label + edges[i].label_len >
+                header->labels_len)
+        {
+            goto image_unmap_error;
+        }
+    }
+
+    free(blacklist->keys);
+    free(blacklist->pool);
+    blacklist->keys       = NULL;
+    blacklist->pool       = NULL;
+    blacklist->num_nodes  = header->num_nodes;
+    blacklist->num_edges  = header->num_edges;
+    blacklist->labels_len = header->labels_len;
+    blacklist->nodes      = nodes;
+    blacklist->edges      = edges;
+    blacklist->labels     = (char *)(edges + header->num_edges);
+    blacklist->mapping    = mapping;
+    blacklist->view       = (PVOID)header;
+    return TRUE;
+
+open_error:
+    fprintf(stderr, "error: could not map image file %s (%d)\n", filename,
+        GetLastError());
+    return FALSE;
+
+image_unmap_error:
+    UnmapViewOfFile(header);
+    CloseHandle(mapping);
+image_error:
+    fprintf(stderr, "error: invalid image file %s\n", filename);
+    return FALSE;
+}
+
+/*
+ * Load a blacklist from text files (or a single image file).  Returns NULL
+ * on error.
+ */
+extern PBLACKLIST BlackListLoad(UINT num_files, char **files)
+{
+    PBLACKLIST blacklist = BlackListInit();
+    UINT i;
+
+    if (num_files == 1 && BlackListIsImage(files[0]))
+    {
+        if (!BlackListMap(blacklist, files[0]))
+        {
+            BlackListFree(blacklist);
+            return NULL;
+        }
+        return blacklist;
+    }
+    for (i = 0; i < num_files; i++)
+    {
+        if (!BlackListRead(blacklist, files[i]))
+        {
+            BlackListFree(blacklist);
+            return NULL;
+        }
+    }
+    BlackListCompile(blacklist);
+    return blacklist;
+}
+
+/*
+ * Free a blacklist.
+ */
+extern void BlackListFree(PBLACKLIST blacklist)
+{
+    if (blacklist->view != NULL)
+    {
+        UnmapViewOfFile(blacklist->view);
+        CloseHandle(blacklist->mapping);
+    }
+    else
+    {
+        free(blacklist->nodes);
+        free(blacklist->edges);
+        free(blacklist->labels);
+    }
+    free(blacklist->keys);
+    free(blacklist->pool);
+    free(blacklist);
+}
+
+/*
+ * Print the size of a compiled blacklist.
+ */
+extern void BlackListPrint(PBLACKLIST blacklist)
+{
+    printf("BLACKLIST %u nodes, %u edges, %u bytes%s\n",
+        blacklist->num_nodes, blacklist->num_edges,
+        (UINT)(blacklist->num_nodes*sizeof(NODE) +
+        blacklist->num_edges*sizeof(EDGE) + blacklist->labels_len),
+        (blacklist->view != NULL? " (mapped)": ""));
+}
+
+/*
+ * Start using the current blacklist.
+ */
+extern PBLACKLIST BlackListEnter(LONG *epoch_ptr)
+{
+    LONG epoch;
+
+    while (TRUE)
+    {
+        epoch = blacklist_epoch;
+        InterlockedIncrement(&blacklist_readers[epoch & 1]);
+        if (epoch == blacklist_epoch)
+        {
+            // Any reload from now on will wait for us.
+            *epoch_ptr = epoch;
+            return blacklist_current;
+        }
+
+        // Raced with a reload; it may not wait for us, so retry.
+        InterlockedDecrement(&blacklist_readers[epoch & 1]);
+    }
+}
+
+/*
+ * Stop using the blacklist returned by BlackListEnter().
+ */
+extern void BlackListExit(LONG epoch)
+{
+    InterlockedDecrement(&blacklist_readers[epoch & 1]);
+}
+
+/*
+ * Publish a new blacklist, and wait until no reader is still using the old
+ * blacklist (which is returned).
+ */
+extern PBLACKLIST BlackListSwap(PBLACKLIST blacklist)
+{
+    PBLACKLIST old_blacklist;
+    LONG epoch;
+
+    old_blacklist = (PBLACKLIST)InterlockedExchangePointer(
+        (PVOID volatile *)&blacklist_current, (PVOID)blacklist);
+    epoch = InterlockedIncrement(&blacklist_epoch) - 1;
+    while (blacklist_readers[epoch & 1] != 0)
+    {
+        SwitchToThread();
+    }
+    return old_blacklist;
+}
+
+/*
+ * Advance a position in the trie by one char.
+ */
+static BOOL BlackListStep(PBLACKLIST blacklist, PTRIEPOS pos, char c)
+{
+    PNODE node;
+    PEDGE edge;
+    int lo, hi, mid;
+
+    if (pos->off == 0)
+    {
+        // At a node; find the edge (sorted by first char):
+        node = blacklist->nodes + pos->node;
+        lo = 0;
+        hi = (int)node->num_edges-1;
+        while (TRUE)
+        {
+            if (lo > hi)
+            {
+                return FALSE;
+            }
+            mid = (lo + hi) / 2;
+            edge = blacklist->edges + node->edges + mid;
+            if (edge->c == c)
+            {
+                break;
+            }
+            if ((UINT8)edge->c < (UINT8)c)
+            {
+                lo = mid+1;
+            }
+            else
+            {
+                hi = mid-1;
+            }
+        }
+        pos->edge = node->edges + mid;
+    }
+    else
+    {
+        edge = blacklist->edges + pos->edge;
+        if (blacklist->labels[edge->label + pos->off] != c)
+        {
+            return FALSE;
+        }
+    }
+    pos->off++;
+    if (pos->off == edge->label_len)
+    {
+        pos->node = edge->child;
+        pos->off = 0;
+    }
+    return TRUE;
+}
+
+/*
+ * Match a URL against the blacklist.  A blacklist entry matches if its
+ * domain is the URL's domain or a parent domain, and its uri is a prefix of
+ * the URL's uri.
+ */
+extern BOOL BlackListMatch(PBLACKLIST blacklist, PURL url)
+{
+    char domain[MAXURL+1];
+    TRIEPOS pos, upos;
+    UINT i, j, len;
+
+    if (blacklist->num_nodes == 0)
+    {
+        return FALSE;
+    }
+    len = DomainReverse(url->domain, (UINT)strlen(url->domain), domain);
+    pos.node = 0;
+    pos.off  = 0;
+    for (i = 0; ; i++)
+    {
+        if (i == len || domain[i] == '.')
+        {
+            // End of a label; try the entries for this domain:
+            upos = pos;
+            if (BlackListStep(blacklist, &upos, '/'))
+            {
+                for (j = 0; ; j++)
+                {
+                    if (upos.off == 0 && blacklist->nodes[upos.node].match)
+                    {
+                        return TRUE;
+                    }
+                    if (url->uri[j] == '\0' ||
+                        !BlackListStep(blacklist, &upos, url->uri[j]))
+                    {
+                        break;
+                    }
+                }
+            }
+            if (i == len)
+            {
+                return FALSE;
+            }
+        }
+        if (!BlackListStep(blacklist, &pos, domain[i]))
+        {
+            return FALSE;
+        }
+    }
+}
+
+/*
+ * Reverse the labels of a (lower-cased) domain, e.g. "www.Example.com"
+ * becomes "com.example.www".  Returns the length.
+ */
+static UINT DomainReverse(const char *domain, UINT len, char *buf)
+{
+    UINT start, end = len, i, k = 0;
+
+    while (TRUE)
+    {
+        for (start = end; start > 0 && domain[start-1] != '.'; start--)
+            ;
+        for (i = start; i < end; i++)
+        {
+            buf[k++] = (char)tolower((UINT8)domain[i]);
+        }
+        if (start == 0)
+        {
+            break;
+        }
+        buf[k++] = '.';
+        end = start-1;
+    }
+    buf[k] = '\0';
+    return k;
+}
+
+/*
+ * Read URLs from a file.
+ */
+extern BOOL BlackListRead(PBLACKLIST blacklist, const char *filename)
+{
+    char domain[MAXURL+1];
+    char uri[MAXURL+1];
+    char key[MAXKEY];
+    int c;
+    UINT16 i, j;
+    UINT len;
+    FILE *file = fopen(filename, "r");
+    
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: could not open blacklist file %s\n",
+            filename);
+        return FALSE;
+    }
+
+    // Read URLs from the file and add them to the blacklist: 
+    while (TRUE)
+    {
+        while (isspace(c = getc(file)))
+            ;
+        if (c == EOF)
+        {
+            break;
+        }
+        if (c != '-' && !isalnum(c))
+        {
+            while (!isspace(c = getc(file)) && c != EOF)
+                ;
+            if (c == EOF)
+            {
+                break;
+            }
+            continue;
+        }
+        i = 0;
+        domain[i++] = (char)c;
+        while ((isalnum(c = getc(file)) || c == '-' || c == '.') && i < MAXURL)
+        {
+            domain[i++] = (char)c;
+        }
+        domain[i] = '\0';
+        j = 0;
+        if (c == '/')
+        {
+            while (!isspace(c = getc(file)) && c != EOF && j < MAXURL)
+            {
+                uri[j++] = (char)c;
+            }
+            uri[j] = '\0';
+        }
+        else if (isspace(c))
+        {
+            uri[j] = '\0';
+        }
+        else
+        {
+            while (!isspace(c = getc(file)) && c != EOF)
+                ;
+            continue;
+        }
+
+        len = DomainReverse(domain, i, key);
+        key[len++] = '/';
+        memcpy(key + len, uri, j);
+        len += j;
+        BlackListInsert(blacklist, key, len);
+    }
+
+    fclose(file);
+    return TRUE;
+}
+
+/*
+ * Attempt to parse a URL and match it with the blacklist.  The data is the
+ * start of a (reassembled) request; 'more' is set if the request line and
+ * Host header are not complete yet.  The URL is returned in 'url' (whose
+ * domain and uri buffers hold MAXURL chars each); its domain is empty if no
+ * URL was found.
+ *
+ * BUG:
+ * - This function makes several assumptions about HTTP requests, such as:
+ *      1) The HTTP request begins at a packet boundary;
+ *      2) The Host header immediately follows the GET/POST line.
+ *   Some browsers, such as Internet Explorer, violate these assumptions
+ *   and therefore matching will not work.
+ */
+extern BOOL BlackListPayloadMatch(PBLACKLIST blacklist, char *data,
+    UINT len, PURL url, BOOL *more)
+{
+    static const char get_str[] = "GET /";
+    static const char post_str[] = "POST /";
+    static const char http_host_str[] = " HTTP/1.1\r\nHost: ";
+    char *domain = url->domain;
+    char *uri = url->uri;
+    UINT i = 0, j;
+
+    *more = FALSE;
+    domain[0] = '\0';
+    if (len >= sizeof(get_str)-1 &&
+        strncmp(data, get_str, sizeof(get_str)-1) == 0)
+    {
+        i += sizeof(get_str)-1;
+    }
+    else if (len >= sizeof(post_str)-1 &&
+             strncmp(data, post_str, sizeof(post_str)-1) == 0)
+    {
+        i += sizeof(post_str)-1;
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    for (j = 0; i < len && data[i] != ' ' && j < MAXURL-1; j++, i++)
+    {
+        uri[j] = data[i];
+    }
+    uri[j] = '\0';
+    if (i + sizeof(http_host_str)-1 >= len)
+    {
+        // Wait for the rest of the Host header, unless it cannot match:
+        *more = (memcmp(data+i, http_host_str, len-i) == 0);
+        return FALSE;
+    }
+
+    if (strncmp(data+i, http_host_str, sizeof(http_host_str)-1) != 0)
+    {
+        return FALSE;
+    }
+    i += sizeof(http_host_str)-1;
+
+    for (j = 0; i < len && data[i] != '\r' && j < MAXURL-1; j++, i++)
+    {
+        domain[j] = data[i];
+    }
+    if (i >= len)
+    {
+        *more = TRUE;
+        j = 0;
+    }
+    if (j > 0 && domain[j-1] == '.')
+    {
+        // Nice try...
+        j--;
+    }
+    domain[j] = '\0';
+    if (j == 0)
+    {
+        return FALSE;
+    }
+
+    // Search the blacklist:
+    return BlackListMatch(blacklist, url);
+}
+
+/*
+ * Key comparison.
+ */
+static int __cdecl KeyCompare(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
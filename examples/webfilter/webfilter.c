@@ -24,6 +24,20 @@
  * the URL against a blacklist.  If the URL is matched, we hijack the TCP
  * connection, reseting the connection at the server end, and sending a
  * blockpage to the browser.
+ *
+ * Large blacklists can be compiled ahead of time into an image file:
+ *      webfilter --compile blacklist.img blacklist.txt [...]
+ * which webfilter maps into memory and uses in place:
+ *      webfilter blacklist.img
+ *
+ * Packets are spread over a number of worker threads by flow (--threads),
+ * each of which keeps a number of reads outstanding (--depth).  A request
+ * that spans several packets is reassembled (per connection) before it is
+ * matched.
+ *
+ * The blacklist files are reloaded whenever they change, without
+ * interrupting the filtering of traffic.  To replace an image file, compile
+ * to a new file and rename it over the old one.
  */
 
 #include <winsock2.h>
@@ -32,137 +46,135 @@
 #include <stdlib.h>
 
 #include "windivert.h"
+#include "webfilter.h"
 
-#define MAXBUF 0xFFFF
-#define MAXURL 4096
+#define RELOAD_INTERVAL 1000    // Blacklist reload check interval (ms).
+#define MAXTHREADS 64
+#define MAXDEPTH 64
 
 /*
- * URL and blacklist representation.
+ * Blacklist files to watch for changes.
  */
 typedef struct
 {
-    char *domain;
-    char *uri;
-} URL, *PURL;
-typedef struct
-{
-    UINT size;
-    UINT length;
-    PURL *urls;
-} BLACKLIST, *PBLACKLIST;
+    UINT num_files;
+    char **files;
+    FILETIME *times;            // Last write times.
+} RELOAD, *PRELOAD;
 
-/*
- * Pre-fabricated packets.
- */
-typedef struct
-{
-    WINDIVERT_IPHDR  ip;
-    WINDIVERT_TCPHDR tcp;
-} PACKET, *PPACKET;
-typedef struct 
-{
-    PACKET header;
-    UINT8 data[];
-} DATAPACKET, *PDATAPACKET;
-
-/*
- * THe block page contents.
- */
-const char block_data[] =
-    "HTTP/1.1 200 OK\r\n"
-    "Connection: close\r\n"
-    "Content-Type: text/html\r\n"
-    "\r\n"
-    "<!doctype html>\n"
-    "<html>\n"
-    "\t<head>\n"
-    "\t\t<title>BLOCKED!</title>\n"
-    "\t</head>\n"
-    "\t<body>\n"
-    "\t\t<h1>BLOCKED!</h1>\n"
-    "\t\t<hr>\n"
-    "\t\t<p>This URL has been blocked!</p>\n"
-    "\t</body>\n"
-    "</html>\n";
+static WORKER workers[MAXTHREADS];
 
 /*
  * Prototypes
  */
-static void PacketInit(PPACKET packet);
-static int __cdecl UrlCompare(const void *a, const void *b);
-static int UrlMatch(PURL urla, PURL urlb);
-static PBLACKLIST BlackListInit(void);
-static void BlackListInsert(PBLACKLIST blacklist, PURL url);
-static void BlackListSort(PBLACKLIST blacklist);
-static BOOL BlackListMatch(PBLACKLIST blacklist, PURL url);
-static void BlackListRead(PBLACKLIST blacklist, const char *filename);
-static BOOL BlackListPayloadMatch(PBLACKLIST blacklist, char *data,
-    UINT16 len);
+static BOOL ReloadCheck(PRELOAD reload);
+static DWORD WINAPI ReloadThread(LPVOID arg);
 
 /*
  * Entry.
  */
 int __cdecl main(int argc, char **argv)
 {
-    HANDLE handle;
-    WINDIVERT_ADDRESS addr;
-    UINT8 packet[MAXBUF];
-    UINT packet_len;
-    PWINDIVERT_IPHDR ip_header;
-    PWINDIVERT_TCPHDR tcp_header;
-    PVOID payload;
-    UINT payload_len;
-    PACKET reset0;
-    PPACKET reset = &reset0;
-    PACKET finish0;
-    PPACKET finish = &finish0;
-    PDATAPACKET blockpage;
-    UINT16 blockpage_len;
+    HANDLE handle, thread;
     PBLACKLIST blacklist;
+    RELOAD reload;
+    SYSTEM_INFO info;
+    UINT num_threads, depth;
     unsigned i;
     INT16 priority = 404;       // Arbitrary.
 
+    // Parse the options:
+    GetSystemInfo(&info);
+    num_threads = info.dwNumberOfProcessors;
+    num_threads = (num_threads > MAXTHREADS? MAXTHREADS: num_threads);
+    depth = 4;
+    for (i = 1; i + 1 < (UINT)argc; i += 2)
+    {
+        if (strcmp(argv[i], "--threads") == 0)
+        {
+            num_threads = (UINT)atoi(argv[i+1]);
+        }
+        else if (strcmp(argv[i], "--depth") == 0)
+        {
+            depth = (UINT)atoi(argv[i+1]);
+        }
+        else
+        {
+            break;
+        }
+    }
+    argv[i-1] = argv[0];
+    argc -= i - 1;
+    argv += i - 1;
+    if (num_threads < 1 || num_threads > MAXTHREADS || depth < 1 ||
+        depth > MAXDEPTH)
+    {
+        fprintf(stderr, "error: invalid number of threads or depth\n");
+        exit(EXIT_FAILURE);
+    }
+
     // Read the blacklists.
-    if (argc <= 1)
+    if (argc <= 1 || (strcmp(argv[1], "--compile") == 0 && argc <= 3))
     {
-        fprintf(stderr, "usage: %s blacklist.txt [blacklist2.txt ...]\n",
-            argv[0]);
+        fprintf(stderr, "usage: %s [--threads N] [--depth N] blacklist.txt "
+            "[blacklist2.txt ...]\n"
+            "       %s [--threads N] [--depth N] blacklist.img\n"
+            "       %s --compile blacklist.img blacklist.txt "
+            "[blacklist2.txt ...]\n", argv[0], argv[0], argv[0]);
         exit(EXIT_FAILURE);
     }
-    blacklist = BlackListInit();
-    for (i = 1; i < (UINT)argc; i++)
+    if (strcmp(argv[1], "--compile") == 0)
     {
-        BlackListRead(blacklist, argv[i]);
+        blacklist = BlackListInit();
+        for (i = 3; i < (UINT)argc; i++)
+        {
+            if (!BlackListRead(blacklist, argv[i]))
+            {
+                exit(EXIT_FAILURE);
+            }
+        }
+        BlackListCompile(blacklist);
+        BlackListPrint(blacklist);
+        BlackListWrite(blacklist, argv[2]);
+        printf("WROTE %s\n", argv[2]);
+        return 0;
     }
-    BlackListSort(blacklist);
-
-    // Initialize the pre-frabricated packets:
-    blockpage_len = sizeof(DATAPACKET)+sizeof(block_data)-1;
-    blockpage = (PDATAPACKET)malloc(blockpage_len);
-    if (blockpage == NULL)
+    reload.num_files = (UINT)argc - 1;
+    reload.files = argv + 1;
+    reload.times = (FILETIME *)calloc(reload.num_files, sizeof(FILETIME));
+    if (reload.times == NULL)
     {
         fprintf(stderr, "error: memory allocation failed\n");
         exit(EXIT_FAILURE);
     }
-    PacketInit(&blockpage->header);
-    blockpage->header.ip.Length   = htons(blockpage_len);
-    blockpage->header.tcp.SrcPort = htons(80);
-    blockpage->header.tcp.Psh     = 1;
-    blockpage->header.tcp.Ack     = 1;
-    memcpy(blockpage->data, block_data, sizeof(block_data)-1);
-    PacketInit(reset);
-    reset->tcp.Rst = 1;
-    reset->tcp.Ack = 1;
-    PacketInit(finish);
-    finish->tcp.Fin = 1;
-    finish->tcp.Ack = 1;
+    ReloadCheck(&reload);
+    blacklist = BlackListLoad(reload.num_files, reload.files);
+    if (blacklist == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+    BlackListPrint(blacklist);
+    BlackListSwap(blacklist);
+    thread = CreateThread(NULL, 0, ReloadThread, (LPVOID)&reload, 0, NULL);
+    if (thread == NULL)
+    {
+        fprintf(stderr, "error: failed to start reload thread (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    if (!LogStart())
+    {
+        fprintf(stderr, "error: failed to start log thread (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
 
     // Open the Divert device:
     handle = WinDivertOpen(
             "outbound && "              // Outbound traffic only
             "ip && "                    // Only IPv4 supported
             "tcp.DstPort == 80 && "     // HTTP (port 80) only
-            "tcp.PayloadLength > 0",    // TCP data packets only
+            "tcp.PayloadLength > 0",    // Requests may span packets
             WINDIVERT_LAYER_NETWORK, priority, 0
         );
     if (handle == INVALID_HANDLE_VALUE)
@@ -171,434 +183,91 @@ int __cdecl main(int argc, char **argv)
             GetLastError());
         exit(EXIT_FAILURE);
     }
-    printf("OPENED WinDivert\n");
 
-    // Main loop:
-    while (TRUE)
+    // One queue per worker, so that the workers do not contend for packets,
+    // and all packets of a connection are handled in order by one worker:
+    if (!WinDivertSetParam(handle, WINDIVERT_PARAM_QUEUE_COUNT,
+            (UINT64)num_threads))
     {
-        if (!WinDivertRecv(handle, packet, sizeof(packet), &addr, &packet_len))
-        {
-            fprintf(stderr, "warning: failed to read packet (%d)\n",
-                GetLastError());
-            continue;
-        }
-
-        if (!WinDivertHelperParsePacket(packet, packet_len, &ip_header, NULL,
-                NULL, NULL, &tcp_header, NULL, &payload, &payload_len) ||
-            !BlackListPayloadMatch(blacklist, payload, (UINT16)payload_len))
-        {
-            // Packet does not match the blacklist; simply reinject it.
-            if (!WinDivertSend(handle, packet, packet_len, &addr, NULL))
-            {
-                fprintf(stderr, "warning: failed to reinject packet (%d)\n",
-                    GetLastError());
-            }
-            continue;
-        }
-
-        // The URL matched the blacklist; we block it by hijacking the TCP
-        // connection.
-
-        // (1) Send a TCP RST to the server; immediately closing the
-        //     connection at the server's end.
-        reset->ip.SrcAddr       = ip_header->SrcAddr;
-        reset->ip.DstAddr       = ip_header->DstAddr;
-        reset->tcp.SrcPort      = tcp_header->SrcPort;
-        reset->tcp.DstPort      = htons(80);
-        reset->tcp.SeqNum       = tcp_header->SeqNum;
-        reset->tcp.AckNum       = tcp_header->AckNum;
-        WinDivertHelperCalcChecksums((PVOID)reset, sizeof(PACKET), 0);
-        if (!WinDivertSend(handle, (PVOID)reset, sizeof(PACKET), &addr, NULL))
-        {
-            fprintf(stderr, "warning: failed to send reset packet (%d)\n",
-                GetLastError());
-        }
-
-        // (2) Send the blockpage to the browser:
-        blockpage->header.ip.SrcAddr       = ip_header->DstAddr;
-        blockpage->header.ip.DstAddr       = ip_header->SrcAddr;
-        blockpage->header.tcp.DstPort      = tcp_header->SrcPort;
-        blockpage->header.tcp.SeqNum       = tcp_header->AckNum;
-        blockpage->header.tcp.AckNum       =
-            htonl(ntohl(tcp_header->SeqNum) + payload_len);
-        WinDivertHelperCalcChecksums((PVOID)blockpage, blockpage_len, 0);
-        addr.Direction = !addr.Direction;     // Reverse direction.
-        if (!WinDivertSend(handle, (PVOID)blockpage, blockpage_len, &addr,
-                NULL))
-        {
-            fprintf(stderr, "warning: failed to send block page packet (%d)\n",
-                GetLastError());
-        }
-
-        // (3) Send a TCP FIN to the browser; closing the connection at the 
-        //     browser's end.
-        finish->ip.SrcAddr       = ip_header->DstAddr;
-        finish->ip.DstAddr       = ip_header->SrcAddr;
-        finish->tcp.SrcPort      = htons(80);
-        finish->tcp.DstPort      = tcp_header->SrcPort;
-        finish->tcp.SeqNum       =
-            htonl(ntohl(tcp_header->AckNum) + sizeof(block_data) - 1); 
-        finish->tcp.AckNum       =
-            htonl(ntohl(tcp_header->SeqNum) + payload_len);
-        WinDivertHelperCalcChecksums((PVOID)finish, sizeof(PACKET), 0);
-        if (!WinDivertSend(handle, (PVOID)finish, sizeof(PACKET), &addr, NULL))
-        {
-            fprintf(stderr, "warning: failed to send finish packet (%d)\n",
-                GetLastError());
-        }
+        fprintf(stderr, "error: failed to set the queue count (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
     }
-}
-
-/*
- * Initialize a PACKET.
- */
-static void PacketInit(PPACKET packet)
-{
-    memset(packet, 0, sizeof(PACKET));
-    packet->ip.Version = 4;
-    packet->ip.HdrLength = sizeof(WINDIVERT_IPHDR) / sizeof(UINT32);
-    packet->ip.Length = htons(sizeof(PACKET));
-    packet->ip.TTL = 64;
-    packet->ip.Protocol = IPPROTO_TCP;
-    packet->tcp.HdrLength = sizeof(WINDIVERT_TCPHDR) / sizeof(UINT32);
-}
+    printf("OPENED WinDivert (%u threads, depth %u)\n", num_threads, depth);
 
-/*
- * Initialize an empty blacklist.
- */
-static PBLACKLIST BlackListInit(void)
-{
-    PBLACKLIST blacklist = (PBLACKLIST)malloc(sizeof(BLACKLIST));
-    UINT size;
-    if (blacklist == NULL)
+    // Start the workers:
+    for (i = 0; i < num_threads; i++)
     {
-        goto memory_error;
+        WorkerInit(&workers[i], handle, i, depth);
     }
-    size = 1024;
-    blacklist->urls = (PURL *)malloc(size*sizeof(PURL));
-    if (blacklist->urls == NULL)
+    for (i = 1; i < num_threads; i++)
     {
-        goto memory_error;
-    }
-    blacklist->size = size;
-    blacklist->length = 0;
-
-    return blacklist;
-
-memory_error:
-    fprintf(stderr, "error: failed to allocate memory\n");
-    exit(EXIT_FAILURE);
-}
-
-/*
- * Insert a URL into a blacklist.
- */
-static void BlackListInsert(PBLACKLIST blacklist, PURL url)
-{
-    if (blacklist->length >= blacklist->size)
-    {
-        blacklist->size = (blacklist->size*3) / 2;
-        printf("GROW blacklist to %u\n", blacklist->size);
-        blacklist->urls = (PURL *)realloc(blacklist->urls,
-            blacklist->size*sizeof(PURL));
-        if (blacklist->urls == NULL)
+        thread = CreateThread(NULL, 0, WorkerThread, (LPVOID)&workers[i], 0,
+            NULL);
+        if (thread == NULL)
         {
-            fprintf(stderr, "error: failed to reallocate memory\n");
+            fprintf(stderr, "error: failed to start worker thread (%d)\n",
+                GetLastError());
             exit(EXIT_FAILURE);
         }
     }
 
-    blacklist->urls[blacklist->length++] = url;
-}
+    // Main thread:
+    WorkerThread((LPVOID)&workers[0]);
 
-/*
- * Sort the blacklist (for searching).
- */
-static void BlackListSort(PBLACKLIST blacklist)
-{
-    qsort(blacklist->urls, blacklist->length, sizeof(PURL), UrlCompare);
+    return 0;
 }
 
 /*
- * Match a URL against the blacklist.
+ * Update the last write times of the blacklist files; returns TRUE if any
+ * file has changed.
  */
-static BOOL BlackListMatch(PBLACKLIST blacklist, PURL url)
+static BOOL ReloadCheck(PRELOAD reload)
 {
-    int lo = 0, hi = ((int)blacklist->length)-1;
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    BOOL changed = FALSE;
+    UINT i;
 
-    while (lo <= hi)
+    for (i = 0; i < reload->num_files; i++)
     {
-        INT mid = (lo + hi) / 2;
-        int cmp = UrlMatch(url, blacklist->urls[mid]);
-        if (cmp > 0)
-        {
-            hi = mid-1;
-        }
-        else if (cmp < 0)
+        if (!GetFileAttributesExA(reload->files[i], GetFileExInfoStandard,
+                &data))
         {
-            lo = mid+1;
+            continue;
         }
-        else
+        if (CompareFileTime(&data.ftLastWriteTime, &reload->times[i]) != 0)
         {
-            return TRUE;
+            reload->times[i] = data.ftLastWriteTime;
+            changed = TRUE;
         }
     }
-    return FALSE;
+    return changed;
 }
 
-
 /*
- * Read URLs from a file.
+ * Reload the blacklist whenever the blacklist files change.  The old
+ * blacklist stays in use if the new one fails to load.
  */
-static void BlackListRead(PBLACKLIST blacklist, const char *filename)
+static DWORD WINAPI ReloadThread(LPVOID arg)
 {
-    char domain[MAXURL+1];
-    char uri[MAXURL+1];
-    int c;
-    UINT16 i, j;
-    PURL url;
-    FILE *file = fopen(filename, "r");
-    
-    if (file == NULL)
-    {
-        fprintf(stderr, "error: could not open blacklist file %s\n",
-            filename);
-        exit(EXIT_FAILURE);
-    }
+    PRELOAD reload = (PRELOAD)arg;
+    PBLACKLIST blacklist;
 
-    // Read URLs from the file and add them to the blacklist: 
     while (TRUE)
     {
-        while (isspace(c = getc(file)))
-            ;
-        if (c == EOF)
-        {
-            break;
-        }
-        if (c != '-' && !isalnum(c))
+        Sleep(RELOAD_INTERVAL);
+        if (!ReloadCheck(reload))
         {
-            while (!isspace(c = getc(file)) && c != EOF)
-                ;
-            if (c == EOF)
-            {
-                break;
-            }
             continue;
         }
-        i = 0;
-        domain[i++] = (char)c;
-        while ((isalnum(c = getc(file)) || c == '-' || c == '.') && i < MAXURL)
-        {
-            domain[i++] = (char)c;
-        }
-        domain[i] = '\0';
-        j = 0;
-        if (c == '/')
+        blacklist = BlackListLoad(reload->num_files, reload->files);
+        if (blacklist == NULL)
         {
-            while (!isspace(c = getc(file)) && c != EOF && j < MAXURL)
-            {
-                uri[j++] = (char)c;
-            }
-            uri[j] = '\0';
-        }
-        else if (isspace(c))
-        {
-            uri[j] = '\0';
-        }
-        else
-        {
-            while (!isspace(c = getc(file)) && c != EOF)
-                ;
+            fprintf(stderr, "warning: failed to reload blacklist\n");
             continue;
         }
-
-        printf("ADD %s/%s\n", domain, uri);
-
-        url = (PURL)malloc(sizeof(URL));
-        if (url == NULL)
-        {
-            goto memory_error;
-        }
-        url->domain = (char *)malloc((i+1)*sizeof(char));
-        url->uri    = (char *)malloc((j+1)*sizeof(char));
-        if (url->domain == NULL || url->uri == NULL)
-        {
-            goto memory_error;
-        }
-        strcpy(url->uri, uri);
-        for (j = 0; j < i; j++)
-        {
-            url->domain[j] = domain[i-j-1];
-        }
-        url->domain[j] = '\0';
-
-        BlackListInsert(blacklist, url);
-    }
-
-    fclose(file);
-    return;
-
-memory_error:
-    fprintf(stderr, "error: memory allocation failed\n");
-    exit(EXIT_FAILURE);
-}
-
-/*
- * Attempt to parse a URL and match it with the blacklist.
- *
- * BUG:
- * - This function makes several assumptions about HTTP requests, such as:
- *      1) The URL will be contained within one packet;
- *      2) The HTTP request begins at a packet boundary;
- *      3) The Host header immediately follows the GET/POST line.
- *   Some browsers, such as Internet Explorer, violate these assumptions
- *   and therefore matching will not work.
- */
-static BOOL BlackListPayloadMatch(PBLACKLIST blacklist, char *data, UINT16 len)
-{
-    static const char get_str[] = "GET /";
-    static const char post_str[] = "POST /";
-    static const char http_host_str[] = " HTTP/1.1\r\nHost: ";
-    char domain[MAXURL];
-    char uri[MAXURL];
-    URL url = {domain, uri};
-    UINT16 i = 0, j;
-    BOOL result;
-    HANDLE console;
-
-    if (len <= sizeof(post_str) + sizeof(http_host_str))
-    {
-        return FALSE;
+        BlackListFree(BlackListSwap(blacklist));
+        printf("RELOADED blacklist\n");
     }
-    if (strncmp(data, get_str, sizeof(get_str)-1) == 0)
-    {
-        i += sizeof(get_str)-1;
-    }
-    else if (strncmp(data, post_str, sizeof(post_str)-1) == 0)
-    {
-        i += sizeof(post_str)-1;
-    }
-    else
-    {
-        return FALSE;
-    }
-
-    for (j = 0; i < len && data[i] != ' '; j++, i++)
-    {
-        uri[j] = data[i];
-    }
-    uri[j] = '\0';
-    if (i + sizeof(http_host_str)-1 >= len)
-    {
-        return FALSE;
-    }
-
-    if (strncmp(data+i, http_host_str, sizeof(http_host_str)-1) != 0)
-    {
-        return FALSE;
-    }
-    i += sizeof(http_host_str)-1;
-
-    for (j = 0; i < len && data[i] != '\r'; j++, i++)
-    {
-        domain[j] = data[i];
-    }
-    if (i >= len)
-    {
-        return FALSE;
-    }
-    if (j == 0)
-    {
-        return FALSE;
-    }
-    if (domain[j-1] == '.')
-    {
-        // Nice try...
-        j--;
-        if (j == 0)
-        {
-            return FALSE;
-        }
-    }
-    domain[j] = '\0';
-
-    printf("URL %s/%s: ", domain, uri);
-
-    // Reverse the domain:
-    for (i = 0; i < j / 2; i++)
-    {
-        char t = domain[i];
-        domain[i] = domain[j-i-1];
-        domain[j-i-1] = t;
-    }
-
-    // Search the blacklist:
-    result = BlackListMatch(blacklist, &url);
-    
-    // Print the verdict:
-    console = GetStdHandle(STD_OUTPUT_HANDLE);
-    if (result)
-    {
-        SetConsoleTextAttribute(console, FOREGROUND_RED);
-        puts("BLOCKED!");
-    }
-    else
-    {
-        SetConsoleTextAttribute(console, FOREGROUND_GREEN);
-        puts("allowed");
-    }
-    SetConsoleTextAttribute(console,
-        FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
-    return result;
-}
-
-/*
- * URL comparison.
- */
-static int __cdecl UrlCompare(const void *a, const void *b)
-{
-    PURL urla = *(PURL *)a;
-    PURL urlb = *(PURL *)b;
-    int cmp = strcmp(urla->domain, urlb->domain);
-    if (cmp != 0)
-    {
-        return cmp;
-    }
-    return strcmp(urla->uri, urlb->uri);
-}
-
-/*
- * URL matching
- */
-static int UrlMatch(PURL urla, PURL urlb)
-{
-    UINT16 i;
-
-    for (i = 0; urla->domain[i] && urlb->domain[i]; i++)
-    {
-        int cmp = (int)urlb->domain[i] - (int)urla->domain[i];
-        if (cmp != 0)
-        {
-            return cmp;
-        }
-    }
-    if (urla->domain[i] == '\0' && urlb->domain[i] != '\0')
-    {
-        return 1;
-    }
-
-    for (i = 0; urla->uri[i] && urlb->uri[i]; i++)
-    {
-        int cmp = (int)urlb->uri[i] - (int)urla->uri[i];
-        if (cmp != 0)
-        {
-            return cmp;
-        }
-    }
-    if (urla->uri[i] == '\0' && urlb->uri[i] != '\0')
-    {
-        return 1;
-    }
-    return 0;
 }
 
@@ -0,0 +1,189 @@
+/*
+ * webfilter.h
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Definitions shared by the parts of the webfilter example:
+ *  - blacklist.c: the blacklist (a compiled trie, read from text files or
+ *    mapped from an image file) and the HTTP request matcher.
+ *  - worker.c: the worker threads, which filter packets, and the URL log.
+ *  - webfilter.c: the program itself (options, reloading the blacklist,
+ *    and starting the threads).
+ * blacklist.c and worker.c can also be built on a POSIX host, against the
+ * DLL and a Win32 shim, for testing (see test/).
+ */
+
+#ifndef __WEBFILTER_H
+#define __WEBFILTER_H
+
+#include <windows.h>
+
+#include "windivert.h"
+
+#define MAXURL 4096
+#define MAXKEY (2*MAXURL+2)
+#define MAXBUF 0xFFFF
+#define MAXREQUESTS 64          // Partial requests tracked per worker.
+#define REQUEST_WINDOW (2*MAXURL+64)    // Max request line + Host bytes.
+
+/*
+ * URL and blacklist representation.
+ *
+ * Each blacklist entry "domain/uri" is stored as the key "rev-domain/uri",
+ * where rev-domain is the domain with its labels reversed, e.g.
+ * "www.example.com/ads" becomes "com.example.www/ads".  The keys are
+ * compiled into a compressed (radix) trie made of flat arrays, so that a
+ * URL is matched in one pass over the domain.
+ */
+typedef struct
+{
+    char *domain;
+    char *uri;
+} URL, *PURL;
+typedef struct
+{
+    UINT32 edges;               // Index of first (outgoing) edge
+    UINT16 num_edges;           // Number of edges
+    UINT16 match;               // A key ends here?
+} NODE, *PNODE;
+typedef struct
+{
+    UINT32 label;               // Offset of label in labels
+    UINT16 label_len;           // Length of label
+    char c;                     // First char of label
+    UINT8 reserved;
+    UINT32 child;               // Index of child node
+} EDGE, *PEDGE;
+typedef struct
+{
+    UINT size;                  // Keys (before compilation):
+    UINT length;
+    UINT32 *keys;               // Offsets into pool
+    UINT pool_size;
+    UINT pool_length;
+    char *pool;
+    UINT num_nodes;             // Compiled trie:
+    UINT num_edges;
+    UINT labels_len;
+    PNODE nodes;
+    PEDGE edges;
+    char *labels;
+    HANDLE mapping;             // Image file mapping (or NULL)
+    PVOID view;                 // Mapped image (or NULL)
+} BLACKLIST, *PBLACKLIST;
+
+/*
+ * Blacklist image file: the header is followed by the nodes, edges and
+ * labels arrays of the compiled trie.
+ */
+#define IMAGE_MAGIC     0x4C424457      // "WDBL"
+#define IMAGE_VERSION   1
+typedef struct
+{
+    UINT32 magic;
+    UINT32 version;
+    UINT32 num_nodes;
+    UINT32 num_edges;
+    UINT32 labels_len;
+    UINT32 reserved;
+} IMAGE_HEADER, *PIMAGE_HEADER;
+
+/*
+ * Position in the blacklist trie.
+ */
+typedef struct
+{
+    UINT32 node;                // Current node
+    UINT32 edge;                // Current edge (if off != 0)
+    UINT16 off;                 // Offset into the edge's label
+} TRIEPOS, *PTRIEPOS;
+
+/*
+ * Pre-fabricated packets.
+ */
+typedef struct
+{
+    WINDIVERT_IPHDR  ip;
+    WINDIVERT_TCPHDR tcp;
+} PACKET, *PPACKET;
+typedef struct
+{
+    PACKET header;
+    UINT8 data[];
+} DATAPACKET, *PDATAPACKET;
+
+/*
+ * Worker threads.  Each worker reads its own queue, keeps "depth" reads
+ * outstanding, and has its own pre-fabricated packets.
+ */
+typedef struct
+{
+    OVERLAPPED overlapped;
+    BOOL pending;               // Read is outstanding.
+    WINDIVERT_ADDRESS addr;
+    UINT8 packet[MAXBUF];
+} READ, *PREAD;
+typedef struct
+{
+    UINT32 addr[2];             // Client and server addresses
+    UINT16 port;                // Client port
+    DWORD last;                 // Time of the last segment (ms)
+    HANDLE stream;              // Request data (or NULL if unused)
+} REQUEST, *PREQUEST;
+typedef struct
+{
+    HANDLE handle;
+    UINT queue;
+    UINT depth;
+    PREAD reads;
+    REQUEST requests[MAXREQUESTS];
+    PACKET reset;
+    PACKET finish;
+    PDATAPACKET blockpage;
+    UINT16 blockpage_len;
+} WORKER, *PWORKER;
+
+/*
+ * Blacklist (blacklist.c).
+ */
+extern PBLACKLIST BlackListInit(void);
+extern void BlackListInsert(PBLACKLIST blacklist, const char *key,
+    UINT len);
+extern void BlackListCompile(PBLACKLIST blacklist);
+extern BOOL BlackListMatch(PBLACKLIST blacklist, PURL url);
+extern BOOL BlackListRead(PBLACKLIST blacklist, const char *filename);
+extern void BlackListWrite(PBLACKLIST blacklist, const char *filename);
+extern BOOL BlackListIsImage(const char *filename);
+extern BOOL BlackListMap(PBLACKLIST blacklist, const char *filename);
+extern PBLACKLIST BlackListLoad(UINT num_files, char **files);
+extern void BlackListFree(PBLACKLIST blacklist);
+extern void BlackListPrint(PBLACKLIST blacklist);
+extern PBLACKLIST BlackListEnter(LONG *epoch_ptr);
+extern void BlackListExit(LONG epoch);
+extern PBLACKLIST BlackListSwap(PBLACKLIST blacklist);
+extern BOOL BlackListPayloadMatch(PBLACKLIST blacklist, char *data,
+    UINT len, PURL url, BOOL *more);
+
+/*
+ * Workers and the URL log (worker.c).
+ */
+extern void WorkerInit(PWORKER worker, HANDLE handle, UINT queue,
+    UINT depth);
+extern DWORD WINAPI WorkerThread(LPVOID arg);
+extern BOOL LogStart(void);
+
+#endif      /* __WEBFILTER_H */
@@ -0,0 +1,493 @@
+/*
+ * worker.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The webfilter workers: reading packets from a worker's queue, tracking
+ * partial HTTP requests, and blocking the connections of blacklisted
+ * requests; and the URL log.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "windivert.h"
+#include "webfilter.h"
+
+#define LOG_SIZE (64*1024)
+#define LOG_INTERVAL 100        // Log flush interval (ms).
+
+/*
+ * URL log.  Workers append lines (each prefixed by a colour char) and the
+ * log thread writes them to the console in batches.
+ */
+typedef struct
+{
+    CRITICAL_SECTION lock;
+    UINT len;
+    UINT dropped;               // Lines dropped because the log was full.
+    char buf[LOG_SIZE];
+} LOG, *PLOG;
+
+static LOG url_log;
+
+/*
+ * The block page contents.
+ */
+static const char block_data[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Connection: close\r\n"
+    "Content-Type: text/html\r\n"
+    "\r\n"
+    "<!doctype html>\n"
+    "<html>\n"
+    "\t<head>\n"
+    "\t\t<title>BLOCKED!</title>\n"
+    "\t</head>\n"
+    "\t<body>\n"
+    "\t\t<h1>BLOCKED!</h1>\n"
+    "\t\t<hr>\n"
+    "\t\t<p>This URL has been blocked!</p>\n"
+    "\t</body>\n"
+    "</html>\n";
+
+/*
+ * Prototypes
+ */
+static void PacketInit(PPACKET packet);
+static BOOL WorkerRead(PWORKER worker, PREAD read);
+static void WorkerPacket(PWORKER worker, PREAD read, UINT packet_len);
+static PREQUEST WorkerRequest(PWORKER worker, PWINDIVERT_IPHDR ip_header,
+    PWINDIVERT_TCPHDR tcp_header, char *payload, UINT payload_len);
+static void WorkerRequestEnd(PREQUEST request);
+static void LogUrl(const char *domain, const char *uri, BOOL blocked);
+static DWORD WINAPI LogThread(LPVOID arg);
+
+/*
+ * Initialize a worker.
+ */
+extern void WorkerInit(PWORKER worker, HANDLE handle, UINT queue,
+    UINT depth)
+{
+    PDATAPACKET blockpage;
+    UINT16 blockpage_len;
+    UINT i;
+
+    worker->handle = handle;
+    worker->queue  = queue;
+    worker->depth  = depth;
+    worker->reads  = (PREAD)calloc(depth, sizeof(READ));
+    if (worker->reads == NULL)
+    {
+        goto memory_error;
+    }
+    for (i = 0; i < depth; i++)
+    {
+        worker->reads[i].overlapped.hEvent =
+            CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (worker->reads[i].overlapped.hEvent == NULL)
+        {
+            fprintf(stderr, "error: failed to create event (%d)\n",
+                GetLastError());
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Initialize the pre-frabricated packets:
+    blockpage_len = sizeof(DATAPACKET)+sizeof(block_data)-1;
+    blockpage = (PDATAPACKET)malloc(blockpage_len);
+    if (blockpage == NULL)
+    {
+        goto memory_error;
+    }
+    PacketInit(&blockpage->header);
+    blockpage->header.ip.Length   = htons(blockpage_len);
+    blockpage->header.tcp.SrcPort = htons(80);
+    blockpage->header.tcp.Psh     = 1;
+    blockpage->header.tcp.Ack     = 1;
+    memcpy(blockpage->data, block_data, sizeof(block_data)-1);
+    worker->blockpage = blockpage;
+    worker->blockpage_len = blockpage_len;
+    PacketInit(&worker->reset);
+    worker->reset.tcp.Rst = 1;
+    worker->reset.tcp.Ack = 1;
+    PacketInit(&worker->finish);
+    worker->finish.tcp.Fin = 1;
+    worker->finish.tcp.Ack = 1;
+    return;
+
+memory_error:
+    fprintf(stderr, "error: memory allocation failed\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Worker thread.  Reads complete in the order they were issued, so
+ * handling them round-robin keeps each connection's packets in order.
+ */
+extern DWORD WINAPI WorkerThread(LPVOID arg)
+{
+    PWORKER worker = (PWORKER)arg;
+    PREAD read;
+    DWORD packet_len;
+    UINT i;
+
+    for (i = 0; i < worker->depth; i++)
+    {
+        WorkerRead(worker, &worker->reads[i]);
+    }
+
+    // Main loop:
+    for (i = 0; TRUE; i = (i + 1) % worker->depth)
+    {
+        read = &worker->reads[i];
+        if (!read->pending && !WorkerRead(worker, read))
+        {
+            continue;
+        }
+        read->pending = FALSE;
+        if (!GetOverlappedResult(worker->handle, &read->overlapped,
+                &packet_len, TRUE))
+        {
+            fprintf(stderr, "warning: failed to read packet (%d)\n",
+                GetLastError());
+        }
+        else
+        {
+            WorkerPacket(worker, read, (UINT)packet_len);
+        }
+        WorkerRead(worker, read);
+    }
+}
+
+/*
+ * Start a read.
+ */
+static BOOL WorkerRead(PWORKER worker, PREAD read)
+{
+    if (!WinDivertRecvQueue(worker->handle, worker->queue, read->packet,
+            sizeof(read->packet), &read->addr, NULL, &read->overlapped) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        fprintf(stderr, "warning: failed to read packet (%d)\n",
+            GetLastError());
+        return FALSE;
+    }
+    read->pending = TRUE;
+    return TRUE;
+}
+
+/*
+ * Handle a packet: reinject it, or block the connection if the URL matches
+ * the blacklist.
+ */
+static void WorkerPacket(PWORKER worker, PREAD read, UINT packet_len)
+{
+    HANDLE handle = worker->handle;
+    UINT8 *packet = read->packet;
+    PWINDIVERT_ADDRESS addr = &read->addr;
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    PVOID payload;
+    UINT payload_len;
+    PPACKET reset = &worker->reset;
+    PPACKET finish = &worker->finish;
+    PDATAPACKET blockpage = worker->blockpage;
+    UINT16 blockpage_len = worker->blockpage_len;
+    PBLACKLIST blacklist;
+    PREQUEST request = NULL;
+    char domain[MAXURL];
+    char uri[MAXURL];
+    URL url = {domain, uri};
+    PVOID data;
+    UINT data_len;
+    LONG epoch;
+    BOOL match = FALSE, more = FALSE;
+
+    if (WinDivertHelperParsePacket(packet, packet_len, &ip_header, NULL,
+            NULL, NULL, &tcp_header, NULL, &payload, &payload_len))
+    {
+        request = WorkerRequest(worker, ip_header, tcp_header,
+            (char *)payload, payload_len);
+    }
+    if (request != NULL)
+    {
+        // Match the request so far; the packet itself is sent on unless the
+        // request is blocked, so nothing is delayed.
+        if (WinDivertHelperStreamPush(request->stream, packet, packet_len) &&
+            WinDivertHelperStreamData(request->stream, &data, &data_len,
+                NULL))
+        {
+            blacklist = BlackListEnter(&epoch);
+            match = BlackListPayloadMatch(blacklist, (char *)data, data_len,
+                &url, &more);
+            BlackListExit(epoch);
+            if (domain[0] != '\0')
+            {
+                LogUrl(domain, uri, match);
+            }
+        }
+        if (!more)
+        {
+            WorkerRequestEnd(request);
+        }
+    }
+    if (!match)
+    {
+        // Packet does not match the blacklist; simply reinject it.
+        if (!WinDivertSend(handle, packet, packet_len, addr, NULL))
+        {
+            fprintf(stderr, "warning: failed to reinject packet (%d)\n",
+                GetLastError());
+        }
+        return;
+    }
+
+    // The URL matched the blacklist; we block it by hijacking the TCP
+    // connection.
+
+    // (1) Send a TCP RST to the server; immediately closing the
+    //     connection at the server's end.
+    reset->ip.SrcAddr       = ip_header->SrcAddr;
+    reset->ip.DstAddr       = ip_header->DstAddr;
+    reset->tcp.SrcPort      = tcp_header->SrcPort;
+    reset->tcp.DstPort      = htons(80);
+    reset->tcp.SeqNum       = tcp_header->SeqNum;
+    reset->tcp.AckNum       = tcp_header->AckNum;
+    WinDivertHelperCalcChecksums((PVOID)reset, sizeof(PACKET), 0);
+    if (!WinDivertSend(handle, (PVOID)reset, sizeof(PACKET), addr, NULL))
+    {
+        fprintf(stderr, "warning: failed to send reset packet (%d)\n",
+            GetLastError());
+    }
+
+    // (2) Send the blockpage to the browser:
+    blockpage->header.ip.SrcAddr       = ip_header->DstAddr;
+    blockpage->header.ip.DstAddr       = ip_header->SrcAddr;
+    blockpage->header.tcp.DstPort      = tcp_header->SrcPort;
+    blockpage->header.tcp.SeqNum       = tcp_header->AckNum;
+    blockpage->header.tcp.AckNum       =
+        htonl(ntohl(tcp_header->SeqNum) + payload_len);
+    WinDivertHelperCalcChecksums((PVOID)blockpage, blockpage_len, 0);
+    addr->Direction = !addr->Direction;     // Reverse direction.
+    if (!WinDivertSend(handle, (PVOID)blockpage, blockpage_len, addr, NULL))
+    {
+        fprintf(stderr, "warning: failed to send block page packet (%d)\n",
+            GetLastError());
+    }
+
+    // (3) Send a TCP FIN to the browser; closing the connection at the 
+    //     browser's end.
+    finish->ip.SrcAddr       = ip_header->DstAddr;
+    finish->ip.DstAddr       = ip_header->SrcAddr;
+    finish->tcp.SrcPort      = htons(80);
+    finish->tcp.DstPort      = tcp_header->SrcPort;
+    finish->tcp.SeqNum       =
+        htonl(ntohl(tcp_header->AckNum) + sizeof(block_data) - 1); 
+    finish->tcp.AckNum       =
+        htonl(ntohl(tcp_header->SeqNum) + payload_len);
+    WinDivertHelperCalcChecksums((PVOID)finish, sizeof(PACKET), 0);
+    if (!WinDivertSend(handle, (PVOID)finish, sizeof(PACKET), addr, NULL))
+    {
+        fprintf(stderr, "warning: failed to send finish packet (%d)\n",
+            GetLastError());
+    }
+}
+
+/*
+ * Find the partial request of a connection, or start a new one if the
+ * payload begins a GET/POST request.  Returns NULL for other packets.
+ */
+static PREQUEST WorkerRequest(PWORKER worker, PWINDIVERT_IPHDR ip_header,
+    PWINDIVERT_TCPHDR tcp_header, char *payload, UINT payload_len)
+{
+    PREQUEST request, oldest = NULL;
+    BOOL start;
+    UINT i;
+
+    start = ((payload_len >= 5 && memcmp(payload, "GET /", 5) == 0) ||
+             (payload_len >= 6 && memcmp(payload, "POST /", 6) == 0));
+    for (i = 0; i < MAXREQUESTS; i++)
+    {
+        request = &worker->requests[i];
+        if (request->stream == NULL)
+        {
+            oldest = request;
+            continue;
+        }
+        if (request->addr[0] == ip_header->SrcAddr &&
+            request->addr[1] == ip_header->DstAddr &&
+            request->port == tcp_header->SrcPort)
+        {
+            if (start)
+            {
+                // A new request on the same connection:
+                WorkerRequestEnd(request);
+                break;
+            }
+            request->last = GetTickCount();
+            return request;
+        }
+        if (oldest == NULL || (oldest->stream != NULL &&
+                (LONG)(request->last - oldest->last) < 0))
+        {
+            oldest = request;
+        }
+    }
+    if (!start)
+    {
+        return NULL;
+    }
+    request = (i < MAXREQUESTS? request: oldest);
+
+    // Evict the least recently used partial request if necessary:
+    if (request->stream != NULL)
+    {
+        WorkerRequestEnd(request);
+    }
+    request->stream = WinDivertHelperStreamOpen(REQUEST_WINDOW);
+    if (request->stream == INVALID_HANDLE_VALUE)
+    {
+        request->stream = NULL;
+        return NULL;
+    }
+    request->addr[0] = ip_header->SrcAddr;
+    request->addr[1] = ip_header->DstAddr;
+    request->port    = tcp_header->SrcPort;
+    request->last    = GetTickCount();
+    return request;
+}
+
+/*
+ * Forget a (matched, or abandoned) request.
+ */
+static void WorkerRequestEnd(PREQUEST request)
+{
+    WinDivertHelperStreamClose(request->stream);
+    request->stream = NULL;
+}
+
+/*
+ * Log a URL and its verdict.
+ */
+static void LogUrl(const char *domain, const char *uri, BOOL blocked)
+{
+    char line[2*MAXURL+32];
+    int len;
+
+    len = _snprintf(line, sizeof(line), "%cURL %s/%s: %s\n",
+        (blocked? 'R': 'G'), domain, uri, (blocked? "BLOCKED!": "allowed"));
+    if (len < 0 || (size_t)len >= sizeof(line))
+    {
+        return;
+    }
+    EnterCriticalSection(&url_log.lock);
+    if (url_log.len + len > sizeof(url_log.buf))
+    {
+        url_log.dropped++;
+    }
+    else
+    {
+        memcpy(url_log.buf + url_log.len, line, len);
+        url_log.len += len;
+    }
+    LeaveCriticalSection(&url_log.lock);
+}
+
+/*
+ * Start the log thread.
+ */
+extern BOOL LogStart(void)
+{
+    HANDLE thread;
+
+    InitializeCriticalSection(&url_log.lock);
+    thread = CreateThread(NULL, 0, LogThread, (LPVOID)&url_log, 0, NULL);
+    if (thread == NULL)
+    {
+        return FALSE;
+    }
+    CloseHandle(thread);
+    return TRUE;
+}
+
+/*
+ * Log thread.  Writes the logged lines in batches, changing the console
+ * colour only when it differs from the previous line's.
+ */
+static DWORD WINAPI LogThread(LPVOID arg)
+{
+    PLOG log = (PLOG)arg;
+    static char buf[LOG_SIZE];
+    UINT len, dropped, i, j;
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    char colour = '\0';
+
+    while (TRUE)
+    {
+        Sleep(LOG_INTERVAL);
+        EnterCriticalSection(&log->lock);
+        len = log->len;
+        dropped = log->dropped;
+        memcpy(buf, log->buf, len);
+        log->len = 0;
+        log->dropped = 0;
+        LeaveCriticalSection(&log->lock);
+
+        for (i = 0; i < len; i = j)
+        {
+            if (buf[i] != colour)
+            {
+                fflush(stdout);
+                colour = buf[i];
+                SetConsoleTextAttribute(console, (colour == 'R'?
+                    FOREGROUND_RED: FOREGROUND_GREEN));
+            }
+            for (j = i + 1; j < len && buf[j-1] != '\n'; j++)
+                ;
+            fwrite(buf + i + 1, 1, j - i - 1, stdout);
+        }
+        if (len != 0)
+        {
+            fflush(stdout);
+            colour = '\0';
+            SetConsoleTextAttribute(console,
+                FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+        }
+        if (dropped != 0)
+        {
+            printf("(%u lines dropped)\n", dropped);
+        }
+    }
+}
+
+/*
+ * Initialize a PACKET.
+ */
+static void PacketInit(PPACKET packet)
+{
+    memset(packet, 0, sizeof(PACKET));
+    packet->ip.Version = 4;
+    packet->ip.HdrLength = sizeof(WINDIVERT_IPHDR) / sizeof(UINT32);
+    packet->ip.Length = htons(sizeof(PACKET));
+    packet->ip.TTL = 64;
+    packet->ip.Protocol = IPPROTO_TCP;
+    packet->tcp.HdrLength = sizeof(WINDIVERT_TCPHDR) / sizeof(UINT32);
+}
@@ -86,10 +86,11 @@ typedef enum
  */
 typedef enum
 {
-    WINDIVERT_PARAM_QUEUE_LEN  = 0,     /* Packet queue length. */
-    WINDIVERT_PARAM_QUEUE_TIME = 1      /* Packet queue time. */
+    WINDIVERT_PARAM_QUEUE_LEN   = 0,    /* Packet queue length. */
+    WINDIVERT_PARAM_QUEUE_TIME  = 1,    /* Packet queue time. */
+    WINDIVERT_PARAM_QUEUE_COUNT = 2     /* Number of packet queues. */
 } WINDIVERT_PARAM, *PWINDIVERT_PARAM;
-#define WINDIVERT_PARAM_MAX             WINDIVERT_PARAM_QUEUE_TIME
+#define WINDIVERT_PARAM_MAX             WINDIVERT_PARAM_QUEUE_COUNT
 
 #ifndef WINDIVERT_KERNEL
 
@@ -102,6 +103,33 @@ extern WINDIVERTEXPORT HANDLE WinDivertOpen(
     __in        INT16 priority,
     __in        UINT64 flags);
 
+/*
+ * Compile a filter into a (serializable) filter object.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertFilterCompile(
+    __in        const char *filter,
+    __in        WINDIVERT_LAYER layer,
+    __out_opt   PVOID pObject,
+    __in        UINT objectLen,
+    __out_opt   UINT *pObjectLen);
+
+/*
+ * Open a WinDivert handle from a compiled filter object.
+ */
+extern WINDIVERTEXPORT HANDLE WinDivertOpenCompiled(
+    __in        const VOID *pObject,
+    __in        UINT objectLen,
+    __in        INT16 priority,
+    __in        UINT64 flags);
+
+/*
+ * Replace the filter of an open WinDivert handle.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertSetFilter(
+    __in        HANDLE handle,
+    __in        const char *filter,
+    __in        WINDIVERT_LAYER layer);
+
 /*
  * Receive (read) a packet from a WinDivert handle.
  */
@@ -124,6 +152,18 @@ extern WINDIVERTEXPORT BOOL WinDivertRecvEx(
     __out_opt   UINT *readLen,
     __inout_opt LPOVERLAPPED lpOverlapped);
 
+/*
+ * Receive (read) a packet from one of a WinDivert handle's queues.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertRecvQueue(
+    __in        HANDLE handle,
+    __in        UINT queue,
+    __out       PVOID pPacket,
+    __in        UINT packetLen,
+    __out_opt   PWINDIVERT_ADDRESS pAddr,
+    __out_opt   UINT *readLen,
+    __inout_opt LPOVERLAPPED lpOverlapped);
+
 /*
  * Send (write/inject) a packet to a WinDivert handle.
  */
@@ -168,6 +208,95 @@ extern WINDIVERTEXPORT BOOL WinDivertGetParam(
     __in        WINDIVERT_PARAM param,
     __out       UINT64 *pValue);
 
+/*
+ * Handle pool limits for WinDivertPoolCreate().
+ */
+#define WINDIVERT_POOL_MAX_SIZE                             1024
+
+/*
+ * Create a pool of pre-opened WinDivert handles.
+ */
+extern WINDIVERTEXPORT HANDLE WinDivertPoolCreate(
+    __in        UINT poolSize);
+
+/*
+ * Open a WinDivert handle, re-using an idle handle from a pool.
+ */
+extern WINDIVERTEXPORT HANDLE WinDivertPoolOpen(
+    __in        HANDLE pool,
+    __in        const char *filter,
+    __in        WINDIVERT_LAYER layer,
+    __in        INT16 priority,
+    __in        UINT64 flags);
+
+/*
+ * Close a WinDivert handle, returning it to a pool.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertPoolClose(
+    __in        HANDLE pool,
+    __in        HANDLE handle);
+
+/*
+ * Destroy a WinDivert handle pool.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertPoolDestroy(
+    __in        HANDLE pool);
+
+/*
+ * Packet pump limits for WinDivertPumpCreate().
+ */
+#define WINDIVERT_PUMP_MAX_THREADS                          64
+#define WINDIVERT_PUMP_MAX_DEPTH                            1024
+#define WINDIVERT_PUMP_PACKET_MAX                           0xFFFF
+
+/*
+ * Packet pump callback.  Returns TRUE to re-inject the (possibly modified)
+ * packet, FALSE to drop it.
+ */
+typedef BOOL (*WINDIVERT_PUMP_CALLBACK)(
+    __in        PVOID context,
+    __inout     PVOID pPacket,
+    __inout     UINT *pPacketLen,
+    __inout     PWINDIVERT_ADDRESS pAddr);
+
+/*
+ * Packet pump I/O callback, for the completions of the application's own
+ * overlapped requests on the pump's handle.  error is 0 on success.
+ */
+typedef VOID (*WINDIVERT_PUMP_IO_CALLBACK)(
+    __in        PVOID context,
+    __in        LPOVERLAPPED lpOverlapped,
+    __in        UINT ioLen,
+    __in        DWORD error);
+
+/*
+ * Start pumping packets from a WinDivert handle through a callback.
+ */
+extern WINDIVERTEXPORT HANDLE WinDivertPumpCreate(
+    __in        HANDLE handle,
+    __in        UINT numThreads,
+    __in        UINT depth,
+    __in        WINDIVERT_PUMP_CALLBACK callback,
+    __in_opt    PVOID context);
+
+/*
+ * WinDivertPumpCreate() that also passes the completions of the
+ * application's own overlapped requests to ioCallback.
+ */
+extern WINDIVERTEXPORT HANDLE WinDivertPumpCreateEx(
+    __in        HANDLE handle,
+    __in        UINT numThreads,
+    __in        UINT depth,
+    __in        WINDIVERT_PUMP_CALLBACK callback,
+    __in_opt    WINDIVERT_PUMP_IO_CALLBACK ioCallback,
+    __in_opt    PVOID context);
+
+/*
+ * Stop and destroy a packet pump.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertPumpDestroy(
+    __in        HANDLE pump);
+
 /****************************************************************************/
 /* WINDIVERT HELPER API                                                     */
 /****************************************************************************/
@@ -330,6 +459,32 @@ extern WINDIVERTEXPORT BOOL WinDivertHelperParsePacket(
     __out_opt   PVOID *ppData,
     __out_opt   UINT *pDataLen);
 
+/*
+ * Column outputs for WinDivertHelperParsePacketBatch().  Each non-NULL column
+ * points to an array of (at least) `count' entries; SrcAddr/DstAddr hold four
+ * UINT32s per packet.  NULL columns are not written.
+ */
+typedef struct
+{
+    UINT8  *Version;                /* 4, 6 or 0 (not parsed) */
+    UINT8  *Protocol;               /* Transport protocol */
+    UINT32 *SrcAddr;                /* IPv6 or IPv4-mapped, network order */
+    UINT32 *DstAddr;                /* IPv6 or IPv4-mapped, network order */
+    UINT16 *SrcPort;                /* TCP/UDP only, network order */
+    UINT16 *DstPort;                /* TCP/UDP only, network order */
+    UINT   *PayloadOffset;          /* Offset of payload within packet */
+    UINT   *PayloadLength;          /* Payload length */
+} WINDIVERT_PACKET_COLUMNS, *PWINDIVERT_PACKET_COLUMNS;
+
+/*
+ * Parse a batch of raw packets into columns.
+ */
+extern WINDIVERTEXPORT UINT WinDivertHelperParsePacketBatch(
+    __in        const PVOID *pPackets,
+    __in        const UINT *packetLens,
+    __in        UINT count,
+    __out       PWINDIVERT_PACKET_COLUMNS pColumns);
+
 /*
  * Parse an IPv4 address.
  */
@@ -352,6 +507,224 @@ extern WINDIVERTEXPORT UINT WinDivertHelperCalcChecksums(
     __in        UINT packetLen,
     __in        UINT64 flags);
 
+/*
+ * IPv4/IPv6 fragment reassembly limits for WinDivertHelperReassemblyOpen().
+ */
+#define WINDIVERT_REASSEMBLY_MAX_DATAGRAMS                  1024
+#define WINDIVERT_REASSEMBLY_DEFAULT_DATAGRAMS              64
+#define WINDIVERT_REASSEMBLY_DEFAULT_TIMEOUT                30000
+
+/*
+ * Create an IPv4/IPv6 fragment reassembly context.
+ */
+extern WINDIVERTEXPORT HANDLE WinDivertHelperReassemblyOpen(
+    __in        UINT maxDatagrams,
+    __in        UINT timeout);
+
+/*
+ * Add a packet to a reassembly context; returns whole datagrams.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperReassemble(
+    __in        HANDLE handle,
+    __in        PVOID pPacket,
+    __in        UINT packetLen,
+    __out       PVOID pDatagram,
+    __in        UINT datagramLen,
+    __out_opt   UINT *pReadLen);
+
+/*
+ * Close a reassembly context.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperReassemblyClose(
+    __in        HANDLE handle);
+
+/*
+ * TCP stream reassembly limits for WinDivertHelperStreamOpen().
+ */
+#define WINDIVERT_STREAM_MAX_WINDOW                         0x1000000
+#define WINDIVERT_STREAM_DEFAULT_WINDOW                     0x10000
+
+/*
+ * Create a TCP stream (one direction of a connection) reassembly context.
+ */
+extern WINDIVERTEXPORT HANDLE WinDivertHelperStreamOpen(
+    __in        UINT windowLen);
+
+/*
+ * Add a TCP segment's payload to a stream.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperStreamPush(
+    __in        HANDLE handle,
+    __in        PVOID pPacket,
+    __in        UINT packetLen);
+
+/*
+ * Get the in-order (contiguous) data of a stream.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperStreamData(
+    __in        HANDLE handle,
+    __out       PVOID *ppData,
+    __out       UINT *pDataLen,
+    __out_opt   UINT32 *pSeqNum);
+
+/*
+ * Discard in-order data from the start of a stream.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperStreamConsume(
+    __in        HANDLE handle,
+    __in        UINT len);
+
+/*
+ * Close a TCP stream reassembly context.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperStreamClose(
+    __in        HANDLE handle);
+
+/*
+ * Load a compiled filter object for WinDivertHelperEvalFilter().
+ */
+extern WINDIVERTEXPORT HANDLE WinDivertHelperFilterOpen(
+    __in        const VOID *pObject,
+    __in        UINT objectLen);
+
+/*
+ * Evaluate a filter against a packet.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperEvalFilter(
+    __in        HANDLE handle,
+    __in        PVOID pPacket,
+    __in        UINT packetLen,
+    __in        PWINDIVERT_ADDRESS pAddr);
+
+/*
+ * Compute the (direction independent) flow hash of a packet.
+ */
+extern WINDIVERTEXPORT UINT32 WinDivertHelperHashPacket(
+    __in        PVOID pPacket,
+    __in        UINT packetLen);
+
+/*
+ * Close a filter loaded by WinDivertHelperFilterOpen().
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperFilterClose(
+    __in        HANDLE handle);
+
+/*
+ * Flow table limits for WinDivertHelperFlowTableCreate().
+ */
+#define WINDIVERT_FLOW_TABLE_MAX_FLOWS                      0x1000000
+#define WINDIVERT_FLOW_TABLE_MAX_DATA                       0x1000
+#define WINDIVERT_FLOW_TABLE_MAX_TIMEOUT                    0x7FFFFFFF
+
+/*
+ * WinDivertHelperFlowLookup() flags.
+ */
+#define WINDIVERT_FLOW_CREATE                               0x0001
+
+/*
+ * Create a flow table.
+ */
+extern WINDIVERTEXPORT HANDLE WinDivertHelperFlowTableCreate(
+    __in        UINT maxFlows,
+    __in        UINT dataSize,
+    __in        UINT timeout);
+
+/*
+ * Find (or create) the flow of a packet; returns the flow's data.
+ */
+extern WINDIVERTEXPORT PVOID WinDivertHelperFlowLookup(
+    __in        HANDLE table,
+    __in        PVOID pPacket,
+    __in        UINT packetLen,
+    __in        UINT64 flags,
+    __out_opt   BOOL *pReverse);
+
+/*
+ * Remove a flow from a flow table.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperFlowRemove(
+    __in        HANDLE table,
+    __in        PVOID pData);
+
+/*
+ * Remove flows that have been idle for longer than the table's timeout.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperFlowTableExpire(
+    __in        HANDLE table);
+
+/*
+ * Destroy a flow table.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperFlowTableDestroy(
+    __in        HANDLE table);
+
+/*
+ * pcapng capture file limits for WinDivertHelperPcapOpen().
+ */
+#define WINDIVERT_PCAP_MAX_PACKET                           0xFFFF
+#define WINDIVERT_PCAP_MIN_ROTATE_SIZE                      0x100000
+#define WINDIVERT_PCAP_MAX_ROTATE_TIME                      0x100000
+
+/*
+ * Open a pcapng capture file (optionally rotated by size or time).
+ */
+extern WINDIVERTEXPORT HANDLE WinDivertHelperPcapOpen(
+    __in        const char *filename,
+    __in        UINT64 rotateSize,
+    __in        UINT rotateTime);
+
+/*
+ * Write a packet to a pcapng capture file.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperPcapWrite(
+    __in        HANDLE handle,
+    __in        PVOID pPacket,
+    __in        UINT packetLen,
+    __in        PWINDIVERT_ADDRESS pAddr);
+
+/*
+ * Write buffered packets to a pcapng capture file.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperPcapFlush(
+    __in        HANDLE handle);
+
+/*
+ * Close a pcapng capture file.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperPcapClose(
+    __in        HANDLE handle);
+
+/*
+ * Maximum number of rules for WinDivertHelperClassifierOpen().
+ */
+#define WINDIVERT_CLASSIFIER_MAX_RULES                      0xFFFF
+
+/*
+ * Create a classifier from an ordered list of filters (rules).
+ */
+extern WINDIVERTEXPORT HANDLE WinDivertHelperClassifierOpen(
+    __in        const char **filters,
+    __in        UINT numFilters,
+    __in        WINDIVERT_LAYER layer);
+
+/*
+ * Find the rules (in order) that match a packet.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperClassify(
+    __in        HANDLE handle,
+    __in        PVOID pPacket,
+    __in        UINT packetLen,
+    __in        PWINDIVERT_ADDRESS pAddr,
+    __out       UINT *pRuleIds,
+    __in        UINT ruleIdsLen,
+    __out_opt   UINT *pNumRules);
+
+/*
+ * Close a classifier.
+ */
+extern WINDIVERTEXPORT BOOL WinDivertHelperClassifierClose(
+    __in        HANDLE handle);
+
 #endif      /* WINDIVERT_KERNEL */
 
 #ifdef __cplusplus
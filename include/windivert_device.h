@@ -43,7 +43,7 @@
 #define WINDIVERT_DEVICE_NAME                                               \
     L"WinDivert" WINDIVERT_VERSION_LSTR
 
-#define WINDIVERT_IOCTL_VERSION                     3
+#define WINDIVERT_IOCTL_VERSION                     6
 #define WINDIVERT_IOCTL_MAGIC                       0xE8D3
 
 #define WINDIVERT_FILTER_FIELD_ZERO                 0
@@ -104,8 +104,10 @@
 #define WINDIVERT_FILTER_FIELD_UDP_LENGTH           55
 #define WINDIVERT_FILTER_FIELD_UDP_CHECKSUM         56
 #define WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH    57
+#define WINDIVERT_FILTER_FIELD_TCP_PAYLOAD          58
+#define WINDIVERT_FILTER_FIELD_UDP_PAYLOAD          59
 #define WINDIVERT_FILTER_FIELD_MAX                  \
-    WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH
+    WINDIVERT_FILTER_FIELD_UDP_PAYLOAD
 
 #define WINDIVERT_FILTER_TEST_EQ                    0
 #define WINDIVERT_FILTER_TEST_NEQ                   1
@@ -113,10 +115,31 @@
 #define WINDIVERT_FILTER_TEST_LEQ                   3
 #define WINDIVERT_FILTER_TEST_GT                    4
 #define WINDIVERT_FILTER_TEST_GEQ                   5
-#define WINDIVERT_FILTER_TEST_MAX                   WINDIVERT_FILTER_TEST_GEQ
+#define WINDIVERT_FILTER_TEST_CONTAINS              6
+#define WINDIVERT_FILTER_TEST_NCONTAINS             7
+#define WINDIVERT_FILTER_TEST_MAX                   \
+    WINDIVERT_FILTER_TEST_NCONTAINS
 
 #define WINDIVERT_FILTER_MAXLEN                     32
 
+/*
+ * Payload fields load `length' bytes starting at `offset' bytes into the
+ * payload.  Only the first WINDIVERT_FILTER_PAYLOAD_MAXLEN bytes of the
+ * payload can be matched.
+ */
+#define WINDIVERT_FILTER_PAYLOAD_MAXLEN             128
+#define WINDIVERT_FILTER_PAYLOAD_MAXWIDTH           (4*sizeof(UINT32))
+
+/*
+ * The (n)contains tests search the whole payload for a set of patterns
+ * compiled into an Aho-Corasick automaton.  The automata follow the filter
+ * program in the IOCTL_WINDIVERT_START_FILTER buffer (whose argument is the
+ * number of filter instructions), and arg[0] of the test is the index of its
+ * automaton.
+ */
+#define WINDIVERT_FILTER_AUTOMATA_MAXLEN            0x02000000
+#define WINDIVERT_FILTER_AUTOMATON_MATCH            0
+
 #define WINDIVERT_FILTER_RESULT_ACCEPT              (WINDIVERT_FILTER_MAXLEN+1)
 #define WINDIVERT_FILTER_RESULT_REJECT              (WINDIVERT_FILTER_MAXLEN+2)
 
@@ -160,6 +183,9 @@
 #define WINDIVERT_PARAM_QUEUE_TIME_DEFAULT          512
 #define WINDIVERT_PARAM_QUEUE_TIME_MIN              128
 #define WINDIVERT_PARAM_QUEUE_TIME_MAX              2048
+#define WINDIVERT_PARAM_QUEUE_COUNT_DEFAULT         1
+#define WINDIVERT_PARAM_QUEUE_COUNT_MIN             1
+#define WINDIVERT_PARAM_QUEUE_COUNT_MAX             64
 
 /*
  * WinDivert message definitions.
@@ -183,9 +209,45 @@ struct windivert_ioctl_filter_s
     UINT8  test;                    // WINDIVERT_FILTER_TEST_*
     UINT16 success;                 // Success continuation.
     UINT16 failure;                 // Fail continuation.
+    UINT16 offset;                  // Payload offset (payload fields).
+    UINT8  length;                  // Payload length (payload fields).
     UINT32 arg[4];                  // Argument.
 };
 typedef struct windivert_ioctl_filter_s *windivert_ioctl_filter_t;
+
+/*
+ * The automaton header is followed by the UINT32 transition table
+ * next[states*classes].  States are numbered by their row offset into the
+ * table (i.e. state*classes); state 0 is the match state and state 1 is the
+ * start state.
+ */
+struct windivert_ioctl_automaton_s
+{
+    UINT32 size;                    // Automaton size (including header).
+    UINT32 states;                  // Number of states.
+    UINT16 classes;                 // Number of byte classes.
+    UINT16 reserved;                // Reserved (zero).
+    UINT8  map[256];                // Byte to class map.
+};
+typedef struct windivert_ioctl_automaton_s *windivert_ioctl_automaton_t;
+
+/*
+ * The IOCTL_WINDIVERT_OPEN buffer is this header followed by the
+ * IOCTL_WINDIVERT_START_FILTER buffer (the filter program and automata).
+ * A zero queue_len or queue_time keeps the default.
+ */
+#define WINDIVERT_IOCTL_OPEN_VERSION                1
+struct windivert_ioctl_open_s
+{
+    UINT8  version;                 // WINDIVERT_IOCTL_OPEN_VERSION
+    UINT8  layer;                   // WINDIVERT_LAYER_*
+    UINT16 filter_len;              // Filter program length.
+    UINT32 priority;                // WINDIVERT_PRIORITY(priority16)
+    UINT64 flags;                   // WINDIVERT_FLAG_*
+    UINT32 queue_len;               // WINDIVERT_PARAM_QUEUE_LEN (or 0)
+    UINT32 queue_time;              // WINDIVERT_PARAM_QUEUE_TIME (or 0)
+};
+typedef struct windivert_ioctl_open_s *windivert_ioctl_open_t;
 #pragma pack(pop)
 
 /*
@@ -207,5 +269,11 @@ typedef struct windivert_ioctl_filter_s *windivert_ioctl_filter_t;
     CTL_CODE(FILE_DEVICE_NETWORK, 0x90E, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
 #define IOCTL_WINDIVERT_GET_PARAM                                           \
     CTL_CODE(FILE_DEVICE_NETWORK, 0x90F, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_WINDIVERT_OPEN                                                \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x910, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_WINDIVERT_RESET                                               \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x911, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_WINDIVERT_SET_FILTER                                          \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x912, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
 
 #endif      /* __WINDIVERT_DEVICE_H */
@@ -50,6 +50,7 @@ do
         $STRIP --strip-debug "install/MINGW/$CPU/WinDivert.dll"
         echo "\tbuild install/MINGW/$CPU/netdump.exe..."
         $CC -s -O2 -Iinclude/ examples/netdump/netdump.c \
+            examples/netdump/log.c \
             -o "install/MINGW/$CPU/netdump.exe" -lWinDivert -lws2_32 \
             -L"install/MINGW/$CPU/"
         echo "\tbuild install/MINGW/$CPU/netfilter.exe..."
@@ -60,8 +61,14 @@ do
         $CC -s -O2 -Iinclude/ examples/passthru/passthru.c \
             -o "install/MINGW/$CPU/passthru.exe" -lWinDivert -lws2_32 \
             -L"install/MINGW/$CPU/"
+        echo "\tbuild install/MINGW/$CPU/replay.exe..."
+        $CC -s -O2 -Iinclude/ examples/replay/replay.c \
+            -o "install/MINGW/$CPU/replay.exe" -lWinDivert -lws2_32 \
+            -L"install/MINGW/$CPU/"
         echo "\tbuild install/MINGW/$CPU/webfilter.exe..."
         $CC -s -O2 -Iinclude/ examples/webfilter/webfilter.c \
+            examples/webfilter/blacklist.c \
+            examples/webfilter/worker.c \
             -o "install/MINGW/$CPU/webfilter.exe" -lWinDivert -lws2_32 \
              -L"install/MINGW/$CPU/"
         echo "\tcopy install/MINGW/$CPU/WinDivert.inf..."
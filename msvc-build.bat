@@ -70,6 +70,13 @@ copy /Y build\passthru.exe ..\..\%MSVC_INSTALL%
 rd /s /q build\
 cd ..\..
 
+:: Build replay
+cd examples\replay
+msbuild /p:Platform=%PLATFORM% /p:OutDir=build\
+copy /Y build\replay.exe ..\..\%MSVC_INSTALL%
+rd /s /q build\
+cd ..\..
+
 :: Build webfilter
 cd examples\webfilter
 msbuild /p:Platform=%PLATFORM% /p:OutDir=build\
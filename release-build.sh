@@ -81,6 +81,8 @@ do
     cp install/$TARGET/i386/netfilter.exe $INSTALL/x86
     echo "\tcopy $INSTALL/x86/passtru.exe..."
     cp install/$TARGET/i386/passthru.exe $INSTALL/x86
+    echo "\tcopy $INSTALL/x86/replay.exe..."
+    cp install/$TARGET/i386/replay.exe $INSTALL/x86
     echo "\tcopy $INSTALL/x86/webfilter.exe..."
     cp install/$TARGET/i386/webfilter.exe $INSTALL/x86
     if [ -d "install/$TARGET/amd64" ]
@@ -116,6 +118,8 @@ do
         cp install/$TARGET/amd64/netfilter.exe $INSTALL/amd64
         echo "\tcopy $INSTALL/amd64/passtru.exe..."
         cp install/$TARGET/amd64/passthru.exe $INSTALL/amd64
+        echo "\tcopy $INSTALL/amd64/replay.exe..."
+        cp install/$TARGET/amd64/replay.exe $INSTALL/amd64
         echo "\tcopy $INSTALL/amd64/webfilter.exe..."
         cp install/$TARGET/amd64/webfilter.exe $INSTALL/amd64
     else
@@ -76,25 +76,12 @@ static void DEBUG_ERROR(PCCH format, NTSTATUS status, ...)
 #endif      // DEBUG_ON
 
 /*
- * WinDivert packet filter.
+ * WinDivert packet filter (shared with the DLL).
  */
-struct filter_s
-{
-    UINT8  protocol:4;                          // field's protocol
-    UINT8  test:4;                              // Filter test
-    UINT8  field;                               // Field of interest
-    UINT16 success;                             // Success continuation
-    UINT16 failure;                             // Fail continuation
-    UINT32 arg[4];                              // Comparison argument
-};
-typedef struct filter_s *filter_t;
-#define WINDIVERT_FILTER_PROTOCOL_NONE          0
-#define WINDIVERT_FILTER_PROTOCOL_IP            1
-#define WINDIVERT_FILTER_PROTOCOL_IPV6          2
-#define WINDIVERT_FILTER_PROTOCOL_ICMP          3
-#define WINDIVERT_FILTER_PROTOCOL_ICMPV6        4
-#define WINDIVERT_FILTER_PROTOCOL_TCP           5
-#define WINDIVERT_FILTER_PROTOCOL_UDP           6
+#define ntohs(x)                                RtlUshortByteSwap(x)
+#define ntohl(x)                                RtlUlongByteSwap(x)
+typedef PNET_BUFFER windivert_packet_t;
+#include "windivert_shared.c"
 #define WINDIVERT_FILTER_TAG                    'Fvid'
 
 /*
@@ -115,19 +102,27 @@ typedef enum
     WINDIVERT_CONTEXT_STATE_CLOSED  = 0xD3,     // Context is closed.
     WINDIVERT_CONTEXT_STATE_INVALID = 0xE4      // Context is invalid.
 } context_state_t;
+struct queue_s
+{
+    KSPIN_LOCK lock;                            // Queue lock.
+    LIST_ENTRY packet_queue;                    // Packet queue.
+    ULONG packet_queue_length;                  // Packet queue length.
+    WDFQUEUE read_queue;                        // Read queue (or NULL).
+};
+typedef struct queue_s *queue_t;
 struct context_s
 {
     UINT64 magic;                               // WINDIVERT_CONTEXT_MAGIC
     context_state_t state;                      // Context's state.
     KSPIN_LOCK lock;                            // Context-wide lock.
     WDFDEVICE device;                           // Context's device.
-    LIST_ENTRY packet_queue;                    // Packet queue.
-    ULONG packet_queue_length;                  // Packet queue length.
+    struct queue_s queues[WINDIVERT_PARAM_QUEUE_COUNT_MAX];
+                                                // Packet and read queues.
+    UINT queue_count;                           // Number of queues in use.
     ULONG packet_queue_maxlength;               // Packet queue max length.
     WDFTIMER timer;                             // Packet timer.
     UINT timer_timeout;                         // Packet timeout (in ms).
     BOOL timer_ticktock;                        // Packet timer ticktock.
-    WDFQUEUE read_queue;                        // Read queue.
     KEVENT read_event;                          // Read event.
     void *read_thread;                          // Read thread.
     UINT8 layer_0;                              // Context's layer (initial).
@@ -146,7 +141,8 @@ struct context_s
                                                 // What is registered?
     HANDLE engine_handle;                       // WFP engine handle.
     LONG filter_on;                             // Is filter on?
-    filter_t filter;                            // Packet filter.
+    struct windivert_filter_ref_s filter_ref;   // Packet filter.
+    KMUTEX filter_mutex;                        // Filter change lock.
 };
 typedef struct context_s context_s;
 typedef struct context_s *context_t;
@@ -207,100 +203,35 @@ typedef struct packet_s *packet_t;
 #define WINDIVERT_NET_BUFFER_LIST_TAG       'Lvid'
 
 /*
- * WinDivert address definition.
+ * WinDivert re-inject groups.  Consecutive re-injected packets of the same
+ * flow are cloned into one NET_BUFFER_LIST (one NET_BUFFER per packet, in
+ * order), and each NET_BUFFER_LIST is re-injected with a single call once
+ * the classify is done.
  */
-struct windivert_addr_s
+struct reinject_s
 {
-    UINT32 IfIdx;
-    UINT32 SubIfIdx;
-    UINT8  Direction;
+    PNET_BUFFER_LIST first;                 // First group (or NULL)
+    PNET_BUFFER_LIST last;                  // Last group
+    PNET_BUFFER last_buffer;                // Last packet of the last group
+    struct windivert_group_s state;         // Grouping state
 };
-typedef struct windivert_addr_s *windivert_addr_t;
+typedef struct reinject_s *reinject_t;
 
 /*
- * Header definitions.
+ * Maximum number of packets filtered per batch (bits in a verdict bitmap).
  */
-struct iphdr
-{
-    UINT8  HdrLength:4;
-    UINT8  Version:4;
-    UINT8  TOS;
-    UINT16 Length;
-    UINT16 Id;
-    UINT16 FragOff0;
-    UINT8  TTL;
-    UINT8  Protocol;
-    UINT16 Checksum;
-    UINT32 SrcAddr;
-    UINT32 DstAddr;
-};
-struct ipv6hdr
-{
-    UINT8  TrafficClass0:4;
-    UINT8  Version:4;
-    UINT8  FlowLabel0:4;
-    UINT8  TrafficClass1:4;
-    UINT16 FlowLabel1;
-    UINT16 Length;
-    UINT8  NextHdr;
-    UINT8  HopLimit;
-    UINT32 SrcAddr[4];
-    UINT32 DstAddr[4];
-};
-struct icmphdr
-{
-    UINT8  Type;
-    UINT8  Code;
-    UINT16 Checksum;
-    UINT32 Body;
-};
-struct icmpv6hdr
-{
-    UINT8  Type;
-    UINT8  Code;
-    UINT16 Checksum;
-    UINT32 Body;
-};
-struct tcphdr
-{
-    UINT16 SrcPort;
-    UINT16 DstPort;
-    UINT32 SeqNum;
-    UINT32 AckNum;
-    UINT16 Reserved1:4;
-    UINT16 HdrLength:4;
-    UINT16 Fin:1;
-    UINT16 Syn:1;
-    UINT16 Rst:1;
-    UINT16 Psh:1;
-    UINT16 Ack:1;
-    UINT16 Urg:1;
-    UINT16 Reserved2:2;
-    UINT16 Window;
-    UINT16 Checksum;
-    UINT16 UrgPtr;
-};
-struct udphdr
-{
-    UINT16 SrcPort;
-    UINT16 DstPort;
-    UINT16 Length;
-    UINT16 Checksum;
-};
-
-#define IPHDR_GET_FRAGOFF(hdr)          (((hdr)->FragOff0) & 0xFF1F)
-#define IPHDR_GET_MF(hdr)               (((hdr)->FragOff0) & 0x0020)
-#define IPHDR_GET_DF(hdr)               (((hdr)->FragOff0) & 0x0040)
-#define IPV6HDR_GET_TRAFFICCLASS(hdr)   \
-    ((((hdr)->TrafficClass0) << 4) | ((hdr)->TrafficClass1))
-#define IPV6HDR_GET_FLOWLABEL(hdr)      \
-    ((((UINT32)(hdr)->FlowLabel0) << 16) | ((UINT32)(hdr)->FlowLabel1))
+#define WINDIVERT_BATCH_MAX                 (8*sizeof(UINT64))
 
 /*
- * Misc.
+ * WinDivert address definition.
  */
-#define UINT8_MAX       0xFF
-#define UINT16_MAX      0xFFFF
+struct windivert_addr_s
+{
+    UINT32 IfIdx;
+    UINT32 SubIfIdx;
+    UINT8  Direction;
+};
+typedef struct windivert_addr_s *windivert_addr_t;
 
 /*
  * Global handles.
@@ -308,15 +239,29 @@ struct udphdr
 HANDLE inject_handle;
 HANDLE injectv6_handle;
 NDIS_HANDLE pool_handle;
+NDIS_HANDLE nb_pool_handle;
+
+/*
+ * NET_BUFFER_LISTs allocated from pool_handle and not yet freed.  NDIS
+ * recycles the NET_BUFFER_LISTs of its pools (and trims them), so each
+ * injection simply allocates one, and its completion routine frees it.  The
+ * count is global since (re)inject completions may run after the handle has
+ * been closed; the driver does not unload until it drops to zero.
+ */
+static struct windivert_nbl_count_s nbl_count;
 
 /*
  * Prototypes.
  */
 extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
     IN size_t in_length, IN size_t out_len, IN ULONG code);
-extern NTSTATUS windivert_read(context_t context, WDFREQUEST request);
+extern NTSTATUS windivert_read(context_t context, queue_t queue,
+    WDFREQUEST request);
 static void windivert_read_service_worker(PVOID context_0);
-static void windivert_read_service(context_t context);
+static void windivert_read_service(context_t context, queue_t queue);
+static NTSTATUS windivert_queue_create(context_t context, queue_t queue);
+static void windivert_queue_flush(queue_t queue);
+static NTSTATUS windivert_queue_set_count(context_t context, UINT count);
 static BOOLEAN windivert_context_verify(context_t context,
     context_state_t state);
 extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
@@ -325,6 +270,12 @@ static NTSTATUS windivert_register_callouts(context_t context, BOOL is_inbound,
     BOOL is_outbound, BOOL is_ipv4, BOOL is_ipv6);
 static NTSTATUS windivert_register_callout(context_t context, UINT idx,
     layer_t layer);
+static NTSTATUS windivert_unregister_callouts(context_t context);
+static NTSTATUS windivert_reset(context_t context);
+static NTSTATUS windivert_start_filter(context_t context,
+    windivert_ioctl_filter_t filter, size_t filter_len, UINT64 length);
+static NTSTATUS windivert_set_filter(context_t context,
+    windivert_ioctl_filter_t filter, size_t filter_len, UINT64 length);
 extern VOID windivert_timer(IN WDFTIMER timer);
 extern VOID windivert_cleanup(IN WDFFILEOBJECT object);
 extern VOID windivert_close(IN WDFFILEOBJECT object);
@@ -370,22 +321,28 @@ static void windivert_classify_callout(IN UINT8 direction, IN UINT32 if_idx,
     IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN OUT void *data,
     const FWPS_FILTER0 *filter, IN UINT64 flow_context,
     OUT FWPS_CLASSIFY_OUT0 *result);
-static BOOL windivert_reinject_packet(context_t context, UINT8 direction,
+static BOOL windivert_reinject_packet(reinject_t group, PNET_BUFFER buffer,
+    UINT32 hash, UINT8 direction);
+static BOOL windivert_reinject_group(context_t context, UINT8 direction,
     BOOL isipv4, UINT32 if_idx, UINT32 sub_if_idx, UINT32 priority,
-    PNET_BUFFER_LIST buffers, PNET_BUFFER buffer);
+    PNET_BUFFER_LIST buffers, reinject_t group);
 static void NTAPI windivert_reinject_complete(VOID *context,
     NET_BUFFER_LIST *buffers_cpy, BOOLEAN dispatch_level);
-static BOOL windivert_queue_packet(context_t context, PNET_BUFFER_LIST buffers,
-    PNET_BUFFER buffer, UINT8 direction, UINT32 if_idx, UINT32 sub_if_idx);
+static void windivert_reinject_free(PNET_BUFFER_LIST buffers_cpy);
+static void windivert_reinject_free_group(PNET_BUFFER_LIST buffers_cpy);
+static BOOL windivert_queue_packet(context_t context, queue_t queue,
+    PNET_BUFFER_LIST buffers, PNET_BUFFER buffer, UINT8 direction,
+    UINT32 if_idx, UINT32 sub_if_idx);
 static void windivert_free_packet(packet_t packet);
+static NTSTATUS windivert_nbl_alloc(PMDL mdl, ULONG offset, ULONG length,
+    PNET_BUFFER_LIST *buffers_ptr);
+static void windivert_nbl_free(PNET_BUFFER_LIST buffers);
 static UINT16 windivert_checksum(const void *pseudo_header,
     size_t pseudo_header_len, const void *data, size_t size);
 static void windivert_update_checksums(void *header, size_t len,
     BOOL update_ip, BOOL update_tcp, BOOL update_udp);
-static BOOL windivert_filter(PNET_BUFFER buffer, UINT32 if_idx,
-    UINT32 sub_if_idx, BOOL outbound, filter_t filter);
 static filter_t windivert_filter_compile(windivert_ioctl_filter_t ioctl_filter,
-    size_t ioctl_filter_len);
+    size_t ioctl_filter_len, UINT64 filter_len);
 static void windivert_filter_analyze(filter_t filter, BOOL *is_inbound,
     BOOL *is_outbound, BOOL *ip_ipv4, BOOL *is_ipv6);
 static BOOL windivert_filter_test(filter_t filter, UINT16 ip, UINT8 protocol,
@@ -487,6 +444,7 @@ extern NTSTATUS DriverEntry(IN PDRIVER_OBJECT driver_obj,
     WDFQUEUE queue;
     WDF_OBJECT_ATTRIBUTES obj_attrs;
     NET_BUFFER_LIST_POOL_PARAMETERS pool_params;
+    NET_BUFFER_POOL_PARAMETERS nb_pool_params;
     NTSTATUS status;
     DECLARE_CONST_UNICODE_STRING(device_name,
         L"\\Device\\" WINDIVERT_DEVICE_NAME);
@@ -586,6 +544,7 @@ extern NTSTATUS DriverEntry(IN PDRIVER_OBJECT driver_obj,
     }
 
     // Create the packet pool handle.
+    windivert_nbl_count_init(&nbl_count);
     RtlZeroMemory(&pool_params, sizeof(pool_params));
     pool_params.Header.Type = NDIS_OBJECT_TYPE_DEFAULT;
     pool_params.Header.Revision = NET_BUFFER_LIST_POOL_PARAMETERS_REVISION_1;
@@ -600,6 +559,20 @@ extern NTSTATUS DriverEntry(IN PDRIVER_OBJECT driver_obj,
         DEBUG_ERROR("failed to allocate net buffer list pool", status);
         return status;
     }
+    RtlZeroMemory(&nb_pool_params, sizeof(nb_pool_params));
+    nb_pool_params.Header.Type = NDIS_OBJECT_TYPE_DEFAULT;
+    nb_pool_params.Header.Revision = NET_BUFFER_POOL_PARAMETERS_REVISION_1;
+    nb_pool_params.Header.Size =
+        NDIS_SIZEOF_NET_BUFFER_POOL_PARAMETERS_REVISION_1;
+    nb_pool_params.PoolTag = WINDIVERT_NET_BUFFER_LIST_TAG;
+    nb_pool_params.DataSize = 0;
+    nb_pool_handle = NdisAllocateNetBufferPool(NULL, &nb_pool_params);
+    if (nb_pool_handle == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to allocate net buffer pool", status);
+        return status;
+    }
 
     return STATUS_SUCCESS;
 }
@@ -609,10 +582,20 @@ extern NTSTATUS DriverEntry(IN PDRIVER_OBJECT driver_obj,
  */
 extern VOID windivert_unload(IN WDFDRIVER Driver)
 {
+    LARGE_INTEGER delay;
+
     DEBUG("UNLOAD: unloading the WinDivert driver");
+
+    // The pools cannot be freed until every (re)injection has completed:
+    delay.QuadPart = -10000;                    // 1ms
+    while (nbl_count.used != 0)
+    {
+        KeDelayExecutionThread(KernelMode, FALSE, &delay);
+    }
     FwpsInjectionHandleDestroy0(inject_handle);
     FwpsInjectionHandleDestroy0(injectv6_handle);
-    NdisFreeNetBufferPool(pool_handle);
+    NdisFreeNetBufferListPool(pool_handle);
+    NdisFreeNetBufferPool(nb_pool_handle);
 }
 
 /*
@@ -650,7 +633,6 @@ extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
     IN WDFFILEOBJECT object)
 {
     NET_BUFFER_LIST_POOL_PARAMETERS pool_params;
-    WDF_IO_QUEUE_CONFIG queue_config;
     WDF_TIMER_CONFIG timer_config;
     WDF_OBJECT_ATTRIBUTES timer_attributes;
     FWPM_SESSION0 session;
@@ -665,7 +647,7 @@ extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
     context->magic  = WINDIVERT_CONTEXT_MAGIC;
     context->state  = WINDIVERT_CONTEXT_STATE_OPENING;
     context->device = device;
-    context->packet_queue_length = 0;
+    context->queue_count = WINDIVERT_PARAM_QUEUE_COUNT_DEFAULT;
     context->packet_queue_maxlength = WINDIVERT_PARAM_QUEUE_LEN_DEFAULT;
     context->timer_timeout = WINDIVERT_PARAM_QUEUE_TIME_DEFAULT;
     context->layer_0     = WINDIVERT_LAYER_DEFAULT;
@@ -675,14 +657,21 @@ extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
     context->priority_0  = WINDIVERT_PRIORITY_DEFAULT;
     context->priority    = WINDIVERT_PRIORITY_DEFAULT;
     context->read_thread = NULL;
-    context->filter      = NULL;
+    windivert_filter_ref_init(&context->filter_ref, NULL);
+    KeInitializeMutex(&context->filter_mutex, 0);
     for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
     {
         context->registered[i] = FALSE;
     }
     context->filter_on = FALSE;
     KeInitializeSpinLock(&context->lock);
-    InitializeListHead(&context->packet_queue);
+    for (i = 0; i < WINDIVERT_PARAM_QUEUE_COUNT_MAX; i++)
+    {
+        KeInitializeSpinLock(&context->queues[i].lock);
+        InitializeListHead(&context->queues[i].packet_queue);
+        context->queues[i].packet_queue_length = 0;
+        context->queues[i].read_queue = NULL;
+    }
     for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
     {
         status = ExUuidCreate(&context->sublayer_guid[i]);
@@ -711,12 +700,9 @@ extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
     pool_params.fAllocateNetBuffer = TRUE;
     pool_params.PoolTag = WINDIVERT_NET_BUFFER_LIST_TAG;
     pool_params.DataSize = 0;
-    WDF_IO_QUEUE_CONFIG_INIT(&queue_config, WdfIoQueueDispatchManual);
-    status = WdfIoQueueCreate(device, &queue_config, WDF_NO_OBJECT_ATTRIBUTES,
-        &context->read_queue);
+    status = windivert_queue_create(context, &context->queues[0]);
     if (!NT_SUCCESS(status))
     {
-        DEBUG_ERROR("failed to create I/O read queue", status);
         goto windivert_create_exit;
     }
     KeInitializeEvent(&context->read_event, NotificationEvent, FALSE);
@@ -761,9 +747,9 @@ windivert_create_exit:
     if (!NT_SUCCESS(status))
     {
         context->state = WINDIVERT_CONTEXT_STATE_INVALID;
-        if (context->read_queue != NULL)
+        if (context->queues[0].read_queue != NULL)
         {
-            WdfObjectDelete(context->read_queue);
+            WdfObjectDelete(context->queues[0].read_queue);
         }
         if (context->timer != NULL)
         {
@@ -786,45 +772,52 @@ windivert_create_exit:
 }
 
 /*
- * Register all WFP callouts.
+ * Register all WFP callouts (that are not already registered).
  */
 static NTSTATUS windivert_register_callouts(context_t context, BOOL is_inbound,
     BOOL is_outbound, BOOL is_ipv4, BOOL is_ipv6)
 {
-    UINT8 i, j;
+    UINT8 i;
     layer_t layers[WINDIVERT_CONTEXT_MAXLAYERS];
+    BOOL added[WINDIVERT_CONTEXT_MAXLAYERS];
     NTSTATUS status;
 
-    i = 0;
+    // Each WFP layer has a fixed slot, so that a filter change can add the
+    // missing callouts to a running handle.
+    for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
+    {
+        layers[i] = NULL;
+        added[i] = FALSE;
+    }
     switch (context->layer)
     {
         case WINDIVERT_LAYER_NETWORK:
             if (is_inbound && is_ipv4)
             {
-                layers[i++] = layer_inbound_network_ipv4;
+                layers[0] = layer_inbound_network_ipv4;
             }
             if (is_outbound && is_ipv4)
             {
-                layers[i++] = layer_outbound_network_ipv4;
+                layers[1] = layer_outbound_network_ipv4;
             }
             if (is_inbound && is_ipv6)
             {
-                layers[i++] = layer_inbound_network_ipv6;
+                layers[2] = layer_inbound_network_ipv6;
             }
             if (is_outbound && is_ipv6)
             {
-                layers[i++] = layer_outbound_network_ipv6;
+                layers[3] = layer_outbound_network_ipv6;
             }
             break;
 
         case WINDIVERT_LAYER_NETWORK_FORWARD:
             if (is_ipv4)
             {
-                layers[i++] = layer_forward_network_ipv4;
+                layers[0] = layer_forward_network_ipv4;
             }
             if (is_ipv6)
             {
-                layers[i++] = layer_forward_network_ipv6;
+                layers[1] = layer_forward_network_ipv6;
             }
             break;
 
@@ -838,9 +831,14 @@ static NTSTATUS windivert_register_callouts(context_t context, BOOL is_inbound,
         DEBUG_ERROR("failed to begin WFP transaction", status);
         goto windivert_register_callouts_exit;
     }
-    for (j = 0; j < i; j++)
+    for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
     {
-        status = windivert_register_callout(context, j, layers[j]);
+        if (layers[i] == NULL || context->registered[i])
+        {
+            continue;
+        }
+        added[i] = TRUE;
+        status = windivert_register_callout(context, i, layers[i]);
         if (!NT_SUCCESS(status))
         {
             FwpmTransactionAbort0(context->engine_handle);
@@ -858,12 +856,12 @@ windivert_register_callouts_exit:
 
     if (!NT_SUCCESS(status))
     {
-        for (j = 0; j < i; j++)
+        for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
         {
-            if (context->registered[j])
+            if (added[i] && context->registered[i])
             {
-                FwpsCalloutUnregisterByKey0(&context->callout_guid[j]);
-                context->registered[j] = FALSE;
+                FwpsCalloutUnregisterByKey0(&context->callout_guid[i]);
+                context->registered[i] = FALSE;
             }
         }
     }
@@ -948,6 +946,126 @@ windivert_register_callout_error:
     return status;
 }
 
+/*
+ * Remove and unregister all WFP callouts.
+ */
+static NTSTATUS windivert_unregister_callouts(context_t context)
+{
+    UINT i;
+    NTSTATUS status;
+
+    status = FwpmTransactionBegin0(context->engine_handle, 0);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to begin WFP transaction", status);
+        goto windivert_unregister_callouts_exit;
+    }
+    for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
+    {
+        if (!context->registered[i])
+        {
+            continue;
+        }
+        status = FwpmFilterDeleteByKey0(context->engine_handle,
+            context->filter_guid+i);
+        if (!NT_SUCCESS(status))
+        {
+            DEBUG_ERROR("failed delete WFP filter", status);
+            FwpmTransactionAbort0(context->engine_handle);
+            goto windivert_unregister_callouts_exit;
+        }
+        status = FwpmCalloutDeleteByKey0(context->engine_handle,
+            context->callout_guid+i);
+        if (!NT_SUCCESS(status))
+        {
+            DEBUG_ERROR("failed delete WFP callout", status);
+            FwpmTransactionAbort0(context->engine_handle);
+            goto windivert_unregister_callouts_exit;
+        }
+        status = FwpmSubLayerDeleteByKey0(context->engine_handle,
+            context->sublayer_guid+i);
+        if (!NT_SUCCESS(status))
+        {
+            DEBUG_ERROR("failed delete WFP sub-layer", status);
+            FwpmTransactionAbort0(context->engine_handle);
+            goto windivert_unregister_callouts_exit;
+        }
+    }
+    status = FwpmTransactionCommit0(context->engine_handle);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to commit WFP transaction", status);
+        goto windivert_unregister_callouts_exit;
+    }
+
+windivert_unregister_callouts_exit:
+    for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
+    {
+        if (context->registered[i])
+        {
+            FwpsCalloutUnregisterByKey0(&context->callout_guid[i]);
+            context->registered[i] = FALSE;
+        }
+    }
+    return status;
+}
+
+/*
+ * Return an open context to its initial (just created) state so that the
+ * handle can be re-used with a new filter.
+ */
+static NTSTATUS windivert_reset(context_t context)
+{
+    queue_t queue;
+    filter_t filter;
+    UINT i;
+    NTSTATUS status;
+
+    if (!context->filter_on)
+    {
+        return STATUS_SUCCESS;
+    }
+    KeWaitForSingleObject(&context->filter_mutex, Executive, KernelMode,
+        FALSE, NULL);
+    status = windivert_unregister_callouts(context);
+    if (!NT_SUCCESS(status))
+    {
+        // The callouts are gone, but the WFP objects may remain (until the
+        // handle is closed), so the handle cannot be re-used.
+        KeReleaseMutex(&context->filter_mutex, FALSE);
+        return status;
+    }
+
+    // Discard queued packets and pending reads:
+    for (i = 0; i < WINDIVERT_PARAM_QUEUE_COUNT_MAX &&
+            context->queues[i].read_queue != NULL; i++)
+    {
+        queue = &context->queues[i];
+        windivert_queue_flush(queue);
+        WdfIoQueuePurgeSynchronously(queue->read_queue);
+        WdfIoQueueStart(queue->read_queue);
+    }
+
+    filter = windivert_filter_swap(&context->filter_ref, NULL);
+    if (filter != NULL)
+    {
+        ExFreePoolWithTag(filter, WINDIVERT_FILTER_TAG);
+    }
+    context->queue_count = WINDIVERT_PARAM_QUEUE_COUNT_DEFAULT;
+    context->packet_queue_maxlength = WINDIVERT_PARAM_QUEUE_LEN_DEFAULT;
+    context->timer_timeout = WINDIVERT_PARAM_QUEUE_TIME_DEFAULT;
+    context->layer_0     = WINDIVERT_LAYER_DEFAULT;
+    context->layer       = WINDIVERT_LAYER_DEFAULT;
+    context->flags_0     = 0;
+    context->flags       = 0;
+    context->priority_0  = WINDIVERT_PRIORITY_DEFAULT;
+    context->priority    = WINDIVERT_PRIORITY_DEFAULT;
+    InterlockedExchange(&context->filter_on, FALSE);
+    KeReleaseMutex(&context->filter_mutex, FALSE);
+    WdfTimerStop(context->timer, TRUE);
+    return STATUS_SUCCESS;
+}
+
 /*
  * WinDivert old-packet cleanup routine.
  */
@@ -957,7 +1075,10 @@ extern VOID windivert_timer(IN WDFTIMER timer)
     PLIST_ENTRY entry;
     WDFFILEOBJECT object = (WDFFILEOBJECT)WdfTimerGetParentObject(timer);
     context_t context = windivert_context_get(object);
+    queue_t queue;
     packet_t packet;
+    LONG peak;
+    UINT i;
 
     if (!windivert_context_verify(context, WINDIVERT_CONTEXT_STATE_OPEN))
     {
@@ -968,31 +1089,44 @@ extern VOID windivert_timer(IN WDFTIMER timer)
     //     context->timer_ticktock);
 
     // Sweep away old packets.
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    while (!IsListEmpty(&context->packet_queue))
+    for (i = 0; i < WINDIVERT_PARAM_QUEUE_COUNT_MAX &&
+            context->queues[i].read_queue != NULL; i++)
     {
-        entry = RemoveHeadList(&context->packet_queue);
-        packet = CONTAINING_RECORD(entry, struct packet_s, entry);
-        if (packet->timer_ticktock == context->timer_ticktock)
+        queue = &context->queues[i];
+        KeAcquireInStackQueuedSpinLock(&queue->lock, &lock_handle);
+        while (!IsListEmpty(&queue->packet_queue))
         {
-            InsertHeadList(&context->packet_queue, entry);
-            break;
+            entry = RemoveHeadList(&queue->packet_queue);
+            packet = CONTAINING_RECORD(entry, struct packet_s, entry);
+            if (packet->timer_ticktock == context->timer_ticktock)
+            {
+                InsertHeadList(&queue->packet_queue, entry);
+                break;
+            }
+            queue->packet_queue_length--;
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+            // Packet is old, dispose of it.
+            DEBUG("TIMEOUT (context=%p, packet=%p)", context, packet);
+            windivert_free_packet(packet);
+            KeAcquireInStackQueuedSpinLock(&queue->lock, &lock_handle);
         }
-        context->packet_queue_length--;
         KeReleaseInStackQueuedSpinLock(&lock_handle);
-
-        // Packet is old, dispose of it.
-        DEBUG("TIMEOUT (context=%p, packet=%p)", context, packet);
-        windivert_free_packet(packet);
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
     }
 
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
     context->timer_ticktock = !context->timer_ticktock;
 
-    // Restart the timer.
-    WdfTimerStart(context->timer,
-        WDF_REL_TIMEOUT_IN_MS(context->timer_timeout));
+    // NET_BUFFER_LISTs in use (by injections and sniffed clones):
+    peak = windivert_nbl_count_sample(&nbl_count);
+    DEBUG("TIMER: %ld NET_BUFFER_LISTs in use (peak %ld)", nbl_count.used,
+        peak);
+
+    // Restart the timer (unless the handle has been reset).
+    if (context->filter_on)
+    {
+        WdfTimerStart(context->timer,
+            WDF_REL_TIMEOUT_IN_MS(context->timer_timeout));
+    }
 }
 
 /*
@@ -1001,11 +1135,9 @@ extern VOID windivert_timer(IN WDFTIMER timer)
 extern VOID windivert_cleanup(IN WDFFILEOBJECT object)
 {
     KLOCK_QUEUE_HANDLE lock_handle;
-    PLIST_ENTRY entry;
-    UINT i;
     context_t context = windivert_context_get(object);
-    packet_t packet;
-    NTSTATUS status;
+    queue_t queue;
+    UINT i;
     
     DEBUG("CLEANUP: cleaning up WinDivert context (context=%p)", context);
     
@@ -1017,68 +1149,23 @@ extern VOID windivert_cleanup(IN WDFFILEOBJECT object)
     KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
     context->state = WINDIVERT_CONTEXT_STATE_CLOSING;
     KeSetEvent(&context->read_event, IO_NO_INCREMENT, FALSE);
-    while (!IsListEmpty(&context->packet_queue))
-    {
-        entry = RemoveHeadList(&context->packet_queue);
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        packet = CONTAINING_RECORD(entry, struct packet_s, entry);
-        windivert_free_packet(packet);
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    }
     KeReleaseInStackQueuedSpinLock(&lock_handle);
-    WdfIoQueuePurge(context->read_queue, NULL, NULL);
-    WdfObjectDelete(context->read_queue);
-    WdfObjectDelete(context->timer);
-
-    status = FwpmTransactionBegin0(context->engine_handle, 0);
-    if (!NT_SUCCESS(status))
-    {
-        DEBUG_ERROR("failed to begin WFP transaction", status);
-        goto windivert_cleanup_exit;
-    }
-    for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
-    {
-	    if (!context->registered[i])
-	    {
-	        continue;
-	    }
-        status = FwpmFilterDeleteByKey0(context->engine_handle,
-            context->filter_guid+i);
-        if (!NT_SUCCESS(status))
-        {
-            DEBUG_ERROR("failed delete WFP filter", status);
-            FwpmTransactionAbort0(context->engine_handle);
-            goto windivert_cleanup_exit;
-        }
-        status = FwpmSubLayerDeleteByKey0(context->engine_handle,
-            context->sublayer_guid+i);
-        if (!NT_SUCCESS(status))
-        {
-            DEBUG_ERROR("failed delete WFP sub-layer", status);
-            FwpmTransactionAbort0(context->engine_handle);
-            goto windivert_cleanup_exit;
-        }
-    }
-    status = FwpmTransactionCommit0(context->engine_handle);
-    if (!NT_SUCCESS(status))
+    for (i = 0; i < WINDIVERT_PARAM_QUEUE_COUNT_MAX &&
+            context->queues[i].read_queue != NULL; i++)
     {
-        DEBUG_ERROR("failed to commit WFP transaction", status);
-        goto windivert_cleanup_exit;
+        queue = &context->queues[i];
+        windivert_queue_flush(queue);
+        WdfIoQueuePurge(queue->read_queue, NULL, NULL);
+        WdfObjectDelete(queue->read_queue);
     }
+    WdfObjectDelete(context->timer);
 
-windivert_cleanup_exit:
+    windivert_unregister_callouts(context);
     FwpmEngineClose0(context->engine_handle);
-    for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
-    {
-        if (context->registered[i])
-        {
-            FwpsCalloutUnregisterByKey0(&context->callout_guid[i]);
-        }
-    }
-    if (context->filter != NULL)
+    if (context->filter_ref.filter != NULL)
     {   
-        ExFreePoolWithTag(context->filter, WINDIVERT_FILTER_TAG);
-        context->filter = NULL;
+        ExFreePoolWithTag(context->filter_ref.filter, WINDIVERT_FILTER_TAG);
+        context->filter_ref.filter = NULL;
     }
     KeWaitForSingleObject(context->read_thread, Executive, KernelMode, FALSE,
         NULL);
@@ -1104,7 +1191,8 @@ extern VOID windivert_close(IN WDFFILEOBJECT object)
 /*
  * WinDivert read routine.
  */
-static NTSTATUS windivert_read(context_t context, WDFREQUEST request)
+static NTSTATUS windivert_read(context_t context, queue_t queue,
+    WDFREQUEST request)
 {
     NTSTATUS status = STATUS_SUCCESS;
 
@@ -1112,7 +1200,7 @@ static NTSTATUS windivert_read(context_t context, WDFREQUEST request)
         request);
 
     // Forward the request to the pending read queue:
-    status = WdfRequestForwardToIoQueue(request, context->read_queue);
+    status = WdfRequestForwardToIoQueue(request, queue->read_queue);
     if (!NT_SUCCESS(status))
     {
         DEBUG_ERROR("failed to forward I/O request to read queue", status);
@@ -1120,7 +1208,7 @@ static NTSTATUS windivert_read(context_t context, WDFREQUEST request)
     }
 
     // Service the read request:
-    windivert_read_service(context);
+    windivert_read_service(context, queue);
 
     return STATUS_SUCCESS;
 }
@@ -1132,6 +1220,7 @@ static void windivert_read_service_worker(PVOID context_0)
 {
     KLOCK_QUEUE_HANDLE lock_handle;
     context_t context = (context_t)context_0;
+    UINT i;
 
     /*
      * NOTE: We cannot verify the context because we do not know what state
@@ -1152,7 +1241,11 @@ static void windivert_read_service_worker(PVOID context_0)
         KeReleaseInStackQueuedSpinLock(&lock_handle);
 
         // Service reads:
-        windivert_read_service(context);
+        for (i = 0; i < WINDIVERT_PARAM_QUEUE_COUNT_MAX &&
+                context->queues[i].read_queue != NULL; i++)
+        {
+            windivert_read_service(context, &context->queues[i]);
+        }
     }
 
     KeReleaseInStackQueuedSpinLock(&lock_handle);
@@ -1162,7 +1255,7 @@ static void windivert_read_service_worker(PVOID context_0)
 /*
  * WinDivert read request service.
  */
-static void windivert_read_service(context_t context)
+static void windivert_read_service(context_t context, queue_t queue)
 {
     KLOCK_QUEUE_HANDLE lock_handle;
     WDFREQUEST request;
@@ -1177,17 +1270,17 @@ static void windivert_read_service(context_t context)
 
     DEBUG("windivert_read_service");
 
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    KeAcquireInStackQueuedSpinLock(&queue->lock, &lock_handle);
     while (context->state == WINDIVERT_CONTEXT_STATE_OPEN &&
-           !IsListEmpty(&context->packet_queue))
+           !IsListEmpty(&queue->packet_queue))
     {
-        status = WdfIoQueueRetrieveNextRequest(context->read_queue, &request);
+        status = WdfIoQueueRetrieveNextRequest(queue->read_queue, &request);
         if (!NT_SUCCESS(status))
         {
             break;
         }
-        entry = RemoveHeadList(&context->packet_queue);
-        context->packet_queue_length--;
+        entry = RemoveHeadList(&queue->packet_queue);
+        queue->packet_queue_length--;
         KeReleaseInStackQueuedSpinLock(&lock_handle);
         packet = CONTAINING_RECORD(entry, struct packet_s, entry);
         
@@ -1251,11 +1344,82 @@ windivert_read_service_complete:
         {
             WdfRequestComplete(request, status);
         }
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+        KeAcquireInStackQueuedSpinLock(&queue->lock, &lock_handle);
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+}
+
+/*
+ * Create a queue's read queue.
+ */
+static NTSTATUS windivert_queue_create(context_t context, queue_t queue)
+{
+    WDF_IO_QUEUE_CONFIG queue_config;
+    NTSTATUS status;
+
+    WDF_IO_QUEUE_CONFIG_INIT(&queue_config, WdfIoQueueDispatchManual);
+    status = WdfIoQueueCreate(context->device, &queue_config,
+        WDF_NO_OBJECT_ATTRIBUTES, &queue->read_queue);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to create I/O read queue", status);
+        queue->read_queue = NULL;
+    }
+    return status;
+}
+
+/*
+ * Remove and free all packets in a queue.
+ */
+static void windivert_queue_flush(queue_t queue)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PLIST_ENTRY entry;
+    packet_t packet;
+
+    KeAcquireInStackQueuedSpinLock(&queue->lock, &lock_handle);
+    while (!IsListEmpty(&queue->packet_queue))
+    {
+        entry = RemoveHeadList(&queue->packet_queue);
+        queue->packet_queue_length--;
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        packet = CONTAINING_RECORD(entry, struct packet_s, entry);
+        windivert_free_packet(packet);
+        KeAcquireInStackQueuedSpinLock(&queue->lock, &lock_handle);
     }
     KeReleaseInStackQueuedSpinLock(&lock_handle);
 }
 
+/*
+ * Set the number of queues that packets are spread over.  Queues are
+ * created on demand and are never destroyed (until the handle is closed),
+ * so packets and reads on queues beyond a reduced count are unaffected.
+ */
+static NTSTATUS windivert_queue_set_count(context_t context, UINT count)
+{
+    UINT i;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    KeWaitForSingleObject(&context->filter_mutex, Executive, KernelMode,
+        FALSE, NULL);
+    for (i = 0; i < count; i++)
+    {
+        if (context->queues[i].read_queue == NULL)
+        {
+            status = windivert_queue_create(context, &context->queues[i]);
+            if (!NT_SUCCESS(status))
+            {
+                goto windivert_queue_set_count_exit;
+            }
+        }
+    }
+    context->queue_count = count;
+
+windivert_queue_set_count_exit:
+    KeReleaseMutex(&context->filter_mutex, FALSE);
+    return status;
+}
+
 /*
  * WinDivert write routine.
  */
@@ -1326,8 +1490,7 @@ static NTSTATUS windivert_write(context_t context, WDFREQUEST request,
             goto windivert_write_exit;
     }
 
-    status = FwpsAllocateNetBufferAndNetBufferList0(pool_handle, 0, 0, mdl,
-        0, data_len, &buffers);
+    status = windivert_nbl_alloc(mdl, 0, data_len, &buffers);
     if (!NT_SUCCESS(status))
     {
         DEBUG_ERROR("failed to create NET_BUFFER_LIST for injected packet",
@@ -1363,7 +1526,7 @@ windivert_write_exit:
         DEBUG_ERROR("failed to (re)inject packet", status);
         if (buffers != NULL)
         {
-            FwpsFreeNetBufferList0(buffers);
+            windivert_nbl_free(buffers);
         }
     }
 
@@ -1394,7 +1557,7 @@ static void NTAPI windivert_inject_complete(VOID *context,
     {
         DEBUG_ERROR("failed to inject packet", status);
     }
-    FwpsFreeNetBufferList0(buffers);
+    windivert_nbl_free(buffers);
     WdfRequestCompleteWithInformation(request, status, length);
 }
 
@@ -1484,11 +1647,9 @@ VOID windivert_caller_context(IN WDFDEVICE device, IN WDFREQUEST request)
             break;
 
         case IOCTL_WINDIVERT_START_FILTER:
-            status = STATUS_INVALID_DEVICE_REQUEST;
-            DEBUG_ERROR("arg pointer is non-NULL for SET_FILTER ioctl",
-                status);
-            goto windivert_caller_context_error;
-
+        case IOCTL_WINDIVERT_OPEN:
+        case IOCTL_WINDIVERT_RESET:
+        case IOCTL_WINDIVERT_SET_FILTER:
         case IOCTL_WINDIVERT_SET_LAYER:
         case IOCTL_WINDIVERT_SET_PRIORITY:
         case IOCTL_WINDIVERT_SET_FLAGS:
@@ -1528,6 +1689,7 @@ extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
     size_t inbuflen, outbuflen, filter_len;
     windivert_ioctl_t ioctl;
     windivert_ioctl_filter_t filter;
+    windivert_ioctl_open_t ioctl_open;
     windivert_addr_t addr;
     req_context_t req_context;
     NTSTATUS status = STATUS_SUCCESS;
@@ -1553,7 +1715,8 @@ extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
     }
     switch (code)
     {
-        case IOCTL_WINDIVERT_START_FILTER: case IOCTL_WINDIVERT_GET_PARAM:
+        case IOCTL_WINDIVERT_START_FILTER: case IOCTL_WINDIVERT_OPEN:
+        case IOCTL_WINDIVERT_SET_FILTER: case IOCTL_WINDIVERT_GET_PARAM:
             status = WdfRequestRetrieveOutputBuffer(request, 0, &outbuf,
                 &outbuflen);
             if (!NT_SUCCESS(status))
@@ -1572,7 +1735,16 @@ extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
     switch (code)
     {
         case IOCTL_WINDIVERT_RECV:
-            status = windivert_read(context, request);
+            ioctl = (windivert_ioctl_t)inbuf;
+            if (ioctl->arg8 >= WINDIVERT_PARAM_QUEUE_COUNT_MAX ||
+                context->queues[ioctl->arg8].read_queue == NULL)
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to read; invalid queue", status);
+                goto windivert_ioctl_exit;
+            }
+            status = windivert_read(context, &context->queues[ioctl->arg8],
+                request);
             if (NT_SUCCESS(status))
             {
                 return;
@@ -1591,49 +1763,68 @@ extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
             break;
         
         case IOCTL_WINDIVERT_START_FILTER:
-        {
-            BOOL is_inbound, is_outbound, is_ipv4, is_ipv6;
-
             if (InterlockedExchange(&context->filter_on, TRUE) == TRUE)
             {
                 status = STATUS_INVALID_DEVICE_REQUEST;
                 DEBUG_ERROR("duplicate SET_FILTER ioctl", status);
                 goto windivert_ioctl_exit;
             }
-
-            context->layer = context->layer_0;
-            context->flags = context->flags_0;
-            context->priority = context->priority_0;
-
+            ioctl = (windivert_ioctl_t)inbuf;
             filter = (windivert_ioctl_filter_t)outbuf;
             filter_len = outbuflen;
-            context->filter = windivert_filter_compile(filter, filter_len);
-            if (context->filter == NULL)
+            status = windivert_start_filter(context, filter, filter_len,
+                ioctl->arg);
+            break;
+
+        case IOCTL_WINDIVERT_OPEN:
+            // Everything is validated before anything is applied:
+            ioctl_open = (windivert_ioctl_open_t)outbuf;
+            if (!windivert_open_verify(ioctl_open, outbuflen))
             {
                 status = STATUS_INVALID_DEVICE_REQUEST;
-                DEBUG_ERROR("failed to compile filter", status);
+                DEBUG_ERROR("failed to open; invalid open message", status);
                 goto windivert_ioctl_exit;
             }
-
-            if ((context->flags & WINDIVERT_FLAG_PASSTHRU) != 0)
+            if (InterlockedExchange(&context->filter_on, TRUE) == TRUE)
             {
-                // Passthru mode.
-                is_inbound = is_outbound = is_ipv4 = is_ipv6 = FALSE;
+                status = STATUS_INVALID_DEVICE_REQUEST;
+                DEBUG_ERROR("duplicate OPEN ioctl", status);
+                goto windivert_ioctl_exit;
+            }
+            context->layer_0 = ioctl_open->layer;
+            context->flags_0 = ioctl_open->flags;
+            context->priority_0 = ioctl_open->priority;
+            if (ioctl_open->queue_len != 0)
+            {
+                context->packet_queue_maxlength = (ULONG)ioctl_open->queue_len;
             }
-            else
+            if (ioctl_open->queue_time != 0)
             {
-                windivert_filter_analyze(context->filter, &is_inbound,
-                    &is_outbound, &is_ipv4, &is_ipv6);
+                context->timer_timeout = (UINT)ioctl_open->queue_time;
             }
-            status = windivert_register_callouts(context, is_inbound,
-                is_outbound, is_ipv4, is_ipv6);
+            filter = (windivert_ioctl_filter_t)(ioctl_open + 1);
+            filter_len = outbuflen - sizeof(struct windivert_ioctl_open_s);
+            status = windivert_start_filter(context, filter, filter_len,
+                (UINT64)ioctl_open->filter_len);
+            break;
 
-            // Start the timer.
-            WdfTimerStart(context->timer,
-                WDF_REL_TIMEOUT_IN_MS(context->timer_timeout));
+        case IOCTL_WINDIVERT_RESET:
+            status = windivert_reset(context);
+            break;
 
+        case IOCTL_WINDIVERT_SET_FILTER:
+            ioctl = (windivert_ioctl_t)inbuf;
+            if (ioctl->arg8 != context->layer)
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to set filter; wrong layer", status);
+                goto windivert_ioctl_exit;
+            }
+            filter = (windivert_ioctl_filter_t)outbuf;
+            filter_len = outbuflen;
+            status = windivert_set_filter(context, filter, filter_len,
+                ioctl->arg);
             break;
-        }
 
         case IOCTL_WINDIVERT_SET_LAYER:
             ioctl = (windivert_ioctl_t)inbuf;
@@ -1698,6 +1889,18 @@ extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
                     context->timer_timeout = (UINT)value;
                     break;
 
+                case WINDIVERT_PARAM_QUEUE_COUNT:
+                    if (value < WINDIVERT_PARAM_QUEUE_COUNT_MIN ||
+                        value > WINDIVERT_PARAM_QUEUE_COUNT_MAX)
+                    {
+                        status = STATUS_INVALID_DEVICE_REQUEST;
+                        DEBUG_ERROR("failed to set queue count; invalid "
+                            "value", status);
+                        goto windivert_ioctl_exit;
+                    }
+                    status = windivert_queue_set_count(context, (UINT)value);
+                    break;
+
                 default:
                     status = STATUS_INVALID_DEVICE_REQUEST;
                     DEBUG_ERROR("failed to set parameter; invalid parameter",
@@ -1724,6 +1927,9 @@ extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
                 case WINDIVERT_PARAM_QUEUE_TIME:
                     *valptr = context->timer_timeout;
                     break;
+                case WINDIVERT_PARAM_QUEUE_COUNT:
+                    *valptr = context->queue_count;
+                    break;
                 default:
                     status = STATUS_INVALID_DEVICE_REQUEST;
                     DEBUG_ERROR("failed to get parameter; invalid parameter",
@@ -1743,6 +1949,105 @@ windivert_ioctl_exit:
     WdfRequestComplete(request, status);
 }
 
+/*
+ * Compile the filter, register the callouts and start the timer.
+ */
+static NTSTATUS windivert_start_filter(context_t context,
+    windivert_ioctl_filter_t filter, size_t filter_len, UINT64 length)
+{
+    BOOL is_inbound, is_outbound, is_ipv4, is_ipv6;
+    NTSTATUS status;
+
+    KeWaitForSingleObject(&context->filter_mutex, Executive, KernelMode,
+        FALSE, NULL);
+    context->layer = context->layer_0;
+    context->flags = context->flags_0;
+    context->priority = context->priority_0;
+
+    context->filter_ref.filter = windivert_filter_compile(filter,
+        filter_len, length);
+    if (context->filter_ref.filter == NULL)
+    {
+        KeReleaseMutex(&context->filter_mutex, FALSE);
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        DEBUG_ERROR("failed to compile filter", status);
+        return status;
+    }
+
+    if ((context->flags & WINDIVERT_FLAG_PASSTHRU) != 0)
+    {
+        // Passthru mode.
+        is_inbound = is_outbound = is_ipv4 = is_ipv6 = FALSE;
+    }
+    else
+    {
+        windivert_filter_analyze(context->filter_ref.filter, &is_inbound,
+            &is_outbound, &is_ipv4, &is_ipv6);
+    }
+    status = windivert_register_callouts(context, is_inbound,
+        is_outbound, is_ipv4, is_ipv6);
+    KeReleaseMutex(&context->filter_mutex, FALSE);
+
+    // Start the timer.
+    WdfTimerStart(context->timer,
+        WDF_REL_TIMEOUT_IN_MS(context->timer_timeout));
+
+    return status;
+}
+
+/*
+ * Replace the filter of a started handle.
+ */
+static NTSTATUS windivert_set_filter(context_t context,
+    windivert_ioctl_filter_t filter, size_t filter_len, UINT64 length)
+{
+    BOOL is_inbound, is_outbound, is_ipv4, is_ipv6;
+    filter_t new_filter, old_filter;
+    NTSTATUS status;
+
+    new_filter = windivert_filter_compile(filter, filter_len, length);
+    if (new_filter == NULL)
+    {
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        DEBUG_ERROR("failed to compile filter", status);
+        return status;
+    }
+
+    KeWaitForSingleObject(&context->filter_mutex, Executive, KernelMode,
+        FALSE, NULL);
+    if (context->filter_ref.filter == NULL)
+    {
+        KeReleaseMutex(&context->filter_mutex, FALSE);
+        ExFreePoolWithTag(new_filter, WINDIVERT_FILTER_TAG);
+        status = STATUS_INVALID_DEVICE_STATE;
+        DEBUG_ERROR("failed to set filter; filter not started", status);
+        return status;
+    }
+
+    // Add any callouts the new filter needs.  Until the new filter is
+    // published, the old filter rejects every packet from these callouts.
+    // Callouts that only the old filter needed are kept.
+    if ((context->flags & WINDIVERT_FLAG_PASSTHRU) == 0)
+    {
+        windivert_filter_analyze(new_filter, &is_inbound, &is_outbound,
+            &is_ipv4, &is_ipv6);
+        status = windivert_register_callouts(context, is_inbound,
+            is_outbound, is_ipv4, is_ipv6);
+        if (!NT_SUCCESS(status))
+        {
+            KeReleaseMutex(&context->filter_mutex, FALSE);
+            ExFreePoolWithTag(new_filter, WINDIVERT_FILTER_TAG);
+            return status;
+        }
+    }
+
+    old_filter = windivert_filter_swap(&context->filter_ref, new_filter);
+    KeReleaseMutex(&context->filter_mutex, FALSE);
+    ExFreePoolWithTag(old_filter, WINDIVERT_FILTER_TAG);
+
+    return STATUS_SUCCESS;
+}
+
 /*
  * WinDivert notify callout.
  */
@@ -1911,10 +2216,17 @@ static void windivert_classify_callout(IN UINT8 direction, IN UINT32 if_idx,
     FWPS_PACKET_INJECTION_STATE packet_state;
     HANDLE packet_context;
     UINT32 priority;
-    PNET_BUFFER_LIST buffers, buffers_fst, buffers_itr;
-    PNET_BUFFER buffer;
-    BOOL outbound;
+    PNET_BUFFER_LIST buffers, buffers_fst, buffers_itr, buffers_nxt;
+    PNET_BUFFER buffer, batch[WINDIVERT_BATCH_MAX];
+    struct reinject_s group;
+    UINT64 verdicts;
+    UINT32 hashes[WINDIVERT_BATCH_MAX];
+    UINT i, count, queue_count;
+    BOOL outbound, match;
     context_t context;
+    filter_t packet_filter;
+    queue_t queue;
+    LONG epoch;
     packet_t packet;
 
     // Basic checks:
@@ -1958,87 +2270,105 @@ static void windivert_classify_callout(IN UINT8 direction, IN UINT32 if_idx,
 
     /*
      * This code is complicated by the fact the a single NET_BUFFER_LIST
-     * may contain several NET_BUFFER structures.  Each NET_BUFFER needs to
-     * be filtered independently.  To achieve this we do the following:
-     * 1) First check if any NET_BUFFER passes the filter.
-     * 2) If no, then CONTINUE the entire NET_BUFFER_LIST.
-     * 3) Else, split the NET_BUFFER_LIST into individual NET_BUFFERs; and
-     *    either queue or re-inject based on the filter.
+     * chain may contain several packets.  Each packet needs to be filtered
+     * independently.  To achieve this we do the following:
+     * 1) Filter a batch of packets, recording the verdicts in a bitmap.
+     * 2) If no packet so far passes the filter, continue with the next
+     *    batch.  If no packet at all passes, PERMIT the entire chain.
+     * 3) Else, split the chain into individual packets; and either queue
+     *    or re-inject each based on its verdict.  Consecutive re-injected
+     *    packets of the same flow are grouped, and each group is injected
+     *    with a single call at the end.
      */
-
-    // Find the first NET_BUFFER we need to queue:
-    buffers_fst = buffers;
-    outbound = (direction == WINDIVERT_DIRECTION_OUTBOUND);
-    do
-    {
-        buffer = NET_BUFFER_LIST_FIRST_NB(buffers_fst);
-        if (windivert_filter(buffer, if_idx, sub_if_idx, outbound,
-            context->filter))
-        {
-            break;
-        }
-        buffers_fst= NET_BUFFER_LIST_NEXT_NBL(buffers_fst);
-    }
-    while (buffers_fst != NULL);
-
-    // No NET_BUFFER needs to be queued, permit the entire NET_BUFFER_LIST:
-    if (buffers_fst == NULL)
+    // The filter may be replaced at any time; this classify keeps using the
+    // filter it started with.
+    packet_filter = windivert_filter_enter(&context->filter_ref, &epoch);
+    if (packet_filter == NULL)
     {
+        windivert_filter_exit(&context->filter_ref, epoch);
         result->actionType = FWP_ACTION_PERMIT;
         return;
     }
-
-    if ((context->flags & WINDIVERT_FLAG_SNIFF) == 0)
+    group.first = NULL;
+    group.last  = NULL;
+    group.last_buffer = NULL;
+    windivert_group_init(&group.state);
+    outbound = (direction == WINDIVERT_DIRECTION_OUTBOUND);
+    queue_count = context->queue_count;
+    match = FALSE;
+    buffers_itr = buffers;
+    do
     {
-        // Re-inject all packets up to 'buffers_fst'
-        buffers_itr = buffers;
-        while (buffers_itr != buffers_fst)
+        // Filter the next batch:
+        buffers_fst = buffers_itr;
+        for (count = 0; count < WINDIVERT_BATCH_MAX && buffers_itr != NULL;
+                count++)
         {
-            buffer = NET_BUFFER_LIST_FIRST_NB(buffers_itr);
-            if (!windivert_reinject_packet(context, direction, isipv4, if_idx,
-                    sub_if_idx, priority, buffers, buffer))
-            {
-                goto windivert_classify_callout_exit;
-            }
+            batch[count] = NET_BUFFER_LIST_FIRST_NB(buffers_itr);
             buffers_itr = NET_BUFFER_LIST_NEXT_NBL(buffers_itr);
         }
-    }
-    else
-    {
-        buffers_itr = buffers_fst;
-    }
+        verdicts = windivert_filter_batch(batch, count, if_idx, sub_if_idx,
+            outbound, packet_filter, ((queue_count > 1 ||
+                (context->flags & WINDIVERT_FLAG_SNIFF) == 0)? hashes: NULL));
 
-    // Queue buffers_itr = buffers_fst, which matched our filter.
-    buffer = NET_BUFFER_LIST_FIRST_NB(buffers_itr);
-    if (!windivert_queue_packet(context, buffers, buffer, direction, if_idx,
-            sub_if_idx))
-    {
-        goto windivert_classify_callout_exit;
-    }
-    buffers_itr = NET_BUFFER_LIST_NEXT_NBL(buffers_itr);
-
-    // Queue or re-inject remaining packets.
-    while (buffers_itr != NULL)
-    {
-        buffer = NET_BUFFER_LIST_FIRST_NB(buffers_itr);
-        if (windivert_filter(buffer, if_idx, sub_if_idx, outbound,
-            context->filter))
+        if (!match)
         {
-            if (!windivert_queue_packet(context, buffers, buffer, direction,
-                    if_idx, sub_if_idx))
+            if (verdicts == 0)
             {
-                goto windivert_classify_callout_exit;
+                continue;
+            }
+            match = TRUE;
+
+            // Re-inject all packets before this batch:
+            if ((context->flags & WINDIVERT_FLAG_SNIFF) == 0)
+            {
+                for (buffers_nxt = buffers; buffers_nxt != buffers_fst;
+                        buffers_nxt = NET_BUFFER_LIST_NEXT_NBL(buffers_nxt))
+                {
+                    buffer = NET_BUFFER_LIST_FIRST_NB(buffers_nxt);
+                    if (!windivert_reinject_packet(&group, buffer,
+                            windivert_hash_packet(buffer), direction))
+                    {
+                        goto windivert_classify_callout_exit;
+                    }
+                }
             }
         }
-        else if ((context->flags & WINDIVERT_FLAG_SNIFF) == 0)
+
+        // Queue or re-inject the packets of this batch:
+        for (i = 0; i < count; i++)
         {
-            if (!windivert_reinject_packet(context, direction, isipv4, if_idx,
-                    sub_if_idx, priority, buffers, buffer))
+            buffer = batch[i];
+            if ((verdicts & ((UINT64)1 << i)) != 0)
+            {
+                windivert_group_close(&group.state);
+                queue = &context->queues[queue_count > 1?
+                    windivert_hash_queue(hashes[i], queue_count): 0];
+                if (!windivert_queue_packet(context, queue, buffers, buffer,
+                        direction, if_idx, sub_if_idx))
+                {
+                    goto windivert_classify_callout_exit;
+                }
+            }
+            else if ((context->flags & WINDIVERT_FLAG_SNIFF) == 0)
             {
-                goto windivert_classify_callout_exit;
+                if (!windivert_reinject_packet(&group, buffer, hashes[i],
+                        direction))
+                {
+                    goto windivert_classify_callout_exit;
+                }
             }
         }
     }
+    while (buffers_itr != NULL);
+
+    // No packet needs to be queued, permit the entire NET_BUFFER_LIST chain:
+    if (!match)
+    {
+        windivert_filter_exit(&context->filter_ref, epoch);
+        result->actionType = FWP_ACTION_PERMIT;
+        return;
+    }
 
     // Since new packets have been queued, service any read.
     if ((context->flags & WINDIVERT_FLAG_DROP) == 0)
@@ -2048,6 +2378,10 @@ static void windivert_classify_callout(IN UINT8 direction, IN UINT32 if_idx,
 
 windivert_classify_callout_exit:
 
+    windivert_filter_exit(&context->filter_ref, epoch);
+    windivert_reinject_group(context, direction, isipv4, if_idx, sub_if_idx,
+        priority, buffers, &group);
+
     if ((context->flags & WINDIVERT_FLAG_SNIFF) != 0)
     {
         result->actionType = FWP_ACTION_PERMIT;
@@ -2063,8 +2397,9 @@ windivert_classify_callout_exit:
 /*
  * Queue a NET_BUFFER.
  */
-static BOOL windivert_queue_packet(context_t context, PNET_BUFFER_LIST buffers,
-    PNET_BUFFER buffer, UINT8 direction, UINT32 if_idx, UINT32 sub_if_idx)
+static BOOL windivert_queue_packet(context_t context, queue_t queue,
+    PNET_BUFFER_LIST buffers, PNET_BUFFER buffer, UINT8 direction,
+    UINT32 if_idx, UINT32 sub_if_idx)
 {
     KLOCK_QUEUE_HANDLE lock_handle;
     NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO checksum_info;
@@ -2087,8 +2422,7 @@ static BOOL windivert_queue_packet(context_t context, PNET_BUFFER_LIST buffers,
     if ((context->flags & WINDIVERT_FLAG_SNIFF) != 0)
     {
         // Clone the buffer
-        status = FwpsAllocateNetBufferAndNetBufferList0(
-            pool_handle, 0, 0, NET_BUFFER_FIRST_MDL(buffer),
+        status = windivert_nbl_alloc(NET_BUFFER_FIRST_MDL(buffer),
             NET_BUFFER_DATA_OFFSET(buffer), NET_BUFFER_DATA_LENGTH(buffer),
             &packet->clone);
         if (!NT_SUCCESS(status))
@@ -2126,7 +2460,7 @@ static BOOL windivert_queue_packet(context_t context, PNET_BUFFER_LIST buffers,
     packet->timer_ticktock = context->timer_ticktock;
     entry = &packet->entry;
     FwpsReferenceNetBufferList0(buffers, FALSE);
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    KeAcquireInStackQueuedSpinLock(&queue->lock, &lock_handle);
     if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
     {
         // We are no longer open
@@ -2134,13 +2468,13 @@ static BOOL windivert_queue_packet(context_t context, PNET_BUFFER_LIST buffers,
         windivert_free_packet(packet);
         return FALSE;
     }
-    InsertTailList(&context->packet_queue, entry);
+    InsertTailList(&queue->packet_queue, entry);
     entry = NULL;
-    context->packet_queue_length++;
-    if (context->packet_queue_length > context->packet_queue_maxlength)
+    queue->packet_queue_length++;
+    if (queue->packet_queue_length > context->packet_queue_maxlength)
     {
-        entry = RemoveHeadList(&context->packet_queue);
-        context->packet_queue_length--;
+        entry = RemoveHeadList(&queue->packet_queue);
+        queue->packet_queue_length--;
     }
     KeReleaseInStackQueuedSpinLock(&lock_handle);
     if (entry != NULL)
@@ -2163,57 +2497,109 @@ static void windivert_free_packet(packet_t packet)
     FwpsDereferenceNetBufferList0(packet->buffers, FALSE);
     if (packet->clone != NULL)
     {
-        FwpsFreeNetBufferList0(packet->clone);
+        windivert_nbl_free(packet->clone);
     }
     ExFreePoolWithTag(packet, WINDIVERT_PACKET_TAG);
 }
 
 /*
- * Re-inject a NET_BUFFER.
+ * Add a clone of a NET_BUFFER to the re-inject groups: either to the last
+ * group (see windivert_group_next()), or as a new group.
  */
-static BOOL windivert_reinject_packet(context_t context, UINT8 direction,
-    BOOL isipv4, UINT32 if_idx, UINT32 sub_if_idx, UINT32 priority,
-    PNET_BUFFER_LIST buffers, PNET_BUFFER buffer)
+static BOOL windivert_reinject_packet(reinject_t group, PNET_BUFFER buffer,
+    UINT32 hash, UINT8 direction)
 {
     PNET_BUFFER_LIST buffers_cpy;
-    HANDLE handle;
+    PNET_BUFFER buffer_cpy;
     NTSTATUS status;
 
-    status = FwpsAllocateNetBufferAndNetBufferList0(
-        pool_handle, 0, 0, NET_BUFFER_FIRST_MDL(buffer),
+    if (windivert_group_next(&group->state, hash, direction) &&
+        group->last != NULL)
+    {
+        buffer_cpy = NdisAllocateNetBuffer(nb_pool_handle,
+            NET_BUFFER_FIRST_MDL(buffer), NET_BUFFER_DATA_OFFSET(buffer),
+            NET_BUFFER_DATA_LENGTH(buffer));
+        if (buffer_cpy == NULL)
+        {
+            return FALSE;
+        }
+        NET_BUFFER_NEXT_NB(group->last_buffer) = buffer_cpy;
+        group->last_buffer = buffer_cpy;
+        return TRUE;
+    }
+
+    status = windivert_nbl_alloc(NET_BUFFER_FIRST_MDL(buffer),
         NET_BUFFER_DATA_OFFSET(buffer), NET_BUFFER_DATA_LENGTH(buffer),
         &buffers_cpy);
     if (!NT_SUCCESS(status))
     {
         return FALSE;
     }
-    FwpsReferenceNetBufferList0(buffers, FALSE);
-    handle = (isipv4? inject_handle: injectv6_handle);
-    if (context->layer == WINDIVERT_LAYER_NETWORK_FORWARD)
-    {
-        status = FwpsInjectForwardAsync0(handle, (HANDLE)priority, 0,
-            (isipv4? AF_INET: AF_INET6), UNSPECIFIED_COMPARTMENT_ID,
-            if_idx, buffers_cpy, windivert_reinject_complete, (HANDLE)buffers);
-    }   
-    else if (direction == WINDIVERT_DIRECTION_OUTBOUND)
+    if (group->first == NULL)
     {
-        status = FwpsInjectNetworkSendAsync0(handle, (HANDLE)priority, 0,
-            UNSPECIFIED_COMPARTMENT_ID, buffers_cpy,
-            windivert_reinject_complete, (HANDLE)buffers);
+        group->first = buffers_cpy;
     }
     else
     {
-        // NOTE: this case should never occur since inbound net buffers only
-        //       ever contain one packet.  We keep for completeness.
-        status = FwpsInjectNetworkReceiveAsync0(handle, (HANDLE)priority, 0,
-            UNSPECIFIED_COMPARTMENT_ID, if_idx, sub_if_idx, buffers_cpy,
-            windivert_reinject_complete, (HANDLE)buffers);
+        NET_BUFFER_LIST_NEXT_NBL(group->last) = buffers_cpy;
     }
-    if (!NT_SUCCESS(status))
+    group->last = buffers_cpy;
+    group->last_buffer = NET_BUFFER_LIST_FIRST_NB(buffers_cpy);
+    return TRUE;
+}
+
+/*
+ * Re-inject the groups of NET_BUFFERs (if any).  Each group is a single
+ * NET_BUFFER_LIST, injected with one call (an injection may only carry a
+ * single NET_BUFFER_LIST), and the original NET_BUFFER_LIST is referenced
+ * until each group completes.
+ */
+static BOOL windivert_reinject_group(context_t context, UINT8 direction,
+    BOOL isipv4, UINT32 if_idx, UINT32 sub_if_idx, UINT32 priority,
+    PNET_BUFFER_LIST buffers, reinject_t group)
+{
+    PNET_BUFFER_LIST buffers_cpy, buffers_nxt;
+    HANDLE handle;
+    NTSTATUS status;
+
+    buffers_cpy = group->first;
+    group->first = NULL;
+    group->last  = NULL;
+    group->last_buffer = NULL;
+    handle = (isipv4? inject_handle: injectv6_handle);
+    for (; buffers_cpy != NULL; buffers_cpy = buffers_nxt)
     {
-        FwpsDereferenceNetBufferList0(buffers, FALSE);
-        FwpsFreeNetBufferList0(buffers_cpy);
-        return FALSE;
+        buffers_nxt = NET_BUFFER_LIST_NEXT_NBL(buffers_cpy);
+        NET_BUFFER_LIST_NEXT_NBL(buffers_cpy) = NULL;
+        FwpsReferenceNetBufferList0(buffers, FALSE);
+        if (context->layer == WINDIVERT_LAYER_NETWORK_FORWARD)
+        {
+            status = FwpsInjectForwardAsync0(handle, (HANDLE)priority, 0,
+                (isipv4? AF_INET: AF_INET6), UNSPECIFIED_COMPARTMENT_ID,
+                if_idx, buffers_cpy, windivert_reinject_complete,
+                (HANDLE)buffers);
+        }
+        else if (direction == WINDIVERT_DIRECTION_OUTBOUND)
+        {
+            status = FwpsInjectNetworkSendAsync0(handle, (HANDLE)priority, 0,
+                UNSPECIFIED_COMPARTMENT_ID, buffers_cpy,
+                windivert_reinject_complete, (HANDLE)buffers);
+        }
+        else
+        {
+            // NOTE: this case should never occur since inbound net buffers
+            //       only ever contain one packet.  We keep for completeness.
+            status = FwpsInjectNetworkReceiveAsync0(handle, (HANDLE)priority,
+                0, UNSPECIFIED_COMPARTMENT_ID, if_idx, sub_if_idx,
+                buffers_cpy, windivert_reinject_complete, (HANDLE)buffers);
+        }
+        if (!NT_SUCCESS(status))
+        {
+            FwpsDereferenceNetBufferList0(buffers, FALSE);
+            windivert_reinject_free_group(buffers_cpy);
+            windivert_reinject_free(buffers_nxt);
+            return FALSE;
+        }
     }
     return TRUE;
 }
@@ -2229,7 +2615,72 @@ static void NTAPI windivert_reinject_complete(VOID *context,
 
     buffers = (PNET_BUFFER_LIST)context;
     FwpsDereferenceNetBufferList0(buffers, FALSE);
-    FwpsFreeNetBufferList0(buffers_cpy);
+    windivert_reinject_free_group(buffers_cpy);
+}
+
+/*
+ * Free a chain of re-inject groups.
+ */
+static void windivert_reinject_free(PNET_BUFFER_LIST buffers_cpy)
+{
+    PNET_BUFFER_LIST buffers_nxt;
+
+    while (buffers_cpy != NULL)
+    {
+        buffers_nxt = NET_BUFFER_LIST_NEXT_NBL(buffers_cpy);
+        windivert_reinject_free_group(buffers_cpy);
+        buffers_cpy = buffers_nxt;
+    }
+}
+
+/*
+ * Free a re-inject group: the NET_BUFFERs added to the group, then the
+ * NET_BUFFER_LIST (with its first NET_BUFFER).
+ */
+static void windivert_reinject_free_group(PNET_BUFFER_LIST buffers_cpy)
+{
+    PNET_BUFFER buffer, buffer_nxt;
+
+    buffer = NET_BUFFER_LIST_FIRST_NB(buffers_cpy);
+    buffer_nxt = NET_BUFFER_NEXT_NB(buffer);
+    NET_BUFFER_NEXT_NB(buffer) = NULL;
+    while (buffer_nxt != NULL)
+    {
+        buffer = buffer_nxt;
+        buffer_nxt = NET_BUFFER_NEXT_NB(buffer);
+        NET_BUFFER_NEXT_NB(buffer) = NULL;
+        NdisFreeNetBuffer(buffer);
+    }
+    windivert_nbl_free(buffers_cpy);
+}
+
+/*
+ * Allocate a NET_BUFFER_LIST that describes length bytes of an MDL chain
+ * starting at offset.
+ */
+static NTSTATUS windivert_nbl_alloc(PMDL mdl, ULONG offset, ULONG length,
+    PNET_BUFFER_LIST *buffers_ptr)
+{
+    NTSTATUS status;
+
+    status = FwpsAllocateNetBufferAndNetBufferList0(pool_handle, 0, 0, mdl,
+        offset, length, buffers_ptr);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    windivert_nbl_count_alloc(&nbl_count);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Free a NET_BUFFER_LIST allocated by windivert_nbl_alloc() (once any
+ * injection of it has completed).
+ */
+static void windivert_nbl_free(PNET_BUFFER_LIST buffers)
+{
+    FwpsFreeNetBufferList0(buffers);
+    windivert_nbl_count_free(&nbl_count);
 }
 
 /*
@@ -2369,417 +2820,86 @@ static void windivert_update_checksums(void *header, size_t len,
 }
 
 /*
- * Checks if the given packet is of interest.
+ * Get the length of a packet.
  */
-static BOOL windivert_filter(PNET_BUFFER buffer, UINT32 if_idx,
-    UINT32 sub_if_idx, BOOL outbound, filter_t filter)
+static size_t windivert_packet_length(PNET_BUFFER buffer)
 {
-    // Buffer contains enough space for a full size iphdr and tcphdr/udphdr
-    // (without options)
-    UINT8 storage[0xF*sizeof(UINT32) + sizeof(struct tcphdr)];
-    UINT8 *headers;
-    size_t tot_len, cpy_len, ip_header_len;
-    struct iphdr *ip_header = NULL;
-    struct ipv6hdr *ipv6_header = NULL;
-    struct icmphdr *icmp_header = NULL;
-    struct icmpv6hdr *icmpv6_header = NULL;
-    struct tcphdr *tcp_header = NULL;
-    struct udphdr *udp_header = NULL;
-    UINT16 ip, ttl;
-    UINT8 protocol;
+    return (size_t)NET_BUFFER_DATA_LENGTH(buffer);
+}
 
-    // Parse the headers:
-    tot_len = NET_BUFFER_DATA_LENGTH(buffer);
-    if (tot_len < sizeof(struct iphdr))
-    {
-        DEBUG("FILTER: REJECT (packet length too small)");
-        return FALSE;
-    }
-    cpy_len = (tot_len < sizeof(storage)? tot_len: sizeof(storage));
-    headers = (UINT8 *)NdisGetDataBuffer(buffer, (ULONG)cpy_len, storage, 1,
-        0);
-    if (headers == NULL)
-    {
-        headers = storage;
-    }
+/*
+ * Get the first len bytes of a packet as a contiguous block.  The NET_BUFFER
+ * is used directly if possible; otherwise the bytes are copied into storage.
+ * Returns NULL if the bytes cannot be obtained (storage then does not hold
+ * the data).
+ */
+static UINT8 *windivert_packet_data(PNET_BUFFER buffer, size_t len,
+    UINT8 *storage)
+{
+    return (UINT8 *)NdisGetDataBuffer(buffer, (ULONG)len, storage, 1, 0);
+}
 
-    ip_header = (struct iphdr *)headers;
-    switch (ip_header->Version)
+/*
+ * Prefetch the start of a packet (if it is already mapped).
+ */
+static void windivert_packet_prefetch(PNET_BUFFER buffer)
+{
+    PMDL mdl = NET_BUFFER_CURRENT_MDL(buffer);
+
+    if (mdl != NULL && (mdl->MdlFlags &
+            (MDL_MAPPED_TO_SYSTEM_VA | MDL_SOURCE_IS_NONPAGED_POOL)) != 0)
     {
-        case 4:
-            ip_header_len = ip_header->HdrLength*sizeof(UINT32);
-            if (RtlUshortByteSwap(ip_header->Length) != tot_len ||
-                ip_header->HdrLength < 5 ||
-                ip_header_len > tot_len)
-            {
-                DEBUG("FILTER: REJECT (bad IPv4 packet)");
-                return FALSE;
-            }
-            protocol = ip_header->Protocol;
-            break;
-        case 6:
-            ip_header = NULL;
-            ipv6_header = (struct ipv6hdr *)headers;
-            ip_header_len = sizeof(struct ipv6hdr);
-            if (ip_header_len > tot_len ||
-                RtlUshortByteSwap(ipv6_header->Length) +
-                    sizeof(struct ipv6hdr) != tot_len)
-            {
-                DEBUG("FILTER: REJECT (bad IPv6 packet)");
-                return FALSE;
-            }
-            protocol = ipv6_header->NextHdr;
-            break;
-        default:
-            DEBUG("FILTER: REJECT (packet is neither IPv4 nor IPv6)");
-            return FALSE;
+        PreFetchCacheLine(PF_TEMPORAL_LEVEL_1,
+            (UINT8 *)mdl->MappedSystemVa +
+                NET_BUFFER_CURRENT_MDL_OFFSET(buffer));
     }
+}
+
+/*
+ * Search the packet from offset onwards for any pattern of the automaton.
+ * The NET_BUFFER's MDL chain is searched in place (i.e. without copying).
+ */
+static BOOL windivert_packet_contains(PNET_BUFFER buffer, size_t offset,
+    windivert_ioctl_automaton_t automaton)
+{
+    PMDL mdl;
+    UINT8 *data;
+    size_t len, mdl_len, data_len;
+    UINT32 state = automaton->classes;      // Start state
 
-    switch (protocol)
+    len = NET_BUFFER_DATA_LENGTH(buffer);
+    if (offset >= len)
     {
-        case IPPROTO_ICMP:
-            icmp_header = (struct icmphdr *)(headers + ip_header_len);
-            if (ip_header == NULL ||
-                sizeof(struct icmphdr) + ip_header_len > tot_len)
-            {
-                DEBUG("FILTER: REJECT (bad ICMP packet)");
-                return FALSE;
-            }
-            break;
-        case IPPROTO_ICMPV6:
-            icmpv6_header = (struct icmpv6hdr *)(headers + ip_header_len);
-            if (ipv6_header == NULL ||
-                sizeof(struct icmpv6hdr) + ip_header_len > tot_len)
-            {
-                DEBUG("FILTER: REJECT (bad ICMPV6 packet)");
-                return FALSE;
-            }
-            break;
-        case IPPROTO_TCP:
-            tcp_header = (struct tcphdr *)(headers + ip_header_len);
-            if (tcp_header->HdrLength < 5 ||
-                tcp_header->HdrLength*sizeof(UINT32) + ip_header_len > tot_len)
-            {
-                DEBUG("FILTER: REJECT (bad TCP packet)");
-                return FALSE;
-            }
-            break;
-        case IPPROTO_UDP:
-            udp_header = (struct udphdr *)(headers + ip_header_len);
-            if (sizeof(struct udphdr) + ip_header_len > tot_len)
-            {
-                DEBUG("FILTER: REJECT (bad UDP packet)");
-                return FALSE;
-            }
-            break;
-        default:
-            break;
+        return FALSE;
     }
-
-    // Execute the filter:
-    ip = 0;
-    ttl = WINDIVERT_FILTER_MAXLEN+1;       // Additional safety
-    while (ttl-- != 0)
+    len -= offset;
+    offset += NET_BUFFER_CURRENT_MDL_OFFSET(buffer);
+    mdl = NET_BUFFER_CURRENT_MDL(buffer);
+    while (mdl != NULL && len != 0)
     {
-        BOOL result;
-        UINT32 field[4];
-        field[1] = 0;
-        field[2] = 0;
-        field[3] = 0;
-        switch (filter[ip].protocol)
+        mdl_len = MmGetMdlByteCount(mdl);
+        if (offset >= mdl_len)
         {
-            case WINDIVERT_FILTER_PROTOCOL_NONE:
-                result = TRUE;
-                break;
-            case WINDIVERT_FILTER_PROTOCOL_IP:
-                result = (ip_header != NULL);
-                break;
-            case WINDIVERT_FILTER_PROTOCOL_IPV6:
-                result = (ipv6_header != NULL);
-                break;
-            case WINDIVERT_FILTER_PROTOCOL_ICMP:
-                result = (icmp_header != NULL);
-                break;
-            case WINDIVERT_FILTER_PROTOCOL_ICMPV6:
-                result = (icmpv6_header != NULL);
-                break;
-            case WINDIVERT_FILTER_PROTOCOL_TCP:
-                result = (tcp_header != NULL);
-                break;
-            case WINDIVERT_FILTER_PROTOCOL_UDP:
-                result = (udp_header != NULL);
-                break;
-            default:
-                result = FALSE;
-                break;
+            offset -= mdl_len;
+            mdl = mdl->Next;
+            continue;
         }
-        if (result)
+        data = (UINT8 *)MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+        if (data == NULL)
         {
-            switch (filter[ip].field)
-            {
-                case WINDIVERT_FILTER_FIELD_ZERO:
-                    field[0] = 0;
-                    break;
-                case WINDIVERT_FILTER_FIELD_INBOUND:
-                    field[0] = (UINT32)(!outbound);
-                    break;
-                case WINDIVERT_FILTER_FIELD_OUTBOUND:
-                    field[0] = (UINT32)outbound;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IFIDX:
-                    field[0] = (UINT32)if_idx;
-                    break;
-                case WINDIVERT_FILTER_FIELD_SUBIFIDX:
-                    field[0] = (UINT32)sub_if_idx;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP:
-                    field[0] = (UINT32)(ip_header != NULL);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6:
-                    field[0] = (UINT32)(ipv6_header != NULL);
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMP:
-                    field[0] = (UINT32)(icmp_header != NULL);
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMPV6:
-                    field[0] = (UINT32)(icmpv6_header != NULL);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP:
-                    field[0] = (UINT32)(tcp_header != NULL);
-                    break;
-                case WINDIVERT_FILTER_FIELD_UDP:
-                    field[0] = (UINT32)(udp_header != NULL);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_HDRLENGTH:
-                    field[0] = (UINT32)ip_header->HdrLength;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_TOS:
-                    field[0] = (UINT32)RtlUshortByteSwap(ip_header->TOS);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_LENGTH:
-                    field[0] = (UINT32)RtlUshortByteSwap(ip_header->Length);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_ID:
-                    field[0] = (UINT32)RtlUshortByteSwap(ip_header->Id);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_DF:
-                    field[0] = (UINT32)IPHDR_GET_DF(ip_header);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_MF:
-                    field[0] = (UINT32)IPHDR_GET_MF(ip_header);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_FRAGOFF:
-                    field[0] = (UINT32)RtlUshortByteSwap(
-                        IPHDR_GET_FRAGOFF(ip_header));
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_TTL:
-                    field[0] = (UINT32)ip_header->TTL;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_PROTOCOL:
-                    field[0] = (UINT32)ip_header->Protocol;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_CHECKSUM:
-                    field[0] = (UINT32)RtlUshortByteSwap(ip_header->Checksum);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_SRCADDR:
-                    field[0] = (UINT32)RtlUlongByteSwap(ip_header->SrcAddr);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IP_DSTADDR:
-                    field[0] = (UINT32)RtlUlongByteSwap(ip_header->DstAddr);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_TRAFFICCLASS:
-                    field[0] = (UINT32)IPV6HDR_GET_TRAFFICCLASS(ipv6_header);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_FLOWLABEL:
-                    field[0] = (UINT32)RtlUlongByteSwap(
-                        IPV6HDR_GET_FLOWLABEL(ipv6_header));
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_LENGTH:
-                    field[0] = (UINT32)RtlUshortByteSwap(ipv6_header->Length);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR:
-                    field[0] = (UINT32)ipv6_header->NextHdr;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
-                    field[0] = (UINT32)ipv6_header->HopLimit;
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_SRCADDR:
-                    field[0] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->SrcAddr[3]);
-                    field[1] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->SrcAddr[2]);
-                    field[2] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->SrcAddr[1]);
-                    field[3] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->SrcAddr[0]);
-                    break;
-                case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
-                    field[0] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->DstAddr[3]);
-                    field[1] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->DstAddr[2]);
-                    field[2] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->DstAddr[1]);
-                    field[3] =
-                        (UINT32)RtlUlongByteSwap(ipv6_header->DstAddr[0]);
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMP_TYPE:
-                    field[0] = (UINT32)icmp_header->Type;
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMP_CODE:
-                    field[0] = (UINT32)icmp_header->Code;
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMP_CHECKSUM:
-                    field[0] =
-                        (UINT32)RtlUshortByteSwap(icmp_header->Checksum);
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMP_BODY:
-                    field[0] = (UINT32)RtlUlongByteSwap(icmp_header->Body);
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMPV6_TYPE:
-                    field[0] = (UINT32)icmpv6_header->Type;
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMPV6_CODE:
-                    field[0] = (UINT32)icmpv6_header->Code;
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMPV6_CHECKSUM:
-                    field[0] = (UINT32)icmpv6_header->Checksum;
-                    break;
-                case WINDIVERT_FILTER_FIELD_ICMPV6_BODY:
-                    field[0] = (UINT32)icmpv6_header->Body;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_SRCPORT:
-                    field[0] = (UINT32)RtlUshortByteSwap(tcp_header->SrcPort);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_DSTPORT:
-                    field[0] = (UINT32)RtlUshortByteSwap(tcp_header->DstPort);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_SEQNUM:
-                    field[0] = (UINT32)RtlUlongByteSwap(tcp_header->SeqNum);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_ACKNUM:
-                    field[0] = (UINT32)RtlUlongByteSwap(tcp_header->AckNum);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_HDRLENGTH:
-                    field[0] = (UINT32)tcp_header->HdrLength;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_URG:
-                    field[0] = (UINT32)tcp_header->Urg;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_ACK:
-                    field[0] = (UINT32)tcp_header->Ack;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_PSH:
-                    field[0] = (UINT32)tcp_header->Psh;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_RST:
-                    field[0] = (UINT32)tcp_header->Rst;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_SYN:
-                    field[0] = (UINT32)tcp_header->Syn;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_FIN:
-                    field[0] = (UINT32)tcp_header->Fin;
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_WINDOW:
-                    field[0] = (UINT32)RtlUshortByteSwap(tcp_header->Window);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_CHECKSUM:
-                    field[0] = (UINT32)RtlUshortByteSwap(tcp_header->Checksum);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_URGPTR:
-                    field[0] = (UINT32)RtlUshortByteSwap(tcp_header->UrgPtr);
-                    break;
-                case WINDIVERT_FILTER_FIELD_TCP_PAYLOADLENGTH:
-                    field[0] = (UINT32)(tot_len - ip_header_len -
-                        tcp_header->HdrLength*sizeof(UINT32));
-                    break;
-                case WINDIVERT_FILTER_FIELD_UDP_SRCPORT:
-                    field[0] = (UINT32)RtlUshortByteSwap(udp_header->SrcPort);
-                    break;
-                case WINDIVERT_FILTER_FIELD_UDP_DSTPORT:
-                    field[0] = (UINT32)RtlUshortByteSwap(udp_header->DstPort);
-                    break;
-                case WINDIVERT_FILTER_FIELD_UDP_LENGTH:
-                    field[0] = (UINT32)RtlUshortByteSwap(udp_header->Length);
-                    break;
-                case WINDIVERT_FILTER_FIELD_UDP_CHECKSUM:
-                    field[0] = (UINT32)RtlUshortByteSwap(udp_header->Checksum);
-                    break;
-                case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
-                    field[0] = (UINT32)(tot_len - ip_header_len -
-                        sizeof(struct udphdr));
-                    break;
-                default:
-                    field[0] = 0;
-                    break;
-            }
-            switch (filter[ip].test)
-            {
-                case WINDIVERT_FILTER_TEST_EQ:
-                    result = (field[0] == filter[ip].arg[0] &&
-                              field[1] == filter[ip].arg[1] &&
-                              field[2] == filter[ip].arg[2] &&
-                              field[3] == filter[ip].arg[3]);
-                    break;
-                case WINDIVERT_FILTER_TEST_NEQ:
-                    result = (field[0] != filter[ip].arg[0] ||
-                              field[1] != filter[ip].arg[1] ||
-                              field[2] != filter[ip].arg[2] ||
-                              field[3] != filter[ip].arg[3]);
-                    break;
-                case WINDIVERT_FILTER_TEST_LT:
-                    result = (field[3] < filter[ip].arg[3] ||
-                             (field[3] == filter[ip].arg[3] &&
-                              field[2] < filter[ip].arg[2] ||
-                             (field[2] == filter[ip].arg[2] && 
-                              field[1] < filter[ip].arg[1] ||
-                             (field[1] == filter[ip].arg[1] &&
-                              field[0] < filter[ip].arg[0]))));
-                    break;
-                case WINDIVERT_FILTER_TEST_LEQ:
-                    result = (field[3] < filter[ip].arg[3] ||
-                             (field[3] == filter[ip].arg[3] &&
-                              field[2] < filter[ip].arg[2] ||
-                             (field[2] == filter[ip].arg[2] && 
-                              field[1] < filter[ip].arg[1] ||
-                             (field[1] == filter[ip].arg[1] &&
-                              field[0] <= filter[ip].arg[0]))));
-                    break;
-                case WINDIVERT_FILTER_TEST_GT:
-                    result = (field[3] > filter[ip].arg[3] ||
-                             (field[3] == filter[ip].arg[3] &&
-                              field[2] > filter[ip].arg[2] ||
-                             (field[2] == filter[ip].arg[2] && 
-                              field[1] > filter[ip].arg[1] ||
-                             (field[1] == filter[ip].arg[1] &&
-                              field[0] > filter[ip].arg[0]))));
-                    break;
-                case WINDIVERT_FILTER_TEST_GEQ:
-                    result = (field[3] > filter[ip].arg[3] ||
-                             (field[3] == filter[ip].arg[3] &&
-                              field[2] > filter[ip].arg[2] ||
-                             (field[2] == filter[ip].arg[2] && 
-                              field[1] > filter[ip].arg[1] ||
-                             (field[1] == filter[ip].arg[1] &&
-                              field[0] >= filter[ip].arg[0]))));
-                    break;
-                default:
-                    result = FALSE;
-                    break;
-            }
+            return FALSE;
         }
-        ip = (result? filter[ip].success: filter[ip].failure);
-        if (ip == WINDIVERT_FILTER_RESULT_ACCEPT)
+        data_len = mdl_len - offset;
+        data_len = (data_len < len? data_len: len);
+        if (windivert_automaton_match(automaton, data + offset, data_len,
+                &state))
         {
             return TRUE;
         }
-        if (ip == WINDIVERT_FILTER_RESULT_REJECT)
-        {
-            return FALSE;
-        }
+        len -= data_len;
+        offset = 0;
+        mdl = mdl->Next;
     }
-    DEBUG("FILTER: REJECT (filter TTL exceeded)");
     return FALSE;
 }
 
@@ -2919,260 +3039,43 @@ static BOOL windivert_filter_test(filter_t filter, UINT16 ip, UINT8 protocol,
  * Compile a WinDivert filter from an IOCTL.
  */
 static filter_t windivert_filter_compile(windivert_ioctl_filter_t ioctl_filter,
-    size_t ioctl_filter_len)
+    size_t ioctl_filter_len, UINT64 filter_len)
 {
-    filter_t filter0 = NULL, result = NULL;
-    UINT16 i;
-    size_t length;
+    filter_t filter = NULL;
+    UINT8 *automata_data;
+    size_t length, automata_len;
 
-    if (ioctl_filter_len % sizeof(struct windivert_ioctl_filter_s) != 0)
+    if (filter_len >= WINDIVERT_FILTER_MAXLEN)
     {
-        goto windivert_filter_compile_exit;
+        return NULL;
     }
-    length = ioctl_filter_len / sizeof(struct windivert_ioctl_filter_s);
-    if (length >= WINDIVERT_FILTER_MAXLEN)
+    length = (size_t)filter_len;
+    if (ioctl_filter_len < length*sizeof(struct windivert_ioctl_filter_s))
     {
-        goto windivert_filter_compile_exit;
+        return NULL;
     }
-
-    // Do NOT use the stack (size = 12Kb on x86) for filter0.
-    filter0 = (filter_t)ExAllocatePoolWithTag(NonPagedPool,
-        WINDIVERT_FILTER_MAXLEN*sizeof(struct filter_s), WINDIVERT_FILTER_TAG);
-    if (filter0 == NULL)
+    automata_len = ioctl_filter_len -
+        length*sizeof(struct windivert_ioctl_filter_s);
+    if (automata_len > WINDIVERT_FILTER_AUTOMATA_MAXLEN)
     {
-        goto windivert_filter_compile_exit;
+        return NULL;
     }
- 
-    for (i = 0; i < length; i++)
-    {
-        if (ioctl_filter[i].field > WINDIVERT_FILTER_FIELD_MAX ||
-            ioctl_filter[i].test > WINDIVERT_FILTER_TEST_MAX)
-        {
-            goto windivert_filter_compile_exit;
-        }
-        switch (ioctl_filter[i].success)
-        {
-            case WINDIVERT_FILTER_RESULT_ACCEPT:
-            case WINDIVERT_FILTER_RESULT_REJECT:
-                break;
-            default:
-                if (ioctl_filter[i].success <= i ||
-                    ioctl_filter[i].success >= length)
-                {
-                    goto windivert_filter_compile_exit;
-                }
-                break;
-        }
-        switch (ioctl_filter[i].failure)
-        {
-            case WINDIVERT_FILTER_RESULT_ACCEPT:
-            case WINDIVERT_FILTER_RESULT_REJECT:
-                break;
-            default:
-                if (ioctl_filter[i].failure <= i ||
-                    ioctl_filter[i].failure >= length)
-                {
-                    goto windivert_filter_compile_exit;
-                }
-                break;
-        }
 
-        // Enforce size limits:
-        if (ioctl_filter[i].field != WINDIVERT_FILTER_FIELD_IPV6_SRCADDR &&
-            ioctl_filter[i].field != WINDIVERT_FILTER_FIELD_IPV6_DSTADDR)
-        {
-            if (ioctl_filter[i].arg[1] != 0 ||
-                ioctl_filter[i].arg[2] != 0 ||
-                ioctl_filter[i].arg[3] != 0)
-            {
-                goto windivert_filter_compile_exit;
-            }
-        }
-        switch (ioctl_filter[i].field)
-        {
-            case WINDIVERT_FILTER_FIELD_ZERO:
-            case WINDIVERT_FILTER_FIELD_INBOUND:
-            case WINDIVERT_FILTER_FIELD_OUTBOUND:
-            case WINDIVERT_FILTER_FIELD_IP:
-            case WINDIVERT_FILTER_FIELD_IPV6:
-            case WINDIVERT_FILTER_FIELD_ICMP:
-            case WINDIVERT_FILTER_FIELD_ICMPV6:
-            case WINDIVERT_FILTER_FIELD_TCP:
-            case WINDIVERT_FILTER_FIELD_UDP:
-            case WINDIVERT_FILTER_FIELD_IP_DF:
-            case WINDIVERT_FILTER_FIELD_IP_MF:
-            case WINDIVERT_FILTER_FIELD_TCP_URG:
-            case WINDIVERT_FILTER_FIELD_TCP_ACK:
-            case WINDIVERT_FILTER_FIELD_TCP_PSH:
-            case WINDIVERT_FILTER_FIELD_TCP_RST:
-            case WINDIVERT_FILTER_FIELD_TCP_SYN:
-            case WINDIVERT_FILTER_FIELD_TCP_FIN:
-                if (ioctl_filter[i].arg[0] > 1)
-                {
-                    goto windivert_filter_compile_exit;
-                }
-                break;
-            case WINDIVERT_FILTER_FIELD_IP_HDRLENGTH:
-            case WINDIVERT_FILTER_FIELD_TCP_HDRLENGTH:
-                if (ioctl_filter[i].arg[0] > 0x0F)
-                {
-                    goto windivert_filter_compile_exit;
-                }
-                break;
-            case WINDIVERT_FILTER_FIELD_IP_TTL:
-            case WINDIVERT_FILTER_FIELD_IP_PROTOCOL:
-            case WINDIVERT_FILTER_FIELD_IPV6_TRAFFICCLASS:
-            case WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR:
-            case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
-            case WINDIVERT_FILTER_FIELD_ICMP_TYPE:
-            case WINDIVERT_FILTER_FIELD_ICMP_CODE:
-            case WINDIVERT_FILTER_FIELD_ICMPV6_TYPE:
-            case WINDIVERT_FILTER_FIELD_ICMPV6_CODE:
-                if (ioctl_filter[i].arg[0] > UINT8_MAX)
-                {
-                    goto windivert_filter_compile_exit;
-                }
-                break;
-            case WINDIVERT_FILTER_FIELD_IP_FRAGOFF:
-                if (ioctl_filter[i].arg[0] > 0x1FFF)
-                {
-                    goto windivert_filter_compile_exit;
-                }
-                break;
-            case WINDIVERT_FILTER_FIELD_IP_TOS:
-            case WINDIVERT_FILTER_FIELD_IP_LENGTH:
-            case WINDIVERT_FILTER_FIELD_IP_ID:
-            case WINDIVERT_FILTER_FIELD_IP_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_IPV6_LENGTH:
-            case WINDIVERT_FILTER_FIELD_ICMP_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_ICMPV6_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_TCP_SRCPORT:
-            case WINDIVERT_FILTER_FIELD_TCP_DSTPORT:
-            case WINDIVERT_FILTER_FIELD_TCP_WINDOW:
-            case WINDIVERT_FILTER_FIELD_TCP_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_TCP_URGPTR:
-            case WINDIVERT_FILTER_FIELD_TCP_PAYLOADLENGTH:
-            case WINDIVERT_FILTER_FIELD_UDP_SRCPORT:
-            case WINDIVERT_FILTER_FIELD_UDP_DSTPORT:
-            case WINDIVERT_FILTER_FIELD_UDP_LENGTH:
-            case WINDIVERT_FILTER_FIELD_UDP_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
-                if (ioctl_filter[i].arg[0] > UINT16_MAX)
-                {
-                    goto windivert_filter_compile_exit;
-                }
-                break;
-            case WINDIVERT_FILTER_FIELD_IPV6_FLOWLABEL:
-                if (ioctl_filter[i].arg[0] > 0x000FFFFF)
-                {
-                    goto windivert_filter_compile_exit;
-                }
-                break;
-            default:
-                break;
-        }
-        filter0[i].field   = ioctl_filter[i].field;
-        filter0[i].test    = ioctl_filter[i].test;
-        filter0[i].success = ioctl_filter[i].success;
-        filter0[i].failure = ioctl_filter[i].failure;
-        filter0[i].arg[0]  = ioctl_filter[i].arg[0];
-        filter0[i].arg[1]  = ioctl_filter[i].arg[1];
-        filter0[i].arg[2]  = ioctl_filter[i].arg[2];
-        filter0[i].arg[3]  = ioctl_filter[i].arg[3];
-
-        // Protocol selection:
-        switch (ioctl_filter[i].field)
-        {
-            case WINDIVERT_FILTER_FIELD_ZERO:
-            case WINDIVERT_FILTER_FIELD_INBOUND:
-            case WINDIVERT_FILTER_FIELD_OUTBOUND:
-            case WINDIVERT_FILTER_FIELD_IFIDX:
-            case WINDIVERT_FILTER_FIELD_SUBIFIDX:
-            case WINDIVERT_FILTER_FIELD_IP:
-            case WINDIVERT_FILTER_FIELD_IPV6:
-            case WINDIVERT_FILTER_FIELD_ICMP:
-            case WINDIVERT_FILTER_FIELD_ICMPV6:
-            case WINDIVERT_FILTER_FIELD_TCP:
-            case WINDIVERT_FILTER_FIELD_UDP:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_NONE;
-                break;
-            case WINDIVERT_FILTER_FIELD_IP_HDRLENGTH:
-            case WINDIVERT_FILTER_FIELD_IP_TOS:
-            case WINDIVERT_FILTER_FIELD_IP_LENGTH:
-            case WINDIVERT_FILTER_FIELD_IP_ID:
-            case WINDIVERT_FILTER_FIELD_IP_DF:
-            case WINDIVERT_FILTER_FIELD_IP_MF:
-            case WINDIVERT_FILTER_FIELD_IP_FRAGOFF:
-            case WINDIVERT_FILTER_FIELD_IP_TTL:
-            case WINDIVERT_FILTER_FIELD_IP_PROTOCOL:
-            case WINDIVERT_FILTER_FIELD_IP_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_IP_SRCADDR:
-            case WINDIVERT_FILTER_FIELD_IP_DSTADDR:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_IP;
-                break;
-            case WINDIVERT_FILTER_FIELD_IPV6_TRAFFICCLASS:
-            case WINDIVERT_FILTER_FIELD_IPV6_FLOWLABEL:
-            case WINDIVERT_FILTER_FIELD_IPV6_LENGTH:
-            case WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR:
-            case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
-            case WINDIVERT_FILTER_FIELD_IPV6_SRCADDR:
-            case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_IPV6;
-                break;
-            case WINDIVERT_FILTER_FIELD_ICMP_TYPE:
-            case WINDIVERT_FILTER_FIELD_ICMP_CODE:
-            case WINDIVERT_FILTER_FIELD_ICMP_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_ICMP_BODY:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_ICMP;
-                break;
-            case WINDIVERT_FILTER_FIELD_ICMPV6_TYPE:
-            case WINDIVERT_FILTER_FIELD_ICMPV6_CODE:
-            case WINDIVERT_FILTER_FIELD_ICMPV6_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_ICMPV6_BODY:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_ICMPV6;
-                break;
-            case WINDIVERT_FILTER_FIELD_TCP_SRCPORT:
-            case WINDIVERT_FILTER_FIELD_TCP_DSTPORT:
-            case WINDIVERT_FILTER_FIELD_TCP_SEQNUM:
-            case WINDIVERT_FILTER_FIELD_TCP_ACKNUM:
-            case WINDIVERT_FILTER_FIELD_TCP_HDRLENGTH:
-            case WINDIVERT_FILTER_FIELD_TCP_URG:
-            case WINDIVERT_FILTER_FIELD_TCP_ACK:
-            case WINDIVERT_FILTER_FIELD_TCP_PSH:
-            case WINDIVERT_FILTER_FIELD_TCP_RST:
-            case WINDIVERT_FILTER_FIELD_TCP_SYN:
-            case WINDIVERT_FILTER_FIELD_TCP_FIN:
-            case WINDIVERT_FILTER_FIELD_TCP_WINDOW:
-            case WINDIVERT_FILTER_FIELD_TCP_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_TCP_URGPTR:
-            case WINDIVERT_FILTER_FIELD_TCP_PAYLOADLENGTH:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_TCP;
-                break;
-            case WINDIVERT_FILTER_FIELD_UDP_SRCPORT:
-            case WINDIVERT_FILTER_FIELD_UDP_DSTPORT:
-            case WINDIVERT_FILTER_FIELD_UDP_LENGTH:
-            case WINDIVERT_FILTER_FIELD_UDP_CHECKSUM:
-            case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
-                filter0[i].protocol = WINDIVERT_FILTER_PROTOCOL_UDP;
-                break;
-            default:
-                goto windivert_filter_compile_exit;
-        }
-    }
-    
-    result = (filter_t)ExAllocatePoolWithTag(NonPagedPool,
-        i*sizeof(struct filter_s), WINDIVERT_FILTER_TAG);
-    if (result != NULL)
+    // The automata are stored after the compiled filter.  They are copied
+    // before they are verified, since the user buffer may change under us.
+    filter = (filter_t)ExAllocatePoolWithTag(NonPagedPool,
+        length*sizeof(struct filter_s) + automata_len, WINDIVERT_FILTER_TAG);
+    if (filter == NULL)
     {
-        RtlMoveMemory(result, filter0, i*sizeof(struct filter_s));
+        return NULL;
     }
-
-windivert_filter_compile_exit:
-
-    if (filter0 != NULL)
+    automata_data = (UINT8 *)(filter + length);
+    RtlCopyMemory(automata_data, ioctl_filter + length, automata_len);
+    if (!windivert_filter_load(ioctl_filter, length, automata_data,
+            automata_len, filter))
     {
-        ExFreePoolWithTag(filter0, WINDIVERT_FILTER_TAG);
+        ExFreePoolWithTag(filter, WINDIVERT_FILTER_TAG);
+        return NULL;
     }
-    return result;
+    return filter;
 }
-
@@ -0,0 +1,92 @@
+/*
+ * bench.h
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Common definitions for the host benchmarks.  Like the tests, each
+ * benchmark is a program that includes the code under test directly.  Every
+ * benchmark accepts "--iterations N" (so that "make check" can run it once,
+ * quickly) and prints one line per measurement, in the same format as the
+ * replay example.
+ */
+
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Parse the "--iterations N" argument, or return the default.
+ */
+static __inline UINT BenchIterations(int argc, char **argv, UINT def)
+{
+    UINT iterations = def;
+
+    if (argc == 3 && strcmp(argv[1], "--iterations") == 0)
+    {
+        iterations = (UINT)atoi(argv[2]);
+    }
+    else if (argc != 1)
+    {
+        iterations = 0;
+    }
+    if (iterations == 0)
+    {
+        fprintf(stderr, "usage: %s [--iterations N]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    return iterations;
+}
+
+/*
+ * The current time, in ticks.
+ */
+static __inline LONGLONG BenchTicks(void)
+{
+    LARGE_INTEGER ticks;
+
+    QueryPerformanceCounter(&ticks);
+    return ticks.QuadPart;
+}
+
+/*
+ * Convert a tick count into an average time per operation.
+ */
+static __inline double BenchNs(LONGLONG ticks, UINT64 ops)
+{
+    LARGE_INTEGER freq;
+
+    QueryPerformanceFrequency(&freq);
+    if (ops == 0)
+    {
+        return 0.0;
+    }
+    return ((double)ticks * 1.0e9 / (double)freq.QuadPart) / (double)ops;
+}
+
+/*
+ * Report a measurement.
+ */
+static __inline void BenchReport(const char *name, LONGLONG ticks, UINT64 ops,
+    const char *unit)
+{
+    printf("%-24s %10.1f ns/%s\n", name, BenchNs(ticks, ops), unit);
+}
+
+#endif      /* __BENCH_H */
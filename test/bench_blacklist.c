@@ -0,0 +1,162 @@
+/*
+ * bench_blacklist.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The webfilter blacklist with 1M random "domain/uri" entries: the time to
+ * compile the trie and its size, and the time per lookup of URLs that are
+ * blocked (a subdomain of an entry, with a longer uri) and that are not.
+ *
+ * usage: bench_blacklist [--iterations N]
+ */
+
+#include <winsock2.h>
+#include "windivert.h"
+#include "../examples/webfilter/blacklist.c"
+#include "test.h"
+#include "bench.h"
+
+#define NUM_ENTRIES     1000000
+#define NUM_URLS        4096
+
+static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789-";
+#define ALPHABET_LEN    (sizeof(alphabet) - 1)
+static const char *tlds[] = {"com", "net", "org", "de", "uk", "info"};
+#define NUM_TLDS        (sizeof(tlds) / sizeof(tlds[0]))
+
+static char domains[NUM_URLS][64];
+static char uris[NUM_URLS][32];
+
+/*
+ * A random entry: one or two random labels and a top level domain, and
+ * (for half of the entries) a random uri.
+ */
+static void RandomEntry(char *domain, char *uri)
+{
+    UINT i, j, len, num_labels = 1 + TestRandom() % 2;
+    char *s = domain;
+
+    for (i = 0; i < num_labels; i++)
+    {
+        len = 4 + TestRandom() % 10;
+        for (j = 0; j < len; j++)
+        {
+            *s++ = alphabet[TestRandom() % ALPHABET_LEN];
+        }
+        *s++ = '.';
+    }
+    strcpy(s, tlds[TestRandom() % NUM_TLDS]);
+    len = (TestRandom() % 2 == 0? 0: 3 + TestRandom() % 8);
+    for (j = 0; j < len; j++)
+    {
+        uri[j] = alphabet[TestRandom() % 26];
+    }
+    uri[len] = '\0';
+}
+
+/*
+ * Time NUM_URLS lookups, iterations times.
+ */
+static LONGLONG Lookups(PBLACKLIST blacklist, UINT iterations,
+    UINT *matched)
+{
+    URL url;
+    LONGLONG ticks;
+    UINT i, j;
+
+    *matched = 0;
+    ticks = BenchTicks();
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < NUM_URLS; j++)
+        {
+            url.domain = domains[j];
+            url.uri    = uris[j];
+            *matched += BlackListMatch(blacklist, &url);
+        }
+    }
+    return BenchTicks() - ticks;
+}
+
+int main(int argc, char **argv)
+{
+    UINT iterations = BenchIterations(argc, argv, 200), matched, i;
+    PBLACKLIST blacklist;
+    char domain[64], uri[32], key[MAXKEY];
+    UINT len, trie_size, keys_size;
+    UINT32 saved_random;
+    LONGLONG ticks, insert_ticks, compile_ticks;
+
+    // Insert the entries (as BlackListRead() would) and compile them:
+    saved_random = test_random_state;
+    blacklist = BlackListInit();
+    insert_ticks = BenchTicks();
+    for (i = 0; i < NUM_ENTRIES; i++)
+    {
+        RandomEntry(domain, uri);
+        len = DomainReverse(domain, (UINT)strlen(domain), key);
+        key[len++] = '/';
+        strcpy(key + len, uri);
+        BlackListInsert(blacklist, key, len + (UINT)strlen(uri));
+    }
+    insert_ticks = BenchTicks() - insert_ticks;
+    keys_size = blacklist->pool_length + blacklist->length * sizeof(UINT32);
+    compile_ticks = BenchTicks();
+    BlackListCompile(blacklist);
+    compile_ticks = BenchTicks() - compile_ticks;
+    trie_size = blacklist->num_nodes * sizeof(NODE) +
+        blacklist->num_edges * sizeof(EDGE) + blacklist->labels_len;
+
+    printf("entries: %u (%u nodes, %u edges, %u bytes; keys %u bytes), "
+        "built in %.1f + %.1f ms\n", NUM_ENTRIES, blacklist->num_nodes,
+        blacklist->num_edges, trie_size, keys_size,
+        BenchNs(insert_ticks, 1) / 1.0e6, BenchNs(compile_ticks, 1) / 1.0e6);
+    BenchReport("insert", insert_ticks, NUM_ENTRIES, "entry");
+    BenchReport("compile", compile_ticks, NUM_ENTRIES, "entry");
+
+    // Blocked: subdomains of the first entries, with longer uris:
+    test_random_state = saved_random;
+    for (i = 0; i < NUM_URLS; i++)
+    {
+        RandomEntry(domain, uri);
+        snprintf(domains[i], sizeof(domains[i]), "www.%s", domain);
+        snprintf(uris[i], sizeof(uris[i]), "%s/index.html", uri);
+    }
+    ticks = Lookups(blacklist, iterations, &matched);
+    printf("blocked: %u/%u matched\n", matched / iterations, NUM_URLS);
+    BenchReport("lookup (blocked)", ticks, (UINT64)iterations * NUM_URLS,
+        "lookup");
+    printf("%-24s %10.2f M/s\n", "lookup (blocked)",
+        1.0e3 / BenchNs(ticks, (UINT64)iterations * NUM_URLS));
+
+    // Allowed: other random URLs (which share top level domains, and may
+    // share the start of a label with entries):
+    test_random_state = saved_random ^ 0x5A5A5A5A;
+    for (i = 0; i < NUM_URLS; i++)
+    {
+        RandomEntry(domains[i], uris[i]);
+    }
+    ticks = Lookups(blacklist, iterations, &matched);
+    printf("allowed: %u/%u matched\n", matched / iterations, NUM_URLS);
+    BenchReport("lookup (allowed)", ticks, (UINT64)iterations * NUM_URLS,
+        "lookup");
+    printf("%-24s %10.2f M/s\n", "lookup (allowed)",
+        1.0e3 / BenchNs(ticks, (UINT64)iterations * NUM_URLS));
+
+    BlackListFree(blacklist);
+    return 0;
+}
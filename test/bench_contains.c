@@ -0,0 +1,141 @@
+/*
+ * bench_contains.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Throughput of the "contains" automata with 1k and 10k host name like
+ * patterns, searching 1460 byte payloads of random text.  Also reports the
+ * time to build each automaton and its size.
+ *
+ * usage: bench_contains [--iterations N]
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+#include "bench.h"
+
+#define NUM_PAYLOADS    1024
+#define PAYLOAD_LEN     1460
+#define PATTERN_MINLEN  6
+#define PATTERN_MAXLEN  14
+
+static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789.-";
+#define ALPHABET_LEN    (sizeof(alphabet) - 1)
+
+static UINT8 payloads[NUM_PAYLOADS][PAYLOAD_LEN];
+
+/*
+ * Build an automaton for num random patterns.
+ */
+static windivert_ioctl_automaton_t Automaton(UINT num, UINT *size,
+    LONGLONG *ticks)
+{
+    char *set, *s;
+    FILTER_TOKEN token;
+    UINT8 *automata = NULL;
+    UINT automata_len = 0, i, j, len;
+    LONGLONG start;
+
+    set = (char *)malloc(num * (PATTERN_MAXLEN + 4) + 1);
+    if (set == NULL)
+    {
+        return NULL;
+    }
+    for (i = 0, s = set; i < num; i++)
+    {
+        s += sprintf(s, "%s\"", (i == 0? "": ", "));
+        len = PATTERN_MINLEN +
+            TestRandom() % (PATTERN_MAXLEN - PATTERN_MINLEN + 1);
+        for (j = 0; j < len; j++)
+        {
+            *s++ = alphabet[TestRandom() % ALPHABET_LEN];
+        }
+        *s++ = '"';
+    }
+    *s = '\0';
+
+    memset(&token, 0, sizeof(token));
+    token.kind = FILTER_TOKEN_STRINGS;
+    token.str  = set;
+    token.len  = (UINT)(s - set);
+    start = BenchTicks();
+    if (!WinDivertCompileAutomaton(&token, &automata, &automata_len))
+    {
+        automata = NULL;
+    }
+    *ticks = BenchTicks() - start;
+    *size = automata_len;
+    free(set);
+    return (windivert_ioctl_automaton_t)automata;
+}
+
+int main(int argc, char **argv)
+{
+    static const UINT nums[] = {1000, 10000};
+    UINT iterations = BenchIterations(argc, argv, 200), matched, size;
+    UINT i, j, n;
+    windivert_ioctl_automaton_t automaton;
+    LONGLONG ticks, build_ticks;
+    UINT64 bytes;
+    UINT32 state;
+    char name[64];
+
+    for (i = 0; i < NUM_PAYLOADS; i++)
+    {
+        for (j = 0; j < PAYLOAD_LEN; j++)
+        {
+            payloads[i][j] = (UINT8)alphabet[TestRandom() % ALPHABET_LEN];
+        }
+    }
+
+    for (n = 0; n < sizeof(nums) / sizeof(nums[0]); n++)
+    {
+        automaton = Automaton(nums[n], &size, &build_ticks);
+        if (automaton == NULL)
+        {
+            fprintf(stderr, "error: failed to build automaton\n");
+            return EXIT_FAILURE;
+        }
+
+        matched = 0;
+        ticks = BenchTicks();
+        for (i = 0; i < iterations; i++)
+        {
+            for (j = 0; j < NUM_PAYLOADS; j++)
+            {
+                state = automaton->classes;
+                if (windivert_automaton_match(automaton, payloads[j],
+                        PAYLOAD_LEN, &state))
+                {
+                    matched++;
+                }
+            }
+        }
+        ticks = BenchTicks() - ticks;
+        bytes = (UINT64)iterations * NUM_PAYLOADS * PAYLOAD_LEN;
+
+        printf("patterns: %u (%u states, %u bytes, built in %.1f ms), "
+            "%u/%u payloads matched\n", nums[n], automaton->states, size,
+            BenchNs(build_ticks, 1) / 1.0e6, matched / iterations,
+            NUM_PAYLOADS);
+        snprintf(name, sizeof(name), "contains (%u)", nums[n]);
+        BenchReport(name, ticks, bytes, "byte");
+        printf("%-24s %10.2f GB/s\n", name, 1.0 / BenchNs(ticks, bytes));
+        free(automaton);
+    }
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * bench_image.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Start-up time of webfilter with a 1M entry blacklist: loading the text
+ * file (reading and compiling it), writing the image file, and loading the
+ * image file (mapping and checking it).  Also the time of the first lookups
+ * after loading, which for a mapped image includes faulting in its pages.
+ *
+ * usage: bench_image [--iterations N]
+ */
+
+#include <winsock2.h>
+#include "windivert.h"
+#include "../examples/webfilter/blacklist.c"
+#include "test.h"
+#include "bench.h"
+
+#define NUM_ENTRIES     1000000
+#define NUM_URLS        1000
+#define TEXT_FILE       "bench_image.txt"
+#define IMAGE_FILE      "bench_image.img"
+
+static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789-";
+#define ALPHABET_LEN    (sizeof(alphabet) - 1)
+static const char *tlds[] = {"com", "net", "org", "de", "uk", "info"};
+#define NUM_TLDS        (sizeof(tlds) / sizeof(tlds[0]))
+
+static char domains[NUM_URLS][4 + 64];
+static char uris[NUM_URLS][32 + 11];
+
+/*
+ * A random entry (as in bench_blacklist).
+ */
+static void RandomEntry(char *domain, char *uri)
+{
+    UINT i, j, len, num_labels = 1 + TestRandom() % 2;
+    char *s = domain;
+
+    for (i = 0; i < num_labels; i++)
+    {
+        len = 4 + TestRandom() % 10;
+        for (j = 0; j < len; j++)
+        {
+            *s++ = alphabet[TestRandom() % ALPHABET_LEN];
+        }
+        *s++ = '.';
+    }
+    strcpy(s, tlds[TestRandom() % NUM_TLDS]);
+    len = (TestRandom() % 2 == 0? 0: 3 + TestRandom() % 8);
+    for (j = 0; j < len; j++)
+    {
+        uri[j] = alphabet[TestRandom() % 26];
+    }
+    uri[len] = '\0';
+}
+
+/*
+ * Time the first lookups of blocked URLs.
+ */
+static LONGLONG FirstLookups(PBLACKLIST blacklist)
+{
+    URL url;
+    LONGLONG ticks;
+    UINT i, matched = 0;
+
+    ticks = BenchTicks();
+    for (i = 0; i < NUM_URLS; i++)
+    {
+        url.domain = domains[i];
+        url.uri    = uris[i];
+        matched += BlackListMatch(blacklist, &url);
+    }
+    ticks = BenchTicks() - ticks;
+    if (matched != NUM_URLS)
+    {
+        fprintf(stderr, "error: %u/%u URLs matched\n", matched, NUM_URLS);
+        exit(EXIT_FAILURE);
+    }
+    return ticks;
+}
+
+int main(int argc, char **argv)
+{
+    static char *text_files[] = {TEXT_FILE};
+    static char *image_files[] = {IMAGE_FILE};
+    UINT iterations = BenchIterations(argc, argv, 5), i;
+    PBLACKLIST blacklist;
+    char domain[64], uri[32];
+    FILE *file;
+    LONGLONG ticks, text_ticks = 0, write_ticks = 0, image_ticks = 0,
+        text_lookup_ticks = 0, image_lookup_ticks = 0;
+
+    file = fopen(TEXT_FILE, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s\n", TEXT_FILE);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < NUM_ENTRIES; i++)
+    {
+        RandomEntry(domain, uri);
+        fprintf(file, "%s/%s\n", domain, uri);
+        if (i < NUM_URLS)
+        {
+            snprintf(domains[i], sizeof(domains[i]), "www.%s", domain);
+            snprintf(uris[i], sizeof(uris[i]), "%s/index.html", uri);
+        }
+    }
+    fclose(file);
+
+    for (i = 0; i < iterations; i++)
+    {
+        ticks = BenchTicks();
+        blacklist = BlackListLoad(1, text_files);
+        text_ticks += BenchTicks() - ticks;
+        if (blacklist == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        text_lookup_ticks += FirstLookups(blacklist);
+        ticks = BenchTicks();
+        BlackListWrite(blacklist, IMAGE_FILE);
+        write_ticks += BenchTicks() - ticks;
+        BlackListFree(blacklist);
+
+        ticks = BenchTicks();
+        blacklist = BlackListLoad(1, image_files);
+        image_ticks += BenchTicks() - ticks;
+        if (blacklist == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        image_lookup_ticks += FirstLookups(blacklist);
+        BlackListFree(blacklist);
+    }
+    remove(TEXT_FILE);
+    remove(IMAGE_FILE);
+
+    printf("entries: %u, %u iterations\n", NUM_ENTRIES, iterations);
+    printf("%-24s %10.1f ms\n", "load (text)",
+        BenchNs(text_ticks, iterations) / 1.0e6);
+    printf("%-24s %10.1f ms\n", "write (image)",
+        BenchNs(write_ticks, iterations) / 1.0e6);
+    printf("%-24s %10.1f ms\n", "load (image)",
+        BenchNs(image_ticks, iterations) / 1.0e6);
+    BenchReport("first lookup (text)", text_lookup_ticks,
+        (UINT64)iterations * NUM_URLS, "lookup");
+    BenchReport("first lookup (image)", image_lookup_ticks,
+        (UINT64)iterations * NUM_URLS, "lookup");
+    return 0;
+}
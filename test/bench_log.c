@@ -0,0 +1,213 @@
+/*
+ * bench_log.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The netdump packet log, on packets of 0 to 1400 payload bytes (TCP/IPv4
+ * and UDP/IPv6):
+ *  - "format": PacketFormat() alone;
+ *  - "log thread": the log thread writing a full ring (the records of
+ *    formatted packets), to /dev/null; and
+ *  - "capture (N)": N producers each formatting packets and appending them
+ *    to the ring (LogWrite()) while the log thread writes it, as the capture
+ *    loop does; with the number of records dropped because the ring was
+ *    full.
+ * The log thread's output goes to /dev/null, and the results are printed
+ * at the end.
+ *
+ * usage: bench_log [--iterations N]
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <winsock2.h>
+#include "windivert.h"
+#include "../examples/netdump/log.c"
+#include "test.h"
+#include "bench.h"
+
+#define NUM_PACKETS     64
+#define PRODUCERS_MAX   4
+
+typedef struct
+{
+    UINT8 packet[1500];
+    UINT len;
+} TESTPACKET, *PTESTPACKET;
+
+static LOG packet_log;
+static TESTPACKET packets[NUM_PACKETS];
+static WINDIVERT_ADDRESS addr;
+static UINT iterations;
+static volatile LONG dropped = 0;
+
+/*
+ * Format and log each packet, iterations times.
+ */
+static DWORD WINAPI Producer(LPVOID arg)
+{
+    static char records[PRODUCERS_MAX][LOG_RECORD_MAX];
+    char *record = records[(UINT_PTR)arg];
+    UINT i, j, len;
+    LONG n = 0;
+
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < NUM_PACKETS; j++)
+        {
+            len = PacketFormat(record, packets[j].packet, packets[j].len,
+                &addr);
+            n += !LogWrite(&packet_log, record, len);
+        }
+    }
+    InterlockedExchangeAdd(&dropped, n);
+    return 0;
+}
+
+/*
+ * Wait until the log thread has written (and flushed) every record.
+ */
+static void LogDrain(void)
+{
+    while (packet_log.tail != packet_log.head)
+    {
+        Sleep(1);
+    }
+    Sleep(2 * LOG_INTERVAL);
+}
+
+int main(int argc, char **argv)
+{
+    static const UINT payload_lens[] = {0, 64, 512, 1400};
+    static char payload[1400 + 1], record[LOG_RECORD_MAX];
+    HANDLE threads[PRODUCERS_MAX], thread;
+    LONGLONG format_ticks, log_ticks, ticks[PRODUCERS_MAX + 1];
+    LONG num_dropped[PRODUCERS_MAX + 1];
+    UINT i, j, len, num, records;
+    int out_fd, null_fd;
+    char name[32];
+
+    iterations = BenchIterations(argc, argv, 200);
+
+    // The log thread's output goes to /dev/null (from the start, so that it
+    // can set the stdout buffer):
+    fflush(stdout);
+    out_fd = dup(1);
+    null_fd = open("/dev/null", O_WRONLY);
+    if (out_fd < 0 || null_fd < 0)
+    {
+        fprintf(stderr, "error: failed to open /dev/null\n");
+        return EXIT_FAILURE;
+    }
+    dup2(null_fd, 1);
+    close(null_fd);
+
+    // The packets:
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        len = payload_lens[i % 4];
+        for (j = 0; j < len; j++)
+        {
+            payload[j] = (char)(' ' + TestRandom() % 95);
+        }
+        payload[len] = '\0';
+        packets[i].len = TestPacket(packets[i].packet, (i % 8 >= 4),
+            (i % 8 >= 4? IPPROTO_UDP: IPPROTO_TCP), (UINT16)(1024 + i), 80,
+            payload);
+    }
+    addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+    addr.IfIdx     = 7;
+    LogInit(&packet_log, 0);
+
+    // Format only:
+    format_ticks = BenchTicks();
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < NUM_PACKETS; j++)
+        {
+            PacketFormat(record, packets[j].packet, packets[j].len, &addr);
+        }
+    }
+    format_ticks = BenchTicks() - format_ticks;
+
+    // Fill the ring, and time the log thread writing it:
+    for (records = 0; ; records++)
+    {
+        len = PacketFormat(record, packets[records % NUM_PACKETS].packet,
+            packets[records % NUM_PACKETS].len, &addr);
+        if (!LogWrite(&packet_log, record, len))
+        {
+            break;
+        }
+    }
+    packet_log.dropped = 0;
+    log_ticks = BenchTicks();
+    thread = CreateThread(NULL, 0, LogThread, (LPVOID)&packet_log, 0, NULL);
+    if (thread == NULL)
+    {
+        fprintf(stderr, "error: failed to start log thread\n");
+        return EXIT_FAILURE;
+    }
+    while (packet_log.tail != packet_log.head)
+    {
+        YieldProcessor();
+    }
+    log_ticks = BenchTicks() - log_ticks;
+    LogDrain();
+
+    // Capture with 1, 2 and 4 producers:
+    for (num = 1; num <= PRODUCERS_MAX; num *= 2)
+    {
+        InterlockedExchange(&dropped, 0);
+        ticks[num] = BenchTicks();
+        for (i = 0; i < num; i++)
+        {
+            threads[i] = CreateThread(NULL, 0, Producer, (LPVOID)(UINT_PTR)i,
+                0, NULL);
+            if (threads[i] == NULL)
+            {
+                fprintf(stderr, "error: failed to start producer\n");
+                return EXIT_FAILURE;
+            }
+        }
+        WaitForMultipleObjects(num, threads, TRUE, INFINITE);
+        ticks[num] = BenchTicks() - ticks[num];
+        num_dropped[num] = dropped;
+        for (i = 0; i < num; i++)
+        {
+            CloseHandle(threads[i]);
+        }
+        LogDrain();
+    }
+
+    fflush(stdout);
+    dup2(out_fd, 1);
+    close(out_fd);
+    printf("%u packets, %u records fill the ring\n", NUM_PACKETS, records);
+    BenchReport("format", format_ticks, (UINT64)iterations * NUM_PACKETS,
+        "packet");
+    BenchReport("log thread", log_ticks, records, "record");
+    for (num = 1; num <= PRODUCERS_MAX; num *= 2)
+    {
+        snprintf(name, sizeof(name), "capture (%u)", num);
+        BenchReport(name, ticks[num],
+            (UINT64)num * iterations * NUM_PACKETS, "packet");
+        printf("%-24s %10ld dropped\n", name, (long)num_dropped[num]);
+    }
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * bench_nbl.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Contention of the injection path's NET_BUFFER_LIST bookkeeping, with 1, 2,
+ * 4 and 8 threads each allocating and freeing (as inject and inject-complete
+ * do).  Compares:
+ *  - "count": an allocation (malloc(), standing in for the NDIS pool) plus
+ *    windivert_nbl_count_alloc()/windivert_nbl_count_free(); and
+ *  - "free-list": a free list behind one spin lock, as the driver's own
+ *    NET_BUFFER_LIST recycling used.
+ *
+ * usage: bench_nbl [--iterations N]
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+#include "bench.h"
+
+#define THREADS_MAX     8
+#define BURST           16
+#define OBJECT_LEN      256
+
+static struct windivert_nbl_count_s count;
+static UINT iterations;
+
+/*
+ * The free-list model.
+ */
+typedef struct ENTRY
+{
+    struct ENTRY *next;
+} ENTRY, *PENTRY;
+
+static volatile LONG lock = 0;
+static PENTRY free_list = NULL;
+
+static void Lock(void)
+{
+    while (InterlockedCompareExchange(&lock, 1, 0) != 0)
+    {
+        while (lock != 0)
+        {
+            YieldProcessor();
+        }
+    }
+}
+
+static void Unlock(void)
+{
+    InterlockedExchange(&lock, 0);
+}
+
+static PVOID FreeListAlloc(void)
+{
+    PENTRY entry;
+
+    Lock();
+    entry = free_list;
+    if (entry != NULL)
+    {
+        free_list = entry->next;
+    }
+    Unlock();
+    return (entry != NULL? (PVOID)entry: malloc(OBJECT_LEN));
+}
+
+static void FreeListFree(PVOID object)
+{
+    PENTRY entry = (PENTRY)object;
+
+    Lock();
+    entry->next = free_list;
+    free_list = entry;
+    Unlock();
+}
+
+/*
+ * Allocate and free BURST objects at a time, iterations times.
+ */
+static DWORD WINAPI CountThread(LPVOID arg)
+{
+    PVOID objects[BURST];
+    UINT i, j;
+
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < BURST; j++)
+        {
+            objects[j] = malloc(OBJECT_LEN);
+            windivert_nbl_count_alloc(&count);
+        }
+        for (j = 0; j < BURST; j++)
+        {
+            free(objects[j]);
+            windivert_nbl_count_free(&count);
+        }
+    }
+    return 0;
+}
+
+static DWORD WINAPI FreeListThread(LPVOID arg)
+{
+    PVOID objects[BURST];
+    UINT i, j;
+
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < BURST; j++)
+        {
+            objects[j] = FreeListAlloc();
+        }
+        for (j = 0; j < BURST; j++)
+        {
+            FreeListFree(objects[j]);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Run num threads of func; returns the elapsed ticks.
+ */
+static LONGLONG Run(LPTHREAD_START_ROUTINE func, UINT num)
+{
+    HANDLE threads[THREADS_MAX];
+    LONGLONG ticks;
+    UINT i;
+
+    ticks = BenchTicks();
+    for (i = 0; i < num; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, func, NULL, 0, NULL);
+    }
+    WaitForMultipleObjects(num, threads, TRUE, INFINITE);
+    ticks = BenchTicks() - ticks;
+    for (i = 0; i < num; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+    return ticks;
+}
+
+int main(int argc, char **argv)
+{
+    UINT num;
+    LONGLONG ticks;
+    UINT64 ops;
+    PENTRY entry;
+    char name[64];
+
+    iterations = BenchIterations(argc, argv, 100000);
+    windivert_nbl_count_init(&count);
+    for (num = 1; num <= THREADS_MAX; num *= 2)
+    {
+        ops = (UINT64)num * iterations * BURST;
+        ticks = Run(CountThread, num);
+        snprintf(name, sizeof(name), "count (%u)", num);
+        BenchReport(name, ticks, ops, "alloc+free");
+        ticks = Run(FreeListThread, num);
+        snprintf(name, sizeof(name), "free-list (%u)", num);
+        BenchReport(name, ticks, ops, "alloc+free");
+    }
+    printf("peak: %ld in use\n", (long)windivert_nbl_count_sample(&count));
+    if (count.used != 0)
+    {
+        fprintf(stderr, "error: %ld still in use\n", (long)count.used);
+        return EXIT_FAILURE;
+    }
+
+    while ((entry = free_list) != NULL)
+    {
+        free_list = entry->next;
+        free(entry);
+    }
+    return 0;
+}
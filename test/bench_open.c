@@ -0,0 +1,168 @@
+/*
+ * bench_open.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Open latency: WinDivertOpen() with a filter string, which compiles the
+ * filter each time, against WinDivertOpenCompiled() with a precompiled
+ * filter object, and the driver's side of the open (windivert_open_verify()
+ * and windivert_filter_load()).  The device is the shim's, so the time of
+ * the DeviceIoControl() call itself is not included.
+ *
+ * usage: bench_open [--iterations N]
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+#include "bench.h"
+
+#define NUM_PATTERNS    200
+#define MAX_OBJECT      0x100000
+
+static UINT8 request[MAX_OBJECT];
+static DWORD request_len;
+
+static BOOL DeviceIoControlHook(HANDLE handle, DWORD code, LPVOID in,
+    DWORD in_len, LPVOID out, DWORD out_len, DWORD *ret_len,
+    LPOVERLAPPED overlapped)
+{
+    request_len = (out_len < sizeof(request)? out_len: sizeof(request));
+    memcpy(request, out, request_len);
+    *ret_len = 0;
+    return TRUE;
+}
+
+/*
+ * The driver's side of the open (see windivert_filter_compile()).
+ */
+static BOOL DriverOpen(void)
+{
+    windivert_ioctl_open_t ioctl_open = (windivert_ioctl_open_t)request;
+    windivert_ioctl_filter_t program;
+    filter_t filter;
+    size_t automata_len;
+    BOOL result;
+
+    if (!windivert_open_verify(ioctl_open, request_len))
+    {
+        return FALSE;
+    }
+    program = (windivert_ioctl_filter_t)(ioctl_open + 1);
+    automata_len = request_len - sizeof(struct windivert_ioctl_open_s) -
+        ioctl_open->filter_len*sizeof(struct windivert_ioctl_filter_s);
+    filter = (filter_t)malloc(ioctl_open->filter_len*sizeof(struct filter_s) +
+        automata_len + 1);
+    if (filter == NULL)
+    {
+        return FALSE;
+    }
+    memcpy(filter + ioctl_open->filter_len, program + ioctl_open->filter_len,
+        automata_len);
+    result = windivert_filter_load(program, ioctl_open->filter_len,
+        (UINT8 *)(filter + ioctl_open->filter_len), automata_len, filter);
+    free(filter);
+    return result;
+}
+
+/*
+ * Time n opens of filter, both ways.
+ */
+static BOOL Bench(const char *name, const char *filter, UINT n)
+{
+    static UINT8 object[MAX_OBJECT];
+    UINT object_len, i;
+    HANDLE handle;
+    LONGLONG ticks;
+    char label[64];
+
+    if (!WinDivertFilterCompile(filter, WINDIVERT_LAYER_NETWORK, object,
+            sizeof(object), &object_len))
+    {
+        fprintf(stderr, "error: failed to compile \"%s\" filter\n", name);
+        return FALSE;
+    }
+
+    ticks = BenchTicks();
+    for (i = 0; i < n; i++)
+    {
+        handle = WinDivertOpen(filter, WINDIVERT_LAYER_NETWORK, 0, 0);
+        if (handle == INVALID_HANDLE_VALUE)
+        {
+            return FALSE;
+        }
+        CloseHandle(handle);
+    }
+    ticks = BenchTicks() - ticks;
+    snprintf(label, sizeof(label), "open %s (string)", name);
+    BenchReport(label, ticks, n, "open");
+
+    ticks = BenchTicks();
+    for (i = 0; i < n; i++)
+    {
+        handle = WinDivertOpenCompiled(object, object_len, 0, 0);
+        if (handle == INVALID_HANDLE_VALUE)
+        {
+            return FALSE;
+        }
+        CloseHandle(handle);
+    }
+    ticks = BenchTicks() - ticks;
+    snprintf(label, sizeof(label), "open %s (object)", name);
+    BenchReport(label, ticks, n, "open");
+
+    ticks = BenchTicks();
+    for (i = 0; i < n; i++)
+    {
+        if (!DriverOpen())
+        {
+            return FALSE;
+        }
+    }
+    ticks = BenchTicks() - ticks;
+    snprintf(label, sizeof(label), "open %s (driver)", name);
+    BenchReport(label, ticks, n, "open");
+    printf("%-24s %10u bytes\n", name, object_len);
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    static char patterns[NUM_PATTERNS * 24 + 64];
+    UINT iterations = BenchIterations(argc, argv, 2000), i;
+    char *s;
+
+    shim_device_io_control = DeviceIoControlHook;
+
+    s = patterns + sprintf(patterns, "tcp.Payload contains {");
+    for (i = 0; i < NUM_PATTERNS; i++)
+    {
+        s += sprintf(s, "%s\"host%u.example\"", (i == 0? "": ", "), i);
+    }
+    sprintf(s, "}");
+
+    if (!Bench("simple", "tcp.DstPort == 80", iterations) ||
+        !Bench("rules", "(ip.DstAddr == 10.0.0.1 and tcp.DstPort == 80) or "
+            "(ipv6.DstAddr == fe80::1 and udp.DstPort == 53) or "
+            "(icmp.Type == 8 and ip.TTL < 64) or tcp.Payload[0:4] == \"GET \"",
+            iterations) ||
+        !Bench("contains", patterns, 1 + iterations / 20))
+    {
+        fprintf(stderr, "error: open failed\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
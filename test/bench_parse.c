@@ -0,0 +1,142 @@
+/*
+ * bench_parse.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares WinDivertHelperParsePacketBatch() with a loop that calls
+ * WinDivertHelperParsePacket() for each packet and fills in the same
+ * columns, on a mixed IPv4/IPv6 TCP/UDP/ICMP trace.
+ *
+ * usage: bench_parse [--iterations N]
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+#include "bench.h"
+
+#define NUM_PACKETS     4096
+#define PACKET_MAX      128
+
+static UINT8 data[NUM_PACKETS][PACKET_MAX];
+static PVOID packets[NUM_PACKETS];
+static UINT packet_lens[NUM_PACKETS];
+
+static UINT8 version[NUM_PACKETS];
+static UINT8 protocol[NUM_PACKETS];
+static UINT32 src_addr[4*NUM_PACKETS];
+static UINT32 dst_addr[4*NUM_PACKETS];
+static UINT16 src_port[NUM_PACKETS];
+static UINT16 dst_port[NUM_PACKETS];
+static UINT payload_offset[NUM_PACKETS];
+static UINT payload_len[NUM_PACKETS];
+
+/*
+ * Fill in the columns for one packet with WinDivertHelperParsePacket().
+ */
+static void ParseOne(UINT i)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_UDPHDR udp_header;
+    PVOID data_ptr;
+    UINT data_len;
+
+    WinDivertHelperParsePacket(packets[i], packet_lens[i], &ip_header,
+        &ipv6_header, NULL, NULL, &tcp_header, &udp_header, &data_ptr,
+        &data_len);
+    if (ip_header != NULL)
+    {
+        version[i]      = 4;
+        protocol[i]     = ip_header->Protocol;
+        src_addr[4*i+0] = dst_addr[4*i+0] = 0;
+        src_addr[4*i+1] = dst_addr[4*i+1] = 0;
+        src_addr[4*i+2] = dst_addr[4*i+2] = htonl(0x0000FFFFu);
+        src_addr[4*i+3] = ip_header->SrcAddr;
+        dst_addr[4*i+3] = ip_header->DstAddr;
+    }
+    else if (ipv6_header != NULL)
+    {
+        version[i]      = 6;
+        protocol[i]     = ipv6_header->NextHdr;
+        memcpy(src_addr + 4*i, ipv6_header->SrcAddr, 4*sizeof(UINT32));
+        memcpy(dst_addr + 4*i, ipv6_header->DstAddr, 4*sizeof(UINT32));
+    }
+    src_port[i] = (tcp_header != NULL? tcp_header->SrcPort:
+        udp_header != NULL? udp_header->SrcPort: 0);
+    dst_port[i] = (tcp_header != NULL? tcp_header->DstPort:
+        udp_header != NULL? udp_header->DstPort: 0);
+    payload_offset[i] = packet_lens[i] - data_len;
+    payload_len[i]    = data_len;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *payloads[] = {"", "GET / HTTP/1.1\r\n", "x"};
+    static const UINT8 protocols[] = {IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP};
+    WINDIVERT_PACKET_COLUMNS columns;
+    UINT iterations = BenchIterations(argc, argv, 2000), i, j, parsed = 0;
+    UINT8 proto;
+    BOOL ipv6;
+    LONGLONG start, single_ticks = 0, batch_ticks = 0;
+
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        ipv6  = (TestRandom() % 2 == 0);
+        proto = protocols[TestRandom() % 3];
+        if (ipv6 && proto == IPPROTO_ICMP)
+        {
+            proto = IPPROTO_ICMPV6;
+        }
+        packet_lens[i] = TestPacket(data[i], ipv6, proto,
+            (UINT16)(1024 + TestRandom() % 1024), 80,
+            payloads[TestRandom() % 3]);
+        packets[i] = data[i];
+    }
+
+    columns.Version       = version;
+    columns.Protocol      = protocol;
+    columns.SrcAddr       = src_addr;
+    columns.DstAddr       = dst_addr;
+    columns.SrcPort       = src_port;
+    columns.DstPort       = dst_port;
+    columns.PayloadOffset = payload_offset;
+    columns.PayloadLength = payload_len;
+
+    for (j = 0; j < iterations; j++)
+    {
+        start = BenchTicks();
+        for (i = 0; i < NUM_PACKETS; i++)
+        {
+            ParseOne(i);
+        }
+        single_ticks += BenchTicks() - start;
+
+        start = BenchTicks();
+        parsed += WinDivertHelperParsePacketBatch(packets, packet_lens,
+            NUM_PACKETS, &columns);
+        batch_ticks += BenchTicks() - start;
+    }
+
+    printf("packets:  %u (%u parsed), %u iterations\n", NUM_PACKETS,
+        parsed / iterations, iterations);
+    BenchReport("parse (per packet)", single_ticks,
+        (UINT64)NUM_PACKETS * iterations, "packet");
+    BenchReport("parse (batch)", batch_ticks,
+        (UINT64)NUM_PACKETS * iterations, "packet");
+    return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * bench_reassemble.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Memory use and throughput of WinDivertHelperReassemble(), for IPv4 and
+ * IPv6 datagrams of 8KB and 64KB split into 1500 byte packets.  Several
+ * datagrams are interleaved, and each is sent in order or in reverse order.
+ *
+ * usage: bench_reassemble [--iterations N]
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+#include "bench.h"
+
+#define NUM_DATAGRAMS   WINDIVERT_REASSEMBLY_DEFAULT_DATAGRAMS
+#define INTERLEAVE      8
+#define MTU             1500
+#define FRAGS_MAX       64
+
+static UINT8 frags[INTERLEAVE][FRAGS_MAX][MTU];
+static UINT frag_lens[INTERLEAVE][FRAGS_MAX];
+static UINT8 output[0x10000 + 64];
+
+/*
+ * Split a datagram with data_len bytes of data into MTU sized fragments;
+ * returns the number of fragments.
+ */
+static UINT Fragments(UINT k, BOOL ipv6, UINT data_len, UINT16 id)
+{
+    UINT hdr_len = (ipv6? sizeof(WINDIVERT_IPV6HDR) + 8:
+        sizeof(WINDIVERT_IPHDR));
+    UINT chunk = (MTU - hdr_len) & ~7u, offset, len, n = 0;
+    UINT32 id32 = htonl((UINT32)id);
+    UINT16 frag_off;
+    UINT8 *frag;
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+
+    for (offset = 0; offset < data_len; offset += len, n++)
+    {
+        len = (data_len - offset > chunk? chunk: data_len - offset);
+        frag = frags[k][n];
+        TestPacket(frag, ipv6, IPPROTO_UDP, 53, 53, "");
+        memset(frag + hdr_len, (int)(offset / 8), len);
+        frag_lens[k][n] = hdr_len + len;
+        if (!ipv6)
+        {
+            ip_header = (PWINDIVERT_IPHDR)frag;
+            ip_header->Id = htons(id);
+            ip_header->Length = htons((UINT16)(hdr_len + len));
+            WINDIVERT_IPHDR_SET_FRAGOFF(ip_header,
+                htons((UINT16)(offset / 8)));
+            WINDIVERT_IPHDR_SET_MF(ip_header, offset + len < data_len);
+            continue;
+        }
+        ipv6_header = (PWINDIVERT_IPV6HDR)frag;
+        ipv6_header->NextHdr = 44;
+        ipv6_header->Length = htons((UINT16)(8 + len));
+        frag += sizeof(WINDIVERT_IPV6HDR);
+        frag[0] = IPPROTO_UDP;
+        frag[1] = 0;
+        frag_off = htons((UINT16)(offset | (offset + len < data_len? 1: 0)));
+        memcpy(frag + 2, &frag_off, sizeof(frag_off));
+        memcpy(frag + 4, &id32, sizeof(id32));
+    }
+    return n;
+}
+
+/*
+ * Reassemble INTERLEAVE datagrams, iterations times; returns the number of
+ * packets.
+ */
+static UINT64 Run(HANDLE handle, BOOL ipv6, UINT data_len, BOOL reverse,
+    UINT iterations, LONGLONG *ticks, UINT *failed)
+{
+    UINT n = 0, i, j, k, f, read_len;
+    UINT64 packets = 0;
+    LONGLONG start;
+
+    for (k = 0; k < INTERLEAVE; k++)
+    {
+        n = Fragments(k, ipv6, data_len, (UINT16)k);
+    }
+    start = BenchTicks();
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < n; j++)
+        {
+            f = (reverse? n - 1 - j: j);
+            for (k = 0; k < INTERLEAVE; k++)
+            {
+                if (WinDivertHelperReassemble(handle, frags[k][f],
+                        frag_lens[k][f], output, sizeof(output), &read_len)
+                        != (j == n - 1))
+                {
+                    (*failed)++;
+                }
+            }
+        }
+        packets += (UINT64)n * INTERLEAVE;
+    }
+    *ticks = BenchTicks() - start;
+    return packets;
+}
+
+int main(int argc, char **argv)
+{
+    static const UINT sizes[] = {8192, 0xFFFF - sizeof(WINDIVERT_IPHDR)};
+    UINT iterations = BenchIterations(argc, argv, 200), failed = 0, s;
+    HANDLE handle;
+    LONGLONG ticks;
+    UINT64 packets;
+    BOOL ipv6, reverse;
+    char name[64];
+
+    printf("memory:   %u datagrams, %lu bytes\n", NUM_DATAGRAMS,
+        (unsigned long)(sizeof(WINDIVERT_REASSEMBLY) +
+            NUM_DATAGRAMS * (sizeof(WINDIVERT_REASSEMBLY_ENTRY) +
+                WINDIVERT_REASSEMBLY_MAXLEN)));
+    handle = WinDivertHelperReassemblyOpen(NUM_DATAGRAMS,
+        WINDIVERT_REASSEMBLY_DEFAULT_TIMEOUT);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "error: failed to open reassembly context (%d)\n",
+            GetLastError());
+        return EXIT_FAILURE;
+    }
+    for (ipv6 = FALSE; ipv6 <= TRUE; ipv6++)
+    {
+        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            for (reverse = FALSE; reverse <= TRUE; reverse++)
+            {
+                packets = Run(handle, ipv6, sizes[s], reverse, iterations,
+                    &ticks, &failed);
+                snprintf(name, sizeof(name), "%s %5u %s", (ipv6? "ipv6":
+                    "ipv4"), sizes[s], (reverse? "reverse": "in-order"));
+                BenchReport(name, ticks, packets, "packet");
+            }
+        }
+    }
+    WinDivertHelperReassemblyClose(handle);
+    if (failed != 0)
+    {
+        fprintf(stderr, "error: %u packets were not reassembled as "
+            "expected\n", failed);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * bench_reload.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Lookup latency of the webfilter blacklist (100K entries) with 4 reader
+ * threads, each lookup being a BlackListEnter(), BlackListMatch() and
+ * BlackListExit() as in the worker threads:
+ *  - "direct": BlackListMatch() alone, for comparison;
+ *  - "steady": no reloads; and
+ *  - "reload": another thread swapping blacklists back to back, as fast as
+ *    the readers let it (a real reload happens once per changed file).
+ * Each reports the mean, median, 99.9th percentile and maximum lookup time
+ * (with fewer CPUs than readers, the tail includes the readers being
+ * preempted), and "reload" also the number and mean time of the swaps.
+ *
+ * usage: bench_reload [--iterations N]
+ */
+
+#include <winsock2.h>
+#include "windivert.h"
+#include "../examples/webfilter/blacklist.c"
+#include "test.h"
+#include "bench.h"
+
+#define NUM_ENTRIES     100000
+#define NUM_URLS        4096
+#define NUM_READERS     4
+
+static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789-";
+#define ALPHABET_LEN    (sizeof(alphabet) - 1)
+static const char *tlds[] = {"com", "net", "org", "de", "uk", "info"};
+#define NUM_TLDS        (sizeof(tlds) / sizeof(tlds[0]))
+
+static char domains[NUM_URLS][4 + 64];
+static char uris[NUM_URLS][32 + 11];
+static UINT iterations;
+static BOOL direct;
+static PBLACKLIST blacklists[2];
+static LONGLONG *samples[NUM_READERS];
+static volatile LONG running = 0;
+static volatile LONG matched = 0;
+
+/*
+ * A random entry (as in bench_blacklist).
+ */
+static void RandomEntry(char *domain, char *uri)
+{
+    UINT i, j, len, num_labels = 1 + TestRandom() % 2;
+    char *s = domain;
+
+    for (i = 0; i < num_labels; i++)
+    {
+        len = 4 + TestRandom() % 10;
+        for (j = 0; j < len; j++)
+        {
+            *s++ = alphabet[TestRandom() % ALPHABET_LEN];
+        }
+        *s++ = '.';
+    }
+    strcpy(s, tlds[TestRandom() % NUM_TLDS]);
+    len = (TestRandom() % 2 == 0? 0: 3 + TestRandom() % 8);
+    for (j = 0; j < len; j++)
+    {
+        uri[j] = alphabet[TestRandom() % 26];
+    }
+    uri[len] = '\0';
+}
+
+/*
+ * Build a blacklist of NUM_ENTRIES random entries (the same ones each time).
+ */
+static PBLACKLIST NewBlackList(void)
+{
+    PBLACKLIST blacklist = BlackListInit();
+    char domain[64], uri[32], key[MAXKEY];
+    UINT len, i;
+
+    test_random_state = 0x12345678;
+    for (i = 0; i < NUM_ENTRIES; i++)
+    {
+        RandomEntry(domain, uri);
+        len = DomainReverse(domain, (UINT)strlen(domain), key);
+        key[len++] = '/';
+        strcpy(key + len, uri);
+        BlackListInsert(blacklist, key, len + (UINT)strlen(uri));
+    }
+    BlackListCompile(blacklist);
+    return blacklist;
+}
+
+/*
+ * Time each of iterations * NUM_URLS lookups.
+ */
+static DWORD WINAPI Reader(LPVOID arg)
+{
+    LONGLONG *sample = samples[(UINT_PTR)arg], ticks;
+    PBLACKLIST blacklist;
+    URL url;
+    LONG epoch;
+    UINT i, j, n = 0;
+
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < NUM_URLS; j++)
+        {
+            url.domain = domains[j];
+            url.uri    = uris[j];
+            ticks = BenchTicks();
+            if (direct)
+            {
+                n += BlackListMatch(blacklists[0], &url);
+            }
+            else
+            {
+                blacklist = BlackListEnter(&epoch);
+                n += BlackListMatch(blacklist, &url);
+                BlackListExit(epoch);
+            }
+            *sample++ = BenchTicks() - ticks;
+        }
+    }
+    InterlockedExchangeAdd(&matched, (LONG)n);
+    InterlockedDecrement(&running);
+    return 0;
+}
+
+static int __cdecl SampleCompare(const void *a, const void *b)
+{
+    LONGLONG x = *(const LONGLONG *)a, y = *(const LONGLONG *)b;
+    return (x < y? -1: (x > y? 1: 0));
+}
+
+/*
+ * Run the readers, swapping blacklists until they finish if reload.
+ */
+static void Run(const char *name, BOOL reload)
+{
+    HANDLE threads[NUM_READERS];
+    LONGLONG ticks, swap_ticks = 0, total = 0, *all;
+    UINT64 num = (UINT64)iterations * NUM_URLS, swaps = 0, i;
+    char label[64];
+
+    InterlockedExchange(&running, NUM_READERS);
+    InterlockedExchange(&matched, 0);
+    for (i = 0; i < NUM_READERS; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, Reader, (LPVOID)(UINT_PTR)i, 0,
+            NULL);
+        if (threads[i] == NULL)
+        {
+            fprintf(stderr, "error: failed to start reader\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while (reload && running != 0)
+    {
+        ticks = BenchTicks();
+        BlackListSwap(blacklists[(swaps + 1) % 2]);
+        swap_ticks += BenchTicks() - ticks;
+        swaps++;
+    }
+    WaitForMultipleObjects(NUM_READERS, threads, TRUE, INFINITE);
+    for (i = 0; i < NUM_READERS; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+    if (matched != (LONG)(NUM_READERS * num))
+    {
+        fprintf(stderr, "error: %ld/%lu URLs matched\n", (long)matched,
+            (unsigned long)(NUM_READERS * num));
+        exit(EXIT_FAILURE);
+    }
+
+    // The samples are contiguous (see main()):
+    all = samples[0];
+    num *= NUM_READERS;
+    for (i = 0; i < num; i++)
+    {
+        total += all[i];
+    }
+    qsort(all, (size_t)num, sizeof(LONGLONG), SampleCompare);
+    snprintf(label, sizeof(label), "%s (mean)", name);
+    BenchReport(label, total, num, "lookup");
+    snprintf(label, sizeof(label), "%s (median)", name);
+    BenchReport(label, all[num / 2], 1, "lookup");
+    snprintf(label, sizeof(label), "%s (99.9%%)", name);
+    BenchReport(label, all[num - 1 - num / 1000], 1, "lookup");
+    snprintf(label, sizeof(label), "%s (max)", name);
+    BenchReport(label, all[num - 1], 1, "lookup");
+    if (reload)
+    {
+        printf("%-24s %10lu swaps\n", name, (unsigned long)swaps);
+        snprintf(label, sizeof(label), "%s (swap)", name);
+        BenchReport(label, swap_ticks, swaps, "swap");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    LONGLONG *all;
+    char domain[64], uri[32];
+    UINT i;
+
+    iterations = BenchIterations(argc, argv, 50);
+    blacklists[0] = NewBlackList();
+    blacklists[1] = NewBlackList();
+
+    // Blocked URLs: subdomains of the first entries, with longer uris:
+    test_random_state = 0x12345678;
+    for (i = 0; i < NUM_URLS; i++)
+    {
+        RandomEntry(domain, uri);
+        snprintf(domains[i], sizeof(domains[i]), "www.%s", domain);
+        snprintf(uris[i], sizeof(uris[i]), "%s/index.html", uri);
+    }
+    all = (LONGLONG *)malloc(NUM_READERS * (size_t)iterations * NUM_URLS *
+        sizeof(LONGLONG));
+    if (all == NULL)
+    {
+        fprintf(stderr, "error: memory allocation failed\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < NUM_READERS; i++)
+    {
+        samples[i] = all + (size_t)i * iterations * NUM_URLS;
+    }
+
+    BlackListSwap(blacklists[0]);
+    printf("entries: %u, %u readers\n", NUM_ENTRIES, NUM_READERS);
+    direct = TRUE;
+    Run("direct", FALSE);
+    direct = FALSE;
+    Run("steady", FALSE);
+    Run("reload", TRUE);
+
+    BlackListSwap(NULL);
+    BlackListFree(blacklists[0]);
+    BlackListFree(blacklists[1]);
+    free(all);
+    return 0;
+}
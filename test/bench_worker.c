@@ -0,0 +1,314 @@
+/*
+ * bench_worker.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Scaling of the webfilter workers: 1, 2, 4 and 8 workers, each handling
+ * (with WorkerPacket()) the packets of its own queue's HTTP connections, as
+ * after WinDivertRecvQueue().  Each worker has 128 connections: a quarter
+ * each send an allowed request, a blocked request, a request split over
+ * two packets, and other data.  The blacklist has 100K entries, the device
+ * accepts every packet sent, and the URL log is emptied (but not written)
+ * as often as by the log thread.  Reports the time per packet, over all
+ * workers (so ideal scaling divides it by the number of workers, up to the
+ * number of CPUs).
+ *
+ * usage: bench_worker [--iterations N]
+ */
+
+#include <winsock2.h>
+#include "windivert.h"
+#include "../examples/webfilter/blacklist.c"
+#include "../examples/webfilter/worker.c"
+#include "test.h"
+#include "bench.h"
+
+#define NUM_ENTRIES     100000
+#define NUM_FLOWS       128
+#define NUM_PACKETS     (NUM_FLOWS + NUM_FLOWS / 4)
+#define WORKERS_MAX     8
+
+static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789-";
+#define ALPHABET_LEN    (sizeof(alphabet) - 1)
+static const char *tlds[] = {"com", "net", "org", "de", "uk", "info"};
+#define NUM_TLDS        (sizeof(tlds) / sizeof(tlds[0]))
+
+/*
+ * A worker's packets, in the order they are handled.
+ */
+typedef struct
+{
+    UINT8 packet[512];
+    UINT len;
+} TESTPACKET, *PTESTPACKET;
+typedef struct
+{
+    WORKER worker;
+    TESTPACKET packets[NUM_PACKETS];
+    UINT64 sends;
+} BENCHWORKER, *PBENCHWORKER;
+
+/*
+ * (Not exported by the DLL's header; frees this thread's I/O event, as the
+ * DLL's thread detach would.)
+ */
+extern BOOL APIENTRY WinDivertDllEntry(HANDLE module, DWORD reason,
+    LPVOID reserved);
+
+static BENCHWORKER workers[WORKERS_MAX];
+static char domains[WORKERS_MAX * NUM_FLOWS / 4][4 + 64];
+static char uris[WORKERS_MAX * NUM_FLOWS / 4][32 + 11];
+static UINT iterations;
+static volatile LONG stop = FALSE;
+static __thread UINT64 thread_sends = 0;
+
+/*
+ * A random entry (as in bench_blacklist).
+ */
+static void RandomEntry(char *domain, char *uri)
+{
+    UINT i, j, len, num_labels = 1 + TestRandom() % 2;
+    char *s = domain;
+
+    for (i = 0; i < num_labels; i++)
+    {
+        len = 4 + TestRandom() % 10;
+        for (j = 0; j < len; j++)
+        {
+            *s++ = alphabet[TestRandom() % ALPHABET_LEN];
+        }
+        *s++ = '.';
+    }
+    strcpy(s, tlds[TestRandom() % NUM_TLDS]);
+    len = (TestRandom() % 2 == 0? 0: 3 + TestRandom() % 8);
+    for (j = 0; j < len; j++)
+    {
+        uri[j] = alphabet[TestRandom() % 26];
+    }
+    uri[len] = '\0';
+}
+
+/*
+ * The device: accept every packet sent.
+ */
+static BOOL DeviceIoControlHook(HANDLE handle, DWORD code, LPVOID in,
+    DWORD in_len, LPVOID out, DWORD out_len, DWORD *ret_len,
+    LPOVERLAPPED overlapped)
+{
+    thread_sends++;
+    *ret_len = out_len;
+    return TRUE;
+}
+
+/*
+ * Build a packet of the connection from port.
+ */
+static void NewPacket(PTESTPACKET packet, UINT16 port, UINT32 seq,
+    const char *payload)
+{
+    PWINDIVERT_TCPHDR tcp_header;
+
+    packet->len = TestPacket(packet->packet, FALSE, IPPROTO_TCP, port, 80,
+        payload);
+    tcp_header = (PWINDIVERT_TCPHDR)(packet->packet +
+        sizeof(WINDIVERT_IPHDR));
+    tcp_header->SeqNum = htonl(seq);
+    tcp_header->AckNum = htonl(0x20000000);
+    tcp_header->Ack    = 1;
+    tcp_header->Psh    = 1;
+    WinDivertHelperCalcChecksums(packet->packet, packet->len, 0);
+}
+
+/*
+ * Build a worker's packets: the first packet of each connection, then the
+ * second halves of the split requests.  The blocked requests are for the
+ * given domains and uris (subdomains of entries, with longer uris).
+ * Returns the number of packets sent for one pass.
+ */
+static UINT BuildPackets(PBENCHWORKER bench, char (*domains)[4 + 64],
+    char (*uris)[32 + 11])
+{
+    char request[256], domain[64], uri[32];
+    PTESTPACKET packet = bench->packets, split_packet;
+    UINT i, split, sends = 0;
+
+    split_packet = packet + NUM_FLOWS;
+    for (i = 0; i < NUM_FLOWS; i++, packet++)
+    {
+        RandomEntry(domain, uri);
+        switch (i % 4)
+        {
+            case 0:
+                snprintf(request, sizeof(request),
+                    "GET /%s/a.html HTTP/1.1\r\nHost: www.%s\r\n\r\n", uri,
+                    domain);
+                NewPacket(packet, (UINT16)(1024 + i), 1000, request);
+                sends++;
+                break;
+            case 1:
+                snprintf(request, sizeof(request),
+                    "GET /%s HTTP/1.1\r\nHost: %s\r\n\r\n", uris[i / 4],
+                    domains[i / 4]);
+                NewPacket(packet, (UINT16)(1024 + i), 1000, request);
+                sends += 3;
+                break;
+            case 2:
+                snprintf(request, sizeof(request),
+                    "GET /%s/c.html HTTP/1.1\r\nHost: www.%s\r\n\r\n", uri,
+                    domain);
+                split = (UINT)strlen(request) / 2;
+                NewPacket(split_packet++, (UINT16)(1024 + i), 1000 + split,
+                    request + split);
+                request[split] = '\0';
+                NewPacket(packet, (UINT16)(1024 + i), 1000, request);
+                sends += 2;
+                break;
+            default:
+                NewPacket(packet, (UINT16)(1024 + i), 5000,
+                    "name=value&other=1");
+                sends++;
+                break;
+        }
+    }
+    return sends;
+}
+
+/*
+ * Handle the worker's packets, iterations times.
+ */
+static DWORD WINAPI Worker(LPVOID arg)
+{
+    PBENCHWORKER bench = (PBENCHWORKER)arg;
+    PREAD read = &bench->worker.reads[0];
+    PTESTPACKET packet;
+    UINT i, j;
+
+    thread_sends = 0;
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < NUM_PACKETS; j++)
+        {
+            packet = &bench->packets[j];
+            memcpy(read->packet, packet->packet, packet->len);
+            read->addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+            WorkerPacket(&bench->worker, read, packet->len);
+        }
+    }
+    bench->sends = thread_sends;
+    WinDivertDllEntry(NULL, DLL_THREAD_DETACH, NULL);
+    return 0;
+}
+
+/*
+ * Empty the URL log as often as the log thread would.
+ */
+static DWORD WINAPI LogDrain(LPVOID arg)
+{
+    while (!stop)
+    {
+        Sleep(LOG_INTERVAL);
+        EnterCriticalSection(&url_log.lock);
+        url_log.len = 0;
+        url_log.dropped = 0;
+        LeaveCriticalSection(&url_log.lock);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    HANDLE threads[WORKERS_MAX], drain;
+    PBLACKLIST blacklist;
+    char domain[64], uri[32], key[MAXKEY], name[32];
+    LONGLONG ticks;
+    UINT i, num, len, sends[WORKERS_MAX];
+
+    iterations = BenchIterations(argc, argv, 2000);
+    shim_device_io_control = DeviceIoControlHook;
+    InitializeCriticalSection(&url_log.lock);
+
+    // The blacklist:
+    test_random_state = 0x12345678;
+    blacklist = BlackListInit();
+    for (i = 0; i < NUM_ENTRIES; i++)
+    {
+        RandomEntry(domain, uri);
+        len = DomainReverse(domain, (UINT)strlen(domain), key);
+        key[len++] = '/';
+        strcpy(key + len, uri);
+        BlackListInsert(blacklist, key, len + (UINT)strlen(uri));
+    }
+    BlackListCompile(blacklist);
+    BlackListSwap(blacklist);
+
+    // Blocked URLs: subdomains of the first entries, with longer uris:
+    test_random_state = 0x12345678;
+    for (i = 0; i < WORKERS_MAX * NUM_FLOWS / 4; i++)
+    {
+        RandomEntry(domain, uri);
+        snprintf(domains[i], sizeof(domains[i]), "www.%s", domain);
+        snprintf(uris[i], sizeof(uris[i]), "%s/index.html", uri);
+    }
+
+    // The workers, each with its own connections (the allowed requests are
+    // for other random URLs):
+    test_random_state = 0x87654321;
+    for (i = 0; i < WORKERS_MAX; i++)
+    {
+        WorkerInit(&workers[i].worker, (HANDLE)&workers[i], i, 1);
+        sends[i] = BuildPackets(&workers[i], domains + i * NUM_FLOWS / 4,
+            uris + i * NUM_FLOWS / 4);
+    }
+    printf("entries: %u, %u connections and %u packets per worker\n",
+        NUM_ENTRIES, NUM_FLOWS, NUM_PACKETS);
+
+    drain = CreateThread(NULL, 0, LogDrain, NULL, 0, NULL);
+    for (num = 1; num <= WORKERS_MAX; num *= 2)
+    {
+        ticks = BenchTicks();
+        for (i = 0; i < num; i++)
+        {
+            threads[i] = CreateThread(NULL, 0, Worker, (LPVOID)&workers[i],
+                0, NULL);
+            if (threads[i] == NULL)
+            {
+                fprintf(stderr, "error: failed to start worker\n");
+                return EXIT_FAILURE;
+            }
+        }
+        WaitForMultipleObjects(num, threads, TRUE, INFINITE);
+        ticks = BenchTicks() - ticks;
+        for (i = 0; i < num; i++)
+        {
+            CloseHandle(threads[i]);
+            if (workers[i].sends != (UINT64)sends[i] * iterations)
+            {
+                fprintf(stderr, "error: worker %u sent %lu packets, "
+                    "expected %lu\n", i, (unsigned long)workers[i].sends,
+                    (unsigned long)((UINT64)sends[i] * iterations));
+                return EXIT_FAILURE;
+            }
+        }
+        snprintf(name, sizeof(name), "workers (%u)", num);
+        BenchReport(name, ticks, (UINT64)num * iterations * NUM_PACKETS,
+            "packet");
+    }
+    InterlockedExchange(&stop, TRUE);
+    WaitForSingleObject(drain, INFINITE);
+    CloseHandle(drain);
+    return 0;
+}
@@ -0,0 +1,1037 @@
+/*
+ * win32.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Minimal POSIX implementation of the Win32 API declared by windows.h, for
+ * running the WinDivert tests on a build host.  Time, atomics, memory, files,
+ * file mappings, threads, TLS and completion ports work; anything that needs
+ * the driver (services, the WinDivert device) fails with ERROR_NOT_SUPPORTED,
+ * unless a test hook simulates it.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <windows.h>
+
+#define SHIM_HANDLE_MAGIC       0x4D494853  // "SHIM"
+#define SHIM_HANDLE_FILE        1
+#define SHIM_HANDLE_EVENT       2
+#define SHIM_HANDLE_THREAD      3
+#define SHIM_HANDLE_DEVICE      4
+#define SHIM_HANDLE_PORT        5
+#define SHIM_HANDLE_MAPPING     6
+#define SHIM_TLS_MAX            64
+
+typedef struct SHIM_COMPLETION
+{
+    struct SHIM_COMPLETION *next;
+    DWORD len;                          // Bytes transferred
+    ULONG_PTR key;                      // Completion key
+    LPOVERLAPPED overlapped;
+    DWORD error;                        // ERROR_SUCCESS, or the error
+} SHIM_COMPLETION, *PSHIM_COMPLETION;
+
+typedef struct SHIM_VIEW
+{
+    struct SHIM_VIEW *next;
+    LPVOID addr;
+    SIZE_T len;
+} SHIM_VIEW, *PSHIM_VIEW;
+
+typedef struct SHIM_HANDLE
+{
+    UINT32 magic;                       // SHIM_HANDLE_MAGIC
+    UINT32 kind;                        // SHIM_HANDLE_*
+    int fd;                             // File descriptor (files and
+                                        // mappings)
+    UINT64 size;                        // File size (mappings)
+    pthread_t thread;                   // Thread (threads)
+    LPTHREAD_START_ROUTINE func;        // Thread function and argument
+    LPVOID arg;
+    BOOL joined;
+    struct SHIM_HANDLE *port;           // Bound completion port (if any)
+    ULONG_PTR key;                      // and its key
+    pthread_mutex_t lock;               // Completion queue (ports)
+    pthread_cond_t cond;
+    PSHIM_COMPLETION head, tail;
+} SHIM_HANDLE, *PSHIM_HANDLE;
+
+BOOL (*shim_device_io_control)(HANDLE handle, DWORD code, LPVOID in,
+    DWORD in_len, LPVOID out, DWORD out_len, DWORD *ret_len,
+    LPOVERLAPPED overlapped) = NULL;
+ULONGLONG shim_tick_offset = 0;
+volatile LONG shim_device_handles = 0;
+
+static __thread DWORD shim_last_error = 0;
+static __thread LPVOID shim_tls[SHIM_TLS_MAX];
+static LONG shim_tls_next = 0;
+static PSHIM_VIEW shim_views = NULL;        // Mapped views
+static pthread_mutex_t shim_views_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Handles.
+ */
+static HANDLE ShimHandleNew(UINT32 kind)
+{
+    PSHIM_HANDLE handle = (PSHIM_HANDLE)calloc(1, sizeof(SHIM_HANDLE));
+
+    if (handle == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    handle->magic = SHIM_HANDLE_MAGIC;
+    handle->kind  = kind;
+    handle->fd    = -1;
+    return (HANDLE)handle;
+}
+
+static PSHIM_HANDLE ShimHandleGet(HANDLE handle, UINT32 kind)
+{
+    PSHIM_HANDLE shim = (PSHIM_HANDLE)handle;
+
+    if (shim == NULL || handle == INVALID_HANDLE_VALUE ||
+        shim->magic != SHIM_HANDLE_MAGIC || shim->kind != kind)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return NULL;
+    }
+    return shim;
+}
+
+static DWORD ShimError(int err)
+{
+    switch (err)
+    {
+        case ENOENT:
+            return ERROR_FILE_NOT_FOUND;
+        case EACCES: case EPERM:
+            return ERROR_ACCESS_DENIED;
+        case EEXIST:
+            return ERROR_ALREADY_EXISTS;
+        case ENOMEM:
+            return ERROR_NOT_ENOUGH_MEMORY;
+        case EINVAL:
+            return ERROR_INVALID_PARAMETER;
+        default:
+            return ERROR_OPEN_FAILED;
+    }
+}
+
+/*
+ * Errors.
+ */
+DWORD GetLastError(void)
+{
+    return shim_last_error;
+}
+
+void SetLastError(DWORD err)
+{
+    shim_last_error = err;
+}
+
+/*
+ * Time.
+ */
+ULONGLONG GetTickCount64(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG)ts.tv_sec * 1000 + (ULONGLONG)ts.tv_nsec / 1000000 +
+        shim_tick_offset;
+}
+
+DWORD GetTickCount(void)
+{
+    return (DWORD)GetTickCount64();
+}
+
+void GetSystemTimeAsFileTime(FILETIME *time)
+{
+    struct timespec ts;
+    UINT64 t;
+
+    // 100ns intervals since 1601-01-01.
+    clock_gettime(CLOCK_REALTIME, &ts);
+    t = (UINT64)ts.tv_sec * 10000000 + (UINT64)ts.tv_nsec / 100 +
+        116444736000000000ull;
+    time->dwLowDateTime  = (DWORD)t;
+    time->dwHighDateTime = (DWORD)(t >> 32);
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    count->QuadPart = (LONGLONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq)
+{
+    freq->QuadPart = 1000000000;
+    return TRUE;
+}
+
+void Sleep(DWORD ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+/*
+ * Atomics.
+ */
+LONG InterlockedIncrement(LONG volatile *addr)
+{
+    return __atomic_add_fetch(addr, 1, __ATOMIC_SEQ_CST);
+}
+
+LONG InterlockedDecrement(LONG volatile *addr)
+{
+    return __atomic_sub_fetch(addr, 1, __ATOMIC_SEQ_CST);
+}
+
+LONG InterlockedExchange(LONG volatile *addr, LONG val)
+{
+    return __atomic_exchange_n(addr, val, __ATOMIC_SEQ_CST);
+}
+
+LONG InterlockedExchangeAdd(LONG volatile *addr, LONG val)
+{
+    return __atomic_fetch_add(addr, val, __ATOMIC_SEQ_CST);
+}
+
+LONG InterlockedCompareExchange(LONG volatile *addr, LONG val, LONG cmp)
+{
+    __atomic_compare_exchange_n(addr, &cmp, val, FALSE, __ATOMIC_SEQ_CST,
+        __ATOMIC_SEQ_CST);
+    return cmp;
+}
+
+PVOID InterlockedExchangePointer(PVOID volatile *addr, PVOID val)
+{
+    return __atomic_exchange_n(addr, val, __ATOMIC_SEQ_CST);
+}
+
+PVOID InterlockedCompareExchangePointer(PVOID volatile *addr, PVOID val,
+    PVOID cmp)
+{
+    __atomic_compare_exchange_n(addr, &cmp, val, FALSE, __ATOMIC_SEQ_CST,
+        __ATOMIC_SEQ_CST);
+    return cmp;
+}
+
+void YieldProcessor(void)
+{
+    // Yield rather than pause: a spinning thread may be waiting for one
+    // that is not running.
+    sched_yield();
+}
+
+BOOL SwitchToThread(void)
+{
+    return (sched_yield() == 0);
+}
+
+void MemoryBarrier(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Memory.
+ */
+LPVOID VirtualAlloc(LPVOID addr, SIZE_T size, DWORD type, DWORD protect)
+{
+    LPVOID mem;
+
+    if (addr != NULL || (type & MEM_COMMIT) == 0)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return NULL;
+    }
+    mem = calloc(1, size);
+    if (mem == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    }
+    return mem;
+}
+
+BOOL VirtualFree(LPVOID addr, SIZE_T size, DWORD type)
+{
+    free(addr);
+    return TRUE;
+}
+
+/*
+ * Files.
+ */
+HANDLE CreateFileA(LPCSTR name, DWORD access, DWORD share, LPVOID security,
+    DWORD disposition, DWORD flags, HANDLE template_file)
+{
+    PSHIM_HANDLE handle;
+    int mode;
+
+    if ((access & GENERIC_READ) != 0 && (access & GENERIC_WRITE) != 0)
+    {
+        mode = O_RDWR;
+    }
+    else
+    {
+        mode = ((access & GENERIC_WRITE) != 0? O_WRONLY: O_RDONLY);
+    }
+    switch (disposition)
+    {
+        case CREATE_NEW:
+            mode |= O_CREAT | O_EXCL;
+            break;
+        case CREATE_ALWAYS:
+            mode |= O_CREAT | O_TRUNC;
+            break;
+        case OPEN_EXISTING:
+            break;
+        default:
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return INVALID_HANDLE_VALUE;
+    }
+    handle = (PSHIM_HANDLE)ShimHandleNew(SHIM_HANDLE_FILE);
+    if (handle == NULL)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+    handle->fd = open(name, mode, 0644);
+    if (handle->fd < 0)
+    {
+        SetLastError(ShimError(errno));
+        free(handle);
+        return INVALID_HANDLE_VALUE;
+    }
+    return (HANDLE)handle;
+}
+
+HANDLE CreateFile(LPCWSTR name, DWORD access, DWORD share, LPVOID security,
+    DWORD disposition, DWORD flags, HANDLE template_file)
+{
+    HANDLE handle;
+
+    // Only used to open the WinDivert device, which exists if a test handles
+    // its requests.
+    if (shim_device_io_control == NULL)
+    {
+        SetLastError(ERROR_FILE_NOT_FOUND);
+        return INVALID_HANDLE_VALUE;
+    }
+    handle = ShimHandleNew(SHIM_HANDLE_DEVICE);
+    if (handle == NULL)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+    InterlockedIncrement(&shim_device_handles);
+    return handle;
+}
+
+BOOL ReadFile(HANDLE file, LPVOID buf, DWORD len, DWORD *read_len,
+    LPOVERLAPPED overlapped)
+{
+    PSHIM_HANDLE handle = ShimHandleGet(file, SHIM_HANDLE_FILE);
+    ssize_t result;
+    DWORD total = 0;
+
+    if (handle == NULL)
+    {
+        return FALSE;
+    }
+    while (total < len)
+    {
+        result = read(handle->fd, (UINT8 *)buf + total, len - total);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result < 0)
+        {
+            SetLastError(ERROR_READ_FAULT);
+            return FALSE;
+        }
+        if (result == 0)
+        {
+            break;
+        }
+        total += (DWORD)result;
+    }
+    if (read_len != NULL)
+    {
+        *read_len = total;
+    }
+    return TRUE;
+}
+
+BOOL WriteFile(HANDLE file, const void *buf, DWORD len, DWORD *write_len,
+    LPOVERLAPPED overlapped)
+{
+    PSHIM_HANDLE handle = ShimHandleGet(file, SHIM_HANDLE_FILE);
+    ssize_t result;
+    DWORD total = 0;
+
+    if (handle == NULL)
+    {
+        return FALSE;
+    }
+    while (total < len)
+    {
+        result = write(handle->fd, (const UINT8 *)buf + total, len - total);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            SetLastError(ERROR_WRITE_FAULT);
+            return FALSE;
+        }
+        total += (DWORD)result;
+    }
+    if (write_len != NULL)
+    {
+        *write_len = total;
+    }
+    return TRUE;
+}
+
+BOOL GetFileSizeEx(HANDLE file, LARGE_INTEGER *size)
+{
+    PSHIM_HANDLE handle = ShimHandleGet(file, SHIM_HANDLE_FILE);
+    struct stat st;
+
+    if (handle == NULL)
+    {
+        return FALSE;
+    }
+    if (fstat(handle->fd, &st) != 0)
+    {
+        SetLastError(ShimError(errno));
+        return FALSE;
+    }
+    size->QuadPart = (LONGLONG)st.st_size;
+    return TRUE;
+}
+
+/*
+ * File mappings.  Only read-only mappings of whole files are supported; a
+ * mapping keeps its own file descriptor, so the file handle may be closed.
+ */
+HANDLE CreateFileMappingA(HANDLE file, LPVOID security, DWORD protect,
+    DWORD size_high, DWORD size_low, LPCSTR name)
+{
+    PSHIM_HANDLE handle = ShimHandleGet(file, SHIM_HANDLE_FILE), mapping;
+    struct stat st;
+
+    if (handle == NULL)
+    {
+        return NULL;
+    }
+    if (protect != PAGE_READONLY || size_high != 0 || size_low != 0 ||
+        name != NULL)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return NULL;
+    }
+    if (fstat(handle->fd, &st) != 0)
+    {
+        SetLastError(ShimError(errno));
+        return NULL;
+    }
+    if (st.st_size == 0)
+    {
+        SetLastError(ERROR_FILE_INVALID);
+        return NULL;
+    }
+    mapping = (PSHIM_HANDLE)ShimHandleNew(SHIM_HANDLE_MAPPING);
+    if (mapping == NULL)
+    {
+        return NULL;
+    }
+    mapping->fd = dup(handle->fd);
+    if (mapping->fd < 0)
+    {
+        SetLastError(ShimError(errno));
+        free(mapping);
+        return NULL;
+    }
+    mapping->size = (UINT64)st.st_size;
+    return (HANDLE)mapping;
+}
+
+LPVOID MapViewOfFile(HANDLE mapping, DWORD access, DWORD offset_high,
+    DWORD offset_low, SIZE_T len)
+{
+    PSHIM_HANDLE handle = ShimHandleGet(mapping, SHIM_HANDLE_MAPPING);
+    PSHIM_VIEW view;
+    LPVOID addr;
+
+    if (handle == NULL)
+    {
+        return NULL;
+    }
+    if (access != FILE_MAP_READ || offset_high != 0 || offset_low != 0 ||
+        len > handle->size)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return NULL;
+    }
+    len = (len == 0? (SIZE_T)handle->size: len);
+    view = (PSHIM_VIEW)malloc(sizeof(SHIM_VIEW));
+    if (view == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    addr = mmap(NULL, len, PROT_READ, MAP_SHARED, handle->fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        SetLastError(ShimError(errno));
+        free(view);
+        return NULL;
+    }
+    view->addr = addr;
+    view->len  = len;
+    pthread_mutex_lock(&shim_views_lock);
+    view->next = shim_views;
+    shim_views = view;
+    pthread_mutex_unlock(&shim_views_lock);
+    return addr;
+}
+
+BOOL UnmapViewOfFile(LPCVOID addr)
+{
+    PSHIM_VIEW *prev, view;
+
+    pthread_mutex_lock(&shim_views_lock);
+    for (prev = &shim_views; (view = *prev) != NULL; prev = &view->next)
+    {
+        if (view->addr == addr)
+        {
+            *prev = view->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shim_views_lock);
+    if (view == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    munmap(view->addr, view->len);
+    free(view);
+    return TRUE;
+}
+
+BOOL CloseHandle(HANDLE handle)
+{
+    PSHIM_HANDLE shim = (PSHIM_HANDLE)handle;
+    PSHIM_COMPLETION entry;
+
+    if (shim == NULL || handle == INVALID_HANDLE_VALUE ||
+        shim->magic != SHIM_HANDLE_MAGIC)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+    if (shim->kind == SHIM_HANDLE_FILE || shim->kind == SHIM_HANDLE_MAPPING)
+    {
+        close(shim->fd);
+    }
+    else if (shim->kind == SHIM_HANDLE_THREAD && !shim->joined)
+    {
+        pthread_detach(shim->thread);
+    }
+    else if (shim->kind == SHIM_HANDLE_DEVICE)
+    {
+        InterlockedDecrement(&shim_device_handles);
+    }
+    else if (shim->kind == SHIM_HANDLE_PORT)
+    {
+        while ((entry = shim->head) != NULL)
+        {
+            shim->head = entry->next;
+            free(entry);
+        }
+        pthread_mutex_destroy(&shim->lock);
+        pthread_cond_destroy(&shim->cond);
+    }
+    shim->magic = 0;
+    free(shim);
+    return TRUE;
+}
+
+/*
+ * Device I/O.  Requests go to the test hook (if any), and always complete
+ * synchronously.
+ */
+BOOL DeviceIoControl(HANDLE handle, DWORD code, LPVOID in, DWORD in_len,
+    LPVOID out, DWORD out_len, DWORD *ret_len, LPOVERLAPPED overlapped)
+{
+    if (shim_device_io_control == NULL)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+    return shim_device_io_control(handle, code, in, in_len, out, out_len,
+        ret_len, overlapped);
+}
+
+BOOL GetOverlappedResult(HANDLE handle, LPOVERLAPPED overlapped, DWORD *len,
+    BOOL wait)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+}
+
+BOOL CancelIoEx(HANDLE handle, LPOVERLAPPED overlapped)
+{
+    SetLastError(ERROR_NOT_FOUND);
+    return FALSE;
+}
+
+HANDLE CreateEvent(LPVOID security, BOOL manual, BOOL state, LPCWSTR name)
+{
+    return ShimHandleNew(SHIM_HANDLE_EVENT);
+}
+
+/*
+ * Completion ports.  A port is a queue of completions; the concurrency
+ * limit is ignored.  Nothing completes requests on a bound handle except
+ * shim_complete_io().
+ */
+static BOOL ShimPortQueue(PSHIM_HANDLE port, DWORD len, ULONG_PTR key,
+    LPOVERLAPPED overlapped, DWORD error)
+{
+    PSHIM_COMPLETION entry;
+
+    entry = (PSHIM_COMPLETION)malloc(sizeof(SHIM_COMPLETION));
+    if (entry == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    entry->next       = NULL;
+    entry->len        = len;
+    entry->key        = key;
+    entry->overlapped = overlapped;
+    entry->error      = error;
+    pthread_mutex_lock(&port->lock);
+    if (port->tail == NULL)
+    {
+        port->head = entry;
+    }
+    else
+    {
+        port->tail->next = entry;
+    }
+    port->tail = entry;
+    pthread_cond_signal(&port->cond);
+    pthread_mutex_unlock(&port->lock);
+    return TRUE;
+}
+
+HANDLE CreateIoCompletionPort(HANDLE handle, HANDLE port, ULONG_PTR key,
+    DWORD threads)
+{
+    PSHIM_HANDLE shim = NULL, shim_port;
+
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        shim = (PSHIM_HANDLE)handle;
+        if (shim == NULL || shim->magic != SHIM_HANDLE_MAGIC)
+        {
+            SetLastError(ERROR_INVALID_HANDLE);
+            return NULL;
+        }
+        if (shim->port != NULL)
+        {
+            // A handle can only be bound to one port.
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return NULL;
+        }
+    }
+    if (port == NULL)
+    {
+        shim_port = (PSHIM_HANDLE)ShimHandleNew(SHIM_HANDLE_PORT);
+        if (shim_port == NULL)
+        {
+            return NULL;
+        }
+        pthread_mutex_init(&shim_port->lock, NULL);
+        pthread_cond_init(&shim_port->cond, NULL);
+    }
+    else
+    {
+        shim_port = ShimHandleGet(port, SHIM_HANDLE_PORT);
+        if (shim_port == NULL)
+        {
+            return NULL;
+        }
+    }
+    if (shim != NULL)
+    {
+        shim->port = shim_port;
+        shim->key  = key;
+    }
+    return (HANDLE)shim_port;
+}
+
+BOOL GetQueuedCompletionStatus(HANDLE port, DWORD *len, ULONG_PTR *key,
+    LPOVERLAPPED *overlapped, DWORD timeout)
+{
+    PSHIM_HANDLE shim = ShimHandleGet(port, SHIM_HANDLE_PORT);
+    PSHIM_COMPLETION entry;
+    struct timespec deadline;
+    DWORD error;
+
+    *overlapped = NULL;
+    if (shim == NULL)
+    {
+        return FALSE;
+    }
+    if (timeout != INFINITE)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    pthread_mutex_lock(&shim->lock);
+    while (shim->head == NULL)
+    {
+        if (timeout == INFINITE)
+        {
+            pthread_cond_wait(&shim->cond, &shim->lock);
+        }
+        else if (pthread_cond_timedwait(&shim->cond, &shim->lock,
+                &deadline) != 0)
+        {
+            pthread_mutex_unlock(&shim->lock);
+            SetLastError(WAIT_TIMEOUT);
+            return FALSE;
+        }
+    }
+    entry = shim->head;
+    shim->head = entry->next;
+    if (shim->head == NULL)
+    {
+        shim->tail = NULL;
+    }
+    pthread_mutex_unlock(&shim->lock);
+
+    *len        = entry->len;
+    *key        = entry->key;
+    *overlapped = entry->overlapped;
+    error       = entry->error;
+    free(entry);
+    if (error != ERROR_SUCCESS)
+    {
+        SetLastError(error);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL PostQueuedCompletionStatus(HANDLE port, DWORD len, ULONG_PTR key,
+    LPOVERLAPPED overlapped)
+{
+    PSHIM_HANDLE shim = ShimHandleGet(port, SHIM_HANDLE_PORT);
+
+    if (shim == NULL)
+    {
+        return FALSE;
+    }
+    return ShimPortQueue(shim, len, key, overlapped, ERROR_SUCCESS);
+}
+
+BOOL shim_complete_io(HANDLE handle, LPOVERLAPPED overlapped, DWORD len,
+    DWORD error)
+{
+    PSHIM_HANDLE shim = (PSHIM_HANDLE)handle;
+
+    if (shim == NULL || handle == INVALID_HANDLE_VALUE ||
+        shim->magic != SHIM_HANDLE_MAGIC || shim->port == NULL)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+    overlapped->Internal     = (ULONG_PTR)error;
+    overlapped->InternalHigh = (ULONG_PTR)len;
+    return ShimPortQueue(shim->port, len, shim->key, overlapped, error);
+}
+
+/*
+ * Threads.
+ */
+static void *ShimThreadStart(void *arg)
+{
+    PSHIM_HANDLE handle = (PSHIM_HANDLE)arg;
+
+    return (void *)(UINT_PTR)handle->func(handle->arg);
+}
+
+HANDLE CreateThread(LPVOID security, SIZE_T stack,
+    LPTHREAD_START_ROUTINE func, LPVOID arg, DWORD flags, DWORD *id)
+{
+    PSHIM_HANDLE handle;
+
+    handle = (PSHIM_HANDLE)ShimHandleNew(SHIM_HANDLE_THREAD);
+    if (handle == NULL)
+    {
+        return NULL;
+    }
+    handle->func = func;
+    handle->arg  = arg;
+    if (pthread_create(&handle->thread, NULL, ShimThreadStart, handle) != 0)
+    {
+        free(handle);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    if (id != NULL)
+    {
+        *id = 0;
+    }
+    return (HANDLE)handle;
+}
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD timeout)
+{
+    return WaitForMultipleObjects(1, &handle, TRUE, timeout);
+}
+
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE *handles, BOOL all,
+    DWORD timeout)
+{
+    PSHIM_HANDLE handle;
+    DWORD i;
+
+    // Only waiting (without a timeout) for all of a set of threads to exit
+    // is supported.
+    if (!all || timeout != INFINITE)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return (DWORD)-1;
+    }
+    for (i = 0; i < count; i++)
+    {
+        handle = ShimHandleGet(handles[i], SHIM_HANDLE_THREAD);
+        if (handle == NULL)
+        {
+            return (DWORD)-1;
+        }
+        if (!handle->joined)
+        {
+            pthread_join(handle->thread, NULL);
+            handle->joined = TRUE;
+        }
+    }
+    return WAIT_OBJECT_0;
+}
+
+void InitializeCriticalSection(LPCRITICAL_SECTION section)
+{
+    pthread_mutex_init(&section->mutex, NULL);
+}
+
+void DeleteCriticalSection(LPCRITICAL_SECTION section)
+{
+    pthread_mutex_destroy(&section->mutex);
+}
+
+void EnterCriticalSection(LPCRITICAL_SECTION section)
+{
+    pthread_mutex_lock(&section->mutex);
+}
+
+void LeaveCriticalSection(LPCRITICAL_SECTION section)
+{
+    pthread_mutex_unlock(&section->mutex);
+}
+
+/*
+ * Thread local storage.
+ */
+DWORD TlsAlloc(void)
+{
+    LONG idx = InterlockedIncrement(&shim_tls_next) - 1;
+
+    if (idx >= SHIM_TLS_MAX)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return TLS_OUT_OF_INDEXES;
+    }
+    return (DWORD)idx;
+}
+
+BOOL TlsFree(DWORD idx)
+{
+    return (idx < SHIM_TLS_MAX);
+}
+
+LPVOID TlsGetValue(DWORD idx)
+{
+    if (idx >= SHIM_TLS_MAX)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    SetLastError(ERROR_SUCCESS);
+    return shim_tls[idx];
+}
+
+BOOL TlsSetValue(DWORD idx, LPVOID val)
+{
+    if (idx >= SHIM_TLS_MAX)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    shim_tls[idx] = val;
+    return TRUE;
+}
+
+/*
+ * Console: the output is not coloured, and is treated as redirected (not a
+ * console) by GetConsoleMode().
+ */
+HANDLE GetStdHandle(DWORD which)
+{
+    if (which != STD_OUTPUT_HANDLE)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+    return (HANDLE)stdout;
+}
+
+BOOL SetConsoleTextAttribute(HANDLE console, WORD attributes)
+{
+    return (console == (HANDLE)stdout);
+}
+
+BOOL GetConsoleMode(HANDLE console, DWORD *mode)
+{
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+}
+
+/*
+ * Not supported: modules, directories and services.
+ */
+HMODULE LoadLibrary(LPCWSTR name)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return NULL;
+}
+
+void *GetProcAddress(HMODULE module, LPCSTR name)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return NULL;
+}
+
+BOOL FreeLibrary(HMODULE module)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+}
+
+DWORD GetCurrentDirectory(DWORD len, LPWSTR buf)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return 0;
+}
+
+HANDLE FindFirstFile(LPCWSTR name, WIN32_FIND_DATA *data)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return INVALID_HANDLE_VALUE;
+}
+
+BOOL FindClose(HANDLE handle)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+}
+
+SC_HANDLE OpenSCManager(LPCWSTR machine, LPCWSTR db, DWORD access)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return NULL;
+}
+
+SC_HANDLE OpenService(SC_HANDLE manager, LPCWSTR name, DWORD access)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return NULL;
+}
+
+SC_HANDLE CreateService(SC_HANDLE manager, LPCWSTR name,
+    LPCWSTR display_name, DWORD access, DWORD type, DWORD start,
+    DWORD error, LPCWSTR path, LPCWSTR group, DWORD *tag, LPCWSTR deps,
+    LPCWSTR user, LPCWSTR password)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return NULL;
+}
+
+BOOL StartService(SC_HANDLE service, DWORD argc, LPCWSTR *argv)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+}
+
+BOOL DeleteService(SC_HANDLE service)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+}
+
+BOOL CloseServiceHandle(SC_HANDLE handle)
+{
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+}
@@ -0,0 +1,315 @@
+/*
+ * windows.h
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * NOTE: This is NOT the Windows SDK header.  It declares just enough of the
+ *       Win32 API for the portable parts of WinDivert (the filter compiler
+ *       and interpreter, and the helper functions) to build on a POSIX host
+ *       for testing.  See win32.c for the implementation.
+ */
+
+#ifndef __SHIM_WINDOWS_H
+#define __SHIM_WINDOWS_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <wchar.h>
+
+/*
+ * Types.
+ */
+typedef int BOOL;
+typedef unsigned char BOOLEAN;
+typedef void VOID;
+typedef void *PVOID;
+typedef void *LPVOID;
+typedef const void *LPCVOID;
+typedef void *HANDLE;
+typedef void *HMODULE;
+typedef void *SC_HANDLE;
+typedef char CHAR;
+typedef unsigned char UCHAR;
+typedef wchar_t WCHAR;
+typedef const char *LPCSTR;
+typedef WCHAR *LPWSTR;
+typedef const WCHAR *LPCWSTR;
+typedef int INT;
+typedef unsigned int UINT;
+typedef unsigned short WORD;
+typedef unsigned short USHORT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint32_t DWORD;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef int8_t INT8;
+typedef uint8_t UINT8;
+typedef int16_t INT16;
+typedef uint16_t UINT16;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+typedef uintptr_t UINT_PTR;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T;
+
+typedef struct
+{
+    ULONG_PTR Internal;
+    ULONG_PTR InternalHigh;
+    DWORD Offset;
+    DWORD OffsetHigh;
+    HANDLE hEvent;
+} OVERLAPPED, *LPOVERLAPPED;
+
+typedef union
+{
+    struct
+    {
+        DWORD LowPart;
+        LONG HighPart;
+    } u;
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct
+{
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME;
+
+typedef struct
+{
+    DWORD dwFileAttributes;
+    WCHAR cFileName[260];
+} WIN32_FIND_DATA;
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+} CRITICAL_SECTION, *LPCRITICAL_SECTION;
+
+typedef DWORD (*LPTHREAD_START_ROUTINE)(LPVOID);
+
+/*
+ * Constants.
+ */
+#define TRUE                            1
+#define FALSE                           0
+#define CONST                           const
+#define INFINITE                        0xFFFFFFFF
+#define INVALID_HANDLE_VALUE            ((HANDLE)(intptr_t)-1)
+#define TLS_OUT_OF_INDEXES              0xFFFFFFFF
+#define DLL_PROCESS_DETACH              0
+#define DLL_PROCESS_ATTACH              1
+#define DLL_THREAD_ATTACH               2
+#define DLL_THREAD_DETACH               3
+#define WAIT_OBJECT_0                   0
+#define WAIT_TIMEOUT                    258
+
+#define ERROR_SUCCESS                   0
+#define ERROR_FILE_NOT_FOUND            2
+#define ERROR_PATH_NOT_FOUND            3
+#define ERROR_ACCESS_DENIED             5
+#define ERROR_INVALID_HANDLE            6
+#define ERROR_NOT_ENOUGH_MEMORY         8
+#define ERROR_INVALID_DATA              13
+#define ERROR_OUTOFMEMORY               14
+#define ERROR_WRITE_FAULT               29
+#define ERROR_READ_FAULT                30
+#define ERROR_GEN_FAILURE               31
+#define ERROR_HANDLE_EOF                38
+#define ERROR_NOT_SUPPORTED             50
+#define ERROR_INVALID_PARAMETER         87
+#define ERROR_OPEN_FAILED               110
+#define ERROR_INSUFFICIENT_BUFFER       122
+#define ERROR_ALREADY_EXISTS            183
+#define ERROR_NO_DATA                   232
+#define ERROR_OPERATION_ABORTED         995
+#define ERROR_IO_PENDING                997
+#define ERROR_SERVICE_ALREADY_RUNNING   1056
+#define ERROR_SERVICE_EXISTS            1073
+#define ERROR_FILE_INVALID              1006
+#define ERROR_NOT_FOUND                 1168
+
+#define GENERIC_READ                    0x80000000
+#define GENERIC_WRITE                   0x40000000
+#define FILE_SHARE_READ                 0x00000001
+#define FILE_SHARE_WRITE                0x00000002
+#define FILE_SHARE_DELETE               0x00000004
+#define CREATE_NEW                      1
+#define CREATE_ALWAYS                   2
+#define OPEN_EXISTING                   3
+#define FILE_ATTRIBUTE_NORMAL           0x00000080
+#define FILE_FLAG_SEQUENTIAL_SCAN       0x08000000
+#define FILE_FLAG_OVERLAPPED            0x40000000
+#define MEM_COMMIT                      0x00001000
+#define MEM_RESERVE                     0x00002000
+#define MEM_RELEASE                     0x00008000
+#define PAGE_READONLY                   0x02
+#define PAGE_READWRITE                  0x04
+#define FILE_MAP_READ                   0x0004
+#define SC_MANAGER_ALL_ACCESS           0x000F003F
+#define SERVICE_ALL_ACCESS              0x000F01FF
+#define SERVICE_KERNEL_DRIVER           0x00000001
+#define SERVICE_DEMAND_START            0x00000003
+#define SERVICE_ERROR_NORMAL            0x00000001
+#define STD_OUTPUT_HANDLE               ((DWORD)-11)
+#define FOREGROUND_BLUE                 0x0001
+#define FOREGROUND_GREEN                0x0002
+#define FOREGROUND_RED                  0x0004
+
+/*
+ * Annotations and calling conventions.
+ */
+#define WINAPI
+#define APIENTRY
+#define __cdecl
+#define __declspec(x)
+#define __in
+#define __in_opt
+#define __out
+#define __out_opt
+#define __inout
+#define __inout_opt
+#define FORCEINLINE                     static inline
+
+/*
+ * Functions.
+ */
+#define RtlZeroMemory(dst, len)         memset((dst), 0, (len))
+#define wcscpy_s(dst, len, src)         wcscpy((dst), (src))
+#define _snprintf                       snprintf
+
+extern DWORD GetLastError(void);
+extern void SetLastError(DWORD err);
+
+extern DWORD GetTickCount(void);
+extern ULONGLONG GetTickCount64(void);
+extern void GetSystemTimeAsFileTime(FILETIME *time);
+extern BOOL QueryPerformanceCounter(LARGE_INTEGER *count);
+extern BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq);
+extern void Sleep(DWORD ms);
+
+extern LONG InterlockedIncrement(LONG volatile *addr);
+extern LONG InterlockedDecrement(LONG volatile *addr);
+extern LONG InterlockedExchange(LONG volatile *addr, LONG val);
+extern LONG InterlockedExchangeAdd(LONG volatile *addr, LONG val);
+extern LONG InterlockedCompareExchange(LONG volatile *addr, LONG val,
+    LONG cmp);
+extern PVOID InterlockedExchangePointer(PVOID volatile *addr, PVOID val);
+extern PVOID InterlockedCompareExchangePointer(PVOID volatile *addr,
+    PVOID val, PVOID cmp);
+extern void YieldProcessor(void);
+extern BOOL SwitchToThread(void);
+extern void MemoryBarrier(void);
+
+extern LPVOID VirtualAlloc(LPVOID addr, SIZE_T size, DWORD type,
+    DWORD protect);
+extern BOOL VirtualFree(LPVOID addr, SIZE_T size, DWORD type);
+
+extern HANDLE CreateFileA(LPCSTR name, DWORD access, DWORD share,
+    LPVOID security, DWORD disposition, DWORD flags, HANDLE template_file);
+extern HANDLE CreateFile(LPCWSTR name, DWORD access, DWORD share,
+    LPVOID security, DWORD disposition, DWORD flags, HANDLE template_file);
+extern BOOL ReadFile(HANDLE file, LPVOID buf, DWORD len, DWORD *read_len,
+    LPOVERLAPPED overlapped);
+extern BOOL WriteFile(HANDLE file, const void *buf, DWORD len,
+    DWORD *write_len, LPOVERLAPPED overlapped);
+extern BOOL GetFileSizeEx(HANDLE file, LARGE_INTEGER *size);
+extern HANDLE CreateFileMappingA(HANDLE file, LPVOID security,
+    DWORD protect, DWORD size_high, DWORD size_low, LPCSTR name);
+extern LPVOID MapViewOfFile(HANDLE mapping, DWORD access,
+    DWORD offset_high, DWORD offset_low, SIZE_T len);
+extern BOOL UnmapViewOfFile(LPCVOID addr);
+extern BOOL CloseHandle(HANDLE handle);
+extern BOOL DeviceIoControl(HANDLE handle, DWORD code, LPVOID in,
+    DWORD in_len, LPVOID out, DWORD out_len, DWORD *ret_len,
+    LPOVERLAPPED overlapped);
+extern BOOL GetOverlappedResult(HANDLE handle, LPOVERLAPPED overlapped,
+    DWORD *len, BOOL wait);
+extern BOOL CancelIoEx(HANDLE handle, LPOVERLAPPED overlapped);
+extern HANDLE CreateEvent(LPVOID security, BOOL manual, BOOL state,
+    LPCWSTR name);
+
+extern HANDLE CreateIoCompletionPort(HANDLE handle, HANDLE port,
+    ULONG_PTR key, DWORD threads);
+extern BOOL GetQueuedCompletionStatus(HANDLE port, DWORD *len,
+    ULONG_PTR *key, LPOVERLAPPED *overlapped, DWORD timeout);
+extern BOOL PostQueuedCompletionStatus(HANDLE port, DWORD len,
+    ULONG_PTR key, LPOVERLAPPED overlapped);
+extern HANDLE CreateThread(LPVOID security, SIZE_T stack,
+    LPTHREAD_START_ROUTINE func, LPVOID arg, DWORD flags, DWORD *id);
+extern DWORD WaitForSingleObject(HANDLE handle, DWORD timeout);
+extern DWORD WaitForMultipleObjects(DWORD count, const HANDLE *handles,
+    BOOL all, DWORD timeout);
+extern void InitializeCriticalSection(LPCRITICAL_SECTION section);
+extern void DeleteCriticalSection(LPCRITICAL_SECTION section);
+extern void EnterCriticalSection(LPCRITICAL_SECTION section);
+extern void LeaveCriticalSection(LPCRITICAL_SECTION section);
+
+extern DWORD TlsAlloc(void);
+extern BOOL TlsFree(DWORD idx);
+extern LPVOID TlsGetValue(DWORD idx);
+extern BOOL TlsSetValue(DWORD idx, LPVOID val);
+
+extern HMODULE LoadLibrary(LPCWSTR name);
+extern void *GetProcAddress(HMODULE module, LPCSTR name);
+extern BOOL FreeLibrary(HMODULE module);
+extern DWORD GetCurrentDirectory(DWORD len, LPWSTR buf);
+extern HANDLE FindFirstFile(LPCWSTR name, WIN32_FIND_DATA *data);
+extern BOOL FindClose(HANDLE handle);
+extern HANDLE GetStdHandle(DWORD which);
+extern BOOL SetConsoleTextAttribute(HANDLE console, WORD attributes);
+extern BOOL GetConsoleMode(HANDLE console, DWORD *mode);
+
+extern SC_HANDLE OpenSCManager(LPCWSTR machine, LPCWSTR db, DWORD access);
+extern SC_HANDLE OpenService(SC_HANDLE manager, LPCWSTR name, DWORD access);
+extern SC_HANDLE CreateService(SC_HANDLE manager, LPCWSTR name,
+    LPCWSTR display_name, DWORD access, DWORD type, DWORD start,
+    DWORD error, LPCWSTR path, LPCWSTR group, DWORD *tag, LPCWSTR deps,
+    LPCWSTR user, LPCWSTR password);
+extern BOOL StartService(SC_HANDLE service, DWORD argc, LPCWSTR *argv);
+extern BOOL DeleteService(SC_HANDLE service);
+extern BOOL CloseServiceHandle(SC_HANDLE handle);
+
+/*
+ * Test hooks (not part of Win32).
+ *
+ * shim_device_io_control, if set, handles DeviceIoControl() requests, so
+ * that tests can see the requests the DLL sends to the driver (and the
+ * WinDivert device can be opened).
+ * shim_tick_offset is added to the GetTickCount*() clock, so that tests can
+ * skip ahead in time.
+ * shim_device_handles is the number of open WinDivert device handles.
+ * shim_complete_io() completes an overlapped request on a handle bound to a
+ * completion port (as the device would), with ERROR_SUCCESS or an error.
+ */
+extern BOOL (*shim_device_io_control)(HANDLE handle, DWORD code, LPVOID in,
+    DWORD in_len, LPVOID out, DWORD out_len, DWORD *ret_len,
+    LPOVERLAPPED overlapped);
+extern ULONGLONG shim_tick_offset;
+extern volatile LONG shim_device_handles;
+extern BOOL shim_complete_io(HANDLE handle, LPOVERLAPPED overlapped,
+    DWORD len, DWORD error);
+
+#endif      /* __SHIM_WINDOWS_H */
@@ -0,0 +1,39 @@
+/*
+ * winioctl.h
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * NOTE: Host build stand-in for the Windows SDK header (see windows.h).
+ */
+
+#ifndef __SHIM_WINIOCTL_H
+#define __SHIM_WINIOCTL_H
+
+#include <windows.h>
+
+#define CTL_CODE(type, func, method, access)                                \
+    (((type) << 16) | ((access) << 14) | ((func) << 2) | (method))
+#define FILE_DEVICE_NETWORK             0x00000012
+#define METHOD_BUFFERED                 0
+#define METHOD_IN_DIRECT                1
+#define METHOD_OUT_DIRECT               2
+#define METHOD_NEITHER                  3
+#define FILE_ANY_ACCESS                 0
+#define FILE_READ_DATA                  1
+#define FILE_WRITE_DATA                 2
+
+#endif      /* __SHIM_WINIOCTL_H */
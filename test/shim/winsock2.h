@@ -0,0 +1,57 @@
+/*
+ * winsock2.h
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * NOTE: Host build stand-in for the Windows SDK header (see windows.h).
+ *       The byte order functions assume a little-endian host, as Windows
+ *       does.  They are functions rather than macros since the DLL defines
+ *       its own ntoh/hton macros.
+ */
+
+#ifndef __SHIM_WINSOCK2_H
+#define __SHIM_WINSOCK2_H
+
+#include <windows.h>
+
+#define IPPROTO_ICMP    1
+#define IPPROTO_TCP     6
+#define IPPROTO_UDP     17
+#define IPPROTO_ICMPV6  58
+
+static inline UINT16 htons(UINT16 x)
+{
+    return (UINT16)((x >> 8) | (x << 8));
+}
+
+static inline UINT16 ntohs(UINT16 x)
+{
+    return (UINT16)((x >> 8) | (x << 8));
+}
+
+static inline UINT32 htonl(UINT32 x)
+{
+    return ((x >> 24) | ((x >> 8) & 0x0000FF00) | ((x << 8) & 0x00FF0000) |
+        (x << 24));
+}
+
+static inline UINT32 ntohl(UINT32 x)
+{
+    return htonl(x);
+}
+
+#endif      /* __SHIM_WINSOCK2_H */
@@ -0,0 +1,143 @@
+/*
+ * test.h
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Common definitions for the host tests.  Each test is a program that
+ * includes dll/windivert.c directly (so that internal functions can be
+ * tested), and exits with a non-zero status if any check failed.
+ */
+
+#ifndef __TEST_H
+#define __TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned test_checks = 0;
+static unsigned test_failures = 0;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        test_checks++;                                                      \
+        if (!(cond))                                                        \
+        {                                                                   \
+            test_failures++;                                                \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,          \
+                __LINE__, #cond);                                           \
+        }                                                                   \
+    } while (FALSE)
+
+/*
+ * Report the results; returns the exit status.
+ */
+static __inline int TestResult(const char *name)
+{
+    printf("%s: %u checks, %u failed\n", name, test_checks, test_failures);
+    return (test_failures == 0? EXIT_SUCCESS: EXIT_FAILURE);
+}
+
+/*
+ * Deterministic pseudo-random numbers (xorshift), so that failures can be
+ * reproduced.
+ */
+static UINT32 test_random_state = 0x12345678;
+
+static __inline UINT32 TestRandom(void)
+{
+    UINT32 x = test_random_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    test_random_state = x;
+    return x;
+}
+
+/*
+ * Build a packet from 10.0.0.1 to 10.0.0.2 (or fe80::1 to fe80::2), with
+ * valid lengths and checksums.  Ports are ignored for ICMP/ICMPv6.  Returns
+ * the packet length.
+ */
+static __inline UINT TestPacket(UINT8 *packet, BOOL ipv6, UINT8 protocol,
+    UINT16 src_port, UINT16 dst_port, const char *payload)
+{
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_UDPHDR udp_header;
+    UINT ip_len = (ipv6? sizeof(WINDIVERT_IPV6HDR): sizeof(WINDIVERT_IPHDR));
+    UINT hdr_len, payload_len = (UINT)strlen(payload);
+
+    switch (protocol)
+    {
+        case IPPROTO_TCP:
+            hdr_len = sizeof(WINDIVERT_TCPHDR);
+            break;
+        case IPPROTO_UDP:
+            hdr_len = sizeof(WINDIVERT_UDPHDR);
+            break;
+        default:
+            hdr_len = sizeof(WINDIVERT_ICMPHDR);
+            break;
+    }
+    memset(packet, 0, ip_len + hdr_len);
+    memcpy(packet + ip_len + hdr_len, payload, payload_len);
+    if (ipv6)
+    {
+        ipv6_header->Version     = 6;
+        ipv6_header->Length      = htons((UINT16)(hdr_len + payload_len));
+        ipv6_header->NextHdr     = protocol;
+        ipv6_header->HopLimit    = 64;
+        ipv6_header->SrcAddr[0]  = htonl(0xFE800000u);
+        ipv6_header->SrcAddr[3]  = htonl(1u);
+        ipv6_header->DstAddr[0]  = htonl(0xFE800000u);
+        ipv6_header->DstAddr[3]  = htonl(2u);
+    }
+    else
+    {
+        ip_header->Version       = 4;
+        ip_header->HdrLength     = 5;
+        ip_header->Length        = htons((UINT16)(ip_len + hdr_len +
+            payload_len));
+        ip_header->TTL           = 64;
+        ip_header->Protocol      = protocol;
+        ip_header->SrcAddr       = htonl(0x0A000001u);
+        ip_header->DstAddr       = htonl(0x0A000002u);
+    }
+    switch (protocol)
+    {
+        case IPPROTO_TCP:
+            tcp_header = (PWINDIVERT_TCPHDR)(packet + ip_len);
+            tcp_header->SrcPort   = htons(src_port);
+            tcp_header->DstPort   = htons(dst_port);
+            tcp_header->HdrLength = 5;
+            tcp_header->Window    = htons(8192);
+            break;
+        case IPPROTO_UDP:
+            udp_header = (PWINDIVERT_UDPHDR)(packet + ip_len);
+            udp_header->SrcPort   = htons(src_port);
+            udp_header->DstPort   = htons(dst_port);
+            udp_header->Length    = htons((UINT16)(hdr_len + payload_len));
+            break;
+    }
+    WinDivertHelperCalcChecksums(packet, ip_len + hdr_len + payload_len, 0);
+    return ip_len + hdr_len + payload_len;
+}
+
+#endif      /* __TEST_H */
@@ -0,0 +1,166 @@
+/*
+ * test_batch.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that batch filtering (windivert_filter_batch(), as used by the
+ * driver's classify callout) gives the same verdicts and flow hashes as
+ * filtering each packet on its own.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_ROUNDS      2000
+#define BATCH_MAX       64
+
+static const char *filters[] =
+{
+    "true",
+    "false",
+    "outbound",
+    "ip",
+    "tcp.DstPort == 80",
+    "udp or icmp",
+    "tcp.Syn and ip.TTL > 32",
+    "tcp.Payload[0:4] == \"GET \"",
+};
+#define NUM_FILTERS     (sizeof(filters) / sizeof(filters[0]))
+
+static UINT8 data[BATCH_MAX+1][256];
+static WINDIVERT_PACKET packets[BATCH_MAX+1];
+static windivert_packet_t batch[BATCH_MAX+1];
+
+/*
+ * A random (sometimes malformed) packet.
+ */
+static UINT RandomPacket(UINT8 *packet)
+{
+    static const char *payloads[] = {"", "GET /", "x"};
+    static const UINT8 protocols[] = {IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP};
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_TCPHDR tcp_header;
+    BOOL ipv6 = (TestRandom() % 3 == 0);
+    UINT8 protocol = protocols[TestRandom() % 3];
+    UINT packet_len;
+
+    if (ipv6 && protocol == IPPROTO_ICMP)
+    {
+        protocol = IPPROTO_ICMPV6;
+    }
+    packet_len = TestPacket(packet, ipv6, protocol,
+        (UINT16)(1 + TestRandom() % 1000), (TestRandom() % 2 == 0? 80: 53),
+        payloads[TestRandom() % 3]);
+    if (!ipv6)
+    {
+        ip_header->TTL = (UINT8)TestRandom();
+    }
+    if (protocol == IPPROTO_TCP)
+    {
+        tcp_header = (PWINDIVERT_TCPHDR)(packet +
+            (ipv6? sizeof(WINDIVERT_IPV6HDR): sizeof(WINDIVERT_IPHDR)));
+        tcp_header->Syn = TestRandom() % 2;
+    }
+    if (TestRandom() % 8 == 0)
+    {
+        packet_len = TestRandom() % packet_len;
+    }
+    return packet_len;
+}
+
+int main(void)
+{
+    PWINDIVERT_FILTER_OBJECT object;
+    filter_t compiled[NUM_FILTERS];
+    UINT32 hashes[BATCH_MAX], hash;
+    UINT64 verdicts, expected;
+    UINT object_len, round, count, i, j;
+    BOOL outbound, result;
+
+    for (i = 0; i < NUM_FILTERS; i++)
+    {
+        object = WinDivertCompileFilterObject(filters[i],
+            WINDIVERT_LAYER_NETWORK, &object_len);
+        CHECK(object != NULL);
+        if (object == NULL)
+        {
+            return TestResult("test_batch");
+        }
+        compiled[i] = WinDivertLoadFilter(object);
+        free(object);
+        CHECK(compiled[i] != NULL);
+        if (compiled[i] == NULL)
+        {
+            return TestResult("test_batch");
+        }
+    }
+    for (i = 0; i <= BATCH_MAX; i++)
+    {
+        packets[i].data = data[i];
+        batch[i] = &packets[i];
+    }
+
+    for (round = 0; round < NUM_ROUNDS; round++)
+    {
+        // Include empty and full batches:
+        count = (round < 2? round * BATCH_MAX: TestRandom() % (BATCH_MAX+1));
+        for (i = 0; i < count; i++)
+        {
+            packets[i].len = RandomPacket(data[i]);
+        }
+        outbound = TestRandom() % 2;
+        for (j = 0; j < NUM_FILTERS; j++)
+        {
+            expected = 0;
+            memset(hashes, 0xAA, sizeof(hashes));
+            verdicts = windivert_filter_batch(batch, count, 1, 0, outbound,
+                compiled[j], hashes);
+            for (i = 0; i < count; i++)
+            {
+                result = windivert_filter(batch[i], 1, 0, outbound,
+                    compiled[j], &hash);
+                if (result)
+                {
+                    expected |= ((UINT64)1 << i);
+                }
+                CHECK(hashes[i] == hash);
+            }
+            CHECK(verdicts == expected);
+
+            // Without flow hashes:
+            verdicts = windivert_filter_batch(batch, count, 1, 0, outbound,
+                compiled[j], NULL);
+            CHECK(verdicts == expected);
+        }
+    }
+
+    // At most 64 packets are filtered:
+    for (i = 0; i <= BATCH_MAX; i++)
+    {
+        packets[i].len = TestPacket(data[i], FALSE, IPPROTO_TCP, 1, 80, "");
+    }
+    CHECK(windivert_filter_batch(batch, BATCH_MAX+1, 1, 0, TRUE,
+        compiled[0], NULL) == ~(UINT64)0);
+    CHECK(windivert_filter_batch(batch, BATCH_MAX+1, 1, 0, TRUE,
+        compiled[1], NULL) == 0);
+
+    for (i = 0; i < NUM_FILTERS; i++)
+    {
+        free(compiled[i]);
+    }
+    return TestResult("test_batch");
+}
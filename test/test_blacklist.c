@@ -0,0 +1,533 @@
+/*
+ * test_blacklist.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the webfilter blacklist trie against a naive matcher: random
+ * blacklists (whose domains and uris are often suffixes or prefixes of each
+ * other) are written to a text file, read and compiled, and random URLs must
+ * match exactly when some entry's domain is the URL's domain or a parent
+ * domain, and its uri is a prefix of the URL's uri.  Compiled blacklists
+ * written to image files must map back to the same trie, and corrupt images
+ * must be rejected.  Also checks the HTTP request parsing of
+ * BlackListPayloadMatch().
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <winsock2.h>
+#include "windivert.h"
+#include "../examples/webfilter/blacklist.c"
+#include "test.h"
+
+#define NUM_ROUNDS      400
+#define NUM_IMAGES      100
+#define NUM_URLS        200
+#define ENTRIES_MAX     64
+#define LABELS_MAX      4
+#define URI_MAXLEN      6
+#define TEXT_FILE       "test_blacklist.txt"
+#define IMAGE_FILE      "test_blacklist.img"
+
+static const char *labels[] =
+    {"a", "b", "ab", "ba", "www", "x-1", "com", "org"};
+#define NUM_LABELS      (sizeof(labels) / sizeof(labels[0]))
+
+typedef struct
+{
+    char domain[64];
+    char uri[URI_MAXLEN+1];
+} ENTRY, *PENTRY;
+
+static ENTRY entries[ENTRIES_MAX];
+static UINT num_entries;
+
+/*
+ * A random domain of 1..LABELS_MAX labels.
+ */
+static void RandomDomain(char *domain)
+{
+    UINT i, num = 1 + TestRandom() % LABELS_MAX;
+
+    domain[0] = '\0';
+    for (i = 0; i < num; i++)
+    {
+        if (i != 0)
+        {
+            strcat(domain, ".");
+        }
+        strcat(domain, labels[TestRandom() % NUM_LABELS]);
+    }
+}
+
+/*
+ * A random uri (possibly empty) over a small alphabet.
+ */
+static void RandomUri(char *uri)
+{
+    static const char alphabet[] = "ab/";
+    UINT i, len = TestRandom() % (URI_MAXLEN + 1);
+
+    for (i = 0; i < len; i++)
+    {
+        uri[i] = alphabet[TestRandom() % (sizeof(alphabet) - 1)];
+    }
+    uri[len] = '\0';
+}
+
+/*
+ * Write a random blacklist to TEXT_FILE.  Domains are written in random
+ * case, with "/" or nothing for an empty uri.
+ */
+static void RandomBlackList(void)
+{
+    FILE *file = fopen(TEXT_FILE, "w");
+    char domain[64];
+    UINT i, j;
+
+    CHECK(file != NULL);
+    if (file == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+    num_entries = TestRandom() % (ENTRIES_MAX + 1);
+    for (i = 0; i < num_entries; i++)
+    {
+        RandomDomain(entries[i].domain);
+        RandomUri(entries[i].uri);
+        strcpy(domain, entries[i].domain);
+        for (j = 0; domain[j] != '\0'; j++)
+        {
+            if (TestRandom() % 4 == 0)
+            {
+                domain[j] = (char)toupper((UINT8)domain[j]);
+            }
+        }
+        fprintf(file, "%s%s%s%s", domain,
+            (entries[i].uri[0] != '\0' || TestRandom() % 2 == 0? "/": ""),
+            entries[i].uri, (TestRandom() % 2 == 0? "\n": " \t"));
+    }
+    fclose(file);
+}
+
+/*
+ * Naive matcher.
+ */
+static BOOL NaiveMatch(const char *url_domain, const char *url_uri)
+{
+    char domain[64];
+    UINT i, len, dlen;
+
+    for (i = 0; url_domain[i] != '\0'; i++)
+    {
+        domain[i] = (char)tolower((UINT8)url_domain[i]);
+    }
+    domain[i] = '\0';
+    len = i;
+    for (i = 0; i < num_entries; i++)
+    {
+        dlen = (UINT)strlen(entries[i].domain);
+        if (dlen > len || strcmp(domain + len - dlen, entries[i].domain) != 0)
+        {
+            continue;
+        }
+        if (dlen < len && domain[len - dlen - 1] != '.')
+        {
+            continue;
+        }
+        if (strncmp(url_uri, entries[i].uri, strlen(entries[i].uri)) == 0)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * A random URL: mostly an entry's own domain and uri, extended.  The
+ * buffers hold 64 and 2*URI_MAXLEN+1 chars.
+ */
+static void RandomUrl(char *domain, char *uri)
+{
+    UINT j;
+
+    if (num_entries != 0 && TestRandom() % 2 == 0)
+    {
+        j = TestRandom() % num_entries;
+        domain[0] = '\0';
+        if (TestRandom() % 2 == 0)
+        {
+            strcat(domain, labels[TestRandom() % NUM_LABELS]);
+            strcat(domain, (TestRandom() % 4 == 0? "": "."));
+        }
+        strcat(domain, entries[j].domain);
+        strcpy(uri, entries[j].uri);
+        RandomUri(uri + strlen(uri));
+    }
+    else
+    {
+        RandomDomain(domain);
+        RandomUri(uri);
+    }
+    if (TestRandom() % 8 == 0)
+    {
+        domain[0] = (char)toupper((UINT8)domain[0]);
+    }
+}
+
+/*
+ * Differential test of BlackListMatch().
+ */
+static void TestMatch(void)
+{
+    PBLACKLIST blacklist;
+    char domain[64], uri[2*URI_MAXLEN+1];
+    URL url = {domain, uri};
+    UINT round, i, matched = 0;
+
+    for (round = 0; round < NUM_ROUNDS; round++)
+    {
+        RandomBlackList();
+        blacklist = BlackListInit();
+        CHECK(BlackListRead(blacklist, TEXT_FILE));
+        BlackListCompile(blacklist);
+        CHECK(blacklist->num_nodes >= 1);
+        CHECK(blacklist->num_nodes <= 2 * num_entries + 1);
+        CHECK(blacklist->num_edges + 1 == blacklist->num_nodes);
+        for (i = 0; i < NUM_URLS; i++)
+        {
+            RandomUrl(domain, uri);
+            CHECK(BlackListMatch(blacklist, &url) == NaiveMatch(domain, uri));
+            matched += NaiveMatch(domain, uri);
+        }
+        BlackListFree(blacklist);
+    }
+
+    // Both outcomes are well covered:
+    CHECK(matched > NUM_ROUNDS * NUM_URLS / 10);
+    CHECK(matched < NUM_ROUNDS * NUM_URLS * 9 / 10);
+    remove(TEXT_FILE);
+}
+
+/*
+ * Build a blacklist from a string.
+ */
+static PBLACKLIST BlackListString(const char *text)
+{
+    PBLACKLIST blacklist;
+    FILE *file = fopen(TEXT_FILE, "w");
+
+    if (file == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+    fputs(text, file);
+    fclose(file);
+    blacklist = BlackListInit();
+    CHECK(BlackListRead(blacklist, TEXT_FILE));
+    BlackListCompile(blacklist);
+    remove(TEXT_FILE);
+    return blacklist;
+}
+
+/*
+ * Image files: a compiled blacklist written to an image file maps back to
+ * the same trie, which keeps working after the image file is removed (as
+ * when a new image is renamed over it).
+ */
+static void TestImage(void)
+{
+    static char *text_files[] = {TEXT_FILE};
+    static char *image_files[] = {IMAGE_FILE};
+    PBLACKLIST compiled, mapped;
+    char domain[64], uri[2*URI_MAXLEN+1];
+    URL url = {domain, uri};
+    UINT round, i;
+
+    for (round = 0; round < NUM_IMAGES; round++)
+    {
+        RandomBlackList();
+        CHECK(!BlackListIsImage(TEXT_FILE));
+        compiled = BlackListLoad(1, text_files);
+        CHECK(compiled != NULL);
+        if (compiled == NULL)
+        {
+            continue;
+        }
+        CHECK(compiled->view == NULL);
+        BlackListWrite(compiled, IMAGE_FILE);
+        CHECK(BlackListIsImage(IMAGE_FILE));
+        mapped = BlackListLoad(1, image_files);
+        CHECK(mapped != NULL);
+        if (mapped == NULL)
+        {
+            BlackListFree(compiled);
+            continue;
+        }
+        CHECK(mapped->view != NULL);
+        CHECK(mapped->num_nodes == compiled->num_nodes);
+        CHECK(mapped->num_edges == compiled->num_edges);
+        CHECK(mapped->labels_len == compiled->labels_len);
+        CHECK(memcmp(mapped->nodes, compiled->nodes,
+            compiled->num_nodes * sizeof(NODE)) == 0);
+        CHECK(memcmp(mapped->edges, compiled->edges,
+            compiled->num_edges * sizeof(EDGE)) == 0);
+        CHECK(memcmp(mapped->labels, compiled->labels,
+            compiled->labels_len) == 0);
+
+        remove(IMAGE_FILE);
+        for (i = 0; i < NUM_URLS; i++)
+        {
+            RandomUrl(domain, uri);
+            CHECK(BlackListMatch(mapped, &url) == NaiveMatch(domain, uri));
+        }
+        BlackListFree(compiled);
+        BlackListFree(mapped);
+    }
+    remove(TEXT_FILE);
+}
+
+/*
+ * Try to map IMAGE_FILE, without the error message if it fails.
+ */
+static BOOL MapFile(void)
+{
+    PBLACKLIST blacklist;
+    int err_fd, null_fd;
+    BOOL result;
+
+    fflush(stderr);
+    err_fd = dup(2);
+    null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 2);
+    close(null_fd);
+    blacklist = BlackListInit();
+    result = BlackListMap(blacklist, IMAGE_FILE);
+    BlackListFree(blacklist);
+    fflush(stderr);
+    dup2(err_fd, 2);
+    close(err_fd);
+    return result;
+}
+
+/*
+ * Write an image and try to map it.
+ */
+static BOOL MapImage(const UINT8 *image, UINT len)
+{
+    FILE *file = fopen(IMAGE_FILE, "wb");
+
+    if (file == NULL || fwrite(image, 1, len, file) != len)
+    {
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    return MapFile();
+}
+
+/*
+ * Corrupt images are rejected.
+ */
+static void TestCorruptImage(void)
+{
+    static UINT8 image[4096], copy[4096];
+    PBLACKLIST blacklist;
+    PIMAGE_HEADER header = (PIMAGE_HEADER)copy;
+    PNODE nodes = (PNODE)(header + 1);
+    PEDGE edges;
+    FILE *file;
+    UINT len, i;
+
+    blacklist = BlackListString(
+        "example.com/ads\n"
+        "example.org\n"
+        "www.example.net/a/b\n");
+    BlackListWrite(blacklist, IMAGE_FILE);
+    BlackListFree(blacklist);
+    file = fopen(IMAGE_FILE, "rb");
+    CHECK(file != NULL);
+    if (file == NULL)
+    {
+        return;
+    }
+    len = (UINT)fread(image, 1, sizeof(image), file);
+    fclose(file);
+    CHECK(len > sizeof(IMAGE_HEADER) && len < sizeof(image));
+    memcpy(copy, image, len);
+    edges = (PEDGE)(nodes + header->num_nodes);
+    CHECK(MapImage(copy, len));
+
+    // Truncated or extended:
+    CHECK(!MapImage(copy, 0));
+    CHECK(!MapImage(copy, sizeof(IMAGE_HEADER) - 1));
+    CHECK(!MapImage(copy, sizeof(IMAGE_HEADER)));
+    CHECK(!MapImage(copy, len - 1));
+    CHECK(!MapImage(copy, len + 1));
+
+    // Bad header:
+    header->magic++;
+    CHECK(!MapImage(copy, len));
+    memcpy(copy, image, len);
+    header->version++;
+    CHECK(!MapImage(copy, len));
+    memcpy(copy, image, len);
+    header->num_nodes = 0;
+    CHECK(!MapImage(copy, len));
+    header->num_edges = header->labels_len = 0;
+    CHECK(!MapImage(copy, sizeof(IMAGE_HEADER)));   // No root node.
+    memcpy(copy, image, len);
+    header->num_nodes++;
+    CHECK(!MapImage(copy, len));
+    memcpy(copy, image, len);
+    header->labels_len--;
+    CHECK(!MapImage(copy, len));
+    memcpy(copy, image, len);
+    header->num_edges = 0xFFFFFFFF;     // Larger than 4GB in total.
+    header->num_nodes = 0x10000001;
+    CHECK(!MapImage(copy, len));
+
+    // Bad nodes and edges:
+    for (i = 0; i < ((PIMAGE_HEADER)image)->num_nodes; i++)
+    {
+        memcpy(copy, image, len);
+        nodes[i].edges = header->num_edges - nodes[i].num_edges + 1;
+        CHECK(!MapImage(copy, len));
+        memcpy(copy, image, len);
+        nodes[i].num_edges = (UINT16)(header->num_edges -
+            nodes[i].edges + 1);
+        CHECK(!MapImage(copy, len));
+    }
+    for (i = 0; i < ((PIMAGE_HEADER)image)->num_edges; i++)
+    {
+        memcpy(copy, image, len);
+        edges[i].child = header->num_nodes;
+        CHECK(!MapImage(copy, len));
+        memcpy(copy, image, len);
+        edges[i].label_len = 0;
+        CHECK(!MapImage(copy, len));
+        memcpy(copy, image, len);
+        edges[i].label = header->labels_len - edges[i].label_len + 1;
+        CHECK(!MapImage(copy, len));
+    }
+
+    // A text file, or no file, is not an image:
+    CHECK(!MapImage((const UINT8 *)"example.com/ads\n", 16));
+    remove(IMAGE_FILE);
+    CHECK(!BlackListIsImage(IMAGE_FILE));
+    CHECK(!MapFile());
+}
+
+/*
+ * Match a request with BlackListPayloadMatch().
+ */
+static BOOL PayloadMatch(PBLACKLIST blacklist, const char *request,
+    UINT len, char *domain, char *uri, BOOL *more)
+{
+    char data[256];
+    URL url = {domain, uri};
+
+    memcpy(data, request, len);
+    return BlackListPayloadMatch(blacklist, data, len, &url, more);
+}
+
+static BOOL RequestMatch(PBLACKLIST blacklist, const char *request,
+    char *domain, char *uri, BOOL *more)
+{
+    return PayloadMatch(blacklist, request, (UINT)strlen(request), domain,
+        uri, more);
+}
+
+/*
+ * HTTP request parsing.
+ */
+static void TestPayloadMatch(void)
+{
+    static const char get[] =
+        "GET /ads/banner.gif HTTP/1.1\r\nHost: www.Example.com\r\n\r\n";
+    static const char post[] =
+        "POST /form HTTP/1.1\r\nHost: example.org.\r\n\r\n";
+    PBLACKLIST blacklist;
+    char domain[MAXURL], uri[MAXURL];
+    UINT len, i;
+    BOOL more, complete;
+
+    blacklist = BlackListString(
+        "example.com/ads\n"
+        "example.org\n");
+
+    // Complete requests:
+    CHECK(PayloadMatch(blacklist, get, sizeof(get)-1, domain, uri, &more));
+    CHECK(!more);
+    CHECK(strcmp(domain, "www.Example.com") == 0);
+    CHECK(strcmp(uri, "ads/banner.gif") == 0);
+    CHECK(PayloadMatch(blacklist, post, sizeof(post)-1, domain, uri, &more));
+    CHECK(!more);
+    CHECK(strcmp(domain, "example.org") == 0);      // Trailing '.' dropped.
+    CHECK(strcmp(uri, "form") == 0);
+
+    // Every prefix of a request up to the end of the Host header asks for
+    // more, without a match or a URL:
+    len = (UINT)(strstr(get, "\r\n\r\n") - get);
+    for (i = 0; i <= len; i++)
+    {
+        CHECK(!PayloadMatch(blacklist, get, i, domain, uri, &more));
+        complete = (i >= 5);        // "GET /" seen.
+        CHECK(more == complete);
+        CHECK(domain[0] == '\0');
+    }
+    CHECK(PayloadMatch(blacklist, get, len + 1, domain, uri, &more));
+    CHECK(!more);
+
+    // Not requests, or not matching:
+    CHECK(!RequestMatch(blacklist, "PUT /ads HTTP/1.1\r\nHost: example.com"
+        "\r\n", domain, uri, &more));
+    CHECK(!more && domain[0] == '\0');
+    CHECK(!RequestMatch(blacklist, "GET /ads HTTP/1.0\r\nHost: example.com"
+        "\r\n", domain, uri, &more));
+    CHECK(!more && domain[0] == '\0');
+    CHECK(!RequestMatch(blacklist, "GET /ads HTTP/1.1\r\nHost: \r\n",
+        domain, uri, &more));
+    CHECK(!more && domain[0] == '\0');
+    CHECK(!RequestMatch(blacklist, "GET /ads HTTP/1.1\r\nHost: .\r\n",
+        domain, uri, &more));
+    CHECK(!more && domain[0] == '\0');
+    CHECK(!RequestMatch(blacklist, "GET /news HTTP/1.1\r\nHost: example.com"
+        "\r\n", domain, uri, &more));
+    CHECK(!more);
+    CHECK(strcmp(domain, "example.com") == 0);
+    CHECK(strcmp(uri, "news") == 0);
+    CHECK(!RequestMatch(blacklist, "GET /ads HTTP/1.1\r\nHost: badexample.com"
+        "\r\n", domain, uri, &more));
+    CHECK(strcmp(domain, "badexample.com") == 0);
+    BlackListFree(blacklist);
+
+    // An empty blacklist matches nothing:
+    blacklist = BlackListString("");
+    CHECK(!PayloadMatch(blacklist, get, sizeof(get)-1, domain, uri, &more));
+    CHECK(strcmp(domain, "www.Example.com") == 0);
+    BlackListFree(blacklist);
+}
+
+int main(void)
+{
+    TestMatch();
+    TestImage();
+    TestCorruptImage();
+    TestPayloadMatch();
+    return TestResult("test_blacklist");
+}
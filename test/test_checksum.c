@@ -0,0 +1,212 @@
+/*
+ * test_checksum.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks WinDivertHelperCalcChecksums() against an independent (byte-wise)
+ * implementation of the Internet checksum, for IPv4 and IPv6 packets of
+ * every transport protocol.  The packets are also written to a capture file
+ * (argv[1], if given) for the replay smoke test.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_PACKETS     64
+
+/*
+ * Byte-wise one's complement sum of big-endian 16-bit words.
+ */
+static UINT32 ReferenceSum(UINT32 sum, const UINT8 *data, UINT len)
+{
+    UINT i;
+
+    for (i = 0; i + 1 < len; i += 2)
+    {
+        sum += ((UINT32)data[i] << 8) | data[i+1];
+    }
+    if (i < len)
+    {
+        sum += (UINT32)data[i] << 8;
+    }
+    return sum;
+}
+
+static UINT16 ReferenceFold(UINT32 sum)
+{
+    while ((sum >> 16) != 0)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (UINT16)sum;
+}
+
+/*
+ * A correctly checksummed segment sums (with its pseudo header) to 0xFFFF.
+ */
+static BOOL ReferenceVerify(const UINT8 *packet, UINT packet_len)
+{
+    const UINT8 *segment;
+    UINT32 sum = 0;
+    UINT segment_len;
+    UINT8 protocol, pseudo[4];
+
+    if ((packet[0] >> 4) == 4)
+    {
+        if (ReferenceFold(ReferenceSum(0, packet, 20)) != 0xFFFF)
+        {
+            return FALSE;
+        }
+        protocol    = packet[9];
+        segment     = packet + 20;
+        segment_len = packet_len - 20;
+        if (protocol != IPPROTO_ICMP)
+        {
+            sum = ReferenceSum(sum, packet + 12, 8);
+        }
+    }
+    else
+    {
+        protocol    = packet[6];
+        segment     = packet + 40;
+        segment_len = packet_len - 40;
+        sum = ReferenceSum(sum, packet + 8, 32);
+    }
+    if (protocol != IPPROTO_ICMP)
+    {
+        // Length and next header, as (big-endian) 32-bit fields.
+        pseudo[0] = 0;
+        pseudo[1] = 0;
+        pseudo[2] = (UINT8)(segment_len >> 8);
+        pseudo[3] = (UINT8)segment_len;
+        sum = ReferenceSum(sum, pseudo, 4);
+        pseudo[2] = 0;
+        pseudo[3] = protocol;
+        sum = ReferenceSum(sum, pseudo, 4);
+    }
+    return (ReferenceFold(ReferenceSum(sum, segment, segment_len)) ==
+        0xFFFF);
+}
+
+/*
+ * Build a random packet of the given version and protocol.
+ */
+static UINT BuildPacket(UINT8 *packet, BOOL ipv6, UINT8 protocol)
+{
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_UDPHDR udp_header;
+    UINT ip_len = (ipv6? 40: 20), hdr_len, payload_len, i;
+
+    payload_len = TestRandom() % 200;
+    switch (protocol)
+    {
+        case IPPROTO_TCP:
+            hdr_len = sizeof(WINDIVERT_TCPHDR);
+            break;
+        case IPPROTO_UDP:
+            hdr_len = sizeof(WINDIVERT_UDPHDR);
+            break;
+        default:
+            hdr_len = sizeof(WINDIVERT_ICMPHDR);
+            break;
+    }
+    memset(packet, 0, ip_len + hdr_len);
+    for (i = 0; i < hdr_len + payload_len; i++)
+    {
+        packet[ip_len + i] = (UINT8)TestRandom();
+    }
+    if (ipv6)
+    {
+        ipv6_header->Version    = 6;
+        ipv6_header->Length     = htons((UINT16)(hdr_len + payload_len));
+        ipv6_header->NextHdr    = protocol;
+        ipv6_header->HopLimit   = 64;
+        for (i = 0; i < 4; i++)
+        {
+            ipv6_header->SrcAddr[i] = TestRandom();
+            ipv6_header->DstAddr[i] = TestRandom();
+        }
+    }
+    else
+    {
+        ip_header->Version      = 4;
+        ip_header->HdrLength    = 5;
+        ip_header->Length       = htons((UINT16)(ip_len + hdr_len +
+            payload_len));
+        ip_header->TTL          = 64;
+        ip_header->Protocol     = protocol;
+        ip_header->SrcAddr      = TestRandom();
+        ip_header->DstAddr      = TestRandom();
+    }
+    switch (protocol)
+    {
+        case IPPROTO_TCP:
+            tcp_header = (PWINDIVERT_TCPHDR)(packet + ip_len);
+            tcp_header->HdrLength = 5;
+            break;
+        case IPPROTO_UDP:
+            udp_header = (PWINDIVERT_UDPHDR)(packet + ip_len);
+            udp_header->Length = htons((UINT16)(hdr_len + payload_len));
+            break;
+    }
+    return ip_len + hdr_len + payload_len;
+}
+
+int main(int argc, char **argv)
+{
+    static const UINT8 protocols[2][3] =
+    {
+        {IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP},
+        {IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMPV6}
+    };
+    static UINT8 packet[WINDIVERT_PCAP_MAX_PACKET];
+    WINDIVERT_ADDRESS addr;
+    HANDLE pcap = INVALID_HANDLE_VALUE;
+    UINT packet_len, count, i, ipv6, j;
+
+    if (argc > 1)
+    {
+        pcap = WinDivertHelperPcapOpen(argv[1], 0, 0);
+        CHECK(pcap != INVALID_HANDLE_VALUE);
+    }
+    memset(&addr, 0, sizeof(addr));
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        for (ipv6 = 0; ipv6 < 2; ipv6++)
+        {
+            for (j = 0; j < 3; j++)
+            {
+                packet_len = BuildPacket(packet, ipv6, protocols[ipv6][j]);
+                count = WinDivertHelperCalcChecksums(packet, packet_len, 0);
+                CHECK(count == (ipv6? 1: 2));
+                CHECK(ReferenceVerify(packet, packet_len));
+                if (pcap != INVALID_HANDLE_VALUE)
+                {
+                    CHECK(WinDivertHelperPcapWrite(pcap, packet, packet_len,
+                        &addr));
+                }
+            }
+        }
+    }
+    if (pcap != INVALID_HANDLE_VALUE)
+    {
+        CHECK(WinDivertHelperPcapClose(pcap));
+    }
+    return TestResult("test_checksum");
+}
@@ -0,0 +1,255 @@
+/*
+ * test_classifier.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that WinDivertHelperClassify() agrees with evaluating each rule on
+ * its own (WinDivertHelperEvalFilter()), for random rule sets and random
+ * (sometimes malformed) packets.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_RULES       200
+#define NUM_ROUNDS      10
+#define NUM_PACKETS     2000
+
+static char rule_strs[NUM_RULES][128];
+static const char *rules[NUM_RULES];
+static HANDLE filters[NUM_RULES];
+
+/*
+ * A random rule.  Values are drawn from small ranges so that rules and
+ * packets often match, and many rules share a classifier key.
+ */
+static void RandomRule(char *rule, size_t len)
+{
+    static const char *payloads[] = {"GET ", "POST", "dns.", "ping"};
+    UINT port = 1 + TestRandom() % 8, addr = 1 + TestRandom() % 4;
+
+    switch (TestRandom() % 16)
+    {
+        case 0:
+            snprintf(rule, len, "tcp.DstPort == %u", port);
+            break;
+        case 1:
+            snprintf(rule, len, "udp.DstPort == %u and ip", port);
+            break;
+        case 2:
+            snprintf(rule, len, "tcp.SrcPort == %u or udp.SrcPort == %u",
+                port, 1 + TestRandom() % 8);
+            break;
+        case 3:
+            snprintf(rule, len, "ip.DstAddr == 10.0.0.%u", addr);
+            break;
+        case 4:
+            snprintf(rule, len, "ip.SrcAddr == 10.0.0.%u and tcp.Syn",
+                addr);
+            break;
+        case 5:
+            snprintf(rule, len, "icmp.Type == %u", TestRandom() % 2 * 8);
+            break;
+        case 6:
+            snprintf(rule, len, "icmpv6.Type == %u",
+                128 + TestRandom() % 2);
+            break;
+        case 7:
+            snprintf(rule, len, "ip.Protocol == %u",
+                (TestRandom() % 2 == 0? IPPROTO_TCP: IPPROTO_UDP));
+            break;
+        case 8:
+            snprintf(rule, len, "ipv6.NextHdr == %u and outbound",
+                (TestRandom() % 2 == 0? IPPROTO_TCP: IPPROTO_UDP));
+            break;
+        case 9:
+            snprintf(rule, len, "tcp.Payload[0:4] == \"%s\"",
+                payloads[TestRandom() % 4]);
+            break;
+        case 10:
+            snprintf(rule, len, "udp.Payload contains {\"%s\"}",
+                payloads[TestRandom() % 4]);
+            break;
+        case 11:
+            snprintf(rule, len, "not tcp.DstPort == %u", port);
+            break;
+        case 12:
+            snprintf(rule, len, "ifIdx == %u", TestRandom() % 3);
+            break;
+        case 13:
+            snprintf(rule, len, "%s", (TestRandom() % 2 == 0? "inbound":
+                "true"));
+            break;
+        case 14:
+            snprintf(rule, len, "tcp.DstPort == %u and ip.DstAddr == "
+                "10.0.0.%u", port, addr);
+            break;
+        default:
+            snprintf(rule, len, "tcp.PayloadLength > %u or udp.Length < %u",
+                TestRandom() % 8, 8 + TestRandom() % 8);
+            break;
+    }
+}
+
+/*
+ * A random packet.  Some are IPv4 fragments or malformed.
+ */
+static UINT RandomPacket(UINT8 *packet, PWINDIVERT_ADDRESS addr)
+{
+    static const char *payloads[] = {"", "GET /", "POST /", "dns.query",
+        "ping"};
+    static const UINT8 protocols[] = {IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP,
+        IPPROTO_ICMPV6};
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_ICMPHDR icmp_header;
+    UINT8 protocol;
+    BOOL ipv6 = (TestRandom() % 3 == 0);
+    UINT ip_len, packet_len;
+
+    protocol = protocols[TestRandom() % 3];
+    if (ipv6 && protocol == IPPROTO_ICMP)
+    {
+        protocol = IPPROTO_ICMPV6;
+    }
+    packet_len = TestPacket(packet, ipv6, protocol,
+        (UINT16)(1 + TestRandom() % 8), (UINT16)(1 + TestRandom() % 8),
+        payloads[TestRandom() % 5]);
+    ip_len = (ipv6? sizeof(WINDIVERT_IPV6HDR): sizeof(WINDIVERT_IPHDR));
+    if (!ipv6)
+    {
+        ip_header->SrcAddr = htonl(0x0A000000u | (1 + TestRandom() % 4));
+        ip_header->DstAddr = htonl(0x0A000000u | (1 + TestRandom() % 4));
+    }
+    switch (protocol)
+    {
+        case IPPROTO_TCP:
+            tcp_header = (PWINDIVERT_TCPHDR)(packet + ip_len);
+            tcp_header->Syn = TestRandom() % 2;
+            break;
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            icmp_header = (PWINDIVERT_ICMPHDR)(packet + ip_len);
+            icmp_header->Type = (UINT8)(ipv6? 128 + TestRandom() % 2:
+                TestRandom() % 2 * 8);
+            break;
+    }
+    switch (TestRandom() % 16)
+    {
+        case 0:
+            // Non-first fragment:
+            if (!ipv6)
+            {
+                ip_header->FragOff0 = htons(1 + TestRandom() % 100);
+            }
+            break;
+        case 1:
+            // Bad transport header:
+            if (protocol == IPPROTO_TCP)
+            {
+                tcp_header = (PWINDIVERT_TCPHDR)(packet + ip_len);
+                tcp_header->HdrLength = 15;
+            }
+            break;
+        case 2:
+            // Truncated:
+            packet_len = TestRandom() % packet_len;
+            break;
+    }
+    addr->IfIdx     = TestRandom() % 3;
+    addr->SubIfIdx  = 0;
+    addr->Direction = (UINT8)(TestRandom() % 2);
+    return packet_len;
+}
+
+int main(void)
+{
+    static UINT8 object[sizeof(WINDIVERT_FILTER_OBJECT) +
+        WINDIVERT_FILTER_MAXLEN*sizeof(struct windivert_ioctl_filter_s) +
+        WINDIVERT_FILTER_AUTOMATA_MAXLEN];
+    UINT8 packet[256];
+    UINT ids[NUM_RULES], expected[NUM_RULES], num_expected, num_ids;
+    UINT packet_len, object_len, round, i, j;
+    WINDIVERT_ADDRESS addr;
+    HANDLE classifier;
+    BOOL result;
+
+    for (round = 0; round < NUM_ROUNDS; round++)
+    {
+        for (i = 0; i < NUM_RULES; i++)
+        {
+            RandomRule(rule_strs[i], sizeof(rule_strs[i]));
+            rules[i] = rule_strs[i];
+            CHECK(WinDivertFilterCompile(rules[i], WINDIVERT_LAYER_NETWORK,
+                object, sizeof(object), &object_len));
+            filters[i] = WinDivertHelperFilterOpen(object, object_len);
+            CHECK(filters[i] != INVALID_HANDLE_VALUE);
+        }
+        classifier = WinDivertHelperClassifierOpen(rules, NUM_RULES,
+            WINDIVERT_LAYER_NETWORK);
+        CHECK(classifier != INVALID_HANDLE_VALUE);
+        if (classifier == INVALID_HANDLE_VALUE)
+        {
+            break;
+        }
+
+        for (i = 0; i < NUM_PACKETS; i++)
+        {
+            packet_len = RandomPacket(packet, &addr);
+            num_expected = 0;
+            for (j = 0; j < NUM_RULES; j++)
+            {
+                if (WinDivertHelperEvalFilter(filters[j], packet, packet_len,
+                        &addr))
+                {
+                    expected[num_expected++] = j;
+                }
+            }
+            result = WinDivertHelperClassify(classifier, packet, packet_len,
+                &addr, ids, NUM_RULES, &num_ids);
+            CHECK(result == (num_expected != 0));
+            CHECK(num_ids == num_expected);
+            CHECK(memcmp(ids, expected, num_expected * sizeof(UINT)) == 0);
+
+            // A short rule ID array gets the first matching rules:
+            if (num_expected > 1)
+            {
+                result = WinDivertHelperClassify(classifier, packet,
+                    packet_len, &addr, ids, 1, &num_ids);
+                CHECK(result && num_ids == 1 && ids[0] == expected[0]);
+            }
+        }
+
+        CHECK(WinDivertHelperClassifierClose(classifier));
+        for (i = 0; i < NUM_RULES; i++)
+        {
+            WinDivertHelperFilterClose(filters[i]);
+        }
+    }
+
+    // Invalid rules and arguments:
+    rules[0] = "tcp.DstPort == 80";
+    rules[1] = "tcp.DstPort ==";
+    CHECK(WinDivertHelperClassifierOpen(rules, 2, WINDIVERT_LAYER_NETWORK) ==
+        INVALID_HANDLE_VALUE);
+    CHECK(WinDivertHelperClassifierOpen(rules, 0, WINDIVERT_LAYER_NETWORK) ==
+        INVALID_HANDLE_VALUE);
+    CHECK(!WinDivertHelperClassify(INVALID_HANDLE_VALUE, packet, 0, &addr,
+        ids, NUM_RULES, NULL));
+
+    return TestResult("test_classifier");
+}
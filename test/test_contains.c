@@ -0,0 +1,328 @@
+/*
+ * test_contains.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the Aho-Corasick automata of the "contains" filter test against a
+ * naive search: random pattern sets (with overlapping patterns, and
+ * patterns that are prefixes or suffixes of each other) over small and large
+ * alphabets, matched against random data (including empty data, and data
+ * with patterns at either end) in one or two chunks.  Also checks whole
+ * filters, where the pattern must lie within the payload.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_ROUNDS      3000
+#define NUM_DATA        50
+#define NUM_FILTERS     300
+#define PATTERNS_MAX    40
+#define PATTERN_MAXLEN  8
+#define DATA_MAXLEN     300
+
+static UINT8 patterns[PATTERNS_MAX][PATTERN_MAXLEN];
+static UINT pattern_lens[PATTERNS_MAX];
+static UINT num_patterns;
+static char pattern_set[PATTERNS_MAX * (4*PATTERN_MAXLEN + 4) + 1];
+static UINT8 data[DATA_MAXLEN];
+
+/*
+ * A random byte from the first alphabet_len bytes of alphabet.
+ */
+static UINT8 RandomByte(const UINT8 *alphabet, UINT alphabet_len)
+{
+    UINT r = TestRandom() % alphabet_len;
+
+    return (alphabet == NULL? (UINT8)r: alphabet[r]);
+}
+
+/*
+ * A random pattern set.  Some patterns are (random length) prefixes or
+ * suffixes of earlier patterns.  The set is written to pattern_set in the
+ * filter syntax, i.e. "\x61\x62", ..., with some bytes not escaped.
+ */
+static void RandomPatterns(const UINT8 *alphabet, UINT alphabet_len)
+{
+    UINT i, j, k, len, from;
+    char *s = pattern_set;
+
+    num_patterns = 1 + TestRandom() % PATTERNS_MAX;
+    for (i = 0; i < num_patterns; i++)
+    {
+        len = 1 + TestRandom() % PATTERN_MAXLEN;
+        from = (i == 0? 0: TestRandom() % i);
+        switch (TestRandom() % 4)
+        {
+            case 0:
+                // Prefix of an earlier pattern:
+                if (i == 0)
+                {
+                    goto RandomPattern;
+                }
+                len = 1 + TestRandom() % pattern_lens[from];
+                memcpy(patterns[i], patterns[from], len);
+                break;
+            case 1:
+                // Suffix of an earlier pattern:
+                if (i == 0)
+                {
+                    goto RandomPattern;
+                }
+                len = 1 + TestRandom() % pattern_lens[from];
+                memcpy(patterns[i], patterns[from] + pattern_lens[from] - len,
+                    len);
+                break;
+            default:
+            RandomPattern:
+                for (j = 0; j < len; j++)
+                {
+                    patterns[i][j] = RandomByte(alphabet, alphabet_len);
+                }
+                break;
+        }
+        pattern_lens[i] = len;
+
+        s += sprintf(s, "%s\"", (i == 0? "": ", "));
+        for (k = 0; k < len; k++)
+        {
+            if (patterns[i][k] >= 'a' && patterns[i][k] <= 'z')
+            {
+                *s++ = (char)patterns[i][k];
+            }
+            else
+            {
+                s += sprintf(s, "\\x%.2X", patterns[i][k]);
+            }
+        }
+        *s++ = '"';
+    }
+    *s = '\0';
+}
+
+/*
+ * Does any pattern occur in data[0..len-1]?
+ */
+static BOOL NaiveContains(const UINT8 *buf, UINT len)
+{
+    UINT i, j;
+
+    for (i = 0; i < num_patterns; i++)
+    {
+        for (j = 0; j + pattern_lens[i] <= len; j++)
+        {
+            if (memcmp(buf + j, patterns[i], pattern_lens[i]) == 0)
+            {
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Random data, maybe with a pattern at the start, at the end, or in the
+ * middle; returns the length.
+ */
+static UINT RandomData(UINT8 *buf, UINT max_len, const UINT8 *alphabet,
+    UINT alphabet_len)
+{
+    UINT len = (TestRandom() % 8 == 0? 0: TestRandom() % (max_len + 1));
+    UINT i, p, pos;
+
+    for (i = 0; i < len; i++)
+    {
+        buf[i] = RandomByte(alphabet, alphabet_len);
+    }
+    p = TestRandom() % num_patterns;
+    if (pattern_lens[p] > len)
+    {
+        return len;
+    }
+    switch (TestRandom() % 4)
+    {
+        case 0:
+            pos = 0;
+            break;
+        case 1:
+            pos = len - pattern_lens[p];
+            break;
+        case 2:
+            pos = TestRandom() % (len - pattern_lens[p] + 1);
+            break;
+        default:
+            return len;
+    }
+    memcpy(buf + pos, patterns[p], pattern_lens[p]);
+    return len;
+}
+
+/*
+ * Run an automaton over buf, split into two chunks at split.
+ */
+static BOOL AutomatonContains(windivert_ioctl_automaton_t automaton,
+    const UINT8 *buf, UINT len, UINT split)
+{
+    UINT32 state = automaton->classes;          // Start state
+
+    if (windivert_automaton_match(automaton, buf, split, &state))
+    {
+        return TRUE;
+    }
+    return windivert_automaton_match(automaton, buf + split, len - split,
+        &state);
+}
+
+/*
+ * Differential test of the automata built by WinDivertCompileAutomaton().
+ */
+static void TestAutomata(void)
+{
+    UINT8 alphabet[4];
+    FILTER_TOKEN token;
+    UINT8 *automata;
+    UINT automata_len, alphabet_len, round, i, len, split;
+    BOOL expected;
+
+    for (round = 0; round < NUM_ROUNDS; round++)
+    {
+        // Small alphabets give many overlapping matches; with the full byte
+        // range, every byte is in some class:
+        alphabet_len = 1 + round % 4;
+        for (i = 0; i < alphabet_len; i++)
+        {
+            alphabet[i] = (UINT8)TestRandom();
+        }
+        if (round % 5 == 0)
+        {
+            RandomPatterns(NULL, 256);
+        }
+        else
+        {
+            RandomPatterns(alphabet, alphabet_len);
+        }
+
+        memset(&token, 0, sizeof(token));
+        token.kind = FILTER_TOKEN_STRINGS;
+        token.str  = pattern_set;
+        token.len  = (UINT)strlen(pattern_set);
+        automata = NULL;
+        automata_len = 0;
+        CHECK(WinDivertCompileAutomaton(&token, &automata, &automata_len));
+        if (automata == NULL)
+        {
+            continue;
+        }
+        CHECK(windivert_automaton_verify(
+            (windivert_ioctl_automaton_t)automata, automata_len) ==
+                automata_len);
+
+        for (i = 0; i < NUM_DATA; i++)
+        {
+            if (round % 5 == 0)
+            {
+                len = RandomData(data, DATA_MAXLEN, NULL, 256);
+            }
+            else
+            {
+                len = RandomData(data, DATA_MAXLEN, alphabet, alphabet_len);
+            }
+            split = TestRandom() % (len + 1);
+            expected = NaiveContains(data, len);
+            CHECK(AutomatonContains((windivert_ioctl_automaton_t)automata,
+                data, len, len) == expected);
+            CHECK(AutomatonContains((windivert_ioctl_automaton_t)automata,
+                data, len, split) == expected);
+        }
+        free(automata);
+    }
+}
+
+/*
+ * Differential test of whole filters: only the payload is searched, so
+ * patterns in the headers, or that run past the end of the payload, do not
+ * match.
+ */
+static void TestFilters(void)
+{
+    static const UINT8 alphabet[] = "abcd";
+    static UINT8 object[0x10000];
+    static char filter[sizeof(pattern_set) + 64];
+    WINDIVERT_ADDRESS addr;
+    UINT8 packet[512];
+    char payload[DATA_MAXLEN + 1];
+    UINT object_len, round, i, len, packet_len, hdr_len;
+    HANDLE handle;
+    BOOL ipv6, expected;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.IfIdx     = 3;
+    addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+    for (round = 0; round < NUM_FILTERS; round++)
+    {
+        RandomPatterns(alphabet, 4);
+        snprintf(filter, sizeof(filter), "%stcp.Payload contains {%s}",
+            (round % 2 == 0? "": "not "), pattern_set);
+        CHECK(WinDivertFilterCompile(filter, WINDIVERT_LAYER_NETWORK,
+            object, sizeof(object), &object_len));
+        handle = WinDivertHelperFilterOpen(object, object_len);
+        CHECK(handle != INVALID_HANDLE_VALUE);
+        if (handle == INVALID_HANDLE_VALUE)
+        {
+            continue;
+        }
+        for (i = 0; i < NUM_DATA; i++)
+        {
+            len = RandomData((UINT8 *)payload, DATA_MAXLEN, alphabet, 4);
+            payload[len] = '\0';
+            ipv6 = (TestRandom() % 2 == 0);
+            packet_len = TestPacket(packet, ipv6, IPPROTO_TCP, 0x6162,
+                0x6364, payload);
+            hdr_len = packet_len - len;
+            expected = NaiveContains(packet + hdr_len, len);
+            CHECK(WinDivertHelperEvalFilter(handle, packet, packet_len,
+                &addr) == (round % 2 == 0? expected: !expected));
+
+            // Truncate the packet (as far as the IP header is concerned) in
+            // the middle of the payload:
+            if (len == 0 || ipv6)
+            {
+                continue;
+            }
+            len = TestRandom() % len;
+            ((PWINDIVERT_IPHDR)packet)->Length =
+                htons((UINT16)(hdr_len + len));
+            expected = NaiveContains(packet + hdr_len, len);
+            CHECK(WinDivertHelperEvalFilter(handle, packet, hdr_len + len,
+                &addr) == (round % 2 == 0? expected: !expected));
+        }
+        WinDivertHelperFilterClose(handle);
+    }
+
+    // Empty patterns are rejected:
+    CHECK(!WinDivertFilterCompile("tcp.Payload contains {\"\"}",
+        WINDIVERT_LAYER_NETWORK, object, sizeof(object), &object_len));
+    CHECK(!WinDivertFilterCompile("tcp.Payload contains {\"a\", \"\"}",
+        WINDIVERT_LAYER_NETWORK, object, sizeof(object), &object_len));
+}
+
+int main(void)
+{
+    TestAutomata();
+    TestFilters();
+    return TestResult("test_contains");
+}
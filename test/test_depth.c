@@ -0,0 +1,227 @@
+/*
+ * test_depth.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the header depth a filter needs (filter[0].depth), the number of
+ * header bytes windivert_parse_headers() fetches for each depth, and that
+ * filtering at the filter's depth gives the same verdict as filtering with
+ * fully parsed headers.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_PACKETS     5000
+
+static const struct
+{
+    const char *filter;
+    UINT8 depth;
+} filters[] =
+{
+    {"true",                            WINDIVERT_FILTER_DEPTH_NONE},
+    {"false",                           WINDIVERT_FILTER_DEPTH_NONE},
+    {"outbound and ifIdx == 1",         WINDIVERT_FILTER_DEPTH_NONE},
+    {"ip",                              WINDIVERT_FILTER_DEPTH_NETWORK},
+    {"ipv6 or inbound",                 WINDIVERT_FILTER_DEPTH_NETWORK},
+    {"ip.TTL > 32 and ip.DstAddr == 10.0.0.2",
+                                        WINDIVERT_FILTER_DEPTH_NETWORK},
+    {"ipv6.SrcAddr == fe80::1",         WINDIVERT_FILTER_DEPTH_NETWORK},
+    {"ip.HdrLength > 5",                WINDIVERT_FILTER_DEPTH_NETWORK},
+    {"tcp",                             WINDIVERT_FILTER_DEPTH_TRANSPORT},
+    {"icmp or icmpv6",                  WINDIVERT_FILTER_DEPTH_TRANSPORT},
+    {"udp.DstPort == 53",               WINDIVERT_FILTER_DEPTH_TRANSPORT},
+    {"outbound or tcp.Syn",             WINDIVERT_FILTER_DEPTH_TRANSPORT},
+    {"ip and (inbound or udp)",         WINDIVERT_FILTER_DEPTH_TRANSPORT},
+    {"tcp.Payload[0:4] == \"GET \"",    WINDIVERT_FILTER_DEPTH_TRANSPORT},
+    {"udp.Payload contains {\"dns\"}",  WINDIVERT_FILTER_DEPTH_TRANSPORT},
+};
+#define NUM_FILTERS     (sizeof(filters) / sizeof(filters[0]))
+
+/*
+ * Compile a filter into a (malloc'ed) filter_t.
+ */
+static filter_t Compile(const char *filter_str)
+{
+    PWINDIVERT_FILTER_OBJECT object;
+    filter_t filter;
+    UINT object_len;
+
+    object = WinDivertCompileFilterObject(filter_str,
+        WINDIVERT_LAYER_NETWORK, &object_len);
+    if (object == NULL)
+    {
+        return NULL;
+    }
+    filter = WinDivertLoadFilter(object);
+    free(object);
+    return filter;
+}
+
+/*
+ * Insert opt_len bytes of IPv4 options (NOPs) after the IPv4 header.
+ */
+static UINT AddOptions(UINT8 *packet, UINT packet_len, UINT opt_len)
+{
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    UINT hdr_len = sizeof(WINDIVERT_IPHDR);
+
+    memmove(packet + hdr_len + opt_len, packet + hdr_len,
+        packet_len - hdr_len);
+    memset(packet + hdr_len, 0x01, opt_len);
+    packet_len += opt_len;
+    ip_header->HdrLength = (UINT8)((hdr_len + opt_len) / sizeof(UINT32));
+    ip_header->Length    = htons((UINT16)packet_len);
+    WinDivertHelperCalcChecksums(packet, packet_len, 0);
+    return packet_len;
+}
+
+/*
+ * A random packet: IPv4 (maybe with options or fragmented) or IPv6,
+ * TCP/UDP/ICMP, and sometimes malformed.
+ */
+static UINT RandomPacket(UINT8 *packet)
+{
+    static const char *payloads[] = {"", "GET /", "dns", "x"};
+    static const UINT8 protocols[] = {IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP};
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_TCPHDR tcp_header;
+    BOOL ipv6 = (TestRandom() % 3 == 0);
+    UINT8 protocol = protocols[TestRandom() % 3];
+    UINT packet_len, ip_len;
+
+    if (ipv6 && protocol == IPPROTO_ICMP)
+    {
+        protocol = IPPROTO_ICMPV6;
+    }
+    packet_len = TestPacket(packet, ipv6, protocol, 1000,
+        (TestRandom() % 2 == 0? 53: 80), payloads[TestRandom() % 4]);
+    ip_len = (ipv6? sizeof(WINDIVERT_IPV6HDR): sizeof(WINDIVERT_IPHDR));
+    if (!ipv6)
+    {
+        ip_header->TTL = (UINT8)TestRandom();
+        if (TestRandom() % 4 == 0)
+        {
+            ip_len += 4 * (1 + TestRandom() % 10);
+            packet_len = AddOptions(packet, packet_len,
+                ip_len - sizeof(WINDIVERT_IPHDR));
+        }
+        if (TestRandom() % 8 == 0)
+        {
+            ip_header->FragOff0 = htons(1 + TestRandom() % 100);
+        }
+    }
+    if (protocol == IPPROTO_TCP)
+    {
+        tcp_header = (PWINDIVERT_TCPHDR)(packet + ip_len);
+        tcp_header->Syn = TestRandom() % 2;
+        if (TestRandom() % 8 == 0)
+        {
+            tcp_header->HdrLength = 15;     // Beyond the packet
+        }
+    }
+    if (TestRandom() % 8 == 0)
+    {
+        packet_len = TestRandom() % packet_len;
+    }
+    return packet_len;
+}
+
+int main(void)
+{
+    struct windivert_headers_s headers;
+    filter_t compiled[NUM_FILTERS];
+    WINDIVERT_PACKET packet;
+    UINT8 data[256];
+    UINT i, j;
+    BOOL full, outbound, expected, result;
+
+    // The depth each filter needs:
+    for (i = 0; i < NUM_FILTERS; i++)
+    {
+        compiled[i] = Compile(filters[i].filter);
+        CHECK(compiled[i] != NULL);
+        if (compiled[i] == NULL)
+        {
+            return TestResult("test_depth");
+        }
+        CHECK(compiled[i][0].depth == filters[i].depth);
+    }
+
+    // The header bytes fetched for each depth:
+    packet.data = data;
+    packet.len  = TestPacket(data, FALSE, IPPROTO_TCP, 1, 2,
+        "a payload that is longer than the IPv4 options");
+    CHECK(windivert_parse_headers(&packet, WINDIVERT_FILTER_DEPTH_NONE,
+        &headers) && headers.cpy_len == 0 && headers.ip_header == NULL);
+    CHECK(windivert_parse_headers(&packet, WINDIVERT_FILTER_DEPTH_NETWORK,
+        &headers) && headers.cpy_len == sizeof(WINDIVERT_IPV6HDR) &&
+        headers.ip_header != NULL && headers.tcp_header == NULL);
+    CHECK(windivert_parse_headers(&packet, WINDIVERT_FILTER_DEPTH_TRANSPORT,
+        &headers) && headers.cpy_len == sizeof(WINDIVERT_IPV6HDR) +
+        sizeof(WINDIVERT_TCPHDR) && headers.tcp_header != NULL);
+    packet.len = AddOptions(data, (UINT)packet.len, 40);
+    CHECK(windivert_parse_headers(&packet, WINDIVERT_FILTER_DEPTH_TRANSPORT,
+        &headers) && headers.cpy_len == 60 + sizeof(WINDIVERT_TCPHDR) &&
+        headers.tcp_header != NULL &&
+        ntohs(headers.tcp_header->DstPort) == 2);
+    packet.len = TestPacket(data, TRUE, IPPROTO_UDP, 1, 2, "");
+    CHECK(windivert_parse_headers(&packet, WINDIVERT_FILTER_DEPTH_TRANSPORT,
+        &headers) && headers.cpy_len == packet.len &&
+        headers.udp_header != NULL);
+
+    // A bad transport header only fails filters that need it:
+    packet.len = TestPacket(data, FALSE, IPPROTO_TCP, 1, 2, "");
+    ((PWINDIVERT_TCPHDR)(data + sizeof(WINDIVERT_IPHDR)))->HdrLength = 15;
+    CHECK(windivert_parse_headers(&packet, WINDIVERT_FILTER_DEPTH_NETWORK,
+        &headers));
+    CHECK(!windivert_parse_headers(&packet,
+        WINDIVERT_FILTER_DEPTH_TRANSPORT, &headers));
+
+    // Filtering at the filter's depth agrees with fully parsed headers
+    // (whenever the packet can be fully parsed):
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        packet.len = RandomPacket(data);
+        outbound   = TestRandom() % 2;
+        full = windivert_parse_headers(&packet,
+            WINDIVERT_FILTER_DEPTH_TRANSPORT, &headers);
+        for (j = 0; j < NUM_FILTERS; j++)
+        {
+            result = windivert_filter(&packet, 1, 0, outbound, compiled[j],
+                NULL);
+            if (full)
+            {
+                expected = windivert_filter_exec(&packet, &headers, 1, 0,
+                    outbound, compiled[j]);
+                CHECK(result == expected);
+            }
+            else if (compiled[j][0].depth ==
+                        WINDIVERT_FILTER_DEPTH_TRANSPORT)
+            {
+                CHECK(!result);
+            }
+        }
+    }
+
+    for (i = 0; i < NUM_FILTERS; i++)
+    {
+        free(compiled[i]);
+    }
+    return TestResult("test_depth");
+}
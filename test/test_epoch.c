@@ -0,0 +1,271 @@
+/*
+ * test_epoch.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the filter replacement used by WinDivertSetFilter() and by a
+ * handle reset (windivert_filter_swap(), windivert_filter_enter() and
+ * windivert_filter_exit()): a swap waits for readers of the old filter, and
+ * under concurrent readers no reader ever sees a filter after it has been
+ * retired.  A reset swaps in no filter (so packets are rejected) until the
+ * handle is re-used with a new filter.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_READERS     4
+#define NUM_SWAPS       20000
+#define NUM_RESETS      5000
+#define FILTER_LIVE     0x4C495645
+#define FILTER_DEAD     0x44454144
+
+static struct windivert_filter_ref_s ref;
+static volatile LONG stop = FALSE;
+static volatile LONG reads = 0;
+static volatile LONG stale = 0;
+static volatile LONG nulls = 0;
+static volatile LONG swapped = FALSE;
+static filter_t swap_filter, swap_result;
+
+/*
+ * Repeatedly use the current filter, checking it is not retired.
+ */
+static DWORD WINAPI Reader(LPVOID arg)
+{
+    filter_t filter;
+    LONG epoch;
+    UINT i, n = 0;
+
+    while (!stop)
+    {
+        filter = windivert_filter_enter(&ref, &epoch);
+        for (i = 0; i < 4; i++)
+        {
+            if (filter == NULL)
+            {
+                InterlockedIncrement(&nulls);
+            }
+            else if (filter[0].arg[0] != FILTER_LIVE)
+            {
+                InterlockedIncrement(&stale);
+            }
+            if (i == 1 && ++n % 16 == 0)
+            {
+                YieldProcessor();
+            }
+        }
+        windivert_filter_exit(&ref, epoch);
+        InterlockedIncrement(&reads);
+    }
+    return 0;
+}
+
+/*
+ * Swap in swap_filter (from another thread); NULL resets.
+ */
+static DWORD WINAPI Swapper(LPVOID arg)
+{
+    swap_result = windivert_filter_swap(&ref, swap_filter);
+    InterlockedExchange(&swapped, TRUE);
+    return 0;
+}
+
+static filter_t NewFilter(void)
+{
+    filter_t filter = (filter_t)calloc(1, sizeof(struct filter_s));
+
+    if (filter != NULL)
+    {
+        filter[0].arg[0] = FILTER_LIVE;
+    }
+    return filter;
+}
+
+int main(void)
+{
+    static filter_t filters[NUM_SWAPS+1];
+    HANDLE threads[NUM_READERS], thread;
+    filter_t filter, old_filter;
+    LONG epoch, epoch2, null_reads;
+    UINT i;
+
+    for (i = 0; i <= NUM_SWAPS; i++)
+    {
+        filters[i] = NewFilter();
+        if (filters[i] == NULL)
+        {
+            CHECK(filters[i] != NULL);
+            return TestResult("test_epoch");
+        }
+    }
+
+    // Single thread:
+    windivert_filter_ref_init(&ref, filters[0]);
+    filter = windivert_filter_enter(&ref, &epoch);
+    CHECK(filter == filters[0] && epoch == 0 && ref.readers[0] == 1);
+    filter = windivert_filter_enter(&ref, &epoch2);
+    CHECK(filter == filters[0] && epoch2 == 0 && ref.readers[0] == 2);
+    windivert_filter_exit(&ref, epoch2);
+    windivert_filter_exit(&ref, epoch);
+    CHECK(ref.readers[0] == 0 && ref.readers[1] == 0);
+    old_filter = windivert_filter_swap(&ref, filters[1]);
+    CHECK(old_filter == filters[0] && ref.epoch == 1);
+    filter = windivert_filter_enter(&ref, &epoch);
+    CHECK(filter == filters[1] && epoch == 1 && ref.readers[1] == 1);
+    windivert_filter_exit(&ref, epoch);
+
+    // A swap waits for a reader of the old filter:
+    filter = windivert_filter_enter(&ref, &epoch);
+    swap_filter = filters[2];
+    thread = CreateThread(NULL, 0, Swapper, NULL, 0, NULL);
+    CHECK(thread != NULL);
+    if (thread == NULL)
+    {
+        return TestResult("test_epoch");
+    }
+    while (ref.epoch == epoch)
+    {
+        YieldProcessor();
+    }
+    Sleep(50);
+    CHECK(!swapped);
+
+    // ... but a new reader already gets the new filter:
+    CHECK(windivert_filter_enter(&ref, &epoch2) == filters[2]);
+    windivert_filter_exit(&ref, epoch2);
+    CHECK(!swapped);
+    windivert_filter_exit(&ref, epoch);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    CHECK(swapped && swap_result == filters[1]);
+
+    // A reset also waits for a reader of the old filter, after which
+    // readers see no filter (and so reject every packet):
+    filter = windivert_filter_enter(&ref, &epoch);
+    swap_filter = NULL;
+    InterlockedExchange(&swapped, FALSE);
+    thread = CreateThread(NULL, 0, Swapper, NULL, 0, NULL);
+    CHECK(thread != NULL);
+    if (thread == NULL)
+    {
+        return TestResult("test_epoch");
+    }
+    while (ref.epoch == epoch)
+    {
+        YieldProcessor();
+    }
+    Sleep(50);
+    CHECK(!swapped);
+    CHECK(windivert_filter_enter(&ref, &epoch2) == NULL);
+    windivert_filter_exit(&ref, epoch2);
+    windivert_filter_exit(&ref, epoch);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    CHECK(swapped && swap_result == filters[2]);
+
+    // ... until the handle is re-used with a new filter:
+    CHECK(windivert_filter_swap(&ref, filters[3]) == NULL);
+    CHECK(windivert_filter_enter(&ref, &epoch) == filters[3]);
+    windivert_filter_exit(&ref, epoch);
+    CHECK(ref.readers[0] == 0 && ref.readers[1] == 0);
+
+    // Concurrent readers; retired filters are marked dead (not freed, so
+    // that a stale read is detected rather than undefined):
+    windivert_filter_ref_init(&ref, filters[0]);
+    for (i = 0; i < NUM_READERS; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, Reader, NULL, 0, NULL);
+        CHECK(threads[i] != NULL);
+        if (threads[i] == NULL)
+        {
+            return TestResult("test_epoch");
+        }
+    }
+    for (i = 1; i <= NUM_SWAPS; i++)
+    {
+        // Let the readers keep up:
+        while (reads < (LONG)i)
+        {
+            YieldProcessor();
+        }
+        old_filter = windivert_filter_swap(&ref, filters[i]);
+        CHECK(old_filter == filters[i-1]);
+        old_filter[0].arg[0] = FILTER_DEAD;
+    }
+    InterlockedExchange(&stop, TRUE);
+    WaitForMultipleObjects(NUM_READERS, threads, TRUE, INFINITE);
+    for (i = 0; i < NUM_READERS; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+    CHECK(stale == 0 && nulls == 0);
+    CHECK(reads >= NUM_SWAPS);
+    CHECK(ref.epoch == NUM_SWAPS);
+    CHECK(ref.readers[0] == 0 && ref.readers[1] == 0);
+
+    // Concurrent readers across handle resets and re-use:
+    for (i = 0; i <= NUM_RESETS; i++)
+    {
+        filters[i][0].arg[0] = FILTER_LIVE;
+    }
+    windivert_filter_ref_init(&ref, filters[0]);
+    InterlockedExchange(&stop, FALSE);
+    InterlockedExchange(&reads, 0);
+    for (i = 0; i < NUM_READERS; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, Reader, NULL, 0, NULL);
+        CHECK(threads[i] != NULL);
+        if (threads[i] == NULL)
+        {
+            return TestResult("test_epoch");
+        }
+    }
+    for (i = 1; i <= NUM_RESETS; i++)
+    {
+        while (reads < (LONG)i)
+        {
+            YieldProcessor();
+        }
+        null_reads = nulls;
+        old_filter = windivert_filter_swap(&ref, NULL);
+        CHECK(old_filter == filters[i-1]);
+        old_filter[0].arg[0] = FILTER_DEAD;
+
+        // Wait until a reader has seen the reset:
+        while (nulls == null_reads)
+        {
+            YieldProcessor();
+        }
+        CHECK(windivert_filter_swap(&ref, filters[i]) == NULL);
+    }
+    InterlockedExchange(&stop, TRUE);
+    WaitForMultipleObjects(NUM_READERS, threads, TRUE, INFINITE);
+    for (i = 0; i < NUM_READERS; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+    CHECK(stale == 0 && nulls >= NUM_RESETS);
+    CHECK(ref.epoch == 2 * NUM_RESETS);
+    CHECK(ref.readers[0] == 0 && ref.readers[1] == 0);
+
+    for (i = 0; i <= NUM_SWAPS; i++)
+    {
+        free(filters[i]);
+    }
+    return TestResult("test_epoch");
+}
@@ -0,0 +1,213 @@
+/*
+ * test_filter.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the filter compiler and interpreter (WinDivertHelperEvalFilter())
+ * against the expected verdicts for a set of packets.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_PACKETS     7
+
+static UINT8 packets[NUM_PACKETS][256];
+static UINT packet_lens[NUM_PACKETS];
+
+/*
+ * Each filter's expected verdict for each packet ('1' = match).
+ */
+static const struct
+{
+    const char *filter;
+    const char *verdicts;
+} tests[] =
+{
+    {"true",                                        "1111111"},
+    {"false",                                       "0000000"},
+    {"outbound",                                    "1111111"},
+    {"inbound",                                     "0000000"},
+    {"ifIdx == 3 and subIfIdx == 1",                "1111111"},
+    {"ifIdx != 3",                                  "0000000"},
+    {"ip",                                          "1101010"},
+    {"ipv6",                                        "0010100"},
+    {"tcp",                                         "1100000"},
+    {"udp",                                         "0010000"},
+    {"icmp",                                        "0001000"},
+    {"icmpv6",                                      "0000100"},
+    {"not tcp",                                     "0011110"},
+    {"tcp.DstPort == 80",                           "1100000"},
+    {"tcp.Syn",                                     "1000000"},
+    {"tcp.Syn and tcp.DstPort < 1024",              "1000000"},
+    {"tcp.PayloadLength > 0",                       "0100000"},
+    {"udp.DstPort == 53 or icmp",                   "0011000"},
+    {"(tcp or udp) and ip.TTL == 64",               "1100000"},
+    {"ip.SrcAddr == 10.0.0.1",                      "1101010"},
+    {"ip.DstAddr == 10.0.0.1",                      "0000000"},
+    {"ipv6.SrcAddr == fe80::1",                     "0010100"},
+    {"ipv6.DstAddr > fe80::1 and ipv6.DstAddr < fe80::1:0", "0010100"},
+    {"ip.Protocol == 17",                           "0000010"},
+    {"ip.FragOff > 0",                              "0000010"},
+    {"icmp.Type == 8",                              "0001000"},
+    {"icmpv6.Type == 128",                          "0000100"},
+    {"tcp.Payload[0:4] == \"GET \"",                "0100000"},
+    {"tcp.Payload[0:4] == \"POST\"",                "0000000"},
+    {"udp.Payload[0] == 0x64",                      "0010000"},
+    {"tcp.Payload contains {\"Host: example.com\"}", "0100000"},
+    {"tcp.Payload contains {\"Host: example.org\", \"HTTP/1.1\"}",
+                                                    "0100000"},
+    {"tcp.Payload contains {\"Host: example.org\"}", "0000000"},
+};
+
+/*
+ * Build the test packets:
+ * 0: IPv4 TCP SYN 1234 -> 80
+ * 1: IPv4 TCP ACK+PSH 1234 -> 80 (HTTP request)
+ * 2: IPv6 UDP 5353 -> 53
+ * 3: IPv4 ICMP echo request
+ * 4: IPv6 ICMPv6 echo request
+ * 5: IPv4 UDP (non-first fragment)
+ * 6: IPv4 TCP with a bad length
+ */
+static void BuildPackets(void)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_ICMPHDR icmp_header;
+    PWINDIVERT_ICMPV6HDR icmpv6_header;
+
+    packet_lens[0] = TestPacket(packets[0], FALSE, IPPROTO_TCP, 1234, 80,
+        "");
+    tcp_header = (PWINDIVERT_TCPHDR)(packets[0] + sizeof(WINDIVERT_IPHDR));
+    tcp_header->Syn = 1;
+
+    packet_lens[1] = TestPacket(packets[1], FALSE, IPPROTO_TCP, 1234, 80,
+        "GET /index.html HTTP/1.1\r\nHost: example.com\r\n\r\n");
+    tcp_header = (PWINDIVERT_TCPHDR)(packets[1] + sizeof(WINDIVERT_IPHDR));
+    tcp_header->Ack = 1;
+    tcp_header->Psh = 1;
+
+    packet_lens[2] = TestPacket(packets[2], TRUE, IPPROTO_UDP, 5353, 53,
+        "dns");
+
+    packet_lens[3] = TestPacket(packets[3], FALSE, IPPROTO_ICMP, 0, 0,
+        "ping");
+    icmp_header = (PWINDIVERT_ICMPHDR)(packets[3] + sizeof(WINDIVERT_IPHDR));
+    icmp_header->Type = 8;
+
+    packet_lens[4] = TestPacket(packets[4], TRUE, IPPROTO_ICMPV6, 0, 0,
+        "ping");
+    icmpv6_header =
+        (PWINDIVERT_ICMPV6HDR)(packets[4] + sizeof(WINDIVERT_IPV6HDR));
+    icmpv6_header->Type = 128;
+
+    packet_lens[5] = TestPacket(packets[5], FALSE, IPPROTO_UDP, 1000, 2000,
+        "fragment");
+    ip_header = (PWINDIVERT_IPHDR)packets[5];
+    ip_header->FragOff0 = htons(100);
+
+    packet_lens[6] = TestPacket(packets[6], FALSE, IPPROTO_TCP, 1234, 80,
+        "data");
+    ip_header = (PWINDIVERT_IPHDR)packets[6];
+    ip_header->Length = htons(packet_lens[6] + 1);
+}
+
+/*
+ * Compile and evaluate a filter; returns -1 if the filter is invalid.
+ */
+static int Eval(const char *filter, UINT8 *packet, UINT packet_len,
+    PWINDIVERT_ADDRESS addr)
+{
+    static UINT8 object[sizeof(WINDIVERT_FILTER_OBJECT) +
+        WINDIVERT_FILTER_MAXLEN*sizeof(struct windivert_ioctl_filter_s) +
+        WINDIVERT_FILTER_AUTOMATA_MAXLEN];
+    HANDLE handle;
+    UINT object_len;
+    BOOL result;
+
+    if (!WinDivertFilterCompile(filter, WINDIVERT_LAYER_NETWORK, object,
+            sizeof(object), &object_len))
+    {
+        return -1;
+    }
+    handle = WinDivertHelperFilterOpen(object, object_len);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        return -1;
+    }
+    result = WinDivertHelperEvalFilter(handle, packet, packet_len, addr);
+    WinDivertHelperFilterClose(handle);
+    return (result? 1: 0);
+}
+
+int main(void)
+{
+    WINDIVERT_ADDRESS addr;
+    UINT i, j;
+    int result;
+
+    BuildPackets();
+    addr.IfIdx     = 3;
+    addr.SubIfIdx  = 1;
+    addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        for (j = 0; j < NUM_PACKETS; j++)
+        {
+            result = Eval(tests[i].filter, packets[j], packet_lens[j], &addr);
+            CHECK(result == tests[i].verdicts[j] - '0');
+            if (result != tests[i].verdicts[j] - '0')
+            {
+                fprintf(stderr, "\tfilter \"%s\", packet %u: %d\n",
+                    tests[i].filter, j, result);
+            }
+        }
+    }
+
+    // Direction and interface come from the address:
+    addr.Direction = WINDIVERT_DIRECTION_INBOUND;
+    CHECK(Eval("inbound and tcp", packets[0], packet_lens[0], &addr) == 1);
+    CHECK(Eval("outbound", packets[0], packet_lens[0], &addr) == 0);
+    addr.IfIdx = 4;
+    CHECK(Eval("ifIdx == 4", packets[0], packet_lens[0], &addr) == 1);
+
+    // Invalid filters and arguments:
+    CHECK(Eval("tcp.DstPort ==", packets[0], packet_lens[0], &addr) == -1);
+    CHECK(Eval("tcp.NoSuchField", packets[0], packet_lens[0], &addr) == -1);
+
+    // Payload literals must fit the field width:
+    CHECK(Eval("tcp.Payload[0] == 0x100", packets[1], packet_lens[1],
+        &addr) == -1);
+    CHECK(Eval("tcp.Payload[0:2] == 0x10000", packets[1], packet_lens[1],
+        &addr) == -1);
+    CHECK(Eval("tcp.Payload[0:2] == \"GET\"", packets[1], packet_lens[1],
+        &addr) == -1);
+    CHECK(Eval("tcp.Payload[0:5] == 0x100000000", packets[1],
+        packet_lens[1], &addr) == 0);
+    CHECK(Eval("tcp.Payload[0:2] == 0x4745", packets[1], packet_lens[1],
+        &addr) == 1);
+    CHECK(Eval("tcp.Payload[0:3] == \"GET\"", packets[1], packet_lens[1],
+        &addr) == 1);
+
+    CHECK(WinDivertHelperFilterOpen(NULL, 0) == INVALID_HANDLE_VALUE);
+    CHECK(!WinDivertHelperEvalFilter(INVALID_HANDLE_VALUE, packets[0],
+        packet_lens[0], &addr));
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+
+    return TestResult("test_filter");
+}
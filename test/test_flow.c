@@ -0,0 +1,337 @@
+/*
+ * test_flow.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the flow table helpers (WinDivertHelperFlowLookup() etc.) against
+ * a simple model, under random lookups, removals and idle expiry (the
+ * clock is advanced with the shim's shim_tick_offset).
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define MAX_POOL        8192
+#define TIMEOUT         1000
+#define SLACK           50          // Clock slack (ms) of the model
+
+/*
+ * A flow of the pool, and the model's view of it.
+ */
+typedef struct
+{
+    BOOL ipv6;
+    UINT8 protocol;
+    UINT32 addr[2];
+    UINT16 port[2];
+    BOOL present;                   // In the table?
+    BOOL reverse;                   // First packet was addr[1] -> addr[0]?
+    UINT64 last;                    // Last lookup
+} FLOW;
+
+static FLOW pool[MAX_POOL];
+
+/*
+ * A packet of the flow, from endpoint dir to endpoint 1-dir.
+ */
+static UINT FlowPacket(UINT8 *packet, const FLOW *flow, UINT dir)
+{
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+    UINT packet_len;
+
+    packet_len = TestPacket(packet, flow->ipv6, flow->protocol,
+        flow->port[dir], flow->port[1-dir], "data");
+    if (flow->ipv6)
+    {
+        ipv6_header->SrcAddr[3] = flow->addr[dir];
+        ipv6_header->DstAddr[3] = flow->addr[1-dir];
+    }
+    else
+    {
+        ip_header->SrcAddr = flow->addr[dir];
+        ip_header->DstAddr = flow->addr[1-dir];
+    }
+    return packet_len;
+}
+
+/*
+ * Fill the pool with distinct flows (each has its own first address).  Some
+ * flows have the same address at both ends, so that the ports decide the
+ * direction.
+ */
+static void FillPool(UINT pool_size)
+{
+    static const UINT8 protocols[] = {IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP};
+    FLOW *flow;
+    UINT i;
+
+    for (i = 0; i < pool_size; i++)
+    {
+        flow = pool + i;
+        flow->ipv6     = (i % 4 == 3);
+        flow->protocol = protocols[i % 3];
+        if (flow->ipv6 && flow->protocol == IPPROTO_ICMP)
+        {
+            flow->protocol = IPPROTO_ICMPV6;
+        }
+        flow->addr[0]  = htonl(0x0A000000u | i);
+        flow->addr[1]  = htonl(0x0A010000u | i % 3);
+        if (flow->protocol == IPPROTO_TCP || flow->protocol == IPPROTO_UDP)
+        {
+            flow->port[0] = (UINT16)(1000 + i % 7);
+            flow->port[1] = 80;
+            if (i % 5 == 4)
+            {
+                flow->addr[1] = flow->addr[0];
+            }
+        }
+        else
+        {
+            flow->port[0] = flow->port[1] = 0;
+        }
+        flow->present  = FALSE;
+    }
+}
+
+/*
+ * Look up a flow, checking the result against the model.
+ */
+static void Lookup(HANDLE table, UINT id, BOOL create, UINT *count,
+    UINT max_flows)
+{
+    FLOW *flow = pool + id;
+    UINT8 packet[256];
+    UINT packet_len, dir = TestRandom() % 2;
+    UINT32 *data;
+    BOOL reverse = 2;
+
+    packet_len = FlowPacket(packet, flow, dir);
+    data = (UINT32 *)WinDivertHelperFlowLookup(table, packet, packet_len,
+        (create? WINDIVERT_FLOW_CREATE: 0), &reverse);
+    if (flow->present)
+    {
+        CHECK(data != NULL && data[0] == id + 1);
+        CHECK(reverse == (dir != (UINT)flow->reverse));
+        flow->last = GetTickCount64();
+    }
+    else if (!create)
+    {
+        CHECK(data == NULL && GetLastError() == ERROR_NOT_FOUND);
+    }
+    else if (*count == max_flows)
+    {
+        CHECK(data == NULL && GetLastError() == ERROR_NOT_ENOUGH_MEMORY);
+    }
+    else
+    {
+        CHECK(data != NULL && data[0] == 0 && data[1] == 0 && !reverse);
+        if (data != NULL)
+        {
+            data[0] = id + 1;
+            data[1] = 0;
+            flow->present = TRUE;
+            flow->reverse = (BOOL)dir;
+            flow->last    = GetTickCount64();
+            (*count)++;
+        }
+    }
+}
+
+/*
+ * Random operations against the model.
+ */
+static void RunModel(UINT max_flows, UINT pool_size, UINT steps)
+{
+    HANDLE table;
+    UINT8 packet[256];
+    UINT32 *data;
+    UINT count = 0, id, i, j;
+    UINT64 now, idle;
+
+    FillPool(pool_size);
+    table = WinDivertHelperFlowTableCreate(max_flows, 2 * sizeof(UINT32),
+        TIMEOUT);
+    CHECK(table != INVALID_HANDLE_VALUE);
+    if (table == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+    for (i = 0; i < steps; i++)
+    {
+        id = TestRandom() % pool_size;
+        switch (TestRandom() % 16)
+        {
+            case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7:
+                Lookup(table, id, TRUE, &count, max_flows);
+                break;
+            case 8: case 9: case 10:
+                Lookup(table, id, FALSE, &count, max_flows);
+                break;
+            case 11: case 12:
+                if (!pool[id].present)
+                {
+                    break;
+                }
+                data = (UINT32 *)WinDivertHelperFlowLookup(table, packet,
+                    FlowPacket(packet, pool + id, 0), 0, NULL);
+                CHECK(data != NULL && WinDivertHelperFlowRemove(table, data));
+                CHECK(!WinDivertHelperFlowRemove(table, data));
+                pool[id].present = FALSE;
+                count--;
+                break;
+            case 13:
+                shim_tick_offset += TestRandom() % (TIMEOUT / 2);
+                break;
+            default:
+                CHECK(WinDivertHelperFlowTableExpire(table));
+                now = GetTickCount64();
+                for (j = 0; j < pool_size; j++)
+                {
+                    if (!pool[j].present)
+                    {
+                        continue;
+                    }
+                    idle = now - pool[j].last;
+                    data = (UINT32 *)WinDivertHelperFlowLookup(table,
+                        packet, FlowPacket(packet, pool + j, 0), 0, NULL);
+                    if (idle + SLACK < TIMEOUT)
+                    {
+                        CHECK(data != NULL && data[0] == j + 1);
+                    }
+                    else if (idle >= TIMEOUT + TIMEOUT / 64 + SLACK)
+                    {
+                        CHECK(data == NULL);
+                    }
+                    if (data == NULL)
+                    {
+                        pool[j].present = FALSE;
+                        count--;
+                    }
+                    else
+                    {
+                        pool[j].last = GetTickCount64();
+                    }
+                }
+                break;
+        }
+    }
+    CHECK(WinDivertHelperFlowTableDestroy(table));
+}
+
+int main(void)
+{
+    HANDLE table;
+    UINT8 packet[256];
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    UINT32 *data, *data2;
+    UINT packet_len, i;
+    BOOL reverse;
+
+    // Invalid arguments:
+    CHECK(WinDivertHelperFlowTableCreate(0, 8, TIMEOUT) ==
+        INVALID_HANDLE_VALUE);
+    CHECK(WinDivertHelperFlowTableCreate(8, WINDIVERT_FLOW_TABLE_MAX_DATA + 1,
+        TIMEOUT) == INVALID_HANDLE_VALUE);
+    CHECK(WinDivertHelperFlowTableCreate(8, 8, 0) == INVALID_HANDLE_VALUE);
+    CHECK(!WinDivertHelperFlowTableExpire(INVALID_HANDLE_VALUE));
+    CHECK(!WinDivertHelperFlowTableDestroy(NULL));
+
+    table = WinDivertHelperFlowTableCreate(2, 8, TIMEOUT);
+    CHECK(table != INVALID_HANDLE_VALUE);
+    if (table == INVALID_HANDLE_VALUE)
+    {
+        return TestResult("test_flow");
+    }
+    FillPool(4);
+    packet_len = FlowPacket(packet, pool, 0);
+    CHECK(WinDivertHelperFlowLookup(table, packet, packet_len, 0x2, NULL) ==
+        NULL && GetLastError() == ERROR_INVALID_PARAMETER);
+    CHECK(WinDivertHelperFlowLookup(table, packet, 10, WINDIVERT_FLOW_CREATE,
+        NULL) == NULL && GetLastError() == ERROR_INVALID_PARAMETER);
+
+    // Both directions find the same flow:
+    data = (UINT32 *)WinDivertHelperFlowLookup(table, packet, packet_len,
+        WINDIVERT_FLOW_CREATE, &reverse);
+    CHECK(data != NULL && !reverse);
+    packet_len = FlowPacket(packet, pool, 1);
+    data2 = (UINT32 *)WinDivertHelperFlowLookup(table, packet, packet_len, 0,
+        &reverse);
+    CHECK(data2 == data && reverse);
+
+    // The fragments of a datagram share a flow:
+    pool[1].protocol = IPPROTO_UDP;
+    pool[1].ipv6     = FALSE;
+    packet_len = FlowPacket(packet, pool + 1, 0);
+    ip_header->FragOff0 = htons(0x2000);
+    data = (UINT32 *)WinDivertHelperFlowLookup(table, packet, packet_len,
+        WINDIVERT_FLOW_CREATE, NULL);
+    ip_header->FragOff0 = htons(100);
+    CHECK(data != NULL && WinDivertHelperFlowLookup(table, packet,
+        packet_len, 0, NULL) == data);
+
+    // Full table; a removal makes room:
+    packet_len = FlowPacket(packet, pool + 2, 0);
+    CHECK(WinDivertHelperFlowLookup(table, packet, packet_len,
+        WINDIVERT_FLOW_CREATE, NULL) == NULL &&
+        GetLastError() == ERROR_NOT_ENOUGH_MEMORY);
+    CHECK(WinDivertHelperFlowRemove(table, data));
+    CHECK(WinDivertHelperFlowLookup(table, packet, packet_len,
+        WINDIVERT_FLOW_CREATE, NULL) != NULL);
+    CHECK(!WinDivertHelperFlowRemove(table, (UINT8 *)data + 1));
+    CHECK(!WinDivertHelperFlowRemove(table, packet));
+
+    // Idle flows expire (only) after the timeout:
+    shim_tick_offset += TIMEOUT / 2;
+    CHECK(WinDivertHelperFlowTableExpire(table));
+    CHECK(WinDivertHelperFlowLookup(table, packet, packet_len, 0, NULL) !=
+        NULL);
+    shim_tick_offset += TIMEOUT + TIMEOUT / 2;
+    CHECK(WinDivertHelperFlowTableExpire(table));
+    CHECK(WinDivertHelperFlowLookup(table, packet, packet_len, 0, NULL) ==
+        NULL);
+    packet_len = FlowPacket(packet, pool, 0);
+    CHECK(WinDivertHelperFlowLookup(table, packet, packet_len, 0, NULL) ==
+        NULL);
+    CHECK(WinDivertHelperFlowTableDestroy(table));
+
+    // Random operations, with small and large tables:
+    RunModel(16, 64, 20000);
+    RunModel(128, 512, 50000);
+    RunModel(4096, MAX_POOL, 100000);
+
+    // A long idle period (more than a turn of the timer wheel):
+    table = WinDivertHelperFlowTableCreate(64, 8, TIMEOUT);
+    FillPool(64);
+    for (i = 0; i < 64; i++)
+    {
+        packet_len = FlowPacket(packet, pool + i, 0);
+        CHECK(WinDivertHelperFlowLookup(table, packet, packet_len,
+            WINDIVERT_FLOW_CREATE, NULL) != NULL);
+    }
+    shim_tick_offset += 100 * TIMEOUT;
+    CHECK(WinDivertHelperFlowTableExpire(table));
+    for (i = 0; i < 64; i++)
+    {
+        packet_len = FlowPacket(packet, pool + i, 0);
+        CHECK(WinDivertHelperFlowLookup(table, packet, packet_len, 0,
+            NULL) == NULL);
+    }
+    CHECK(WinDivertHelperFlowTableDestroy(table));
+
+    return TestResult("test_flow");
+}
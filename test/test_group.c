@@ -0,0 +1,207 @@
+/*
+ * test_group.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the grouping of re-injected packets (windivert_group_next(), as
+ * used by the driver's classify): a chain of packets from a few flows, in
+ * either direction, some of them diverted, is split into groups the way the
+ * driver builds its NET_BUFFER_LISTs.  Groups must end at a change of flow
+ * or direction, at a diverted packet, and at a packet that cannot be
+ * parsed, and nowhere else; and the groups must hold the re-injected
+ * packets in their original order.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_ROUNDS      2000
+#define CHAIN_MAX       200
+#define FLOWS_MAX       4
+
+static UINT8 data[CHAIN_MAX][128];
+static UINT packet_lens[CHAIN_MAX];
+static UINT flow_ids[CHAIN_MAX];                // (CHAIN_MAX = unparsable)
+static UINT8 directions[CHAIN_MAX];
+static BOOL diverted[CHAIN_MAX];
+
+/*
+ * The groups, as lists of packet indexes.
+ */
+static UINT groups[CHAIN_MAX][CHAIN_MAX];
+static UINT group_lens[CHAIN_MAX];
+static UINT num_groups;
+
+/*
+ * Re-inject the packets (of chain[0..count-1] that are not diverted) as
+ * the driver does.
+ */
+static void Classify(UINT count)
+{
+    struct windivert_group_s state;
+    WINDIVERT_PACKET packet;
+    UINT32 hash;
+    UINT i;
+
+    num_groups = 0;
+    windivert_group_init(&state);
+    for (i = 0; i < count; i++)
+    {
+        if (diverted[i])
+        {
+            windivert_group_close(&state);
+            continue;
+        }
+        packet.data = data[i];
+        packet.len  = packet_lens[i];
+        hash = windivert_hash_packet(&packet);
+        if (!windivert_group_next(&state, hash, directions[i]) ||
+            num_groups == 0)
+        {
+            group_lens[num_groups++] = 0;
+        }
+        groups[num_groups-1][group_lens[num_groups-1]++] = i;
+    }
+}
+
+/*
+ * Does packet i start a new group?
+ */
+static BOOL Boundary(UINT i)
+{
+    return (i == 0 || diverted[i-1] || flow_ids[i] == CHAIN_MAX ||
+        flow_ids[i] != flow_ids[i-1] || directions[i] != directions[i-1]);
+}
+
+/*
+ * A random chain of count packets.  Packets come in runs (like the segments
+ * of a large send) of random flows, with some runs reversed.
+ */
+static void RandomChain(UINT count, UINT num_flows)
+{
+    static const UINT8 protocols[] = {IPPROTO_TCP, IPPROTO_UDP};
+    UINT16 ports[FLOWS_MAX];
+    UINT8 flow_protocols[FLOWS_MAX];
+    BOOL ipv6[FLOWS_MAX], reverse = FALSE;
+    UINT i, j, run = 0, flow = 0;
+
+    for (j = 0; j < num_flows; j++)
+    {
+        ports[j] = (UINT16)(1000 + j);
+        flow_protocols[j] = protocols[TestRandom() % 2];
+        ipv6[j] = (TestRandom() % 2 == 0);
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (run == 0)
+        {
+            run  = 1 + TestRandom() % 50;
+            flow = TestRandom() % num_flows;
+            reverse = (TestRandom() % 4 == 0);
+        }
+        run--;
+        packet_lens[i] = TestPacket(data[i], ipv6[flow], flow_protocols[flow],
+            (reverse? 80: ports[flow]), (reverse? ports[flow]: 80),
+            (TestRandom() % 2 == 0? "segment": "a longer segment"));
+        flow_ids[i] = flow;
+        directions[i] = (UINT8)(reverse? WINDIVERT_DIRECTION_INBOUND:
+            WINDIVERT_DIRECTION_OUTBOUND);
+        if (TestRandom() % 40 == 0)
+        {
+            // Cannot be parsed:
+            packet_lens[i] = 10;
+            flow_ids[i] = CHAIN_MAX;
+        }
+        diverted[i] = (TestRandom() % 10 == 0);
+    }
+}
+
+int main(void)
+{
+    UINT round, count, num_flows, expected, next, i, j, k;
+    BOOL ok_order, ok_same, ok_boundary;
+
+    for (round = 0; round < NUM_ROUNDS; round++)
+    {
+        count = (round % 10 == 0? 0: 1 + TestRandom() % CHAIN_MAX);
+        num_flows = 1 + TestRandom() % FLOWS_MAX;
+        RandomChain(count, num_flows);
+        Classify(count);
+
+        // The groups, in order, are the re-injected packets, in order:
+        ok_order = ok_same = ok_boundary = TRUE;
+        next = 0;
+        expected = 0;
+        for (j = 0; j < num_groups; j++)
+        {
+            ok_order = ok_order && group_lens[j] > 0;
+            for (k = 0; k < group_lens[j]; k++)
+            {
+                i = groups[j][k];
+                while (next < count && diverted[next])
+                {
+                    next++;
+                }
+                ok_order = ok_order && i == next;
+                next++;
+
+                // Each group starts at a boundary, and has no boundary
+                // within:
+                ok_boundary = ok_boundary && (Boundary(i) == (k == 0));
+                ok_same = ok_same && flow_ids[i] == flow_ids[groups[j][0]] &&
+                    directions[i] == directions[groups[j][0]];
+            }
+        }
+        for (i = 0; i < count; i++)
+        {
+            expected += (!diverted[i] && Boundary(i));
+        }
+        while (next < count && diverted[next])
+        {
+            next++;
+        }
+        CHECK(ok_order && next == count);
+        CHECK(ok_same);
+        CHECK(ok_boundary);
+        CHECK(num_groups == expected);
+    }
+
+    // A large send of one flow is a single group:
+    RandomChain(40, 1);
+    for (i = 0; i < 40; i++)
+    {
+        packet_lens[i] = TestPacket(data[i], FALSE, IPPROTO_TCP, 1000, 80,
+            "segment");
+        flow_ids[i] = 0;
+        directions[i] = WINDIVERT_DIRECTION_OUTBOUND;
+        diverted[i] = FALSE;
+    }
+    Classify(40);
+    CHECK(num_groups == 1 && group_lens[0] == 40);
+
+    // ... and a diverted segment splits it in two:
+    diverted[20] = TRUE;
+    Classify(40);
+    CHECK(num_groups == 2 && group_lens[0] == 20 && group_lens[1] == 19);
+
+    // Both directions of a flow have the same hash, but are not grouped:
+    directions[30] = WINDIVERT_DIRECTION_INBOUND;
+    Classify(40);
+    CHECK(num_groups == 4);
+
+    return TestResult("test_group");
+}
@@ -0,0 +1,502 @@
+/*
+ * test_handle_pool.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Lifecycle of the handle pool (WinDivertPool*()), against a simulated
+ * driver that, like the real one, rejects an OPEN on a handle whose filter
+ * is on until the handle is RESET.  Checks acquiring idle handles, releasing
+ * them (with a RESET) for re-use, falling back to new handles when the pool
+ * is exhausted (and closing the extra handles on release), the failure
+ * paths, and that no handle is ever handed out twice when threads open and
+ * close handles concurrently.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define POOL_SIZE       4
+#define EXTRA           3
+#define MODEL_MAX       4096
+#define NUM_THREADS     8
+#define NUM_CYCLES      2000
+
+/*
+ * The simulated driver's state for each handle it has seen.
+ */
+typedef struct
+{
+    HANDLE handle;
+    BOOL filter_on;                             // OPEN without a RESET
+    UINT opens;
+    UINT resets;
+    UINT8 layer;
+} MODEL_ENTRY, *PMODEL_ENTRY;
+
+static volatile LONG lock = 0;
+static MODEL_ENTRY model[MODEL_MAX];
+static UINT model_len = 0;
+static volatile LONG bad = 0;                   // Requests that should not
+static BOOL fail_open = FALSE;                  // happen
+static BOOL fail_reset = FALSE;
+static volatile LONG open_failures = 0;
+
+static void Lock(void)
+{
+    while (InterlockedCompareExchange(&lock, 1, 0) != 0)
+    {
+        YieldProcessor();
+    }
+}
+
+static void Unlock(void)
+{
+    InterlockedExchange(&lock, 0);
+}
+
+/*
+ * The model entry for a handle (a new one starts with the filter off).
+ * Must hold the lock.
+ */
+static PMODEL_ENTRY ModelGet(HANDLE handle)
+{
+    UINT i;
+
+    for (i = 0; i < model_len; i++)
+    {
+        if (model[i].handle == handle)
+        {
+            return &model[i];
+        }
+    }
+    if (model_len >= MODEL_MAX)
+    {
+        return NULL;
+    }
+    memset(&model[model_len], 0, sizeof(model[model_len]));
+    model[model_len].handle = handle;
+    return &model[model_len++];
+}
+
+static MODEL_ENTRY ModelCopy(HANDLE handle)
+{
+    MODEL_ENTRY entry;
+    PMODEL_ENTRY e;
+
+    Lock();
+    e = ModelGet(handle);
+    if (e == NULL)
+    {
+        memset(&entry, 0, sizeof(entry));
+    }
+    else
+    {
+        entry = *e;
+    }
+    Unlock();
+    return entry;
+}
+
+static void ModelClear(void)
+{
+    Lock();
+    model_len = 0;
+    Unlock();
+    bad = 0;
+    fail_open = fail_reset = FALSE;
+}
+
+/*
+ * The simulated driver.
+ */
+static BOOL DeviceIoControlHook(HANDLE handle, DWORD code, LPVOID in,
+    DWORD in_len, LPVOID out, DWORD out_len, DWORD *ret_len,
+    LPOVERLAPPED overlapped)
+{
+    windivert_ioctl_t ioctl = (windivert_ioctl_t)in;
+    windivert_ioctl_open_t ioctl_open = (windivert_ioctl_open_t)out;
+    PMODEL_ENTRY entry;
+    DWORD err = 0;
+
+    *ret_len = 0;
+    if (in_len != sizeof(struct windivert_ioctl_s) ||
+        ioctl->magic != WINDIVERT_IOCTL_MAGIC ||
+        ioctl->version != WINDIVERT_IOCTL_VERSION)
+    {
+        InterlockedIncrement(&bad);
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    Lock();
+    entry = ModelGet(handle);
+    if (entry == NULL)
+    {
+        err = ERROR_NOT_ENOUGH_MEMORY;
+        InterlockedIncrement(&bad);
+        goto DeviceIoControlHookExit;
+    }
+    switch (code)
+    {
+        case IOCTL_WINDIVERT_OPEN:
+            if (!windivert_open_verify(ioctl_open, out_len))
+            {
+                err = ERROR_INVALID_PARAMETER;
+                InterlockedIncrement(&bad);
+                break;
+            }
+            if (entry->filter_on)
+            {
+                // Handed out while still in use, or re-used without a
+                // RESET.
+                err = ERROR_INVALID_PARAMETER;
+                InterlockedIncrement(&bad);
+                break;
+            }
+            if (fail_open)
+            {
+                err = ERROR_GEN_FAILURE;
+                break;
+            }
+            entry->filter_on = TRUE;
+            entry->opens++;
+            entry->layer = ioctl_open->layer;
+            break;
+        case IOCTL_WINDIVERT_RESET:
+            if (fail_reset)
+            {
+                err = ERROR_GEN_FAILURE;
+                break;
+            }
+            entry->filter_on = FALSE;
+            entry->resets++;
+            break;
+        default:
+            err = ERROR_NOT_SUPPORTED;
+            InterlockedIncrement(&bad);
+            break;
+    }
+
+DeviceIoControlHookExit:
+    Unlock();
+    if (err != 0)
+    {
+        SetLastError(err);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Is handle one of the pool's idle handles?
+ */
+static BOOL PoolIdle(HANDLE pool_handle, HANDLE handle)
+{
+    PWINDIVERT_POOL pool = (PWINDIVERT_POOL)pool_handle;
+    UINT i;
+
+    for (i = 0; i < pool->size; i++)
+    {
+        if (pool->slots[i] == handle)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static UINT PoolIdleCount(HANDLE pool_handle)
+{
+    PWINDIVERT_POOL pool = (PWINDIVERT_POOL)pool_handle;
+    UINT i, count = 0;
+
+    for (i = 0; i < pool->size; i++)
+    {
+        count += (pool->slots[i] != NULL);
+    }
+    return count;
+}
+
+/*
+ * Acquire, release and re-use.
+ */
+static void TestLifecycle(void)
+{
+    HANDLE pool, handle, handle2, idle[POOL_SIZE];
+    MODEL_ENTRY entry;
+    UINT i;
+
+    ModelClear();
+    pool = WinDivertPoolCreate(POOL_SIZE);
+    CHECK(pool != INVALID_HANDLE_VALUE);
+    if (pool == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    // The device handles are opened up-front, but not started:
+    CHECK(shim_device_handles == POOL_SIZE);
+    CHECK(PoolIdleCount(pool) == POOL_SIZE);
+    for (i = 0; i < POOL_SIZE; i++)
+    {
+        idle[i] = ((PWINDIVERT_POOL)pool)->slots[i];
+    }
+    CHECK(model_len == 0);
+
+    // Acquire: an idle handle is started with the filter:
+    handle = WinDivertPoolOpen(pool, "tcp.DstPort == 80",
+        WINDIVERT_LAYER_NETWORK_FORWARD, 0, 0);
+    CHECK(handle != INVALID_HANDLE_VALUE);
+    CHECK(handle == idle[0]);
+    CHECK(!PoolIdle(pool, handle));
+    CHECK(PoolIdleCount(pool) == POOL_SIZE - 1);
+    CHECK(shim_device_handles == POOL_SIZE);
+    entry = ModelCopy(handle);
+    CHECK(entry.filter_on && entry.opens == 1 && entry.resets == 0);
+    CHECK(entry.layer == WINDIVERT_LAYER_NETWORK_FORWARD);
+
+    // Release: the handle is RESET and returned to the pool:
+    CHECK(WinDivertPoolClose(pool, handle));
+    CHECK(PoolIdle(pool, handle));
+    CHECK(PoolIdleCount(pool) == POOL_SIZE);
+    CHECK(shim_device_handles == POOL_SIZE);
+    entry = ModelCopy(handle);
+    CHECK(!entry.filter_on && entry.opens == 1 && entry.resets == 1);
+
+    // Re-use, with another layer (the driver rejects an OPEN on a handle
+    // that was not RESET):
+    for (i = 0; i < 10; i++)
+    {
+        handle2 = WinDivertPoolOpen(pool, "udp", WINDIVERT_LAYER_NETWORK, 0,
+            0);
+        CHECK(handle2 == handle);
+        entry = ModelCopy(handle2);
+        CHECK(entry.filter_on && entry.opens == i + 2 &&
+            entry.resets == i + 1);
+        CHECK(entry.layer == WINDIVERT_LAYER_NETWORK);
+        CHECK(WinDivertPoolClose(pool, handle2));
+    }
+    CHECK(bad == 0);
+
+    CHECK(WinDivertPoolDestroy(pool));
+    CHECK(shim_device_handles == 0);
+}
+
+/*
+ * More handles than the pool holds.
+ */
+static void TestExhaustion(void)
+{
+    HANDLE pool, handles[POOL_SIZE + EXTRA];
+    MODEL_ENTRY entry;
+    UINT i, j, from_pool = 0;
+
+    ModelClear();
+    pool = WinDivertPoolCreate(POOL_SIZE);
+    CHECK(pool != INVALID_HANDLE_VALUE);
+    if (pool == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+    for (i = 0; i < POOL_SIZE + EXTRA; i++)
+    {
+        handles[i] = WinDivertPoolOpen(pool, "true",
+            WINDIVERT_LAYER_NETWORK, 0, 0);
+        CHECK(handles[i] != INVALID_HANDLE_VALUE);
+        from_pool += (i < POOL_SIZE);
+        for (j = 0; j < i; j++)
+        {
+            CHECK(handles[j] != handles[i]);
+        }
+        entry = ModelCopy(handles[i]);
+        CHECK(entry.filter_on && entry.opens == 1);
+    }
+
+    // The pool is empty, so the extra handles are new:
+    CHECK(PoolIdleCount(pool) == 0);
+    CHECK(shim_device_handles == POOL_SIZE + EXTRA);
+
+    // Release the extra handles first; they fill the pool, and the rest
+    // are closed:
+    for (i = POOL_SIZE + EXTRA; i-- > 0; )
+    {
+        CHECK(WinDivertPoolClose(pool, handles[i]));
+    }
+    CHECK(PoolIdleCount(pool) == POOL_SIZE);
+    CHECK(shim_device_handles == POOL_SIZE);
+    for (i = POOL_SIZE; i < POOL_SIZE + EXTRA; i++)
+    {
+        CHECK(PoolIdle(pool, handles[i]));
+    }
+    CHECK(bad == 0);
+
+    CHECK(WinDivertPoolDestroy(pool));
+    CHECK(shim_device_handles == 0);
+}
+
+/*
+ * Failures: a filter that does not compile, a failed OPEN, and a failed
+ * RESET (after which the handle cannot be re-used).
+ */
+static void TestFailures(void)
+{
+    HANDLE pool, handle;
+    MODEL_ENTRY entry;
+
+    ModelClear();
+    pool = WinDivertPoolCreate(POOL_SIZE);
+    CHECK(pool != INVALID_HANDLE_VALUE);
+    if (pool == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    // Bad filter: nothing is claimed or sent:
+    SetLastError(0);
+    handle = WinDivertPoolOpen(pool, "tcp.DstPort ==",
+        WINDIVERT_LAYER_NETWORK, 0, 0);
+    CHECK(handle == INVALID_HANDLE_VALUE);
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+    CHECK(PoolIdleCount(pool) == POOL_SIZE);
+    CHECK(model_len == 0);
+
+    // Failed OPEN: the claimed handle is closed:
+    fail_open = TRUE;
+    SetLastError(0);
+    handle = WinDivertPoolOpen(pool, "true", WINDIVERT_LAYER_NETWORK, 0, 0);
+    CHECK(handle == INVALID_HANDLE_VALUE);
+    CHECK(GetLastError() == ERROR_GEN_FAILURE);
+    CHECK(PoolIdleCount(pool) == POOL_SIZE - 1);
+    CHECK(shim_device_handles == POOL_SIZE - 1);
+    fail_open = FALSE;
+
+    // Failed RESET: the handle is closed rather than returned:
+    handle = WinDivertPoolOpen(pool, "true", WINDIVERT_LAYER_NETWORK, 0, 0);
+    CHECK(handle != INVALID_HANDLE_VALUE);
+    CHECK(PoolIdleCount(pool) == POOL_SIZE - 2);
+    fail_reset = TRUE;
+    entry = ModelCopy(handle);
+    CHECK(WinDivertPoolClose(pool, handle));
+    CHECK(!PoolIdle(pool, handle));
+    CHECK(PoolIdleCount(pool) == POOL_SIZE - 2);
+    CHECK(shim_device_handles == POOL_SIZE - 2);
+    CHECK(entry.opens == 1 && ModelCopy(handle).resets == 0);
+    fail_reset = FALSE;
+    CHECK(bad == 0);
+
+    CHECK(WinDivertPoolDestroy(pool));
+    CHECK(shim_device_handles == 0);
+
+    // The device cannot be opened:
+    shim_device_io_control = NULL;
+    SetLastError(0);
+    CHECK(WinDivertPoolCreate(POOL_SIZE) == INVALID_HANDLE_VALUE);
+    CHECK(GetLastError() != 0);
+    CHECK(shim_device_handles == 0);
+    shim_device_io_control = DeviceIoControlHook;
+
+    // Invalid parameters:
+    SetLastError(0);
+    CHECK(WinDivertPoolCreate(0) == INVALID_HANDLE_VALUE);
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+    SetLastError(0);
+    CHECK(WinDivertPoolCreate(WINDIVERT_POOL_MAX_SIZE + 1) ==
+        INVALID_HANDLE_VALUE);
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+    SetLastError(0);
+    CHECK(WinDivertPoolOpen(INVALID_HANDLE_VALUE, "true",
+        WINDIVERT_LAYER_NETWORK, 0, 0) == INVALID_HANDLE_VALUE);
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+    SetLastError(0);
+    CHECK(!WinDivertPoolClose(NULL, INVALID_HANDLE_VALUE));
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+    SetLastError(0);
+    CHECK(!WinDivertPoolDestroy(INVALID_HANDLE_VALUE));
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+}
+
+/*
+ * Threads that open and close handles through the same pool.
+ */
+static DWORD WINAPI Worker(LPVOID arg)
+{
+    HANDLE pool = (HANDLE)arg, handle;
+    UINT i;
+
+    for (i = 0; i < NUM_CYCLES; i++)
+    {
+        handle = WinDivertPoolOpen(pool, "true", WINDIVERT_LAYER_NETWORK, 0,
+            0);
+        if (handle == INVALID_HANDLE_VALUE)
+        {
+            InterlockedIncrement(&open_failures);
+            continue;
+        }
+        if (i % 4 == 0)
+        {
+            YieldProcessor();
+        }
+        if (!WinDivertPoolClose(pool, handle))
+        {
+            InterlockedIncrement(&bad);
+        }
+    }
+
+    // As the loader would, to close this thread's event:
+    WinDivertDllEntry(NULL, DLL_THREAD_DETACH, NULL);
+    return 0;
+}
+
+static void TestConcurrent(void)
+{
+    HANDLE pool, threads[NUM_THREADS];
+    UINT i;
+
+    ModelClear();
+    pool = WinDivertPoolCreate(POOL_SIZE);
+    CHECK(pool != INVALID_HANDLE_VALUE);
+    if (pool == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+    for (i = 0; i < NUM_THREADS; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, Worker, (LPVOID)pool, 0, NULL);
+    }
+    WaitForMultipleObjects(NUM_THREADS, threads, TRUE, INFINITE);
+    for (i = 0; i < NUM_THREADS; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+
+    // No handle was handed out twice, and only idle handles remain open:
+    CHECK(open_failures == 0);
+    CHECK(bad == 0);
+    CHECK(PoolIdleCount(pool) >= 1);
+    CHECK(shim_device_handles == (LONG)PoolIdleCount(pool));
+    CHECK(WinDivertPoolDestroy(pool));
+    CHECK(shim_device_handles == 0);
+}
+
+int main(void)
+{
+    shim_device_io_control = DeviceIoControlHook;
+    TestLifecycle();
+    TestExhaustion();
+    TestFailures();
+    TestConcurrent();
+    return TestResult("test_handle_pool");
+}
@@ -0,0 +1,305 @@
+/*
+ * test_log.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the netdump packet log: PacketFormat() (header lines, hex and
+ * ASCII dumps, colour markers), the ring layout of LogWrite() (alignment,
+ * padding at the end of the ring, position counters wrapping around), that
+ * a full ring or the rate limit drops and counts records without touching
+ * unwritten ones, and that the log thread writes the records of concurrent
+ * producers in order (without the colour markers, as output is not a
+ * console) and reports the dropped ones.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <winsock2.h>
+#include "windivert.h"
+#include "../examples/netdump/log.c"
+#include "test.h"
+
+#define MAXBUF          0xFFFF
+#define NUM_PRODUCERS   4
+#define NUM_RECORDS     80000       // (Enough to wrap around the ring.)
+#define OUTPUT_FILE     "test_log.out"
+#define RECORD_LEN(text_len)                                                \
+    ((UINT32)((sizeof(LOGHDR) + (text_len) + sizeof(LOGHDR) - 1) &          \
+        ~(sizeof(LOGHDR) - 1)))
+
+static LOG packet_log;
+static char record[LOG_RECORD_MAX];
+
+/*
+ * Remove the colour markers from a record (as the log thread does when the
+ * output is not a console).  Returns the text length.
+ */
+static UINT Strip(char *text, UINT len)
+{
+    UINT i, j;
+
+    for (i = 0, j = 0; i < len; i++)
+    {
+        if (text[i] == LOG_COLOUR)
+        {
+            i++;
+            continue;
+        }
+        text[j++] = text[i];
+    }
+    text[j] = '\0';
+    return j;
+}
+
+/*
+ * Check the hex and ASCII dumps at the end of a (stripped) record.
+ */
+static void CheckDumps(const char *text, const UINT8 *packet, UINT len)
+{
+    static char expected[4 * MAXBUF];
+    char *p = expected;
+    UINT i;
+
+    for (i = 0; i < len; i++)
+    {
+        p += sprintf(p, "%s%.2X", (i % 20 == 0? "\n\t": ""), packet[i]);
+    }
+    for (i = 0; i < len; i++)
+    {
+        p += sprintf(p, "%s%c", (i % 40 == 0? "\n\t": ""),
+            (packet[i] >= 0x20 && packet[i] < 0x7F? packet[i]: '.'));
+    }
+    strcpy(p, "\n");
+    CHECK(strlen(text) >= strlen(expected) &&
+        strcmp(text + strlen(text) - strlen(expected), expected) == 0);
+}
+
+/*
+ * Write NUM_RECORDS records "<producer> <n>\n", each with a colour marker.
+ */
+static DWORD WINAPI Producer(LPVOID arg)
+{
+    char text[32];
+    UINT i, len;
+
+    for (i = 0; i < NUM_RECORDS; i++)
+    {
+        len = (UINT)sprintf(text, "%c%cp%u %u\n", LOG_COLOUR,
+            FOREGROUND_GREEN, (UINT)(UINT_PTR)arg, i);
+        LogWrite(&packet_log, text, len);
+    }
+    return 0;
+}
+
+int main(void)
+{
+    static UINT8 packet[MAXBUF];
+    static char output[4 * 1024 * 1024];
+    static char bytes[256];
+    static const char start[] = "\nPacket [Direction=0 IfIdx=7 "
+        "SubIfIdx=3]\nIPv4 [Version=4 HdrLength=5 ";
+    HANDLE threads[NUM_PRODUCERS], thread;
+    WINDIVERT_ADDRESS addr;
+    PLOGHDR hdr;
+    UINT packet_len, len, i, n, last[NUM_PRODUCERS], count = 0, shown = 0;
+    UINT32 head;
+    long dropped;
+    ssize_t result;
+    int out_fd, file_fd;
+    char *line;
+    BOOL ordered = TRUE;
+
+    // Output goes to a file (before any is written, so that the log thread
+    // can set the stdout buffer):
+    fflush(stdout);
+    out_fd = dup(1);
+    file_fd = open(OUTPUT_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(out_fd >= 0 && file_fd >= 0);
+    dup2(file_fd, 1);
+    close(file_fd);
+
+    // Format a TCP/IPv4 packet:
+    LogInit(&packet_log, 0);
+    CHECK(!packet_log.console);
+    packet_len = TestPacket(packet, FALSE, IPPROTO_TCP, 1234, 80,
+        "GET / HTTP/1.1\r\nHost: www.example.com\r\n\r\n");
+    memset(&addr, 0, sizeof(addr));
+    addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+    addr.IfIdx     = 7;
+    addr.SubIfIdx  = 3;
+    len = PacketFormat(record, packet, packet_len, &addr);
+    for (i = 0, n = 0; i < len; i++)
+    {
+        n += (record[i] == LOG_COLOUR);
+    }
+    CHECK(n == 6);
+    CHECK(record[len-2] == LOG_COLOUR && record[len-1] ==
+        (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE));
+    len = Strip(record, len);
+    CHECK(strncmp(record, start, sizeof(start) - 1) == 0);
+    CHECK(strstr(record, " SrcAddr=10.0.0.1 DstAddr=10.0.0.2]\n") != NULL);
+    CHECK(strstr(record, "]\nTCP [SrcPort=1234 DstPort=80 ") != NULL);
+    CHECK(strstr(record, "IPv6 [") == NULL && strstr(record, "UDP [") ==
+        NULL);
+    CheckDumps(record, packet, packet_len);
+
+    // ... and a UDP/IPv6 packet, with every (non-zero) byte value:
+    for (i = 0; i < 255; i++)
+    {
+        bytes[i] = (char)(i + 1);
+    }
+    packet_len = TestPacket(packet, TRUE, IPPROTO_UDP, 53, 5353, bytes);
+    len = PacketFormat(record, packet, packet_len, &addr);
+    len = Strip(record, len);
+    CHECK(strstr(record, "\nIPv6 [Version=6 ") != NULL);
+    CHECK(strstr(record, " SrcAddr=fe80:0:0:0:0:0:0:1 "
+        "DstAddr=fe80:0:0:0:0:0:0:2]\n") != NULL);
+    CHECK(strstr(record, "]\nUDP [SrcPort=53 DstPort=5353 ") != NULL);
+    CHECK(strstr(record, "IPv4 [") == NULL && strstr(record, "TCP [") ==
+        NULL);
+    CheckDumps(record, packet, packet_len);
+
+    // Records are aligned to the header size:
+    CHECK(LogWrite(&packet_log, "abc", 3));
+    hdr = (PLOGHDR)packet_log.buf;
+    CHECK(packet_log.head == 32 && hdr->ready && hdr->len == 32 &&
+        hdr->text_len == 3 && memcmp(hdr + 1, "abc", 3) == 0);
+    CHECK(LogWrite(&packet_log, "0123456789abcdef", 16));
+    hdr = (PLOGHDR)(packet_log.buf + 32);
+    CHECK(packet_log.head == 64 && hdr->ready && hdr->len == 32);
+    CHECK(packet_log.tail == 0 && packet_log.dropped == 0);
+
+    // A record that does not fit before the end of the ring is preceded by
+    // padding; the positions wrap around:
+    memset(packet_log.buf, 0, LOG_SIZE);
+    packet_log.head = packet_log.tail = (LONG)(UINT32)-16;
+    CHECK(LogWrite(&packet_log, record, 100));
+    hdr = (PLOGHDR)(packet_log.buf + LOG_SIZE - 16);
+    CHECK(hdr->ready && hdr->len == 16 && hdr->text_len == 0);
+    hdr = (PLOGHDR)packet_log.buf;
+    CHECK(hdr->ready && hdr->len == RECORD_LEN(100) &&
+        hdr->text_len == 100 && memcmp(hdr + 1, record, 100) == 0);
+    CHECK((UINT32)packet_log.head == RECORD_LEN(100));
+
+    // A full ring drops records, without overwriting unwritten ones:
+    memset(packet_log.buf, 0, LOG_SIZE);
+    packet_log.head = packet_log.tail = 0;
+    for (n = 0; LogWrite(&packet_log, record, 65536); n++)
+        ;
+    CHECK(n == LOG_SIZE / RECORD_LEN(65536));
+    CHECK(packet_log.dropped == 1 && packet_log.tail == 0);
+    head = (UINT32)packet_log.head;
+    CHECK(LogWrite(&packet_log, "abc", 3));
+    CHECK((UINT32)packet_log.head == head + 32);
+    head += 32;
+    hdr = (PLOGHDR)packet_log.buf;
+    CHECK(hdr->ready && hdr->len == RECORD_LEN(65536));
+
+    // ... until the log thread has written one:
+    hdr->ready = FALSE;
+    packet_log.tail = (LONG)hdr->len;
+    CHECK(LogWrite(&packet_log, record, 65536));
+    hdr = (PLOGHDR)(packet_log.buf + (head & (LOG_SIZE-1)));
+    CHECK(hdr->ready && hdr->len == LOG_SIZE - (head & (LOG_SIZE-1)) &&
+        hdr->text_len == 0);
+    hdr = (PLOGHDR)packet_log.buf;
+    CHECK(hdr->ready && hdr->text_len == 65536);
+    CHECK((UINT32)packet_log.head - (UINT32)packet_log.tail == LOG_SIZE);
+    free(packet_log.buf);
+
+    // The rate limit drops records beyond the limit each second (starting
+    // at the beginning of one):
+    LogInit(&packet_log, 3);
+    shim_tick_offset += 1000 - GetTickCount() % 1000;
+    CHECK(LogWrite(&packet_log, "a", 1) && LogWrite(&packet_log, "b", 1) &&
+        LogWrite(&packet_log, "c", 1));
+    CHECK(!LogWrite(&packet_log, "d", 1) && !LogWrite(&packet_log, "e", 1));
+    CHECK(packet_log.dropped == 2 && (UINT32)packet_log.head == 3 * 32);
+    shim_tick_offset += 1000;
+    CHECK(LogWrite(&packet_log, "f", 1));
+    CHECK(packet_log.dropped == 2 && (UINT32)packet_log.head == 4 * 32);
+    free(packet_log.buf);
+
+    // The log thread writes each producer's records in order:
+    LogInit(&packet_log, 0);
+    thread = CreateThread(NULL, 0, LogThread, (LPVOID)&packet_log, 0, NULL);
+    CHECK(thread != NULL);
+    for (i = 0; i < NUM_PRODUCERS; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, Producer, (LPVOID)(UINT_PTR)i, 0,
+            NULL);
+        CHECK(threads[i] != NULL);
+        if (thread == NULL || threads[i] == NULL)
+        {
+            return TestResult("test_log");
+        }
+    }
+    WaitForMultipleObjects(NUM_PRODUCERS, threads, TRUE, INFINITE);
+    for (i = 0; i < NUM_PRODUCERS; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+    while (packet_log.tail != packet_log.head || packet_log.dropped != 0)
+    {
+        Sleep(LOG_INTERVAL);
+    }
+    Sleep(2 * LOG_INTERVAL);
+    fflush(stdout);
+    dup2(out_fd, 1);
+    close(out_fd);
+
+    file_fd = open(OUTPUT_FILE, O_RDONLY);
+    CHECK(file_fd >= 0);
+    len = 0;
+    while (file_fd >= 0 && len < sizeof(output) - 1 &&
+        (result = read(file_fd, output + len, sizeof(output) - 1 - len)) > 0)
+    {
+        len += (UINT)result;
+    }
+    close(file_fd);
+    remove(OUTPUT_FILE);
+    output[len] = '\0';
+    CHECK(len < sizeof(output) - 1);
+    CHECK(memchr(output, LOG_COLOUR, len) == NULL);
+    for (i = 0; i < NUM_PRODUCERS; i++)
+    {
+        last[i] = (UINT)-1;
+    }
+    for (line = strtok(output, "\n"); line != NULL;
+        line = strtok(NULL, "\n"))
+    {
+        if (sscanf(line, "(%ld packets not shown)", &dropped) == 1)
+        {
+            shown += (UINT)dropped;
+            continue;
+        }
+        if (sscanf(line, "p%u %u", &i, &n) != 2 || i >= NUM_PRODUCERS ||
+            n >= NUM_RECORDS || (last[i] != (UINT)-1 && n <= last[i]))
+        {
+            ordered = FALSE;
+            continue;
+        }
+        last[i] = n;
+        count++;
+    }
+    CHECK(ordered);
+    CHECK(!((PLOGHDR)packet_log.buf)->ready);
+    CHECK(count > 0 && count + shown == NUM_PRODUCERS * NUM_RECORDS);
+
+    return TestResult("test_log");
+}
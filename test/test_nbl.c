@@ -0,0 +1,221 @@
+/*
+ * test_nbl.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the count of NET_BUFFER_LISTs in use (windivert_nbl_count_*()), as
+ * used by the driver's injections: against a model for a random sequence of
+ * allocations, frees and samples; and with injecting threads handing their
+ * NET_BUFFER_LISTs to completing threads (as FwpsInject*Async0 does), while
+ * another thread samples.  Once every injection has completed the count
+ * must be zero (the driver waits for this before it unloads).
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_OPS         200000
+#define NUM_INJECTORS   4
+#define NUM_INJECTS     200000
+#define INFLIGHT_MAX    64
+#define RING_LEN        1024
+
+static struct windivert_nbl_count_s count;
+
+/*
+ * A (single producer, single consumer) ring of in-flight injections, from
+ * an injector to its completion thread.
+ */
+typedef struct
+{
+    PVOID entries[RING_LEN];
+    volatile LONG head;                         // Next to complete.
+    volatile LONG tail;                         // Next to inject.
+    volatile LONG done;                         // Injector finished.
+    LONG completed;
+    BOOL ok;
+} RING, *PRING;
+
+static RING rings[NUM_INJECTORS];
+static volatile LONG stop = FALSE;
+static volatile LONG bad_samples = 0;
+
+/*
+ * Random sequence against a model.
+ */
+static void TestModel(void)
+{
+    LONG used = 0, peak = 0, sample;
+    UINT i;
+    BOOL ok = TRUE;
+
+    windivert_nbl_count_init(&count);
+    CHECK(count.used == 0 && windivert_nbl_count_sample(&count) == 0);
+    for (i = 0; i < NUM_OPS; i++)
+    {
+        switch (TestRandom() % 8)
+        {
+            case 0: case 1: case 2:
+                windivert_nbl_count_alloc(&count);
+                used++;
+                peak = (used > peak? used: peak);
+                break;
+            case 3: case 4: case 5:
+                if (used == 0)
+                {
+                    break;
+                }
+                windivert_nbl_count_free(&count);
+                used--;
+                break;
+            default:
+                // A new sample starts at the number in use:
+                sample = windivert_nbl_count_sample(&count);
+                ok = ok && sample == peak;
+                peak = used;
+                break;
+        }
+        ok = ok && count.used == used && count.peak == peak;
+    }
+    CHECK(ok);
+    while (used > 0)
+    {
+        windivert_nbl_count_free(&count);
+        used--;
+    }
+    CHECK(count.used == 0);
+    CHECK(windivert_nbl_count_sample(&count) == peak);
+    CHECK(windivert_nbl_count_sample(&count) == 0);
+}
+
+/*
+ * Allocate (inject) NUM_INJECTS NET_BUFFER_LISTs, with at most INFLIGHT_MAX
+ * in flight.
+ */
+static DWORD WINAPI Injector(LPVOID arg)
+{
+    PRING ring = (PRING)arg;
+    LONG i;
+    PVOID buffers;
+
+    for (i = 0; i < NUM_INJECTS; i++)
+    {
+        while (ring->tail - ring->head >= INFLIGHT_MAX)
+        {
+            YieldProcessor();
+        }
+        buffers = malloc(64);
+        windivert_nbl_count_alloc(&count);
+        ring->entries[ring->tail % RING_LEN] = buffers;
+        InterlockedIncrement(&ring->tail);
+    }
+    InterlockedExchange(&ring->done, TRUE);
+    return 0;
+}
+
+/*
+ * Complete (free) the injections of one injector.
+ */
+static DWORD WINAPI Completer(LPVOID arg)
+{
+    PRING ring = (PRING)arg;
+    PVOID buffers;
+
+    while (!ring->done || ring->head != ring->tail)
+    {
+        if (ring->head == ring->tail)
+        {
+            YieldProcessor();
+            continue;
+        }
+        buffers = ring->entries[ring->head % RING_LEN];
+        ring->ok = ring->ok && buffers != NULL;
+        free(buffers);
+        windivert_nbl_count_free(&count);
+        InterlockedIncrement(&ring->head);
+        ring->completed++;
+    }
+    return 0;
+}
+
+/*
+ * Sample (as the driver's timer does) until stopped.  No more than
+ * NUM_INJECTORS * INFLIGHT_MAX can ever be in use.
+ */
+static DWORD WINAPI Sampler(LPVOID arg)
+{
+    LONG sample, used;
+
+    while (!stop)
+    {
+        sample = windivert_nbl_count_sample(&count);
+        used = count.used;
+        if (sample < 0 || sample > NUM_INJECTORS * INFLIGHT_MAX ||
+            used < 0 || used > NUM_INJECTORS * INFLIGHT_MAX)
+        {
+            InterlockedIncrement(&bad_samples);
+        }
+        YieldProcessor();
+    }
+    return 0;
+}
+
+static void TestConcurrent(void)
+{
+    HANDLE threads[2*NUM_INJECTORS], sampler;
+    LONG peak;
+    UINT i;
+
+    windivert_nbl_count_init(&count);
+    sampler = CreateThread(NULL, 0, Sampler, NULL, 0, NULL);
+    for (i = 0; i < NUM_INJECTORS; i++)
+    {
+        memset(&rings[i], 0, sizeof(rings[i]));
+        rings[i].ok = TRUE;
+        threads[2*i]   = CreateThread(NULL, 0, Injector, &rings[i], 0, NULL);
+        threads[2*i+1] = CreateThread(NULL, 0, Completer, &rings[i], 0,
+            NULL);
+    }
+    WaitForMultipleObjects(2*NUM_INJECTORS, threads, TRUE, INFINITE);
+    stop = TRUE;
+    WaitForSingleObject(sampler, INFINITE);
+    CloseHandle(sampler);
+    for (i = 0; i < 2*NUM_INJECTORS; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+
+    for (i = 0; i < NUM_INJECTORS; i++)
+    {
+        CHECK(rings[i].ok);
+        CHECK(rings[i].completed == NUM_INJECTS);
+    }
+    CHECK(bad_samples == 0);
+
+    // Every injection has completed:
+    CHECK(count.used == 0);
+    peak = windivert_nbl_count_sample(&count);
+    CHECK(peak >= 0 && peak <= NUM_INJECTORS * INFLIGHT_MAX);
+    CHECK(windivert_nbl_count_sample(&count) == 0);
+}
+
+int main(void)
+{
+    TestModel();
+    TestConcurrent();
+    return TestResult("test_nbl");
+}
@@ -0,0 +1,565 @@
+/*
+ * test_open.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fuzzes the IOCTL_WINDIVERT_OPEN message: the encoder (WinDivertStart(),
+ * with the DeviceIoControl() request captured by the shim), and the decoder
+ * (windivert_open_verify() and windivert_filter_load(), as used by the
+ * driver) with mutated and truncated messages.  Also checks that a filter
+ * compiled to a filter object, and reopened from its bytes with
+ * WinDivertOpenCompiled(), gives the same verdicts as the filter string, and
+ * that corrupted or truncated filter objects are rejected.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_ENCODE      500
+#define NUM_DECODE      20000
+#define NUM_IMAGES      2000
+#define MAX_IMAGE       0x10000
+#define NUM_PACKETS     8
+#define MAX_MESSAGE     (sizeof(struct windivert_ioctl_open_s) +            \
+    WINDIVERT_FILTER_MAXLEN*sizeof(struct windivert_ioctl_filter_s) +       \
+    WINDIVERT_FILTER_AUTOMATA_MAXLEN + 64)
+
+static const char *filters[] =
+{
+    "true",
+    "false",
+    "ifIdx == 3 and subIfIdx == 0",
+    "ip.DstAddr == 10.0.0.2 and tcp.DstPort == 80",
+    "ipv6.SrcAddr == fe80::1 or udp.DstPort == 53",
+    "tcp.Syn or (icmp and icmp.Type == 8)",
+    "tcp.Payload[0:4] == \"GET \"",
+    "tcp.Payload contains {\"Host: \", \"HTTP/1.1\"}",
+    "udp.Payload contains {\"dns\"} and not tcp",
+};
+#define NUM_FILTERS     (sizeof(filters) / sizeof(filters[0]))
+
+static UINT8 packets[NUM_PACKETS][256];
+static UINT packet_lens[NUM_PACKETS];
+
+/*
+ * The last request seen by the DeviceIoControl() hook.
+ */
+static DWORD request_code;
+static UINT8 request[MAX_MESSAGE];
+static DWORD request_len;
+
+static BOOL DeviceIoControlHook(HANDLE handle, DWORD code, LPVOID in,
+    DWORD in_len, LPVOID out, DWORD out_len, DWORD *ret_len,
+    LPOVERLAPPED overlapped)
+{
+    request_code = code;
+    request_len  = (out_len < sizeof(request)? out_len: sizeof(request));
+    memcpy(request, out, request_len);
+    *ret_len = 0;
+    return TRUE;
+}
+
+/*
+ * Decode an IOCTL_WINDIVERT_OPEN message as the driver does (see
+ * windivert_filter_compile()); returns a (malloc'ed) filter or NULL.
+ */
+static filter_t Decode(const UINT8 *message, size_t len)
+{
+    windivert_ioctl_open_t ioctl_open = (windivert_ioctl_open_t)message;
+    windivert_ioctl_filter_t program;
+    filter_t filter;
+    size_t automata_len;
+
+    if (!windivert_open_verify(ioctl_open, len))
+    {
+        return NULL;
+    }
+    program = (windivert_ioctl_filter_t)(ioctl_open + 1);
+    automata_len = len - sizeof(struct windivert_ioctl_open_s) -
+        ioctl_open->filter_len*sizeof(struct windivert_ioctl_filter_s);
+    filter = (filter_t)malloc(ioctl_open->filter_len*sizeof(struct filter_s) +
+        automata_len + 1);
+    if (filter == NULL)
+    {
+        return NULL;
+    }
+    memcpy(filter + ioctl_open->filter_len, program + ioctl_open->filter_len,
+        automata_len);
+    if (!windivert_filter_load(program, ioctl_open->filter_len,
+            (UINT8 *)(filter + ioctl_open->filter_len), automata_len, filter))
+    {
+        free(filter);
+        return NULL;
+    }
+    return filter;
+}
+
+/*
+ * Checks the invariants the driver relies on for a decoded message.
+ */
+static void CheckDecoded(const UINT8 *message, filter_t filter)
+{
+    windivert_ioctl_open_t ioctl_open = (windivert_ioctl_open_t)message;
+    UINT16 i, length = ioctl_open->filter_len;
+    BOOL ok = TRUE;
+    UINT j;
+
+    CHECK(ioctl_open->layer <= WINDIVERT_LAYER_MAX);
+    CHECK(WINDIVERT_FLAGS_VALID(ioctl_open->flags));
+    CHECK(ioctl_open->priority <= WINDIVERT_PRIORITY_MAX);
+    for (i = 0; i < length; i++)
+    {
+        ok = ok && (filter[i].success == WINDIVERT_FILTER_RESULT_ACCEPT ||
+            filter[i].success == WINDIVERT_FILTER_RESULT_REJECT ||
+            (filter[i].success > i && filter[i].success < length));
+        ok = ok && (filter[i].failure == WINDIVERT_FILTER_RESULT_ACCEPT ||
+            filter[i].failure == WINDIVERT_FILTER_RESULT_REJECT ||
+            (filter[i].failure > i && filter[i].failure < length));
+        ok = ok && filter[i].depth <= WINDIVERT_FILTER_DEPTH_TRANSPORT;
+    }
+    CHECK(ok);
+
+    // The filter must be safe to run:
+    for (j = 0; j < NUM_PACKETS; j++)
+    {
+        WINDIVERT_PACKET packet;
+        UINT32 hash;
+
+        packet.data = packets[j];
+        packet.len  = packet_lens[j];
+        windivert_filter(&packet, 3, 0, j % 2, filter, &hash);
+    }
+}
+
+/*
+ * Encode a random (valid) open request; returns the filter object used.
+ */
+static PWINDIVERT_FILTER_OBJECT Encode(UINT *object_len, INT16 *priority,
+    UINT64 *flags, WINDIVERT_LAYER *layer)
+{
+    PWINDIVERT_FILTER_OBJECT object;
+
+    *layer = (WINDIVERT_LAYER)(TestRandom() % (WINDIVERT_LAYER_MAX + 1));
+    object = WinDivertCompileFilterObject(filters[TestRandom() % NUM_FILTERS],
+        *layer, object_len);
+    if (object == NULL)
+    {
+        return NULL;
+    }
+    *priority = (INT16)((int)(TestRandom() % 2001) - 1000);
+    do
+    {
+        *flags = TestRandom() & WINDIVERT_FLAGS_ALL;
+    }
+    while (!WINDIVERT_FLAGS_VALID(*flags));
+    request_code = 0;
+    request_len  = 0;
+    if (!WinDivertStart((HANDLE)1, object, *object_len, *priority, *flags))
+    {
+        free(object);
+        return NULL;
+    }
+    return object;
+}
+
+/*
+ * Evaluate a filter for each test packet; returns a bitmap of verdicts.
+ */
+static UINT Verdicts(filter_t filter)
+{
+    WINDIVERT_PACKET packet;
+    UINT verdicts = 0, i;
+
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        packet.data = packets[i];
+        packet.len  = packet_lens[i];
+        if (windivert_filter(&packet, 3, 0, i % 2, filter, NULL))
+        {
+            verdicts |= (1 << i);
+        }
+    }
+    return verdicts;
+}
+
+/*
+ * Evaluate a loaded filter object for each test packet, as Verdicts().
+ */
+static UINT EvalVerdicts(HANDLE handle)
+{
+    WINDIVERT_ADDRESS addr;
+    UINT verdicts = 0, i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.IfIdx = 3;
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        addr.Direction = (i % 2 == 0? WINDIVERT_DIRECTION_INBOUND:
+            WINDIVERT_DIRECTION_OUTBOUND);
+        if (WinDivertHelperEvalFilter(handle, packets[i], packet_lens[i],
+                &addr))
+        {
+            verdicts |= (1 << i);
+        }
+    }
+    return verdicts;
+}
+
+/*
+ * Open a handle from a filter object image, as an application that saved
+ * the image would; returns the decoded request, or NULL if either the DLL
+ * or the driver rejects the image.
+ */
+static filter_t OpenImage(const UINT8 *image, UINT image_len)
+{
+    HANDLE handle;
+
+    request_code = 0;
+    request_len  = 0;
+    handle = WinDivertOpenCompiled(image, image_len, 0, 0);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+        CHECK(request_code == 0);
+        return NULL;
+    }
+    CloseHandle(handle);
+    CHECK(request_code == IOCTL_WINDIVERT_OPEN);
+    return Decode(request, request_len);
+}
+
+/*
+ * Round trip: compile each filter to a filter object, copy the object's
+ * bytes, and reopen it with WinDivertOpenCompiled() (as the driver sees it)
+ * and WinDivertHelperFilterOpen().  Both must give the same verdicts as the
+ * filter string opened with WinDivertOpen().
+ */
+static void TestRoundTrip(void)
+{
+    static UINT8 object[MAX_IMAGE], image[MAX_IMAGE], expected[MAX_MESSAGE];
+    filter_t filter, reopened;
+    HANDLE handle;
+    UINT object_len, expected_len, layer, i;
+
+    for (layer = 0; layer <= WINDIVERT_LAYER_MAX; layer++)
+    {
+        for (i = 0; i < NUM_FILTERS; i++)
+        {
+            // The size, then the object:
+            object_len = 0;
+            CHECK(!WinDivertFilterCompile(filters[i], (WINDIVERT_LAYER)layer,
+                NULL, 0, &object_len));
+            CHECK(GetLastError() == ERROR_INSUFFICIENT_BUFFER);
+            CHECK(object_len >= sizeof(WINDIVERT_FILTER_OBJECT) &&
+                object_len <= sizeof(object));
+            CHECK(WinDivertFilterCompile(filters[i], (WINDIVERT_LAYER)layer,
+                object, sizeof(object), &object_len));
+            memcpy(image, object, object_len);
+            memset(object, 0, sizeof(object));
+
+            // The filter string:
+            request_code = 0;
+            handle = WinDivertOpen(filters[i], (WINDIVERT_LAYER)layer, 0, 0);
+            CHECK(handle != INVALID_HANDLE_VALUE);
+            CloseHandle(handle);
+            CHECK(request_code == IOCTL_WINDIVERT_OPEN);
+            expected_len = request_len;
+            memcpy(expected, request, request_len);
+            filter = Decode(expected, expected_len);
+            CHECK(filter != NULL);
+
+            // The image sends the same request:
+            reopened = OpenImage(image, object_len);
+            CHECK(reopened != NULL);
+            CHECK(request_len == expected_len &&
+                memcmp(request, expected, expected_len) == 0);
+            if (filter != NULL && reopened != NULL)
+            {
+                CHECK(Verdicts(reopened) == Verdicts(filter));
+            }
+
+            handle = WinDivertHelperFilterOpen(image, object_len);
+            CHECK(handle != INVALID_HANDLE_VALUE);
+            if (filter != NULL && handle != INVALID_HANDLE_VALUE)
+            {
+                CHECK(EvalVerdicts(handle) == Verdicts(filter));
+            }
+            WinDivertHelperFilterClose(handle);
+            free(filter);
+            free(reopened);
+        }
+    }
+}
+
+/*
+ * Reopen a modified copy of image; the result must be rejected.
+ */
+#define CHECK_REJECT_IMAGE(field, value)                                    \
+    do                                                                      \
+    {                                                                       \
+        memcpy(corrupt, image, image_len);                                  \
+        ((PWINDIVERT_FILTER_OBJECT)corrupt)->field = (value);               \
+        CHECK(OpenImage(corrupt, image_len) == NULL);                       \
+        CHECK(WinDivertHelperFilterOpen(corrupt, image_len) ==              \
+            INVALID_HANDLE_VALUE);                                          \
+    } while (FALSE)
+
+/*
+ * Corrupted and truncated filter objects: a bad header is rejected by the
+ * DLL; a consistent header over a truncated body is rejected by
+ * windivert_open_verify() and windivert_filter_load().  Random corruption
+ * must never crash either.
+ */
+static void TestImages(void)
+{
+    static UINT8 image[MAX_IMAGE], corrupt[MAX_IMAGE];
+    PWINDIVERT_FILTER_OBJECT object = (PWINDIVERT_FILTER_OBJECT)corrupt;
+    filter_t filter;
+    HANDLE handle;
+    UINT image_len, program_len, len, rejected, i, j;
+
+    for (i = 0; i < NUM_FILTERS; i++)
+    {
+        CHECK(WinDivertFilterCompile(filters[i], WINDIVERT_LAYER_NETWORK,
+            image, sizeof(image), &image_len));
+        program_len = ((PWINDIVERT_FILTER_OBJECT)image)->filter_len *
+            sizeof(struct windivert_ioctl_filter_s);
+
+        // Bad header fields:
+        CHECK_REJECT_IMAGE(magic, WINDIVERT_FILTER_OBJECT_MAGIC + 1);
+        CHECK_REJECT_IMAGE(version, WINDIVERT_IOCTL_VERSION + 1);
+        CHECK_REJECT_IMAGE(layer, WINDIVERT_LAYER_MAX + 1);
+        CHECK_REJECT_IMAGE(filter_len, WINDIVERT_FILTER_MAXLEN);
+        CHECK_REJECT_IMAGE(filter_len,
+            ((PWINDIVERT_FILTER_OBJECT)image)->filter_len + 1);
+        CHECK_REJECT_IMAGE(automata_len,
+            ((PWINDIVERT_FILTER_OBJECT)image)->automata_len + 1);
+        CHECK_REJECT_IMAGE(automata_len,
+            WINDIVERT_FILTER_AUTOMATA_MAXLEN + 1);
+
+        // Truncated or extended images:
+        memcpy(corrupt, image, image_len);
+        CHECK(OpenImage(corrupt, 0) == NULL);
+        CHECK(OpenImage(NULL, image_len) == NULL);
+        CHECK(OpenImage(corrupt, sizeof(WINDIVERT_FILTER_OBJECT) - 1) ==
+            NULL);
+        CHECK(OpenImage(corrupt, image_len - 1) == NULL);
+        CHECK(OpenImage(corrupt, image_len + 1) == NULL);
+        CHECK(WinDivertHelperFilterOpen(corrupt, image_len - 1) ==
+            INVALID_HANDLE_VALUE);
+
+        // A consistent header, but the last instruction (which some earlier
+        // instruction jumps to) or the last automaton byte is missing:
+        if (object->filter_len > 1)
+        {
+            memcpy(corrupt, image, image_len);
+            object->filter_len--;
+            memmove(corrupt + sizeof(WINDIVERT_FILTER_OBJECT) + program_len -
+                sizeof(struct windivert_ioctl_filter_s),
+                image + sizeof(WINDIVERT_FILTER_OBJECT) + program_len,
+                object->automata_len);
+            CHECK(OpenImage(corrupt, image_len -
+                sizeof(struct windivert_ioctl_filter_s)) == NULL);
+        }
+        if (object->automata_len > 0)
+        {
+            memcpy(corrupt, image, image_len);
+            object->automata_len--;
+            CHECK(OpenImage(corrupt, image_len - 1) == NULL);
+        }
+    }
+
+    // Random corruption (in the header, the program or the automata):
+    rejected = 0;
+    for (i = 0; i < NUM_IMAGES; i++)
+    {
+        CHECK(WinDivertFilterCompile(filters[i % NUM_FILTERS],
+            WINDIVERT_LAYER_NETWORK, image, sizeof(image), &image_len));
+        memcpy(corrupt, image, image_len);
+        len = (TestRandom() % 4 == 0? TestRandom() % (image_len + 1):
+            image_len);
+        for (j = 1 + TestRandom() % 4; j > 0 && len > 0; j--)
+        {
+            corrupt[TestRandom() % len] ^= (UINT8)(1 << (TestRandom() % 8));
+        }
+        filter = OpenImage(corrupt, len);
+        if (filter == NULL)
+        {
+            rejected++;
+            continue;
+        }
+        CheckDecoded(request, filter);
+        free(filter);
+        handle = WinDivertHelperFilterOpen(corrupt, len);
+        CHECK(handle != INVALID_HANDLE_VALUE);
+        WinDivertHelperFilterClose(handle);
+    }
+    CHECK(rejected > 0 && rejected < NUM_IMAGES);
+}
+
+/*
+ * Decode a modified copy of the last request; the result must be rejected.
+ */
+#define CHECK_REJECT(field, value)                                          \
+    do                                                                      \
+    {                                                                       \
+        memcpy(message, request, request_len);                              \
+        ((windivert_ioctl_open_t)message)->field = (value);                 \
+        CHECK(Decode(message, request_len) == NULL);                        \
+    } while (FALSE)
+
+int main(void)
+{
+    static UINT8 message[MAX_MESSAGE];
+    windivert_ioctl_open_t ioctl_open = (windivert_ioctl_open_t)request;
+    PWINDIVERT_FILTER_OBJECT object;
+    filter_t expected, filter;
+    WINDIVERT_LAYER layer;
+    PWINDIVERT_TCPHDR tcp_header;
+    INT16 priority;
+    UINT64 flags;
+    UINT object_len, accepted, i, j;
+    size_t len;
+
+    shim_device_io_control = DeviceIoControlHook;
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        packet_lens[i] = TestPacket(packets[i], i % 3 == 1,
+            (i % 3 == 2? IPPROTO_UDP: IPPROTO_TCP), 1234, (i < 4? 80: 53),
+            (i % 2 == 0? "GET / HTTP/1.1\r\nHost: x\r\n": "dns"));
+        if (i % 3 != 2)
+        {
+            tcp_header = (PWINDIVERT_TCPHDR)(packets[i] + (i % 3 == 1?
+                sizeof(WINDIVERT_IPV6HDR): sizeof(WINDIVERT_IPHDR)));
+            tcp_header->Syn = (i >= 6);
+        }
+    }
+
+    // Encoder: the request holds the parameters and the filter object, and
+    // decodes to the same filter.
+    for (i = 0; i < NUM_ENCODE; i++)
+    {
+        object = Encode(&object_len, &priority, &flags, &layer);
+        CHECK(object != NULL);
+        if (object == NULL)
+        {
+            break;
+        }
+        CHECK(request_code == IOCTL_WINDIVERT_OPEN);
+        CHECK(request_len == sizeof(struct windivert_ioctl_open_s) +
+            object_len - sizeof(WINDIVERT_FILTER_OBJECT));
+        CHECK(ioctl_open->version == WINDIVERT_IOCTL_OPEN_VERSION);
+        CHECK(ioctl_open->layer == layer);
+        CHECK(ioctl_open->filter_len == object->filter_len);
+        CHECK(ioctl_open->priority == WINDIVERT_PRIORITY(priority));
+        CHECK(ioctl_open->flags == flags);
+        CHECK(ioctl_open->queue_len == 0 && ioctl_open->queue_time == 0);
+        CHECK(memcmp(ioctl_open + 1, object + 1,
+            object_len - sizeof(WINDIVERT_FILTER_OBJECT)) == 0);
+
+        filter = Decode(request, request_len);
+        expected = WinDivertLoadFilter(object);
+        CHECK(filter != NULL && expected != NULL);
+        if (filter != NULL && expected != NULL)
+        {
+            CheckDecoded(request, filter);
+            CHECK(Verdicts(filter) == Verdicts(expected));
+        }
+        free(filter);
+        free(expected);
+
+        // Bad header fields:
+        CHECK_REJECT(version, WINDIVERT_IOCTL_OPEN_VERSION + 1);
+        CHECK_REJECT(layer, WINDIVERT_LAYER_MAX + 1);
+        CHECK_REJECT(flags, WINDIVERT_FLAG_SNIFF | WINDIVERT_FLAG_DROP);
+        CHECK_REJECT(flags, 0x8);
+        CHECK_REJECT(priority, WINDIVERT_PRIORITY_MAX + 1);
+        CHECK_REJECT(queue_len, WINDIVERT_PARAM_QUEUE_LEN_MAX + 1);
+        CHECK_REJECT(queue_time, WINDIVERT_PARAM_QUEUE_TIME_MIN - 1);
+        CHECK_REJECT(queue_time, WINDIVERT_PARAM_QUEUE_TIME_MAX + 1);
+        CHECK_REJECT(filter_len, 0);
+        CHECK_REJECT(filter_len, WINDIVERT_FILTER_MAXLEN);
+        CHECK_REJECT(filter_len, object->filter_len + 1);
+
+        // Truncated (the header, the program, or an automaton):
+        CHECK(Decode(request, sizeof(struct windivert_ioctl_open_s) - 1) ==
+            NULL);
+        CHECK(Decode(request, request_len - 1) == NULL);
+
+        // A backward jump:
+        memcpy(message, request, request_len);
+        ((windivert_ioctl_filter_t)(message +
+            sizeof(struct windivert_ioctl_open_s)))[0].success = 0;
+        CHECK(Decode(message, request_len) == NULL);
+
+        // Valid queue parameters are accepted:
+        memcpy(message, request, request_len);
+        ((windivert_ioctl_open_t)message)->queue_len =
+            WINDIVERT_PARAM_QUEUE_LEN_MAX;
+        ((windivert_ioctl_open_t)message)->queue_time =
+            WINDIVERT_PARAM_QUEUE_TIME_MIN;
+        filter = Decode(message, request_len);
+        CHECK(filter != NULL);
+        free(filter);
+        free(object);
+    }
+
+    // Decoder: random mutations must never crash, and anything accepted
+    // must satisfy the driver's invariants.
+    accepted = 0;
+    for (i = 0; i < NUM_DECODE; i++)
+    {
+        object = Encode(&object_len, &priority, &flags, &layer);
+        if (object == NULL)
+        {
+            CHECK(object != NULL);
+            break;
+        }
+        free(object);
+        memcpy(message, request, request_len);
+        len = request_len;
+        switch (TestRandom() % 4)
+        {
+            case 0:
+                len = TestRandom() % (request_len + 1);
+                break;
+            case 1:
+                for (j = 0; j < 16 && len < sizeof(message); j++)
+                {
+                    message[len++] = (UINT8)TestRandom();
+                }
+                break;
+        }
+        for (j = 1 + TestRandom() % 4; j > 0 && len > 0; j--)
+        {
+            message[TestRandom() % len] ^= (UINT8)(1 << (TestRandom() % 8));
+        }
+        filter = Decode(message, len);
+        if (filter != NULL)
+        {
+            accepted++;
+            CheckDecoded(message, filter);
+            free(filter);
+        }
+    }
+    CHECK(accepted > 0 && accepted < NUM_DECODE);
+
+    TestRoundTrip();
+    TestImages();
+
+    return TestResult("test_open");
+}
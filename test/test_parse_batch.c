@@ -0,0 +1,272 @@
+/*
+ * test_parse_batch.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that WinDivertHelperParsePacketBatch() gives the same results for
+ * each packet as WinDivertHelperParsePacket(), for a mix of IPv4/IPv6,
+ * fragmented, truncated and malformed packets, and batch sizes either side
+ * of the chunk size.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_ROUNDS      300
+#define BATCH_MAX       200
+#define PACKET_MAX      256
+
+static UINT8 data[BATCH_MAX][PACKET_MAX];
+static PVOID packets[BATCH_MAX];
+static UINT packet_lens[BATCH_MAX];
+
+static UINT8 version[BATCH_MAX];
+static UINT8 protocol[BATCH_MAX];
+static UINT32 src_addr[4*BATCH_MAX];
+static UINT32 dst_addr[4*BATCH_MAX];
+static UINT16 src_port[BATCH_MAX];
+static UINT16 dst_port[BATCH_MAX];
+static UINT payload_offset[BATCH_MAX];
+static UINT payload_len[BATCH_MAX];
+
+/*
+ * A random packet: well formed, with IPv4 options, a non-first fragment,
+ * truncated, or with random header bytes.
+ */
+static UINT RandomPacket(UINT8 *packet)
+{
+    static const char *payloads[] = {"", "x", "GET / HTTP/1.1\r\n"};
+    static const UINT8 protocols[] =
+        {IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP, IPPROTO_ICMPV6, 47};
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+    PWINDIVERT_TCPHDR tcp_header;
+    BOOL ipv6 = (TestRandom() % 2 == 0);
+    UINT8 proto = protocols[TestRandom() % 5];
+    UINT ip_len = (ipv6? sizeof(WINDIVERT_IPV6HDR): sizeof(WINDIVERT_IPHDR));
+    UINT packet_len, options, i;
+
+    packet_len = TestPacket(packet, ipv6, proto, 1000 + TestRandom() % 100,
+        80, payloads[TestRandom() % 3]);
+    switch (TestRandom() % 8)
+    {
+        case 0:
+            // IPv4 options:
+            if (ipv6)
+            {
+                break;
+            }
+            options = 4 * (1 + TestRandom() % 10);
+            memmove(packet + ip_len + options, packet + ip_len,
+                packet_len - ip_len);
+            memset(packet + ip_len, 0x01, options);
+            packet_len += options;
+            ip_header->HdrLength = (UINT8)((ip_len + options) / 4);
+            ip_header->Length = htons((UINT16)packet_len);
+            break;
+        case 1:
+            // Non-first fragment (for IPv6, a fragment without a transport
+            // header is just an unknown NextHdr):
+            if (ipv6)
+            {
+                ipv6_header->NextHdr = 44;
+                break;
+            }
+            WINDIVERT_IPHDR_SET_FRAGOFF(ip_header,
+                htons((UINT16)(1 + TestRandom() % 100)));
+            break;
+        case 2:
+            // Truncated, with the IP length either fixed up or not:
+            packet_len = TestRandom() % (packet_len + 1);
+            if (TestRandom() % 2 == 0)
+            {
+                break;
+            }
+            if (ipv6 && packet_len >= ip_len)
+            {
+                ipv6_header->Length = htons((UINT16)(packet_len - ip_len));
+            }
+            else if (!ipv6 && packet_len >= ip_len)
+            {
+                ip_header->Length = htons((UINT16)packet_len);
+            }
+            break;
+        case 3:
+            // Bad TCP header length:
+            if (proto == IPPROTO_TCP)
+            {
+                tcp_header = (PWINDIVERT_TCPHDR)(packet + ip_len);
+                tcp_header->HdrLength = (UINT16)(TestRandom() % 16);
+            }
+            break;
+        case 4:
+            // Random header bytes:
+            for (i = 0; i < 3; i++)
+            {
+                packet[TestRandom() % (ip_len + 8)] = (UINT8)TestRandom();
+            }
+            break;
+        default:
+            break;
+    }
+    return packet_len;
+}
+
+/*
+ * Check entry i of the columns against WinDivertHelperParsePacket().
+ */
+static void CheckPacket(UINT i, BOOL all_columns)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_UDPHDR udp_header;
+    PVOID data_ptr;
+    UINT data_len;
+    UINT8 exp_version = 0, exp_protocol = 0;
+    UINT32 exp_src[4] = {0}, exp_dst[4] = {0};
+    UINT16 exp_sport = 0, exp_dport = 0;
+    UINT exp_offset = 0, exp_len = 0;
+
+    if (packets[i] == NULL)
+    {
+        ip_header = NULL;
+        ipv6_header = NULL;
+    }
+    else
+    {
+        WinDivertHelperParsePacket(packets[i], packet_lens[i], &ip_header,
+            &ipv6_header, NULL, NULL, &tcp_header, &udp_header, &data_ptr,
+            &data_len);
+    }
+    if (ip_header != NULL)
+    {
+        exp_version  = 4;
+        exp_protocol = ip_header->Protocol;
+        exp_src[2]   = htonl(0x0000FFFFu);
+        exp_src[3]   = ip_header->SrcAddr;
+        exp_dst[2]   = htonl(0x0000FFFFu);
+        exp_dst[3]   = ip_header->DstAddr;
+    }
+    else if (ipv6_header != NULL)
+    {
+        exp_version  = 6;
+        exp_protocol = ipv6_header->NextHdr;
+        memcpy(exp_src, ipv6_header->SrcAddr, sizeof(exp_src));
+        memcpy(exp_dst, ipv6_header->DstAddr, sizeof(exp_dst));
+    }
+    if (exp_version != 0)
+    {
+        // The payload (or, if the transport header is invalid, the rest of
+        // the packet) runs to the end of the packet:
+        exp_len    = data_len;
+        exp_offset = packet_lens[i] - data_len;
+        if (tcp_header != NULL)
+        {
+            exp_sport = tcp_header->SrcPort;
+            exp_dport = tcp_header->DstPort;
+        }
+        else if (udp_header != NULL)
+        {
+            exp_sport = udp_header->SrcPort;
+            exp_dport = udp_header->DstPort;
+        }
+    }
+
+    CHECK(version[i] == exp_version);
+    CHECK(payload_offset[i] == exp_offset);
+    if (!all_columns)
+    {
+        return;
+    }
+    CHECK(protocol[i] == exp_protocol);
+    CHECK(memcmp(src_addr + 4*i, exp_src, sizeof(exp_src)) == 0);
+    CHECK(memcmp(dst_addr + 4*i, exp_dst, sizeof(exp_dst)) == 0);
+    CHECK(src_port[i] == exp_sport);
+    CHECK(dst_port[i] == exp_dport);
+    CHECK(payload_len[i] == exp_len);
+}
+
+int main(void)
+{
+    static const UINT sizes[] = {0, 1, 63, 64, 65, 128, BATCH_MAX};
+    WINDIVERT_PACKET_COLUMNS columns;
+    UINT round, count, parsed, expected, i;
+    BOOL all_columns;
+
+    for (round = 0; round < NUM_ROUNDS; round++)
+    {
+        count = sizes[round % (sizeof(sizes) / sizeof(sizes[0]))];
+        expected = 0;
+        for (i = 0; i < count; i++)
+        {
+            packet_lens[i] = RandomPacket(data[i]);
+            packets[i] = (TestRandom() % 50 == 0? NULL: data[i]);
+        }
+
+        // Poison the columns, so that unwritten entries are caught:
+        memset(version, 0xAA, sizeof(version));
+        memset(protocol, 0xAA, sizeof(protocol));
+        memset(src_addr, 0xAA, sizeof(src_addr));
+        memset(dst_addr, 0xAA, sizeof(dst_addr));
+        memset(src_port, 0xAA, sizeof(src_port));
+        memset(dst_port, 0xAA, sizeof(dst_port));
+        memset(payload_offset, 0xAA, sizeof(payload_offset));
+        memset(payload_len, 0xAA, sizeof(payload_len));
+
+        // Every other round only asks for some of the columns:
+        all_columns = (round % 2 == 0);
+        memset(&columns, 0, sizeof(columns));
+        columns.Version       = version;
+        columns.PayloadOffset = payload_offset;
+        if (all_columns)
+        {
+            columns.Protocol      = protocol;
+            columns.SrcAddr       = src_addr;
+            columns.DstAddr       = dst_addr;
+            columns.SrcPort       = src_port;
+            columns.DstPort       = dst_port;
+            columns.PayloadLength = payload_len;
+        }
+
+        parsed = WinDivertHelperParsePacketBatch(packets, packet_lens,
+            count, &columns);
+        for (i = 0; i < count; i++)
+        {
+            CheckPacket(i, all_columns);
+            expected += (version[i] != 0);
+        }
+        CHECK(parsed == expected);
+        if (!all_columns)
+        {
+            CHECK(protocol[0] == 0xAA && payload_len[0] == 0xAAAAAAAAu);
+        }
+        CHECK(count == BATCH_MAX || version[count] == 0xAA);
+    }
+
+    // Invalid parameters:
+    SetLastError(0);
+    CHECK(WinDivertHelperParsePacketBatch(NULL, packet_lens, 1,
+        &columns) == 0);
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+    SetLastError(0);
+    CHECK(WinDivertHelperParsePacketBatch(packets, packet_lens, 1,
+        NULL) == 0);
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+
+    return TestResult("test_parse_batch");
+}
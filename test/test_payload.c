@@ -0,0 +1,353 @@
+/*
+ * test_payload.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the filter interpreter on packets that are not contiguous, as in
+ * the driver: there a packet is a chain of buffers (MDLs), only the start of
+ * which may be mapped, and windivert_packet_data() copies the bytes needed
+ * into storage, or fails (returns NULL).
+ *
+ * Unlike the other tests, this one does not include dll/windivert.c: the
+ * shared interpreter (dll/windivert_shared.c) is built here with such a
+ * packet type, and its verdicts are compared with the DLL's
+ * WinDivertHelperEvalFilter() on the same (contiguous) packets.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "windivert.h"
+#include "windivert_device.h"
+
+#define MAX_SEGMENTS    8
+#define NUM_PACKETS     5000
+
+/*
+ * A packet split into segments (each a separate allocation, so that reading
+ * past a segment is caught by sanitizers).
+ */
+typedef struct
+{
+    UINT count;                                 // Number of segments
+    UINT8 *segs[MAX_SEGMENTS];                  // Segment data
+    size_t seg_lens[MAX_SEGMENTS];              // Segment lengths
+    size_t len;                                 // Packet length
+    BOOL fail;                                  // Copying fails?
+} TEST_PACKET, *PTEST_PACKET;
+typedef PTEST_PACKET windivert_packet_t;
+#define DEBUG(format, ...)
+#include "../dll/windivert_shared.c"
+#include "test.h"
+
+/*
+ * The compiled filter object header (see WinDivertFilterCompile() in
+ * dll/windivert.c); the filter program and automata follow it.
+ */
+#pragma pack(push, 1)
+typedef struct
+{
+    UINT32 magic;
+    UINT8  version;
+    UINT8  layer;
+    UINT16 filter_len;
+    UINT32 automata_len;
+} FILTER_OBJECT_HDR;
+#pragma pack(pop)
+
+static const char *filters[] =
+{
+    "true",
+    "outbound and ifIdx == 3",
+    "tcp.DstPort == 80",
+    "ip.TTL == 64 or ipv6.HopLimit == 64",
+    "tcp.Payload[0:4] == \"GET \"",
+    "tcp.Payload[0] != 0x47",
+    "tcp.Payload[4] == 0x2F and tcp.DstPort == 80",
+    "udp.Payload[0:2] == 0x6F73",
+    "tcp.Payload[30:4] == \"host\" or udp.Payload[2] == 0x74",
+    "tcp.PayloadLength > 40 and tcp.Payload[40] == 0x61",
+    "tcp.Payload contains {\"Host\"}",
+    "udp.Payload contains {\"host\", \"GET /\"}",
+    "not tcp.Payload contains {\"os\"}",
+    "tcp.Payload[30] != 0x68",
+};
+#define NUM_FILTERS     (sizeof(filters) / sizeof(filters[0]))
+
+/*
+ * Packet access, as in the driver (see sys/windivert.c).
+ */
+static size_t windivert_packet_length(PTEST_PACKET packet)
+{
+    return packet->len;
+}
+
+static UINT8 *windivert_packet_data(PTEST_PACKET packet, size_t len,
+    UINT8 *storage)
+{
+    size_t pos, seg_len;
+    UINT i;
+
+    if (len <= packet->seg_lens[0])
+    {
+        return packet->segs[0];
+    }
+    if (packet->fail || len > packet->len)
+    {
+        return NULL;
+    }
+    for (i = 0, pos = 0; pos < len; i++)
+    {
+        seg_len = packet->seg_lens[i];
+        seg_len = (len - pos < seg_len? len - pos: seg_len);
+        memcpy(storage + pos, packet->segs[i], seg_len);
+        pos += seg_len;
+    }
+    return storage;
+}
+
+static BOOL windivert_packet_contains(PTEST_PACKET packet, size_t offset,
+    windivert_ioctl_automaton_t automaton)
+{
+    UINT32 state = automaton->classes;      // Start state
+    size_t len;
+    UINT i;
+
+    for (i = 0; i < packet->count; i++)
+    {
+        if (offset >= packet->seg_lens[i])
+        {
+            offset -= packet->seg_lens[i];
+            continue;
+        }
+        len = packet->seg_lens[i] - offset;
+        if (windivert_automaton_match(automaton, packet->segs[i] + offset,
+                len, &state))
+        {
+            return TRUE;
+        }
+        offset = 0;
+    }
+    return FALSE;
+}
+
+static void windivert_packet_prefetch(PTEST_PACKET packet)
+{
+    return;
+}
+
+/*
+ * Split a packet into segments at the given cut points (in order).
+ */
+static void Split(PTEST_PACKET packet, const UINT8 *data, UINT len,
+    const UINT *cuts, UINT num_cuts)
+{
+    UINT start = 0, end, i;
+
+    packet->count = 0;
+    packet->len   = len;
+    packet->fail  = FALSE;
+    for (i = 0; i <= num_cuts; i++)
+    {
+        end = (i < num_cuts? cuts[i]: len);
+        packet->seg_lens[i] = end - start;
+        packet->segs[i] = (UINT8 *)malloc(end - start + 1);
+        memcpy(packet->segs[i], data + start, end - start);
+        packet->count++;
+        start = end;
+    }
+}
+
+static void Free(PTEST_PACKET packet)
+{
+    UINT i;
+
+    for (i = 0; i < packet->count; i++)
+    {
+        free(packet->segs[i]);
+    }
+}
+
+/*
+ * Compile a filter for both the DLL and the interpreter built here.
+ */
+static BOOL Compile(const char *filter_str, HANDLE *handle, filter_t *filter)
+{
+    static UINT8 object[sizeof(FILTER_OBJECT_HDR) +
+        WINDIVERT_FILTER_MAXLEN*sizeof(struct windivert_ioctl_filter_s) +
+        WINDIVERT_FILTER_AUTOMATA_MAXLEN];
+    const FILTER_OBJECT_HDR *hdr = (const FILTER_OBJECT_HDR *)object;
+    windivert_ioctl_filter_t ioctl_filter =
+        (windivert_ioctl_filter_t)(hdr + 1);
+    UINT object_len;
+
+    if (!WinDivertFilterCompile(filter_str, WINDIVERT_LAYER_NETWORK, object,
+            sizeof(object), &object_len))
+    {
+        return FALSE;
+    }
+    *handle = WinDivertHelperFilterOpen(object, object_len);
+    *filter = (filter_t)malloc(hdr->filter_len * sizeof(struct filter_s) +
+        hdr->automata_len);
+    if (*handle == INVALID_HANDLE_VALUE || *filter == NULL)
+    {
+        return FALSE;
+    }
+    memcpy(*filter + hdr->filter_len, ioctl_filter + hdr->filter_len,
+        hdr->automata_len);
+    return windivert_filter_load(ioctl_filter, hdr->filter_len,
+        (UINT8 *)(*filter + hdr->filter_len), hdr->automata_len, *filter);
+}
+
+/*
+ * A random TCP/UDP packet (IPv4, maybe with options, or IPv6) with a payload
+ * made from a few words, so that the payload filters sometimes match.
+ */
+static UINT RandomPacket(UINT8 *packet)
+{
+    static const char *words[] = {"GET ", "/", "Host", "host", "os", "a"};
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    char payload[256];
+    BOOL ipv6 = (TestRandom() % 3 == 0);
+    UINT8 protocol = (TestRandom() % 3 == 0? IPPROTO_UDP: IPPROTO_TCP);
+    UINT packet_len, opt_len, hdr_len, n, i;
+
+    payload[0] = '\0';
+    n = TestRandom() % 24;
+    for (i = 0; i < n; i++)
+    {
+        strcat(payload, words[TestRandom() % 6]);
+    }
+    packet_len = TestPacket(packet, ipv6, protocol,
+        (UINT16)(1000 + TestRandom() % 2), (TestRandom() % 2 == 0? 80: 53),
+        payload);
+    if (!ipv6 && TestRandom() % 4 == 0)
+    {
+        // IPv4 options (NOPs):
+        hdr_len = sizeof(WINDIVERT_IPHDR);
+        opt_len = 4 * (1 + TestRandom() % 10);
+        memmove(packet + hdr_len + opt_len, packet + hdr_len,
+            packet_len - hdr_len);
+        memset(packet + hdr_len, 0x01, opt_len);
+        packet_len += opt_len;
+        ip_header->HdrLength = (UINT8)((hdr_len + opt_len) / 4);
+        ip_header->Length    = htons((UINT16)packet_len);
+    }
+    return packet_len;
+}
+
+static int __cdecl CompareCut(const void *a, const void *b)
+{
+    UINT x = *(const UINT *)a, y = *(const UINT *)b;
+
+    return (x < y? -1: (x > y? 1: 0));
+}
+
+int main(void)
+{
+    HANDLE handles[NUM_FILTERS];
+    filter_t compiled[NUM_FILTERS];
+    WINDIVERT_ADDRESS addr;
+    TEST_PACKET packet;
+    UINT8 data[256];
+    UINT cuts[MAX_SEGMENTS-1], len, num_cuts, hdr_len, i, j;
+    BOOL expected, result;
+
+    for (i = 0; i < NUM_FILTERS; i++)
+    {
+        CHECK(Compile(filters[i], &handles[i], &compiled[i]));
+    }
+    if (test_failures != 0)
+    {
+        return TestResult("test_payload");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.IfIdx     = 3;
+    addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+
+    // Split packets give the same verdicts as contiguous packets:
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        len = RandomPacket(data);
+        num_cuts = TestRandom() % MAX_SEGMENTS;
+        for (j = 0; j < num_cuts; j++)
+        {
+            cuts[j] = TestRandom() % (len + 1);
+        }
+        qsort(cuts, num_cuts, sizeof(UINT), CompareCut);
+        Split(&packet, data, len, cuts, num_cuts);
+        for (j = 0; j < NUM_FILTERS; j++)
+        {
+            expected = WinDivertHelperEvalFilter(handles[j], data, len,
+                &addr);
+            result = windivert_filter(&packet, 3, 0, TRUE, compiled[j],
+                NULL);
+            CHECK(result == expected);
+            if (result != expected)
+            {
+                fprintf(stderr, "\tfilter \"%s\", packet %u (%u segments)\n",
+                    filters[j], i, packet.count);
+            }
+        }
+        Free(&packet);
+    }
+
+    // If the payload cannot be copied, payload fields beyond the header
+    // bytes already fetched do not match (whatever the test), but the
+    // headers can still be filtered on:
+    len = TestPacket(data, FALSE, IPPROTO_TCP, 1000, 80,
+        "GET /xxxxxxxxxxxxxxxxxxxxxxxxxhostyyyyyyazz");
+    hdr_len = sizeof(WINDIVERT_IPHDR) + sizeof(WINDIVERT_TCPHDR);
+    cuts[0] = sizeof(WINDIVERT_IPV6HDR) + sizeof(WINDIVERT_TCPHDR);
+    Split(&packet, data, len, cuts, 1);
+    packet.fail = TRUE;
+    CHECK(windivert_filter(&packet, 3, 0, TRUE, compiled[2], NULL));
+    CHECK(windivert_filter(&packet, 3, 0, TRUE, compiled[4], NULL));
+    CHECK(!windivert_filter(&packet, 3, 0, TRUE, compiled[8], NULL));
+    CHECK(!windivert_filter(&packet, 3, 0, TRUE, compiled[9], NULL));
+    packet.fail = FALSE;
+    CHECK(windivert_filter(&packet, 3, 0, TRUE, compiled[8], NULL));
+    CHECK(windivert_filter(&packet, 3, 0, TRUE, compiled[9], NULL));
+    CHECK(!windivert_filter(&packet, 3, 0, TRUE, compiled[13], NULL));
+    Free(&packet);
+    data[hdr_len + 30] = 'X';
+    Split(&packet, data, len, cuts, 1);
+    CHECK(windivert_filter(&packet, 3, 0, TRUE, compiled[13], NULL));
+    packet.fail = TRUE;
+    CHECK(!windivert_filter(&packet, 3, 0, TRUE, compiled[13], NULL));
+    Free(&packet);
+
+    // ... and if the headers cannot be copied, only metadata filters match:
+    cuts[0] = sizeof(WINDIVERT_IPHDR) - 1;
+    Split(&packet, data, len, cuts, 1);
+    packet.fail = TRUE;
+    for (i = 0; i < NUM_FILTERS; i++)
+    {
+        result = windivert_filter(&packet, 3, 0, TRUE, compiled[i], NULL);
+        CHECK(result == (i <= 1));
+    }
+    Free(&packet);
+
+    for (i = 0; i < NUM_FILTERS; i++)
+    {
+        WinDivertHelperFilterClose(handles[i]);
+        free(compiled[i]);
+    }
+    return TestResult("test_payload");
+}
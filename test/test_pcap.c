@@ -0,0 +1,451 @@
+/*
+ * test_pcap.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks pcapng capture files (WinDivertHelperPcapWrite() etc.): the files
+ * written are parsed back block by block (block lengths, padding, options)
+ * and must hold exactly the packets written, with their interfaces,
+ * directions and timestamps, including across size and time rotation.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_PACKETS     3000
+#define NUM_ROTATE      3200
+#define MAX_RECORDS     4096
+#define MAX_FILES       16
+
+/*
+ * A packet read back from a capture file.
+ */
+typedef struct
+{
+    const UINT8 *data;
+    UINT32 len;
+    UINT32 if_idx;
+    UINT32 sub_if_idx;
+    UINT32 flags;
+    UINT64 timestamp;                       // Microseconds since 1970
+} RECORD;
+
+static RECORD records[MAX_RECORDS];
+static UINT8 *packets[MAX_RECORDS];
+static UINT packet_lens[MAX_RECORDS];
+static WINDIVERT_ADDRESS addrs[MAX_RECORDS];
+
+static UINT64 Now(void)
+{
+    FILETIME now;
+    UINT64 timestamp;
+
+    GetSystemTimeAsFileTime(&now);
+    timestamp = ((((UINT64)now.dwHighDateTime) << 32) | now.dwLowDateTime);
+    return (timestamp - WINDIVERT_PCAP_EPOCH) / 10;
+}
+
+/*
+ * Read a whole file into a (malloc'ed) buffer.
+ */
+static UINT8 *ReadAll(const char *name, UINT *len)
+{
+    FILE *stream = fopen(name, "rb");
+    UINT8 *buf;
+    long size;
+
+    if (stream == NULL)
+    {
+        return NULL;
+    }
+    fseek(stream, 0, SEEK_END);
+    size = ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+    buf = (UINT8 *)malloc(size + 1);
+    if (buf == NULL || fread(buf, 1, size, stream) != (size_t)size)
+    {
+        free(buf);
+        fclose(stream);
+        return NULL;
+    }
+    fclose(stream);
+    *len = (UINT)size;
+    return buf;
+}
+
+/*
+ * Check that the options at buf[0..len) are well formed, and end exactly
+ * with opt_endofopt; returns the value of option `code' (or NULL).
+ */
+static const UINT8 *ParseOptions(const UINT8 *buf, UINT len, UINT16 code,
+    UINT16 *value_len)
+{
+    const UINT8 *value = NULL;
+    UINT16 opt_code, opt_len;
+    UINT i, pos = 0;
+
+    while (TRUE)
+    {
+        if (pos + 4 > len)
+        {
+            return NULL;
+        }
+        opt_code = *(const UINT16 *)(buf + pos);
+        opt_len  = *(const UINT16 *)(buf + pos + 2);
+        pos += 4;
+        if (opt_code == WINDIVERT_PCAP_OPT_END)
+        {
+            return (opt_len == 0 && pos == len? value: NULL);
+        }
+        if (pos + ((opt_len + 3) & ~3) > len)
+        {
+            return NULL;
+        }
+        for (i = opt_len; i < ((opt_len + 3) & ~3); i++)
+        {
+            if (buf[pos + i] != 0)
+            {
+                return NULL;
+            }
+        }
+        if (opt_code == code)
+        {
+            value = buf + pos;
+            *value_len = opt_len;
+        }
+        pos += (opt_len + 3) & ~3;
+    }
+}
+
+/*
+ * Parse a capture file, appending its packets to records[].  Returns FALSE
+ * if the file is malformed.
+ */
+static BOOL ParseCapture(const UINT8 *buf, UINT len, UINT *count)
+{
+    WINDIVERT_PCAP_INTERFACE interfaces[64];
+    const UINT8 *block, *value;
+    UINT32 type, block_len, id, cap_len, pad_len, i;
+    UINT16 value_len;
+    UINT num_interfaces = 0, pos;
+    char name[32];
+
+    // Section Header Block:
+    block = buf;
+    if (len < 28 || ((const UINT32 *)block)[0] != WINDIVERT_PCAP_BLOCK_SHB ||
+        ((const UINT32 *)block)[1] != 28 ||
+        ((const UINT32 *)block)[2] != WINDIVERT_PCAP_BYTE_ORDER ||
+        ((const UINT16 *)block)[6] != 1 || ((const UINT16 *)block)[7] != 0 ||
+        ((const UINT32 *)block)[4] != 0xFFFFFFFF ||
+        ((const UINT32 *)block)[5] != 0xFFFFFFFF ||
+        ((const UINT32 *)block)[6] != 28)
+    {
+        return FALSE;
+    }
+
+    for (pos = 28; pos < len; pos += block_len)
+    {
+        block = buf + pos;
+        if (len - pos < 12)
+        {
+            return FALSE;
+        }
+        type      = ((const UINT32 *)block)[0];
+        block_len = ((const UINT32 *)block)[1];
+        if (block_len < 12 || block_len % 4 != 0 || block_len > len - pos ||
+            *(const UINT32 *)(block + block_len - 4) != block_len)
+        {
+            return FALSE;
+        }
+        switch (type)
+        {
+            case WINDIVERT_PCAP_BLOCK_IDB:
+                if (block_len < 20 || num_interfaces >= 64 ||
+                    ((const UINT16 *)block)[4] !=
+                        WINDIVERT_PCAP_LINKTYPE_RAW ||
+                    ((const UINT16 *)block)[5] != 0 ||
+                    ((const UINT32 *)block)[3] != 0)
+                {
+                    return FALSE;
+                }
+                value = ParseOptions(block + 16, block_len - 20,
+                    WINDIVERT_PCAP_OPT_IF_NAME, &value_len);
+                if (value == NULL || value_len >= sizeof(name))
+                {
+                    return FALSE;
+                }
+                memcpy(name, value, value_len);
+                name[value_len] = '\0';
+                if (sscanf(name, "%u.%u", &interfaces[num_interfaces].IfIdx,
+                        &interfaces[num_interfaces].SubIfIdx) != 2)
+                {
+                    return FALSE;
+                }
+                for (i = 0; i < num_interfaces; i++)
+                {
+                    if (interfaces[i].IfIdx ==
+                            interfaces[num_interfaces].IfIdx &&
+                        interfaces[i].SubIfIdx ==
+                            interfaces[num_interfaces].SubIfIdx)
+                    {
+                        return FALSE;       // Duplicate interface
+                    }
+                }
+                num_interfaces++;
+                break;
+
+            case WINDIVERT_PCAP_BLOCK_EPB:
+                if (block_len < 32 || *count >= MAX_RECORDS)
+                {
+                    return FALSE;
+                }
+                id      = ((const UINT32 *)block)[2];
+                cap_len = ((const UINT32 *)block)[5];
+                pad_len = (cap_len + 3) & ~3;
+                if (id >= num_interfaces ||
+                    ((const UINT32 *)block)[6] != cap_len ||
+                    28 + pad_len + 4 > block_len)
+                {
+                    return FALSE;
+                }
+                for (i = cap_len; i < pad_len; i++)
+                {
+                    if (block[28 + i] != 0)
+                    {
+                        return FALSE;
+                    }
+                }
+                value = ParseOptions(block + 28 + pad_len,
+                    block_len - 28 - pad_len - 4,
+                    WINDIVERT_PCAP_OPT_EPB_FLAGS, &value_len);
+                if (value == NULL || value_len != sizeof(UINT32))
+                {
+                    return FALSE;
+                }
+                records[*count].data       = block + 28;
+                records[*count].len        = cap_len;
+                records[*count].if_idx     = interfaces[id].IfIdx;
+                records[*count].sub_if_idx = interfaces[id].SubIfIdx;
+                records[*count].flags      = *(const UINT32 *)value;
+                records[*count].timestamp  =
+                    ((UINT64)((const UINT32 *)block)[3] << 32) |
+                    ((const UINT32 *)block)[4];
+                (*count)++;
+                break;
+
+            default:
+                return FALSE;
+        }
+    }
+    return (pos == len);
+}
+
+/*
+ * Check that records[first..first+count) match the packets written.
+ */
+static BOOL CheckRecords(UINT first, UINT count, UINT64 start, UINT64 end)
+{
+    UINT64 last = start;
+    UINT i;
+
+    for (i = first; i < first + count; i++)
+    {
+        if (records[i].len != packet_lens[i] ||
+            memcmp(records[i].data, packets[i], packet_lens[i]) != 0 ||
+            records[i].if_idx != addrs[i].IfIdx ||
+            records[i].sub_if_idx != addrs[i].SubIfIdx ||
+            records[i].flags != (addrs[i].Direction ==
+                WINDIVERT_DIRECTION_INBOUND? WINDIVERT_PCAP_FLAG_INBOUND:
+                WINDIVERT_PCAP_FLAG_OUTBOUND) ||
+            records[i].timestamp < last || records[i].timestamp > end)
+        {
+            return FALSE;
+        }
+        last = records[i].timestamp;
+    }
+    return TRUE;
+}
+
+/*
+ * Make a random packet (any bytes, of any length up to the maximum) and
+ * address, with up to num_interfaces interfaces.
+ */
+static void RandomPacket(UINT i, UINT num_interfaces, UINT max_len)
+{
+    UINT j;
+
+    switch (TestRandom() % 16)
+    {
+        case 0:
+            packet_lens[i] = TestRandom() % 4;
+            break;
+        case 1:
+            packet_lens[i] = max_len - TestRandom() % 4;
+            break;
+        default:
+            packet_lens[i] = TestRandom() % 1500;
+            break;
+    }
+    for (j = 0; j < packet_lens[i]; j++)
+    {
+        packets[i][j] = (UINT8)TestRandom();
+    }
+    memset(&addrs[i], 0, sizeof(addrs[i]));
+    j = TestRandom() % num_interfaces;
+    addrs[i].IfIdx     = 1 + j / 2;
+    addrs[i].SubIfIdx  = j % 2;
+    addrs[i].Direction = (TestRandom() % 2 == 0?
+        WINDIVERT_DIRECTION_INBOUND: WINDIVERT_DIRECTION_OUTBOUND);
+}
+
+int main(void)
+{
+    HANDLE pcap;
+    UINT8 *bufs[MAX_FILES], packet[8] = {0};
+    WINDIVERT_ADDRESS addr;
+    char name[64];
+    UINT64 start, end;
+    UINT len, count, total, num_files, i;
+
+    for (i = 0; i < MAX_RECORDS; i++)
+    {
+        packets[i] = (UINT8 *)malloc(WINDIVERT_PCAP_MAX_PACKET);
+        if (packets[i] == NULL)
+        {
+            CHECK(packets[i] != NULL);
+            return TestResult("test_pcap");
+        }
+    }
+    memset(&addr, 0, sizeof(addr));
+
+    // Invalid arguments:
+    CHECK(WinDivertHelperPcapOpen(NULL, 0, 0) == INVALID_HANDLE_VALUE);
+    CHECK(WinDivertHelperPcapOpen("test_pcap.pcapng",
+        WINDIVERT_PCAP_MIN_ROTATE_SIZE - 1, 0) == INVALID_HANDLE_VALUE);
+    CHECK(WinDivertHelperPcapOpen("test_pcap.pcapng", 0,
+        WINDIVERT_PCAP_MAX_ROTATE_TIME + 1) == INVALID_HANDLE_VALUE);
+    CHECK(WinDivertHelperPcapOpen("no/such/dir/test_pcap.pcapng", 0, 0) ==
+        INVALID_HANDLE_VALUE);
+    CHECK(!WinDivertHelperPcapWrite(NULL, packet, sizeof(packet), &addr));
+    CHECK(!WinDivertHelperPcapFlush(INVALID_HANDLE_VALUE));
+    CHECK(!WinDivertHelperPcapClose(NULL));
+
+    // Round trip (more than one write buffer, and more interfaces than
+    // initially allocated):
+    pcap = WinDivertHelperPcapOpen("test_pcap.pcapng", 0, 0);
+    CHECK(pcap != INVALID_HANDLE_VALUE);
+    if (pcap == INVALID_HANDLE_VALUE)
+    {
+        return TestResult("test_pcap");
+    }
+    CHECK(!WinDivertHelperPcapWrite(pcap, NULL, 0, &addr));
+    CHECK(!WinDivertHelperPcapWrite(pcap, packet, sizeof(packet), NULL));
+    CHECK(!WinDivertHelperPcapWrite(pcap, packets[0],
+        WINDIVERT_PCAP_MAX_PACKET + 1, &addr));
+    start = Now();
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        RandomPacket(i, 40, WINDIVERT_PCAP_MAX_PACKET);
+        CHECK(WinDivertHelperPcapWrite(pcap, packets[i], packet_lens[i],
+            addrs + i));
+        if (i == NUM_PACKETS / 2)
+        {
+            // Everything written so far is in the file after a flush:
+            CHECK(WinDivertHelperPcapFlush(pcap));
+            bufs[0] = ReadAll("test_pcap.pcapng", &len);
+            count = 0;
+            CHECK(bufs[0] != NULL && ParseCapture(bufs[0], len, &count) &&
+                count == i + 1 && CheckRecords(0, count, start, Now()));
+            free(bufs[0]);
+        }
+    }
+    CHECK(WinDivertHelperPcapClose(pcap));
+    end = Now();
+    bufs[0] = ReadAll("test_pcap.pcapng", &len);
+    count = 0;
+    CHECK(bufs[0] != NULL && ParseCapture(bufs[0], len, &count));
+    CHECK(count == NUM_PACKETS && CheckRecords(0, count, start, end));
+    free(bufs[0]);
+    remove("test_pcap.pcapng");
+
+    // Rotation by size; every file stands alone, and together they hold
+    // every packet:
+    pcap = WinDivertHelperPcapOpen("test_pcap_size.pcapng",
+        WINDIVERT_PCAP_MIN_ROTATE_SIZE, 0);
+    CHECK(pcap != INVALID_HANDLE_VALUE);
+    start = Now();
+    for (i = 0; i < NUM_ROTATE; i++)
+    {
+        RandomPacket(i, 3, 1500);
+        CHECK(WinDivertHelperPcapWrite(pcap, packets[i], packet_lens[i],
+            addrs + i));
+    }
+    CHECK(WinDivertHelperPcapClose(pcap));
+    end = Now();
+    for (num_files = 0, total = 0; num_files < MAX_FILES; num_files++)
+    {
+        sprintf(name, "test_pcap_size-%.5u.pcapng", num_files);
+        bufs[num_files] = ReadAll(name, &len);
+        if (bufs[num_files] == NULL)
+        {
+            break;
+        }
+        remove(name);
+        count = total;
+        CHECK(len <= WINDIVERT_PCAP_MIN_ROTATE_SIZE &&
+            ParseCapture(bufs[num_files], len, &count) && count > total);
+        total = count;
+    }
+    CHECK(num_files >= 2 && num_files < MAX_FILES);
+    CHECK(total == NUM_ROTATE && CheckRecords(0, total, start, end));
+    for (i = 0; i < num_files; i++)
+    {
+        free(bufs[i]);
+    }
+
+    // Rotation by time (the clock is advanced with shim_tick_offset):
+    pcap = WinDivertHelperPcapOpen("test_pcap_time", 0, 1);
+    CHECK(pcap != INVALID_HANDLE_VALUE);
+    start = Now();
+    for (i = 0; i < 3; i++)
+    {
+        RandomPacket(i, 2, 100);
+        CHECK(WinDivertHelperPcapWrite(pcap, packets[i], packet_lens[i],
+            addrs + i));
+        shim_tick_offset += (i == 0? 1000: 10);
+    }
+    CHECK(WinDivertHelperPcapClose(pcap));
+    end = Now();
+    bufs[0] = ReadAll("test_pcap_time-00000", &len);
+    count = 0;
+    CHECK(bufs[0] != NULL && ParseCapture(bufs[0], len, &count) &&
+        count == 1);
+    bufs[1] = ReadAll("test_pcap_time-00001", &len);
+    CHECK(bufs[1] != NULL && ParseCapture(bufs[1], len, &count) &&
+        count == 3);
+    CHECK(CheckRecords(0, 3, start, end));
+    free(bufs[0]);
+    free(bufs[1]);
+    remove("test_pcap_time-00000");
+    remove("test_pcap_time-00001");
+
+    for (i = 0; i < MAX_RECORDS; i++)
+    {
+        free(packets[i]);
+    }
+    return TestResult("test_pcap");
+}
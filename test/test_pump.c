@@ -0,0 +1,518 @@
+/*
+ * test_pump.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Drives the packet pump with a simulated device: receives are queued, and
+ * a driver thread completes them (in random order, some with a transient
+ * error) through the shim's completion port.  Checks that every packet
+ * reaches the callback once, that kept packets are sent (as modified by the
+ * callback) and dropped ones are not, that no more than depth receives are
+ * outstanding, and that WinDivertPumpDestroy() cancels the rest.  Also
+ * checks that the completions of the application's own requests are passed
+ * to the I/O callback, that persistently failing receives are retired, and
+ * that failures to start are reported.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_PACKETS     20000
+#define NUM_APP         100
+#define WAIT_MAX        30000                   // ms
+
+static BOOL SimRecv(HANDLE handle, PVOID packet, UINT packet_len,
+    PWINDIVERT_ADDRESS addr, LPOVERLAPPED overlapped);
+static BOOL SimSend(HANDLE handle, PVOID packet, UINT packet_len,
+    PWINDIVERT_ADDRESS addr, LPOVERLAPPED overlapped);
+static VOID SimCancel(HANDLE handle, LPOVERLAPPED overlapped);
+
+/*
+ * The simulated device; completions go through the shim's completion port.
+ */
+static const WINDIVERT_PUMP_IO sim_io =
+{
+    WinDivertPumpPortOpen,
+    SimRecv,
+    SimSend,
+    SimCancel,
+    WinDivertPumpPortWait,
+    WinDivertPumpPortWake,
+    WinDivertPumpPortClose
+};
+
+typedef struct
+{
+    LPOVERLAPPED overlapped;
+    UINT8 *packet;
+    UINT packet_len;
+    PWINDIVERT_ADDRESS addr;
+} SIM_READ;
+
+static HANDLE device;
+static volatile LONG lock = 0;
+static SIM_READ reads[WINDIVERT_PUMP_MAX_DEPTH];   // Outstanding receives
+static UINT num_reads, max_reads;
+static volatile LONG next_seq;                  // Next packet to receive
+static DWORD recv_error;                        // Fail every receive?
+static BOOL recv_fail_now;                      // Fail to issue receives?
+static volatile LONG stop_driver;
+static volatile LONG recv_calls, send_calls, callbacks, sends, drops;
+static volatile LONG active, max_active, bad;
+static volatile LONG received[NUM_PACKETS], sent[NUM_PACKETS];
+static OVERLAPPED app[NUM_APP];                 // Application's requests
+static volatile LONG app_completions;
+static UINT app_lens[NUM_APP];
+static DWORD app_errors[NUM_APP];
+
+static void Lock(void)
+{
+    while (InterlockedCompareExchange(&lock, 1, 0) != 0)
+    {
+        YieldProcessor();
+    }
+}
+
+static void Unlock(void)
+{
+    InterlockedExchange(&lock, 0);
+}
+
+static void Max(volatile LONG *max, LONG value)
+{
+    LONG old;
+
+    while ((old = *max) < value &&
+           InterlockedCompareExchange(max, value, old) != old)
+        ;
+}
+
+/*
+ * Packet seq is PacketLen(seq) bytes, starting with seq.
+ */
+static UINT PacketLen(UINT32 seq)
+{
+    return 8 + seq % 50;
+}
+
+/*
+ * Queue a receive.
+ */
+static BOOL SimRecv(HANDLE handle, PVOID packet, UINT packet_len,
+    PWINDIVERT_ADDRESS addr, LPOVERLAPPED overlapped)
+{
+    UINT i;
+
+    InterlockedIncrement(&recv_calls);
+    if (recv_fail_now)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+    Lock();
+    for (i = 0; i < num_reads; i++)
+    {
+        if (reads[i].overlapped == overlapped)
+        {
+            InterlockedIncrement(&bad);         // Already outstanding
+        }
+    }
+    if (handle != device || num_reads >= WINDIVERT_PUMP_MAX_DEPTH)
+    {
+        InterlockedIncrement(&bad);
+        Unlock();
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    reads[num_reads].overlapped = overlapped;
+    reads[num_reads].packet     = (UINT8 *)packet;
+    reads[num_reads].packet_len = packet_len;
+    reads[num_reads].addr       = addr;
+    num_reads++;
+    max_reads = (num_reads > max_reads? num_reads: max_reads);
+    Unlock();
+    SetLastError(ERROR_IO_PENDING);
+    return FALSE;
+}
+
+/*
+ * Check and complete a send.
+ */
+static BOOL SimSend(HANDLE handle, PVOID packet, UINT packet_len,
+    PWINDIVERT_ADDRESS addr, LPOVERLAPPED overlapped)
+{
+    UINT8 *data = (UINT8 *)packet;
+    UINT32 seq;
+
+    InterlockedIncrement(&send_calls);
+    memcpy(&seq, data, sizeof(seq));
+    if (handle != device || seq >= NUM_PACKETS ||
+        packet_len != PacketLen(seq) - 1 || data[4] != (UINT8)~seq ||
+        addr->IfIdx != seq)
+    {
+        InterlockedIncrement(&bad);
+    }
+    else
+    {
+        InterlockedIncrement(&sent[seq]);
+    }
+    InterlockedIncrement(&sends);
+    shim_complete_io(device, overlapped, packet_len, 0);
+    SetLastError(ERROR_IO_PENDING);
+    return FALSE;
+}
+
+/*
+ * Cancel a receive (if it is still outstanding).
+ */
+static VOID SimCancel(HANDLE handle, LPOVERLAPPED overlapped)
+{
+    BOOL found = FALSE;
+    UINT i;
+
+    Lock();
+    for (i = 0; i < num_reads; i++)
+    {
+        if (reads[i].overlapped == overlapped)
+        {
+            reads[i] = reads[--num_reads];
+            found = TRUE;
+            break;
+        }
+    }
+    Unlock();
+    if (found)
+    {
+        shim_complete_io(device, overlapped, 0, ERROR_OPERATION_ABORTED);
+    }
+}
+
+/*
+ * Complete outstanding receives, in random order, until stopped.
+ */
+static DWORD WINAPI Driver(LPVOID arg)
+{
+    UINT32 random = 0x9E3779B9, seq;
+    SIM_READ read;
+    UINT i, len;
+
+    while (!stop_driver)
+    {
+        Lock();
+        if (num_reads == 0 || (recv_error == 0 && next_seq >= NUM_PACKETS))
+        {
+            Unlock();
+            YieldProcessor();
+            continue;
+        }
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        i = random % num_reads;
+        read = reads[i];
+        reads[i] = reads[--num_reads];
+        Unlock();
+
+        if (recv_error != 0 || random % 64 == 0)
+        {
+            shim_complete_io(device, read.overlapped, 0,
+                (recv_error != 0? recv_error: ERROR_GEN_FAILURE));
+            continue;
+        }
+        seq = (UINT32)next_seq;
+        len = PacketLen(seq);
+        if (read.packet_len < len)
+        {
+            InterlockedIncrement(&bad);
+            continue;
+        }
+        memset(read.packet, 0xA5, len);
+        memcpy(read.packet, &seq, sizeof(seq));
+        memset(read.addr, 0, sizeof(*read.addr));
+        read.addr->IfIdx = seq;
+        InterlockedIncrement(&next_seq);
+        shim_complete_io(device, read.overlapped, len, 0);
+    }
+    return 0;
+}
+
+/*
+ * Drop every fifth packet, and modify (and shorten) the rest.
+ */
+static BOOL Callback(PVOID context, PVOID packet, UINT *packet_len,
+    PWINDIVERT_ADDRESS addr)
+{
+    UINT8 *data = (UINT8 *)packet;
+    UINT32 seq;
+    BOOL keep;
+
+    Max(&max_active, InterlockedIncrement(&active));
+    memcpy(&seq, data, sizeof(seq));
+    if (context != (PVOID)&device || seq >= NUM_PACKETS ||
+        *packet_len != PacketLen(seq) || data[4] != 0xA5)
+    {
+        InterlockedIncrement(&bad);
+        InterlockedDecrement(&active);
+        return FALSE;
+    }
+    InterlockedIncrement(&received[seq]);
+    keep = (seq % 5 != 0);
+    if (keep)
+    {
+        data[4] = (UINT8)~seq;
+        (*packet_len)--;
+    }
+    else
+    {
+        InterlockedIncrement(&drops);
+    }
+    InterlockedIncrement(&callbacks);
+    InterlockedDecrement(&active);
+    return keep;
+}
+
+/*
+ * Completion of one of the application's own requests.
+ */
+static VOID IoCallback(PVOID context, LPOVERLAPPED overlapped, UINT io_len,
+    DWORD error)
+{
+    UINT i = (UINT)(overlapped - app);
+
+    if (context != (PVOID)&device || overlapped < app ||
+        overlapped >= app + NUM_APP)
+    {
+        InterlockedIncrement(&bad);
+        return;
+    }
+    app_lens[i]   = io_len;
+    app_errors[i] = error;
+    InterlockedIncrement(&app_completions);
+}
+
+/*
+ * Wait (up to WAIT_MAX) for *value to reach target.
+ */
+static BOOL WaitFor(volatile LONG *value, LONG target)
+{
+    UINT i;
+
+    for (i = 0; i < WAIT_MAX && *value != target; i++)
+    {
+        Sleep(1);
+    }
+    return (*value == target);
+}
+
+/*
+ * A new simulated device (and driver thread).
+ */
+static HANDLE SimStart(DWORD error)
+{
+    HANDLE driver;
+
+    memset((PVOID)received, 0, sizeof(received));
+    memset((PVOID)sent, 0, sizeof(sent));
+    memset(app, 0, sizeof(app));
+    num_reads = max_reads = 0;
+    next_seq = 0;
+    recv_error = error;
+    recv_fail_now = FALSE;
+    stop_driver = FALSE;
+    recv_calls = send_calls = callbacks = sends = drops = 0;
+    active = max_active = bad = 0;
+    app_completions = 0;
+    device = CreateFile(L"\\\\.\\WinDivert", GENERIC_READ | GENERIC_WRITE,
+        0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
+        INVALID_HANDLE_VALUE);
+    CHECK(device != INVALID_HANDLE_VALUE);
+    driver = CreateThread(NULL, 0, Driver, NULL, 0, NULL);
+    CHECK(driver != NULL);
+    return driver;
+}
+
+static void SimStop(HANDLE driver)
+{
+    stop_driver = TRUE;
+    WaitForSingleObject(driver, INFINITE);
+    CloseHandle(driver);
+    CloseHandle(device);
+}
+
+/*
+ * Pump NUM_PACKETS packets, while the application's own requests complete
+ * on the same handle.
+ */
+static void TestPump(UINT num_threads, UINT depth, BOOL io_callback)
+{
+    HANDLE driver, pump, other;
+    PWINDIVERT_PUMP pump_ptr;
+    LONG expected_sends = 0;
+    UINT i;
+    BOOL ok;
+
+    driver = SimStart(0);
+    pump = WinDivertPumpStart(&sim_io, device, num_threads, depth, Callback,
+        (io_callback? IoCallback: NULL), (PVOID)&device);
+    CHECK(pump != INVALID_HANDLE_VALUE);
+    if (pump == INVALID_HANDLE_VALUE)
+    {
+        SimStop(driver);
+        return;
+    }
+    pump_ptr = (PWINDIVERT_PUMP)pump;
+
+    // The handle is already bound to the pump:
+    SetLastError(0);
+    other = WinDivertPumpStart(&sim_io, device, 1, 1, Callback, NULL,
+        NULL);
+    CHECK(other == INVALID_HANDLE_VALUE);
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+
+    for (i = 0; i < NUM_APP; i++)
+    {
+        CHECK(shim_complete_io(device, &app[i], i,
+            (i % 3 == 0? ERROR_GEN_FAILURE: 0)));
+    }
+    for (i = 0; i < NUM_PACKETS; i++)
+    {
+        expected_sends += (i % 5 != 0);
+    }
+    CHECK(WaitFor(&callbacks, NUM_PACKETS));
+    CHECK(WaitFor(&sends, expected_sends));
+    if (io_callback)
+    {
+        CHECK(WaitFor(&app_completions, NUM_APP));
+    }
+
+    // Every buffer is still in use (transient errors do not retire any):
+    CHECK(pump_ptr->pending == (LONG)depth);
+    CHECK(WinDivertPumpDestroy(pump));
+    CHECK(num_reads == 0);
+    SimStop(driver);
+
+    CHECK(bad == 0);
+    CHECK(next_seq == NUM_PACKETS);
+    CHECK(drops == NUM_PACKETS - expected_sends);
+    CHECK(max_reads <= depth);
+    CHECK(max_active >= 1 && max_active <= (LONG)num_threads);
+    for (i = 0, ok = TRUE; i < NUM_PACKETS; i++)
+    {
+        ok = ok && received[i] == 1 && sent[i] == (i % 5 != 0);
+    }
+    CHECK(ok);
+    if (!io_callback)
+    {
+        CHECK(app_completions == 0);
+        return;
+    }
+    for (i = 0, ok = TRUE; i < NUM_APP; i++)
+    {
+        ok = ok && app_lens[i] == i &&
+            app_errors[i] == (i % 3 == 0? ERROR_GEN_FAILURE: 0);
+    }
+    CHECK(ok);
+}
+
+/*
+ * Every receive fails: each buffer is retired after
+ * WINDIVERT_PUMP_MAX_FAILURES attempts, and the threads exit.
+ */
+static void TestFailures(UINT num_threads, UINT depth)
+{
+    HANDLE driver, pump;
+    PWINDIVERT_PUMP pump_ptr;
+
+    driver = SimStart(ERROR_GEN_FAILURE);
+    pump = WinDivertPumpStart(&sim_io, device, num_threads, depth, Callback,
+        IoCallback, (PVOID)&device);
+    CHECK(pump != INVALID_HANDLE_VALUE);
+    if (pump == INVALID_HANDLE_VALUE)
+    {
+        SimStop(driver);
+        return;
+    }
+    pump_ptr = (PWINDIVERT_PUMP)pump;
+    CHECK(WaitFor(&pump_ptr->pending, 0));
+    CHECK(recv_calls == (LONG)(depth * WINDIVERT_PUMP_MAX_FAILURES));
+    CHECK(pump_ptr->error == ERROR_GEN_FAILURE);
+    CHECK(WinDivertPumpDestroy(pump));
+    SimStop(driver);
+    CHECK(bad == 0 && callbacks == 0 && send_calls == 0);
+}
+
+/*
+ * Failures to start.
+ */
+static void TestStart(void)
+{
+    HANDLE driver, pump;
+
+    // Every receive fails immediately:
+    driver = SimStart(0);
+    recv_fail_now = TRUE;
+    SetLastError(0);
+    pump = WinDivertPumpStart(&sim_io, device, 4, 8, Callback, NULL, NULL);
+    CHECK(pump == INVALID_HANDLE_VALUE);
+    CHECK(GetLastError() == ERROR_INVALID_HANDLE);
+    CHECK(recv_calls == 8);
+    SimStop(driver);
+
+    // Invalid parameters:
+    SetLastError(0);
+    CHECK(WinDivertPumpCreate(INVALID_HANDLE_VALUE, 1, 1, Callback,
+        NULL) == INVALID_HANDLE_VALUE);
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+    SetLastError(0);
+    CHECK(WinDivertPumpCreateEx((HANDLE)&device, 0, 1, Callback, IoCallback,
+        NULL) == INVALID_HANDLE_VALUE);
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+    SetLastError(0);
+    CHECK(WinDivertPumpCreate((HANDLE)&device, 1,
+        WINDIVERT_PUMP_MAX_DEPTH + 1, Callback, NULL) ==
+            INVALID_HANDLE_VALUE);
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+    SetLastError(0);
+    CHECK(WinDivertPumpCreate((HANDLE)&device, 1, 1, NULL, NULL) ==
+        INVALID_HANDLE_VALUE);
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+    SetLastError(0);
+    CHECK(!WinDivertPumpDestroy(INVALID_HANDLE_VALUE));
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+}
+
+/*
+ * Device requests; none are expected.
+ */
+static BOOL SimIoControl(HANDLE handle, DWORD code, LPVOID in, DWORD in_len,
+    LPVOID out, DWORD out_len, DWORD *ret_len, LPOVERLAPPED overlapped)
+{
+    InterlockedIncrement(&bad);
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+}
+
+int main(void)
+{
+    shim_device_io_control = SimIoControl;
+    TestPump(1, 1, TRUE);
+    TestPump(4, 16, TRUE);
+    TestPump(8, 64, FALSE);
+    TestFailures(4, 16);
+    TestStart();
+    return TestResult("test_pump");
+}
@@ -0,0 +1,217 @@
+/*
+ * test_queue.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the flow hash used to select a packet queue
+ * (WinDivertHelperHashPacket() and windivert_hash_queue()): both directions
+ * of a flow, and all packets of a flow, map to the same queue, and flows
+ * are spread evenly over the queues.
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_FLOWS       20000
+#define QUEUE_MAX       64
+
+/*
+ * A flow's 5-tuple.
+ */
+typedef struct
+{
+    BOOL ipv6;
+    UINT8 protocol;
+    UINT32 src_addr[4];
+    UINT32 dst_addr[4];
+    UINT16 src_port;
+    UINT16 dst_port;
+} FLOW;
+
+static void RandomFlow(FLOW *flow)
+{
+    static const UINT8 protocols[] = {IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP};
+    UINT i;
+
+    flow->ipv6     = (TestRandom() % 3 == 0);
+    flow->protocol = protocols[TestRandom() % 3];
+    if (flow->ipv6 && flow->protocol == IPPROTO_ICMP)
+    {
+        flow->protocol = IPPROTO_ICMPV6;
+    }
+    for (i = 0; i < 4; i++)
+    {
+        flow->src_addr[i] = TestRandom();
+        flow->dst_addr[i] = TestRandom();
+    }
+    flow->src_port = (UINT16)TestRandom();
+    flow->dst_port = (UINT16)TestRandom();
+}
+
+/*
+ * Build a packet of the flow, in the given direction.
+ */
+static UINT FlowPacket(UINT8 *packet, const FLOW *flow, BOOL reverse,
+    const char *payload)
+{
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+    const UINT32 *src_addr = (reverse? flow->dst_addr: flow->src_addr);
+    const UINT32 *dst_addr = (reverse? flow->src_addr: flow->dst_addr);
+    UINT packet_len;
+
+    packet_len = TestPacket(packet, flow->ipv6, flow->protocol,
+        (reverse? flow->dst_port: flow->src_port),
+        (reverse? flow->src_port: flow->dst_port), payload);
+    if (flow->ipv6)
+    {
+        memcpy(ipv6_header->SrcAddr, src_addr, 4 * sizeof(UINT32));
+        memcpy(ipv6_header->DstAddr, dst_addr, 4 * sizeof(UINT32));
+    }
+    else
+    {
+        ip_header->SrcAddr = src_addr[0];
+        ip_header->DstAddr = dst_addr[0];
+    }
+    WinDivertHelperCalcChecksums(packet, packet_len, 0);
+    return packet_len;
+}
+
+static int __cdecl CompareHash(const void *a, const void *b)
+{
+    UINT32 x = *(const UINT32 *)a, y = *(const UINT32 *)b;
+
+    return (x < y? -1: (x > y? 1: 0));
+}
+
+int main(void)
+{
+    static const UINT counts[] = {2, 3, 7, 16, QUEUE_MAX};
+    static UINT32 hashes[NUM_FLOWS];
+    UINT queues[QUEUE_MAX];
+    UINT8 packet[256];
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_TCPHDR tcp_header;
+    WINDIVERT_PACKET wpacket;
+    FLOW flow;
+    UINT32 hash, hash2, filter_hash;
+    UINT packet_len, count, collisions, min, max, i, j;
+    BOOL ok_reverse = TRUE, ok_flow = TRUE, ok_filter = TRUE;
+    filter_t filter;
+    PWINDIVERT_FILTER_OBJECT object;
+    UINT object_len;
+
+    object = WinDivertCompileFilterObject("true", WINDIVERT_LAYER_NETWORK,
+        &object_len);
+    filter = (object == NULL? NULL: WinDivertLoadFilter(object));
+    free(object);
+    CHECK(filter != NULL);
+    if (filter == NULL)
+    {
+        return TestResult("test_queue");
+    }
+
+    // Both directions, and every packet, of a flow hash the same:
+    for (i = 0; i < NUM_FLOWS; i++)
+    {
+        RandomFlow(&flow);
+        packet_len = FlowPacket(packet, &flow, FALSE, "request");
+        hash = WinDivertHelperHashPacket(packet, packet_len);
+        hashes[i] = hash;
+
+        wpacket.data = packet;
+        wpacket.len  = packet_len;
+        windivert_filter(&wpacket, 1, 0, TRUE, filter, &filter_hash);
+        ok_filter = ok_filter && (filter_hash == hash);
+
+        packet_len = FlowPacket(packet, &flow, TRUE, "a longer response");
+        if (!flow.ipv6)
+        {
+            ip_header->TTL = (UINT8)TestRandom();
+        }
+        if (flow.protocol == IPPROTO_TCP)
+        {
+            tcp_header = (PWINDIVERT_TCPHDR)(packet + (flow.ipv6?
+                sizeof(WINDIVERT_IPV6HDR): sizeof(WINDIVERT_IPHDR)));
+            tcp_header->Ack = 1;
+            tcp_header->AckNum = TestRandom();
+        }
+        hash2 = WinDivertHelperHashPacket(packet, packet_len);
+        ok_reverse = ok_reverse && (hash2 == hash);
+
+        packet_len = FlowPacket(packet, &flow, FALSE, "");
+        ok_flow = ok_flow && hash != 0 &&
+            WinDivertHelperHashPacket(packet, packet_len) == hash;
+    }
+    CHECK(ok_reverse);
+    CHECK(ok_flow);
+    CHECK(ok_filter);
+
+    // Distinct flows rarely collide:
+    qsort(hashes, NUM_FLOWS, sizeof(UINT32), CompareHash);
+    for (i = 1, collisions = 0; i < NUM_FLOWS; i++)
+    {
+        collisions += (hashes[i] == hashes[i-1]);
+    }
+    CHECK(collisions <= 2);
+
+    // The fragments of a datagram hash the same (without the ports):
+    flow.ipv6     = FALSE;
+    flow.protocol = IPPROTO_UDP;
+    packet_len = FlowPacket(packet, &flow, FALSE, "first fragment");
+    ip_header->FragOff0 = htons(0x2000);                // MF
+    hash = WinDivertHelperHashPacket(packet, packet_len);
+    packet_len = FlowPacket(packet, &flow, FALSE, "last");
+    ip_header->FragOff0 = htons(3);
+    CHECK(hash != 0 &&
+        WinDivertHelperHashPacket(packet, packet_len) == hash);
+
+    // Packets that cannot be parsed hash to 0 (queue 0):
+    CHECK(WinDivertHelperHashPacket(packet, 10) == 0);
+    CHECK(WinDivertHelperHashPacket(NULL, 0) == 0);
+
+    // Queue selection:
+    for (count = 1; count <= QUEUE_MAX; count++)
+    {
+        CHECK(windivert_hash_queue(0, count) == 0);
+        CHECK(windivert_hash_queue(0xFFFFFFFF, count) == count - 1);
+    }
+    CHECK(windivert_hash_queue(0x80000000, 2) == 1);
+    CHECK(windivert_hash_queue(0x7FFFFFFF, 2) == 0);
+
+    // Flows are spread evenly over the queues (within 25%):
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        count = counts[i];
+        memset(queues, 0, sizeof(queues));
+        for (j = 0; j < NUM_FLOWS; j++)
+        {
+            queues[windivert_hash_queue(hashes[j], count)]++;
+        }
+        min = max = queues[0];
+        for (j = 1; j < count; j++)
+        {
+            min = (queues[j] < min? queues[j]: min);
+            max = (queues[j] > max? queues[j]: max);
+        }
+        CHECK(min * count * 4 >= NUM_FLOWS * 3);
+        CHECK(max * count * 4 <= NUM_FLOWS * 5);
+    }
+
+    free(filter);
+    return TestResult("test_queue");
+}
@@ -0,0 +1,451 @@
+/*
+ * test_reassemble.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fragment traces for WinDivertHelperReassemble(): in-order, out-of-order,
+ * overlapping, duplicate, timed-out and oversized fragments, for both IPv4
+ * and IPv6.  The reassembled datagram must be identical to the datagram
+ * that was fragmented.  (The clock is advanced with the shim's
+ * shim_tick_offset.)
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define NUM_ROUNDS      2000
+#define PAYLOAD_MAX     3000
+#define FRAGS_MAX       64
+#define TIMEOUT         1000
+
+#define IPV6_HDRLEN     sizeof(WINDIVERT_IPV6HDR)
+#define FRAG_HDRLEN     8
+
+static char payload[PAYLOAD_MAX+1];
+static UINT8 dgram[0x10000 + 64];
+static UINT8 frags[FRAGS_MAX][0x10000 + 64];
+static UINT frag_lens[FRAGS_MAX];
+static UINT frag_offsets[FRAGS_MAX];
+static UINT frag_data_lens[FRAGS_MAX];
+static BOOL frag_last[FRAGS_MAX];
+static UINT8 output[0x10000 + 64];
+
+/*
+ * Build a UDP datagram with a payload_len byte payload, and return its
+ * length.
+ */
+static UINT Datagram(BOOL ipv6, UINT payload_len, UINT16 id)
+{
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)dgram;
+    UINT i;
+
+    for (i = 0; i < payload_len; i++)
+    {
+        payload[i] = (char)('a' + (TestRandom() % 26));
+    }
+    payload[payload_len] = '\0';
+    i = TestPacket(dgram, ipv6, IPPROTO_UDP, 53, 1024 + id, payload);
+    if (!ipv6)
+    {
+        ip_header->Id = htons(id);
+        WinDivertHelperCalcChecksums(dgram, i, 0);
+    }
+    return i;
+}
+
+/*
+ * Build fragment n of the datagram: len bytes of data at offset.  For IPv6,
+ * ext_len bytes of destination options precede the fragment header.
+ */
+static void Fragment(UINT n, BOOL ipv6, UINT offset, UINT len, BOOL last,
+    UINT16 id, UINT ext_len)
+{
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)frags[n];
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)frags[n];
+    UINT8 *frag_header, *ext_header;
+    UINT32 id32 = htonl((UINT32)id);
+    UINT16 frag_off;
+
+    frag_offsets[n] = offset;
+    frag_data_lens[n] = len;
+    frag_last[n] = last;
+
+    if (!ipv6)
+    {
+        memcpy(frags[n], dgram, sizeof(WINDIVERT_IPHDR));
+        memcpy(frags[n] + sizeof(WINDIVERT_IPHDR),
+            dgram + sizeof(WINDIVERT_IPHDR) + offset, len);
+        frag_lens[n] = sizeof(WINDIVERT_IPHDR) + len;
+        ip_header->Length = htons((UINT16)frag_lens[n]);
+        ip_header->Id = htons(id);
+        WINDIVERT_IPHDR_SET_FRAGOFF(ip_header, htons((UINT16)(offset / 8)));
+        WINDIVERT_IPHDR_SET_MF(ip_header, !last);
+        WinDivertHelperCalcChecksums(frags[n], frag_lens[n],
+            WINDIVERT_HELPER_NO_UDP_CHECKSUM);
+        return;
+    }
+
+    memcpy(frags[n], dgram, IPV6_HDRLEN);
+    ext_header = frags[n] + IPV6_HDRLEN;
+    if (ext_len != 0)
+    {
+        ipv6_header->NextHdr = 60;
+        memset(ext_header, 0, ext_len);
+        ext_header[0] = 44;
+        ext_header[1] = (UINT8)(ext_len / 8 - 1);
+    }
+    else
+    {
+        ipv6_header->NextHdr = 44;
+    }
+    frag_header = ext_header + ext_len;
+    frag_header[0] = ((PWINDIVERT_IPV6HDR)dgram)->NextHdr;
+    frag_header[1] = 0;
+    frag_off = htons((UINT16)(offset | (last? 0: 1)));
+    memcpy(frag_header + 2, &frag_off, sizeof(frag_off));
+    memcpy(frag_header + 4, &id32, sizeof(id32));
+    memcpy(frag_header + FRAG_HDRLEN, dgram + IPV6_HDRLEN + offset, len);
+    frag_lens[n] = IPV6_HDRLEN + ext_len + FRAG_HDRLEN + len;
+    ipv6_header->Length = htons((UINT16)(frag_lens[n] - IPV6_HDRLEN));
+}
+
+/*
+ * The expected reassembly of dgram: the same datagram, with any extension
+ * headers of the first fragment.
+ */
+static UINT Expected(UINT8 *expected, BOOL ipv6, UINT dgram_len,
+    UINT ext_len)
+{
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)expected;
+
+    if (!ipv6 || ext_len == 0)
+    {
+        memcpy(expected, dgram, dgram_len);
+        return dgram_len;
+    }
+    memcpy(expected, dgram, IPV6_HDRLEN);
+    memset(expected + IPV6_HDRLEN, 0, ext_len);
+    expected[IPV6_HDRLEN] = ((PWINDIVERT_IPV6HDR)dgram)->NextHdr;
+    expected[IPV6_HDRLEN + 1] = (UINT8)(ext_len / 8 - 1);
+    memcpy(expected + IPV6_HDRLEN + ext_len, dgram + IPV6_HDRLEN,
+        dgram_len - IPV6_HDRLEN);
+    ipv6_header->NextHdr = 60;
+    ipv6_header->Length =
+        htons((UINT16)(dgram_len + ext_len - IPV6_HDRLEN));
+    return dgram_len + ext_len;
+}
+
+/*
+ * Pass fragment n to the reassembler; returns the result length, 0 if the
+ * datagram is pending, or -1 on error.
+ */
+static int Reassemble(HANDLE handle, UINT n)
+{
+    UINT read_len;
+
+    SetLastError(0);
+    if (WinDivertHelperReassemble(handle, frags[n], frag_lens[n], output,
+            sizeof(output), &read_len))
+    {
+        return (int)read_len;
+    }
+    if (GetLastError() == ERROR_IO_PENDING)
+    {
+        CHECK(read_len == 0);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Split the datagram data into fragments, some of them overlapping or
+ * duplicated, in random order.  Returns the number of fragments, and the
+ * index of the fragment that completes the datagram.
+ */
+static UINT RandomFragments(BOOL ipv6, UINT dgram_len, UINT16 id,
+    UINT ext_len, BOOL overlap, BOOL shuffle, UINT *complete)
+{
+    static UINT8 covered[0x10000];
+    UINT hdr_len = (ipv6? IPV6_HDRLEN: sizeof(WINDIVERT_IPHDR));
+    UINT data_len = dgram_len - hdr_len, offset = 0, len, start;
+    UINT n = 0, i, j, tmp, left;
+    BOOL last, seen_first = FALSE, seen_last = FALSE;
+    UINT8 tmp_frag[sizeof(frags[0])];
+
+    while (offset < data_len && n < FRAGS_MAX - 2)
+    {
+        len = 8 * (1 + TestRandom() % 64);
+        last = (offset + len >= data_len || n >= FRAGS_MAX - 4);
+        len = (last? data_len - offset: len);
+        start = offset;
+        if (overlap && offset != 0 && TestRandom() % 2 == 0)
+        {
+            start -= 8 * (1 + TestRandom() % (offset / 8));
+        }
+        Fragment(n++, ipv6, start, offset + len - start, last, id, ext_len);
+        if (TestRandom() % 8 == 0)
+        {
+            // Duplicate:
+            Fragment(n++, ipv6, start, offset + len - start, last, id,
+                ext_len);
+        }
+        offset += len;
+    }
+
+    for (i = 0; shuffle && i + 1 < n; i++)
+    {
+        j = i + TestRandom() % (n - i);
+        memcpy(tmp_frag, frags[i], frag_lens[i]);
+        tmp = frag_lens[i];
+        memcpy(frags[i], frags[j], frag_lens[j]);
+        frag_lens[i] = frag_lens[j];
+        memcpy(frags[j], tmp_frag, tmp);
+        frag_lens[j] = tmp;
+        tmp = frag_offsets[i];
+        frag_offsets[i] = frag_offsets[j];
+        frag_offsets[j] = tmp;
+        tmp = frag_data_lens[i];
+        frag_data_lens[i] = frag_data_lens[j];
+        frag_data_lens[j] = tmp;
+        tmp = frag_last[i];
+        frag_last[i] = frag_last[j];
+        frag_last[j] = tmp;
+    }
+
+    // Find the fragment that completes the datagram:
+    memset(covered, 0, data_len);
+    left = data_len;
+    for (i = 0; i < n; i++)
+    {
+        seen_first = seen_first || (frag_offsets[i] == 0);
+        seen_last = seen_last || frag_last[i];
+        for (j = frag_offsets[i]; j < frag_offsets[i] + frag_data_lens[i];
+                j++)
+        {
+            left -= (covered[j] == 0);
+            covered[j] = 1;
+        }
+        if (left == 0 && seen_first && seen_last)
+        {
+            break;
+        }
+    }
+    *complete = i;
+    return n;
+}
+
+int main(void)
+{
+    static UINT8 expected[sizeof(dgram)];
+    HANDLE handle;
+    UINT round, dgram_len, exp_len, ext_len, data_len, n, complete, i;
+    UINT read_len;
+    BOOL ipv6, overlap, shuffle;
+    UINT8 small[16];
+
+    handle = WinDivertHelperReassemblyOpen(4, TIMEOUT);
+    CHECK(handle != INVALID_HANDLE_VALUE);
+
+    // Random traces: in-order or out-of-order, with or without overlapping
+    // and duplicate fragments, and (IPv6) extension headers:
+    for (round = 0; round < NUM_ROUNDS; round++)
+    {
+        ipv6      = (round % 2 == 0);
+        overlap   = (round % 4 >= 2);
+        shuffle   = (round % 8 >= 4);
+        ext_len   = (ipv6 && TestRandom() % 4 == 0? 8 * (1 + round % 3): 0);
+        dgram_len = Datagram(ipv6, 1 + TestRandom() % PAYLOAD_MAX,
+            (UINT16)round);
+        exp_len   = Expected(expected, ipv6, dgram_len, ext_len);
+        n = RandomFragments(ipv6, dgram_len, (UINT16)round, ext_len, overlap,
+            shuffle, &complete);
+        CHECK(complete < n);
+        for (i = 0; i < complete; i++)
+        {
+            CHECK(Reassemble(handle, i) == 0);
+        }
+        CHECK(Reassemble(handle, complete) == (int)exp_len);
+        CHECK(memcmp(output, expected, exp_len) == 0);
+    }
+
+    for (ipv6 = FALSE; ipv6 <= TRUE; ipv6++)
+    {
+        // Non-fragments are returned unmodified:
+        dgram_len = Datagram(ipv6, 100, 1);
+        data_len = dgram_len -
+            (ipv6? IPV6_HDRLEN: sizeof(WINDIVERT_IPHDR));
+        memcpy(frags[0], dgram, dgram_len);
+        frag_lens[0] = dgram_len;
+        CHECK(Reassemble(handle, 0) == (int)dgram_len);
+        CHECK(memcmp(output, dgram, dgram_len) == 0);
+
+        // Atomic IPv6 fragments are returned without the fragment header,
+        // and do not disturb other fragments with the same id:
+        if (ipv6)
+        {
+            Fragment(0, TRUE, 0, data_len, TRUE, 1, 0);
+            Fragment(1, TRUE, 0, 64, FALSE, 1, 0);
+            Fragment(2, TRUE, 64, data_len - 64, TRUE, 1, 0);
+            CHECK(Reassemble(handle, 1) == 0);
+            CHECK(Reassemble(handle, 0) == (int)dgram_len);
+            CHECK(memcmp(output, dgram, dgram_len) == 0);
+            CHECK(Reassemble(handle, 2) == (int)dgram_len);
+            CHECK(memcmp(output, dgram, dgram_len) == 0);
+        }
+
+        // In-order; the datagram buffer may be too small (the entry is kept
+        // so that the call can be repeated):
+        dgram_len = Datagram(ipv6, 1000, 2);
+        RandomFragments(ipv6, dgram_len, 2, 0, FALSE, FALSE, &complete);
+        CHECK(complete != 0);
+        for (i = 0; i < complete; i++)
+        {
+            CHECK(Reassemble(handle, i) == 0);
+        }
+        CHECK(!WinDivertHelperReassemble(handle, frags[complete],
+            frag_lens[complete], small, sizeof(small), &read_len));
+        CHECK(GetLastError() == ERROR_INSUFFICIENT_BUFFER);
+        CHECK(Reassemble(handle, complete) == (int)dgram_len);
+        CHECK(memcmp(output, dgram, dgram_len) == 0);
+
+        // A duplicate after the datagram is complete starts a new one:
+        CHECK(Reassemble(handle, 0) == 0);
+
+        // Timed-out: the first fragment has expired by the time that the
+        // last one arrives, so the datagram is only complete once the
+        // first fragment is sent again:
+        dgram_len = Datagram(ipv6, 1000, 3);
+        data_len = dgram_len -
+            (ipv6? IPV6_HDRLEN: sizeof(WINDIVERT_IPHDR));
+        Fragment(0, ipv6, 0, 512, FALSE, 3, 0);
+        Fragment(1, ipv6, 512, data_len - 512, TRUE, 3, 0);
+        CHECK(Reassemble(handle, 0) == 0);
+        shim_tick_offset += TIMEOUT + 1;
+        CHECK(Reassemble(handle, 1) == 0);
+        CHECK(Reassemble(handle, 0) == (int)dgram_len);
+        CHECK(memcmp(output, dgram, dgram_len) == 0);
+
+        // Inconsistent last fragments:
+        Fragment(1, ipv6, 512, 64, TRUE, 4, 0);
+        Fragment(2, ipv6, 512, 128, TRUE, 4, 0);
+        CHECK(Reassemble(handle, 1) == 0);
+        CHECK(Reassemble(handle, 2) == -1);
+        CHECK(GetLastError() == ERROR_INVALID_DATA);
+
+        // Fragments beyond the end of the datagram, before and after the
+        // last fragment:
+        Fragment(0, ipv6, 0, 512, FALSE, 5, 0);
+        Fragment(1, ipv6, 256, 64, TRUE, 5, 0);
+        CHECK(Reassemble(handle, 1) == 0);
+        CHECK(Reassemble(handle, 0) == -1);
+        CHECK(GetLastError() == ERROR_INVALID_DATA);
+        CHECK(Reassemble(handle, 0) == 0);
+        CHECK(Reassemble(handle, 1) == -1);
+        CHECK(GetLastError() == ERROR_INVALID_DATA);
+
+        // Non-last fragments must be non-empty multiples of 8 bytes:
+        Fragment(0, ipv6, 0, 100, FALSE, 6, 0);
+        CHECK(Reassemble(handle, 0) == -1);
+        CHECK(GetLastError() == ERROR_INVALID_DATA);
+        Fragment(0, ipv6, 8, 0, FALSE, 6, 0);
+        CHECK(Reassemble(handle, 0) == -1);
+        CHECK(GetLastError() == ERROR_INVALID_DATA);
+    }
+
+    // Oversized: the data may not extend beyond the maximum datagram length
+    // (65535 bytes for IPv4, and 65535 bytes plus the IPv6 header):
+    Datagram(FALSE, 100, 7);
+    Fragment(0, FALSE, 0xFFFF - 20 - 3, 8, TRUE, 7, 0);
+    CHECK(Reassemble(handle, 0) == -1);
+    CHECK(GetLastError() == ERROR_INVALID_DATA);
+    Fragment(0, FALSE, 0xFFFF - 20 - 3, 3, TRUE, 7, 0);
+    CHECK(Reassemble(handle, 0) == 0);
+    Datagram(TRUE, 100, 7);
+    Fragment(0, TRUE, 0xFFFF - 7, 8, TRUE, 7, 0);
+    CHECK(Reassemble(handle, 0) == -1);
+    CHECK(GetLastError() == ERROR_INVALID_DATA);
+    Fragment(0, TRUE, 0xFFFF - 7, 7, TRUE, 7, 0);
+    CHECK(Reassemble(handle, 0) == 0);
+
+    // The largest datagrams that can be reassembled:
+    for (ipv6 = FALSE; ipv6 <= TRUE; ipv6++)
+    {
+        dgram_len = Datagram(ipv6, 100, 8);
+        data_len = (ipv6? 0xFFFF: 0xFFFF - sizeof(WINDIVERT_IPHDR));
+        for (i = 0; i < data_len; i += 1024)
+        {
+            Fragment(0, ipv6, i, (i + 1024 < data_len? 1024: data_len - i),
+                i + 1024 >= data_len, 8, 0);
+            CHECK(Reassemble(handle, 0) ==
+                (i + 1024 < data_len? 0:
+                    (int)(data_len +
+                        (ipv6? IPV6_HDRLEN: sizeof(WINDIVERT_IPHDR)))));
+        }
+    }
+
+    // IPv4 and IPv6 datagrams with the same id are kept apart, and the
+    // oldest datagram is evicted when all entries are in use:
+    shim_tick_offset += TIMEOUT + 1;
+    CHECK(WinDivertHelperReassemblyClose(handle));
+    handle = WinDivertHelperReassemblyOpen(2, TIMEOUT);
+    CHECK(handle != INVALID_HANDLE_VALUE);
+    dgram_len = Datagram(FALSE, 100, 9);
+    Fragment(0, FALSE, 0, 64, FALSE, 9, 0);
+    Fragment(1, FALSE, 64, dgram_len - sizeof(WINDIVERT_IPHDR) - 64, TRUE, 9,
+        0);
+    memcpy(expected, dgram, dgram_len);
+    exp_len = dgram_len;
+    dgram_len = Datagram(TRUE, 100, 9);
+    data_len = dgram_len - IPV6_HDRLEN;
+    Fragment(2, TRUE, 0, 64, FALSE, 9, 0);
+    Fragment(3, TRUE, 64, data_len - 64, TRUE, 9, 0);
+    CHECK(Reassemble(handle, 0) == 0);
+    CHECK(Reassemble(handle, 2) == 0);
+    CHECK(Reassemble(handle, 3) == (int)dgram_len);
+    CHECK(memcmp(output, dgram, dgram_len) == 0);
+    CHECK(Reassemble(handle, 1) == (int)exp_len);
+    CHECK(memcmp(output, expected, exp_len) == 0);
+
+    Fragment(4, TRUE, 0, 64, FALSE, 10, 0);
+    Fragment(5, TRUE, 0, 64, FALSE, 11, 0);
+    Fragment(6, TRUE, 0, 64, FALSE, 12, 0);
+    Fragment(7, TRUE, 0, 64, FALSE, 13, 0);
+    Fragment(8, TRUE, 64, data_len - 64, TRUE, 10, 0);
+    Fragment(9, TRUE, 64, data_len - 64, TRUE, 11, 0);
+    Fragment(10, TRUE, 64, data_len - 64, TRUE, 12, 0);
+    CHECK(Reassemble(handle, 4) == 0);
+    shim_tick_offset += 1;
+    CHECK(Reassemble(handle, 5) == 0);
+    CHECK(Reassemble(handle, 8) == (int)dgram_len);
+    shim_tick_offset += 1;
+    CHECK(Reassemble(handle, 6) == 0);          // Reuses id 10's entry
+    CHECK(Reassemble(handle, 7) == 0);          // Evicts id 11
+    CHECK(Reassemble(handle, 10) == (int)dgram_len);
+    CHECK(memcmp(output, dgram, dgram_len) == 0);
+    CHECK(Reassemble(handle, 9) == 0);
+
+    // Invalid parameters:
+    CHECK(WinDivertHelperReassemblyOpen(0, TIMEOUT) ==
+        INVALID_HANDLE_VALUE);
+    CHECK(WinDivertHelperReassemblyOpen(1, 0) == INVALID_HANDLE_VALUE);
+    CHECK(!WinDivertHelperReassemble(NULL, frags[0], frag_lens[0], output,
+        sizeof(output), NULL));
+    CHECK(GetLastError() == ERROR_INVALID_PARAMETER);
+    CHECK(WinDivertHelperReassemblyClose(handle));
+
+    return TestResult("test_reassemble");
+}
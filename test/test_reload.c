@@ -0,0 +1,266 @@
+/*
+ * test_reload.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the webfilter blacklist reload (BlackListSwap(), BlackListEnter()
+ * and BlackListExit()): a swap waits for readers of the old blacklist but
+ * never blocks new readers, and under concurrent readers no reader ever
+ * matches against a blacklist after it has been swapped out and freed.  An
+ * image file can be replaced (renamed over) while it is mapped, and a
+ * failed reload leaves the current blacklist in use.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <winsock2.h>
+#include "windivert.h"
+#include "../examples/webfilter/blacklist.c"
+#include "test.h"
+
+#define NUM_READERS     4
+#define NUM_SWAPS       5000
+#define IMAGE_FILE      "test_reload.img"
+#define NEW_FILE        "test_reload.new"
+
+static volatile LONG stop = FALSE;
+static volatile LONG reads = 0;
+static volatile LONG stale = 0;
+static volatile LONG swapped = FALSE;
+static PBLACKLIST swap_blacklist, swap_result;
+static char domain_a[] = "www.example.com", uri_a[] = "ads/banner.gif";
+static char domain_b[] = "tracker.example.net", uri_b[] = "pixel.gif";
+
+/*
+ * A compiled blacklist that blocks either the "a" or the "b" URL.
+ */
+static PBLACKLIST NewBlackList(BOOL a)
+{
+    PBLACKLIST blacklist = BlackListInit();
+    const char *key = (a? "com.example/ads": "net.example.tracker/");
+
+    BlackListInsert(blacklist, key, (UINT)strlen(key));
+    BlackListCompile(blacklist);
+    return blacklist;
+}
+
+/*
+ * Match the "a" and "b" URLs.
+ */
+static BOOL MatchA(PBLACKLIST blacklist)
+{
+    URL url = {domain_a, uri_a};
+    return BlackListMatch(blacklist, &url);
+}
+static BOOL MatchB(PBLACKLIST blacklist)
+{
+    URL url = {domain_b, uri_b};
+    return BlackListMatch(blacklist, &url);
+}
+
+/*
+ * Repeatedly match against the current blacklist, which must block exactly
+ * one of the "a" and "b" URLs.
+ */
+static DWORD WINAPI Reader(LPVOID arg)
+{
+    PBLACKLIST blacklist;
+    LONG epoch;
+    BOOL a, b;
+
+    while (!stop)
+    {
+        blacklist = BlackListEnter(&epoch);
+        a = MatchA(blacklist);
+        YieldProcessor();
+        b = MatchB(blacklist);
+        BlackListExit(epoch);
+        if (a == b)
+        {
+            InterlockedIncrement(&stale);
+        }
+        InterlockedIncrement(&reads);
+    }
+    return 0;
+}
+
+/*
+ * Swap in swap_blacklist (from another thread).
+ */
+static DWORD WINAPI Swapper(LPVOID arg)
+{
+    swap_result = BlackListSwap(swap_blacklist);
+    InterlockedExchange(&swapped, TRUE);
+    return 0;
+}
+
+/*
+ * Write a blacklist's image file.
+ */
+static void WriteImage(BOOL a, const char *filename)
+{
+    PBLACKLIST blacklist = NewBlackList(a);
+
+    BlackListWrite(blacklist, filename);
+    BlackListFree(blacklist);
+}
+
+int main(void)
+{
+    static char *files[] = {IMAGE_FILE};
+    HANDLE threads[NUM_READERS], thread;
+    PBLACKLIST blacklist, blacklist_a, blacklist_b, old_blacklist;
+    LONG epoch, epoch2;
+    FILE *file;
+    int err_fd, null_fd;
+    UINT i;
+
+    // Single thread:
+    blacklist_a = NewBlackList(TRUE);
+    blacklist_b = NewBlackList(FALSE);
+    CHECK(MatchA(blacklist_a) && !MatchB(blacklist_a));
+    CHECK(!MatchA(blacklist_b) && MatchB(blacklist_b));
+    CHECK(BlackListSwap(blacklist_a) == NULL);
+    blacklist = BlackListEnter(&epoch);
+    CHECK(blacklist == blacklist_a && epoch == 1 &&
+        blacklist_readers[1] == 1);
+    CHECK(BlackListEnter(&epoch2) == blacklist_a && epoch2 == 1 &&
+        blacklist_readers[1] == 2);
+    BlackListExit(epoch2);
+    BlackListExit(epoch);
+    CHECK(blacklist_readers[0] == 0 && blacklist_readers[1] == 0);
+
+    // A swap waits for a reader of the old blacklist:
+    blacklist = BlackListEnter(&epoch);
+    swap_blacklist = blacklist_b;
+    thread = CreateThread(NULL, 0, Swapper, NULL, 0, NULL);
+    CHECK(thread != NULL);
+    if (thread == NULL)
+    {
+        return TestResult("test_reload");
+    }
+    while (blacklist_epoch == epoch)
+    {
+        YieldProcessor();
+    }
+    Sleep(50);
+    CHECK(!swapped);
+
+    // ... but a new reader already gets the new blacklist:
+    CHECK(BlackListEnter(&epoch2) == blacklist_b);
+    BlackListExit(epoch2);
+    CHECK(!swapped);
+
+    // ... and the old reader can still use the old one:
+    CHECK(MatchA(blacklist) && !MatchB(blacklist));
+    BlackListExit(epoch);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    CHECK(swapped && swap_result == blacklist_a);
+    BlackListFree(blacklist_a);
+
+    // Concurrent readers; each swapped out blacklist is cleared (so that a
+    // reader still using it matches neither URL) and freed:
+    for (i = 0; i < NUM_READERS; i++)
+    {
+        threads[i] = CreateThread(NULL, 0, Reader, NULL, 0, NULL);
+        CHECK(threads[i] != NULL);
+        if (threads[i] == NULL)
+        {
+            return TestResult("test_reload");
+        }
+    }
+    for (i = 1; i <= NUM_SWAPS; i++)
+    {
+        // Let the readers keep up:
+        while (reads < (LONG)i)
+        {
+            YieldProcessor();
+        }
+        blacklist = NewBlackList(i % 2 != 0);
+        old_blacklist = BlackListSwap(blacklist);
+        CHECK(old_blacklist != NULL && old_blacklist != blacklist);
+        memset(old_blacklist->nodes, 0,
+            old_blacklist->num_nodes * sizeof(NODE));
+        BlackListFree(old_blacklist);
+    }
+    InterlockedExchange(&stop, TRUE);
+    WaitForMultipleObjects(NUM_READERS, threads, TRUE, INFINITE);
+    for (i = 0; i < NUM_READERS; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+    CHECK(stale == 0);
+    CHECK(reads >= NUM_SWAPS);
+    CHECK(blacklist_epoch == NUM_SWAPS + 2);
+    CHECK(blacklist_readers[0] == 0 && blacklist_readers[1] == 0);
+
+    // Replace a mapped image file by renaming a new one over it:
+    WriteImage(TRUE, IMAGE_FILE);
+    blacklist = BlackListLoad(1, files);
+    CHECK(blacklist != NULL && blacklist->view != NULL);
+    if (blacklist == NULL)
+    {
+        return TestResult("test_reload");
+    }
+    BlackListFree(BlackListSwap(blacklist));
+    WriteImage(FALSE, NEW_FILE);
+    CHECK(rename(NEW_FILE, IMAGE_FILE) == 0);
+    blacklist = BlackListEnter(&epoch);
+    CHECK(MatchA(blacklist) && !MatchB(blacklist));
+    BlackListExit(epoch);
+    blacklist = BlackListLoad(1, files);
+    CHECK(blacklist != NULL && blacklist->view != NULL);
+    if (blacklist == NULL)
+    {
+        return TestResult("test_reload");
+    }
+    old_blacklist = BlackListSwap(blacklist);
+    CHECK(MatchA(old_blacklist) && !MatchB(old_blacklist));
+    BlackListFree(old_blacklist);
+    blacklist = BlackListEnter(&epoch);
+    CHECK(!MatchA(blacklist) && MatchB(blacklist));
+    BlackListExit(epoch);
+
+    // A failed reload (of a truncated image) leaves the current blacklist
+    // in use:
+    file = fopen(NEW_FILE, "wb");
+    CHECK(file != NULL);
+    if (file != NULL)
+    {
+        fwrite("WDBL", 1, 4, file);
+        fclose(file);
+    }
+    CHECK(rename(NEW_FILE, IMAGE_FILE) == 0);
+    fflush(stderr);
+    err_fd = dup(2);
+    null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 2);
+    close(null_fd);
+    CHECK(BlackListLoad(1, files) == NULL);
+    fflush(stderr);
+    dup2(err_fd, 2);
+    close(err_fd);
+    blacklist = BlackListEnter(&epoch);
+    CHECK(!MatchA(blacklist) && MatchB(blacklist));
+    BlackListExit(epoch);
+    remove(IMAGE_FILE);
+
+    BlackListFree(BlackListSwap(NULL));
+    return TestResult("test_reload");
+}
@@ -0,0 +1,349 @@
+/*
+ * test_stream.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks TCP stream reassembly (WinDivertHelperStreamPush() etc.): in-order,
+ * out-of-order, overlapping and retransmitted segments, the window and
+ * out-of-order range limits, and consuming data, against a simple model
+ * under random segments (including sequence number wrap-around).
+ */
+
+#include "../dll/windivert.c"
+#include "test.h"
+
+#define STREAM_LEN      (1 << 20)
+#define MAX_RANGES      WINDIVERT_STREAM_MAX_RANGES
+
+static UINT8 original[STREAM_LEN];
+static UINT8 model_data[STREAM_LEN];
+static UINT8 model_seen[STREAM_LEN];
+
+/*
+ * Build a TCP segment with the given sequence number and payload.
+ */
+static UINT Segment(UINT8 *packet, BOOL ipv6, UINT32 seq, BOOL syn,
+    const UINT8 *data, UINT len)
+{
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+    PWINDIVERT_TCPHDR tcp_header;
+    UINT packet_len;
+
+    packet_len = TestPacket(packet, ipv6, IPPROTO_TCP, 1000, 80, "");
+    memcpy(packet + packet_len, data, len);
+    if (ipv6)
+    {
+        ipv6_header->Length = htons((UINT16)(ntohs(ipv6_header->Length) +
+            len));
+        tcp_header = (PWINDIVERT_TCPHDR)(packet + sizeof(WINDIVERT_IPV6HDR));
+    }
+    else
+    {
+        ip_header->Length = htons((UINT16)(packet_len + len));
+        tcp_header = (PWINDIVERT_TCPHDR)(packet + sizeof(WINDIVERT_IPHDR));
+    }
+    packet_len += len;
+    tcp_header->SeqNum = htonl(seq);
+    tcp_header->Syn    = (syn? 1: 0);
+    WinDivertHelperCalcChecksums(packet, packet_len, 0);
+    return packet_len;
+}
+
+static BOOL Push(HANDLE stream, UINT32 seq, const char *data)
+{
+    UINT8 packet[256];
+    UINT packet_len;
+
+    packet_len = Segment(packet, FALSE, seq, FALSE, (const UINT8 *)data,
+        (UINT)strlen(data));
+    return WinDivertHelperStreamPush(stream, packet, packet_len);
+}
+
+/*
+ * Check the stream's in-order data.
+ */
+static BOOL HasData(HANDLE stream, UINT32 seq, const char *data)
+{
+    PVOID stream_data;
+    UINT stream_len;
+    UINT32 stream_seq;
+
+    return WinDivertHelperStreamData(stream, &stream_data, &stream_len,
+            &stream_seq) &&
+        stream_seq == seq && stream_len == strlen(data) &&
+        memcmp(stream_data, data, stream_len) == 0;
+}
+
+/*
+ * Random segments (within and around the window, sometimes with data that
+ * differs from what was sent first) and consumes against the model.
+ * Offsets are relative to the first data byte, so the stream holds
+ * [consumed, consumed + window), and model_seen[] marks the bytes the
+ * stream has stored.
+ */
+static void RunModel(UINT window, UINT max_len, UINT32 isn, UINT steps)
+{
+    HANDLE stream;
+    UINT8 packet[2048], data[1024];
+    PVOID stream_data;
+    UINT stream_len, packet_len, len, ranges, op, n, i, k;
+    UINT32 stream_seq;
+    INT64 start, seg_start, end, consumed = 0, ready = 0;
+    BOOL ipv6, result, expected, truncated, touches;
+    DWORD error;
+
+    for (i = 0; i < STREAM_LEN; i++)
+    {
+        original[i] = (UINT8)TestRandom();
+    }
+    memset(model_seen, 0, sizeof(model_seen));
+    stream = WinDivertHelperStreamOpen(window);
+    CHECK(stream != INVALID_HANDLE_VALUE);
+    if (stream == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    // The SYN sets the initial sequence number:
+    packet_len = Segment(packet, FALSE, isn, TRUE, data, 0);
+    CHECK(WinDivertHelperStreamPush(stream, packet, packet_len));
+
+    for (i = 0; i < steps && consumed + window + 2 * max_len < STREAM_LEN;
+            i++)
+    {
+        op = TestRandom() % 16;
+        if ((i / 512) % 4 == 3 && op < 12)
+        {
+            op = 10;            // Sometimes only short segments
+        }
+        switch (op)
+        {
+            case 0: case 1: case 2: case 3: case 4: case 5:
+                start = ready + (INT64)(TestRandom() % 64) - 32;
+                len = TestRandom() % (max_len + 1);
+                break;
+            case 6: case 7: case 8: case 9:
+                start = consumed + (INT64)(TestRandom() % (window + 256)) -
+                    128;
+                len = TestRandom() % (max_len + 1);
+                break;
+            case 10: case 11:
+                // A short segment, leaving holes:
+                start = consumed + (INT64)(TestRandom() % window);
+                len = 1 + TestRandom() % 4;
+                break;
+            case 12: case 13:
+                n = (UINT)(TestRandom() % (ready - consumed + 1));
+                CHECK(WinDivertHelperStreamConsume(stream, n));
+                consumed += n;
+                continue;
+            case 14:
+                CHECK(!WinDivertHelperStreamConsume(stream,
+                    (UINT)(ready - consumed + 1)));
+                continue;
+            default:
+                // Check the stream's data against the model:
+                CHECK(WinDivertHelperStreamData(stream, &stream_data,
+                    &stream_len, &stream_seq));
+                CHECK(stream_len == ready - consumed);
+                CHECK(stream_seq == isn + 1 + (UINT32)consumed);
+                CHECK(memcmp(stream_data, model_data + consumed,
+                    stream_len) == 0);
+                continue;
+        }
+        start = (start < 0? 0: start);
+        seg_start = start;
+        end = start + len;
+        if (TestRandom() % 4 == 0)
+        {
+            for (k = 0; k < len; k++)
+            {
+                data[k] = (UINT8)TestRandom();
+            }
+        }
+        else
+        {
+            memcpy(data, original + start, len);
+        }
+        ipv6 = (TestRandom() % 2 == 0);
+        packet_len = Segment(packet, ipv6, isn + 1 + (UINT32)start, FALSE,
+            data, len);
+        result = WinDivertHelperStreamPush(stream, packet, packet_len);
+        error = GetLastError();
+
+        // The model:
+        truncated = FALSE;
+        if (len == 0 || end <= ready)
+        {
+            CHECK(result);
+            continue;
+        }
+        start = (start < ready? ready: start);
+        if (end > consumed + window)
+        {
+            end = consumed + window;
+            truncated = TRUE;
+            if (start >= end)
+            {
+                CHECK(!result && error == ERROR_INSUFFICIENT_BUFFER);
+                continue;
+            }
+        }
+        if (start > ready)
+        {
+            for (k = (UINT)start - 1, touches = FALSE; k <= end && !touches;
+                    k++)
+            {
+                touches = model_seen[k];
+            }
+            for (k = (UINT)ready + 1, ranges = 0; k < consumed + window; k++)
+            {
+                ranges += (model_seen[k] && !model_seen[k-1]);
+            }
+            if (!touches && ranges >= MAX_RANGES)
+            {
+                CHECK(!result && error == ERROR_INSUFFICIENT_BUFFER);
+                continue;
+            }
+        }
+        for (k = (UINT)start; k < end; k++)
+        {
+            if (!model_seen[k])
+            {
+                model_data[k] = data[k - (UINT)seg_start];
+                model_seen[k] = TRUE;
+            }
+        }
+        while (model_seen[ready])
+        {
+            ready++;
+        }
+        expected = !truncated;
+        CHECK(result == expected);
+        CHECK(expected || error == ERROR_INSUFFICIENT_BUFFER);
+    }
+    CHECK(WinDivertHelperStreamClose(stream));
+}
+
+int main(void)
+{
+    HANDLE stream;
+    UINT8 packet[256];
+    PVOID data;
+    UINT packet_len, len, i;
+    char str[2];
+
+    // Invalid arguments:
+    CHECK(WinDivertHelperStreamOpen(0) == INVALID_HANDLE_VALUE);
+    CHECK(WinDivertHelperStreamOpen(WINDIVERT_STREAM_MAX_WINDOW + 1) ==
+        INVALID_HANDLE_VALUE);
+    packet_len = Segment(packet, FALSE, 0, FALSE, (const UINT8 *)"x", 1);
+    CHECK(!WinDivertHelperStreamPush(NULL, packet, packet_len));
+    CHECK(!WinDivertHelperStreamPush(INVALID_HANDLE_VALUE, packet,
+        packet_len));
+    CHECK(!WinDivertHelperStreamConsume(NULL, 0));
+    CHECK(!WinDivertHelperStreamData(INVALID_HANDLE_VALUE, &data, &len,
+        NULL));
+    CHECK(!WinDivertHelperStreamClose(NULL));
+
+    stream = WinDivertHelperStreamOpen(WINDIVERT_STREAM_DEFAULT_WINDOW);
+    CHECK(stream != INVALID_HANDLE_VALUE);
+    if (stream == INVALID_HANDLE_VALUE)
+    {
+        return TestResult("test_stream");
+    }
+    CHECK(!WinDivertHelperStreamPush(stream, NULL, 0));
+    CHECK(!WinDivertHelperStreamData(stream, NULL, &len, NULL));
+    CHECK(!WinDivertHelperStreamData(stream, &data, NULL, NULL));
+    packet_len = TestPacket(packet, FALSE, IPPROTO_UDP, 1, 2, "udp");
+    CHECK(!WinDivertHelperStreamPush(stream, packet, packet_len) &&
+        GetLastError() == ERROR_INVALID_DATA);
+
+    // Without a SYN, the first segment sets the sequence number:
+    CHECK(Push(stream, 1000, "hello "));
+    CHECK(Push(stream, 1006, "world"));
+    CHECK(HasData(stream, 1000, "hello world"));
+
+    // Retransmits of in-order data are ignored:
+    CHECK(Push(stream, 1000, "HELLO"));
+    CHECK(Push(stream, 1004, "O WORLD!"));
+    CHECK(HasData(stream, 1000, "hello world!"));
+
+    // Out-of-order data waits for the hole; the first copy wins:
+    CHECK(Push(stream, 1016, "mnop"));
+    CHECK(Push(stream, 1020, "qr"));
+    CHECK(HasData(stream, 1000, "hello world!"));
+    CHECK(Push(stream, 1014, "KLMNOPQRST"));
+    CHECK(HasData(stream, 1000, "hello world!"));
+    CHECK(Push(stream, 1012, "ij"));
+    CHECK(HasData(stream, 1000, "hello world!ijKLmnopqrST"));
+
+    // Consume:
+    CHECK(!WinDivertHelperStreamConsume(stream, 25));
+    CHECK(WinDivertHelperStreamConsume(stream, 0));
+    CHECK(WinDivertHelperStreamConsume(stream, 12));
+    CHECK(HasData(stream, 1012, "ijKLmnopqrST"));
+    CHECK(Push(stream, 1030, "67"));
+    CHECK(WinDivertHelperStreamConsume(stream, 12));
+    CHECK(HasData(stream, 1024, ""));
+    CHECK(Push(stream, 1024, "012345"));
+    CHECK(HasData(stream, 1024, "01234567"));
+    CHECK(WinDivertHelperStreamClose(stream));
+
+    // The window:
+    stream = WinDivertHelperStreamOpen(16);
+    CHECK(stream != INVALID_HANDLE_VALUE);
+    CHECK(!Push(stream, 0, "0123456789abcdefghij") &&
+        GetLastError() == ERROR_INSUFFICIENT_BUFFER);
+    CHECK(HasData(stream, 0, "0123456789abcdef"));
+    CHECK(!Push(stream, 16, "ghij") &&
+        GetLastError() == ERROR_INSUFFICIENT_BUFFER);
+    CHECK(WinDivertHelperStreamConsume(stream, 8));
+    CHECK(Push(stream, 16, "ghij"));
+    CHECK(HasData(stream, 8, "89abcdefghij"));
+    CHECK(WinDivertHelperStreamClose(stream));
+
+    // The out-of-order range limit:
+    stream = WinDivertHelperStreamOpen(4096);
+    CHECK(stream != INVALID_HANDLE_VALUE);
+    CHECK(Push(stream, 0, ""));
+    str[1] = '\0';
+    for (i = 0; i < MAX_RANGES; i++)
+    {
+        str[0] = (char)('A' + i);
+        CHECK(Push(stream, 2 * i + 1, str));
+    }
+    CHECK(!Push(stream, 2 * MAX_RANGES + 2, "x") &&
+        GetLastError() == ERROR_INSUFFICIENT_BUFFER);
+    CHECK(Push(stream, 2 * MAX_RANGES, "yz"));
+    for (i = 0; i < MAX_RANGES; i++)
+    {
+        str[0] = (char)('a' + i);
+        CHECK(Push(stream, 2 * i, str));
+    }
+    CHECK(HasData(stream, 0, "aAbBcCdDeEfFgGhHiIjJkKlLmMnNoOpPyz"));
+    CHECK(WinDivertHelperStreamClose(stream));
+
+    // Random segments, with small and large windows, and sequence number
+    // wrap-around:
+    RunModel(64, 32, 0, 20000);
+    RunModel(1024, 600, 0xFFFFF000, 50000);
+    RunModel(8192, 1000, TestRandom(), 20000);
+
+    return TestResult("test_stream");
+}
@@ -0,0 +1,337 @@
+/*
+ * test_worker.c
+ * (C) 2013, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the webfilter worker's handling of a packet (WorkerPacket()), with
+ * the packets it sends captured from the device: an allowed request and any
+ * other packet are reinjected unchanged; a blocked request is dropped and
+ * the connection is reset at the server and answered with the block page
+ * and a FIN, with the right addresses, ports, sequence numbers and
+ * checksums.  A request split over several packets is matched once it is
+ * complete, a new request on a connection replaces the partial one, and
+ * when a worker tracks too many partial requests the least recently used
+ * one is dropped.  Each matched URL is logged with its verdict.
+ */
+
+#include <winsock2.h>
+#include <winioctl.h>
+#include "windivert.h"
+#include "windivert_device.h"
+#include "../examples/webfilter/blacklist.c"
+#include "../examples/webfilter/worker.c"
+#include "test.h"
+
+#define MAXSENT         8
+#define CLIENT_SEQ      0x10000000
+#define SERVER_SEQ      0xF0000000      // (The block page wraps around.)
+
+typedef struct
+{
+    UINT8 packet[1500];
+    UINT len;
+    WINDIVERT_ADDRESS addr;
+} SENT, *PSENT;
+
+/*
+ * (Not exported by the DLL's header; frees this thread's I/O event, as the
+ * DLL's thread detach would.)
+ */
+extern BOOL APIENTRY WinDivertDllEntry(HANDLE module, DWORD reason,
+    LPVOID reserved);
+
+static SENT sent[MAXSENT];
+static UINT num_sent = 0;
+static UINT bad_ioctls = 0;
+
+/*
+ * The device: capture each packet sent.
+ */
+static BOOL DeviceIoControlHook(HANDLE handle, DWORD code, LPVOID in,
+    DWORD in_len, LPVOID out, DWORD out_len, DWORD *ret_len,
+    LPOVERLAPPED overlapped)
+{
+    windivert_ioctl_t ioctl = (windivert_ioctl_t)in;
+    PSENT send;
+
+    if (code != IOCTL_WINDIVERT_SEND || in_len != sizeof(*ioctl) ||
+        num_sent >= MAXSENT || out_len > sizeof(send->packet))
+    {
+        bad_ioctls++;
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    send = &sent[num_sent++];
+    memcpy(send->packet, out, out_len);
+    send->len  = out_len;
+    send->addr = *(PWINDIVERT_ADDRESS)(UINT_PTR)ioctl->arg;
+    *ret_len = out_len;
+    return TRUE;
+}
+
+/*
+ * Handle a packet of an HTTP connection from port; returns the packet's
+ * length (in read->packet).
+ */
+static UINT Packet(PWORKER worker, UINT16 port, UINT32 seq,
+    const char *payload)
+{
+    PREAD read = &worker->reads[0];
+    PWINDIVERT_TCPHDR tcp_header;
+    UINT packet_len;
+
+    packet_len = TestPacket(read->packet, FALSE, IPPROTO_TCP, port, 80,
+        payload);
+    tcp_header = (PWINDIVERT_TCPHDR)(read->packet + sizeof(WINDIVERT_IPHDR));
+    tcp_header->SeqNum = htonl(seq);
+    tcp_header->AckNum = htonl(SERVER_SEQ);
+    tcp_header->Ack    = 1;
+    tcp_header->Psh    = 1;
+    WinDivertHelperCalcChecksums(read->packet, packet_len, 0);
+    memset(&read->addr, 0, sizeof(read->addr));
+    read->addr.IfIdx     = 7;
+    read->addr.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+    num_sent = 0;
+    WorkerPacket(worker, read, packet_len);
+    return packet_len;
+}
+
+/*
+ * Was the packet reinjected unchanged (and nothing else sent)?
+ */
+static BOOL Reinjected(PWORKER worker, UINT packet_len)
+{
+    PREAD read = &worker->reads[0];
+
+    return (num_sent == 1 && sent[0].len == packet_len &&
+        memcmp(sent[0].packet, read->packet, packet_len) == 0 &&
+        sent[0].addr.IfIdx == 7 &&
+        sent[0].addr.Direction == WINDIVERT_DIRECTION_OUTBOUND);
+}
+
+/*
+ * Are a packet's checksums valid?
+ */
+static BOOL ChecksumsValid(PSENT send)
+{
+    UINT8 packet[sizeof(send->packet)];
+
+    memcpy(packet, send->packet, send->len);
+    WinDivertHelperCalcChecksums(packet, send->len, 0);
+    return (memcmp(packet, send->packet, send->len) == 0);
+}
+
+/*
+ * Check a packet sent to block a connection from port.
+ */
+static BOOL BlockPacket(PSENT send, BOOL to_client, UINT16 port,
+    UINT32 seq, UINT32 ack, const char *flags, const char *data)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    PVOID payload;
+    UINT payload_len;
+    UINT32 client = htonl(0x0A000001u), server = htonl(0x0A000002u);
+    UINT data_len = (UINT)strlen(data);
+
+    // (Parsing "fails" for a packet without payload.)
+    WinDivertHelperParsePacket(send->packet, send->len, &ip_header, NULL,
+        NULL, NULL, &tcp_header, NULL, &payload, &payload_len);
+    if (ip_header == NULL || tcp_header == NULL)
+    {
+        return FALSE;
+    }
+    return (ntohs(ip_header->Length) == send->len &&
+        ip_header->SrcAddr == (to_client? server: client) &&
+        ip_header->DstAddr == (to_client? client: server) &&
+        ntohs(tcp_header->SrcPort) == (to_client? 80: port) &&
+        ntohs(tcp_header->DstPort) == (to_client? port: 80) &&
+        ntohl(tcp_header->SeqNum) == seq &&
+        ntohl(tcp_header->AckNum) == ack &&
+        tcp_header->Rst == (strchr(flags, 'R') != NULL) &&
+        tcp_header->Fin == (strchr(flags, 'F') != NULL) &&
+        tcp_header->Ack == (strchr(flags, 'A') != NULL) &&
+        tcp_header->Syn == 0 &&
+        payload_len == data_len &&
+        (data_len == 0 || memcmp(payload, data, data_len) == 0) &&
+        ChecksumsValid(send) &&
+        send->addr.IfIdx == 7 &&
+        send->addr.Direction == (to_client? WINDIVERT_DIRECTION_INBOUND:
+            WINDIVERT_DIRECTION_OUTBOUND));
+}
+
+/*
+ * Was the connection from port blocked after a request ending at seq + len
+ * (and the packet itself dropped)?
+ */
+static BOOL Blocked(UINT16 port, UINT32 seq, UINT len)
+{
+    UINT32 block_len = sizeof(block_data) - 1;
+
+    return (num_sent == 3 &&
+        BlockPacket(&sent[0], FALSE, port, seq, SERVER_SEQ, "RA", "") &&
+        BlockPacket(&sent[1], TRUE, port, SERVER_SEQ, seq + len, "A",
+            block_data) &&
+        BlockPacket(&sent[2], TRUE, port, SERVER_SEQ + block_len, seq + len,
+            "FA", ""));
+}
+
+/*
+ * Is line the URL log's contents (and clear it)?
+ */
+static BOOL Logged(const char *line)
+{
+    BOOL result = (url_log.len == strlen(line) &&
+        memcmp(url_log.buf, line, url_log.len) == 0);
+
+    url_log.len = 0;
+    return result;
+}
+
+int main(void)
+{
+    static WORKER worker;
+    PBLACKLIST blacklist;
+    const char *part1, *part2, *part3, *host;
+    UINT16 port;
+    UINT32 seq;
+    UINT len, len1, len2, i;
+
+    shim_device_io_control = DeviceIoControlHook;
+    InitializeCriticalSection(&url_log.lock);
+    blacklist = BlackListInit();
+    BlackListInsert(blacklist, "com.example/ads", 15);
+    BlackListCompile(blacklist);
+    BlackListSwap(blacklist);
+    WorkerInit(&worker, (HANDLE)&worker, 0, 1);
+    CHECK(worker.blockpage_len ==
+        sizeof(PACKET) + sizeof(block_data) - 1);
+
+    // Allowed request:
+    len = Packet(&worker, 1000, CLIENT_SEQ,
+        "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n\r\n");
+    CHECK(Reinjected(&worker, len));
+    CHECK(Logged("GURL www.example.com/index.html: allowed\n"));
+
+    // Blocked request:
+    len = Packet(&worker, 1001, CLIENT_SEQ,
+        "GET /ads/banner.gif HTTP/1.1\r\nHost: www.example.com\r\n\r\n");
+    CHECK(Blocked(1001, CLIENT_SEQ, len - sizeof(PACKET)));
+    CHECK(Logged("RURL www.example.com/ads/banner.gif: BLOCKED!\n"));
+    len = Packet(&worker, 1002, CLIENT_SEQ,
+        "POST /ads/click HTTP/1.1\r\nHost: example.com\r\n\r\n");
+    CHECK(Blocked(1002, CLIENT_SEQ, len - sizeof(PACKET)));
+    CHECK(Logged("RURL example.com/ads/click: BLOCKED!\n"));
+
+    // Other packets are reinjected (and not logged):
+    len = Packet(&worker, 1003, CLIENT_SEQ, "hello");
+    CHECK(Reinjected(&worker, len));
+    len = Packet(&worker, 1003, CLIENT_SEQ + 5,
+        "Host: www.example.com\r\n\r\n");
+    CHECK(Reinjected(&worker, len));
+    CHECK(Logged(""));
+
+    // A request split over three packets, with another connection's
+    // request in between; only the last packet is blocked:
+    part1 = "GET /ads/banner.gif HT";
+    part2 = "TP/1.1\r\nHo";
+    part3 = "st: www.example.com\r\n\r\n";
+    seq = CLIENT_SEQ;
+    len = Packet(&worker, 1004, seq, part1);
+    CHECK(Reinjected(&worker, len));
+    seq += (UINT32)strlen(part1);
+    len = Packet(&worker, 1005, CLIENT_SEQ,
+        "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n\r\n");
+    CHECK(Reinjected(&worker, len));
+    CHECK(Logged("GURL www.example.com/index.html: allowed\n"));
+    len = Packet(&worker, 1004, seq, part2);
+    CHECK(Reinjected(&worker, len));
+    seq += (UINT32)strlen(part2);
+    len = Packet(&worker, 1004, seq, part3);
+    CHECK(Blocked(1004, seq, (UINT)strlen(part3)));
+    CHECK(Logged("RURL www.example.com/ads/banner.gif: BLOCKED!\n"));
+
+    // ... and the (now forgotten) request is not matched again:
+    seq += (UINT32)strlen(part3);
+    len = Packet(&worker, 1004, seq, "Host: www.example.com\r\n\r\n");
+    CHECK(Reinjected(&worker, len));
+    CHECK(Logged(""));
+
+    // A new request on a connection replaces its partial request:
+    len1 = (UINT)strlen(part1);
+    len = Packet(&worker, 1006, CLIENT_SEQ, part1);
+    CHECK(Reinjected(&worker, len));
+    len = Packet(&worker, 1006, CLIENT_SEQ + len1,
+        "GET /index.html HTTP/1.1\r\nHo");
+    CHECK(Reinjected(&worker, len));
+    len2 = (UINT)strlen("GET /index.html HTTP/1.1\r\nHo");
+    len = Packet(&worker, 1006, CLIENT_SEQ + len1 + len2, part3);
+    CHECK(Reinjected(&worker, len));
+    CHECK(Logged("GURL www.example.com/index.html: allowed\n"));
+
+    // Too many partial requests: the least recently used one is dropped.
+    // The oldest (port 2000) is used again, so port 2001's is dropped:
+    host = "Host: example.com\r\n\r\n";
+    for (i = 0; i < MAXREQUESTS; i++)
+    {
+        port = (UINT16)(2000 + i);
+        len = Packet(&worker, port, CLIENT_SEQ, "GET /ads/ HTTP/1.1\r\n");
+        CHECK(Reinjected(&worker, len));
+        shim_tick_offset += 10;
+    }
+    len1 = (UINT)strlen("GET /ads/ HTTP/1.1\r\n");
+    len = Packet(&worker, 2000, CLIENT_SEQ + len1, "Host: exam");
+    CHECK(Reinjected(&worker, len));
+    shim_tick_offset += 10;
+    len = Packet(&worker, 3000, CLIENT_SEQ, "GET /ads/ HTTP/1.1\r\n");
+    CHECK(Reinjected(&worker, len));
+    len = Packet(&worker, 2001, CLIENT_SEQ + len1, host);
+    CHECK(Reinjected(&worker, len));
+    CHECK(Logged(""));
+    len2 = (UINT)strlen("Host: exam");
+    len = Packet(&worker, 2000, CLIENT_SEQ + len1 + len2, "ple.com\r\n\r\n");
+    CHECK(Blocked(2000, CLIENT_SEQ + len1 + len2,
+        (UINT)strlen("ple.com\r\n\r\n")));
+    CHECK(Logged("RURL example.com/ads/: BLOCKED!\n"));
+    for (i = 2; i <= MAXREQUESTS; i++)
+    {
+        port = (UINT16)(i < MAXREQUESTS? 2000 + i: 3000);
+        len = Packet(&worker, port, CLIENT_SEQ + len1, host);
+        CHECK(Blocked(port, CLIENT_SEQ + len1, (UINT)strlen(host)));
+    }
+
+    // A full log drops lines (and counts them):
+    url_log.len = sizeof(url_log.buf) - 8;
+    len = Packet(&worker, 1007, CLIENT_SEQ,
+        "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n\r\n");
+    CHECK(Reinjected(&worker, len));
+    CHECK(url_log.len == sizeof(url_log.buf) - 8 && url_log.dropped == 1);
+    url_log.len = 0;
+    url_log.dropped = 0;
+
+    CHECK(bad_ioctls == 0);
+    for (i = 0; i < MAXREQUESTS; i++)
+    {
+        if (worker.requests[i].stream != NULL)
+        {
+            WorkerRequestEnd(&worker.requests[i]);
+        }
+    }
+    BlackListFree(BlackListSwap(NULL));
+    WinDivertDllEntry(NULL, DLL_THREAD_DETACH, NULL);
+    return TestResult("test_worker");
+}